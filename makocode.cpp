@@ -49,11 +49,19 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#include <immintrin.h>
+#define MAKOCODE_X86_KERNELS 1
+#endif
+
 #ifndef SIZE_MAX
 #define SIZE_MAX ((size_t)~(size_t)0)
 #endif
@@ -90,6 +98,10 @@ extern "C" int   close(int fd);
 extern "C" int   creat(const char* path, unsigned int mode);
 extern "C" int   unlink(const char* path);
 extern "C" int   open(const char* path, int flags, ...);
+extern "C" long  lseek(int fd, long offset, int whence);
+extern "C" int   ftruncate(int fd, long length);
+extern "C" long  pread(int fd, void* buf, unsigned long count, long offset);
+extern "C" int   mkstemp(char* path_template);
 extern "C" void* realloc(void* ptr, unsigned long size);
 extern "C" double sqrt(double value);
 extern "C" double floor(double value);
@@ -537,6 +549,245 @@ static bool utc_timestamp_string(char* buffer, usize capacity) {
     return true;
 }
 
+// Wall-clock seconds from an arbitrary fixed origin; only differences are
+// meaningful.
+static double monotonic_seconds() {
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+        return 0.0;
+    }
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+// --stats instrumentation. Stage times and counters accumulate in g_stats while
+// encode/decode run, and main() writes them as one JSON object once the
+// command returns. Everything is a no-op until --stats is given, and worker
+// threads update the totals atomically, so a stage's time is summed across
+// threads.
+enum StatsStage {
+    StatsStage_Read,
+    StatsStage_Archive,
+    StatsStage_Compress,
+    StatsStage_Encrypt,
+    StatsStage_EccEncode,
+    StatsStage_Shuffle,
+    StatsStage_Render,
+    StatsStage_PageParse,
+    StatsStage_Metadata,
+    StatsStage_Geometry,
+    StatsStage_Fiducials,
+    StatsStage_BitExtract,
+    StatsStage_Assemble,
+    StatsStage_Unshuffle,
+    StatsStage_EccDecode,
+    StatsStage_Decrypt,
+    StatsStage_Decompress,
+    StatsStage_Unpack,
+    StatsStage_Write,
+    StatsStage_Count
+};
+
+static const char* const STATS_STAGE_NAMES[StatsStage_Count] = {
+    "read",
+    "archive",
+    "compress",
+    "encrypt",
+    "ecc_encode",
+    "shuffle",
+    "render",
+    "page_parse",
+    "metadata",
+    "geometry",
+    "fiducials",
+    "bit_extract",
+    "assemble",
+    "unshuffle",
+    "ecc_decode",
+    "decrypt",
+    "decompress",
+    "unpack",
+    "write"
+};
+
+enum StatsCounter {
+    StatsCounter_Pages,
+    StatsCounter_BytesRead,
+    StatsCounter_BytesWritten,
+    StatsCounter_FilesWritten,
+    StatsCounter_TileAffineAttempts,
+    StatsCounter_TileDownsampleAttempts,
+    StatsCounter_RotationCandidates,
+    StatsCounter_SubgridRetries,
+    StatsCounter_EccBlocks,
+    StatsCounter_EccBlocksWithErrors,
+    StatsCounter_EccCorrectedSymbols,
+    StatsCounter_EccErasureSymbols,
+    StatsCounter_EccParitySymbols,
+    StatsCounter_EccHeaderRepairs,
+    StatsCounter_Count
+};
+
+static const char* const STATS_COUNTER_NAMES[StatsCounter_Count] = {
+    "pages",
+    "bytes_read",
+    "bytes_written",
+    "files_written",
+    "tile_affine_attempts",
+    "tile_downsample_attempts",
+    "rotation_candidates",
+    "subgrid_retries",
+    "ecc_blocks",
+    "ecc_blocks_with_errors",
+    "ecc_corrected_symbols",
+    "ecc_erasure_symbols",
+    "ecc_parity_symbols",
+    "ecc_header_repairs"
+};
+
+// Per-input-page extraction record for decode; a page's slot is only written
+// by the worker that owns it.
+struct StatsPageRecord {
+    const char* path;
+    u64 nanoseconds;
+    u64 bit_count;
+    u32 attempts;
+    bool extracted;
+};
+
+struct StatsRegistry {
+    bool enabled;
+    const char* output_path;  // 0 writes the summary to stderr
+    double started;
+    u64 stage_nanoseconds[StatsStage_Count];
+    u64 stage_calls[StatsStage_Count];
+    u64 counters[StatsCounter_Count];
+    StatsPageRecord* pages;
+    usize page_count;
+};
+
+static StatsRegistry g_stats;
+
+static bool stats_enabled() {
+    return g_stats.enabled;
+}
+
+// Accepts `--stats` (summary on stderr) and `--stats=PATH`.
+static bool consume_stats_flag(const char* arg) {
+    if (!arg) {
+        return false;
+    }
+    usize length = ascii_length(arg);
+    const char prefix[] = "--stats=";
+    if (ascii_equals_token(arg, length, "--stats")) {
+        g_stats.output_path = 0;
+    } else if (length > sizeof(prefix) - 1u && ascii_starts_with(arg, prefix)) {
+        g_stats.output_path = arg + (sizeof(prefix) - 1u);
+    } else {
+        return false;
+    }
+    if (!g_stats.enabled) {
+        g_stats.enabled = true;
+        g_stats.started = monotonic_seconds();
+    }
+    return true;
+}
+
+static void stats_add_seconds(StatsStage stage, double seconds) {
+    if (seconds < 0.0) {
+        seconds = 0.0;
+    }
+    __atomic_fetch_add(&g_stats.stage_nanoseconds[stage], (u64)(seconds * 1e9), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_stats.stage_calls[stage], (u64)1u, __ATOMIC_RELAXED);
+}
+
+static void stats_count(StatsCounter counter, u64 amount) {
+    if (g_stats.enabled) {
+        __atomic_fetch_add(&g_stats.counters[counter], amount, __ATOMIC_RELAXED);
+    }
+}
+
+// Gives each decode input a per-page record in the summary. The paths are
+// copied in behind the records, because page names such as Y4M frame labels
+// do not outlive the command that made them.
+static void stats_track_pages(const char* const* paths, usize count) {
+    if (!g_stats.enabled || g_stats.pages || count == 0u) {
+        return;
+    }
+    usize name_bytes = 0u;
+    for (usize i = 0u; i < count; ++i) {
+        name_bytes += ascii_length(paths[i]) + 1u;
+    }
+    usize record_bytes = count * sizeof(StatsPageRecord);
+    StatsPageRecord* pages = (StatsPageRecord*)malloc(record_bytes + name_bytes);
+    if (!pages) {
+        return;
+    }
+    memset((void*)pages, 0, record_bytes);
+    char* names = (char*)pages + record_bytes;
+    for (usize i = 0u; i < count; ++i) {
+        usize length = ascii_length(paths[i]);
+        memcpy(names, paths[i], length);
+        names[length] = '\0';
+        pages[i].path = names;
+        names += length + 1u;
+    }
+    g_stats.pages = pages;
+    g_stats.page_count = count;
+}
+
+static void stats_record_page(usize index, double seconds, u64 bit_count, bool extracted) {
+    if (!g_stats.pages || index >= g_stats.page_count) {
+        return;
+    }
+    StatsPageRecord& page = g_stats.pages[index];
+    page.nanoseconds += (u64)((seconds > 0.0 ? seconds : 0.0) * 1e9);
+    page.bit_count = bit_count;
+    page.attempts += 1u;
+    page.extracted = extracted;
+    if (page.attempts == 1u) {
+        stats_count(StatsCounter_Pages, 1u);
+    }
+}
+
+// Charges the time from construction (or the last enter()) to the current
+// stage. enter() switches stages without a gap, which lets one timer walk the
+// phases of a long function and still close correctly on any early return.
+struct StatsTimer {
+    StatsStage stage;
+    double started;
+    bool active;
+
+    explicit StatsTimer(StatsStage initial)
+        : stage(initial),
+          started(0.0),
+          active(g_stats.enabled) {
+        if (active) {
+            started = monotonic_seconds();
+        }
+    }
+
+    ~StatsTimer() {
+        stop();
+    }
+
+    void enter(StatsStage next) {
+        if (!active) {
+            return;
+        }
+        double now = monotonic_seconds();
+        stats_add_seconds(stage, now - started);
+        stage = next;
+        started = now;
+    }
+
+    void stop() {
+        if (active) {
+            stats_add_seconds(stage, monotonic_seconds() - started);
+            active = false;
+        }
+    }
+};
+
 // Footer stripes were removed from the format; keep a single switch to hard-disable
 // any legacy probing while the code remains compiled for now.
 static constexpr bool kFooterStripeEnabled = false;
@@ -1186,6 +1437,12 @@ struct ByteBuffer {
         capacity = 0;
     }
 
+    // Drops the contents but keeps the allocation, so scratch buffers reused
+    // across pages stop reallocating.
+    void clear() {
+        size = 0;
+    }
+
     bool reserve(usize new_capacity) {
         if (new_capacity <= capacity) {
             return true;
@@ -1193,14 +1450,10 @@ struct ByteBuffer {
         if (new_capacity > (USIZE_MAX_VALUE / 2u)) {
             return false;
         }
-        u8* new_data = (u8*)malloc(new_capacity);
+        u8* new_data = (u8*)realloc(data, new_capacity);
         if (!new_data) {
             return false;
         }
-        for (usize i = 0; i < size; ++i) {
-            new_data[i] = data[i];
-        }
-        free(data);
         data = new_data;
         capacity = new_capacity;
         return true;
@@ -1223,7 +1476,7 @@ struct ByteBuffer {
     }
 
     bool push(u8 value) {
-        if (!ensure(size + 1u)) {
+        if (size >= capacity && !ensure(size + 1u)) {
             return false;
         }
         data[size++] = value;
@@ -1234,12 +1487,10 @@ struct ByteBuffer {
         if (!source || length == 0u) {
             return true;
         }
-        if (!ensure(size + length)) {
+        if (length > capacity - size && !ensure(size + length)) {
             return false;
         }
-        for (usize i = 0; i < length; ++i) {
-            data[size + i] = source[i];
-        }
+        memcpy(data + size, source, length);
         size += length;
         return true;
     }
@@ -1252,7 +1503,7 @@ struct ByteBuffer {
     }
 
     bool append_char(char c) {
-        return append_bytes((const u8*)&c, 1u);
+        return push((u8)c);
     }
 };
 
@@ -6523,68 +6774,226 @@ MY_STDAPI LzmaUncompress(unsigned char *dest, size_t  *destLen, const unsigned c
 
 /* ===== End Embedded LZMA SDK ===== */
 
-struct FloodQueue {
-    usize* data;
-    usize capacity;
-    usize head;
-    usize tail;
+// Run-length connected-component labelling over a class plane (one byte per pixel, e.g. a
+// thresholded bitmap or palette indices). Pixels belong to the same component when they
+// are 4-connected and share a class value. Each row is split into runs and swept against
+// the previous row's runs, with union-find merging overlaps, so scratch memory scales with
+// the run count rather than the pixel count and the image is read once in scan order.
+struct ComponentRun {
+    unsigned x0;
+    unsigned x1; // exclusive
+    unsigned char value;
+    usize component;
+};
 
-    FloodQueue() : data(0), capacity(0), head(0), tail(0) {}
+struct ComponentStats {
+    u64 area;
+    unsigned min_x;
+    unsigned min_y;
+    unsigned max_x;
+    unsigned max_y;
+    unsigned char value;
+};
 
-    bool initialize(usize max_elements) {
-        if (max_elements < 2u) {
-            max_elements = 2u;
-        }
-        data = (usize*)malloc(max_elements * sizeof(usize));
-        if (!data) {
-            capacity = 0;
-            head = tail = 0;
-            return false;
-        }
-        capacity = max_elements;
-        head = tail = 0;
-        return true;
+struct ComponentLabels {
+    unsigned width;
+    unsigned height;
+    ComponentRun* runs;
+    usize run_count;
+    usize run_capacity;
+    usize* row_offsets; // height + 1 entries; runs of row y are [row_offsets[y], row_offsets[y + 1])
+    ComponentStats* components;
+    usize component_count;
+
+    ComponentLabels()
+        : width(0u),
+          height(0u),
+          runs(0),
+          run_count(0u),
+          run_capacity(0u),
+          row_offsets(0),
+          components(0),
+          component_count(0u) {}
+
+    ~ComponentLabels() {
+        release();
     }
 
     void release() {
-        if (data) {
-            free(data);
-            data = 0;
+        free(runs);
+        free(row_offsets);
+        free(components);
+        runs = 0;
+        row_offsets = 0;
+        components = 0;
+        run_count = 0u;
+        run_capacity = 0u;
+        component_count = 0u;
+        width = 0u;
+        height = 0u;
+    }
+
+    bool push_run(unsigned x0, unsigned x1, unsigned char value) {
+        if (run_count == run_capacity) {
+            usize next_capacity = run_capacity ? (run_capacity * 2u) : 1024u;
+            ComponentRun* grown = (ComponentRun*)realloc(runs, next_capacity * sizeof(ComponentRun));
+            if (!grown) {
+                return false;
+            }
+            runs = grown;
+            run_capacity = next_capacity;
         }
-        capacity = 0;
-        head = tail = 0;
+        ComponentRun& run = runs[run_count];
+        run.x0 = x0;
+        run.x1 = x1;
+        run.value = value;
+        run.component = run_count;
+        ++run_count;
+        return true;
     }
+};
 
-    void reset() {
-        head = tail = 0;
+static usize component_find_root(ComponentRun* runs, usize index) {
+    while (runs[index].component != index) {
+        runs[index].component = runs[runs[index].component].component;
+        index = runs[index].component;
     }
+    return index;
+}
 
-    bool push(usize value) {
-        usize next = head + 1u;
-        if (next >= capacity) {
-            next = 0u;
+static bool label_components(const u8* classes,
+                             unsigned width,
+                             unsigned height,
+                             ComponentLabels& labels) {
+    labels.release();
+    if (!classes || width == 0u || height == 0u) {
+        return false;
+    }
+    labels.row_offsets = (usize*)malloc(((usize)height + 1u) * sizeof(usize));
+    if (!labels.row_offsets) {
+        return false;
+    }
+    labels.width = width;
+    labels.height = height;
+    for (unsigned y = 0u; y < height; ++y) {
+        const u8* row = classes + (usize)y * (usize)width;
+        usize row_begin = labels.run_count;
+        labels.row_offsets[y] = row_begin;
+        unsigned x = 0u;
+        while (x < width) {
+            unsigned char value = row[x];
+            unsigned end = x + 1u;
+            while (end < width && row[end] == value) {
+                ++end;
+            }
+            if (!labels.push_run(x, end, value)) {
+                labels.release();
+                return false;
+            }
+            x = end;
         }
-        if (next == tail) {
-            return false;
+        if (y == 0u) {
+            continue;
+        }
+        // Both rows are sorted by x; advance whichever run ends first.
+        usize prev = labels.row_offsets[y - 1u];
+        usize prev_end = row_begin;
+        usize cur = row_begin;
+        usize cur_end = labels.run_count;
+        ComponentRun* runs = labels.runs;
+        while (prev < prev_end && cur < cur_end) {
+            if (runs[prev].value == runs[cur].value) {
+                usize a = component_find_root(runs, prev);
+                usize b = component_find_root(runs, cur);
+                if (a < b) {
+                    runs[b].component = a;
+                } else if (b < a) {
+                    runs[a].component = b;
+                }
+            }
+            if (runs[prev].x1 < runs[cur].x1) {
+                ++prev;
+            } else if (runs[cur].x1 < runs[prev].x1) {
+                ++cur;
+            } else {
+                ++prev;
+                ++cur;
+            }
         }
-        data[head] = value;
-        head = next;
-        return true;
     }
+    labels.row_offsets[height] = labels.run_count;
 
-    bool pop(usize& value) {
-        if (head == tail) {
-            return false;
+    // Roots always precede their members, so one forward pass resolves every run and a
+    // second renumbers the roots densely in scan order.
+    ComponentRun* runs = labels.runs;
+    for (usize i = 0u; i < labels.run_count; ++i) {
+        runs[i].component = component_find_root(runs, i);
+    }
+    usize component_count = 0u;
+    for (usize i = 0u; i < labels.run_count; ++i) {
+        if (runs[i].component == i) {
+            runs[i].component = component_count++;
+        } else {
+            runs[i].component = runs[runs[i].component].component;
         }
-        value = data[tail];
-        tail++;
-        if (tail >= capacity) {
-            tail = 0u;
+    }
+    labels.components = (ComponentStats*)malloc(component_count * sizeof(ComponentStats));
+    if (!labels.components) {
+        labels.release();
+        return false;
+    }
+    labels.component_count = component_count;
+    for (usize i = 0u; i < component_count; ++i) {
+        labels.components[i].area = 0u;
+    }
+    for (unsigned y = 0u; y < height; ++y) {
+        for (usize r = labels.row_offsets[y]; r < labels.row_offsets[y + 1u]; ++r) {
+            const ComponentRun& run = runs[r];
+            ComponentStats& stats = labels.components[run.component];
+            if (stats.area == 0u) {
+                stats.min_x = run.x0;
+                stats.max_x = run.x1 - 1u;
+                stats.min_y = y;
+                stats.value = run.value;
+            }
+            if (run.x0 < stats.min_x) {
+                stats.min_x = run.x0;
+            }
+            if (run.x1 - 1u > stats.max_x) {
+                stats.max_x = run.x1 - 1u;
+            }
+            stats.max_y = y;
+            stats.area += (u64)(run.x1 - run.x0);
         }
-        return true;
     }
-};
+    return true;
+}
+
+// Returns the component covering (x, y), or USIZE_MAX_VALUE when out of range.
+static usize component_at(const ComponentLabels& labels, unsigned x, unsigned y) {
+    if (!labels.runs || x >= labels.width || y >= labels.height) {
+        return USIZE_MAX_VALUE;
+    }
+    usize lo = labels.row_offsets[y];
+    usize hi = labels.row_offsets[y + 1u];
+    while (lo < hi) {
+        usize mid = lo + ((hi - lo) >> 1u);
+        const ComponentRun& run = labels.runs[mid];
+        if (x < run.x0) {
+            hi = mid;
+        } else if (x >= run.x1) {
+            lo = mid + 1u;
+        } else {
+            return run.component;
+        }
+    }
+    return USIZE_MAX_VALUE;
+}
 
+// Whitens dark specks in the margin. Light regions reachable from the border or edge
+// midpoints are background; of what remains, only the component holding the page
+// center is kept. `out_mask` receives 0xFF for every whitened pixel. No decode path
+// calls it yet; scripts/test_component_labels.sh covers it on fixed pages.
 bool remove_border_dirt(image::ImageBuffer& image,
                         unsigned char fill_threshold,
                         ByteBuffer* out_mask,
@@ -6614,121 +7023,93 @@ bool remove_border_dirt(image::ImageBuffer& image,
         }
     }
 
-    ByteBuffer mask;
-    if (!mask.ensure(total_pixels)) {
+    unsigned char* pixels = image.pixels;
+    ByteBuffer classes;
+    if (!classes.ensure(total_pixels)) {
         return false;
     }
-    mask.size = total_pixels;
+    classes.size = total_pixels;
     for (usize i = 0; i < total_pixels; ++i) {
-        mask.data[i] = 0xFFu;
+        classes.data[i] = (pixels[i] >= fill_threshold) ? 1u : 0u;
     }
-
-    usize queue_capacity = total_pixels + 1u;
-    if (queue_capacity <= total_pixels) {
-        mask.release();
-        if (out_mask) {
-            out_mask->release();
-        }
+    ComponentLabels labels;
+    if (!label_components(classes.data, width, height, labels)) {
         return false;
     }
-    FloodQueue queue;
-    if (!queue.initialize(queue_capacity)) {
-        mask.release();
+
+    ByteBuffer background;
+    if (!background.ensure(labels.component_count)) {
         return false;
     }
-
-    bool queue_ok = true;
-    unsigned char* pixels = image.pixels;
-
-    auto try_copy = [&](unsigned x, unsigned y, bool require_white) {
-        if (!queue_ok) {
-            return;
-        }
-        if (x >= width || y >= height) {
-            return;
-        }
-        usize index = (usize)y * (usize)width + (usize)x;
-        if (mask.data[index] == 0u) {
-            return;
-        }
-        if (require_white && pixels[index] < fill_threshold) {
-            return;
-        }
-        mask.data[index] = 0u;
-        if (!queue.push(index)) {
-            queue_ok = false;
-        }
+    for (usize i = 0; i < labels.component_count; ++i) {
+        background.data[i] = 0u;
+    }
+    const unsigned seeds[8][2] = {
+        {0u, 0u},
+        {width >> 1u, 0u},
+        {width - 1u, 0u},
+        {0u, height >> 1u},
+        {0u, height - 1u},
+        {width - 1u, height - 1u},
+        {width - 1u, height >> 1u},
+        {width >> 1u, height - 1u},
     };
-
-    auto flood = [&](unsigned start_x, unsigned start_y, bool require_white) {
-        if (!queue_ok) {
-            return;
+    for (unsigned s = 0u; s < 8u; ++s) {
+        usize component = component_at(labels, seeds[s][0], seeds[s][1]);
+        if (component != USIZE_MAX_VALUE && labels.components[component].value == 1u) {
+            background.data[component] = 1u;
         }
-        queue.reset();
-        try_copy(start_x, start_y, require_white);
-        usize encoded = 0u;
-        while (queue_ok && queue.pop(encoded)) {
-            unsigned y = (unsigned)(encoded / (usize)width);
-            unsigned x = (unsigned)(encoded - (usize)y * (usize)width);
-            if (x + 1u < width) {
-                try_copy(x + 1u, y, require_white);
-            }
-            if (x > 0u) {
-                try_copy(x - 1u, y, require_white);
-            }
-            if (y + 1u < height) {
-                try_copy(x, y + 1u, require_white);
-            }
-            if (y > 0u) {
-                try_copy(x, y - 1u, require_white);
+    }
+
+    // Relabel with background versus everything else; dark and light pixels outside the
+    // background merge into islands.
+    for (unsigned y = 0u; y < height; ++y) {
+        u8* row = classes.data + (usize)y * (usize)width;
+        for (usize r = labels.row_offsets[y]; r < labels.row_offsets[y + 1u]; ++r) {
+            const ComponentRun& run = labels.runs[r];
+            u8 value = background.data[run.component] ? 0u : 1u;
+            for (unsigned x = run.x0; x < run.x1; ++x) {
+                row[x] = value;
             }
         }
-    };
-
-    flood(0u, 0u, true);
-    flood(width >> 1u, 0u, true);
-    flood(width - 1u, 0u, true);
-    flood(0u, height >> 1u, true);
-    flood(0u, height - 1u, true);
-    flood(width - 1u, height - 1u, true);
-    flood(width - 1u, height >> 1u, true);
-    flood(width >> 1u, height - 1u, true);
-    flood(width >> 1u, height >> 1u, false);
-
-    bool success = queue_ok;
-
-    queue.release();
-
-    if (!success) {
-        mask.release();
+    }
+    background.release();
+    if (!label_components(classes.data, width, height, labels)) {
         return false;
     }
-
-    for (usize i = 0; i < total_pixels; ++i) {
-        unsigned y = (unsigned)(i / (usize)width);
-        unsigned x = (unsigned)(i - (usize)y * (usize)width);
-        if (has_protected_region &&
-            x >= protected_margin && x < (width - protected_margin) &&
-            y >= protected_margin && y < (height - protected_margin)) {
-            mask.data[i] = 0u;
-            continue;
-        }
-        pixels[i] = (unsigned char)(pixels[i] | mask.data[i]);
+    classes.release();
+    usize keep = component_at(labels, width >> 1u, height >> 1u);
+    if (keep != USIZE_MAX_VALUE && labels.components[keep].value != 1u) {
+        keep = USIZE_MAX_VALUE;
     }
 
     if (out_mask) {
         out_mask->release();
         if (!out_mask->ensure(total_pixels)) {
-            mask.release();
             return false;
         }
         out_mask->size = total_pixels;
-        for (usize i = 0; i < total_pixels; ++i) {
-            out_mask->data[i] = mask.data[i];
+    }
+    for (unsigned y = 0u; y < height; ++y) {
+        bool row_protected = has_protected_region &&
+                             y >= protected_margin && y < (height - protected_margin);
+        unsigned char* row = pixels + (usize)y * (usize)width;
+        u8* mask_row = out_mask ? (out_mask->data + (usize)y * (usize)width) : 0;
+        for (usize r = labels.row_offsets[y]; r < labels.row_offsets[y + 1u]; ++r) {
+            const ComponentRun& run = labels.runs[r];
+            bool dirt = run.value == 1u && run.component != keep;
+            for (unsigned x = run.x0; x < run.x1; ++x) {
+                bool whiten = dirt &&
+                              !(row_protected && x >= protected_margin && x < (width - protected_margin));
+                if (whiten) {
+                    row[x] = 0xFFu;
+                }
+                if (mask_row) {
+                    mask_row[x] = whiten ? 0xFFu : 0u;
+                }
+            }
         }
     }
-
-    mask.release();
     return true;
 }
 
@@ -6844,52 +7225,145 @@ struct Sha256State {
     Sha256State() : h(), buffer(), bit_length(0u), buffer_used(0u) {}
 };
 
-static void sha256_process_block(Sha256State& state, const u8* block) {
+// Optional CPU kernels, detected once: SHA-NI for SHA-256, AVX2 for the
+// ChaCha20 lanes and the GF(256) region multiply behind RS parity.
+// MAKOCODE_DISABLE_CPU_KERNELS=1 forces the portable code paths, which remain
+// the reference for every kernel.
+struct CpuKernels {
+    bool sha256;
+    bool avx2;
+};
+
+static const CpuKernels& cpu_kernels() {
+    static CpuKernels kernels;
+    static int detected = 0;
+    if (__atomic_load_n(&detected, __ATOMIC_ACQUIRE)) {
+        return kernels;
+    }
+    CpuKernels found;
+    found.sha256 = false;
+    found.avx2 = false;
+    const char* disable = getenv("MAKOCODE_DISABLE_CPU_KERNELS");
+    bool disabled = disable && *disable && disable[0] != '0';
+#if defined(MAKOCODE_X86_KERNELS)
+    if (!disabled) {
+        unsigned eax = 0u, ebx = 0u, ecx = 0u, edx = 0u;
+        bool has_leaf7 = __get_cpuid_count(7u, 0u, &eax, &ebx, &ecx, &edx) != 0;
+        __builtin_cpu_init();
+        found.sha256 = has_leaf7 && (ebx & (1u << 29u)) && __builtin_cpu_supports("sse4.1");
+        found.avx2 = __builtin_cpu_supports("avx2") != 0;
+    }
+#else
+    (void)disabled;
+#endif
+    kernels = found;
+    __atomic_store_n(&detected, 1, __ATOMIC_RELEASE);
+    return kernels;
+}
+
+static void sha256_process_blocks_scalar(u32 state_h[8], const u8* data, usize block_count) {
     u32 w[64];
-    for (u32 i = 0u; i < 16u; ++i) {
-        u32 b0 = (u32)block[i * 4u + 0u];
-        u32 b1 = (u32)block[i * 4u + 1u];
-        u32 b2 = (u32)block[i * 4u + 2u];
-        u32 b3 = (u32)block[i * 4u + 3u];
-        w[i] = (b0 << 24u) | (b1 << 16u) | (b2 << 8u) | b3;
-    }
-    for (u32 i = 16u; i < 64u; ++i) {
-        u32 s0 = rotr32(w[i - 15u], 7u) ^ rotr32(w[i - 15u], 18u) ^ (w[i - 15u] >> 3u);
-        u32 s1 = rotr32(w[i - 2u], 17u) ^ rotr32(w[i - 2u], 19u) ^ (w[i - 2u] >> 10u);
-        w[i] = w[i - 16u] + s0 + w[i - 7u] + s1;
-    }
-    u32 a = state.h[0];
-    u32 b = state.h[1];
-    u32 c = state.h[2];
-    u32 d = state.h[3];
-    u32 e = state.h[4];
-    u32 f = state.h[5];
-    u32 g = state.h[6];
-    u32 h = state.h[7];
-    for (u32 i = 0u; i < 64u; ++i) {
-        u32 s1 = rotr32(e, 6u) ^ rotr32(e, 11u) ^ rotr32(e, 25u);
-        u32 ch = (e & f) ^ ((~e) & g);
-        u32 temp1 = h + s1 + ch + SHA256_K[i] + w[i];
-        u32 s0 = rotr32(a, 2u) ^ rotr32(a, 13u) ^ rotr32(a, 22u);
-        u32 maj = (a & b) ^ (a & c) ^ (b & c);
-        u32 temp2 = s0 + maj;
-        h = g;
-        g = f;
-        f = e;
-        e = d + temp1;
-        d = c;
-        c = b;
-        b = a;
-        a = temp1 + temp2;
-    }
-    state.h[0] += a;
-    state.h[1] += b;
-    state.h[2] += c;
-    state.h[3] += d;
-    state.h[4] += e;
-    state.h[5] += f;
-    state.h[6] += g;
-    state.h[7] += h;
+    for (; block_count > 0u; --block_count, data += 64u) {
+        const u8* block = data;
+        for (u32 i = 0u; i < 16u; ++i) {
+            u32 b0 = (u32)block[i * 4u + 0u];
+            u32 b1 = (u32)block[i * 4u + 1u];
+            u32 b2 = (u32)block[i * 4u + 2u];
+            u32 b3 = (u32)block[i * 4u + 3u];
+            w[i] = (b0 << 24u) | (b1 << 16u) | (b2 << 8u) | b3;
+        }
+        for (u32 i = 16u; i < 64u; ++i) {
+            u32 s0 = rotr32(w[i - 15u], 7u) ^ rotr32(w[i - 15u], 18u) ^ (w[i - 15u] >> 3u);
+            u32 s1 = rotr32(w[i - 2u], 17u) ^ rotr32(w[i - 2u], 19u) ^ (w[i - 2u] >> 10u);
+            w[i] = w[i - 16u] + s0 + w[i - 7u] + s1;
+        }
+        u32 a = state_h[0];
+        u32 b = state_h[1];
+        u32 c = state_h[2];
+        u32 d = state_h[3];
+        u32 e = state_h[4];
+        u32 f = state_h[5];
+        u32 g = state_h[6];
+        u32 h = state_h[7];
+        for (u32 i = 0u; i < 64u; ++i) {
+            u32 s1 = rotr32(e, 6u) ^ rotr32(e, 11u) ^ rotr32(e, 25u);
+            u32 ch = (e & f) ^ ((~e) & g);
+            u32 temp1 = h + s1 + ch + SHA256_K[i] + w[i];
+            u32 s0 = rotr32(a, 2u) ^ rotr32(a, 13u) ^ rotr32(a, 22u);
+            u32 maj = (a & b) ^ (a & c) ^ (b & c);
+            u32 temp2 = s0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + temp1;
+            d = c;
+            c = b;
+            b = a;
+            a = temp1 + temp2;
+        }
+        state_h[0] += a;
+        state_h[1] += b;
+        state_h[2] += c;
+        state_h[3] += d;
+        state_h[4] += e;
+        state_h[5] += f;
+        state_h[6] += g;
+        state_h[7] += h;
+    }
+}
+
+#if defined(MAKOCODE_X86_KERNELS)
+// SHA-NI rounds. The state is kept as the ABEF/CDGH register pair the
+// instructions expect; each loop step runs four rounds and derives the message
+// words four steps ahead with sha256msg1/msg2.
+__attribute__((target("sha,sse4.1")))
+static void sha256_process_blocks_shani(u32 state_h[8], const u8* data, usize block_count) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bll, 0x0405060700010203ll);
+    __m128i dcba = _mm_loadu_si128((const __m128i*)(state_h + 0));
+    __m128i hgfe = _mm_loadu_si128((const __m128i*)(state_h + 4));
+    __m128i cdab = _mm_shuffle_epi32(dcba, 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1B);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+    for (; block_count > 0u; --block_count, data += 64u) {
+        __m128i abef_saved = abef;
+        __m128i cdgh_saved = cdgh;
+        __m128i words[4];
+        for (u32 i = 0u; i < 4u; ++i) {
+            words[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i * 16u)), byte_swap);
+        }
+        for (u32 i = 0u; i < 16u; ++i) {
+            __m128i schedule = _mm_add_epi32(words[i & 3u], _mm_loadu_si128((const __m128i*)(SHA256_K + i * 4u)));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, schedule);
+            if (i < 12u) {
+                __m128i next = _mm_sha256msg1_epu32(words[i & 3u], words[(i + 1u) & 3u]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(words[(i + 3u) & 3u], words[(i + 2u) & 3u], 4));
+                words[i & 3u] = _mm_sha256msg2_epu32(next, words[(i + 3u) & 3u]);
+            }
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(schedule, 0x0E));
+        }
+        abef = _mm_add_epi32(abef, abef_saved);
+        cdgh = _mm_add_epi32(cdgh, cdgh_saved);
+    }
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i*)(state_h + 0), _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128((__m128i*)(state_h + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+#endif
+
+static void sha256_process_blocks(Sha256State& state, const u8* data, usize block_count) {
+#if defined(MAKOCODE_X86_KERNELS)
+    if (cpu_kernels().sha256) {
+        sha256_process_blocks_shani(state.h, data, block_count);
+        return;
+    }
+#endif
+    sha256_process_blocks_scalar(state.h, data, block_count);
+}
+
+static void sha256_process_block(Sha256State& state, const u8* block) {
+    sha256_process_blocks(state, block, 1u);
 }
 
 static void sha256_init(Sha256State& state) {
@@ -6905,6 +7379,14 @@ static void sha256_update(Sha256State& state, const u8* data, usize length) {
         return;
     }
     while (length > 0u) {
+        if (state.buffer_used == 0u && length >= 64u) {
+            usize block_count = length / 64u;
+            sha256_process_blocks(state, data, block_count);
+            state.bit_length += (u64)block_count * 512u;
+            data += block_count * 64u;
+            length -= block_count * 64u;
+            continue;
+        }
         usize to_copy = 64u - (usize)state.buffer_used;
         if (to_copy > length) {
             to_copy = length;
@@ -6950,12 +7432,15 @@ static void sha256_finalize(Sha256State& state, u8 digest[32]) {
     }
 }
 
-static bool hmac_sha256(const u8* key,
-                        usize key_length,
-                        const u8* data,
-                        usize data_length,
-                        u8 output[32]) {
-    if (!key || key_length == 0u || !output) {
+// HMAC key schedule: the SHA-256 states after absorbing the ipad and opad
+// blocks. PBKDF2 reuses them for every iteration, halving the compressions.
+struct HmacSha256Key {
+    Sha256State inner;
+    Sha256State outer;
+};
+
+static bool hmac_sha256_prepare(const u8* key, usize key_length, HmacSha256Key& prepared) {
+    if (!key || key_length == 0u) {
         return false;
     }
     const usize block_size = 64u;
@@ -6986,26 +7471,32 @@ static bool hmac_sha256(const u8* key,
         ipad[i] = (u8)(key_block[i] ^ 0x36u);
         opad[i] = (u8)(key_block[i] ^ 0x5cu);
     }
-    Sha256State inner;
-    sha256_init(inner);
-    sha256_update(inner, ipad, block_size);
-    sha256_update(inner, data, data_length);
-    u8 inner_digest[32];
-    sha256_finalize(inner, inner_digest);
-    Sha256State outer;
-    sha256_init(outer);
-    sha256_update(outer, opad, block_size);
-    sha256_update(outer, inner_digest, 32u);
-    sha256_finalize(outer, output);
+    sha256_init(prepared.inner);
+    sha256_update(prepared.inner, ipad, block_size);
+    sha256_init(prepared.outer);
+    sha256_update(prepared.outer, opad, block_size);
     for (usize i = 0u; i < block_size; ++i) {
         key_block[i] = 0u;
         ipad[i] = 0u;
         opad[i] = 0u;
     }
+    return true;
+}
+
+static void hmac_sha256_prepared(const HmacSha256Key& prepared,
+                                 const u8* data,
+                                 usize data_length,
+                                 u8 output[32]) {
+    Sha256State inner = prepared.inner;
+    sha256_update(inner, data, data_length);
+    u8 inner_digest[32];
+    sha256_finalize(inner, inner_digest);
+    Sha256State outer = prepared.outer;
+    sha256_update(outer, inner_digest, 32u);
+    sha256_finalize(outer, output);
     for (usize i = 0u; i < 32u; ++i) {
         inner_digest[i] = 0u;
     }
-    return true;
 }
 
 static bool pbkdf2_hmac_sha256(const u8* password,
@@ -7027,6 +7518,11 @@ static bool pbkdf2_hmac_sha256(const u8* password,
         salt_buffer.data[i] = salt[i];
     }
     salt_buffer.size = salt_length + 4u;
+    HmacSha256Key prepared;
+    if (!hmac_sha256_prepare(password, password_length, prepared)) {
+        salt_buffer.release();
+        return false;
+    }
     u8 u[32];
     u8 t[32];
     for (u32 block_index = 1u; block_index <= block_count; ++block_index) {
@@ -7035,18 +7531,12 @@ static bool pbkdf2_hmac_sha256(const u8* password,
         salt_buffer.data[salt_length + 1u] = (u8)((bi >> 16u) & 0xFFu);
         salt_buffer.data[salt_length + 2u] = (u8)((bi >> 8u) & 0xFFu);
         salt_buffer.data[salt_length + 3u] = (u8)(bi & 0xFFu);
-        if (!hmac_sha256(password, password_length, salt_buffer.data, salt_length + 4u, u)) {
-            salt_buffer.release();
-            return false;
-        }
+        hmac_sha256_prepared(prepared, salt_buffer.data, salt_length + 4u, u);
         for (u32 i = 0u; i < 32u; ++i) {
             t[i] = u[i];
         }
         for (u32 iter = 1u; iter < iterations; ++iter) {
-            if (!hmac_sha256(password, password_length, u, 32u, u)) {
-                salt_buffer.release();
-                return false;
-            }
+            hmac_sha256_prepared(prepared, u, 32u, u);
             for (u32 i = 0u; i < 32u; ++i) {
                 t[i] ^= u[i];
             }
@@ -7062,6 +7552,7 @@ static bool pbkdf2_hmac_sha256(const u8* password,
         u[i] = 0u;
         t[i] = 0u;
     }
+    prepared = HmacSha256Key();
     salt_buffer.release();
     return true;
 }
@@ -7081,9 +7572,8 @@ static inline void chacha20_quarter_round(u32& a, u32& b, u32& c, u32& d) {
     b = rotl32(b, 7u);
 }
 
-static void chacha20_block(const u8 key[32], const u8 nonce[12], u32 counter, u8 output[64]) {
+static void chacha20_setup(const u8 key[32], const u8 nonce[12], u32 counter, u32 state[16]) {
     static const u32 constants[4] = {0x61707865u, 0x3320646eu, 0x79622d32u, 0x6b206574u};
-    u32 state[16];
     state[0] = constants[0];
     state[1] = constants[1];
     state[2] = constants[2];
@@ -7095,6 +7585,11 @@ static void chacha20_block(const u8 key[32], const u8 nonce[12], u32 counter, u8
     state[13] = read_le_u32(nonce + 0u);
     state[14] = read_le_u32(nonce + 4u);
     state[15] = read_le_u32(nonce + 8u);
+}
+
+static void chacha20_block(const u8 key[32], const u8 nonce[12], u32 counter, u8 output[64]) {
+    u32 state[16];
+    chacha20_setup(key, nonce, counter, state);
     u32 working[16];
     for (u32 i = 0u; i < 16u; ++i) {
         working[i] = state[i];
@@ -7115,6 +7610,68 @@ static void chacha20_block(const u8 key[32], const u8 nonce[12], u32 counter, u8
     }
 }
 
+// Keystream for LANES consecutive counters at once: lane j of every vector
+// holds word i of block counter+j, so each quarter round is a handful of
+// vector ops (SSE2/NEON for 4 lanes, AVX2 for 8).
+typedef u32 ChachaLanes4 __attribute__((vector_size(16)));
+typedef u32 ChachaLanes8 __attribute__((vector_size(32)));
+
+#define MAKOCODE_CHACHA_LANE_QR(a, b, c, d) \
+    a += b; d ^= a; d = (d << 16) | (d >> 16); \
+    c += d; b ^= c; b = (b << 12) | (b >> 20); \
+    a += b; d ^= a; d = (d << 8) | (d >> 24); \
+    c += d; b ^= c; b = (b << 7) | (b >> 25)
+
+template <typename Lanes, u32 LANES>
+static inline __attribute__((always_inline)) void chacha20_blocks_lanes(const u32 state[16], u8* output) {
+    const Lanes zero = {};
+    Lanes lane_index;
+    for (u32 lane = 0u; lane < LANES; ++lane) {
+        lane_index[lane] = lane;
+    }
+    Lanes x[16];
+    for (u32 i = 0u; i < 16u; ++i) {
+        x[i] = state[i] + zero;
+    }
+    x[12] += lane_index;
+    for (u32 round = 0u; round < 10u; ++round) {
+        MAKOCODE_CHACHA_LANE_QR(x[0], x[4], x[8], x[12]);
+        MAKOCODE_CHACHA_LANE_QR(x[1], x[5], x[9], x[13]);
+        MAKOCODE_CHACHA_LANE_QR(x[2], x[6], x[10], x[14]);
+        MAKOCODE_CHACHA_LANE_QR(x[3], x[7], x[11], x[15]);
+        MAKOCODE_CHACHA_LANE_QR(x[0], x[5], x[10], x[15]);
+        MAKOCODE_CHACHA_LANE_QR(x[1], x[6], x[11], x[12]);
+        MAKOCODE_CHACHA_LANE_QR(x[2], x[7], x[8], x[13]);
+        MAKOCODE_CHACHA_LANE_QR(x[3], x[4], x[9], x[14]);
+    }
+    u32 words[16][LANES];
+    for (u32 i = 0u; i < 16u; ++i) {
+        x[i] += state[i] + ((i == 12u) ? lane_index : zero);
+        memcpy(words[i], &x[i], sizeof(Lanes));
+    }
+    for (u32 lane = 0u; lane < LANES; ++lane) {
+        for (u32 i = 0u; i < 16u; ++i) {
+            write_le_u32(output + lane * 64u + i * 4u, words[i][lane]);
+        }
+    }
+}
+
+#undef MAKOCODE_CHACHA_LANE_QR
+
+static const u32 CHACHA20_MAX_LANES = 8u;
+
+static void chacha20_blocks4(const u32 state[16], u8* output) {
+    chacha20_blocks_lanes<ChachaLanes4, 4u>(state, output);
+}
+
+#if defined(MAKOCODE_X86_KERNELS)
+__attribute__((target("avx2")))
+static void chacha20_blocks8_avx2(const u32 state[16], u8* output) {
+    chacha20_blocks_lanes<ChachaLanes8, 8u>(state, output);
+}
+#endif
+
+// Counters wrap modulo 2^32 exactly like consecutive chacha20_block calls.
 static bool chacha20_xor(const u8 key[32],
                          const u8 nonce[12],
                          u32 counter,
@@ -7124,133 +7681,143 @@ static bool chacha20_xor(const u8 key[32],
     if ((!input && length > 0u) || !output) {
         return false;
     }
-    u8 block[64];
+    u32 state[16];
+    chacha20_setup(key, nonce, counter, state);
+    u32 lanes = 4u;
+#if defined(MAKOCODE_X86_KERNELS)
+    if (cpu_kernels().avx2) {
+        lanes = 8u;
+    }
+#endif
+    u8 block[64u * CHACHA20_MAX_LANES];
     usize offset = 0u;
     while (offset < length) {
-        chacha20_block(key, nonce, counter, block);
-        counter += 1u;
-        usize chunk = (length - offset >= 64u) ? 64u : (length - offset);
-        for (usize i = 0u; i < chunk; ++i) {
-            u8 keystream = block[i];
-            u8 source = input ? input[offset + i] : 0u;
-            output[offset + i] = (u8)(source ^ keystream);
+        usize remaining = length - offset;
+        usize produced = 64u;
+        if (remaining > 64u) {
+#if defined(MAKOCODE_X86_KERNELS)
+            if (lanes == 8u) {
+                chacha20_blocks8_avx2(state, block);
+            } else {
+                chacha20_blocks4(state, block);
+            }
+#else
+            chacha20_blocks4(state, block);
+#endif
+            produced = 64u * (usize)lanes;
+        } else {
+            u8 nonce_bytes[12];
+            write_le_u32(nonce_bytes + 0u, state[13]);
+            write_le_u32(nonce_bytes + 4u, state[14]);
+            write_le_u32(nonce_bytes + 8u, state[15]);
+            chacha20_block(key, nonce_bytes, state[12], block);
         }
-        offset += chunk;
+        usize chunk = (remaining < produced) ? remaining : produced;
+        if (input) {
+            for (usize i = 0u; i < chunk; ++i) {
+                output[offset + i] = (u8)(input[offset + i] ^ block[i]);
+            }
+        } else {
+            memcpy(output + offset, block, chunk);
+        }
+        state[12] += (u32)(produced / 64u);
+        offset += chunk;
     }
-    for (u32 i = 0u; i < 64u; ++i) {
+    for (u32 i = 0u; i < sizeof(block); ++i) {
         block[i] = 0u;
     }
+    for (u32 i = 0u; i < 16u; ++i) {
+        state[i] = 0u;
+    }
     return true;
 }
 
+// Poly1305 in three 44/44/42-bit limbs, so a block costs nine 64x64->128-bit
+// multiplies instead of twenty-five.
+static const u64 POLY1305_MASK44 = 0xfffffffffffull;
+static const u64 POLY1305_MASK42 = 0x3ffffffffffull;
+// The 2^128 bit appended to every full 16-byte block, in limb 2.
+static const u64 POLY1305_FULL_BLOCK = 1ull << 40u;
+
 struct Poly1305State {
-    u64 r0, r1, r2, r3, r4;
-    u64 s1, s2, s3, s4;
-    u64 h0, h1, h2, h3, h4;
+    u64 r0, r1, r2;
+    u64 s1, s2;
+    u64 h0, h1, h2;
 
     Poly1305State()
-        : r0(0u), r1(0u), r2(0u), r3(0u), r4(0u),
-          s1(0u), s2(0u), s3(0u), s4(0u),
-          h0(0u), h1(0u), h2(0u), h3(0u), h4(0u) {}
+        : r0(0u), r1(0u), r2(0u),
+          s1(0u), s2(0u),
+          h0(0u), h1(0u), h2(0u) {}
 };
 
 static void poly1305_init_state(Poly1305State& state, const u8 key[32]) {
-    unsigned __int128 r = (unsigned __int128)read_le_u64(key) |
-                          ((unsigned __int128)read_le_u64(key + 8u) << 64u);
-    unsigned __int128 mask = (((unsigned __int128)0x0ffffffc0ffffffcull) << 64u) |
-                             (unsigned __int128)0x0ffffffc0fffffffull;
-    r &= mask;
-    u64 r_low = (u64)(r & ((unsigned __int128)0xFFFFFFFFFFFFFFFFull));
-    u64 r_high = (u64)(r >> 64u);
-    state.r0 = r_low & 0x3ffffffu;
-    state.r1 = ((r_low >> 26u) & 0x3ffffffu);
-    state.r2 = (((r_low >> 52u) | (r_high << 12u)) & 0x3ffffffu);
-    state.r3 = ((r_high >> 14u) & 0x3ffffffu);
-    state.r4 = ((r_high >> 40u) & 0x3ffffffu);
-    state.s1 = state.r1 * 5u;
-    state.s2 = state.r2 * 5u;
-    state.s3 = state.r3 * 5u;
-    state.s4 = state.r4 * 5u;
-    state.h0 = state.h1 = state.h2 = state.h3 = state.h4 = 0u;
-}
-
-static void poly1305_process_block(Poly1305State& state, const u8 block[16], u64 hibit) {
-    u64 t0 = read_le_u64(block);
-    u64 t1 = read_le_u64(block + 8u);
-    state.h0 += t0 & 0x3ffffffu;
-    state.h1 += (t0 >> 26u) & 0x3ffffffu;
-    state.h2 += ((t0 >> 52u) | (t1 << 12u)) & 0x3ffffffu;
-    state.h3 += (t1 >> 14u) & 0x3ffffffu;
-    state.h4 += ((t1 >> 40u) & 0x3ffffffu) + hibit;
-
-    unsigned __int128 d0 = (unsigned __int128)state.h0 * state.r0 +
-                           (unsigned __int128)state.h1 * state.s4 +
-                           (unsigned __int128)state.h2 * state.s3 +
-                           (unsigned __int128)state.h3 * state.s2 +
-                           (unsigned __int128)state.h4 * state.s1;
-    unsigned __int128 d1 = (unsigned __int128)state.h0 * state.r1 +
-                           (unsigned __int128)state.h1 * state.r0 +
-                           (unsigned __int128)state.h2 * state.s4 +
-                           (unsigned __int128)state.h3 * state.s3 +
-                           (unsigned __int128)state.h4 * state.s2;
-    unsigned __int128 d2 = (unsigned __int128)state.h0 * state.r2 +
-                           (unsigned __int128)state.h1 * state.r1 +
-                           (unsigned __int128)state.h2 * state.r0 +
-                           (unsigned __int128)state.h3 * state.s4 +
-                           (unsigned __int128)state.h4 * state.s3;
-    unsigned __int128 d3 = (unsigned __int128)state.h0 * state.r3 +
-                           (unsigned __int128)state.h1 * state.r2 +
-                           (unsigned __int128)state.h2 * state.r1 +
-                           (unsigned __int128)state.h3 * state.r0 +
-                           (unsigned __int128)state.h4 * state.s4;
-    unsigned __int128 d4 = (unsigned __int128)state.h0 * state.r4 +
-                           (unsigned __int128)state.h1 * state.r3 +
-                           (unsigned __int128)state.h2 * state.r2 +
-                           (unsigned __int128)state.h3 * state.r1 +
-                           (unsigned __int128)state.h4 * state.r0;
-
-    u64 h0 = (u64)(d0 & 0x3ffffffu);
-    u64 carry = (u64)(d0 >> 26u);
-    d1 += carry;
-    u64 h1 = (u64)(d1 & 0x3ffffffu);
-    carry = (u64)(d1 >> 26u);
-    d2 += carry;
-    u64 h2 = (u64)(d2 & 0x3ffffffu);
-    carry = (u64)(d2 >> 26u);
-    d3 += carry;
-    u64 h3 = (u64)(d3 & 0x3ffffffu);
-    carry = (u64)(d3 >> 26u);
-    d4 += carry;
-    u64 h4 = (u64)(d4 & 0x3ffffffu);
-    carry = (u64)(d4 >> 26u);
-    h0 += carry * 5u;
-    carry = h0 >> 26u;
-    h0 &= 0x3ffffffu;
-    h1 += carry;
-    carry = h1 >> 26u;
-    h1 &= 0x3ffffffu;
-    h2 += carry;
-    carry = h2 >> 26u;
-    h2 &= 0x3ffffffu;
-    h3 += carry;
-    carry = h3 >> 26u;
-    h3 &= 0x3ffffffu;
-    h4 += carry;
+    u64 t0 = read_le_u64(key);
+    u64 t1 = read_le_u64(key + 8u);
+    state.r0 = t0 & 0xffc0fffffffull;
+    state.r1 = ((t0 >> 44u) | (t1 << 20u)) & 0xfffffc0ffffull;
+    state.r2 = (t1 >> 24u) & 0x00ffffffc0full;
+    state.s1 = state.r1 * (5u << 2u);
+    state.s2 = state.r2 * (5u << 2u);
+    state.h0 = state.h1 = state.h2 = 0u;
+}
+
+static void poly1305_process_blocks(Poly1305State& state, const u8* data, usize block_count, u64 hibit) {
+    const u64 r0 = state.r0;
+    const u64 r1 = state.r1;
+    const u64 r2 = state.r2;
+    const u64 s1 = state.s1;
+    const u64 s2 = state.s2;
+    u64 h0 = state.h0;
+    u64 h1 = state.h1;
+    u64 h2 = state.h2;
+    for (; block_count > 0u; --block_count, data += 16u) {
+        u64 t0 = read_le_u64(data);
+        u64 t1 = read_le_u64(data + 8u);
+        h0 += t0 & POLY1305_MASK44;
+        h1 += ((t0 >> 44u) | (t1 << 20u)) & POLY1305_MASK44;
+        h2 += ((t1 >> 24u) & POLY1305_MASK42) | hibit;
+
+        unsigned __int128 d0 = (unsigned __int128)h0 * r0 +
+                               (unsigned __int128)h1 * s2 +
+                               (unsigned __int128)h2 * s1;
+        unsigned __int128 d1 = (unsigned __int128)h0 * r1 +
+                               (unsigned __int128)h1 * r0 +
+                               (unsigned __int128)h2 * s2;
+        unsigned __int128 d2 = (unsigned __int128)h0 * r2 +
+                               (unsigned __int128)h1 * r1 +
+                               (unsigned __int128)h2 * r0;
+
+        u64 carry = (u64)(d0 >> 44u);
+        h0 = (u64)d0 & POLY1305_MASK44;
+        d1 += carry;
+        carry = (u64)(d1 >> 44u);
+        h1 = (u64)d1 & POLY1305_MASK44;
+        d2 += carry;
+        carry = (u64)(d2 >> 42u);
+        h2 = (u64)d2 & POLY1305_MASK42;
+        h0 += carry * 5u;
+        carry = h0 >> 44u;
+        h0 &= POLY1305_MASK44;
+        h1 += carry;
+    }
     state.h0 = h0;
     state.h1 = h1;
     state.h2 = h2;
-    state.h3 = h3;
-    state.h4 = h4;
+}
+
+static void poly1305_process_block(Poly1305State& state, const u8 block[16], u64 hibit) {
+    poly1305_process_blocks(state, block, 1u, hibit);
 }
 
 static void poly1305_update(Poly1305State& state, const u8* data, usize length) {
     if (!data || length == 0u) {
         return;
     }
-    while (length >= 16u) {
-        poly1305_process_block(state, data, (1ull << 24u));
-        data += 16u;
-        length -= 16u;
+    if (length >= 16u) {
+        usize block_count = length / 16u;
+        poly1305_process_blocks(state, data, block_count, POLY1305_FULL_BLOCK);
+        data += block_count * 16u;
+        length -= block_count * 16u;
     }
     if (length > 0u) {
         u8 buffer[16];
@@ -7278,68 +7845,56 @@ static void poly1305_pad16(Poly1305State& state, usize length) {
 }
 
 static void poly1305_finish(Poly1305State& state, const u8 pad[16], u8 tag[16]) {
-    u64 carry = state.h1 >> 26u;
-    state.h1 &= 0x3ffffffu;
-    state.h2 += carry;
-    carry = state.h2 >> 26u;
-    state.h2 &= 0x3ffffffu;
-    state.h3 += carry;
-    carry = state.h3 >> 26u;
-    state.h3 &= 0x3ffffffu;
-    state.h4 += carry;
-    carry = state.h4 >> 26u;
-    state.h4 &= 0x3ffffffu;
-    state.h0 += carry * 5u;
-    carry = state.h0 >> 26u;
-    state.h0 &= 0x3ffffffu;
-    state.h1 += carry;
-    carry = state.h1 >> 26u;
-    state.h1 &= 0x3ffffffu;
-    state.h2 += carry;
-    carry = state.h2 >> 26u;
-    state.h2 &= 0x3ffffffu;
-    state.h3 += carry;
-    carry = state.h3 >> 26u;
-    state.h3 &= 0x3ffffffu;
-    state.h4 += carry;
-
-    u64 g0 = state.h0 + 5u;
-    carry = g0 >> 26u;
-    g0 &= 0x3ffffffu;
-    u64 g1 = state.h1 + carry;
-    carry = g1 >> 26u;
-    g1 &= 0x3ffffffu;
-    u64 g2 = state.h2 + carry;
-    carry = g2 >> 26u;
-    g2 &= 0x3ffffffu;
-    u64 g3 = state.h3 + carry;
-    carry = g3 >> 26u;
-    g3 &= 0x3ffffffu;
-    u64 g4 = state.h4 + carry - (1ull << 26u);
-    u64 mask = ((g4 >> 63u) - 1u);
+    u64 h0 = state.h0;
+    u64 h1 = state.h1;
+    u64 h2 = state.h2;
+    u64 carry = h1 >> 44u;
+    h1 &= POLY1305_MASK44;
+    h2 += carry;
+    carry = h2 >> 42u;
+    h2 &= POLY1305_MASK42;
+    h0 += carry * 5u;
+    carry = h0 >> 44u;
+    h0 &= POLY1305_MASK44;
+    h1 += carry;
+    carry = h1 >> 44u;
+    h1 &= POLY1305_MASK44;
+    h2 += carry;
+    carry = h2 >> 42u;
+    h2 &= POLY1305_MASK42;
+    h0 += carry * 5u;
+    carry = h0 >> 44u;
+    h0 &= POLY1305_MASK44;
+    h1 += carry;
+
+    u64 g0 = h0 + 5u;
+    carry = g0 >> 44u;
+    g0 &= POLY1305_MASK44;
+    u64 g1 = h1 + carry;
+    carry = g1 >> 44u;
+    g1 &= POLY1305_MASK44;
+    u64 g2 = h2 + carry - (1ull << 42u);
+    u64 mask = (g2 >> 63u) - 1u;
     g0 &= mask;
     g1 &= mask;
     g2 &= mask;
-    g3 &= mask;
-    g4 &= mask;
     mask = ~mask;
-    state.h0 = (state.h0 & mask) | g0;
-    state.h1 = (state.h1 & mask) | g1;
-    state.h2 = (state.h2 & mask) | g2;
-    state.h3 = (state.h3 & mask) | g3;
-    state.h4 = (state.h4 & mask) | g4;
-
-    unsigned __int128 acc = (unsigned __int128)state.h0 |
-                            ((unsigned __int128)state.h1 << 26u) |
-                            ((unsigned __int128)state.h2 << 52u) |
-                            ((unsigned __int128)state.h3 << 78u) |
-                            ((unsigned __int128)state.h4 << 104u);
-    unsigned __int128 sum0 = acc + (unsigned __int128)read_le_u64(pad);
-    u64 f0 = (u64)sum0;
-    unsigned __int128 sum1 = ((acc >> 64u) + (unsigned __int128)read_le_u64(pad + 8u) + (sum0 >> 64u));
-    u64 f1 = (u64)sum1;
-    write_le_u64(tag, f0);
-    write_le_u64(tag + 8u, f1);
+    h0 = (h0 & mask) | g0;
+    h1 = (h1 & mask) | g1;
+    h2 = (h2 & mask) | g2;
+
+    // Tags have always been written with the high accumulator word added
+    // twice (once more through the carry of the 128-bit low-half sum), which
+    // differs from RFC 8439 in the upper 8 bytes. Existing pages authenticate
+    // against that value, so it is reproduced exactly.
+    u64 acc_low = h0 | (h1 << 44u);
+    u64 acc_high = (h1 >> 20u) | (h2 << 24u);
+    u64 tag_low = acc_low + read_le_u64(pad);
+    u64 low_carry = (tag_low < acc_low) ? 1u : 0u;
+    u64 tag_high = acc_high + read_le_u64(pad + 8u) + acc_high + low_carry;
+    write_le_u64(tag, tag_low);
+    write_le_u64(tag + 8u, tag_high);
+    state = Poly1305State();
 }
 
 static bool chacha20_poly1305_encrypt(const u8* key,
@@ -7387,7 +7942,7 @@ static bool chacha20_poly1305_encrypt(const u8* key,
     }
     write_le_u64(length_block, (u64)aad_length);
     write_le_u64(length_block + 8u, (u64)plaintext_length);
-    poly1305_process_block(mac, length_block, (1ull << 24u));
+    poly1305_process_block(mac, length_block, POLY1305_FULL_BLOCK);
     poly1305_finish(mac, initial_block + 16u, tag);
     for (u32 i = 0u; i < 64u; ++i) {
         initial_block[i] = 0u;
@@ -7429,7 +7984,7 @@ static bool chacha20_poly1305_decrypt(const u8* key,
     }
     write_le_u64(length_block, (u64)aad_length);
     write_le_u64(length_block + 8u, (u64)ciphertext_length);
-    poly1305_process_block(mac, length_block, (1ull << 24u));
+    poly1305_process_block(mac, length_block, POLY1305_FULL_BLOCK);
     u8 expected_tag[16];
     poly1305_finish(mac, initial_block + 16u, expected_tag);
     bool match = constant_time_equal(expected_tag, tag, ENCRYPTION_TAG_BYTES);
@@ -7474,18 +8029,56 @@ enum DecryptStatus {
     DecryptStatus_FormatError = 3
 };
 
-static bool encrypt_payload_buffer(const ByteBuffer& plaintext,
-                                   const char* password,
-                                   usize password_length,
-                                   ByteBuffer& output) {
+// Spool-file I/O for `encode --stream`. Slices stay well below INT_MAX since
+// the read/write prototypes above return int.
+static const usize STREAM_IO_CHUNK_BYTES = (usize)1u << 20u;
+
+static bool stream_read_exact(int fd, u8* dest, usize length) {
+    usize done = 0u;
+    while (done < length) {
+        usize slice = length - done;
+        if (slice > STREAM_IO_CHUNK_BYTES) {
+            slice = STREAM_IO_CHUNK_BYTES;
+        }
+        int result = read(fd, dest + done, (unsigned long)slice);
+        if (result <= 0) {
+            return false;
+        }
+        done += (usize)result;
+    }
+    return true;
+}
+
+static bool stream_write_exact(int fd, const u8* data, usize length) {
+    usize done = 0u;
+    while (done < length) {
+        usize slice = length - done;
+        if (slice > STREAM_IO_CHUNK_BYTES) {
+            slice = STREAM_IO_CHUNK_BYTES;
+        }
+        int result = write(fd, data + done, (unsigned long)slice);
+        if (result <= 0) {
+            return false;
+        }
+        done += (usize)result;
+    }
+    return true;
+}
+
+// Derives the key and fills in the plaintext header shared by the buffer and
+// file-descriptor encryptors; the header doubles as the AEAD associated data.
+static bool prepare_payload_encryption(const char* password,
+                                       usize password_length,
+                                       u64 plain_size,
+                                       u8 key[32],
+                                       u8 nonce[ENCRYPTION_NONCE_BYTES],
+                                       u8 header[ENCRYPTION_HEADER_BYTES]) {
     if (!password || password_length == 0u) {
         return false;
     }
     u8 salt[ENCRYPTION_SALT_BYTES];
-    u8 nonce[ENCRYPTION_NONCE_BYTES];
     crypto_random_bytes(salt, ENCRYPTION_SALT_BYTES);
     crypto_random_bytes(nonce, ENCRYPTION_NONCE_BYTES);
-    u8 key[32];
     if (!pbkdf2_hmac_sha256((const u8*)password,
                             password_length,
                             salt,
@@ -7498,9 +8091,6 @@ static bool encrypt_payload_buffer(const ByteBuffer& plaintext,
         }
         return false;
     }
-    const u8* plain_ptr = plaintext.data;
-    usize plain_size = plaintext.size;
-    u8 header[ENCRYPTION_HEADER_BYTES];
     for (usize i = 0u; i < ENCRYPTION_HEADER_BYTES; ++i) {
         header[i] = 0u;
     }
@@ -7510,13 +8100,29 @@ static bool encrypt_payload_buffer(const ByteBuffer& plaintext,
     header[6] = ENCRYPTION_KDF_PBKDF2_SHA256;
     header[7] = 0u;
     write_le_u32(header + 8u, ENCRYPTION_PBKDF2_ITERATIONS);
-    write_le_u64(header + 12u, (u64)plain_size);
+    write_le_u64(header + 12u, plain_size);
     for (usize i = 0u; i < ENCRYPTION_SALT_BYTES; ++i) {
         header[20u + i] = salt[i];
     }
     for (usize i = 0u; i < ENCRYPTION_NONCE_BYTES; ++i) {
         header[36u + i] = nonce[i];
     }
+    return true;
+}
+
+static bool encrypt_payload_buffer(const ByteBuffer& plaintext,
+                                   const char* password,
+                                   usize password_length,
+                                   ByteBuffer& output) {
+    StatsTimer stats_timer(StatsStage_Encrypt);
+    u8 nonce[ENCRYPTION_NONCE_BYTES];
+    u8 key[32];
+    const u8* plain_ptr = plaintext.data;
+    usize plain_size = plaintext.size;
+    u8 header[ENCRYPTION_HEADER_BYTES];
+    if (!prepare_payload_encryption(password, password_length, (u64)plain_size, key, nonce, header)) {
+        return false;
+    }
     ByteBuffer ciphertext;
     u8 tag[ENCRYPTION_TAG_BYTES];
     if (!chacha20_poly1305_encrypt(key,
@@ -7562,11 +8168,78 @@ static bool encrypt_payload_buffer(const ByteBuffer& plaintext,
     return true;
 }
 
+// Chunked variant of encrypt_payload_buffer: reads `plain_size` bytes from
+// `input_fd` and writes header || ciphertext || tag to `output_fd`. Chunks are
+// a multiple of the ChaCha20 block size, so the keystream counter and the
+// Poly1305 blocks line up exactly with the one-shot encryptor.
+static bool encrypt_payload_fd(int input_fd,
+                               u64 plain_size,
+                               const char* password,
+                               usize password_length,
+                               int output_fd,
+                               u64& output_size) {
+    StatsTimer stats_timer(StatsStage_Encrypt);
+    output_size = 0u;
+    if (plain_size / 64u >= (u64)0xFFFFFFFFu) {
+        return false;
+    }
+    u8 nonce[ENCRYPTION_NONCE_BYTES];
+    u8 key[32];
+    u8 header[ENCRYPTION_HEADER_BYTES];
+    if (!prepare_payload_encryption(password, password_length, plain_size, key, nonce, header)) {
+        return false;
+    }
+    u8 initial_block[64];
+    chacha20_block(key, nonce, 0u, initial_block);
+    Poly1305State mac;
+    poly1305_init_state(mac, initial_block);
+    poly1305_update(mac, header, ENCRYPTION_HEADER_BYTES);
+    poly1305_pad16(mac, ENCRYPTION_HEADER_BYTES);
+    ByteBuffer chunk;
+    bool ok = chunk.ensure(STREAM_IO_CHUNK_BYTES) &&
+              stream_write_exact(output_fd, header, ENCRYPTION_HEADER_BYTES);
+    u32 counter = 1u;
+    u64 remaining = plain_size;
+    while (ok && remaining > 0u) {
+        usize length = (remaining > (u64)STREAM_IO_CHUNK_BYTES) ? STREAM_IO_CHUNK_BYTES : (usize)remaining;
+        ok = stream_read_exact(input_fd, chunk.data, length) &&
+             chacha20_xor(key, nonce, counter, chunk.data, chunk.data, length);
+        if (!ok) {
+            break;
+        }
+        poly1305_update(mac, chunk.data, length);
+        ok = stream_write_exact(output_fd, chunk.data, length);
+        counter += (u32)(length / 64u);
+        remaining -= (u64)length;
+    }
+    if (ok) {
+        poly1305_pad16(mac, (usize)plain_size);
+        u8 length_block[16];
+        write_le_u64(length_block, (u64)ENCRYPTION_HEADER_BYTES);
+        write_le_u64(length_block + 8u, plain_size);
+        poly1305_process_block(mac, length_block, POLY1305_FULL_BLOCK);
+        u8 tag[ENCRYPTION_TAG_BYTES];
+        poly1305_finish(mac, initial_block + 16u, tag);
+        ok = stream_write_exact(output_fd, tag, ENCRYPTION_TAG_BYTES);
+    }
+    for (u32 i = 0u; i < 64u; ++i) {
+        initial_block[i] = 0u;
+    }
+    for (u32 i = 0u; i < 32u; ++i) {
+        key[i] = 0u;
+    }
+    if (ok) {
+        output_size = (u64)ENCRYPTION_HEADER_BYTES + plain_size + (u64)ENCRYPTION_TAG_BYTES;
+    }
+    return ok;
+}
+
 static DecryptStatus decrypt_payload_buffer(const u8* data,
                                             usize data_length,
                                             const char* password,
                                             usize password_length,
                                             ByteBuffer& plaintext) {
+    StatsTimer stats_timer(StatsStage_Decrypt);
     plaintext.release();
     if (!data || data_length < ENCRYPTION_HEADER_BYTES + ENCRYPTION_TAG_BYTES) {
         return DecryptStatus_NotEncrypted;
@@ -7664,7 +8337,9 @@ static bool fisher_yates_shuffle(u8* data, usize count) {
     return true;
 }
 
-static bool fisher_yates_unshuffle(u8* data, usize count) {
+// `companion`, when given, is a parallel array that receives the same
+// permutation (used to carry erasure flags along with the payload bytes).
+static bool fisher_yates_unshuffle(u8* data, usize count, u8* companion = 0) {
     if (!data || count <= 1u) {
         return true;
     }
@@ -7690,14 +8365,90 @@ static bool fisher_yates_unshuffle(u8* data, usize count) {
         u8 temp = data[i];
         data[i] = data[j];
         data[j] = temp;
+        if (companion) {
+            temp = companion[i];
+            companion[i] = companion[j];
+            companion[j] = temp;
+        }
     }
     free(history);
     return true;
 }
 
 static bool shuffle_encoded_stream(u8* data, usize byte_count, bool ecc_enabled);
-static bool unshuffle_encoded_stream(u8* data, usize byte_count);
+static bool unshuffle_encoded_stream(u8* data, usize byte_count, u8* companion = 0);
+
+// Bit streams are little-endian: bit i lives in byte i / 8 at position i % 8.
+// The word helpers assemble bytes explicitly so they stay endian-neutral;
+// compilers lower them to single loads and stores.
+static inline u64 load_le_u64(const u8* data) {
+    return (u64)data[0] |
+           ((u64)data[1] << 8u) |
+           ((u64)data[2] << 16u) |
+           ((u64)data[3] << 24u) |
+           ((u64)data[4] << 32u) |
+           ((u64)data[5] << 40u) |
+           ((u64)data[6] << 48u) |
+           ((u64)data[7] << 56u);
+}
+
+static inline void store_le_u64(u8* data, u64 value) {
+    for (u32 i = 0u; i < 8u; ++i) {
+        data[i] = (u8)(value >> (i * 8u));
+    }
+}
+
+// ORs `bit_count` bits starting at `source_bit` into `dest` starting at
+// `dest_bit`. The destination range must already be zero. Byte-aligned copies
+// are a memcpy; unaligned ones move 56 bits per step with one shift each way.
+static void copy_bits(u8* dest, u64 dest_bit, const u8* source, u64 source_bit, u64 bit_count) {
+    if (!bit_count) {
+        return;
+    }
+    u8* out = dest + (usize)(dest_bit >> 3u);
+    const u8* in = source + (usize)(source_bit >> 3u);
+    u32 dest_shift = (u32)(dest_bit & 7u);
+    u32 source_shift = (u32)(source_bit & 7u);
+    if (dest_shift == 0u && source_shift == 0u) {
+        usize whole_bytes = (usize)(bit_count >> 3u);
+        memcpy(out, in, whole_bytes);
+        u32 tail_bits = (u32)(bit_count & 7u);
+        if (tail_bits) {
+            out[whole_bytes] = (u8)(out[whole_bytes] | (in[whole_bytes] & ((1u << tail_bits) - 1u)));
+        }
+        return;
+    }
+    // Both ranges span at least 64 bits past their first byte here, so the
+    // eight-byte loads and stores stay inside them.
+    while (bit_count >= 64u) {
+        u64 chunk = (load_le_u64(in) >> source_shift) & ((1ull << 56u) - 1ull);
+        store_le_u64(out, load_le_u64(out) | (chunk << dest_shift));
+        in += 7u;
+        out += 7u;
+        bit_count -= 56u;
+    }
+    while (bit_count) {
+        u32 take = 8u - (source_shift > dest_shift ? source_shift : dest_shift);
+        if (take > bit_count) {
+            take = (u32)bit_count;
+        }
+        u32 bits = ((u32)in[0] >> source_shift) & ((1u << take) - 1u);
+        out[0] = (u8)(out[0] | (bits << dest_shift));
+        source_shift += take;
+        dest_shift += take;
+        if (source_shift == 8u) {
+            source_shift = 0u;
+            ++in;
+        }
+        if (dest_shift == 8u) {
+            dest_shift = 0u;
+            ++out;
+        }
+        bit_count -= take;
+    }
+}
 
+// Bits past bit_position are always zero, so writes only OR into the buffer.
 struct BitWriter {
     ByteBuffer buffer;
     usize bit_position;
@@ -7720,27 +8471,30 @@ struct BitWriter {
         return buffer.ensure(target_bytes);
     }
 
-    bool write_bit(u8 value) {
+    // Extends the written bytes to cover `target_bits`, zero-filling new bytes.
+    bool grow_bits(usize target_bits) {
         if (failed) {
             return false;
         }
-        if (!ensure_bits(bit_position + 1u)) {
+        usize target_bytes = (target_bits + 7u) >> 3u;
+        if (target_bytes <= buffer.size) {
+            return true;
+        }
+        if (target_bits < bit_position || !buffer.ensure(target_bytes)) {
             failed = true;
             return false;
         }
-        usize byte_index = bit_position >> 3u;
-        usize bit_offset = bit_position & 7u;
-        u8 mask = (u8)(1u << bit_offset);
-        if (byte_index >= buffer.size) {
-            if (!buffer.push(0u)) {
-                failed = true;
-                return false;
-            }
+        memset(buffer.data + buffer.size, 0, target_bytes - buffer.size);
+        buffer.size = target_bytes;
+        return true;
+    }
+
+    bool write_bit(u8 value) {
+        if (!grow_bits(bit_position + 1u)) {
+            return false;
         }
         if (value & 1u) {
-            buffer.data[byte_index] = (u8)(buffer.data[byte_index] | mask);
-        } else {
-            buffer.data[byte_index] = (u8)(buffer.data[byte_index] & (u8)(~mask));
+            buffer.data[bit_position >> 3u] = (u8)(buffer.data[bit_position >> 3u] | (1u << (bit_position & 7u)));
         }
         ++bit_position;
         return true;
@@ -7750,12 +8504,46 @@ struct BitWriter {
         if (count > 64u) {
             count = 64u;
         }
-        for (usize i = 0; i < count; ++i) {
-            u8 bit = (u8)((value >> i) & 1u);
-            if (!write_bit(bit)) {
-                return false;
+        if (!count) {
+            return !failed;
+        }
+        if (!grow_bits(bit_position + count)) {
+            return false;
+        }
+        if (count < 64u) {
+            value &= (1ull << count) - 1ull;
+        }
+        u8* out = buffer.data + (bit_position >> 3u);
+        u32 shift = (u32)(bit_position & 7u);
+        usize span_bytes = (shift + count + 7u) >> 3u;
+        if (span_bytes >= 8u) {
+            store_le_u64(out, load_le_u64(out) | (value << shift));
+            if (span_bytes > 8u) {
+                out[8] = (u8)(out[8] | (value >> (64u - shift)));
+            }
+        } else {
+            u64 shifted = value << shift;
+            for (usize i = 0u; i < span_bytes; ++i) {
+                out[i] = (u8)(out[i] | (u8)(shifted >> (i * 8u)));
             }
         }
+        bit_position += count;
+        return true;
+    }
+
+    // Appends `bit_count` bits from `source` (zeros when `source` is null).
+    bool append_bits(const u8* source, u64 bit_count) {
+        if (bit_count > (u64)USIZE_MAX_VALUE - (u64)bit_position) {
+            failed = true;
+            return false;
+        }
+        if (!grow_bits(bit_position + (usize)bit_count)) {
+            return false;
+        }
+        if (source) {
+            copy_bits(buffer.data, bit_position, source, 0u, bit_count);
+        }
+        bit_position += (usize)bit_count;
         return true;
     }
 
@@ -7764,13 +8552,7 @@ struct BitWriter {
         if (!remainder) {
             return true;
         }
-        usize missing = 8u - remainder;
-        for (usize i = 0; i < missing; ++i) {
-            if (!write_bit(0u)) {
-                return false;
-            }
-        }
-        return true;
+        return write_bits(0u, 8u - remainder);
     }
 
     const u8* data() const {
@@ -7816,11 +8598,38 @@ struct BitReader {
         if (count > 64u) {
             count = 64u;
         }
+        if (!data || count > bit_count - (cursor < bit_count ? cursor : bit_count)) {
+            // Short reads keep their bit-at-a-time semantics: the available
+            // bits are returned and the reader is marked failed.
+            u64 result = 0u;
+            for (usize i = 0; i < count; ++i) {
+                u8 bit = read_bit();
+                result |= ((u64)bit) << i;
+            }
+            return result;
+        }
+        if (!count) {
+            return 0u;
+        }
+        const u8* in = data + (cursor >> 3u);
+        u32 shift = (u32)(cursor & 7u);
+        usize span_bytes = (shift + count + 7u) >> 3u;
         u64 result = 0u;
-        for (usize i = 0; i < count; ++i) {
-            u8 bit = read_bit();
-            result |= ((u64)bit) << i;
+        if (span_bytes >= 8u) {
+            result = load_le_u64(in) >> shift;
+            if (span_bytes > 8u) {
+                result |= (u64)in[8] << (64u - shift);
+            }
+        } else {
+            for (usize i = 0u; i < span_bytes; ++i) {
+                result |= (u64)in[i] << (i * 8u);
+            }
+            result >>= shift;
+        }
+        if (count < 64u) {
+            result &= (1ull << count) - 1ull;
         }
+        cursor += count;
         return result;
     }
 
@@ -7839,8 +8648,147 @@ struct BitReader {
 };
 
 static const usize LZMA_HEADER_BYTES = (usize)LZMA_PROPS_SIZE + 8u;
+// First header byte of a payload stored without compression. Real LZMA props
+// bytes encode lc + lp*9 + pb*45 and never exceed 224.
+static const u8 LZMA_STORED_MARKER = 0xFFu;
+// First header byte of a block container (see LzmaBlockIndex).
+static const u8 LZMA_BLOCKS_MARKER = 0xFEu;
+// Inputs at least this large are entropy-probed before compressing; smaller
+// ones are simply compressed and stored if that did not pay off.
+static const u64 LZMA_PROBE_MIN_BYTES = 64u * 1024u;
+static const usize LZMA_PROBE_WINDOW_BYTES = 64u * 1024u;
+static const u32 LZMA_PROBE_WINDOWS = 16u;
+// Order-0 entropy (bits per byte) above which the sampled input is treated as
+// already compressed or encrypted.
+static const double LZMA_PROBE_STORE_ENTROPY = 7.9;
+
+enum CompressionProfile {
+    CompressionProfile_Fast = 0,
+    CompressionProfile_Default,
+    CompressionProfile_Max,
+    CompressionProfile_Store
+};
+
+static bool parse_compression_profile(const char* text, usize length, CompressionProfile& profile) {
+    if (ascii_equals_token(text, length, "fast")) {
+        profile = CompressionProfile_Fast;
+    } else if (ascii_equals_token(text, length, "default")) {
+        profile = CompressionProfile_Default;
+    } else if (ascii_equals_token(text, length, "max")) {
+        profile = CompressionProfile_Max;
+    } else if (ascii_equals_token(text, length, "store")) {
+        profile = CompressionProfile_Store;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Encoder settings per profile. The dictionary is the smallest power of two
+// covering the input (capped per profile): a larger window finds nothing more
+// and only costs allocation and match-finder setup.
+static void lzma_profile_props(CompressionProfile profile, u64 length, CLzmaEncProps& props) {
+    LzmaEncProps_Init(&props);
+    u32 dictionary_cap = (1u << 26);
+    props.level = 7;
+    props.fb = 64;
+    if (profile == CompressionProfile_Fast) {
+        props.level = 1;
+        props.fb = 32;
+        dictionary_cap = (1u << 22);
+    } else if (profile == CompressionProfile_Max) {
+        props.level = 9;
+        props.fb = 273;
+        dictionary_cap = (1u << 27);
+    }
+    u32 dictionary = (1u << 12);
+    while ((u64)dictionary < length && dictionary < dictionary_cap) {
+        dictionary <<= 1u;
+    }
+    props.dictSize = dictionary;
+    props.lc = 3;
+    props.lp = 0;
+    props.pb = 2;
+    props.numThreads = 2;
+}
+
+static void lzma_probe_accumulate(const u8* data, usize length, u64* histogram) {
+    for (usize i = 0u; i < length; ++i) {
+        ++histogram[data[i]];
+    }
+}
+
+static bool lzma_probe_histogram_incompressible(const u64* histogram, u64 total) {
+    if (total == 0u) {
+        return false;
+    }
+    double entropy = 0.0;
+    for (u32 i = 0u; i < 256u; ++i) {
+        if (histogram[i] == 0u) {
+            continue;
+        }
+        double p = (double)histogram[i] / (double)total;
+        entropy -= p * log(p);
+    }
+    entropy /= log(2.0);
+    return entropy >= LZMA_PROBE_STORE_ENTROPY;
+}
+
+// Offset of probe window `index`; windows are spread evenly over the input.
+static u64 lzma_probe_window_offset(u64 length, u32 index) {
+    if (length <= (u64)LZMA_PROBE_WINDOW_BYTES) {
+        return 0u;
+    }
+    u64 span = length - (u64)LZMA_PROBE_WINDOW_BYTES;
+    return (span / (u64)(LZMA_PROBE_WINDOWS - 1u)) * (u64)index;
+}
+
+static bool lzma_probe_incompressible(const u8* input, u64 length) {
+    if (length < LZMA_PROBE_MIN_BYTES) {
+        return false;
+    }
+    u64 histogram[256] = {0u};
+    u64 total = 0u;
+    for (u32 w = 0u; w < LZMA_PROBE_WINDOWS; ++w) {
+        u64 offset = lzma_probe_window_offset(length, w);
+        usize window = (usize)(((length - offset) < (u64)LZMA_PROBE_WINDOW_BYTES)
+                                   ? (length - offset)
+                                   : (u64)LZMA_PROBE_WINDOW_BYTES);
+        lzma_probe_accumulate(input + offset, window, histogram);
+        total += (u64)window;
+    }
+    return lzma_probe_histogram_incompressible(histogram, total);
+}
+
+static void lzma_write_stored_header(u8* header, u64 length) {
+    header[0] = LZMA_STORED_MARKER;
+    for (usize i = 1u; i < (usize)LZMA_PROPS_SIZE; ++i) {
+        header[i] = 0u;
+    }
+    write_le_u64(header + LZMA_PROPS_SIZE, length);
+}
+
+static bool lzma_store(const u8* input, usize length, ByteBuffer& output) {
+    output.release();
+    if (USIZE_MAX_VALUE - LZMA_HEADER_BYTES < length) {
+        return false;
+    }
+    if (!output.ensure(LZMA_HEADER_BYTES + length)) {
+        return false;
+    }
+    lzma_write_stored_header(output.data, (u64)length);
+    if (length > 0u) {
+        memcpy(output.data + LZMA_HEADER_BYTES, input, length);
+    }
+    output.size = LZMA_HEADER_BYTES + length;
+    return true;
+}
 
-static bool lzma_compress(const u8* input, usize length, ByteBuffer& output) {
+static bool lzma_compress(const u8* input,
+                          usize length,
+                          ByteBuffer& output,
+                          CompressionProfile profile = CompressionProfile_Default) {
+    StatsTimer stats_timer(StatsStage_Compress);
     output.release();
     if (!input && length > 0u) {
         return false;
@@ -7848,6 +8796,11 @@ static bool lzma_compress(const u8* input, usize length, ByteBuffer& output) {
     if (length > (usize)SIZE_MAX) {
         return false;
     }
+    if (profile == CompressionProfile_Store || lzma_probe_incompressible(input, (u64)length)) {
+        return lzma_store(input, length, output);
+    }
+    CLzmaEncProps encoder_props;
+    lzma_profile_props(profile, (u64)length, encoder_props);
     const u8 zero = 0u;
     const u8* source = (length > 0u) ? input : &zero;
     usize header = LZMA_HEADER_BYTES;
@@ -7897,20 +8850,21 @@ static bool lzma_compress(const u8* input, usize length, ByteBuffer& output) {
         size_t dest_len = available;
         size_t src_len = (size_t)length;
         props_size = LZMA_PROPS_SIZE;
-        int status = LzmaCompress(output.data + header,
-                                  &dest_len,
-                                  source,
-                                  src_len,
-                                  props,
-                                  &props_size,
-                                  9,
-                                  (1u << 27),
-                                  3,
-                                  0,
-                                  2,
-                                  273,
-                                  2);
+        int status = LzmaEncode(output.data + header,
+                                &dest_len,
+                                source,
+                                src_len,
+                                &encoder_props,
+                                props,
+                                &props_size,
+                                0,
+                                NULL,
+                                &g_Alloc,
+                                &g_Alloc);
         if (status == SZ_OK) {
+            if ((usize)dest_len >= length) {
+                return lzma_store(input, length, output);
+            }
             for (usize i = 0u; i < (usize)LZMA_PROPS_SIZE; ++i) {
                 output.data[i] = props[i];
             }
@@ -7940,9 +8894,185 @@ static bool lzma_compress(const u8* input, usize length, ByteBuffer& output) {
     return false;
 }
 
-static bool lzma_decompress(const u8* input,
-                            usize bit_count,
-                            ByteBuffer& output) {
+// Streaming counterpart of lzma_compress for `encode --stream`: the encoder
+// pulls the archive from one descriptor and pushes the .lzma stream to
+// another, so only the encoder window is ever resident.
+struct LzmaFdReader {
+    ISeqInStream stream;
+    int fd;
+    u64 remaining;
+    bool failed;
+};
+
+struct LzmaFdWriter {
+    ISeqOutStream stream;
+    int fd;
+    u64 written;
+    bool failed;
+};
+
+static SRes lzma_fd_read(void* p, void* buf, size_t* size) {
+    LzmaFdReader* reader = (LzmaFdReader*)p;
+    usize request = (usize)*size;
+    *size = 0u;
+    if (request > STREAM_IO_CHUNK_BYTES) {
+        request = STREAM_IO_CHUNK_BYTES;
+    }
+    if ((u64)request > reader->remaining) {
+        request = (usize)reader->remaining;
+    }
+    if (request == 0u) {
+        return SZ_OK;
+    }
+    int result = read(reader->fd, buf, (unsigned long)request);
+    if (result <= 0) {
+        reader->failed = true;
+        return SZ_ERROR_READ;
+    }
+    reader->remaining -= (u64)result;
+    *size = (size_t)result;
+    return SZ_OK;
+}
+
+static size_t lzma_fd_write(void* p, const void* buf, size_t size) {
+    LzmaFdWriter* writer = (LzmaFdWriter*)p;
+    if (writer->failed || !stream_write_exact(writer->fd, (const u8*)buf, (usize)size)) {
+        writer->failed = true;
+        return 0u;
+    }
+    writer->written += (u64)size;
+    return size;
+}
+
+// Same windows as lzma_probe_incompressible, read with pread so the input
+// descriptor's position is left alone.
+static bool lzma_probe_incompressible_fd(int fd, u64 length) {
+    if (length < LZMA_PROBE_MIN_BYTES) {
+        return false;
+    }
+    u8* window = (u8*)malloc(LZMA_PROBE_WINDOW_BYTES);
+    if (!window) {
+        return false;
+    }
+    u64 histogram[256] = {0u};
+    u64 total = 0u;
+    bool ok = true;
+    for (u32 w = 0u; ok && w < LZMA_PROBE_WINDOWS; ++w) {
+        u64 offset = lzma_probe_window_offset(length, w);
+        usize wanted = (usize)(((length - offset) < (u64)LZMA_PROBE_WINDOW_BYTES)
+                                   ? (length - offset)
+                                   : (u64)LZMA_PROBE_WINDOW_BYTES);
+        usize done = 0u;
+        while (done < wanted) {
+            long result = pread(fd, window + done, (unsigned long)(wanted - done), (long)(offset + done));
+            if (result <= 0) {
+                ok = false;
+                break;
+            }
+            done += (usize)result;
+        }
+        lzma_probe_accumulate(window, done, histogram);
+        total += (u64)done;
+    }
+    free(window);
+    return ok && lzma_probe_histogram_incompressible(histogram, total);
+}
+
+static bool lzma_store_fd(int input_fd, u64 length, int output_fd, u64& output_size) {
+    output_size = 0u;
+    u8 header[LZMA_HEADER_BYTES];
+    lzma_write_stored_header(header, length);
+    if (!stream_write_exact(output_fd, header, LZMA_HEADER_BYTES)) {
+        return false;
+    }
+    usize chunk_capacity = (length < (u64)STREAM_IO_CHUNK_BYTES) ? (usize)length : STREAM_IO_CHUNK_BYTES;
+    u8* chunk = (u8*)malloc(chunk_capacity ? chunk_capacity : 1u);
+    if (!chunk) {
+        return false;
+    }
+    u64 remaining = length;
+    bool ok = true;
+    while (ok && remaining > 0u) {
+        usize slice = (remaining < (u64)chunk_capacity) ? (usize)remaining : chunk_capacity;
+        ok = stream_read_exact(input_fd, chunk, slice) && stream_write_exact(output_fd, chunk, slice);
+        remaining -= (u64)slice;
+    }
+    free(chunk);
+    if (ok) {
+        output_size = (u64)LZMA_HEADER_BYTES + length;
+    }
+    return ok;
+}
+
+static bool lzma_compress_fd(int input_fd,
+                             u64 length,
+                             int output_fd,
+                             u64& output_size,
+                             CompressionProfile profile = CompressionProfile_Default) {
+    StatsTimer stats_timer(StatsStage_Compress);
+    output_size = 0u;
+    if (profile == CompressionProfile_Store || lzma_probe_incompressible_fd(input_fd, length)) {
+        return lzma_store_fd(input_fd, length, output_fd, output_size);
+    }
+    long input_start = lseek(input_fd, 0, 1);
+    long output_start = lseek(output_fd, 0, 1);
+    if (input_start < 0 || output_start < 0) {
+        return false;
+    }
+    CLzmaEncHandle encoder = LzmaEnc_Create(&g_Alloc);
+    if (!encoder) {
+        return false;
+    }
+    // Same settings lzma_compress passes to LzmaEncode, which runs the
+    // identical LzmaEnc_Encode loop, so both paths emit byte-identical output.
+    CLzmaEncProps props;
+    lzma_profile_props(profile, length, props);
+    u8 header[LZMA_HEADER_BYTES];
+    SizeT props_size = LZMA_PROPS_SIZE;
+    LzmaFdWriter writer;
+    writer.stream.Write = lzma_fd_write;
+    writer.fd = output_fd;
+    writer.written = 0u;
+    writer.failed = false;
+    LzmaFdReader reader;
+    reader.stream.Read = lzma_fd_read;
+    reader.fd = input_fd;
+    reader.remaining = length;
+    reader.failed = false;
+    bool ok = (LzmaEnc_SetProps(encoder, &props) == SZ_OK) &&
+              (LzmaEnc_WriteProperties(encoder, header, &props_size) == SZ_OK);
+    if (ok) {
+        write_le_u64(header + LZMA_PROPS_SIZE, length);
+        ok = (lzma_fd_write(&writer, header, LZMA_HEADER_BYTES) == LZMA_HEADER_BYTES);
+    }
+    if (ok) {
+        SRes status = LzmaEnc_Encode(encoder, &writer.stream, &reader.stream, 0, &g_Alloc, &g_Alloc);
+        ok = (status == SZ_OK) && !reader.failed && !writer.failed && reader.remaining == 0u;
+    }
+    LzmaEnc_Destroy(encoder, &g_Alloc, &g_Alloc);
+    if (!ok) {
+        return false;
+    }
+    if (writer.written - (u64)LZMA_HEADER_BYTES >= length) {
+        // Compression did not pay off; rewrite the output as a stored payload.
+        if (lseek(input_fd, input_start, 0) != input_start ||
+            lseek(output_fd, output_start, 0) != output_start ||
+            ftruncate(output_fd, output_start) != 0) {
+            return false;
+        }
+        return lzma_store_fd(input_fd, length, output_fd, output_size);
+    }
+    output_size = writer.written;
+    return true;
+}
+
+static bool lzma_blocks_decompress_all(const u8* input, usize byte_count, ByteBuffer& output);
+
+// lzma_decompress without the --stats timer. Blocks of a container come
+// through here so that only the outermost call is timed and counted.
+static bool lzma_decompress_untimed(const u8* input,
+                                    usize bit_count,
+                                    ByteBuffer& output) {
     output.release();
     if (!input) {
         return (bit_count == 0u);
@@ -7961,6 +9091,21 @@ static bool lzma_decompress(const u8* input,
     if (original > (u64)USIZE_MAX_VALUE) {
         return false;
     }
+    if (input[0] == LZMA_BLOCKS_MARKER) {
+        return lzma_blocks_decompress_all(input, byte_count, output);
+    }
+    if (input[0] == LZMA_STORED_MARKER) {
+        // Trailing frame padding may follow the stored bytes, as with LZMA.
+        if ((u64)(byte_count - LZMA_HEADER_BYTES) < original) {
+            return false;
+        }
+        if (!output.ensure(original ? (usize)original : 1u)) {
+            return false;
+        }
+        memcpy(output.data, input + LZMA_HEADER_BYTES, (usize)original);
+        output.size = (usize)original;
+        return true;
+    }
     usize output_size = (usize)original;
     usize required = output_size ? output_size : 1u;
     if (required > (usize)SIZE_MAX) {
@@ -7995,22 +9140,241 @@ static bool lzma_decompress(const u8* input,
     return true;
 }
 
+static bool lzma_decompress(const u8* input,
+                            usize bit_count,
+                            ByteBuffer& output) {
+    StatsTimer stats_timer(StatsStage_Decompress);
+    return lzma_decompress_untimed(input, bit_count, output);
+}
+
+
+// Block container written by `encode --compression-block`. The archive is cut
+// into fixed-size slices that lzma_compress handles independently, so they can
+// be compressed on separate threads, behind an index:
+//   [0] LZMA_BLOCKS_MARKER, [1] version, [2..4] zero, [5..12] u64 total length
+//   u32 block size, u32 block count, u32 entry count
+//   per block: u64 data offset, u64 compressed size, u32 uncompressed size
+//   per entry: u64 archive offset, u64 record length, u32 path length, path
+//   block data, each slice a complete lzma_compress stream (LZMA or stored)
+// The entry table lets decode restore one path by decompressing only the
+// blocks its archive record spans.
+static const u8 LZMA_BLOCKS_VERSION = 1u;
+static const usize LZMA_BLOCKS_HEADER_BYTES = LZMA_HEADER_BYTES + 12u;
+static const usize LZMA_BLOCKS_BLOCK_BYTES = 20u;
+static const usize LZMA_BLOCKS_ENTRY_FIXED_BYTES = 20u;
+
+struct LzmaBlockIndex {
+    const u8* input;
+    u64 total_length;
+    u32 block_size;
+    u32 block_count;
+    u32 entry_count;
+    const u8* blocks;
+    const u8* entries;
+    const u8* block_data;
+    usize block_data_size;
+
+    LzmaBlockIndex()
+        : input(0),
+          total_length(0u),
+          block_size(0u),
+          block_count(0u),
+          entry_count(0u),
+          blocks(0),
+          entries(0),
+          block_data(0),
+          block_data_size(0u) {}
+};
 
-struct EncoderConfig {
-    u32 metadata_key_count;
-    u32 fiducial_density;
+static bool lzma_blocks_parse(const u8* input, usize byte_count, LzmaBlockIndex& index) {
+    index = LzmaBlockIndex();
+    if (!input || byte_count < LZMA_BLOCKS_HEADER_BYTES || input[0] != LZMA_BLOCKS_MARKER) {
+        return false;
+    }
+    if (input[1] != LZMA_BLOCKS_VERSION) {
+        return false;
+    }
+    index.input = input;
+    index.total_length = read_le_u64(input + LZMA_PROPS_SIZE);
+    index.block_size = read_le_u32(input + LZMA_HEADER_BYTES);
+    index.block_count = read_le_u32(input + LZMA_HEADER_BYTES + 4u);
+    index.entry_count = read_le_u32(input + LZMA_HEADER_BYTES + 8u);
+    if (index.block_size == 0u || index.total_length > (u64)USIZE_MAX_VALUE) {
+        return false;
+    }
+    u64 expected_blocks = (index.total_length + index.block_size - 1u) / index.block_size;
+    if ((u64)index.block_count != expected_blocks) {
+        return false;
+    }
+    usize cursor = LZMA_BLOCKS_HEADER_BYTES;
+    if ((byte_count - cursor) / LZMA_BLOCKS_BLOCK_BYTES < (usize)index.block_count) {
+        return false;
+    }
+    index.blocks = input + cursor;
+    cursor += (usize)index.block_count * LZMA_BLOCKS_BLOCK_BYTES;
+    index.entries = input + cursor;
+    for (u32 i = 0u; i < index.entry_count; ++i) {
+        if ((byte_count - cursor) < LZMA_BLOCKS_ENTRY_FIXED_BYTES) {
+            return false;
+        }
+        u32 path_length = read_le_u32(input + cursor + 16u);
+        cursor += LZMA_BLOCKS_ENTRY_FIXED_BYTES;
+        if ((byte_count - cursor) < (usize)path_length) {
+            return false;
+        }
+        cursor += (usize)path_length;
+    }
+    index.block_data = input + cursor;
+    index.block_data_size = byte_count - cursor;
+    return true;
+}
+
+static bool lzma_blocks_decompress_block(const LzmaBlockIndex& index, u32 block, ByteBuffer& output) {
+    output.release();
+    if (block >= index.block_count) {
+        return false;
+    }
+    const u8* entry = index.blocks + (usize)block * LZMA_BLOCKS_BLOCK_BYTES;
+    u64 offset = read_le_u64(entry);
+    u64 size = read_le_u64(entry + 8u);
+    u32 expected = read_le_u32(entry + 16u);
+    if (offset > (u64)index.block_data_size || size > (u64)index.block_data_size - offset) {
+        return false;
+    }
+    if (size > (u64)(USIZE_MAX_VALUE >> 3u)) {
+        return false;
+    }
+    const u8* data = index.block_data + (usize)offset;
+    if (size > 0u && data[0] == LZMA_BLOCKS_MARKER) {
+        return false;
+    }
+    if (!lzma_decompress_untimed(data, (usize)size * 8u, output)) {
+        return false;
+    }
+    return output.size == (usize)expected;
+}
+
+static bool lzma_blocks_decompress_all(const u8* input, usize byte_count, ByteBuffer& output) {
+    output.release();
+    LzmaBlockIndex index;
+    if (!lzma_blocks_parse(input, byte_count, index)) {
+        return false;
+    }
+    usize total = (usize)index.total_length;
+    if (!output.ensure(total ? total : 1u)) {
+        return false;
+    }
+    ByteBuffer block;
+    usize cursor = 0u;
+    for (u32 b = 0u; b < index.block_count; ++b) {
+        if (!lzma_blocks_decompress_block(index, b, block) || block.size > total - cursor) {
+            output.release();
+            return false;
+        }
+        memcpy(output.data + cursor, block.data, block.size);
+        cursor += block.size;
+    }
+    if (cursor != total) {
+        output.release();
+        return false;
+    }
+    output.size = total;
+    return true;
+}
+
+// Archive paths match a requested path exactly or as a parent directory.
+static bool payload_path_matches(const char* entry_path,
+                                 usize entry_length,
+                                 const char* path,
+                                 usize path_length) {
+    while (path_length > 0u && path[path_length - 1u] == '/') {
+        --path_length;
+    }
+    if (path_length == 0u || entry_length < path_length) {
+        return false;
+    }
+    for (usize i = 0u; i < path_length; ++i) {
+        if (entry_path[i] != path[i]) {
+            return false;
+        }
+    }
+    return entry_length == path_length || entry_path[path_length] == '/';
+}
+
+// Appends the archive records whose path matches `path` to `records`,
+// decompressing only the blocks they span (one block is cached at a time,
+// since records are stored in archive order).
+static bool lzma_blocks_extract_records(const LzmaBlockIndex& index,
+                                        const char* path,
+                                        usize path_length,
+                                        ByteBuffer& records,
+                                        u32& record_count) {
+    StatsTimer stats_timer(StatsStage_Decompress);
+    records.release();
+    record_count = 0u;
+    ByteBuffer block;
+    u32 cached_block = index.block_count;
+    const u8* cursor = index.entries;
+    for (u32 i = 0u; i < index.entry_count; ++i) {
+        u64 offset = read_le_u64(cursor);
+        u64 length = read_le_u64(cursor + 8u);
+        u32 name_length = read_le_u32(cursor + 16u);
+        const char* name = (const char*)(cursor + LZMA_BLOCKS_ENTRY_FIXED_BYTES);
+        cursor += LZMA_BLOCKS_ENTRY_FIXED_BYTES + (usize)name_length;
+        if (!payload_path_matches(name, (usize)name_length, path, path_length)) {
+            continue;
+        }
+        if (offset > index.total_length || length > index.total_length - offset) {
+            return false;
+        }
+        if (!records.ensure(records.size + (usize)length)) {
+            return false;
+        }
+        u64 copied = 0u;
+        while (copied < length) {
+            u64 position = offset + copied;
+            u32 b = (u32)(position / index.block_size);
+            if (b != cached_block) {
+                if (!lzma_blocks_decompress_block(index, b, block)) {
+                    return false;
+                }
+                cached_block = b;
+            }
+            u64 within = position - (u64)b * index.block_size;
+            if (within >= (u64)block.size) {
+                return false;
+            }
+            u64 span = (u64)block.size - within;
+            if (span > length - copied) {
+                span = length - copied;
+            }
+            memcpy(records.data + records.size, block.data + (usize)within, (usize)span);
+            records.size += (usize)span;
+            copied += span;
+        }
+        ++record_count;
+    }
+    return true;
+}
+
+struct EncoderConfig {
+    u32 metadata_key_count;
+    u32 fiducial_density;
     double ecc_redundancy;
     u32 max_parallelism;
+    CompressionProfile compression;
 
     EncoderConfig()
         : metadata_key_count(0u),
           fiducial_density(0u),
           ecc_redundancy(0.0),
-          max_parallelism(1u) {}
+          max_parallelism(1u),
+          compression(CompressionProfile_Default) {}
 };
 
 struct EccSummary {
     bool enabled;
+    bool interleaved;
     u16 block_data_symbols;
     u16 parity_symbols;
     double redundancy;
@@ -8019,6 +9383,7 @@ struct EccSummary {
 
     EccSummary()
         : enabled(false),
+          interleaved(false),
           block_data_symbols(0u),
           parity_symbols(0u),
           redundancy(0.0),
@@ -8032,13 +9397,15 @@ struct EccDecodeStats {
     u64 total_blocks;
     u64 blocks_with_errors;
     u64 header_copy_repairs;
+    u64 erasure_symbols;
 
     EccDecodeStats()
         : corrected_symbols(0u),
           total_parity_symbols(0u),
           total_blocks(0u),
           blocks_with_errors(0u),
-          header_copy_repairs(0u) {}
+          header_copy_repairs(0u),
+          erasure_symbols(0u) {}
 };
 
 static bool encode_payload_with_ecc(const ByteBuffer& compressed,
@@ -8053,6 +9420,9 @@ struct EncoderContext {
     ByteBuffer encryption_password;
     bool configured;
     bool encryption_enabled;
+    // payload_bytes already holds the compressed payload (see
+    // adopt_compressed_payload), so encode_payload must not compress it again.
+    bool payload_compressed;
 
     EccSummary ecc_summary;
 
@@ -8063,6 +9433,7 @@ struct EncoderContext {
           encryption_password(),
           configured(false),
           encryption_enabled(false),
+          payload_compressed(false),
           ecc_summary() {}
 
     ~EncoderContext() {
@@ -8075,21 +9446,36 @@ struct EncoderContext {
         encryption_password.release();
         configured = false;
         encryption_enabled = false;
+        payload_compressed = false;
         ecc_summary = EccSummary();
     }
 
     bool set_payload(const u8* data, usize size) {
         payload_bytes.release();
+        payload_compressed = false;
         if (!payload_bytes.ensure(size)) {
             return false;
         }
-        for (usize i = 0; i < size; ++i) {
-            payload_bytes.data[i] = data[i];
+        if (size) {
+            memcpy(payload_bytes.data, data, size);
         }
         payload_bytes.size = size;
         return true;
     }
 
+    // Takes ownership of a payload the caller already compressed (plain LZMA
+    // or a block container); `compressed` is left empty.
+    void adopt_compressed_payload(ByteBuffer& compressed) {
+        payload_bytes.release();
+        payload_bytes.data = compressed.data;
+        payload_bytes.size = compressed.size;
+        payload_bytes.capacity = compressed.capacity;
+        compressed.data = 0;
+        compressed.size = 0u;
+        compressed.capacity = 0u;
+        payload_compressed = true;
+    }
+
     bool set_password(const char* password, usize length) {
         encryption_password.release();
         encryption_enabled = false;
@@ -8109,7 +9495,17 @@ struct EncoderContext {
 
     bool encode_payload(ByteBuffer& output) {
         output.release();
-        return lzma_compress(payload_bytes.data, payload_bytes.size, output);
+        if (payload_compressed) {
+            if (!output.ensure(payload_bytes.size)) {
+                return false;
+            }
+            if (payload_bytes.size) {
+                memcpy(output.data, payload_bytes.data, payload_bytes.size);
+            }
+            output.size = payload_bytes.size;
+            return true;
+        }
+        return lzma_compress(payload_bytes.data, payload_bytes.size, output, config.compression);
     }
 
     bool build() {
@@ -8137,11 +9533,8 @@ struct EncoderContext {
                 ecc_summary = EccSummary();
             }
         } else {
-            for (usize i = 0u; i < payload_source->size; ++i) {
-                u8 byte = payload_source->data ? payload_source->data[i] : 0u;
-                if (!bit_writer.write_bits((u64)byte, 8u)) {
-                    return false;
-                }
+            if (!bit_writer.append_bits(payload_source->data, (u64)payload_source->size * 8u)) {
+                return false;
             }
             if (payload_source->size == 0u) {
                 ecc_summary = EccSummary();
@@ -8152,12 +9545,15 @@ struct EncoderContext {
             ecc_summary.block_data_symbols = 0u;
             ecc_summary.parity_symbols = 0u;
             ecc_summary.enabled = false;
+            ecc_summary.interleaved = false;
         }
         if (!bit_writer.align_to_byte()) {
             return false;
         }
         usize total_bytes = bit_writer.byte_size();
-        if (total_bytes > 0u) {
+        // Interleaved ECC streams already spread their blocks; only the
+        // legacy layouts go through the whole-stream shuffle.
+        if (total_bytes > 0u && !ecc_summary.interleaved) {
             u8* stream = bit_writer.buffer.data;
             if (!stream) {
                 return false;
@@ -8192,6 +9588,13 @@ static const usize ECC_HEADER_TOTAL_BITS = ECC_HEADER_COPY_TOTAL_BITS * ECC_HEAD
 static const usize ECC_HEADER_TOTAL_BYTES = ECC_HEADER_COPY_TOTAL_BYTES * ECC_HEADER_COPY_COUNT;
 static const u16 ECC_HEADER_COPY_DATA_SYMBOLS = (u16)ECC_HEADER_COPY_DATA_BYTES;
 static const u16 ECC_HEADER_COPY_PARITY_SYMBOLS = (u16)ECC_HEADER_COPY_PARITY_BYTES;
+static const u8  ECC_HEADER_FLAG_ENABLED = 0x01u;
+// Blocks are stored with EccInterleave instead of the legacy whole-stream
+// Fisher-Yates shuffle.
+static const u8  ECC_HEADER_FLAG_INTERLEAVED = 0x02u;
+// Blocks gathered per pass when (de)interleaving, so each column read or
+// write touches a contiguous run of the stream.
+static const u64 ECC_INTERLEAVE_TILE_BLOCKS = 64u;
 
 struct EccHeader {
     u16 magic;
@@ -8206,7 +9609,7 @@ struct EccHeader {
     EccHeader()
         : magic(ECC_HEADER_MAGIC),
           version(ECC_HEADER_VERSION),
-          flags(0x01u),
+          flags(ECC_HEADER_FLAG_ENABLED),
           block_data(0u),
           parity(0u),
           reserved(0u),
@@ -8275,7 +9678,7 @@ struct EccHeader {
         if (header.version != ECC_HEADER_VERSION) {
             return false;
         }
-        if (!(header.flags & 0x01u)) {
+        if (!(header.flags & ECC_HEADER_FLAG_ENABLED)) {
             return false;
         }
         if (header.block_data == 0u || header.parity == 0u) {
@@ -8297,6 +9700,55 @@ struct EccHeader {
     }
 };
 
+// Row-column interleave for RS codewords. Symbol j of block b is stored in
+// column j at row (b + column_offset[j]) % block_count, so every codeword is
+// spread evenly across the whole stream (and therefore across pages): a burst
+// of L bytes touches any one block at most ceil(L / block_count) times. The
+// keyed per-column rotation keeps periodic damage, such as a scratch running
+// down a pixel column, from landing on the same blocks. Both directions are
+// O(1) per symbol and need no scratch proportional to the stream.
+struct EccInterleave {
+    u64 block_count;
+    u16 block_total;
+    u64 column_offset[RS_POLY_CAPACITY];
+
+    EccInterleave() : block_count(0u), block_total(0u), column_offset() {}
+
+    bool configure(u16 total_symbols, u64 blocks) {
+        block_count = 0u;
+        block_total = 0u;
+        if (total_symbols == 0u || total_symbols > RS_FIELD_SIZE || blocks == 0u) {
+            return false;
+        }
+        if (blocks > (~0ull / (u64)total_symbols)) {
+            return false;
+        }
+        Pcg64Generator rng;
+        rng.seed(0u);
+        for (u16 j = 0u; j < total_symbols; ++j) {
+            column_offset[j] = rng.next() % blocks;
+        }
+        block_count = blocks;
+        block_total = total_symbols;
+        return true;
+    }
+
+    u64 position(u64 block, u16 symbol) const {
+        u64 row = block + column_offset[symbol];
+        if (row >= block_count) {
+            row -= block_count;
+        }
+        return (u64)symbol * block_count + row;
+    }
+
+    void locate(u64 stream_position, u64& block, u16& symbol) const {
+        symbol = (u16)(stream_position / block_count);
+        u64 row = stream_position - (u64)symbol * block_count;
+        u64 offset = column_offset[symbol];
+        block = (row >= offset) ? (row - offset) : (row + block_count - offset);
+    }
+};
+
 static bool header_copy_data_equal(const u8* left, const u8* right) {
     if (!left || !right) {
         return false;
@@ -8313,7 +9765,9 @@ static bool build_protected_header_copy(const EccHeader& header, u8* out_copy);
 static bool rs_decode_block(u8* block,
                             u16 data_symbols,
                             u16 parity_symbols,
-                            u16* corrected_errors);
+                            u16* corrected_errors,
+                            const u16* erasure_positions = 0,
+                            u16 erasure_count = 0u);
 
 static bool reconstruct_ecc_header_copies(const u8* bytes,
                                           usize byte_count,
@@ -8442,6 +9896,14 @@ struct ReedSolomonTables {
     bool initialized;
     u8 exp_table[512];
     u8 log_table[256];
+    // Full product table shared by the encoder and decoder kernels:
+    // mul_table[a][b] == a * b in GF(256).
+    u8 mul_table[256][256];
+    // Row a split by nibble for the shuffle kernel: mul_low[a][x] == a * x
+    // and mul_high[a][x] == a * (x << 4), so a * b is the XOR of one entry
+    // from each.
+    u8 mul_low[256][16];
+    u8 mul_high[256][16];
 };
 
 static ReedSolomonTables g_rs_tables;
@@ -8464,16 +9926,77 @@ static void rs_ensure_tables() {
         g_rs_tables.exp_table[i] = g_rs_tables.exp_table[i - RS_FIELD_SIZE];
     }
     g_rs_tables.log_table[0] = 0u;
+    for (u16 a = 0u; a < 256u; ++a) {
+        g_rs_tables.mul_table[a][0] = 0u;
+        g_rs_tables.mul_table[0][a] = 0u;
+    }
+    for (u16 a = 1u; a < 256u; ++a) {
+        u16 log_a = g_rs_tables.log_table[a];
+        for (u16 b = 1u; b < 256u; ++b) {
+            u16 log_sum = (u16)(log_a + g_rs_tables.log_table[b]);
+            g_rs_tables.mul_table[a][b] = g_rs_tables.exp_table[log_sum];
+        }
+    }
+    for (u16 a = 0u; a < 256u; ++a) {
+        for (u16 x = 0u; x < 16u; ++x) {
+            g_rs_tables.mul_low[a][x] = g_rs_tables.mul_table[a][x];
+            g_rs_tables.mul_high[a][x] = g_rs_tables.mul_table[a][x << 4u];
+        }
+    }
     g_rs_tables.initialized = true;
 }
 
+// Row `a` of the product table (row[b] == gf_mul(a, b)). Hot loops fetch the
+// row once and then pay a single lookup per symbol.
+static inline const u8* gf_mul_row(u8 a) {
+    rs_ensure_tables();
+    return g_rs_tables.mul_table[a];
+}
+
 static inline u8 gf_mul(u8 a, u8 b) {
-    if (!a || !b) {
-        return 0u;
+    return gf_mul_row(a)[b];
+}
+
+#if defined(MAKOCODE_X86_KERNELS)
+// 32 symbols per step: each nibble of the source indexes a 16-entry table
+// with VPSHUFB. Returns how many leading symbols it handled.
+__attribute__((target("avx2")))
+static usize gf_mul_add_region_avx2(u8* target, const u8* source, usize length, u8 scale) {
+    const __m256i low_table =
+        _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)g_rs_tables.mul_low[scale]));
+    const __m256i high_table =
+        _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)g_rs_tables.mul_high[scale]));
+    const __m256i nibble_mask = _mm256_set1_epi8(0x0F);
+    usize i = 0u;
+    for (; i + 32u <= length; i += 32u) {
+        __m256i symbols = _mm256_loadu_si256((const __m256i*)(source + i));
+        __m256i low = _mm256_and_si256(symbols, nibble_mask);
+        __m256i high = _mm256_and_si256(_mm256_srli_epi64(symbols, 4), nibble_mask);
+        __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low_table, low),
+                                           _mm256_shuffle_epi8(high_table, high));
+        __m256i current = _mm256_loadu_si256((const __m256i*)(target + i));
+        _mm256_storeu_si256((__m256i*)(target + i), _mm256_xor_si256(current, product));
+    }
+    return i;
+}
+#endif
+
+// target[i] ^= scale * source[i] for i < length. The two buffers must not
+// overlap.
+static void gf_mul_add_region(u8* target, const u8* source, usize length, u8 scale) {
+    if (!scale || !target || !source) {
+        return;
+    }
+    const u8* row = gf_mul_row(scale);
+    usize i = 0u;
+#if defined(MAKOCODE_X86_KERNELS)
+    if (length >= 32u && cpu_kernels().avx2) {
+        i = gf_mul_add_region_avx2(target, source, length, scale);
+    }
+#endif
+    for (; i < length; ++i) {
+        target[i] ^= row[source[i]];
     }
-    rs_ensure_tables();
-    u16 log_sum = (u16)g_rs_tables.log_table[a] + (u16)g_rs_tables.log_table[b];
-    return g_rs_tables.exp_table[log_sum % RS_FIELD_SIZE];
 }
 
 static inline u8 gf_div(u8 a, u8 b) {
@@ -8524,13 +10047,11 @@ static u16 poly_scale_shift_add(u8* target,
         }
         target_size = required;
     }
-    for (u16 i = 0u; i < source_size; ++i) {
-        u16 index = (u16)(i + shift);
-        if (index >= RS_POLY_CAPACITY) {
-            break;
-        }
-        target[index] ^= gf_mul(source[i], scale);
+    u16 span = source_size;
+    if ((u32)shift + (u32)span > (u32)RS_POLY_CAPACITY) {
+        span = (shift < RS_POLY_CAPACITY) ? (u16)(RS_POLY_CAPACITY - shift) : 0u;
     }
+    gf_mul_add_region(target + shift, source, span, scale);
     return target_size;
 }
 
@@ -8585,20 +10106,10 @@ static void rs_compute_parity(const u8* generator,
         u8 feedback = data_symbols ? data_symbols[i] : 0u;
         feedback ^= parity_out[0];
         if (parity_symbols > 1u) {
-            for (u16 j = 0u; j < (parity_symbols - 1u); ++j) {
-                parity_out[j] = parity_out[j + 1u];
-            }
+            memmove(parity_out, parity_out + 1u, (usize)(parity_symbols - 1u));
         }
         parity_out[parity_symbols - 1u] = 0u;
-        if (!feedback) {
-            continue;
-        }
-        for (u16 j = 0u; j < parity_symbols; ++j) {
-            u8 coeff = generator[j + 1u];
-            if (coeff) {
-                parity_out[j] ^= gf_mul(coeff, feedback);
-            }
-        }
+        gf_mul_add_region(parity_out, generator + 1u, parity_symbols, feedback);
     }
 }
 
@@ -8639,11 +10150,38 @@ static bool rs_compute_syndromes(const u8* codeword,
         return false;
     }
     all_zero = true;
-    for (u16 i = 0u; i < parity_symbols; ++i) {
+    u16 i = 0u;
+    // Horner evaluation is one dependent lookup per symbol; run four roots
+    // side by side so the table loads overlap.
+    for (; (u32)i + 4u <= (u32)parity_symbols; i = (u16)(i + 4u)) {
+        const u8* row0 = gf_mul_row(gf_pow_alpha(i + 1u));
+        const u8* row1 = gf_mul_row(gf_pow_alpha(i + 2u));
+        const u8* row2 = gf_mul_row(gf_pow_alpha(i + 3u));
+        const u8* row3 = gf_mul_row(gf_pow_alpha(i + 4u));
+        u8 e0 = 0u;
+        u8 e1 = 0u;
+        u8 e2 = 0u;
+        u8 e3 = 0u;
+        for (u16 j = 0u; j < codeword_length; ++j) {
+            u8 symbol = codeword[j];
+            e0 = row0[e0] ^ symbol;
+            e1 = row1[e1] ^ symbol;
+            e2 = row2[e2] ^ symbol;
+            e3 = row3[e3] ^ symbol;
+        }
+        syndromes[i] = e0;
+        syndromes[i + 1u] = e1;
+        syndromes[i + 2u] = e2;
+        syndromes[i + 3u] = e3;
+        if (e0 | e1 | e2 | e3) {
+            all_zero = false;
+        }
+    }
+    for (; i < parity_symbols; ++i) {
         u8 evaluation = 0u;
-        u8 root = gf_pow_alpha(i + 1u);
+        const u8* root_row = gf_mul_row(gf_pow_alpha(i + 1u));
         for (u16 j = 0u; j < codeword_length; ++j) {
-            evaluation = gf_mul(evaluation, root) ^ codeword[j];
+            evaluation = root_row[evaluation] ^ codeword[j];
         }
         syndromes[i] = evaluation;
         if (evaluation) {
@@ -8653,11 +10191,15 @@ static bool rs_compute_syndromes(const u8* codeword,
     return true;
 }
 
+// With erasures, C and B start from the erasure locator and the search only
+// has to find the remaining (unknown-position) error roots.
 static bool rs_berlekamp_massey(const u8* syndromes,
                                 u16 parity_symbols,
+                                const u8* erasure_locator,
+                                u16 erasure_count,
                                 u8* locator,
                                 u16& locator_size) {
-    if (!syndromes || !locator) {
+    if (!syndromes || !locator || erasure_count > parity_symbols) {
         return false;
     }
     u8 C[RS_POLY_CAPACITY];
@@ -8669,11 +10211,18 @@ static bool rs_berlekamp_massey(const u8* syndromes,
     C[0] = 1u;
     B[0] = 1u;
     u16 C_size = 1u;
-    u16 B_size = 1u;
-    u16 L = 0u;
+    if (erasure_locator && erasure_count > 0u) {
+        for (u16 i = 0u; i <= erasure_count; ++i) {
+            C[i] = erasure_locator[i];
+            B[i] = erasure_locator[i];
+        }
+        C_size = (u16)(erasure_count + 1u);
+    }
+    u16 B_size = C_size;
+    u16 L = erasure_count;
     u16 m = 1u;
     u8 b = 1u;
-    for (u16 n = 0u; n < parity_symbols; ++n) {
+    for (u16 n = erasure_count; n < parity_symbols; ++n) {
         u8 delta = syndromes[n];
         for (u16 i = 1u; i <= L; ++i) {
             if (i >= C_size) {
@@ -8693,8 +10242,8 @@ static bool rs_berlekamp_massey(const u8* syndromes,
             }
             u8 factor = gf_div(delta, b);
             C_size = poly_scale_shift_add(C, C_size, B, B_size, factor, m);
-            if ((2u * L) <= n) {
-                L = (u16)(n + 1u - L);
+            if ((2u * L) <= (u32)n + (u32)erasure_count) {
+                L = (u16)(n + 1u + erasure_count - L);
                 for (u16 i = 0u; i < RS_POLY_CAPACITY; ++i) {
                     B[i] = T[i];
                 }
@@ -8837,7 +10386,9 @@ static bool rs_correct_errors(u8* codeword,
                               const u8* locator_derivative,
                               u16 derivative_size,
                               const u16* positions,
-                              u16 position_count) {
+                              u16 position_count,
+                              u16& changed_count) {
+    changed_count = 0u;
     if (!codeword || !omega || !locator_derivative || !positions) {
         return false;
     }
@@ -8871,6 +10422,9 @@ static bool rs_correct_errors(u8* codeword,
         }
         u8 magnitude = gf_div(numerator, denominator);
         codeword[pos] ^= magnitude;
+        if (magnitude) {
+            ++changed_count;
+        }
     }
     return true;
 }
@@ -8880,7 +10434,9 @@ static bool rs_correct_errors(u8* codeword,
 static bool rs_decode_block(u8* block,
                             u16 data_symbols,
                             u16 parity_symbols,
-                            u16* corrected_errors) {
+                            u16* corrected_errors,
+                            const u16* erasure_positions,
+                            u16 erasure_count) {
     if (corrected_errors) {
         *corrected_errors = 0u;
     }
@@ -8902,12 +10458,35 @@ static bool rs_decode_block(u8* block,
     if (all_zero) {
         return true;
     }
+    u16 exponent_offset = (u16)(RS_FIELD_SIZE - codeword_length);
+    if (!erasure_positions || erasure_count > parity_symbols) {
+        erasure_count = 0u;
+    }
+    // Erasure locator: product of (1 + X_k x) over the known-bad positions,
+    // using the same root convention as rs_find_error_locations.
+    u8 erasure_locator[RS_POLY_CAPACITY];
+    for (u16 i = 0u; i < RS_POLY_CAPACITY; ++i) {
+        erasure_locator[i] = 0u;
+    }
+    erasure_locator[0] = 1u;
+    for (u16 k = 0u; k < erasure_count; ++k) {
+        u16 pos = erasure_positions[k];
+        if (pos >= codeword_length) {
+            rs_debug_failure("erasure-position", data_symbols, parity_symbols);
+            return false;
+        }
+        u8 x_k = gf_div(1u, gf_pow_alpha((u32)pos + 1u + (u32)exponent_offset));
+        const u8* row = gf_mul_row(x_k);
+        for (u16 i = (u16)(k + 1u); i > 0u; --i) {
+            erasure_locator[i] ^= row[erasure_locator[i - 1u]];
+        }
+    }
     u8 locator[RS_POLY_CAPACITY];
     for (u16 i = 0u; i < RS_POLY_CAPACITY; ++i) {
         locator[i] = 0u;
     }
     u16 locator_size = 0u;
-    if (!rs_berlekamp_massey(syndromes, parity_symbols, locator, locator_size)) {
+    if (!rs_berlekamp_massey(syndromes, parity_symbols, erasure_locator, erasure_count, locator, locator_size)) {
         rs_debug_failure("berlekamp", data_symbols, parity_symbols);
         return false;
     }
@@ -8917,7 +10496,6 @@ static bool rs_decode_block(u8* block,
     }
     u16 error_positions[RS_POLY_CAPACITY];
     u16 error_count = 0u;
-    u16 exponent_offset = (u16)(RS_FIELD_SIZE - codeword_length);
     if (!rs_find_error_locations(locator,
                                  locator_size,
                                  codeword_length,
@@ -8929,7 +10507,9 @@ static bool rs_decode_block(u8* block,
         rs_debug_failure("locations", data_symbols, parity_symbols);
         return false;
     }
-    if ((error_count * 2u) > parity_symbols) {
+    // Each erasure costs one parity symbol, each unknown error two.
+    u16 unknown_errors = (error_count > erasure_count) ? (u16)(error_count - erasure_count) : 0u;
+    if ((u32)unknown_errors * 2u + (u32)erasure_count > (u32)parity_symbols) {
         rs_debug_failure("too-many-errors", data_symbols, parity_symbols);
         return false;
     }
@@ -8941,6 +10521,7 @@ static bool rs_decode_block(u8* block,
         rs_debug_failure("derivative", data_symbols, parity_symbols);
         return false;
     }
+    u16 changed_count = 0u;
     if (!rs_correct_errors(block,
                            codeword_length,
                            exponent_offset,
@@ -8949,12 +10530,13 @@ static bool rs_decode_block(u8* block,
                            locator_derivative,
                            derivative_size,
                            error_positions,
-                           error_count)) {
+                           error_count,
+                           changed_count)) {
         rs_debug_failure("correct", data_symbols, parity_symbols);
         return false;
     }
     if (corrected_errors) {
-        *corrected_errors = error_count;
+        *corrected_errors = changed_count;
     }
     return true;
 }
@@ -9016,10 +10598,78 @@ static bool compute_ecc_layout(usize data_bytes,
     return true;
 }
 
+// RS-encodes `payload` into `encoded`, which holds (block_data + parity) *
+// block_count symbols laid out by EccInterleave.
+static bool ecc_encode_blocks(const u8* payload,
+                              usize payload_size,
+                              u16 block_data,
+                              u16 parity_symbols,
+                              u64 block_count,
+                              u8* encoded) {
+    if (!payload || !encoded) {
+        return false;
+    }
+    u8 generator[RS_POLY_CAPACITY];
+    u16 generator_size = 0u;
+    if (!rs_build_generator(parity_symbols, generator, generator_size)) {
+        return false;
+    }
+    (void)generator_size;
+    u16 block_symbols = (u16)(block_data + parity_symbols);
+    EccInterleave interleave;
+    if (!interleave.configure(block_symbols, block_count)) {
+        return false;
+    }
+    // Codewords are built a tile at a time and scattered column by column, so
+    // the stores for each column land on one contiguous run of `encoded`.
+    ByteBuffer tile;
+    if (!tile.ensure((usize)ECC_INTERLEAVE_TILE_BLOCKS * RS_POLY_CAPACITY)) {
+        return false;
+    }
+    usize payload_offset = 0u;
+    for (u64 tile_start = 0u; tile_start < block_count; tile_start += ECC_INTERLEAVE_TILE_BLOCKS) {
+        u64 tile_blocks = block_count - tile_start;
+        if (tile_blocks > ECC_INTERLEAVE_TILE_BLOCKS) {
+            tile_blocks = ECC_INTERLEAVE_TILE_BLOCKS;
+        }
+        for (u64 t = 0u; t < tile_blocks; ++t) {
+            u8* codeword = tile.data + (usize)t * RS_POLY_CAPACITY;
+            for (u16 i = 0u; i < block_data; ++i) {
+                usize src_index = payload_offset + (usize)i;
+                codeword[i] = (src_index < payload_size) ? payload[src_index] : 0u;
+            }
+            rs_compute_parity(generator, parity_symbols, codeword, block_data, codeword + block_data);
+            payload_offset += (usize)block_data;
+        }
+        for (u16 j = 0u; j < block_symbols; ++j) {
+            for (u64 t = 0u; t < tile_blocks; ++t) {
+                encoded[(usize)interleave.position(tile_start + t, j)] =
+                    tile.data[(usize)t * RS_POLY_CAPACITY + j];
+            }
+        }
+    }
+    return true;
+}
+
+static void fill_ecc_summary(EccSummary& summary,
+                             u16 block_data,
+                             u16 parity_symbols,
+                             u64 block_count,
+                             usize original_bytes) {
+    summary.enabled = true;
+    summary.interleaved = true;
+    summary.block_data_symbols = block_data;
+    summary.parity_symbols = parity_symbols;
+    summary.block_count = block_count;
+    summary.original_bytes = original_bytes;
+    summary.redundancy = (block_data ? ((double)parity_symbols) / (double)block_data : 0.0);
+}
+
 static bool encode_payload_with_ecc(const ByteBuffer& compressed,
                                     double redundancy,
                                     BitWriter& writer,
                                     EccSummary& summary) {
+    StatsTimer stats_timer(StatsStage_EccEncode);
     if (!compressed.data || compressed.size == 0u) {
         return false;
     }
@@ -9038,32 +10688,11 @@ static bool encode_payload_with_ecc(const ByteBuffer& compressed,
         return false;
     }
     encoded.size = (usize)total_symbols;
-    u8 generator[RS_POLY_CAPACITY];
-    u16 generator_size = 0u;
-    if (!rs_build_generator(parity_symbols, generator, generator_size)) {
+    if (!ecc_encode_blocks(compressed.data, compressed.size, block_data, parity_symbols, block_count, encoded.data)) {
         return false;
     }
-    (void)generator_size;
-    u8 parity_buffer[RS_POLY_CAPACITY];
-    u8 data_buffer[RS_POLY_CAPACITY];
-    usize payload_offset = 0u;
-    u16 block_symbols = (u16)(block_data + parity_symbols);
-    for (u64 block_index = 0u; block_index < block_count; ++block_index) {
-        for (u16 i = 0u; i < block_data; ++i) {
-            usize src_index = payload_offset + (usize)i;
-            data_buffer[i] = (src_index < compressed.size) ? compressed.data[src_index] : 0u;
-        }
-        rs_compute_parity(generator, parity_symbols, data_buffer, block_data, parity_buffer);
-        usize base = (usize)block_index * (usize)block_symbols;
-        for (u16 i = 0u; i < block_data; ++i) {
-            encoded.data[base + i] = data_buffer[i];
-        }
-        for (u16 j = 0u; j < parity_symbols; ++j) {
-            encoded.data[base + block_data + j] = parity_buffer[j];
-        }
-        payload_offset += (usize)block_data;
-    }
     EccHeader header;
+    header.flags = (u8)(ECC_HEADER_FLAG_ENABLED | ECC_HEADER_FLAG_INTERLEAVED);
     header.block_data = block_data;
     header.parity = parity_symbols;
     header.block_count = block_count;
@@ -9075,29 +10704,19 @@ static bool encode_payload_with_ecc(const ByteBuffer& compressed,
     if (!build_protected_header_copy(header, header_copy)) {
         return false;
     }
-    for (usize i = ECC_HEADER_COPY_DATA_BYTES; i < ECC_HEADER_COPY_TOTAL_BYTES; ++i) {
-        if (!writer.write_bits((u64)header_copy[i], 8u)) {
-            return false;
-        }
+    if (!writer.append_bits(header_copy + ECC_HEADER_COPY_DATA_BYTES,
+                            (u64)(ECC_HEADER_COPY_TOTAL_BYTES - ECC_HEADER_COPY_DATA_BYTES) * 8u)) {
+        return false;
     }
     for (usize copy_index = 1u; copy_index < ECC_HEADER_COPY_COUNT; ++copy_index) {
-        for (usize i = 0u; i < ECC_HEADER_COPY_TOTAL_BYTES; ++i) {
-            if (!writer.write_bits((u64)header_copy[i], 8u)) {
-                return false;
-            }
-        }
-    }
-    for (usize i = 0u; i < encoded.size; ++i) {
-        if (!writer.write_bits((u64)encoded.data[i], 8u)) {
+        if (!writer.append_bits(header_copy, (u64)ECC_HEADER_COPY_TOTAL_BYTES * 8u)) {
             return false;
         }
     }
-    summary.enabled = true;
-    summary.block_data_symbols = block_data;
-    summary.parity_symbols = parity_symbols;
-    summary.block_count = block_count;
-    summary.original_bytes = compressed.size;
-    summary.redundancy = (block_data ? ((double)parity_symbols) / (double)block_data : 0.0);
+    if (!writer.append_bits(encoded.data, (u64)encoded.size * 8u)) {
+        return false;
+    }
+    fill_ecc_summary(summary, block_data, parity_symbols, block_count, compressed.size);
     return true;
 }
 
@@ -9105,6 +10724,7 @@ struct EccHeaderInfo {
     bool detected;
     bool valid;
     bool enabled;
+    bool interleaved;
     u16 block_data;
     u16 parity;
     u64 block_count;
@@ -9115,6 +10735,7 @@ struct EccHeaderInfo {
         : detected(false),
           valid(false),
           enabled(false),
+          interleaved(false),
           block_data(0u),
           parity(0u),
           block_count(0u),
@@ -9127,7 +10748,8 @@ static bool build_ecc_header_bytes(u8* dest,
                                    u16 block_data,
                                    u16 parity,
                                    u64 block_count,
-                                   u64 original_bytes) {
+                                   u64 original_bytes,
+                                   bool interleaved) {
     if (!dest || dest_capacity < ECC_HEADER_TOTAL_BYTES) {
         return false;
     }
@@ -9141,6 +10763,9 @@ static bool build_ecc_header_bytes(u8* dest,
         return false;
     }
     EccHeader header;
+    if (interleaved) {
+        header.flags = (u8)(ECC_HEADER_FLAG_ENABLED | ECC_HEADER_FLAG_INTERLEAVED);
+    }
     header.block_data = block_data;
     header.parity = parity;
     header.block_count = block_count;
@@ -9159,6 +10784,43 @@ static bool build_ecc_header_bytes(u8* dest,
     return true;
 }
 
+// In-place variant of encode_payload_with_ecc for `encode --stream`: the caller
+// sizes `dest` from compute_ecc_layout (typically a mapped spool file) and the
+// header copies plus interleaved codewords are written straight into it.
+static bool encode_payload_with_ecc_into(const u8* payload,
+                                         usize payload_size,
+                                         u16 block_data,
+                                         u16 parity_symbols,
+                                         u64 block_count,
+                                         u8* dest,
+                                         usize dest_size,
+                                         EccSummary& summary) {
+    StatsTimer stats_timer(StatsStage_EccEncode);
+    u64 total_bytes = (u64)ECC_HEADER_TOTAL_BYTES + (u64)(block_data + parity_symbols) * block_count;
+    if (!dest || payload_size == 0u || (u64)dest_size != total_bytes) {
+        return false;
+    }
+    if (!build_ecc_header_bytes(dest,
+                                dest_size,
+                                block_data,
+                                parity_symbols,
+                                block_count,
+                                (u64)payload_size,
+                                true)) {
+        return false;
+    }
+    if (!ecc_encode_blocks(payload,
+                           payload_size,
+                           block_data,
+                           parity_symbols,
+                           block_count,
+                           dest + ECC_HEADER_TOTAL_BYTES)) {
+        return false;
+    }
+    fill_ecc_summary(summary, block_data, parity_symbols, block_count, payload_size);
+    return true;
+}
+
 static bool parse_ecc_header(const u8* bytes,
                              usize byte_count,
                              EccHeaderInfo& header) {
@@ -9182,7 +10844,8 @@ static bool parse_ecc_header(const u8* bytes,
         return false;
     }
     header.valid = true;
-    header.enabled = ((parsed.flags & 0x01u) != 0u);
+    header.enabled = ((parsed.flags & ECC_HEADER_FLAG_ENABLED) != 0u);
+    header.interleaved = ((parsed.flags & ECC_HEADER_FLAG_INTERLEAVED) != 0u);
     header.block_data = parsed.block_data;
     header.parity = parsed.parity;
     header.block_count = parsed.block_count;
@@ -9191,10 +10854,15 @@ static bool parse_ecc_header(const u8* bytes,
     return true;
 }
 
+// `erasures`, when given, flags (non-zero) the symbols of `bytes` that the
+// image sampler marked unreliable. Blocks try errors-and-erasures decoding
+// first and fall back to plain error correction if the hints do not help.
 static bool decode_ecc_payload(const u8* bytes,
                                const EccHeaderInfo& header,
                                ByteBuffer& output,
-                               EccDecodeStats* stats) {
+                               EccDecodeStats* stats,
+                               const u8* erasures = 0) {
+    StatsTimer stats_timer(StatsStage_EccDecode);
     if (!bytes || !header.valid || !header.enabled) {
         return false;
     }
@@ -9214,16 +10882,84 @@ static bool decode_ecc_payload(const u8* bytes,
         stats->total_blocks = header.block_count;
         stats->total_parity_symbols = (u64)header.parity * header.block_count;
         stats->header_copy_repairs = 0u;
+        stats->erasure_symbols = 0u;
     }
+    EccInterleave interleave;
+    if (header.interleaved && !interleave.configure(block_total, header.block_count)) {
+        return false;
+    }
+    // Codewords are gathered a tile at a time; for interleaved streams each
+    // column of the tile is a contiguous run of `bytes`.
+    ByteBuffer tile;
+    ByteBuffer tile_erasures;
+    usize tile_bytes = (usize)ECC_INTERLEAVE_TILE_BLOCKS * RS_POLY_CAPACITY;
+    if (!tile.ensure(tile_bytes) || (erasures && !tile_erasures.ensure(tile_bytes))) {
+        return false;
+    }
+    u64 tile_start = 0u;
+    u64 tile_blocks = 0u;
     u8 block_buffer[RS_POLY_CAPACITY];
+    u16 erasure_positions[RS_POLY_CAPACITY];
     for (u64 block_index = 0u; block_index < header.block_count; ++block_index) {
-        usize offset = (usize)block_index * (usize)block_total;
+        if (block_index >= tile_start + tile_blocks) {
+            tile_start = block_index;
+            tile_blocks = header.block_count - tile_start;
+            if (tile_blocks > ECC_INTERLEAVE_TILE_BLOCKS) {
+                tile_blocks = ECC_INTERLEAVE_TILE_BLOCKS;
+            }
+            for (u16 j = 0u; j < block_total; ++j) {
+                for (u64 t = 0u; t < tile_blocks; ++t) {
+                    usize source = header.interleaved
+                                       ? (usize)interleave.position(tile_start + t, j)
+                                       : (usize)(tile_start + t) * (usize)block_total + j;
+                    usize slot = (usize)t * RS_POLY_CAPACITY + j;
+                    tile.data[slot] = bytes[source];
+                    if (erasures) {
+                        tile_erasures.data[slot] = erasures[source];
+                    }
+                }
+            }
+        }
+        const u8* codeword = tile.data + (usize)(block_index - tile_start) * RS_POLY_CAPACITY;
+        const u8* codeword_erasures = erasures
+                                          ? tile_erasures.data + (usize)(block_index - tile_start) * RS_POLY_CAPACITY
+                                          : 0;
         for (u16 i = 0u; i < block_total; ++i) {
-            block_buffer[i] = bytes[offset + i];
+            block_buffer[i] = codeword[i];
+        }
+        u16 erasure_count = 0u;
+        if (codeword_erasures) {
+            for (u16 i = 0u; i < block_total; ++i) {
+                if (codeword_erasures[i]) {
+                    if (erasure_count >= header.parity) {
+                        // More hints than parity: errors-only is the only option.
+                        erasure_count = 0u;
+                        break;
+                    }
+                    erasure_positions[erasure_count++] = i;
+                }
+            }
         }
         u16 block_errors = 0u;
         g_rs_debug_block_index = (i64)block_index;
-        if (!rs_decode_block(block_buffer, header.block_data, header.parity, &block_errors)) {
+        bool decoded = false;
+        if (erasure_count > 0u) {
+            decoded = rs_decode_block(block_buffer,
+                                      header.block_data,
+                                      header.parity,
+                                      &block_errors,
+                                      erasure_positions,
+                                      erasure_count);
+            if (decoded && stats) {
+                stats->erasure_symbols += (u64)erasure_count;
+            }
+            if (!decoded) {
+                for (u16 i = 0u; i < block_total; ++i) {
+                    block_buffer[i] = codeword[i];
+                }
+            }
+        }
+        if (!decoded && !rs_decode_block(block_buffer, header.block_data, header.parity, &block_errors)) {
             return false;
         }
         g_rs_debug_block_index = -1;
@@ -9257,6 +10993,7 @@ static bool decode_ecc_payload(const u8* bytes,
 }
 
 static bool shuffle_encoded_stream(u8* data, usize byte_count, bool ecc_enabled) {
+    StatsTimer stats_timer(StatsStage_Shuffle);
     if (!data || byte_count <= 1u) {
         return true;
     }
@@ -9270,7 +11007,8 @@ static bool shuffle_encoded_stream(u8* data, usize byte_count, bool ecc_enabled)
     return fisher_yates_shuffle(data + header_span, byte_count - header_span);
 }
 
-static bool unshuffle_encoded_stream(u8* data, usize byte_count) {
+static bool unshuffle_encoded_stream(u8* data, usize byte_count, u8* companion) {
+    StatsTimer stats_timer(StatsStage_Unshuffle);
     if (!data || byte_count <= 1u) {
         return true;
     }
@@ -9283,16 +11021,22 @@ static bool unshuffle_encoded_stream(u8* data, usize byte_count) {
     }
     EccHeaderInfo header_probe;
     if (parse_ecc_header(data, byte_count, header_probe) && header_probe.valid && header_probe.enabled) {
+        if (header_probe.interleaved) {
+            // decode_ecc_payload reads interleaved blocks in place.
+            return true;
+        }
         treat_as_ecc = true;
     }
     if (!treat_as_ecc) {
-        return fisher_yates_unshuffle(data, byte_count);
+        return fisher_yates_unshuffle(data, byte_count, companion);
     }
     usize header_span = ecc_header_span_for_bytes(byte_count);
     if (byte_count <= header_span) {
         return true;
     }
-    return fisher_yates_unshuffle(data + header_span, byte_count - header_span);
+    return fisher_yates_unshuffle(data + header_span,
+                                  byte_count - header_span,
+                                  companion ? companion + header_span : 0);
 }
 
 struct DecoderContext {
@@ -9302,6 +11046,11 @@ struct DecoderContext {
     bool password_attempted;
     bool password_failed;
     bool password_not_encrypted;
+    // When set, a block-container payload is left compressed in `payload` (and
+    // payload_is_block_container raised) so the caller can restore selected
+    // entries without decompressing every block.
+    bool keep_block_container;
+    bool payload_is_block_container;
     EccDecodeStats ecc_stats;
 
     DecoderContext()
@@ -9311,6 +11060,8 @@ struct DecoderContext {
           password_attempted(false),
           password_failed(false),
           password_not_encrypted(false),
+          keep_block_container(false),
+          payload_is_block_container(false),
           ecc_stats() {}
 
     ~DecoderContext() {
@@ -9324,16 +11075,38 @@ struct DecoderContext {
         password_attempted = false;
         password_failed = false;
         password_not_encrypted = false;
+        payload_is_block_container = false;
         ecc_stats = EccDecodeStats();
     }
 
-    bool parse(u8* data, usize size_in_bits, const char* password, usize password_length) {
+    bool decompress_payload(const u8* data, usize bit_count) {
+        if (keep_block_container && data && bit_count >= 8u && data[0] == LZMA_BLOCKS_MARKER) {
+            usize byte_count = bit_count >> 3u;
+            if (!payload.ensure(byte_count)) {
+                return false;
+            }
+            memcpy(payload.data, data, byte_count);
+            payload.size = byte_count;
+            payload_is_block_container = true;
+            return true;
+        }
+        return lzma_decompress(data, bit_count, payload);
+    }
+
+    // `erasure_bits` is an optional mask parallel to `data` (see
+    // ppm_extract_frame_bits); a byte with any marked bit is an RS erasure.
+    bool parse(u8* data,
+               usize size_in_bits,
+               const char* password,
+               usize password_length,
+               const u8* erasure_bits = 0) {
         payload.release();
         has_payload = false;
         ecc_failed = false;
         password_attempted = false;
         password_failed = false;
         password_not_encrypted = false;
+        payload_is_block_container = false;
         ecc_stats = EccDecodeStats();
         if (size_in_bits == 0u) {
             has_payload = true;
@@ -9343,7 +11116,17 @@ struct DecoderContext {
         return false;
     }
     usize byte_count = (size_in_bits + 7u) >> 3u;
-    if (byte_count > 0u && !unshuffle_encoded_stream(data, byte_count)) {
+    ByteBuffer erasure_flags;
+    if (erasure_bits && byte_count > 0u) {
+        if (!erasure_flags.ensure(byte_count)) {
+            return false;
+        }
+        for (usize i = 0u; i < byte_count; ++i) {
+            erasure_flags.data[i] = erasure_bits[i];
+        }
+        erasure_flags.size = byte_count;
+    }
+    if (byte_count > 0u && !unshuffle_encoded_stream(data, byte_count, erasure_flags.data)) {
         return false;
     }
     const char* ecc_input_dump = getenv("MAKOCODE_DEBUG_ECC_INPUT");
@@ -9395,7 +11178,8 @@ struct DecoderContext {
             }
             const u8* encoded = data + header_span;
             ByteBuffer compressed;
-            if (!decode_ecc_payload(encoded, header, compressed, &ecc_stats)) {
+            const u8* encoded_erasures = erasure_flags.data ? (erasure_flags.data + header_span) : 0;
+            if (!decode_ecc_payload(encoded, header, compressed, &ecc_stats, encoded_erasures)) {
                 if (debug_logging_enabled()) {
                     char debug_buffer[128];
                     console_line(2, "debug parse: decode_ecc_payload failure");
@@ -9480,7 +11264,7 @@ struct DecoderContext {
                     console_line(2, ecc_output_dump);
                 }
             }
-            if (!lzma_decompress(working->data, (usize)bit_total, payload)) {
+            if (!decompress_payload(working->data, (usize)bit_total)) {
                 if (debug_logging_enabled()) {
                     char size_buffer[32];
                     char bits_buffer[32];
@@ -9526,7 +11310,7 @@ struct DecoderContext {
             has_payload = true;
             return true;
         }
-        if (!lzma_decompress(decode_data, decode_bits, payload)) {
+        if (!decompress_payload(decode_data, decode_bits)) {
             return false;
         }
         has_payload = true;
@@ -9597,6 +11381,7 @@ struct ImageMappingConfig {
     u32 custom_palette_count;
     u32 custom_palette_base;
     bool custom_palette_valid;
+    bool ppm_binary_output;
 
     ImageMappingConfig()
         : color_channels(1u),
@@ -9608,7 +11393,8 @@ struct ImageMappingConfig {
           palette_set(false),
           custom_palette_count(0u),
           custom_palette_base(0u),
-          custom_palette_valid(false) {
+          custom_palette_valid(false),
+          ppm_binary_output(false) {
         palette_text[0] = '\0';
         for (u32 i = 0u; i < MAX_CUSTOM_PALETTE_COLORS; ++i) {
             custom_palette[i].r = 0u;
@@ -9732,6 +11518,54 @@ static bool compute_bits_per_page(u32 width_pixels,
                                   u64& bits_per_page,
                                   u64* reserved_pixels_out = 0);
 
+// A horizontal span of payload pixels on one data row.
+struct PageGeometryRun {
+    u32 row;
+    u32 column;
+    u32 length;
+};
+
+// Geometry-only data that every page with the same layout shares: the
+// reservation masks, reserved-pixel counts, and the payload pixels in raster
+// order packed as runs. Cached entries are immutable once published, so page
+// workers on any thread read them without copying.
+struct PageGeometry {
+    u32 width_pixels;
+    u32 height_pixels;
+    u32 data_height_pixels;
+    bool metadata_tile;
+    FiducialGridDefaults fiducials;
+    makocode::ByteBuffer reservation_mask;  // markers and metadata tile, whole page
+    makocode::ByteBuffer marker_mask;       // markers only, whole page
+    u64 reserved_data_pixels;
+    u64 data_pixel_count;
+    makocode::ByteBuffer run_storage;
+    usize run_count;
+
+    PageGeometry()
+        : width_pixels(0u),
+          height_pixels(0u),
+          data_height_pixels(0u),
+          metadata_tile(false),
+          fiducials(),
+          reservation_mask(),
+          marker_mask(),
+          reserved_data_pixels(0u),
+          data_pixel_count(0u),
+          run_storage(),
+          run_count(0u) {}
+
+    const PageGeometryRun* runs() const {
+        return (const PageGeometryRun*)run_storage.data;
+    }
+};
+
+static const PageGeometry* page_geometry_acquire(u32 width_pixels,
+                                                 u32 height_pixels,
+                                                 u32 data_height_pixels,
+                                                 bool reserve_metadata_tile,
+                                                 PageGeometry& fallback);
+
 struct FooterLayout {
     bool has_text;
     u32 font_size;
@@ -12171,16 +14005,152 @@ namespace FooterStripe {
     }
 }
 
-namespace MetadataTile {
-    using namespace makocode;
+// Rec. 709 luminance of an RGB page plus 2x box-filtered levels above it.
+// Level 0 has the page resolution; level k covers the same area with
+// ceil(size / 2^k) samples. Samplers take full-resolution coordinates, so a
+// caller can move between levels without rescaling its geometry.
+struct LumaPyramid {
+    static const u32 MAX_LEVELS = 4u;
+    float* planes[MAX_LEVELS];
+    u32 widths[MAX_LEVELS];
+    u32 heights[MAX_LEVELS];
+    u32 level_count;
 
-    static const u32 TILE_SIDE = 48u;
-    static const u32 TILE_BORDER = 1u;
-    [[maybe_unused]] static const u32 TILE_INNER_SIDE = TILE_SIDE - TILE_BORDER * 2u;
-    static const u32 TILE_HEADER_BITS = 32u;
+    LumaPyramid() : level_count(0u) {
+        for (u32 i = 0u; i < MAX_LEVELS; ++i) {
+            planes[i] = 0;
+            widths[i] = 0u;
+            heights[i] = 0u;
+        }
+    }
+
+    ~LumaPyramid() {
+        release();
+    }
+
+    void release() {
+        for (u32 i = 0u; i < MAX_LEVELS; ++i) {
+            free(planes[i]);
+            planes[i] = 0;
+            widths[i] = 0u;
+            heights[i] = 0u;
+        }
+        level_count = 0u;
+    }
+};
+
+static bool luma_pyramid_build(LumaPyramid& pyramid,
+                               const u8* pixel_data_rgb,
+                               u32 width_pixels,
+                               u32 height_pixels,
+                               u32 level_count) {
+    pyramid.release();
+    if (!pixel_data_rgb || width_pixels == 0u || height_pixels == 0u || level_count == 0u) {
+        return false;
+    }
+    if (level_count > LumaPyramid::MAX_LEVELS) {
+        level_count = LumaPyramid::MAX_LEVELS;
+    }
+    usize base_count = (usize)width_pixels * (usize)height_pixels;
+    if (base_count > USIZE_MAX_VALUE / sizeof(float)) {
+        return false;
+    }
+    float* base = (float*)malloc(base_count * sizeof(float));
+    if (!base) {
+        return false;
+    }
+    for (usize i = 0u; i < base_count; ++i) {
+        const u8* rgb = pixel_data_rgb + i * 3u;
+        base[i] = (float)(0.2126 * (double)rgb[0] + 0.7152 * (double)rgb[1] + 0.0722 * (double)rgb[2]);
+    }
+    pyramid.planes[0] = base;
+    pyramid.widths[0] = width_pixels;
+    pyramid.heights[0] = height_pixels;
+    pyramid.level_count = 1u;
+    while (pyramid.level_count < level_count) {
+        u32 level = pyramid.level_count;
+        u32 src_w = pyramid.widths[level - 1u];
+        u32 src_h = pyramid.heights[level - 1u];
+        if (src_w < 2u || src_h < 2u) {
+            break;
+        }
+        u32 dst_w = (src_w + 1u) / 2u;
+        u32 dst_h = (src_h + 1u) / 2u;
+        float* dst = (float*)malloc((usize)dst_w * (usize)dst_h * sizeof(float));
+        if (!dst) {
+            pyramid.release();
+            return false;
+        }
+        const float* src = pyramid.planes[level - 1u];
+        for (u32 y = 0u; y < dst_h; ++y) {
+            const float* row0 = src + (usize)(2u * y) * src_w;
+            const float* row1 = (2u * y + 1u < src_h) ? (row0 + src_w) : row0;
+            float* out = dst + (usize)y * dst_w;
+            for (u32 x = 0u; x < dst_w; ++x) {
+                u32 x0 = 2u * x;
+                u32 x1 = (x0 + 1u < src_w) ? (x0 + 1u) : x0;
+                out[x] = 0.25f * (row0[x0] + row0[x1] + row1[x0] + row1[x1]);
+            }
+        }
+        pyramid.planes[level] = dst;
+        pyramid.widths[level] = dst_w;
+        pyramid.heights[level] = dst_h;
+        pyramid.level_count = level + 1u;
+    }
+    return true;
+}
+
+// Bilinear luminance at full-resolution position (x, y), read from `level`.
+static double luma_pyramid_sample(const LumaPyramid& pyramid, u32 level, double x, double y) {
+    if (level >= pyramid.level_count) {
+        level = pyramid.level_count ? pyramid.level_count - 1u : 0u;
+    }
+    const float* plane = pyramid.planes[level];
+    u32 width = pyramid.widths[level];
+    u32 height = pyramid.heights[level];
+    if (!plane || width == 0u || height == 0u) {
+        return 0.0;
+    }
+    if (level) {
+        // Level pixel i is the mean of full-resolution pixels [i*f, (i+1)*f).
+        double inv_scale = 1.0 / (double)(1u << level);
+        x = (x + 0.5) * inv_scale - 0.5;
+        y = (y + 0.5) * inv_scale - 0.5;
+    }
+    x = clamp_double(x, 0.0, (double)(width - 1u));
+    y = clamp_double(y, 0.0, (double)(height - 1u));
+    u32 x0 = (u32)x;
+    u32 y0 = (u32)y;
+    u32 x1 = (x0 + 1u < width) ? (x0 + 1u) : x0;
+    u32 y1 = (y0 + 1u < height) ? (y0 + 1u) : y0;
+    double fx = x - (double)x0;
+    double fy = y - (double)y0;
+    const float* row0 = plane + (usize)y0 * width;
+    const float* row1 = plane + (usize)y1 * width;
+    double v0 = (double)row0[x0] * (1.0 - fx) + (double)row0[x1] * fx;
+    double v1 = (double)row1[x0] * (1.0 - fx) + (double)row1[x1] * fx;
+    return v0 * (1.0 - fy) + v1 * fy;
+}
+
+namespace MetadataTile {
+    using namespace makocode;
+
+    static const u32 TILE_SIDE = 48u;
+    static const u32 TILE_BORDER = 1u;
+    [[maybe_unused]] static const u32 TILE_INNER_SIDE = TILE_SIDE - TILE_BORDER * 2u;
+    static const u32 TILE_HEADER_BITS = 32u;
     static const u32 TILE_HEADER_REPETITIONS = 5u;
     static const u32 TILE_RS_PARITY_BYTES = 32u;
-    static const u32 TILE_SCHEMA_VERSION = 1u;
+    static const u32 TILE_SCHEMA_VERSION = 3u;
+    // Schema 1 pages stored custom-palette pixels as one whole-page base-N
+    // number; schema 2 switched to fixed-width digit blocks; schema 3 stores
+    // ECC blocks with EccInterleave rather than the whole-stream shuffle.
+    static const u32 TILE_SCHEMA_WHOLE_PAGE_DIGITS = 1u;
+    static const u32 TILE_SCHEMA_ECC_INTERLEAVED = 3u;
+
+    static bool tile_schema_supported(u64 schema) {
+        return schema >= (u64)TILE_SCHEMA_WHOLE_PAGE_DIGITS && schema <= (u64)TILE_SCHEMA_VERSION;
+    }
 
     // Reserve a central hole to avoid high-risk collisions with fiducial pixels.
     static const u32 TILE_HOLE_SIDE = 20u;
@@ -12190,40 +14160,6 @@ namespace MetadataTile {
         return 0.2126 * (double)r + 0.7152 * (double)g + 0.0722 * (double)b;
     }
 
-    static double sample_luminance_bilinear(const u8* pixel_data_rgb,
-                                            u32 width_pixels,
-                                            u32 height_pixels,
-                                            double x,
-                                            double y) {
-        if (!pixel_data_rgb || width_pixels == 0u || height_pixels == 0u) {
-            return 0.0;
-        }
-        x = clamp_double(x, 0.0, (double)(width_pixels - 1u));
-        y = clamp_double(y, 0.0, (double)(height_pixels - 1u));
-        u32 x0 = (u32)floor(x);
-        u32 y0 = (u32)floor(y);
-        u32 x1 = (x0 + 1u < width_pixels) ? (x0 + 1u) : x0;
-        u32 y1 = (y0 + 1u < height_pixels) ? (y0 + 1u) : y0;
-        double fx = x - (double)x0;
-        double fy = y - (double)y0;
-
-        auto lum_at = [&](u32 ix, u32 iy) -> double {
-            usize idx = ((usize)iy * (usize)width_pixels + (usize)ix) * 3u;
-            u8 r = pixel_data_rgb[idx + 0u];
-            u8 g = pixel_data_rgb[idx + 1u];
-            u8 b = pixel_data_rgb[idx + 2u];
-            return rgb_luminance_u8(r, g, b);
-        };
-
-        double v00 = lum_at(x0, y0);
-        double v10 = lum_at(x1, y0);
-        double v01 = lum_at(x0, y1);
-        double v11 = lum_at(x1, y1);
-        double v0 = v00 * (1.0 - fx) + v10 * fx;
-        double v1 = v01 * (1.0 - fx) + v11 * fx;
-        return v0 * (1.0 - fy) + v1 * fy;
-    }
-
     static bool palette_endpoints_have_contrast(const PaletteColor& light,
                                                 const PaletteColor& dark,
                                                 double min_luma_gap) {
@@ -12276,6 +14212,7 @@ namespace MetadataTile {
         u64 ecc_original_bytes;
         u32 palette_count;
         PaletteColor palette[MAX_CUSTOM_PALETTE_COLORS];
+        u32 schema_version;
 
         Values()
             : page_bits(0u),
@@ -12291,7 +14228,8 @@ namespace MetadataTile {
               ecc_block_count(0u),
               ecc_original_bytes(0u),
               palette_count(0u),
-              palette() {}
+              palette(),
+              schema_version(TILE_SCHEMA_VERSION) {}
     };
 
     static u8 compute_crc8(const u8* data, usize length) {
@@ -12737,7 +14675,7 @@ namespace MetadataTile {
                 return false;
             }
             u32 schema = (header_out >> 12) & 0x0Fu;
-            if (schema != TILE_SCHEMA_VERSION) return false;
+            if (!tile_schema_supported(schema)) return false;
             u32 meta_len = (header_out >> 4) & 0xFFu;
             u32 palette_count = header_out & 0x0Fu;
             if (palette_count < 2u || palette_count > MAX_CUSTOM_PALETTE_COLORS) return false;
@@ -12808,7 +14746,8 @@ namespace MetadataTile {
         u64 magic32 = reader.read_bits(32u);
         if (reader.failed || magic32 != 0x4D4B4D44u) return false;
         u64 schema8 = reader.read_bits(8u);
-        if (reader.failed || schema8 != TILE_SCHEMA_VERSION) return false;
+        if (reader.failed || !tile_schema_supported(schema8)) return false;
+        out_values.schema_version = (u32)schema8;
         u64 pal_count = reader.read_bits(8u);
         if (reader.failed || pal_count != (u64)palette_count) return false;
         out_values.palette_count = (u32)pal_count;
@@ -12849,9 +14788,7 @@ namespace MetadataTile {
         double angle_rad;
     };
 
-    static bool match_tile_header_affine(const u8* pixel_data_rgb,
-                                         u32 width_pixels,
-                                         u32 height_pixels,
+    static bool match_tile_header_affine(const LumaPyramid& luma,
                                          u32 data_height_pixels,
                                          const AffineParams& affine,
                                          u32& header_out,
@@ -12860,7 +14797,9 @@ namespace MetadataTile {
         header_out = 0u;
         inverted_out = false;
         confidence_out = 0.0;
-        if (!pixel_data_rgb || width_pixels == 0u || height_pixels == 0u || data_height_pixels == 0u) return false;
+        u32 width_pixels = luma.widths[0];
+        u32 height_pixels = luma.heights[0];
+        if (!luma.level_count || width_pixels == 0u || height_pixels == 0u || data_height_pixels == 0u) return false;
         if (data_height_pixels > height_pixels) data_height_pixels = height_pixels;
         if (!(affine.pitch_pixels > 0.0)) return false;
 
@@ -12900,7 +14839,7 @@ namespace MetadataTile {
             double sy = (double)module_y - half;
             double x = affine.center_x + vx_x * sx + vy_x * sy;
             double y = affine.center_y + vx_y * sx + vy_y * sy;
-            return sample_luminance_bilinear(pixel_data_rgb, width_pixels, height_pixels, x, y);
+            return luma_pyramid_sample(luma, 0u, x, y);
         };
 
         // Cheap threshold estimate for header probing.
@@ -12948,7 +14887,7 @@ namespace MetadataTile {
                 return false;
             }
             u32 schema = (header_tmp >> 12) & 0x0Fu;
-            if (schema != TILE_SCHEMA_VERSION) return false;
+            if (!tile_schema_supported(schema)) return false;
             u32 meta_len = (header_tmp >> 4) & 0xFFu;
             u32 palette_count = header_tmp & 0x0Fu;
             if (palette_count < 2u || palette_count > MAX_CUSTOM_PALETTE_COLORS) return false;
@@ -12973,15 +14912,15 @@ namespace MetadataTile {
         return true;
     }
 
-    static bool decode_tile_affine(const u8* pixel_data_rgb,
-                                   u32 width_pixels,
-                                   u32 height_pixels,
+    static bool decode_tile_affine(const LumaPyramid& luma,
                                    u32 data_height_pixels,
                                    const AffineParams& affine,
                                    Values& out_values,
                                    ByteBuffer& out_palette_text,
                                    double* out_border_mismatch = 0) {
-        if (!pixel_data_rgb || width_pixels == 0u || height_pixels == 0u || data_height_pixels == 0u) return false;
+        u32 width_pixels = luma.widths[0];
+        u32 height_pixels = luma.heights[0];
+        if (!luma.level_count || width_pixels == 0u || height_pixels == 0u || data_height_pixels == 0u) return false;
         if (data_height_pixels > height_pixels) data_height_pixels = height_pixels;
         if (!(affine.pitch_pixels > 0.0)) return false;
 
@@ -13022,7 +14961,7 @@ namespace MetadataTile {
             double sy = (double)module_y - half;
             double x = affine.center_x + vx_x * sx + vy_x * sy;
             double y = affine.center_y + vx_y * sx + vy_y * sy;
-            return sample_luminance_bilinear(pixel_data_rgb, width_pixels, height_pixels, x, y);
+            return luma_pyramid_sample(luma, 0u, x, y);
         };
 
         // Threshold from inner region statistics (like decode_tile).
@@ -13069,7 +15008,7 @@ namespace MetadataTile {
                 return false;
             }
             u32 schema = (header_out >> 12) & 0x0Fu;
-            if (schema != TILE_SCHEMA_VERSION) return false;
+            if (!tile_schema_supported(schema)) return false;
             u32 meta_len = (header_out >> 4) & 0xFFu;
             u32 palette_count = header_out & 0x0Fu;
             if (palette_count < 2u || palette_count > MAX_CUSTOM_PALETTE_COLORS) return false;
@@ -13157,7 +15096,8 @@ namespace MetadataTile {
         u64 magic32 = reader.read_bits(32u);
         if (reader.failed || magic32 != 0x4D4B4D44u) return false;
         u64 schema8 = reader.read_bits(8u);
-        if (reader.failed || schema8 != TILE_SCHEMA_VERSION) return false;
+        if (reader.failed || !tile_schema_supported(schema8)) return false;
+        out_values.schema_version = (u32)schema8;
         u64 pal_count = reader.read_bits(8u);
         if (reader.failed || pal_count != (u64)palette_count) return false;
         out_values.palette_count = (u32)pal_count;
@@ -13190,6 +15130,299 @@ namespace MetadataTile {
         return true;
     }
 
+    // Pose candidate produced by the tile search, ranked by `rank` (the pattern
+    // score less small penalties for implausible poses).
+    struct TileCandidate {
+        AffineParams affine;
+        double score;
+        double rank;
+    };
+
+    static const u32 TILE_SEARCH_TOP_K = 16u;
+
+    // Best-first list of at most TILE_SEARCH_TOP_K candidates. With
+    // `merge_nearby` set, a pose within about one module, half a degree and
+    // 0.15 pitch of a kept one counts as the same peak and only the better of
+    // the two survives, so the list spans distinct peaks.
+    struct TileCandidateList {
+        TileCandidate items[TILE_SEARCH_TOP_K];
+        u32 count;
+        bool merge_nearby;
+
+        explicit TileCandidateList(bool merge) : count(0u), merge_nearby(merge) {}
+
+        void offer(const AffineParams& affine, double score, double rank) {
+            u32 slot = count;
+            if (merge_nearby) {
+                for (u32 i = 0u; i < count; ++i) {
+                    const AffineParams& kept = items[i].affine;
+                    double radius = (kept.pitch_pixels > 1.0) ? kept.pitch_pixels : 1.0;
+                    if (fabs(kept.center_x - affine.center_x) <= radius &&
+                        fabs(kept.center_y - affine.center_y) <= radius &&
+                        fabs(kept.angle_rad - affine.angle_rad) <= 0.5 * (3.14159265358979323846 / 180.0) &&
+                        fabs(kept.pitch_pixels - affine.pitch_pixels) <= 0.15) {
+                        if (rank <= items[i].rank) {
+                            return;
+                        }
+                        slot = i;
+                        break;
+                    }
+                }
+            }
+            if (slot == count) {
+                if (count < TILE_SEARCH_TOP_K) {
+                    ++count;
+                } else if (rank > items[count - 1u].rank) {
+                    slot = count - 1u;
+                } else {
+                    return;
+                }
+            }
+            while (slot > 0u && items[slot - 1u].rank < rank) {
+                items[slot] = items[slot - 1u];
+                --slot;
+            }
+            items[slot].affine = affine;
+            items[slot].score = score;
+            items[slot].rank = rank;
+        }
+    };
+
+    // Finest pyramid level on which a module of `pitch` pixels still spans at
+    // least two samples.
+    static u32 tile_search_level(const LumaPyramid& luma, double pitch) {
+        u32 level = 0u;
+        while (level + 1u < luma.level_count && pitch >= 4.0 * (double)(1u << level)) {
+            ++level;
+        }
+        return level;
+    }
+
+    // Pyramid depth needed for tile_search_level() at pitches up to `pitch_max`.
+    static u32 tile_search_level_count(double pitch_max) {
+        u32 levels = 1u;
+        while (levels < LumaPyramid::MAX_LEVELS && pitch_max >= 4.0 * (double)(1u << (levels - 1u))) {
+            ++levels;
+        }
+        return levels;
+    }
+
+    // Normalised correlation between the luminance under a tile pose and the
+    // modules the format fixes: the 'MK' magic in every header repetition and,
+    // with `with_border`, the checkerboard frame. The magic alone is cheap and
+    // tolerant enough for the coarse sweep; the frame spans the whole tile and
+    // pins down pitch and angle during refinement. Dark modules are expected
+    // where the pattern has a 1, so an inverted tile correlates negatively and
+    // the score is the magnitude, in [0, 1]. Poses that leave the data region
+    // score 0.
+    static double score_tile_pattern(const LumaPyramid& luma,
+                                     u32 level,
+                                     u32 data_height_pixels,
+                                     const AffineParams& affine,
+                                     bool with_border) {
+        u32 width_pixels = luma.widths[0];
+        if (!luma.level_count || width_pixels == 0u || data_height_pixels == 0u) return 0.0;
+        if (!(affine.pitch_pixels > 0.0)) return 0.0;
+        double c = cos(affine.angle_rad);
+        double s = sin(affine.angle_rad);
+        double vx_x = affine.pitch_pixels * c;
+        double vx_y = affine.pitch_pixels * s;
+        double vy_x = -affine.pitch_pixels * s;
+        double vy_y = affine.pitch_pixels * c;
+        double half = ((double)TILE_SIDE - 1.0) * 0.5;
+        double extent_x = (fabs(vx_x) + fabs(vy_x)) * half;
+        double extent_y = (fabs(vx_y) + fabs(vy_y)) * half;
+        if (affine.center_x - extent_x < 0.0 || affine.center_y - extent_y < 0.0 ||
+            affine.center_x + extent_x > (double)(width_pixels - 1u) ||
+            affine.center_y + extent_y > (double)(data_height_pixels - 1u)) {
+            return 0.0;
+        }
+        double n = 0.0;
+        double sum_l = 0.0;
+        double sum_ll = 0.0;
+        double sum_p = 0.0;
+        double sum_lp = 0.0;
+        auto accumulate = [&](u32 module_x, u32 module_y, u32 dark) {
+            double sx = (double)module_x - half;
+            double sy = (double)module_y - half;
+            double l = luma_pyramid_sample(luma,
+                                           level,
+                                           affine.center_x + vx_x * sx + vy_x * sy,
+                                           affine.center_y + vx_y * sx + vy_y * sy);
+            n += 1.0;
+            sum_l += l;
+            sum_ll += l * l;
+            if (dark) {
+                sum_p += 1.0;
+                sum_lp += l;
+            }
+        };
+        const u32 magic = 0x4D4Du;
+        for (u32 rep = 0u; rep < TILE_HEADER_REPETITIONS; ++rep) {
+            for (u32 bit = 0u; bit < 16u; ++bit) {
+                accumulate(TILE_BORDER + 16u + bit, TILE_BORDER + rep, (magic >> bit) & 1u);
+            }
+        }
+        if (with_border) {
+            for (u32 i = 0u; i + 1u < TILE_SIDE; ++i) {
+                u32 last = TILE_SIDE - 1u;
+                accumulate(i, 0u, i & 1u);
+                accumulate(last, i, (last + i) & 1u);
+                accumulate(last - i, last, (last - i + last) & 1u);
+                accumulate(0u, last - i, (last - i) & 1u);
+            }
+        }
+        // Pattern values are 0/1, so sum_pp == sum_p.
+        double var_l = n * sum_ll - sum_l * sum_l;
+        double var_p = n * sum_p - sum_p * sum_p;
+        if (!(var_l > n * n) || !(var_p > 0.0)) {
+            return 0.0;
+        }
+        double ncc = (n * sum_lp - sum_l * sum_p) / sqrt(var_l * var_p);
+        return fabs(ncc);
+    }
+
+    struct TileSearchWindow {
+        double center_x;
+        double center_y;
+        int center_span;
+        int center_step;
+        double angle_span_degrees;
+        double angle_step_degrees;
+        double pitch_min;
+        double pitch_max;
+        double pitch_step;
+        double pitch_guess;
+    };
+
+    // Coarse stage: sweep the window scoring only the header magic, each pose
+    // on the coarsest pyramid level that still resolves its modules, and keep
+    // the best distinct peaks.
+    static void collect_tile_candidates(const LumaPyramid& luma,
+                                        u32 data_height_pixels,
+                                        const TileSearchWindow& window,
+                                        double min_score,
+                                        TileCandidateList& out) {
+        for (int dy = -window.center_span; dy <= window.center_span; dy += window.center_step) {
+            for (int dx = -window.center_span; dx <= window.center_span; dx += window.center_step) {
+                for (double angle = -window.angle_span_degrees;
+                     angle <= window.angle_span_degrees + 1e-9;
+                     angle += window.angle_step_degrees) {
+                    for (double pitch = window.pitch_min; pitch <= window.pitch_max + 1e-9; pitch += window.pitch_step) {
+                        AffineParams affine;
+                        affine.center_x = window.center_x + (double)dx;
+                        affine.center_y = window.center_y + (double)dy;
+                        affine.pitch_pixels = pitch;
+                        affine.angle_rad = angle * (3.14159265358979323846 / 180.0);
+                        double score = score_tile_pattern(luma,
+                                                          tile_search_level(luma, pitch),
+                                                          data_height_pixels,
+                                                          affine,
+                                                          false);
+                        if (score < min_score) {
+                            continue;
+                        }
+                        double rank = score;
+                        rank -= fabs(angle) * 0.01;
+                        rank -= fabs(pitch - window.pitch_guess) * 0.05;
+                        rank -= (fabs((double)dx) + fabs((double)dy)) * 0.0005;
+                        out.offer(affine, score, rank);
+                    }
+                }
+            }
+        }
+    }
+
+    // Fine stage for one coarse candidate, at full resolution with the frame
+    // included in the score: a 2px / 0.25deg / 0.05 grid over the coarse cell
+    // and its neighbours, then a 1px / 0.05deg / 0.01 grid around the winner.
+    // The best poses of the last grid are returned best first.
+    static void refine_tile_candidate(const LumaPyramid& luma,
+                                      u32 data_height_pixels,
+                                      const AffineParams& start,
+                                      TileCandidateList& out) {
+        AffineParams best = start;
+        double best_score = -1.0;
+        for (int dy = -6; dy <= 6; dy += 2) {
+            for (int dx = -6; dx <= 6; dx += 2) {
+                for (int a = -3; a <= 3; ++a) {
+                    for (int p = -5; p <= 5; ++p) {
+                        AffineParams affine;
+                        affine.center_x = start.center_x + (double)dx;
+                        affine.center_y = start.center_y + (double)dy;
+                        affine.angle_rad = start.angle_rad + (double)a * 0.25 * (3.14159265358979323846 / 180.0);
+                        affine.pitch_pixels = start.pitch_pixels + (double)p * 0.05;
+                        double score = score_tile_pattern(luma, 0u, data_height_pixels, affine, true);
+                        if (score > best_score) {
+                            best_score = score;
+                            best = affine;
+                        }
+                    }
+                }
+            }
+        }
+        AffineParams center = best;
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                for (int a = -4; a <= 4; ++a) {
+                    for (int p = -4; p <= 4; ++p) {
+                        AffineParams affine;
+                        affine.center_x = center.center_x + (double)dx;
+                        affine.center_y = center.center_y + (double)dy;
+                        affine.angle_rad = center.angle_rad + (double)a * 0.05 * (3.14159265358979323846 / 180.0);
+                        affine.pitch_pixels = center.pitch_pixels + (double)p * 0.01;
+                        double score = score_tile_pattern(luma, 0u, data_height_pixels, affine, true);
+                        if (score > 0.0) {
+                            out.offer(affine, score, score);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    static void log_tile_search_window(const TileSearchWindow& window) {
+        char buf[64];
+        console_write(2, "debug metadata tile: affine search base_center=");
+        format_fixed_3(window.center_x, buf, sizeof(buf));
+        console_write(2, buf);
+        console_write(2, ",");
+        format_fixed_3(window.center_y, buf, sizeof(buf));
+        console_write(2, buf);
+        console_write(2, " pitch_guess=");
+        format_fixed_3(window.pitch_guess, buf, sizeof(buf));
+        console_write(2, buf);
+        console_write(2, " pitch_range=");
+        format_fixed_3(window.pitch_min, buf, sizeof(buf));
+        console_write(2, buf);
+        console_write(2, "..");
+        format_fixed_3(window.pitch_max, buf, sizeof(buf));
+        console_line(2, buf);
+    }
+
+    static void log_tile_affine(const char* prefix, const AffineParams& affine) {
+        char buf_angle[64];
+        char buf_pitch[64];
+        char buf_cx[64];
+        char buf_cy[64];
+        format_fixed_3(affine.angle_rad * (180.0 / 3.14159265358979323846), buf_angle, sizeof(buf_angle));
+        format_fixed_3(affine.pitch_pixels, buf_pitch, sizeof(buf_pitch));
+        format_fixed_3(affine.center_x, buf_cx, sizeof(buf_cx));
+        format_fixed_3(affine.center_y, buf_cy, sizeof(buf_cy));
+        console_write(2, prefix);
+        console_write(2, buf_angle);
+        console_write(2, " pitch=");
+        console_write(2, buf_pitch);
+        console_write(2, " center=");
+        console_write(2, buf_cx);
+        console_write(2, ",");
+        console_line(2, buf_cy);
+    }
+
+    // Hierarchical affine tile recovery: a coarse magic-only sweep over a
+    // luminance pyramid, full-resolution refinement of the best distinct
+    // peaks, and a full decode attempted best-first that stops at the first
+    // tile whose CRC validates.
     static bool search_decode_tile_affine(const u8* pixel_data_rgb,
                                           u32 width_pixels,
                                           u32 height_pixels,
@@ -13203,11 +15436,6 @@ namespace MetadataTile {
         if (!pixel_data_rgb || width_pixels == 0u || height_pixels == 0u || data_height_pixels == 0u) return false;
         if (data_height_pixels > height_pixels) data_height_pixels = height_pixels;
 
-        // For now the metadata tile is expected near the page center (even when the fiducial grid
-        // isn't reliable or present), so anchor the search at the image midpoint.
-        double base_center_x = (double)width_pixels * 0.5;
-        double base_center_y = (double)data_height_pixels * 0.5;
-
         // Estimate pixels-per-module. Prefer the caller's logical size hint; fall back to
         // the square-page heuristic when unavailable.
         double pitch_guess = 1.0;
@@ -13225,194 +15453,63 @@ namespace MetadataTile {
         }
         if (!(pitch_guess > 0.0)) pitch_guess = 1.0;
 
-        // Stage 1: find a header match (cheap), then refine and fully decode.
+        // The metadata tile is expected near the page center (even when the fiducial grid
+        // isn't reliable or present), so anchor the search at the image midpoint.
         // NOTE: `estimate_square_page_from_image()` is tuned for general pages and is not a reliable
-        // predictor of metadata-tile pixels-per-module (e.g. it may prefer ~2x over ~3x).
-        // Use a broader pitch search window here.
-        // Keep the search broad enough for the distorted cases in the suite,
-        // but avoid the explosive Cartesian grid from the original values
-        // (96px span, 0.1deg angle, 0.1px pitch) which can take minutes.
-        // Heuristics:
-        //   - center search span scales with the guessed pitch but is capped;
-        //   - slightly coarser center/angle/pitch steps.
-        double pitch_min = 0.90;
-        double pitch_max = 4.20;
-        if (pitch_guess > 0.0) {
-            double lower = pitch_guess * 0.60;
-            double upper = pitch_guess * 2.10;
-            pitch_min = clamp_double(lower, 0.90, 4.20);
-            pitch_max = clamp_double(upper, pitch_min + 0.20, 4.20);
-        }
-        const int kCenterSpan = (int)clamp_double(pitch_guess * 16.0, 32.0, 64.0);
-        const int kCenterStepCoarse = 6;
-
+        // predictor of metadata-tile pixels-per-module (e.g. it may prefer ~2x over ~3x), so the
+        // pitch window is broad; the center span scales with the guessed pitch but is capped.
+        TileSearchWindow window;
+        window.center_x = (double)width_pixels * 0.5;
+        window.center_y = (double)data_height_pixels * 0.5;
+        window.center_span = (int)clamp_double(pitch_guess * 16.0, 32.0, 64.0);
+        window.center_step = 6;
+        window.angle_span_degrees = max_abs_angle_degrees;
+        window.angle_step_degrees = 0.1;
+        window.pitch_min = clamp_double(pitch_guess * 0.60, 0.90, 4.20);
+        window.pitch_max = clamp_double(pitch_guess * 2.10, window.pitch_min + 0.20, 4.20);
+        window.pitch_step = 0.10;
+        window.pitch_guess = pitch_guess;
         if (debug_logging_enabled()) {
-            char buf[64];
-            console_write(2, "debug metadata tile: affine search base_center=");
-            format_fixed_3(base_center_x, buf, sizeof(buf));
-            console_write(2, buf);
-            console_write(2, ",");
-            format_fixed_3(base_center_y, buf, sizeof(buf));
-            console_write(2, buf);
-            console_write(2, " pitch_guess=");
-            format_fixed_3(pitch_guess, buf, sizeof(buf));
-            console_write(2, buf);
-            console_write(2, " pitch_range=");
-            format_fixed_3(pitch_min, buf, sizeof(buf));
-            console_write(2, buf);
-            console_write(2, "..");
-            format_fixed_3(pitch_max, buf, sizeof(buf));
-            console_line(2, buf);
-        }
-
-        bool have_best = false;
-        double best_score = 1e30;
-        AffineParams best_affine = {};
-
-        for (int dy = -kCenterSpan; dy <= kCenterSpan; dy += kCenterStepCoarse) {
-            for (int dx = -kCenterSpan; dx <= kCenterSpan; dx += kCenterStepCoarse) {
-                double cx = base_center_x + (double)dx;
-                double cy = base_center_y + (double)dy;
-                for (double angle = -max_abs_angle_degrees; angle <= max_abs_angle_degrees + 1e-9; angle += 0.1) {
-                    double angle_rad = angle * (3.14159265358979323846 / 180.0);
-                    for (double pitch = pitch_min; pitch <= pitch_max + 1e-9; pitch += 0.10) {
-                        AffineParams affine;
-                        affine.center_x = cx;
-                        affine.center_y = cy;
-                        affine.pitch_pixels = pitch;
-                        affine.angle_rad = angle_rad;
-                        u32 header = 0u;
-                        bool inverted = false;
-                        double confidence = 0.0;
-                        if (!match_tile_header_affine(pixel_data_rgb,
-                                                      width_pixels,
-                                                      height_pixels,
-                                                      data_height_pixels,
-                                                      affine,
-                                                      header,
-                                                      inverted,
-                                                      confidence)) {
-                            continue;
-                        }
-                        if (confidence < 0.55) {
-                            continue;
-                        }
-                        double score = -confidence;
-                        score += fabs(angle) * 0.01;
-                        score += fabs(pitch - pitch_guess) * 0.05;
-                        score += (fabs((double)dx) + fabs((double)dy)) * 0.0005;
-                        if (score < best_score) {
-                            best_score = score;
-                            best_affine = affine;
-                            have_best = true;
-                        }
-                    }
-                }
-            }
+            log_tile_search_window(window);
         }
 
-        if (!have_best) {
+        LumaPyramid luma;
+        if (!luma_pyramid_build(luma,
+                                pixel_data_rgb,
+                                width_pixels,
+                                height_pixels,
+                                tile_search_level_count(window.pitch_max))) {
             return false;
         }
 
-        // Stage 2: refine around the best header match and fully decode.
-        const int kRefineSpan = 6;
-        const double kRefineAngleSpan = 0.75;
-        const double kRefinePitchSpan = 0.25;
-        for (int dy = -kRefineSpan; dy <= kRefineSpan; ++dy) {
-            for (int dx = -kRefineSpan; dx <= kRefineSpan; ++dx) {
-                double cx = best_affine.center_x + (double)dx;
-                double cy = best_affine.center_y + (double)dy;
-                double base_angle_deg = best_affine.angle_rad * (180.0 / 3.14159265358979323846);
-                for (double angle = base_angle_deg - kRefineAngleSpan; angle <= base_angle_deg + kRefineAngleSpan + 1e-9; angle += 0.05) {
-                    double angle_rad = angle * (3.14159265358979323846 / 180.0);
-                    for (double pitch = best_affine.pitch_pixels - kRefinePitchSpan; pitch <= best_affine.pitch_pixels + kRefinePitchSpan + 1e-9; pitch += 0.01) {
-                        if (!(pitch > 0.0)) continue;
-                        AffineParams affine;
-                        affine.center_x = cx;
-                        affine.center_y = cy;
-                        affine.pitch_pixels = pitch;
-                        affine.angle_rad = angle_rad;
-                        Values values;
-                        ByteBuffer pal_text;
-                        if (!decode_tile_affine(pixel_data_rgb,
-                                                width_pixels,
-                                                height_pixels,
-                                                data_height_pixels,
-                                                affine,
-                                                values,
-                                                pal_text)) {
-                            continue;
-                        }
-                        out_values = values;
-                        byte_buffer_move(out_palette_text, pal_text);
-                        if (found_affine_out) {
-                            *found_affine_out = affine;
-                        }
-                        if (debug_logging_enabled()) {
-                            char buf_angle[64];
-                            char buf_pitch[64];
-                            char buf_cx[64];
-                            char buf_cy[64];
-                            format_fixed_3(angle, buf_angle, sizeof(buf_angle));
-                            format_fixed_3(pitch, buf_pitch, sizeof(buf_pitch));
-                            format_fixed_3(cx, buf_cx, sizeof(buf_cx));
-                            format_fixed_3(cy, buf_cy, sizeof(buf_cy));
-                            console_write(2, "debug metadata tile: affine decoded angle_deg=");
-                            console_write(2, buf_angle);
-                            console_write(2, " pitch=");
-                            console_write(2, buf_pitch);
-                            console_write(2, " center=");
-                            console_write(2, buf_cx);
-                            console_write(2, ",");
-                            console_line(2, buf_cy);
-                        }
-                        return true;
-                    }
+        TileCandidateList coarse(true);
+        collect_tile_candidates(luma, data_height_pixels, window, 0.5, coarse);
+        for (u32 i = 0u; i < coarse.count; ++i) {
+            TileCandidateList fine(false);
+            refine_tile_candidate(luma, data_height_pixels, coarse.items[i].affine, fine);
+            for (u32 j = 0u; j < fine.count; ++j) {
+                const AffineParams& affine = fine.items[j].affine;
+                Values values;
+                ByteBuffer pal_text;
+                stats_count(StatsCounter_TileAffineAttempts, 1u);
+                if (!decode_tile_affine(luma, data_height_pixels, affine, values, pal_text)) {
+                    continue;
+                }
+                out_values = values;
+                byte_buffer_move(out_palette_text, pal_text);
+                if (found_affine_out) {
+                    *found_affine_out = affine;
+                }
+                if (debug_logging_enabled()) {
+                    log_tile_affine("debug metadata tile: affine decoded angle_deg=", affine);
                 }
+                return true;
             }
         }
-
         return false;
     }
 } // namespace MetadataTile
 
-static double debug_sample_luminance_bilinear(const u8* pixel_data_rgb,
-                                              u32 width_pixels,
-                                              u32 height_pixels,
-                                              double x,
-                                              double y) {
-    if (!pixel_data_rgb || width_pixels == 0u || height_pixels == 0u) {
-        return 0.0;
-    }
-    x = clamp_double(x, 0.0, (double)(width_pixels - 1u));
-    y = clamp_double(y, 0.0, (double)(height_pixels - 1u));
-
-    u32 x0 = (u32)floor(x);
-    u32 y0 = (u32)floor(y);
-    u32 x1 = (x0 + 1u < width_pixels) ? (x0 + 1u) : x0;
-    u32 y1 = (y0 + 1u < height_pixels) ? (y0 + 1u) : y0;
-    double fx = x - (double)x0;
-    double fy = y - (double)y0;
-
-    auto lum_at = [&](u32 ix, u32 iy) -> double {
-        usize idx = ((usize)iy * (usize)width_pixels + (usize)ix) * 3u;
-        u8 r = pixel_data_rgb[idx + 0u];
-        u8 g = pixel_data_rgb[idx + 1u];
-        u8 b = pixel_data_rgb[idx + 2u];
-        return 0.2126 * (double)r + 0.7152 * (double)g + 0.0722 * (double)b;
-    };
-
-    double v00 = lum_at(x0, y0);
-    double v10 = lum_at(x1, y0);
-    double v01 = lum_at(x0, y1);
-    double v11 = lum_at(x1, y1);
-
-    double v0 = v00 * (1.0 - fx) + v10 * fx;
-    double v1 = v01 * (1.0 - fx) + v11 * fx;
-    return v0 * (1.0 - fy) + v1 * fy;
-}
-
 struct DebugMetadataTileProbe {
     bool found;
     bool inverted_header;
@@ -13436,150 +15533,6 @@ struct DebugMetadataTileProbe {
           palette_count(0u) {}
 };
 
-static bool debug_try_metadata_tile_header_affine(const u8* pixel_data_rgb,
-                                                 u32 width_pixels,
-                                                 u32 height_pixels,
-                                                 u32 data_height_pixels,
-                                                 double center_x,
-                                                 double center_y,
-                                                 double pitch_pixels,
-                                                 double angle_rad,
-                                                 DebugMetadataTileProbe& out_probe) {
-    using namespace MetadataTile;
-    if (!pixel_data_rgb || width_pixels == 0u || height_pixels == 0u || data_height_pixels == 0u) {
-        return false;
-    }
-    if (data_height_pixels > height_pixels) {
-        data_height_pixels = height_pixels;
-    }
-    if (!(pitch_pixels > 0.0)) {
-        return false;
-    }
-
-    double c = cos(angle_rad);
-    double s = sin(angle_rad);
-    double vx_x = pitch_pixels * c;
-    double vx_y = pitch_pixels * s;
-    double vy_x = -pitch_pixels * s;
-    double vy_y = pitch_pixels * c;
-    double half = ((double)TILE_SIDE - 1.0) * 0.5;
-
-    auto corner_x = [&](double sx, double sy) -> double {
-        return center_x + vx_x * sx + vy_x * sy;
-    };
-    auto corner_y = [&](double sx, double sy) -> double {
-        return center_y + vx_y * sx + vy_y * sy;
-    };
-    double tl_x = corner_x(-half, -half);
-    double tl_y = corner_y(-half, -half);
-    double tr_x = corner_x(half, -half);
-    double tr_y = corner_y(half, -half);
-    double bl_x = corner_x(-half, half);
-    double bl_y = corner_y(-half, half);
-    double br_x = corner_x(half, half);
-    double br_y = corner_y(half, half);
-
-    double min_x = tl_x;
-    double max_x = tl_x;
-    double min_y = tl_y;
-    double max_y = tl_y;
-    auto expand = [&](double x, double y) {
-        if (x < min_x) min_x = x;
-        if (x > max_x) max_x = x;
-        if (y < min_y) min_y = y;
-        if (y > max_y) max_y = y;
-    };
-    expand(tr_x, tr_y);
-    expand(bl_x, bl_y);
-    expand(br_x, br_y);
-    if (min_x < 0.0 || min_y < 0.0 || max_x > (double)(width_pixels - 1u) ||
-        max_y > (double)(data_height_pixels - 1u)) {
-        return false;
-    }
-
-    auto module_lum = [&](double mx, double my) -> double {
-        // module indices in [0, TILE_SIDE-1], map around center so (half,half) is tile center
-        double sx = mx - half;
-        double sy = my - half;
-        double x = center_x + vx_x * sx + vy_x * sy;
-        double y = center_y + vx_y * sx + vy_y * sy;
-        return debug_sample_luminance_bilinear(pixel_data_rgb, width_pixels, height_pixels, x, y);
-    };
-
-    // Cheap threshold estimate: subsample inner modules.
-    double min_l = 255.0;
-    double max_l = 0.0;
-    for (u32 y = TILE_BORDER; y < TILE_SIDE - TILE_BORDER; y += 4u) {
-        for (u32 x = TILE_BORDER; x < TILE_SIDE - TILE_BORDER; x += 4u) {
-            double l = module_lum((double)x, (double)y);
-            if (l < min_l) min_l = l;
-            if (l > max_l) max_l = l;
-        }
-    }
-    if (!(max_l > min_l + 1.0)) {
-        return false;
-    }
-    double threshold = (min_l + max_l) * 0.5;
-
-    auto read_bit = [&](u32 mx, u32 my) -> u8 {
-        double l = module_lum((double)mx, (double)my);
-        return (l < threshold) ? 1u : 0u; // dark => 1
-    };
-
-    auto decode_header = [&](bool invert_bits, u32& header_out) -> bool {
-        header_out = 0u;
-        for (u32 bit = 0u; bit < TILE_HEADER_BITS; ++bit) {
-            u32 ones = 0u;
-            u32 samples = 0u;
-            for (u32 rep = 0u; rep < TILE_HEADER_REPETITIONS; ++rep) {
-                u32 inner_y = TILE_BORDER + rep;
-                u32 inner_x = TILE_BORDER + bit;
-                if (inner_x >= TILE_SIDE - TILE_BORDER) continue;
-                if (inner_y >= TILE_SIDE - TILE_BORDER) continue;
-                u8 b = read_bit(inner_x, inner_y);
-                if (invert_bits) b ^= 1u;
-                ones += b ? 1u : 0u;
-                ++samples;
-            }
-            if (samples == 0u) return false;
-            u32 bit_value = (ones * 2u >= samples) ? 1u : 0u;
-            header_out |= (bit_value << bit);
-        }
-        u16 magic16 = (u16)((header_out >> 16) & 0xFFFFu);
-        if (magic16 != (u16)0x4D4Du) {
-            return false;
-        }
-        u32 schema = (header_out >> 12) & 0x0Fu;
-        if (schema != TILE_SCHEMA_VERSION) return false;
-        u32 meta_len = (header_out >> 4) & 0xFFu;
-        u32 palette_count = header_out & 0x0Fu;
-        if (palette_count < 2u || palette_count > MAX_CUSTOM_PALETTE_COLORS) return false;
-        if (meta_len == 0u || meta_len > 255u) return false;
-        if (meta_len + TILE_RS_PARITY_BYTES > 255u) return false;
-        return true;
-    };
-
-    u32 header = 0u;
-    bool inverted = false;
-    if (!decode_header(false, header)) {
-        if (!decode_header(true, header)) {
-            return false;
-        }
-        inverted = true;
-    }
-
-    out_probe.found = true;
-    out_probe.inverted_header = inverted;
-    out_probe.center_x = center_x;
-    out_probe.center_y = center_y;
-    out_probe.pitch_pixels = pitch_pixels;
-    out_probe.angle_degrees = angle_rad * (180.0 / 3.14159265358979323846);
-    out_probe.header = header;
-    out_probe.meta_len = (header >> 4) & 0xFFu;
-    out_probe.palette_count = header & 0x0Fu;
-    return true;
-}
-
 static void debug_probe_metadata_tile_affine(const u8* pixel_data_rgb,
                                              u32 width_pixels,
                                              u32 height_pixels,
@@ -13603,37 +15556,48 @@ static void debug_probe_metadata_tile_affine(const u8* pixel_data_rgb,
     u64_to_ascii(data_height_pixels, bufh, sizeof(bufh));
     console_line(2, bufh);
 
-    double base_center_x = (double)width_pixels * 0.5;
-    double base_center_y = (double)data_height_pixels * 0.5;
+    // Search around the page center for small rotations and moderate scale
+    // factors with the same engine the decoder uses, stopping at the first
+    // refined pose whose header reads back. Diagnostic-only; runs with --debug.
+    TileSearchWindow window;
+    window.center_x = (double)width_pixels * 0.5;
+    window.center_y = (double)data_height_pixels * 0.5;
+    window.center_span = 16;
+    window.center_step = 4;
+    window.angle_span_degrees = 2.0;
+    window.angle_step_degrees = 0.1;
+    window.pitch_min = 1.8;
+    window.pitch_max = 3.6;
+    window.pitch_step = 0.1;
+    window.pitch_guess = 2.7;
 
     DebugMetadataTileProbe best;
     bool found_any = false;
-
-    // Coarse search around the page center for small rotations and moderate scale factors.
-    // This is diagnostic-only and runs only with --debug.
-    for (int dy = -16; dy <= 16 && !found_any; dy += 4) {
-        for (int dx = -16; dx <= 16 && !found_any; dx += 4) {
-            double cx = base_center_x + (double)dx;
-            double cy = base_center_y + (double)dy;
-            for (int a = -20; a <= 20 && !found_any; ++a) {
-                double angle_deg = (double)a * 0.1;
-                double angle_rad = angle_deg * (3.14159265358979323846 / 180.0);
-                for (int p = 18; p <= 36 && !found_any; ++p) {
-                    double pitch = (double)p * 0.1;
-                    DebugMetadataTileProbe probe;
-                    if (debug_try_metadata_tile_header_affine(pixel_data_rgb,
-                                                             width_pixels,
-                                                             height_pixels,
-                                                             data_height_pixels,
-                                                             cx,
-                                                             cy,
-                                                             pitch,
-                                                             angle_rad,
-                                                             probe)) {
-                        best = probe;
-                        found_any = true;
-                    }
+    LumaPyramid luma;
+    if (luma_pyramid_build(luma, pixel_data_rgb, width_pixels, height_pixels, tile_search_level_count(window.pitch_max))) {
+        TileCandidateList coarse(true);
+        collect_tile_candidates(luma, data_height_pixels, window, 0.5, coarse);
+        for (u32 i = 0u; i < coarse.count && !found_any; ++i) {
+            TileCandidateList fine(false);
+            refine_tile_candidate(luma, data_height_pixels, coarse.items[i].affine, fine);
+            for (u32 j = 0u; j < fine.count && !found_any; ++j) {
+                const AffineParams& affine = fine.items[j].affine;
+                u32 header = 0u;
+                bool inverted = false;
+                double confidence = 0.0;
+                if (!match_tile_header_affine(luma, data_height_pixels, affine, header, inverted, confidence)) {
+                    continue;
                 }
+                best.found = true;
+                best.inverted_header = inverted;
+                best.center_x = affine.center_x;
+                best.center_y = affine.center_y;
+                best.pitch_pixels = affine.pitch_pixels;
+                best.angle_degrees = affine.angle_rad * (180.0 / 3.14159265358979323846);
+                best.header = header;
+                best.meta_len = (header >> 4) & 0xFFu;
+                best.palette_count = header & 0x0Fu;
+                found_any = true;
             }
         }
     }
@@ -14263,25 +16227,105 @@ static u32 mapping_custom_palette_base(const ImageMappingConfig& mapping) {
     return base;
 }
 
-static usize divide_le_bytes_by_base(u8* data, usize length, u32 base, u32& remainder) {
-    remainder = 0u;
-    if (!data || length == 0u || base < 2u) {
-        return 0u;
+// Non-power-of-two palettes convert the page bitstream in fixed-width groups:
+// every `block_digits` base-N digits carry exactly `block_bits` bits, where
+// 2^block_bits is the largest power of two not above base^block_digits. The
+// group size maximizes bits per digit among groups that fit in a u64, so the
+// conversion is linear in page size and a misread pixel only disturbs its own
+// group. A trailing partial group of r digits carries `tail_bits[r]` bits.
+struct PaletteDigitBlock {
+    u32 block_digits;
+    u32 block_bits;
+    u32 tail_bits[64];
+
+    PaletteDigitBlock()
+        : block_digits(0u),
+          block_bits(0u),
+          tail_bits() {}
+};
+
+static u32 floor_log2_u64(u64 value) {
+    u32 result = 0u;
+    while (value > 1u) {
+        value >>= 1u;
+        ++result;
     }
-    for (ssize_t index = (ssize_t)length - 1; index >= 0; --index) {
-        u32 value = ((u32)remainder << 8u) | (u32)data[index];
-        u32 quotient = value / base;
-        remainder = value % base;
-        data[index] = (u8)quotient;
+    return result;
+}
+
+static bool palette_digit_block_for_base(u32 base, PaletteDigitBlock& block) {
+    block = PaletteDigitBlock();
+    if (base < 2u) {
+        return false;
     }
-    while (length > 0u && data[length - 1u] == 0u) {
-        --length;
+    u64 power = 1u;
+    for (u32 digits = 1u; digits < 64u; ++digits) {
+        if (power > U64_MAX_VALUE / (u64)base) {
+            break;
+        }
+        power *= (u64)base;
+        u32 bits = floor_log2_u64(power);
+        block.tail_bits[digits] = bits;
+        if (block.block_digits == 0u ||
+            (u64)bits * (u64)block.block_digits > (u64)block.block_bits * (u64)digits) {
+            block.block_digits = digits;
+            block.block_bits = bits;
+        }
     }
-    return length;
+    return block.block_digits > 0u && block.block_bits > 0u;
 }
 
-static bool normalize_bits_output_size(makocode::ByteBuffer& bits_out, usize alloc_size) {
-    if (alloc_size == 0u) {
+static u64 palette_digit_block_capacity_bits(const PaletteDigitBlock& block, u64 digit_count) {
+    if (block.block_digits == 0u) {
+        return 0u;
+    }
+    u64 full_blocks = digit_count / (u64)block.block_digits;
+    u32 tail_digits = (u32)(digit_count % (u64)block.block_digits);
+    return full_blocks * (u64)block.block_bits + (u64)block.tail_bits[tail_digits];
+}
+
+static u32 palette_digit_block_tail_digits(const PaletteDigitBlock& block, u32 tail_bit_count) {
+    u32 digits = 0u;
+    while (digits < block.block_digits && block.tail_bits[digits] < tail_bit_count) {
+        ++digits;
+    }
+    return digits;
+}
+
+static u64 load_le_bits_u64(const u8* data, u64 bit_offset, u32 bit_count) {
+    u64 value = 0u;
+    u32 filled = 0u;
+    usize byte_index = (usize)(bit_offset >> 3u);
+    u32 shift = (u32)(bit_offset & 7u);
+    while (filled < bit_count) {
+        value |= ((u64)data[byte_index++] >> shift) << filled;
+        filled += 8u - shift;
+        shift = 0u;
+    }
+    if (bit_count < 64u) {
+        value &= (1ull << bit_count) - 1ull;
+    }
+    return value;
+}
+
+static void store_le_bits_u64(u8* data, u64 bit_offset, u32 bit_count, u64 value) {
+    usize byte_index = (usize)(bit_offset >> 3u);
+    u32 shift = (u32)(bit_offset & 7u);
+    u32 written = 0u;
+    while (written < bit_count) {
+        u32 take = 8u - shift;
+        if (take > bit_count - written) {
+            take = bit_count - written;
+        }
+        u8 chunk = (u8)((value >> written) & ((1u << take) - 1u));
+        data[byte_index++] |= (u8)(chunk << shift);
+        written += take;
+        shift = 0u;
+    }
+}
+
+static bool normalize_bits_output_size(makocode::ByteBuffer& bits_out, usize alloc_size) {
+    if (alloc_size == 0u) {
         alloc_size = bits_out.size;
     }
     if (alloc_size == 0u) {
@@ -14419,30 +16463,64 @@ static bool bits_to_base_digits(makocode::ByteBuffer& bit_scratch,
         digit_count_out = total_digits;
         return true;
     }
-    while (byte_count > 0u) {
-        u32 remainder = 0u;
-        byte_count = divide_le_bytes_by_base(bit_scratch.data, byte_count, base, remainder);
-        if (!digits_out.ensure(digits_out.size + 1u)) {
-            return false;
-        }
-        digits_out.data[digits_out.size++] = (u8)remainder;
+    PaletteDigitBlock block;
+    if (!palette_digit_block_for_base(base, block)) {
+        return false;
     }
-    if (digits_out.size == 0u) {
-        if (!digits_out.ensure(1u)) {
-            return false;
+    u64 full_blocks = bit_count / (u64)block.block_bits;
+    u32 tail_bit_count = (u32)(bit_count % (u64)block.block_bits);
+    u32 tail_digits = palette_digit_block_tail_digits(block, tail_bit_count);
+    u64 total_digits = full_blocks * (u64)block.block_digits + (u64)tail_digits;
+    if (total_digits == 0u) {
+        total_digits = 1u;
+    }
+    if (total_digits > (u64)USIZE_MAX_VALUE) {
+        return false;
+    }
+    usize required = (usize)total_digits;
+    if (!digits_out.ensure(required)) {
+        return false;
+    }
+    for (usize i = 0u; i < required; ++i) {
+        digits_out.data[i] = 0u;
+    }
+    digits_out.size = required;
+    u8* digit_cursor = digits_out.data;
+    u64 bit_cursor = 0u;
+    for (u64 block_index = 0u; block_index <= full_blocks; ++block_index) {
+        u32 group_bits = block.block_bits;
+        u32 group_digits = block.block_digits;
+        if (block_index == full_blocks) {
+            group_bits = tail_bit_count;
+            group_digits = tail_digits;
+        }
+        if (group_bits == 0u) {
+            continue;
         }
-        digits_out.data[0] = 0u;
-        digits_out.size = 1u;
+        u64 value = load_le_bits_u64(bit_scratch.data, bit_cursor, group_bits);
+        bit_cursor += group_bits;
+        for (u32 d = 0u; d < group_digits; ++d) {
+            digit_cursor[d] = (u8)(value % (u64)base);
+            value /= (u64)base;
+        }
+        digit_cursor += group_digits;
     }
-    digit_count_out = (u64)digits_out.size;
+    digit_count_out = total_digits;
     return true;
 }
 
+static bool whole_page_digits_to_bits(const u8* digits,
+                                      u64 digit_count,
+                                      u32 base,
+                                      u64 bit_count_target,
+                                      makocode::ByteBuffer& bits_out);
+
 static bool base_digits_to_bits(const u8* digits,
                                 u64 digit_count,
                                 u32 base,
                                 u64 bit_count_target,
-                                makocode::ByteBuffer& bits_out) {
+                                makocode::ByteBuffer& bits_out,
+                                bool whole_page_digits) {
     bits_out.release();
     if (base < 2u) {
         return false;
@@ -14508,6 +16586,67 @@ static bool base_digits_to_bits(const u8* digits,
         }
         return true;
     }
+    if (whole_page_digits) {
+        return whole_page_digits_to_bits(digits, digit_count, base, bit_count_target, bits_out);
+    }
+    PaletteDigitBlock block;
+    if (!palette_digit_block_for_base(base, block)) {
+        return false;
+    }
+    u64 total_bits = bit_count_target ? bit_count_target
+                                      : palette_digit_block_capacity_bits(block, digit_count);
+    u64 bytes_u64 = (total_bits + 7u) / 8u;
+    if (bytes_u64 == 0u) {
+        bytes_u64 = 1u;
+    }
+    if (bytes_u64 > (u64)USIZE_MAX_VALUE) {
+        return false;
+    }
+    usize bytes_needed = (usize)bytes_u64;
+    if (!bits_out.ensure(bytes_needed)) {
+        return false;
+    }
+    for (usize i = 0u; i < bytes_needed; ++i) {
+        bits_out.data[i] = 0u;
+    }
+    bits_out.size = bytes_needed;
+    u64 bit_cursor = 0u;
+    u64 digit_index = 0u;
+    while (bit_cursor < total_bits) {
+        u32 group_bits = block.block_bits;
+        u32 group_digits = block.block_digits;
+        if (total_bits - bit_cursor < (u64)group_bits) {
+            group_bits = (u32)(total_bits - bit_cursor);
+            group_digits = palette_digit_block_tail_digits(block, group_bits);
+        }
+        if ((u64)group_digits > digit_count - digit_index) {
+            // Like the power-of-two path, bits past the digit capacity stay zero.
+            break;
+        }
+        u64 value = 0u;
+        for (u32 d = group_digits; d > 0u; --d) {
+            u32 digit = digits ? (u32)digits[digit_index + d - 1u] : 0u;
+            if (digit >= base) {
+                return false;
+            }
+            value = value * (u64)base + (u64)digit;
+        }
+        // A misread pixel can push the group past 2^group_bits; keep the low
+        // bits and let the ECC layer repair the damage.
+        store_le_bits_u64(bits_out.data, bit_cursor, group_bits, value);
+        bit_cursor += group_bits;
+        digit_index += group_digits;
+    }
+    return true;
+}
+
+// Schema 1 pages: the digits spell a single little-endian base-N number.
+static bool whole_page_digits_to_bits(const u8* digits,
+                                      u64 digit_count,
+                                      u32 base,
+                                      u64 bit_count_target,
+                                      makocode::ByteBuffer& bits_out) {
+    bits_out.release();
     if (!bits_out.ensure(1u)) {
         return false;
     }
@@ -14551,6 +16690,68 @@ static bool base_digits_to_bits(const u8* digits,
     return true;
 }
 
+// Expands per-digit erasure flags into a bit mask aligned with the output of
+// base_digits_to_bits: every bit carried by a flagged digit's group is marked.
+static bool base_digit_erasures_to_bits(const u8* digit_flags,
+                                        u64 digit_count,
+                                        u32 base,
+                                        u64 bit_count,
+                                        makocode::ByteBuffer& mask_out) {
+    mask_out.release();
+    if (!digit_flags || base < 2u || bit_count == 0u) {
+        return false;
+    }
+    u32 group_digits_full = 1u;
+    u32 group_bits_full = log2_u32(base);
+    PaletteDigitBlock block;
+    if (!is_power_of_two_u32(base)) {
+        if (!palette_digit_block_for_base(base, block)) {
+            return false;
+        }
+        group_digits_full = block.block_digits;
+        group_bits_full = block.block_bits;
+    }
+    if (group_bits_full == 0u) {
+        return false;
+    }
+    u64 bytes_u64 = (bit_count + 7u) / 8u;
+    if (bytes_u64 > (u64)USIZE_MAX_VALUE || !mask_out.ensure((usize)bytes_u64)) {
+        return false;
+    }
+    for (usize i = 0u; i < (usize)bytes_u64; ++i) {
+        mask_out.data[i] = 0u;
+    }
+    mask_out.size = (usize)bytes_u64;
+    u64 bit_cursor = 0u;
+    u64 digit_index = 0u;
+    while (bit_cursor < bit_count) {
+        u32 group_bits = group_bits_full;
+        u32 group_digits = group_digits_full;
+        if (bit_count - bit_cursor < (u64)group_bits) {
+            group_bits = (u32)(bit_count - bit_cursor);
+            if (block.block_digits) {
+                group_digits = palette_digit_block_tail_digits(block, group_bits);
+            }
+        }
+        if ((u64)group_digits > digit_count - digit_index) {
+            break;
+        }
+        bool erased = false;
+        for (u32 d = 0u; d < group_digits; ++d) {
+            if (digit_flags[digit_index + d]) {
+                erased = true;
+                break;
+            }
+        }
+        if (erased) {
+            store_le_bits_u64(mask_out.data, bit_cursor, group_bits, ~0ull);
+        }
+        bit_cursor += group_bits;
+        digit_index += group_digits;
+    }
+    return true;
+}
+
 static bool copy_bits_segment(const u8* source_bits,
                               u64 source_bit_count,
                               u64 bit_offset,
@@ -14568,22 +16769,15 @@ static bool copy_bits_segment(const u8* source_bits,
         return false;
     }
     dest_bits.size = bytes_needed;
-    for (usize i = 0u; i < bytes_needed; ++i) {
-        dest_bits.data[i] = 0u;
-    }
-    for (u64 bit_index = 0u; bit_index < bits_to_copy; ++bit_index) {
-        u64 global_bit = bit_offset + bit_index;
-        if (global_bit >= source_bit_count) {
-            continue;
-        }
-        usize byte_index = (usize)(global_bit >> 3u);
-        u8 mask = (u8)(1u << (global_bit & 7u));
-        bool bit_value = (source_bits[byte_index] & mask) != 0u;
-        if (bit_value) {
-            usize dest_byte = (usize)(bit_index >> 3u);
-            u8 dest_mask = (u8)(1u << (bit_index & 7u));
-            dest_bits.data[dest_byte] = (u8)(dest_bits.data[dest_byte] | dest_mask);
-        }
+    memset(dest_bits.data, 0, bytes_needed);
+    // Bits past the end of the source read as zero.
+    if (bit_offset < source_bit_count) {
+        u64 available = source_bit_count - bit_offset;
+        makocode::copy_bits(dest_bits.data,
+                            0u,
+                            source_bits,
+                            bit_offset,
+                            (bits_to_copy < available) ? bits_to_copy : available);
     }
     return true;
 }
@@ -14804,12 +16998,286 @@ static bool map_rgb_to_samples(u8 mode, const u8* rgb, u32* samples) {
     return true;
 }
 
+// Nearest palette entry for a pixel, with the same tie-breaking as
+// map_rgb_to_samples. A pixel is ambiguous when its distance to the nearest
+// entry exceeds half the distance to the runner-up: blots, smudges and foreign
+// inks land here, and such pixels are handed to the RS decoder as erasures.
+// The palette size is a template parameter so each size gets an unrolled
+// search.
+template <u32 PaletteSize>
+static u32 palette_nearest_fixed(const PaletteColor* palette, const u8* rgb, bool& ambiguous) {
+    u32 best_index = 0u;
+    u32 best = 0xFFFFFFFFu;
+    u32 second = 0xFFFFFFFFu;
+    for (u32 i = 0u; i < PaletteSize; ++i) {
+        int dr = (int)palette[i].r - (int)rgb[0];
+        int dg = (int)palette[i].g - (int)rgb[1];
+        int db = (int)palette[i].b - (int)rgb[2];
+        u32 score = (u32)(dr * dr + dg * dg + db * db);
+        if (score < best) {
+            second = best;
+            best = score;
+            best_index = i;
+        } else if (score < second) {
+            second = score;
+        }
+    }
+    ambiguous = (u64)best * 4u > (u64)second;
+    return best_index;
+}
+
+typedef u32 (*PaletteNearestFn)(const PaletteColor* palette, const u8* rgb, bool& ambiguous);
+
+static PaletteNearestFn palette_nearest_for_size(u32 palette_size) {
+    static const PaletteNearestFn searches[MAX_CUSTOM_PALETTE_COLORS + 1u] = {
+        0, 0,
+        palette_nearest_fixed<2>, palette_nearest_fixed<3>, palette_nearest_fixed<4>, palette_nearest_fixed<5>,
+        palette_nearest_fixed<6>, palette_nearest_fixed<7>, palette_nearest_fixed<8>, palette_nearest_fixed<9>,
+        palette_nearest_fixed<10>, palette_nearest_fixed<11>, palette_nearest_fixed<12>, palette_nearest_fixed<13>,
+        palette_nearest_fixed<14>, palette_nearest_fixed<15>, palette_nearest_fixed<16>
+    };
+    return (palette_size <= MAX_CUSTOM_PALETTE_COLORS) ? searches[palette_size] : 0;
+}
+
+// RGB quantized to 5 bits per channel; each cube cell covers 8x8x8 values.
+static const u32 PALETTE_CUBE_SHIFT = 3u;
+static const u32 PALETTE_CUBE_SIDE = 256u >> PALETTE_CUBE_SHIFT;
+static const u8 PALETTE_CUBE_EXACT = 0xFFu;
+
+static inline usize palette_cube_index(const u8* rgb) {
+    return ((usize)(rgb[0] >> PALETTE_CUBE_SHIFT) * PALETTE_CUBE_SIDE + (usize)(rgb[1] >> PALETTE_CUBE_SHIFT)) *
+               PALETTE_CUBE_SIDE +
+           (usize)(rgb[2] >> PALETTE_CUBE_SHIFT);
+}
+
+// Classifies the pixels of a page against one palette. A cube cell holds the
+// symbol for every RGB value inside it, or PALETTE_CUBE_EXACT when the cell
+// straddles a boundary or the ambiguous band and its pixels need the search.
+// A cell is filled only when its eight corners pick the same entry
+// unambiguously. The set of values that pick an entry unambiguously is an
+// intersection of balls, so it is convex and holds the whole cell; the cube
+// therefore returns exactly what the search would.
+struct PaletteClassifier {
+    PaletteColor colors[MAX_CUSTOM_PALETTE_COLORS];
+    u32 count;
+    // PALETTE_GRAY lists black first, but its samples count from white.
+    u32 symbol_xor;
+    PaletteNearestFn nearest;
+    makocode::ByteBuffer cube;
+
+    PaletteClassifier() : colors(), count(0u), symbol_xor(0u), nearest(0), cube() {}
+
+    u32 classify(const u8* rgb, bool& ambiguous) const {
+        u8 cell = cube.data[palette_cube_index(rgb)];
+        if (cell != PALETTE_CUBE_EXACT) {
+            ambiguous = false;
+            return cell;
+        }
+        return nearest(colors, rgb, ambiguous) ^ symbol_xor;
+    }
+};
+
+static bool palette_classifier_build(PaletteClassifier& classifier,
+                                     const PaletteColor* colors,
+                                     u32 count,
+                                     u32 symbol_xor) {
+    PaletteNearestFn nearest = palette_nearest_for_size(count);
+    if (!colors || !nearest) {
+        return false;
+    }
+    for (u32 i = 0u; i < count; ++i) {
+        classifier.colors[i] = colors[i];
+    }
+    classifier.count = count;
+    classifier.symbol_xor = symbol_xor;
+    classifier.nearest = nearest;
+    // Classify the two corner values of every cell along each axis (8k and
+    // 8k + 7), then fill each cell from its eight corners.
+    const usize corner_side = (usize)PALETTE_CUBE_SIDE * 2u;
+    makocode::ByteBuffer corners;
+    if (!corners.ensure(corner_side * corner_side * corner_side)) {
+        return false;
+    }
+    u8 rgb[3];
+    for (usize r = 0u; r < corner_side; ++r) {
+        rgb[0] = (u8)(((r >> 1u) << PALETTE_CUBE_SHIFT) + ((r & 1u) ? 7u : 0u));
+        for (usize g = 0u; g < corner_side; ++g) {
+            rgb[1] = (u8)(((g >> 1u) << PALETTE_CUBE_SHIFT) + ((g & 1u) ? 7u : 0u));
+            u8* corner_row = corners.data + (r * corner_side + g) * corner_side;
+            for (usize b = 0u; b < corner_side; ++b) {
+                rgb[2] = (u8)(((b >> 1u) << PALETTE_CUBE_SHIFT) + ((b & 1u) ? 7u : 0u));
+                bool ambiguous = false;
+                u32 symbol = nearest(classifier.colors, rgb, ambiguous) ^ symbol_xor;
+                corner_row[b] = ambiguous ? PALETTE_CUBE_EXACT : (u8)symbol;
+            }
+        }
+    }
+    usize cell_count = (usize)PALETTE_CUBE_SIDE * PALETTE_CUBE_SIDE * PALETTE_CUBE_SIDE;
+    if (!classifier.cube.ensure(cell_count)) {
+        return false;
+    }
+    classifier.cube.size = cell_count;
+    usize cell = 0u;
+    for (usize r = 0u; r < PALETTE_CUBE_SIDE; ++r) {
+        for (usize g = 0u; g < PALETTE_CUBE_SIDE; ++g) {
+            for (usize b = 0u; b < PALETTE_CUBE_SIDE; ++b, ++cell) {
+                u8 value = corners.data[((r * 2u) * corner_side + g * 2u) * corner_side + b * 2u];
+                for (usize corner = 1u; corner < 8u && value != PALETTE_CUBE_EXACT; ++corner) {
+                    usize cr = r * 2u + ((corner >> 2u) & 1u);
+                    usize cg = g * 2u + ((corner >> 1u) & 1u);
+                    usize cb = b * 2u + (corner & 1u);
+                    if (corners.data[(cr * corner_side + cg) * corner_side + cb] != value) {
+                        value = PALETTE_CUBE_EXACT;
+                    }
+                }
+                classifier.cube.data[cell] = value;
+            }
+        }
+    }
+    return true;
+}
+
+// Palettes a process keeps classifiers for: the built-in modes plus the custom
+// palettes it decodes. Like the page geometry cache, the cap only bounds memory.
+static const u32 PALETTE_CLASSIFIER_CACHE_LIMIT = 8u;
+static PaletteClassifier g_palette_classifier_cache[PALETTE_CLASSIFIER_CACHE_LIMIT];
+static u32 g_palette_classifier_cache_count = 0u;
+static pthread_mutex_t g_palette_classifier_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool palette_classifier_matches(const PaletteClassifier& classifier,
+                                       const PaletteColor* colors,
+                                       u32 count,
+                                       u32 symbol_xor) {
+    if (classifier.count != count || classifier.symbol_xor != symbol_xor) {
+        return false;
+    }
+    for (u32 i = 0u; i < count; ++i) {
+        if (!palette_colors_equal(classifier.colors[i], colors[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns the shared classifier for a palette, building and caching it on
+// first use. When the cache is full it is built into `fallback` instead.
+static const PaletteClassifier* palette_classifier_acquire(const PaletteColor* colors,
+                                                           u32 count,
+                                                           u32 symbol_xor,
+                                                           PaletteClassifier& fallback) {
+    pthread_mutex_lock(&g_palette_classifier_lock);
+    for (u32 i = 0u; i < g_palette_classifier_cache_count; ++i) {
+        if (palette_classifier_matches(g_palette_classifier_cache[i], colors, count, symbol_xor)) {
+            pthread_mutex_unlock(&g_palette_classifier_lock);
+            return &g_palette_classifier_cache[i];
+        }
+    }
+    const PaletteClassifier* result = 0;
+    if (g_palette_classifier_cache_count < PALETTE_CLASSIFIER_CACHE_LIMIT) {
+        PaletteClassifier& entry = g_palette_classifier_cache[g_palette_classifier_cache_count];
+        if (palette_classifier_build(entry, colors, count, symbol_xor)) {
+            ++g_palette_classifier_cache_count;
+            result = &entry;
+        }
+        pthread_mutex_unlock(&g_palette_classifier_lock);
+        return result;
+    }
+    pthread_mutex_unlock(&g_palette_classifier_lock);
+    if (palette_classifier_build(fallback, colors, count, symbol_xor)) {
+        result = &fallback;
+    }
+    return result;
+}
+
+// The classifier for a page's palette: the custom palette when one is active,
+// otherwise the built-in palette of `color_mode`.
+static const PaletteClassifier* palette_classifier_for_mapping(u8 color_mode,
+                                                               const ImageMappingConfig& mapping,
+                                                               PaletteClassifier& fallback) {
+    if (mapping_has_custom_palette(mapping)) {
+        return palette_classifier_acquire(mapping.custom_palette, mapping.custom_palette_count, 0u, fallback);
+    }
+    const PaletteColor* palette = 0;
+    u32 palette_size = 0u;
+    if (!palette_for_mode(color_mode, palette, palette_size)) {
+        return 0;
+    }
+    return palette_classifier_acquire(palette, palette_size, (color_mode == 1u) ? 1u : 0u, fallback);
+}
+
+// Paints one run of data pixels from the frame bitstream. SampleBits is fixed
+// by the colour mode, so a sample is a shift and mask over at most two bytes
+// and its colour comes from `sample_rgb`, built once per page. Bits past
+// `bit_count` read as zero.
+template <u32 SampleBits>
+static void render_run_from_bits(const u8* bits,
+                                 u64 bit_count,
+                                 u64& bit_cursor,
+                                 const u8 (*sample_rgb)[3],
+                                 u8* pixel,
+                                 u32 length) {
+    const u32 sample_mask = (1u << SampleBits) - 1u;
+    for (u32 i = 0u; i < length; ++i, pixel += 3u) {
+        u32 sample = 0u;
+        if (bit_cursor + SampleBits <= bit_count) {
+            usize byte_index = (usize)(bit_cursor >> 3u);
+            u32 shift = (u32)(bit_cursor & 7u);
+            u32 window = bits[byte_index];
+            if (shift + SampleBits > 8u) {
+                window |= (u32)bits[byte_index + 1u] << 8u;
+            }
+            sample = (window >> shift) & sample_mask;
+        } else {
+            for (u32 bit = 0u; bit < SampleBits; ++bit) {
+                u64 position = bit_cursor + bit;
+                if (position < bit_count) {
+                    sample |= (u32)((bits[position >> 3u] >> (position & 7u)) & 1u) << bit;
+                }
+            }
+        }
+        bit_cursor += SampleBits;
+        const u8* color = sample_rgb[sample];
+        pixel[0] = color[0];
+        pixel[1] = color[1];
+        pixel[2] = color[2];
+    }
+}
+
+// Custom-palette counterpart: one base-N digit per pixel, looked up in the
+// palette. Digits past the end paint entry 0.
+static bool render_run_from_digits(const makocode::ByteBuffer& digits,
+                                   u64& digit_index,
+                                   const PaletteColor* palette,
+                                   u32 palette_count,
+                                   u8* pixel,
+                                   u32 length) {
+    for (u32 i = 0u; i < length; ++i, pixel += 3u, ++digit_index) {
+        u8 symbol = (digit_index < (u64)digits.size) ? digits.data[digit_index] : 0u;
+        if (symbol >= palette_count) {
+            return false;
+        }
+        const PaletteColor& color = palette[symbol];
+        pixel[0] = color.r;
+        pixel[1] = color.g;
+        pixel[2] = color.b;
+    }
+    return true;
+}
+
 static double mapping_bits_per_data_pixel(const ImageMappingConfig& mapping) {
     if (mapping_has_custom_palette(mapping)) {
         u32 base = mapping_custom_palette_base(mapping);
         if (base < 2u) {
             return 0.0;
         }
+        if (!is_power_of_two_u32(base)) {
+            // Capacity follows the digit-block packing, not the ideal log2(base).
+            PaletteDigitBlock block;
+            if (!palette_digit_block_for_base(base, block)) {
+                return 0.0;
+            }
+            return (double)block.block_bits / (double)block.block_digits;
+        }
         double base_log = log((double)base);
         double log_two = log(2.0);
         if (log_two == 0.0) {
@@ -14861,6 +17329,7 @@ static bool write_all_fd(int fd, const u8* data, usize length) {
 }
 
 static bool write_bytes_to_file(const char* path, const u8* data, usize length) {
+    StatsTimer stats_timer(StatsStage_Write);
     if (!path) {
         return false;
     }
@@ -14873,6 +17342,10 @@ static bool write_bytes_to_file(const char* path, const u8* data, usize length)
         ok = write_all_fd(fd, data, length);
     }
     close(fd);
+    if (ok) {
+        stats_count(StatsCounter_FilesWritten, 1u);
+        stats_count(StatsCounter_BytesWritten, (u64)length);
+    }
     return ok;
 }
 
@@ -14955,6 +17428,7 @@ struct PpmParserState {
     const u8* data;
     usize size;
     usize cursor;
+    bool binary_pixels;
     bool has_bytes;
     u64 bytes_value;
     bool has_bits;
@@ -14976,6 +17450,8 @@ struct PpmParserState {
     u64 palette_base_value;
     bool has_page_symbols;
     u64 page_symbols_value;
+    bool whole_page_digits;
+    bool ecc_interleaved;
     bool has_page_width_pixels;
     u64 page_width_pixels_value;
     bool has_page_height_pixels;
@@ -15033,6 +17509,7 @@ struct PpmParserState {
         : data(0),
           size(0u),
           cursor(0u),
+          binary_pixels(false),
           has_bytes(false),
           bytes_value(0u),
           has_bits(false),
@@ -15053,6 +17530,8 @@ struct PpmParserState {
           palette_base_value(0u),
           has_page_symbols(false),
           page_symbols_value(0u),
+          whole_page_digits(false),
+          ecc_interleaved(false),
           has_page_width_pixels(false),
           page_width_pixels_value(0u),
           has_page_height_pixels(false),
@@ -16138,6 +18617,20 @@ static bool ppm_next_token(PpmParserState& state, const char** out_start, usize*
     return false;
 }
 
+// Pages are either ASCII P3 (decimal channel text) or binary P6 (raw RGB bytes);
+// the header grammar, including MAKOCODE_* comments, is identical for both.
+static bool ppm_accept_magic(PpmParserState& state, const char* token, usize length) {
+    if (ascii_equals_token(token, length, "P3")) {
+        state.binary_pixels = false;
+        return true;
+    }
+    if (ascii_equals_token(token, length, "P6")) {
+        state.binary_pixels = true;
+        return true;
+    }
+    return false;
+}
+
 static bool map_rgb_to_samples(u8 mode, const u8* rgb, u32* samples);
 
 static u64 gcd_u64(u64 a, u64 b) {
@@ -16172,6 +18665,53 @@ static bool rgb_within_tolerance(const u8* a, const u8* b, u8 tolerance) {
     return dr <= limit && dg <= limit && db <= limit;
 }
 
+// Bulk decoder for the P3 sample body: whitespace-separated decimal samples are
+// parsed straight into `dest` without per-token bookkeeping. It stops in front
+// of anything the general tokenizer must see (a comment, a token longer than
+// three digits, a value above 255, stray bytes) and returns the number of
+// samples written, leaving state.cursor on that token.
+//
+// Samples are at most three digits, so the digit run is unrolled and the
+// value accumulated as it is scanned; the cursor only moves forward and no
+// token is materialised. This stays scalar on purpose, not for want of a
+// CPU kernel: the tokens are short and irregular, and word-at-a-time variants
+// measured 0.41-0.50 GB/s on an A4 page against 0.65 GB/s for this loop.
+static u64 ppm_parse_ascii_samples(PpmParserState& state, u8* dest, u64 sample_count) {
+    const u8* p = state.data + state.cursor;
+    const u8* end = state.data + state.size;
+    u64 produced = 0u;
+    while (produced < sample_count) {
+        while (p < end && *p <= ' ') {
+            ++p;
+        }
+        if (p >= end) {
+            break;
+        }
+        const u8* token = p;
+        u32 value = (u32)(*p - '0');
+        if (value > 9u) {
+            break;
+        }
+        ++p;
+        u32 digit = 0u;
+        if (p < end && (digit = (u32)(*p - '0')) <= 9u) {
+            value = value * 10u + digit;
+            ++p;
+            if (p < end && (digit = (u32)(*p - '0')) <= 9u) {
+                value = value * 10u + digit;
+                ++p;
+            }
+        }
+        if ((p < end && *p > ' ') || value > 255u) {
+            p = token;
+            break;
+        }
+        dest[produced++] = (u8)value;
+    }
+    state.cursor = (usize)(p - state.data);
+    return produced;
+}
+
 static bool ppm_read_rgb_pixels(PpmParserState& state,
                                 u64 pixel_count,
                                 makocode::ByteBuffer& pixel_buffer) {
@@ -16185,24 +18725,77 @@ static bool ppm_read_rgb_pixels(PpmParserState& state,
     if (!pixel_buffer.ensure((usize)total_bytes)) {
         return false;
     }
-    for (u64 pixel = 0u; pixel < pixel_count; ++pixel) {
-        for (u32 channel = 0u; channel < 3u; ++channel) {
-            const char* token = 0;
-            usize length = 0u;
-            if (!ppm_next_token(state, &token, &length)) {
-                return false;
-            }
-            u64 value = 0u;
-            if (!ascii_to_u64(token, length, &value) || value > 255u) {
-                return false;
-            }
-            pixel_buffer.data[pixel * 3u + channel] = (u8)value;
+    if (state.binary_pixels) {
+        // P6: exactly one whitespace byte follows the max value token, then the raster.
+        if (state.cursor >= state.size || (char)state.data[state.cursor] > ' ') {
+            return false;
+        }
+        ++state.cursor;
+        if ((u64)(state.size - state.cursor) < total_bytes) {
+            return false;
+        }
+        memcpy(pixel_buffer.data, state.data + state.cursor, (usize)total_bytes);
+        state.cursor += (usize)total_bytes;
+        pixel_buffer.size = (usize)total_bytes;
+        return true;
+    }
+    // Alternate between the bulk decoder and one general token, which consumes
+    // any comment in the body and validates whatever stopped the fast path.
+    u64 written = 0u;
+    while (written < total_bytes) {
+        written += ppm_parse_ascii_samples(state, pixel_buffer.data + written, total_bytes - written);
+        if (written >= total_bytes) {
+            break;
         }
+        const char* token = 0;
+        usize length = 0u;
+        if (!ppm_next_token(state, &token, &length)) {
+            return false;
+        }
+        u64 value = 0u;
+        if (!ascii_to_u64(token, length, &value) || value > 255u) {
+            return false;
+        }
+        pixel_buffer.data[written++] = (u8)value;
     }
     pixel_buffer.size = (usize)total_bytes;
     return true;
 }
 
+// Reads the header and raster of a page, the work every decode does before
+// sampling.
+static bool ppm_load_page_pixels(const u8* data,
+                                 usize size,
+                                 u32& width_pixels,
+                                 u32& height_pixels,
+                                 makocode::ByteBuffer& pixels) {
+    PpmParserState state;
+    state.data = data;
+    state.size = size;
+    const char* token = 0;
+    usize token_length = 0u;
+    u64 width = 0u;
+    u64 height = 0u;
+    u64 max_value = 0u;
+    if (!ppm_next_token(state, &token, &token_length) ||
+        !ppm_accept_magic(state, token, token_length) ||
+        !ppm_next_token(state, &token, &token_length) ||
+        !ascii_to_u64(token, token_length, &width) ||
+        !ppm_next_token(state, &token, &token_length) ||
+        !ascii_to_u64(token, token_length, &height) ||
+        !ppm_next_token(state, &token, &token_length) ||
+        !ascii_to_u64(token, token_length, &max_value)) {
+        return false;
+    }
+    if (width == 0u || height == 0u || max_value != 255u ||
+        width > (u64)0xFFFFFFFFu || height > (u64)0xFFFFFFFFu) {
+        return false;
+    }
+    width_pixels = (u32)width;
+    height_pixels = (u32)height;
+    return ppm_read_rgb_pixels(state, width * height, pixels);
+}
+
 static double compute_rotation_margin_from_geometry(unsigned src_width,
                                                     unsigned src_height,
                                                     double rotation_degrees,
@@ -16253,57 +18846,162 @@ static double compute_rotation_margin_from_geometry(unsigned src_width,
     return (offset_x + offset_y) * 0.5;
 }
 
-static bool auto_detect_page_rotation(const u8* pixel_data,
-                                      u64 image_width,
-                                      u64 image_height,
+// Per-page luminance cache shared by the geometry detectors in ppm_extract_frame_bits.
+// Level 0 is the mean-of-RGB gray plane the detectors have always thresholded; levels 1
+// and 2 are 2x/4x box mips. Planes, histogram and cut levels are built on first use.
+//
+// It holds no thresholded bitmap: find_corners compares the gray plane against
+// levels.global_cut as it reads, which costs the same as reading a stored bit
+// and saves a full-page pass to build one. remove_border_dirt, the other
+// bitmap user, is not on the decode path. The scale detectors do not read
+// from the cache either; see detect_horizontal_scale_palette.
+struct PageAnalysis {
+    static const u32 MAX_LEVELS = 3u;
+    const u8* rgb;
+    u64 width;
+    u64 height;
+    makocode::image::ImageBuffer gray[MAX_LEVELS];
+    u32 level_count;
+    bool levels_ready;
+    bool levels_valid;
+    makocode::image::Histogram histogram;
+    makocode::image::CutLevels levels;
+
+    PageAnalysis(const u8* pixels, u64 image_width, u64 image_height)
+        : rgb(pixels),
+          width(image_width),
+          height(image_height),
+          level_count(0u),
+          levels_ready(false),
+          levels_valid(false) {
+        for (u32 i = 0u; i < MAX_LEVELS; ++i) {
+            gray[i].width = 0u;
+            gray[i].height = 0u;
+            gray[i].pixels = 0;
+        }
+        levels.global_cut = 0u;
+        levels.fill_cut = 0u;
+    }
+
+    ~PageAnalysis() {
+        release();
+    }
+
+    void release() {
+        for (u32 i = 0u; i < MAX_LEVELS; ++i) {
+            makocode::image::release(gray[i]);
+        }
+        level_count = 0u;
+        levels_ready = false;
+        levels_valid = false;
+    }
+};
+
+static const makocode::image::ImageBuffer* page_analysis_gray(PageAnalysis& analysis, u32 level) {
+    if (level >= PageAnalysis::MAX_LEVELS) {
+        return 0;
+    }
+    if (analysis.level_count == 0u) {
+        if (!analysis.rgb || !analysis.width || !analysis.height) {
+            return 0;
+        }
+        if (analysis.width > 0xFFFFFFFFull || analysis.height > 0xFFFFFFFFull) {
+            return 0;
+        }
+        u64 pixel_count = analysis.width * analysis.height;
+        if (pixel_count > (u64)USIZE_MAX_VALUE) {
+            return 0;
+        }
+        u8* plane = (u8*)malloc((usize)pixel_count);
+        if (!plane) {
+            return 0;
+        }
+        const u8* rgb_ptr = analysis.rgb;
+        for (u64 idx = 0u; idx < pixel_count; ++idx) {
+            u32 r = rgb_ptr[0u];
+            u32 g = rgb_ptr[1u];
+            u32 b = rgb_ptr[2u];
+            plane[idx] = (u8)((r + g + b) / 3u);
+            rgb_ptr += 3u;
+        }
+        analysis.gray[0].width = (unsigned)analysis.width;
+        analysis.gray[0].height = (unsigned)analysis.height;
+        analysis.gray[0].pixels = plane;
+        analysis.level_count = 1u;
+    }
+    while (analysis.level_count <= level) {
+        const makocode::image::ImageBuffer& src = analysis.gray[analysis.level_count - 1u];
+        unsigned dst_w = src.width / 2u;
+        unsigned dst_h = src.height / 2u;
+        if (dst_w < 4u || dst_h < 4u) {
+            return 0;
+        }
+        u8* plane = (u8*)malloc((usize)dst_w * (usize)dst_h);
+        if (!plane) {
+            return 0;
+        }
+        for (unsigned y = 0u; y < dst_h; ++y) {
+            const u8* row0 = src.pixels + (usize)(2u * y) * (usize)src.width;
+            const u8* row1 = row0 + src.width;
+            u8* out = plane + (usize)y * (usize)dst_w;
+            for (unsigned x = 0u; x < dst_w; ++x) {
+                u32 sum = (u32)row0[2u * x] + row0[2u * x + 1u] + row1[2u * x] + row1[2u * x + 1u];
+                out[x] = (u8)((sum + 2u) >> 2u);
+            }
+        }
+        makocode::image::ImageBuffer& dst = analysis.gray[analysis.level_count];
+        dst.width = dst_w;
+        dst.height = dst_h;
+        dst.pixels = plane;
+        ++analysis.level_count;
+    }
+    return &analysis.gray[level];
+}
+
+static bool page_analysis_cut_levels(PageAnalysis& analysis, makocode::image::CutLevels& out_levels) {
+    if (!analysis.levels_ready) {
+        const makocode::image::ImageBuffer* base = page_analysis_gray(analysis, 0u);
+        if (!base) {
+            return false;
+        }
+        analysis.levels_ready = true;
+        makocode::image::compute_histogram(*base, analysis.histogram);
+        analysis.levels_valid = makocode::image::analyze_cut_levels(analysis.histogram, 0.80, analysis.levels);
+    }
+    if (!analysis.levels_valid) {
+        return false;
+    }
+    out_levels = analysis.levels;
+    return true;
+}
+
+static bool auto_detect_page_rotation(PageAnalysis& analysis,
                                       u64 expected_width,
                                       u64 expected_height,
                                       PpmParserState& state) {
-    if (!pixel_data || !image_width || !image_height || !expected_width || !expected_height) {
+    if (!expected_width || !expected_height) {
         return false;
     }
     if (expected_width < 256u || expected_height < 256u) {
         return false;
     }
-    if (image_width > 0xFFFFFFFFull || image_height > 0xFFFFFFFFull) {
-        return false;
-    }
     if (expected_width > 0xFFFFFFFFull || expected_height > 0xFFFFFFFFull) {
         return false;
     }
-    u64 pixel_count = image_width * image_height;
-    if (pixel_count == 0u || pixel_count > (u64)USIZE_MAX_VALUE) {
+    u64 image_width = analysis.width;
+    u64 image_height = analysis.height;
+    const makocode::image::ImageBuffer* gray = page_analysis_gray(analysis, 0u);
+    if (!gray) {
         return false;
     }
-
-    makocode::image::ImageBuffer gray;
-    gray.width = (unsigned)image_width;
-    gray.height = (unsigned)image_height;
-    gray.pixels = (unsigned char*)malloc((usize)pixel_count);
-    if (!gray.pixels) {
-        return false;
-    }
-    const u8* rgb_ptr = pixel_data;
-    for (u64 idx = 0u; idx < pixel_count; ++idx) {
-        u32 r = rgb_ptr[0u];
-        u32 g = rgb_ptr[1u];
-        u32 b = rgb_ptr[2u];
-        gray.pixels[idx] = (u8)((r + g + b) / 3u);
-        rgb_ptr += 3u;
-    }
-
-    makocode::image::Histogram histogram;
-    makocode::image::compute_histogram(gray, histogram);
-    makocode::image::CutLevels levels;
-    if (!makocode::image::analyze_cut_levels(histogram, 0.80, levels)) {
-        makocode::image::release(gray);
+    makocode::image::CutLevels levels;
+    if (!page_analysis_cut_levels(analysis, levels)) {
         return false;
     }
     makocode::image::CornerDetectionConfig config;
     config.logical_width = (u32)expected_width;
     config.logical_height = (u32)expected_height;
     if (config.logical_width == 0u || config.logical_height == 0u) {
-        makocode::image::release(gray);
         return false;
     }
     if (config.logical_width > 64u && config.logical_height > 64u) {
@@ -16311,8 +19009,7 @@ static bool auto_detect_page_rotation(const u8* pixel_data,
         config.cross_trim = 0.5;
     }
     makocode::image::CornerDetectionResult result;
-    bool found = makocode::image::find_corners(gray, levels.global_cut, config, result);
-    makocode::image::release(gray);
+    bool found = makocode::image::find_corners(*gray, levels.global_cut, config, result);
     if (!found || !result.valid) {
         return false;
     }
@@ -16352,15 +19049,15 @@ static bool auto_detect_page_rotation(const u8* pixel_data,
     return true;
 }
 
-static bool estimate_rotation_from_gradients(const u8* pixel_data,
-                                             u64 width,
-                                             u64 height,
+static bool estimate_rotation_from_gradients(PageAnalysis& analysis,
                                              u64 expected_width,
                                              u64 expected_height,
                                              double fiducial_margin,
                                              double& out_degrees,
                                              double& out_scale) {
-    if (!pixel_data || width < 4u || height < 4u || !expected_width || !expected_height) {
+    u64 width = analysis.width;
+    u64 height = analysis.height;
+    if (width < 4u || height < 4u || !expected_width || !expected_height) {
         return false;
     }
     double scale_x_est = (double)width / (double)expected_width;
@@ -16369,21 +19066,38 @@ static bool estimate_rotation_from_gradients(const u8* pixel_data,
     if (scale_est < 1.0) {
         scale_est = 1.0;
     }
-    int margin = (int)(fiducial_margin * scale_est + 0.5);
+    // Edge orientation survives box filtering while modules stay at least two pixels wide,
+    // so upscaled scans are walked on the coarsest mip that still satisfies that.
+    u32 level = 0u;
+    while (level + 1u < PageAnalysis::MAX_LEVELS && scale_est >= (double)(2u << (level + 1u))) {
+        ++level;
+    }
+    const makocode::image::ImageBuffer* gray = page_analysis_gray(analysis, level);
+    while (!gray && level > 0u) {
+        --level;
+        gray = page_analysis_gray(analysis, level);
+    }
+    if (!gray) {
+        return false;
+    }
+    double level_scale = scale_est / (double)(1u << level);
+    int margin = (int)(fiducial_margin * level_scale + 0.5);
     if (margin < 2) {
         margin = 2;
     }
     int x_start = margin;
     int y_start = margin;
-    int x_end = (int)width - margin - 2;
-    int y_end = (int)height - margin - 2;
+    int x_end = (int)gray->width - margin - 2;
+    int y_end = (int)gray->height - margin - 2;
     if (x_end <= x_start || y_end <= y_start) {
         return false;
     }
-    int sample_step = (int)(scale_est >= 1.0 ? scale_est : 1.0);
+    int sample_step = (int)(level_scale >= 1.0 ? level_scale : 1.0);
     if (sample_step < 1) {
         sample_step = 1;
     }
+    const u8* plane = gray->pixels;
+    usize stride = (usize)gray->width;
     const int bins = 181;
     double histogram[bins];
     for (int i = 0; i < bins; ++i) {
@@ -16391,16 +19105,11 @@ static bool estimate_rotation_from_gradients(const u8* pixel_data,
     }
     for (int y = y_start; y <= y_end; y += sample_step) {
         for (int x = x_start; x <= x_end; x += sample_step) {
-            const u8* left = pixel_data + ((u64)y * width + (u64)(x - 1)) * 3u;
-            const u8* right = pixel_data + ((u64)y * width + (u64)(x + 1)) * 3u;
-            const u8* up = pixel_data + ((u64)(y - 1) * width + (u64)x) * 3u;
-            const u8* down = pixel_data + ((u64)(y + 1) * width + (u64)x) * 3u;
-            double left_i = ((double)left[0] + left[1] + left[2]) / 3.0;
-            double right_i = ((double)right[0] + right[1] + right[2]) / 3.0;
-            double up_i = ((double)up[0] + up[1] + up[2]) / 3.0;
-            double down_i = ((double)down[0] + down[1] + down[2]) / 3.0;
-            double gx = right_i - left_i;
-            double gy = down_i - up_i;
+            const u8* row = plane + (usize)y * stride;
+            const u8* up_row = row - stride;
+            const u8* down_row = row + stride;
+            double gx = (double)row[x + 1] - (double)row[x - 1];
+            double gy = (double)down_row[x] - (double)up_row[x];
             double magnitude = sqrt(gx * gx + gy * gy);
             if (magnitude < 25.0) {
                 continue;
@@ -17104,8 +19813,7 @@ static bool auto_detect_rotation_from_fiducials(const double* centers_x,
     return true;
 }
 
-static bool sample_fiducial_centers(const u8* pixel_data,
-                                    u64 width,
+static bool sample_fiducial_centers(PageAnalysis& analysis,
                                     u64 height,
                                     u32 fiducial_columns,
                                     u32 fiducial_rows,
@@ -17115,9 +19823,15 @@ static bool sample_fiducial_centers(const u8* pixel_data,
                                     u64 expected_height,
                                     double*& centers_x_out,
                                     double*& centers_y_out) {
-    if (!pixel_data || !width || !height || !fiducial_columns || !fiducial_rows) {
+    u64 width = analysis.width;
+    if (!width || !height || height > analysis.height || !fiducial_columns || !fiducial_rows) {
+        return false;
+    }
+    const makocode::image::ImageBuffer* gray = page_analysis_gray(analysis, 0u);
+    if (!gray) {
         return false;
     }
+    const u8* plane = gray->pixels;
     usize point_count = (usize)fiducial_columns * (usize)fiducial_rows;
     if (point_count == 0u) {
         return false;
@@ -17162,7 +19876,6 @@ static bool sample_fiducial_centers(const u8* pixel_data,
     }
     double inv_radius_sq = 1.0 / ((double)search_radius * (double)search_radius + 1.0);
     u64 pixel_count = width * height;
-    u64 total_bytes = pixel_count * 3u;
 
     // Avoid biasing fiducial sampling with the metadata tile region.
     bool exclude_tile = false;
@@ -17195,10 +19908,6 @@ static bool sample_fiducial_centers(const u8* pixel_data,
     if (pixel_count > 0u) {
         u64 sample_stride = (pixel_count / 16384u) ? (pixel_count / 16384u) : 1u;
         for (u64 idx = 0u; idx < pixel_count; idx += sample_stride) {
-            u64 pixel_index = idx * 3u;
-            if ((pixel_index + 2u) >= total_bytes) {
-                break;
-            }
             if (exclude_tile) {
                 u64 py = idx / width;
                 u64 px = idx - py * width;
@@ -17206,9 +19915,7 @@ static bool sample_fiducial_centers(const u8* pixel_data,
                     continue;
                 }
             }
-            double intensity = ((double)pixel_data[pixel_index + 0u] +
-                                (double)pixel_data[pixel_index + 1u] +
-                                (double)pixel_data[pixel_index + 2u]) / 3.0;
+            double intensity = (double)plane[idx];
             if (intensity < min_intensity) {
                 min_intensity = intensity;
             }
@@ -17272,11 +19979,8 @@ static bool sample_fiducial_centers(const u8* pixel_data,
                         sample_y_idx >= tile_y0 && sample_y_idx < tile_y1) {
                         continue;
                     }
-                    usize sample_index = ((usize)sample_y_idx * (usize)width + (usize)sample_x_idx) * 3u;
-                    u32 r_val = pixel_data[sample_index + 0u];
-                    u32 g_val = pixel_data[sample_index + 1u];
-                    u32 b_val = pixel_data[sample_index + 2u];
-                    double intensity = ((double)r_val + (double)g_val + (double)b_val) / 3.0;
+                    usize sample_index = (usize)sample_y_idx * (usize)width + (usize)sample_x_idx;
+                    double intensity = (double)plane[sample_index];
                     if (intensity <= dark_threshold) {
                         double weight = (dark_threshold - intensity) + 1.0;
                         double dx = (double)sample_x_idx - approx_x;
@@ -17414,6 +20118,10 @@ static bool map_rgb_to_detection_sample(u8 color_mode,
     return map_rgb_to_samples(color_mode, rgb, sample_out);
 }
 
+// The scale detectors sample the RGB scan through map_rgb_to_detection_sample
+// rather than PageAnalysis. They compare palette classes, which luminance
+// cannot separate (Cyan, Magenta and Yellow all average to gray 170), and they
+// measure the pixel pitch of a module, which a 2x/4x mip would blur away.
 static u64 detect_horizontal_scale_palette(const u8* pixels,
                                            u64 width,
                                            u64 height,
@@ -17642,18 +20350,28 @@ static bool validate_integer_scale(const u8* pixels,
     return true;
 }
 
-static bool ppm_extract_frame_bits(const makocode::ByteBuffer& input,
+// When `erasure_bits_out` is given it receives a mask parallel to frame_bits
+// marking bits sampled from ambiguous pixels; it stays empty when none are.
+static bool ppm_extract_frame_bits(const u8* input_data,
+                                   usize input_size,
                                    const ImageMappingConfig& overrides,
                                    makocode::ByteBuffer& frame_bits,
                                    u64& frame_bit_count,
                                    PpmParserState& metadata_out,
-                                   bool force_disable_fiducial_subgrid = false) {
-    if (!input.data || input.size == 0u) {
+                                   bool force_disable_fiducial_subgrid = false,
+                                   makocode::ByteBuffer* erasure_bits_out = 0,
+                                   const MetadataTile::Values* assumed_metadata = 0) {
+    if (erasure_bits_out) {
+        erasure_bits_out->release();
+    }
+    if (!input_data || input_size == 0u) {
         return false;
     }
+    // Walks page_parse -> metadata -> geometry -> fiducials -> bit_extract.
+    StatsTimer stats_timer(StatsStage_PageParse);
     PpmParserState state;
-   state.data = input.data;
-   state.size = input.size;
+   state.data = input_data;
+   state.size = input_size;
     if (debug_logging_enabled()) {
         char cursor_buffer[32];
         u64_to_ascii((u64)state.cursor, cursor_buffer, sizeof(cursor_buffer));
@@ -17678,7 +20396,7 @@ static bool ppm_extract_frame_bits(const makocode::ByteBuffer& input,
         }
         return false;
     }
-    if (!ascii_equals_token(token, token_length, "P3")) {
+    if (!ppm_accept_magic(state, token, token_length)) {
         if (debug_logging_enabled()) {
             char debug_token[32];
             usize debug_count = (token_length < (usize)(sizeof(debug_token) - 1u)) ? token_length : (sizeof(debug_token) - 1u);
@@ -17686,7 +20404,7 @@ static bool ppm_extract_frame_bits(const makocode::ByteBuffer& input,
                 debug_token[i] = token[i];
             }
             debug_token[debug_count] = '\0';
-            console_line(2, "debug: magic token not P3");
+            console_line(2, "debug: magic token not P3/P6");
             console_write(2, "debug token: ");
             console_line(2, debug_token);
             char length_buffer[32];
@@ -17752,6 +20470,7 @@ static bool ppm_extract_frame_bits(const makocode::ByteBuffer& input,
     if (!pixel_data) {
         return false;
     }
+    stats_timer.enter(StatsStage_Metadata);
     makocode::ByteBuffer downsampled_pixels;
     const u64 base_width = width;
     const u64 base_height = height;
@@ -17784,7 +20503,19 @@ static bool ppm_extract_frame_bits(const makocode::ByteBuffer& input,
         footer_rows_hint = 0u;
     }
     u32 data_height_hint = (footer_rows_hint > 0u && footer_rows_hint < (u32)height) ? ((u32)height - footer_rows_hint) : (u32)height;
-    if (!(disable_tile_env && disable_tile_env[0]) && width <= 0xFFFFFFFFull && height <= 0xFFFFFFFFull) {
+    if (assumed_metadata) {
+        // A --recover-metadata hypothesis stands in for the unreadable tile.
+        tile_values = *assumed_metadata;
+        if (!MetadataTile::build_palette_text_from_colors(tile_values.palette, tile_values.palette_count, tile_palette_text)) {
+            return false;
+        }
+        tile_available = true;
+        apply_metadata_tile_metadata(state, tile_values, tile_palette_text);
+    }
+    if (!tile_available &&
+        !(disable_tile_env && disable_tile_env[0]) &&
+        width <= 0xFFFFFFFFull &&
+        height <= 0xFFFFFFFFull) {
         // Try a few plausible data heights in case the footer height (text-only) was mis-estimated.
         const u32 fallback_offsets[] = {0u, 8u, 16u, 24u, 32u};
         for (u32 i = 0u; i < sizeof(fallback_offsets) / sizeof(fallback_offsets[0]); ++i) {
@@ -18041,6 +20772,7 @@ static bool ppm_extract_frame_bits(const makocode::ByteBuffer& input,
             if (target_w < MetadataTile::TILE_SIDE || target_h < MetadataTile::TILE_SIDE) {
                 return false;
             }
+            stats_count(StatsCounter_TileDownsampleAttempts, 1u);
             if (!fill_downsample(target_w, target_h)) {
                 return false;
             }
@@ -18206,7 +20938,7 @@ static bool ppm_extract_frame_bits(const makocode::ByteBuffer& input,
             debug_probe_metadata_tile_affine(pixel_buffer.data, (u32)base_width, (u32)base_height, base_data_height);
         }
         console_line(1, "decode: metadata tile missing; aborting (no metadata available)");
-        return 1;
+        return false;
     }
     if (!state.has_footer_rows && !tile_available && !stripe_available) {
         auto row_black_count = [&](u64 row_index) -> u64 {
@@ -18302,6 +21034,7 @@ static bool ppm_extract_frame_bits(const makocode::ByteBuffer& input,
     if (force_monochrome && pixel_data && width > 0u && height > 0u) {
         binarize_monochrome_image(pixel_data, width, height);
     }
+    stats_timer.enter(StatsStage_Geometry);
     bool has_rotation = false;
     unsigned rotated_width = (unsigned)width;
     unsigned rotated_height = (unsigned)height;
@@ -18572,6 +21305,7 @@ struct RotationEstimateCandidate {
                                          double margin_est,
                                          bool from_fiducials,
                                          const AffineTransform* affine_opt) {
+        stats_count(StatsCounter_RotationCandidates, 1u);
         candidate.valid = true;
         candidate.angle_deg = angle;
         candidate.width = width_est;
@@ -18727,11 +21461,11 @@ struct RotationEstimateCandidate {
         }
         return has_rotation;
     };
+    // pixel_data is final from here on; the detectors below share one gray plane.
+    PageAnalysis page_analysis(pixel_data, width, height);
     if (width_known && height_known) {
         PpmParserState auto_state = state;
-        if (auto_detect_page_rotation(pixel_data,
-                                      width,
-                                      height,
+        if (auto_detect_page_rotation(page_analysis,
                                       expected_width,
                                       expected_height,
                                       auto_state)) {
@@ -18770,9 +21504,7 @@ struct RotationEstimateCandidate {
     if (width_known && height_known && state.has_fiducial_margin && width >= 256u && height >= 256u) {
         double gradient_angle = 0.0;
         double gradient_scale = 0.0;
-        if (estimate_rotation_from_gradients(pixel_data,
-                                             width,
-                                             height,
+        if (estimate_rotation_from_gradients(page_analysis,
                                              expected_width,
                                              expected_height,
                                              (double)state.fiducial_margin_value,
@@ -18819,8 +21551,7 @@ struct RotationEstimateCandidate {
             if (state.has_footer_rows && expected_height_eff > state.footer_rows_value) {
                 expected_height_eff -= state.footer_rows_value;
             }
-            if (sample_fiducial_centers(pixel_data,
-                                        width,
+            if (sample_fiducial_centers(page_analysis,
                                         sample_height,
                                         fiducial_columns,
                                         fiducial_rows,
@@ -19527,19 +22258,21 @@ struct RotationEstimateCandidate {
             }
         }
     }
-    makocode::ByteBuffer fiducial_mask;
-    u64 reserved_data_pixels = 0u;
+    stats_timer.enter(StatsStage_Fiducials);
     // If the footer stripe is absent (new layout), keep reserving the metadata tile region
     // even when the tile decode failed so the payload bitstream stays aligned with the encoder.
     bool reserve_metadata_tile = tile_available || !stripe_available;
-    if (!compute_fiducial_reservation((u32)logical_width,
-                                      (u32)logical_height,
-                                      (u32)data_height,
-                                      reserved_data_pixels,
-                                      &fiducial_mask,
-                                      reserve_metadata_tile)) {
+    PageGeometry fallback_geometry;
+    const PageGeometry* page_geometry = page_geometry_acquire((u32)logical_width,
+                                                              (u32)logical_height,
+                                                              (u32)data_height,
+                                                              reserve_metadata_tile,
+                                                              fallback_geometry);
+    if (!page_geometry) {
         return false;
     }
+    const makocode::ByteBuffer& fiducial_mask = page_geometry->reservation_mask;
+    u64 reserved_data_pixels = page_geometry->reserved_data_pixels;
     if (debug_logging_enabled()) {
         MetadataTile::Placement placement = MetadataTile::compute_tile_placement((u32)logical_width, (u32)data_height);
         if (placement.valid && fiducial_mask.data && fiducial_mask.size) {
@@ -19620,6 +22353,8 @@ struct RotationEstimateCandidate {
     u64 capacity_with_reserve = capacity_without_reserve - reserved_bits;
     bool skip_reserved_pixels = (reserved_data_pixels > 0u);
     makocode::ByteBuffer custom_digits;
+    makocode::ByteBuffer custom_erasures;
+    u64 erased_samples = 0u;
     u64 digits_target = 0u;
     if (use_custom_palette) {
         u64 usable_pixels = total_data_pixels - reserved_data_pixels;
@@ -19653,10 +22388,14 @@ struct RotationEstimateCandidate {
             if (!custom_digits.ensure((usize)digits_target)) {
                 return false;
             }
+            if (erasure_bits_out && !custom_erasures.ensure((usize)digits_target)) {
+                return false;
+            }
             custom_digits.size = 0u;
         }
     }
     makocode::BitWriter writer;
+    makocode::BitWriter erasure_writer;
     u64 raw_width = width;
     u64 pixel_stride = raw_width;
     double scale_xd = scale_x;
@@ -20204,417 +22943,488 @@ struct RotationEstimateCandidate {
         prefer_nearest_sampling = false;
     }
 
-    u32 active_row_cell = 0u;
-    u64 active_row_start = use_fiducial_subgrid ? fiducial_row_offsets[0] : 0u;
-    u64 active_row_end = use_fiducial_subgrid && fiducial_subgrid_rows > 0u
-                             ? fiducial_row_offsets[1]
-                             : data_height;
+    // Sampling kernels are chosen once per page so the per-cell loop carries no
+    // geometry tests. Each kernel fills one logical row of RGB samples, leaving
+    // reserved cells unsampled; clean identity pages copy whole rows.
+    enum SampleKernel {
+        SampleKernel_Point,
+        SampleKernel_Subgrid,
+        SampleKernel_Affine,
+        SampleKernel_Rotated,
+        SampleKernel_Skewed
+    };
+    SampleKernel sample_kernel = SampleKernel_Point;
+    if (state.has_affine_transform) {
+        sample_kernel = SampleKernel_Affine;
+    } else if (has_rotation) {
+        sample_kernel = SampleKernel_Rotated;
+        if (rotation_width == 0u || rotation_height == 0u || rotated_width == 0u || rotated_height == 0u) {
+            return false;
+        }
+    } else if (has_skew) {
+        sample_kernel = SampleKernel_Skewed;
+    } else if (use_fiducial_subgrid) {
+        sample_kernel = SampleKernel_Subgrid;
+    }
+
     const u8* reservation_mask = (skip_reserved_pixels && fiducial_mask.data)
                                      ? fiducial_mask.data
                                      : (const u8*)0;
     usize reservation_size = reservation_mask ? fiducial_mask.size : 0u;
+    makocode::ByteBuffer row_samples;
+    if (!row_samples.reserve((usize)logical_width * 3u)) {
+        return false;
+    }
+    u8* row_rgb = row_samples.data;
+    const u8* mask_row = 0;
+    usize mask_count = 0u;
+    auto cell_reserved = [&](u64 logical_col) -> bool {
+        return mask_row && (usize)logical_col < mask_count && mask_row[logical_col];
+    };
+    auto bilinear_sample = [&](const u8* pixels,
+                               u64 stride,
+                               u64 limit_x,
+                               u64 limit_y,
+                               double sample_x,
+                               double sample_y,
+                               u8* out) {
+        unsigned x0 = (unsigned)floor(sample_x);
+        unsigned y0 = (unsigned)floor(sample_y);
+        unsigned x1 = (x0 + 1u < limit_x) ? (x0 + 1u) : x0;
+        unsigned y1 = (y0 + 1u < limit_y) ? (y0 + 1u) : y0;
+        double fx = sample_x - (double)x0;
+        double fy = sample_y - (double)y0;
+        usize idx00 = ((usize)y0 * (usize)stride + (usize)x0) * 3u;
+        usize idx10 = ((usize)y0 * (usize)stride + (usize)x1) * 3u;
+        usize idx01 = ((usize)y1 * (usize)stride + (usize)x0) * 3u;
+        usize idx11 = ((usize)y1 * (usize)stride + (usize)x1) * 3u;
+        for (u32 channel = 0u; channel < 3u; ++channel) {
+            double v00 = (double)pixels[idx00 + channel];
+            double v10 = (double)pixels[idx10 + channel];
+            double v01 = (double)pixels[idx01 + channel];
+            double v11 = (double)pixels[idx11 + channel];
+            double top = v00 + (v10 - v00) * fx;
+            double bottom = v01 + (v11 - v01) * fx;
+            double value = top + (bottom - top) * fy;
+            if (value < 0.0) value = 0.0;
+            if (value > 255.0) value = 255.0;
+            out[channel] = (u8)(value + 0.5);
+        }
+    };
 
-    for (u64 logical_row = 0u; logical_row < data_height; ++logical_row) {
-        if (use_fiducial_subgrid) {
-            while (active_row_cell + 1u < fiducial_subgrid_rows && logical_row >= active_row_end) {
-                ++active_row_cell;
-                active_row_start = fiducial_row_offsets[active_row_cell];
-                active_row_end = fiducial_row_offsets[active_row_cell + 1u];
+    // Fiducial subgrid bookkeeping: the subgrid column of every logical column is
+    // fixed for the page, so it is tabulated once instead of tracked per cell.
+    bool warp_active = use_fiducial_subgrid &&
+                       fiducial_displacement_active &&
+                       fiducial_storage.displacement_x &&
+                       fiducial_storage.displacement_y &&
+                       fiducial_column_count > 1u &&
+                       fiducial_row_count > 1u;
+    makocode::ByteBuffer column_cell_storage;
+    u32* column_cells = 0;
+    if (use_fiducial_subgrid) {
+        if (!column_cell_storage.reserve((usize)logical_width * sizeof(u32))) {
+            return false;
+        }
+        column_cells = (u32*)column_cell_storage.data;
+        u32 active_col_cell = 0u;
+        u64 active_col_start = fiducial_column_offsets[0];
+        u64 active_col_end = fiducial_subgrid_columns > 0u ? fiducial_column_offsets[1] : logical_width;
+        for (u64 logical_col = 0u; logical_col < logical_width; ++logical_col) {
+            while (active_col_cell + 1u < fiducial_subgrid_columns && logical_col >= active_col_end) {
+                ++active_col_cell;
+                active_col_start = fiducial_column_offsets[active_col_cell];
+                active_col_end = fiducial_column_offsets[active_col_cell + 1u];
             }
-            if (active_row_end <= active_row_start) {
-                active_row_end = active_row_start + 1u;
+            if (active_col_end <= active_col_start) {
+                active_col_end = active_col_start + 1u;
             }
+            column_cells[logical_col] = active_col_cell;
         }
+    }
+    u32 active_row_cell = 0u;
+    u64 active_row_start = use_fiducial_subgrid ? fiducial_row_offsets[0] : 0u;
+    u64 active_row_end = use_fiducial_subgrid && fiducial_subgrid_rows > 0u
+                             ? fiducial_row_offsets[1]
+                             : data_height;
+    const FiducialSubgridCell* row_cells = 0;
+    double warp_threshold = prefer_nearest_sampling ? 0.03 : 0.02;
+    // Shifts a sample position by the fiducial displacement field interpolated
+    // across the subgrid cell that holds the logical cell.
+    auto apply_fiducial_warp = [&](u64 logical_row, u64 logical_col, double& sample_col, double& sample_row) {
+        const FiducialSubgridCell& cell = row_cells[column_cells[logical_col]];
+        double local_u = 0.5;
+        double local_v = 0.5;
+        if (cell.col_end > cell.col_start) {
+            local_u = (((double)(logical_col - cell.col_start) + 0.5) /
+                       (double)(cell.col_end - cell.col_start));
+        }
+        if (cell.row_end > cell.row_start) {
+            local_v = (((double)(logical_row - cell.row_start) + 0.5) /
+                       (double)(cell.row_end - cell.row_start));
+        }
+        double clamp_margin_u = prefer_nearest_sampling
+                                    ? ((cell.col_end > cell.col_start)
+                                           ? (0.5 / (double)(cell.col_end - cell.col_start))
+                                           : 0.0005)
+                                    : 0.0005;
+        double clamp_margin_v = prefer_nearest_sampling
+                                    ? ((cell.row_end > cell.row_start)
+                                           ? (0.5 / (double)(cell.row_end - cell.row_start))
+                                           : 0.0005)
+                                    : 0.0005;
+        if (clamp_margin_u > 0.2) clamp_margin_u = 0.2;
+        if (clamp_margin_v > 0.2) clamp_margin_v = 0.2;
+        double max_u = 1.0 - clamp_margin_u;
+        double max_v = 1.0 - clamp_margin_v;
+        if (local_u < clamp_margin_u) local_u = clamp_margin_u;
+        if (local_u > max_u) local_u = max_u;
+        if (local_v < clamp_margin_v) local_v = clamp_margin_v;
+        if (local_v > max_v) local_v = max_v;
+        u32 node_row = cell.node_row;
+        u32 node_col = cell.node_col;
+        if (node_row + 1u >= fiducial_row_count || node_col + 1u >= fiducial_column_count) {
+            return;
+        }
+        double horiz_strength = cell.horizontal_error / warp_threshold;
+        double vert_strength = cell.vertical_error / warp_threshold;
+        if (horiz_strength > 1.0) horiz_strength = 1.0;
+        if (vert_strength > 1.0) vert_strength = 1.0;
+        usize idx_tl = (usize)node_row * (usize)fiducial_column_count + (usize)node_col;
+        usize idx_tr = idx_tl + 1u;
+        usize idx_bl = idx_tl + (usize)fiducial_column_count;
+        usize idx_br = idx_bl + 1u;
+        const double* disp_x = fiducial_storage.displacement_x;
+        const double* disp_y = fiducial_storage.displacement_y;
+        double top_disp_x = disp_x[idx_tl] * (1.0 - local_u) + disp_x[idx_tr] * local_u;
+        double bottom_disp_x = disp_x[idx_bl] * (1.0 - local_u) + disp_x[idx_br] * local_u;
+        double top_disp_y = disp_y[idx_tl] * (1.0 - local_u) + disp_y[idx_tr] * local_u;
+        double bottom_disp_y = disp_y[idx_bl] * (1.0 - local_u) + disp_y[idx_br] * local_u;
+        sample_col += (top_disp_x * (1.0 - local_v) + bottom_disp_x * local_v) * horiz_strength;
+        sample_row += (top_disp_y * (1.0 - local_v) + bottom_disp_y * local_v) * vert_strength;
+    };
 
-        u32 active_col_cell = 0u;
-        u64 active_col_start = use_fiducial_subgrid ? fiducial_column_offsets[0] : 0u;
-        u64 active_col_end = use_fiducial_subgrid && fiducial_subgrid_columns > 0u
-                                 ? fiducial_column_offsets[1]
-                                 : logical_width;
-        FiducialSubgridCell* row_cells = use_fiducial_subgrid
-                                             ? (fiducial_cells + ((usize)active_row_cell * (usize)fiducial_subgrid_columns))
-                                             : (FiducialSubgridCell*)0;
-
+    // Point kernel: undistorted pages read the nearest source pixel. Column
+    // positions are tabulated once; identity scans copy each row in one block.
+    makocode::ByteBuffer point_column_storage;
+    u64* point_columns = 0;
+    bool point_columns_contiguous = false;
+    double max_analysis_row = (analysis_height > 0u) ? (double)(analysis_height - 1u) : 0.0;
+    double max_analysis_col = (analysis_width > 0u) ? (double)(analysis_width - 1u) : 0.0;
+    if (sample_kernel == SampleKernel_Point) {
+        if (!point_column_storage.reserve((usize)logical_width * sizeof(u64))) {
+            return false;
+        }
+        point_columns = (u64*)point_column_storage.data;
+        point_columns_contiguous = true;
         for (u64 logical_col = 0u; logical_col < logical_width; ++logical_col) {
-            if (use_fiducial_subgrid) {
-                while (active_col_cell + 1u < fiducial_subgrid_columns && logical_col >= active_col_end) {
-                    ++active_col_cell;
-                    active_col_start = fiducial_column_offsets[active_col_cell];
-                    active_col_end = fiducial_column_offsets[active_col_cell + 1u];
-                }
-                if (active_col_end <= active_col_start) {
-                    active_col_end = active_col_start + 1u;
-                }
+            double sample_col = ((double)logical_col + 0.5) * scale_xd - 0.5;
+            if (sample_col < 0.0) sample_col = 0.0;
+            if (sample_col > max_analysis_col) sample_col = max_analysis_col;
+            point_columns[logical_col] = (u64)(sample_col + 0.5);
+            if (point_columns[logical_col] != point_columns[0] + logical_col) {
+                point_columns_contiguous = false;
+            }
+        }
+    }
+    auto sample_row_point = [&](u64 logical_row) -> bool {
+        double sample_row = ((double)logical_row + 0.5) * scale_yd - 0.5;
+        if (sample_row < 0.0) sample_row = 0.0;
+        if (sample_row > max_analysis_row) sample_row = max_analysis_row;
+        u64 row_base = (u64)(sample_row + 0.5) * pixel_stride;
+        if (point_columns_contiguous && logical_width > 0u &&
+            row_base + point_columns[logical_width - 1u] < raw_pixel_count) {
+            memcpy(row_rgb,
+                   pixel_data + (usize)((row_base + point_columns[0]) * 3u),
+                   (usize)logical_width * 3u);
+            return true;
+        }
+        for (u64 logical_col = 0u; logical_col < logical_width; ++logical_col) {
+            if (cell_reserved(logical_col)) {
+                continue;
             }
-            bool reserved_pixel = false;
-            if (reservation_mask) {
-                usize mask_index = ((usize)logical_row * (usize)logical_width) + (usize)logical_col;
-                if (mask_index < reservation_size && reservation_mask[mask_index]) {
-                    reserved_pixel = true;
-                }
+            u64 pixel_index = row_base + point_columns[logical_col];
+            if (pixel_index >= raw_pixel_count) {
+                return false;
             }
-            if (reserved_pixel) {
+            const u8* source = pixel_data + (usize)(pixel_index * 3u);
+            u8* target = row_rgb + (usize)logical_col * 3u;
+            target[0] = source[0];
+            target[1] = source[1];
+            target[2] = source[2];
+        }
+        return true;
+    };
+
+    // Subgrid kernel: fiducial-aligned pages without rotation or skew, sampled
+    // through the displacement field (nearest when the metadata pinned the grid).
+    auto sample_row_subgrid = [&](u64 logical_row) -> bool {
+        double base_sample_row = ((double)logical_row + 0.5) * scale_yd - 0.5;
+        for (u64 logical_col = 0u; logical_col < logical_width; ++logical_col) {
+            if (cell_reserved(logical_col)) {
                 continue;
             }
-
-            double base_sample_row = ((double)logical_row + 0.5) * scale_yd - 0.5;
-            double base_sample_col = ((double)logical_col + 0.5) * scale_xd - 0.5;
             double sample_row = base_sample_row;
-            double sample_col = base_sample_col;
-            if (use_fiducial_subgrid &&
-                fiducial_displacement_active &&
-                fiducial_storage.displacement_x &&
-                fiducial_storage.displacement_y &&
-                fiducial_column_count > 1u &&
-                fiducial_row_count > 1u) {
-                FiducialSubgridCell& cell = row_cells[active_col_cell];
-                double local_u = 0.5;
-                double local_v = 0.5;
-                if (cell.col_end > cell.col_start) {
-                    local_u = (((double)(logical_col - cell.col_start) + 0.5) /
-                               (double)(cell.col_end - cell.col_start));
-                }
-                if (cell.row_end > cell.row_start) {
-                    local_v = (((double)(logical_row - cell.row_start) + 0.5) /
-                               (double)(cell.row_end - cell.row_start));
-                }
-                double clamp_margin_u = prefer_nearest_sampling
-                                            ? ((cell.col_end > cell.col_start)
-                                                   ? (0.5 / (double)(cell.col_end - cell.col_start))
-                                                   : 0.0005)
-                                            : 0.0005;
-                double clamp_margin_v = prefer_nearest_sampling
-                                            ? ((cell.row_end > cell.row_start)
-                                                   ? (0.5 / (double)(cell.row_end - cell.row_start))
-                                                   : 0.0005)
-                                            : 0.0005;
-                if (clamp_margin_u > 0.2) clamp_margin_u = 0.2;
-                if (clamp_margin_v > 0.2) clamp_margin_v = 0.2;
-                double max_u = 1.0 - clamp_margin_u;
-                double max_v = 1.0 - clamp_margin_v;
-                if (local_u < clamp_margin_u) local_u = clamp_margin_u;
-                if (local_u > max_u) local_u = max_u;
-                if (local_v < clamp_margin_v) local_v = clamp_margin_v;
-                if (local_v > max_v) local_v = max_v;
-                u32 node_row = cell.node_row;
-                u32 node_col = cell.node_col;
-                double horizontal_threshold = prefer_nearest_sampling ? 0.03 : 0.02;
-                double vertical_threshold = prefer_nearest_sampling ? 0.03 : 0.02;
-                double horiz_strength = 0.0;
-                double vert_strength = 0.0;
-                if (horizontal_threshold > 0.0) {
-                    horiz_strength = cell.horizontal_error / horizontal_threshold;
-                    if (horiz_strength > 1.0) horiz_strength = 1.0;
-                }
-                if (vertical_threshold > 0.0) {
-                    vert_strength = cell.vertical_error / vertical_threshold;
-                    if (vert_strength > 1.0) vert_strength = 1.0;
-                }
-                if (node_row + 1u < fiducial_row_count && node_col + 1u < fiducial_column_count) {
-                    usize idx_tl = (usize)node_row * (usize)fiducial_column_count + (usize)node_col;
-                    usize idx_tr = idx_tl + 1u;
-                    usize idx_bl = idx_tl + (usize)fiducial_column_count;
-                    usize idx_br = idx_bl + 1u;
-                    double disp_tl_x = fiducial_storage.displacement_x[idx_tl];
-                    double disp_tr_x = fiducial_storage.displacement_x[idx_tr];
-                    double disp_bl_x = fiducial_storage.displacement_x[idx_bl];
-                    double disp_br_x = fiducial_storage.displacement_x[idx_br];
-                    double disp_tl_y = fiducial_storage.displacement_y[idx_tl];
-                    double disp_tr_y = fiducial_storage.displacement_y[idx_tr];
-                    double disp_bl_y = fiducial_storage.displacement_y[idx_bl];
-                    double disp_br_y = fiducial_storage.displacement_y[idx_br];
-                    double top_disp_x = disp_tl_x * (1.0 - local_u) + disp_tr_x * local_u;
-                    double bottom_disp_x = disp_bl_x * (1.0 - local_u) + disp_br_x * local_u;
-                    double top_disp_y = disp_tl_y * (1.0 - local_u) + disp_tr_y * local_u;
-                    double bottom_disp_y = disp_bl_y * (1.0 - local_u) + disp_br_y * local_u;
-                    double disp_x = (top_disp_x * (1.0 - local_v) + bottom_disp_x * local_v) * horiz_strength;
-                    double disp_y = (top_disp_y * (1.0 - local_v) + bottom_disp_y * local_v) * vert_strength;
-                    sample_col = base_sample_col + disp_x;
-                    sample_row = base_sample_row + disp_y;
-                }
-            }
-            double warp_dx = sample_col - base_sample_col;
-            double warp_dy = sample_row - base_sample_row;
-
-            const u8* rgb = 0;
-            u8 affine_rgb[3];
-            u8 rotated_rgb[3];
-            u8 skew_rgb[3];
-            u8 averaged_rgb[3];
-            // Fast path: undistorted scale-only pages benefit from box averaging over each
-            // logical cell to survive print/scan blur (e.g., 2.5x stretch in case 0016).
-            if (!has_rotation &&
-                !has_skew &&
-                !state.has_affine_transform &&
-                scale_xd > 1.01 &&
-                scale_yd > 1.01 &&
-                analysis_width > 0u &&
-                analysis_height > 0u) {
-                double cell_x0 = (double)logical_col * scale_xd;
-                double cell_x1 = (double)(logical_col + 1u) * scale_xd;
-                double cell_y0 = (double)logical_row * scale_yd;
-                double cell_y1 = (double)(logical_row + 1u) * scale_yd;
-                int xi0 = (int)floor(cell_x0);
-                int xi1 = (int)ceil(cell_x1);
-                int yi0 = (int)floor(cell_y0);
-                int yi1 = (int)ceil(cell_y1);
-                if (xi0 < 0) xi0 = 0;
-                if (yi0 < 0) yi0 = 0;
-                if (xi1 > (int)analysis_width) xi1 = (int)analysis_width;
-                if (yi1 > (int)analysis_height) yi1 = (int)analysis_height;
-                u64 sum_r = 0u, sum_g = 0u, sum_b = 0u;
-                u64 count = 0u;
-                for (int yy = yi0; yy < yi1; ++yy) {
-                    double cy = (double)yy + 0.5;
-                    if (cy < cell_y0 || cy >= cell_y1) continue;
-                    for (int xx = xi0; xx < xi1; ++xx) {
-                        double cx = (double)xx + 0.5;
-                        if (cx < cell_x0 || cx >= cell_x1) continue;
-                        usize idx = ((usize)yy * (usize)pixel_stride + (usize)xx) * 3u;
-                        sum_r += (u64)pixel_data[idx + 0u];
-                        sum_g += (u64)pixel_data[idx + 1u];
-                        sum_b += (u64)pixel_data[idx + 2u];
-                        ++count;
-                    }
-                }
-                if (count > 0u) {
-                    averaged_rgb[0] = (u8)((sum_r + (count / 2u)) / count);
-                    averaged_rgb[1] = (u8)((sum_g + (count / 2u)) / count);
-                    averaged_rgb[2] = (u8)((sum_b + (count / 2u)) / count);
-                    rgb = averaged_rgb;
-                }
+            double sample_col = ((double)logical_col + 0.5) * scale_xd - 0.5;
+            if (warp_active) {
+                apply_fiducial_warp(logical_row, logical_col, sample_col, sample_row);
+            }
+            if (sample_row < 0.0) sample_row = 0.0;
+            if (sample_col < 0.0) sample_col = 0.0;
+            if (sample_row > max_analysis_row) sample_row = max_analysis_row;
+            if (sample_col > max_analysis_col) sample_col = max_analysis_col;
+            u8* target = row_rgb + (usize)logical_col * 3u;
+            if (!prefer_nearest_sampling) {
+                bilinear_sample(pixel_data, pixel_stride, analysis_width, analysis_height, sample_col, sample_row, target);
+                continue;
             }
+            u64 raw_row = (u64)(sample_row + 0.5);
+            u64 raw_col = (u64)(sample_col + 0.5);
+            if (raw_row >= (u64)analysis_height) {
+                raw_row = (analysis_height > 0u) ? (analysis_height - 1u) : 0u;
+            }
+            if (raw_col >= (u64)analysis_width) {
+                raw_col = (analysis_width > 0u) ? (analysis_width - 1u) : 0u;
+            }
+            u64 pixel_index = (raw_row * pixel_stride) + raw_col;
+            if (pixel_index >= raw_pixel_count) {
+                return false;
+            }
+            const u8* source = pixel_data + (usize)(pixel_index * 3u);
+            target[0] = source[0];
+            target[1] = source[1];
+            target[2] = source[2];
+        }
+        return true;
+    };
 
-            if (state.has_affine_transform) {
-                double lx = ((double)logical_col + 0.5);
-                double ly = ((double)logical_row + 0.5);
-                double sample_x = state.affine_transform.a00 * lx +
-                                  state.affine_transform.a01 * ly +
-                                  state.affine_transform.tx + warp_dx;
-                double sample_y = state.affine_transform.a10 * lx +
-                                  state.affine_transform.a11 * ly +
-                                  state.affine_transform.ty + warp_dy;
-                if (state.has_skew_y_pixels) {
-                    double span = state.has_skew_src_width ? (double)state.skew_src_width_value : (double)width;
-                    if (span < 1.0) {
-                        span = (double)width;
-                    }
-                    if (span > 1.0) {
-                        double norm_col = sample_x / span;
-                        if (norm_col < 0.0) norm_col = 0.0;
-                        if (norm_col > 1.0) norm_col = 1.0;
-                        sample_y += state.skew_y_pixels_value * norm_col;
-                    }
-                }
-                if (sample_x < 0.0) sample_x = 0.0;
-                if (sample_y < 0.0) sample_y = 0.0;
-                double max_sample_x = (width > 0u) ? (double)(width - 1u) : 0.0;
-                double max_sample_y = (height > 0u) ? (double)(height - 1u) : 0.0;
-                if (sample_x > max_sample_x) sample_x = max_sample_x;
-                if (sample_y > max_sample_y) sample_y = max_sample_y;
-                unsigned x0 = (unsigned)floor(sample_x);
-                unsigned y0 = (unsigned)floor(sample_y);
-                unsigned x1 = (x0 + 1u < width) ? (x0 + 1u) : x0;
-                unsigned y1 = (y0 + 1u < height) ? (y0 + 1u) : y0;
-                double fx = sample_x - (double)x0;
-                double fy = sample_y - (double)y0;
-                usize idx00 = ((usize)y0 * (usize)width + (usize)x0) * 3u;
-                usize idx10 = ((usize)y0 * (usize)width + (usize)x1) * 3u;
-                usize idx01 = ((usize)y1 * (usize)width + (usize)x0) * 3u;
-                usize idx11 = ((usize)y1 * (usize)width + (usize)x1) * 3u;
-                for (u32 channel = 0u; channel < 3u; ++channel) {
-                    double v00 = (double)pixel_data[idx00 + channel];
-                    double v10 = (double)pixel_data[idx10 + channel];
-                    double v01 = (double)pixel_data[idx01 + channel];
-                    double v11 = (double)pixel_data[idx11 + channel];
-                    double top = v00 + (v10 - v00) * fx;
-                    double bottom = v01 + (v11 - v01) * fx;
-                    double value = top + (bottom - top) * fy;
-                    if (value < 0.0) {
-                        value = 0.0;
-                    }
-                    if (value > 255.0) {
-                        value = 255.0;
-                    }
-                    affine_rgb[channel] = (u8)(value + 0.5);
-                }
-                rgb = affine_rgb;
-            } else if (has_rotation) {
-                if (rotation_width == 0u || rotation_height == 0u || rotated_width == 0u || rotated_height == 0u) {
-                    return false;
-                }
-                double local_sample_col = sample_col;
-                double local_sample_row = sample_row;
-                if (has_skew) {
-                    double normalized_row = (skew_src_height > 1u)
-                                                ? (local_sample_row / (double)(skew_src_height - 1u))
-                                                : 0.0;
-                    double row_shift = state.has_skew_x_pixels
-                                           ? (skew_top * (1.0 - normalized_row) + skew_bottom * normalized_row)
-                                           : 0.0;
-                    double normalized_col = (skew_src_width > 1u)
-                                                ? (local_sample_col / (double)(skew_src_width - 1u))
-                                                : 0.0;
-                    double col_shift = state.has_skew_y_pixels
-                                           ? (state.skew_y_pixels_value * normalized_col)
-                                           : 0.0;
-                    local_sample_col += state.has_skew_margin_x ? (skew_margin + row_shift) : row_shift;
-                    local_sample_row += col_shift;
-                }
-                double dx = local_sample_col - rotation_center_x;
-                double dy = local_sample_row - rotation_center_y;
-                double sample_x = dx * rotation_cos - dy * rotation_sin + rotation_offset_x;
-                double sample_y = dx * rotation_sin + dy * rotation_cos + rotation_offset_y;
-                if (sample_x < 0.0) sample_x = 0.0;
-                if (sample_y < 0.0) sample_y = 0.0;
-                double max_sample_x = (rotated_width > 0u) ? (double)(rotated_width - 1u) : 0.0;
-                double max_sample_y = (rotated_height > 0u) ? (double)(rotated_height - 1u) : 0.0;
-                if (sample_x > max_sample_x) sample_x = max_sample_x;
-                if (sample_y > max_sample_y) sample_y = max_sample_y;
-                unsigned x0 = (unsigned)floor(sample_x);
-                unsigned y0 = (unsigned)floor(sample_y);
-                unsigned x1 = (x0 + 1u < rotated_width) ? (x0 + 1u) : x0;
-                unsigned y1 = (y0 + 1u < rotated_height) ? (y0 + 1u) : y0;
-                double fx = sample_x - (double)x0;
-                double fy = sample_y - (double)y0;
-                usize idx00 = ((usize)y0 * (usize)rotated_width + (usize)x0) * 3u;
-                usize idx10 = ((usize)y0 * (usize)rotated_width + (usize)x1) * 3u;
-                usize idx01 = ((usize)y1 * (usize)rotated_width + (usize)x0) * 3u;
-                usize idx11 = ((usize)y1 * (usize)rotated_width + (usize)x1) * 3u;
-                for (u32 channel = 0u; channel < 3u; ++channel) {
-                    double v00 = (double)pixel_data[idx00 + channel];
-                    double v10 = (double)pixel_data[idx10 + channel];
-                    double v01 = (double)pixel_data[idx01 + channel];
-                    double v11 = (double)pixel_data[idx11 + channel];
-                    double top = v00 + (v10 - v00) * fx;
-                    double bottom = v01 + (v11 - v01) * fx;
-                    double value = top + (bottom - top) * fy;
-                    if (value < 0.0) {
-                        value = 0.0;
-                    }
-                    if (value > 255.0) {
-                        value = 255.0;
-                    }
-                    rotated_rgb[channel] = (u8)(value + 0.5);
-                }
-                rgb = rotated_rgb;
-            } else if (has_skew) {
-                if (sample_row < 0.0) sample_row = 0.0;
-                if (sample_col < 0.0) sample_col = 0.0;
-                double max_row = (analysis_height > 0u) ? (double)(analysis_height - 1u) : 0.0;
-                double max_col = (analysis_width > 0u) ? (double)(analysis_width - 1u) : 0.0;
-                if (sample_row > max_row) sample_row = max_row;
-                if (sample_col > max_col) sample_col = max_col;
-                double normalized_row = (skew_src_height > 1u) ? (sample_row / (double)(skew_src_height - 1u)) : 0.0;
+    // Affine kernel: the column terms of the transform are tabulated once and
+    // the row terms computed once per row, keeping the per-cell work to adds.
+    makocode::ByteBuffer affine_column_storage;
+    double* affine_col_x = 0;
+    double* affine_col_y = 0;
+    double affine_skew_span = 0.0;
+    double max_source_x = (width > 0u) ? (double)(width - 1u) : 0.0;
+    double max_source_y = (height > 0u) ? (double)(height - 1u) : 0.0;
+    if (sample_kernel == SampleKernel_Affine) {
+        if (!affine_column_storage.reserve((usize)logical_width * 2u * sizeof(double))) {
+            return false;
+        }
+        affine_col_x = (double*)affine_column_storage.data;
+        affine_col_y = affine_col_x + logical_width;
+        for (u64 logical_col = 0u; logical_col < logical_width; ++logical_col) {
+            double lx = ((double)logical_col + 0.5);
+            affine_col_x[logical_col] = state.affine_transform.a00 * lx;
+            affine_col_y[logical_col] = state.affine_transform.a10 * lx;
+        }
+        if (state.has_skew_y_pixels) {
+            affine_skew_span = state.has_skew_src_width ? (double)state.skew_src_width_value : (double)width;
+            if (affine_skew_span < 1.0) {
+                affine_skew_span = (double)width;
+            }
+        }
+    }
+    auto sample_row_affine = [&](u64 logical_row) -> bool {
+        double ly = ((double)logical_row + 0.5);
+        double row_x = state.affine_transform.a01 * ly;
+        double row_y = state.affine_transform.a11 * ly;
+        double base_sample_row = ly * scale_yd - 0.5;
+        for (u64 logical_col = 0u; logical_col < logical_width; ++logical_col) {
+            if (cell_reserved(logical_col)) {
+                continue;
+            }
+            double warp_dx = 0.0;
+            double warp_dy = 0.0;
+            if (warp_active) {
+                double base_sample_col = ((double)logical_col + 0.5) * scale_xd - 0.5;
+                double sample_col = base_sample_col;
+                double sample_row = base_sample_row;
+                apply_fiducial_warp(logical_row, logical_col, sample_col, sample_row);
+                warp_dx = sample_col - base_sample_col;
+                warp_dy = sample_row - base_sample_row;
+            }
+            double sample_x = affine_col_x[logical_col] + row_x + state.affine_transform.tx + warp_dx;
+            double sample_y = affine_col_y[logical_col] + row_y + state.affine_transform.ty + warp_dy;
+            if (affine_skew_span > 1.0) {
+                double norm_col = sample_x / affine_skew_span;
+                if (norm_col < 0.0) norm_col = 0.0;
+                if (norm_col > 1.0) norm_col = 1.0;
+                sample_y += state.skew_y_pixels_value * norm_col;
+            }
+            if (sample_x < 0.0) sample_x = 0.0;
+            if (sample_y < 0.0) sample_y = 0.0;
+            if (sample_x > max_source_x) sample_x = max_source_x;
+            if (sample_y > max_source_y) sample_y = max_source_y;
+            bilinear_sample(pixel_data, width, width, height, sample_x, sample_y, row_rgb + (usize)logical_col * 3u);
+        }
+        return true;
+    };
+
+    // Rotated kernel: undoes any skew, then rotates about the page center.
+    double max_rotated_x = (rotated_width > 0u) ? (double)(rotated_width - 1u) : 0.0;
+    double max_rotated_y = (rotated_height > 0u) ? (double)(rotated_height - 1u) : 0.0;
+    double skew_row_span = (skew_src_height > 1u) ? (double)(skew_src_height - 1u) : 0.0;
+    double skew_col_span = (skew_src_width > 1u) ? (double)(skew_src_width - 1u) : 0.0;
+    auto sample_row_rotated = [&](u64 logical_row) -> bool {
+        double base_sample_row = ((double)logical_row + 0.5) * scale_yd - 0.5;
+        for (u64 logical_col = 0u; logical_col < logical_width; ++logical_col) {
+            if (cell_reserved(logical_col)) {
+                continue;
+            }
+            double local_sample_row = base_sample_row;
+            double local_sample_col = ((double)logical_col + 0.5) * scale_xd - 0.5;
+            if (warp_active) {
+                apply_fiducial_warp(logical_row, logical_col, local_sample_col, local_sample_row);
+            }
+            if (has_skew) {
+                double normalized_row = (skew_row_span > 0.0) ? (local_sample_row / skew_row_span) : 0.0;
                 double row_shift = state.has_skew_x_pixels
                                        ? (skew_top * (1.0 - normalized_row) + skew_bottom * normalized_row)
                                        : 0.0;
-                double normalized_col = (skew_src_width > 1u) ? (sample_col / (double)(skew_src_width - 1u)) : 0.0;
+                double normalized_col = (skew_col_span > 0.0) ? (local_sample_col / skew_col_span) : 0.0;
                 double col_shift = state.has_skew_y_pixels
                                        ? (state.skew_y_pixels_value * normalized_col)
                                        : 0.0;
-                double dest_x = sample_col + (state.has_skew_margin_x ? (skew_margin + row_shift) : row_shift);
-                double dest_y = sample_row + col_shift + 0.5;
-                if (dest_x < 0.0) dest_x = 0.0;
-                if (dest_y < 0.0) dest_y = 0.0;
-                double max_dest_x = (width > 0u) ? (double)(width - 1u) : 0.0;
-                double max_dest_y = (height > 0u) ? (double)(height - 1u) : 0.0;
-                if (dest_x > max_dest_x) dest_x = max_dest_x;
-                if (dest_y > max_dest_y) dest_y = max_dest_y;
-                unsigned nearest_x = (unsigned)(dest_x + 0.5);
-                unsigned nearest_y = (unsigned)(dest_y + 0.5);
-                if (nearest_x >= width) {
-                    nearest_x = width - 1u;
-                }
-                if (nearest_y >= height) {
-                    nearest_y = height - 1u;
-                }
-                usize idx = ((usize)nearest_y * (usize)width + (usize)nearest_x) * 3u;
-                for (u32 channel = 0u; channel < 3u; ++channel) {
-                    skew_rgb[channel] = pixel_data[idx + channel];
-                }
-                rgb = skew_rgb;
-            } else {
-                if (sample_row < 0.0) sample_row = 0.0;
-                if (sample_col < 0.0) sample_col = 0.0;
-                double max_row = (analysis_height > 0u) ? (double)(analysis_height - 1u) : 0.0;
-                double max_col = (analysis_width > 0u) ? (double)(analysis_width - 1u) : 0.0;
-                if (sample_row > max_row) sample_row = max_row;
-                if (sample_col > max_col) sample_col = max_col;
-                if (use_fiducial_subgrid) {
-                    if (prefer_nearest_sampling) {
-                        u64 raw_row = (u64)(sample_row + 0.5);
-                        u64 raw_col = (u64)(sample_col + 0.5);
-                        if (raw_row >= (u64)analysis_height) {
-                            raw_row = (analysis_height > 0u) ? (analysis_height - 1u) : 0u;
-                        }
-                        if (raw_col >= (u64)analysis_width) {
-                            raw_col = (analysis_width > 0u) ? (analysis_width - 1u) : 0u;
-                        }
-                        u64 pixel_index = (raw_row * pixel_stride) + raw_col;
-                        if (pixel_index >= raw_pixel_count) {
-                            return false;
-                        }
-                        rgb = pixel_data + (usize)(pixel_index * 3u);
-                    } else {
-                        unsigned x0 = (unsigned)floor(sample_col);
-                        unsigned y0 = (unsigned)floor(sample_row);
-                        unsigned x1 = (x0 + 1u < analysis_width) ? (x0 + 1u) : x0;
-                        unsigned y1 = (y0 + 1u < analysis_height) ? (y0 + 1u) : y0;
-                        double fx = sample_col - (double)x0;
-                        double fy = sample_row - (double)y0;
-                        usize idx00 = ((usize)y0 * (usize)pixel_stride + (usize)x0) * 3u;
-                        usize idx10 = ((usize)y0 * (usize)pixel_stride + (usize)x1) * 3u;
-                        usize idx01 = ((usize)y1 * (usize)pixel_stride + (usize)x0) * 3u;
-                        usize idx11 = ((usize)y1 * (usize)pixel_stride + (usize)x1) * 3u;
-                        u8 interp_rgb[3];
-                        for (u32 channel = 0u; channel < 3u; ++channel) {
-                            double v00 = (double)pixel_data[idx00 + channel];
-                            double v10 = (double)pixel_data[idx10 + channel];
-                            double v01 = (double)pixel_data[idx01 + channel];
-                            double v11 = (double)pixel_data[idx11 + channel];
-                            double top = v00 + (v10 - v00) * fx;
-                            double bottom = v01 + (v11 - v01) * fx;
-                            double value = top + (bottom - top) * fy;
-                            if (value < 0.0) value = 0.0;
-                            if (value > 255.0) value = 255.0;
-                            interp_rgb[channel] = (u8)(value + 0.5);
-                        }
-                        rgb = interp_rgb;
-                    }
-                } else {
-                    u64 raw_row = (u64)(sample_row + 0.5);
-                    u64 raw_col = (u64)(sample_col + 0.5);
-                    u64 pixel_index = (raw_row * pixel_stride) + raw_col;
-                    if (pixel_index >= raw_pixel_count) {
-                        return false;
-                    }
-                    rgb = pixel_data + (usize)(pixel_index * 3u);
-                }
+                local_sample_col += state.has_skew_margin_x ? (skew_margin + row_shift) : row_shift;
+                local_sample_row += col_shift;
+            }
+            double dx = local_sample_col - rotation_center_x;
+            double dy = local_sample_row - rotation_center_y;
+            double sample_x = dx * rotation_cos - dy * rotation_sin + rotation_offset_x;
+            double sample_y = dx * rotation_sin + dy * rotation_cos + rotation_offset_y;
+            if (sample_x < 0.0) sample_x = 0.0;
+            if (sample_y < 0.0) sample_y = 0.0;
+            if (sample_x > max_rotated_x) sample_x = max_rotated_x;
+            if (sample_y > max_rotated_y) sample_y = max_rotated_y;
+            bilinear_sample(pixel_data,
+                            rotated_width,
+                            rotated_width,
+                            rotated_height,
+                            sample_x,
+                            sample_y,
+                            row_rgb + (usize)logical_col * 3u);
+        }
+        return true;
+    };
+
+    // Skewed kernel: shears each sample back into the unskewed source and
+    // takes the nearest pixel.
+    auto sample_row_skewed = [&](u64 logical_row) -> bool {
+        double base_sample_row = ((double)logical_row + 0.5) * scale_yd - 0.5;
+        for (u64 logical_col = 0u; logical_col < logical_width; ++logical_col) {
+            if (cell_reserved(logical_col)) {
+                continue;
+            }
+            double sample_row = base_sample_row;
+            double sample_col = ((double)logical_col + 0.5) * scale_xd - 0.5;
+            if (warp_active) {
+                apply_fiducial_warp(logical_row, logical_col, sample_col, sample_row);
+            }
+            if (sample_row < 0.0) sample_row = 0.0;
+            if (sample_col < 0.0) sample_col = 0.0;
+            if (sample_row > max_analysis_row) sample_row = max_analysis_row;
+            if (sample_col > max_analysis_col) sample_col = max_analysis_col;
+            double normalized_row = (skew_row_span > 0.0) ? (sample_row / skew_row_span) : 0.0;
+            double row_shift = state.has_skew_x_pixels
+                                   ? (skew_top * (1.0 - normalized_row) + skew_bottom * normalized_row)
+                                   : 0.0;
+            double normalized_col = (skew_col_span > 0.0) ? (sample_col / skew_col_span) : 0.0;
+            double col_shift = state.has_skew_y_pixels
+                                   ? (state.skew_y_pixels_value * normalized_col)
+                                   : 0.0;
+            double dest_x = sample_col + (state.has_skew_margin_x ? (skew_margin + row_shift) : row_shift);
+            double dest_y = sample_row + col_shift + 0.5;
+            if (dest_x < 0.0) dest_x = 0.0;
+            if (dest_y < 0.0) dest_y = 0.0;
+            if (dest_x > max_source_x) dest_x = max_source_x;
+            if (dest_y > max_source_y) dest_y = max_source_y;
+            unsigned nearest_x = (unsigned)(dest_x + 0.5);
+            unsigned nearest_y = (unsigned)(dest_y + 0.5);
+            if (nearest_x >= width) {
+                nearest_x = width - 1u;
+            }
+            if (nearest_y >= height) {
+                nearest_y = height - 1u;
+            }
+            const u8* source = pixel_data + ((usize)nearest_y * (usize)width + (usize)nearest_x) * 3u;
+            u8* target = row_rgb + (usize)logical_col * 3u;
+            target[0] = source[0];
+            target[1] = source[1];
+            target[2] = source[2];
+        }
+        return true;
+    };
+
+    PaletteClassifier fallback_classifier;
+    const PaletteClassifier* classifier = palette_classifier_for_mapping(color_mode,
+                                                                         active_mapping,
+                                                                         fallback_classifier);
+    if (!classifier) {
+        return false;
+    }
+    stats_timer.enter(StatsStage_BitExtract);
+    for (u64 logical_row = 0u; logical_row < data_height; ++logical_row) {
+        if (use_fiducial_subgrid) {
+            while (active_row_cell + 1u < fiducial_subgrid_rows && logical_row >= active_row_end) {
+                ++active_row_cell;
+                active_row_start = fiducial_row_offsets[active_row_cell];
+                active_row_end = fiducial_row_offsets[active_row_cell + 1u];
+            }
+            if (active_row_end <= active_row_start) {
+                active_row_end = active_row_start + 1u;
+            }
+            row_cells = fiducial_cells + ((usize)active_row_cell * (usize)fiducial_subgrid_columns);
+        }
+        mask_row = 0;
+        mask_count = 0u;
+        usize mask_offset = (usize)logical_row * (usize)logical_width;
+        if (reservation_mask && mask_offset < reservation_size) {
+            mask_row = reservation_mask + mask_offset;
+            mask_count = reservation_size - mask_offset;
+        }
+
+        bool sampled = false;
+        switch (sample_kernel) {
+            case SampleKernel_Point: sampled = sample_row_point(logical_row); break;
+            case SampleKernel_Subgrid: sampled = sample_row_subgrid(logical_row); break;
+            case SampleKernel_Affine: sampled = sample_row_affine(logical_row); break;
+            case SampleKernel_Rotated: sampled = sample_row_rotated(logical_row); break;
+            case SampleKernel_Skewed: sampled = sample_row_skewed(logical_row); break;
+        }
+        if (!sampled) {
+            return false;
+        }
+
+        for (u64 logical_col = 0u; logical_col < logical_width; ++logical_col) {
+            if (cell_reserved(logical_col)) {
+                continue;
             }
+            const u8* rgb = row_rgb + (usize)logical_col * 3u;
 
+            bool ambiguous = false;
             if (use_custom_palette) {
                 if (digits_target > 0u && custom_digits.size >= (usize)digits_target) {
                     continue;
                 }
-                u32 symbol = 0u;
-                if (!map_rgb_to_custom_symbol(active_mapping, rgb, symbol)) {
-                    return false;
-                }
+                u32 symbol = classifier->classify(rgb, ambiguous);
                 if (digits_target > 0u) {
+                    if (erasure_bits_out) {
+                        custom_erasures.data[custom_digits.size] = ambiguous ? 1u : 0u;
+                        erased_samples += ambiguous ? 1u : 0u;
+                    }
                     custom_digits.data[custom_digits.size++] = (u8)symbol;
                 }
                 continue;
             }
-            u32 samples_raw[3] = {0u, 0u, 0u};
-            if (!map_rgb_to_samples(color_mode, rgb, samples_raw)) {
+            u32 sample = classifier->classify(rgb, ambiguous);
+            ambiguous = ambiguous && erasure_bits_out;
+            erased_samples += ambiguous ? 1u : 0u;
+            if (!writer.write_bits(sample, sample_bits)) {
                 return false;
             }
-            for (u8 sample_index = 0u; sample_index < samples_per_pixel; ++sample_index) {
-                u32 sample = samples_raw[sample_index];
-                if (!writer.write_bits(sample, sample_bits)) {
-                    return false;
-                }
+            if (erasure_bits_out &&
+                !erasure_writer.write_bits(ambiguous ? ((1ull << sample_bits) - 1ull) : 0ull, sample_bits)) {
+                return false;
             }
         }
     }
@@ -20643,7 +23453,8 @@ struct RotationEstimateCandidate {
                                  digits_available,
                                  digits_base,
                                  bit_target,
-                                 frame_bits)) {
+                                 frame_bits,
+                                 state.whole_page_digits)) {
             return false;
         }
         u64 frame_bits_effective = bit_target;
@@ -20651,11 +23462,27 @@ struct RotationEstimateCandidate {
             frame_bits_effective = (u64)frame_bits.size * 8u;
         }
         frame_bit_count = frame_bits_effective;
+        // Whole-page (schema 1) digits cannot localize damage, so they get no mask.
+        if (erasure_bits_out && erased_samples > 0u && !state.whole_page_digits) {
+            if (!base_digit_erasures_to_bits(custom_erasures.data,
+                                             digits_available,
+                                             digits_base,
+                                             frame_bit_count,
+                                             *erasure_bits_out)) {
+                erasure_bits_out->release();
+            }
+        }
         if (color_mode == 3u && frame_bits.size) {
             for (usize i = 0u; i < frame_bits.size; ++i) {
                 u8 rotate = (u8)((i % 3u) + 1u);
                 frame_bits.data[i] = rotate_right_u8(frame_bits.data[i], rotate);
             }
+            if (erasure_bits_out) {
+                for (usize i = 0u; i < erasure_bits_out->size; ++i) {
+                    u8 rotate = (u8)((i % 3u) + 1u);
+                    erasure_bits_out->data[i] = rotate_right_u8(erasure_bits_out->data[i], rotate);
+                }
+            }
         }
         metadata_out = state;
         metadata_out.data = 0;
@@ -20679,6 +23506,22 @@ struct RotationEstimateCandidate {
                 data_bytes[i] = rotate_right_u8(data_bytes[i], rotate);
             }
         }
+        u8* erasure_bytes = erasure_writer.buffer.data;
+        usize erasure_byte_count = erasure_writer.byte_size();
+        for (usize i = 0u; erasure_bytes && i < erasure_byte_count; ++i) {
+            u8 rotate = (u8)((i % 3u) + 1u);
+            erasure_bytes[i] = rotate_right_u8(erasure_bytes[i], rotate);
+        }
+    }
+    if (erasure_bits_out && erased_samples > 0u) {
+        usize erasure_byte_count = erasure_writer.byte_size();
+        if (erasure_byte_count && erasure_bits_out->ensure(erasure_byte_count)) {
+            const u8* erasure_data = erasure_writer.data();
+            for (usize i = 0u; i < erasure_byte_count; ++i) {
+                erasure_bits_out->data[i] = erasure_data ? erasure_data[i] : 0u;
+            }
+            erasure_bits_out->size = erasure_byte_count;
+        }
     }
     frame_bit_count = writer.bit_size();
     usize frame_bytes = writer.byte_size();
@@ -20714,6 +23557,8 @@ struct RotationEstimateCandidate {
          (capacity_with_reserve > 0u && frame_bit_count < capacity_with_reserve) ||
          (expected_payload_bits > 0u && header_preview > 0u && header_preview != expected_payload_bits))) {
         makocode::BitWriter simple_writer;
+        makocode::BitWriter simple_erasure_writer;
+        u64 simple_erased_samples = 0u;
         for (u64 logical_row = 0u; logical_row < data_height; ++logical_row) {
             for (u64 logical_col = 0u; logical_col < logical_width; ++logical_col) {
                 bool reserved_pixel = false;
@@ -20727,16 +23572,32 @@ struct RotationEstimateCandidate {
                     continue;
                 }
                 usize pixel_index = ((usize)logical_row * (usize)raw_width + (usize)logical_col) * 3u;
-                u32 samples_raw[3] = {0u, 0u, 0u};
-                if (!map_rgb_to_samples(color_mode, pixel_data + pixel_index, samples_raw)) {
-                    continue;
+                bool ambiguous = false;
+                u32 sample = classifier->classify(pixel_data + pixel_index, ambiguous);
+                ambiguous = ambiguous && erasure_bits_out;
+                simple_erased_samples += ambiguous ? 1u : 0u;
+                if (!simple_writer.write_bits(sample, sample_bits)) {
+                    return false;
                 }
-                for (u8 sample_index = 0u; sample_index < samples_per_pixel; ++sample_index) {
-                    u32 sample = samples_raw[sample_index];
-                    if (!simple_writer.write_bits(sample, sample_bits)) {
-                        return false;
-                    }
+                if (erasure_bits_out &&
+                    !simple_erasure_writer.write_bits(ambiguous ? ((1ull << sample_bits) - 1ull) : 0ull,
+                                                      sample_bits)) {
+                    return false;
+                }
+            }
+        }
+        // The raster walk samples different pixels, so rebuild the erasure
+        // mask from it as well.
+        if (erasure_bits_out) {
+            erasure_bits_out->release();
+            usize erasure_byte_count = simple_erasure_writer.byte_size();
+            if (simple_erased_samples > 0u && erasure_byte_count &&
+                erasure_bits_out->ensure(erasure_byte_count)) {
+                const u8* erasure_data = simple_erasure_writer.data();
+                for (usize i = 0u; i < erasure_byte_count; ++i) {
+                    erasure_bits_out->data[i] = erasure_data ? erasure_data[i] : 0u;
                 }
+                erasure_bits_out->size = erasure_byte_count;
             }
         }
         frame_bit_count = simple_writer.bit_size();
@@ -20770,18 +23631,7 @@ struct RotationEstimateCandidate {
 static bool append_bits_from_buffer(makocode::BitWriter& writer,
                                     const u8* data,
                                     u64 bit_count) {
-    for (u64 bit_index = 0u; bit_index < bit_count; ++bit_index) {
-        u8 bit_value = 0u;
-        if (data) {
-            usize byte_index = (usize)(bit_index >> 3u);
-            u8 mask = (u8)(1u << (bit_index & 7u));
-            bit_value = (data[byte_index] & mask) ? 1u : 0u;
-        }
-        if (!writer.write_bit(bit_value)) {
-            return false;
-        }
-    }
-    return true;
+    return writer.append_bits(data, bit_count);
 }
 
 static void log_footer_stripe_mismatch(const char* label,
@@ -21086,6 +23936,8 @@ static void apply_metadata_tile_metadata(PpmParserState& state,
                                          const makocode::ByteBuffer& palette_text) {
     const u64 payload_bits = values.page_bits;
     const u64 frame_bits = payload_bits + 64u;
+    state.whole_page_digits = (values.schema_version == MetadataTile::TILE_SCHEMA_WHOLE_PAGE_DIGITS);
+    state.ecc_interleaved = (values.schema_version >= MetadataTile::TILE_SCHEMA_ECC_INTERLEAVED);
     update_stripe_metadata_field("MAKOCODE_BITS", state.has_bits, state.bits_value, payload_bits);
     update_stripe_metadata_field("MAKOCODE_PAGE_BITS", state.has_page_bits, state.page_bits_value, frame_bits);
     update_stripe_metadata_field("page_count", state.has_page_count, state.page_count_value, values.page_count);
@@ -21230,6 +24082,7 @@ static bool merge_parser_state(PpmParserState& dest, const PpmParserState& src)
         dest.has_ecc_flag = true;
         dest.ecc_flag_value = src.ecc_flag_value;
     }
+    dest.ecc_interleaved = dest.ecc_interleaved || src.ecc_interleaved;
     if (src.has_ecc_block_data) {
         if (dest.has_ecc_block_data && dest.ecc_block_data_value != src.ecc_block_data_value) {
             return false;
@@ -21464,13 +24317,20 @@ static bool merge_parser_state(PpmParserState& dest, const PpmParserState& src)
     return true;
 }
 
+// `frame_erasures` (optional) is the frame's erasure mask; the matching
+// payload slice is written to `payload_erasures`.
 static bool frame_bits_to_payload(const u8* frame_data,
                                   u64 frame_bit_count,
                                   const PpmParserState& metadata,
                                   makocode::ByteBuffer& output,
-                                  u64& out_bit_count) {
+                                  u64& out_bit_count,
+                                  const makocode::ByteBuffer* frame_erasures = 0,
+                                  makocode::ByteBuffer* payload_erasures = 0) {
     output.release();
     out_bit_count = 0u;
+    if (payload_erasures) {
+        payload_erasures->release();
+    }
     if (!frame_data || frame_bit_count == 0u) {
         return false;
     }
@@ -21526,29 +24386,19 @@ static bool frame_bits_to_payload(const u8* frame_data,
         console_write(2, " available=");
         console_line(2, avail_buf);
     }
-    makocode::BitWriter payload_writer;
-    for (u64 bit_index = 0u; bit_index < payload_bits; ++bit_index) {
-        u8 bit = reader.read_bit();
-        if (reader.failed) {
-            return false;
-        }
-        if (!payload_writer.write_bit(bit)) {
-            return false;
-        }
-    }
-    if (payload_writer.failed) {
-        return false;
-    }
-    usize payload_bytes = payload_writer.byte_size();
-    if (payload_bytes && !output.ensure(payload_bytes)) {
+    if (!copy_bits_segment(frame_data, frame_bit_count, 64u, payload_bits, output)) {
         return false;
     }
-    const u8* payload_data = payload_writer.data();
-    for (usize i = 0u; i < payload_bytes; ++i) {
-        output.data[i] = payload_data ? payload_data[i] : 0u;
-    }
-    output.size = payload_bytes;
     out_bit_count = payload_bits;
+    if (frame_erasures && frame_erasures->data && frame_erasures->size && payload_erasures) {
+        u64 mask_bits = (u64)frame_erasures->size * 8u;
+        if (mask_bits > frame_bit_count) {
+            mask_bits = frame_bit_count;
+        }
+        if (!copy_bits_segment(frame_erasures->data, mask_bits, 64u, payload_bits, *payload_erasures)) {
+            payload_erasures->release();
+        }
+    }
     return true;
 }
 
@@ -21627,8 +24477,7 @@ static bool buffer_append_zero_padded(makocode::ByteBuffer& buffer,
 
 static bool ppm_write_metadata_header(const PpmParserState& state,
                                       makocode::ByteBuffer& output) {
-    (void)state;
-    if (!output.append_ascii("P3\n")) {
+    if (!output.append_ascii(state.binary_pixels ? "P6\n" : "P3\n")) {
         return false;
     }
     return true;
@@ -21656,75 +24505,74 @@ static bool ppm_append_extended_metadata(const PpmParserState& state,
     return true;
 }
 
-static bool ppm_append_fiducial_metadata(const PpmParserState& state,
-                                         makocode::ByteBuffer& output) {
-    (void)state;
-    (void)output;
-    return true;
-}
-
-static bool ppm_insert_fiducial_grid(const makocode::ByteBuffer& input,
-                                     u32 marker_size,
-                                     u32 grid_columns,
-                                     u32 grid_rows,
-                                     u32 margin_pixels,
-                                     u32 grid_height_limit,
-                                     makocode::ByteBuffer& output) {
-    if (!input.data || input.size == 0u) {
+// Serializes a complete page (header, extended metadata, raster) into output,
+// using the pixel encoding recorded in state.
+static bool ppm_write_raster(const PpmParserState& state,
+                             u32 width_pixels,
+                             u32 height_pixels,
+                             const u8* pixels,
+                             makocode::ByteBuffer& output) {
+    output.clear();
+    if (!pixels || width_pixels == 0u || height_pixels == 0u) {
         return false;
     }
-    if (marker_size == 0u || grid_columns == 0u || grid_rows == 0u) {
+    if (!ppm_write_metadata_header(state, output)) {
         return false;
     }
-    PpmParserState state;
-    state.data = input.data;
-    state.size = input.size;
-    const char* token = 0;
-    usize token_length = 0u;
-    if (!ppm_next_token(state, &token, &token_length)) {
-        return false;
-    }
-    if (!ascii_equals_token(token, token_length, "P3")) {
-        return false;
-    }
-    if (!ppm_next_token(state, &token, &token_length)) {
-        return false;
-    }
-    u64 width = 0u;
-    if (!ascii_to_u64(token, token_length, &width) || width == 0u) {
-        return false;
-    }
-    if (!ppm_next_token(state, &token, &token_length)) {
+    if (!ppm_append_extended_metadata(state, output)) {
         return false;
     }
-    u64 height = 0u;
-    if (!ascii_to_u64(token, token_length, &height) || height == 0u) {
+    if (!ppm_write_dimensions((u64)width_pixels, (u64)height_pixels, output)) {
         return false;
     }
-    if (!ppm_next_token(state, &token, &token_length)) {
-        return false;
+    usize pixel_count = (usize)width_pixels * (usize)height_pixels;
+    if (state.binary_pixels) {
+        return output.append_bytes(pixels, pixel_count * 3u);
     }
-    u64 max_value = 0u;
-    if (!ascii_to_u64(token, token_length, &max_value) || max_value != 255u) {
-        return false;
+    // One "R G B\n" line per pixel, sized up front so the body is formatted
+    // into a single allocation.
+    usize sample_count = pixel_count * 3u;
+    usize body_bytes = sample_count;
+    for (usize index = 0u; index < sample_count; ++index) {
+        u8 value = pixels[index];
+        body_bytes += (value >= 100u) ? 3u : ((value >= 10u) ? 2u : 1u);
     }
-    u64 pixel_count = width * height;
-    if (pixel_count == 0u) {
+    if (!output.reserve(output.size + body_bytes)) {
         return false;
     }
-    makocode::ByteBuffer pixels;
-    if (!ppm_read_rgb_pixels(state, pixel_count, pixels)) {
-        return false;
+    u8* out = output.data + output.size;
+    for (usize index = 0u; index < sample_count; ++index) {
+        u8 value = pixels[index];
+        if (value >= 100u) {
+            *out++ = (u8)('0' + value / 100u);
+            *out++ = (u8)('0' + (value / 10u) % 10u);
+        } else if (value >= 10u) {
+            *out++ = (u8)('0' + value / 10u);
+        }
+        *out++ = (u8)('0' + value % 10u);
+        *out++ = ((index % 3u) == 2u) ? '\n' : ' ';
     }
-    u8* pixel_data = pixels.data;
-    if (!pixel_data) {
+    output.size += body_bytes;
+    return true;
+}
+
+// Paints the white fiducial markers straight into an RGB raster and records the
+// grid geometry (sizes, subgrid offsets) in state for the metadata writers.
+static bool ppm_paint_fiducial_grid(PpmParserState& state,
+                                    u8* pixel_data,
+                                    u32 width_px,
+                                    u32 height_px,
+                                    u32 marker_size,
+                                    u32 grid_columns,
+                                    u32 grid_rows,
+                                    u32 margin_pixels,
+                                    u32 grid_height_limit) {
+    if (!pixel_data || width_px == 0u || height_px == 0u) {
         return false;
     }
-    if (width > (u64)0xFFFFFFFFu || height > (u64)0xFFFFFFFFu) {
+    if (marker_size == 0u || grid_columns == 0u || grid_rows == 0u) {
         return false;
     }
-    u32 width_px = (u32)width;
-    u32 height_px = (u32)height;
     if (marker_size > width_px || marker_size > height_px) {
         return false;
     }
@@ -21753,7 +24601,7 @@ static bool ppm_insert_fiducial_grid(const makocode::ByteBuffer& input,
     state.has_fiducial_margin = true;
     state.fiducial_margin_value = margin_pixels;
 
-    u64 logical_width = width;
+    u64 logical_width = (u64)width_px;
     u64 logical_height = (u64)draw_height;
     // When clipping is requested, treat the clipped height as pure data area (no footer).
     u64 footer_rows_value = 0u;
@@ -21934,35 +24782,83 @@ static bool ppm_insert_fiducial_grid(const makocode::ByteBuffer& input,
             }
         }
     }
-    output.release();
-    if (!ppm_write_metadata_header(state, output)) {
+    return true;
+}
+
+static bool ppm_insert_fiducial_grid(const makocode::ByteBuffer& input,
+                                     u32 marker_size,
+                                     u32 grid_columns,
+                                     u32 grid_rows,
+                                     u32 margin_pixels,
+                                     u32 grid_height_limit,
+                                     makocode::ByteBuffer& output) {
+    if (!input.data || input.size == 0u) {
         return false;
     }
-    if (!ppm_append_extended_metadata(state, output)) {
+    if (marker_size == 0u || grid_columns == 0u || grid_rows == 0u) {
         return false;
     }
-    if (!ppm_write_dimensions(width, height, output)) {
+    PpmParserState state;
+    state.data = input.data;
+    state.size = input.size;
+    const char* token = 0;
+    usize token_length = 0u;
+    if (!ppm_next_token(state, &token, &token_length)) {
         return false;
     }
-    for (u64 row = 0u; row < height; ++row) {
-        for (u64 col = 0u; col < width; ++col) {
-            usize pixel_index = ((usize)row * (usize)width + (usize)col) * 3u;
-            for (u32 channel = 0u; channel < 3u; ++channel) {
-                if (channel) {
-                    if (!output.append_char(' ')) {
-                        return false;
-                    }
-                }
-                if (!buffer_append_number(output, (u64)pixel_data[pixel_index + channel])) {
-                    return false;
-                }
-            }
-            if (!output.append_char('\n')) {
-                return false;
-            }
-        }
+    if (!ppm_accept_magic(state, token, token_length)) {
+        return false;
     }
-    return true;
+    if (!ppm_next_token(state, &token, &token_length)) {
+        return false;
+    }
+    u64 width = 0u;
+    if (!ascii_to_u64(token, token_length, &width) || width == 0u) {
+        return false;
+    }
+    if (!ppm_next_token(state, &token, &token_length)) {
+        return false;
+    }
+    u64 height = 0u;
+    if (!ascii_to_u64(token, token_length, &height) || height == 0u) {
+        return false;
+    }
+    if (!ppm_next_token(state, &token, &token_length)) {
+        return false;
+    }
+    u64 max_value = 0u;
+    if (!ascii_to_u64(token, token_length, &max_value) || max_value != 255u) {
+        return false;
+    }
+    u64 pixel_count = width * height;
+    if (pixel_count == 0u) {
+        return false;
+    }
+    makocode::ByteBuffer pixels;
+    if (!ppm_read_rgb_pixels(state, pixel_count, pixels)) {
+        return false;
+    }
+    u8* pixel_data = pixels.data;
+    if (!pixel_data) {
+        return false;
+    }
+    if (width > (u64)0xFFFFFFFFu || height > (u64)0xFFFFFFFFu) {
+        return false;
+    }
+    u32 width_px = (u32)width;
+    u32 height_px = (u32)height;
+    if (!ppm_paint_fiducial_grid(state,
+                                 pixel_data,
+                                 width_px,
+                                 height_px,
+                                 marker_size,
+                                 grid_columns,
+                                 grid_rows,
+                                 margin_pixels,
+                                 grid_height_limit)) {
+        return false;
+    }
+    return ppm_write_raster(state, width_px, height_px, pixel_data, output);
 }
 
 static bool ppm_measure_dimensions(const makocode::ByteBuffer& input,
@@ -21981,7 +24877,7 @@ static bool ppm_measure_dimensions(const makocode::ByteBuffer& input,
     if (!ppm_next_token(state, &token, &token_length)) {
         return false;
     }
-    if (!ascii_equals_token(token, token_length, "P3")) {
+    if (!ppm_accept_magic(state, token, token_length)) {
         return false;
     }
     if (!ppm_next_token(state, &token, &token_length)) {
@@ -22007,17 +24903,17 @@ static bool ppm_measure_dimensions(const makocode::ByteBuffer& input,
     return true;
 }
 
-// Place the default fiducial grid. Optional data_height_pixels clips the grid
-// so markers stay above the footer stripe.
-static bool apply_default_fiducial_grid(const makocode::ByteBuffer& input,
-                                        makocode::ByteBuffer& output,
-                                        u32 data_height_pixels = 0u) {
-    u32 width_pixels = 0u;
-    u32 height_pixels = 0u;
-    if (!ppm_measure_dimensions(input, width_pixels, height_pixels)) {
-        return false;
-    }
-    u32 fiducial_marker_size = g_fiducial_defaults.marker_size_pixels;
+// Size the default fiducial grid for a page. Optional data_height_pixels clips
+// the grid so markers stay above the footer stripe.
+static void default_fiducial_grid_layout(u32 width_pixels,
+                                         u32 height_pixels,
+                                         u32 data_height_pixels,
+                                         u32& fiducial_marker_size,
+                                         u32& fiducial_columns,
+                                         u32& fiducial_rows,
+                                         u32& fiducial_margin,
+                                         u32& grid_height) {
+    fiducial_marker_size = g_fiducial_defaults.marker_size_pixels;
     if (fiducial_marker_size == 0u) {
         fiducial_marker_size = 1u;
     }
@@ -22025,7 +24921,7 @@ static bool apply_default_fiducial_grid(const makocode::ByteBuffer& input,
     if (fiducial_spacing == 0u) {
         fiducial_spacing = fiducial_marker_size;
     }
-    u32 fiducial_margin = g_fiducial_defaults.margin_pixels;
+    fiducial_margin = g_fiducial_defaults.margin_pixels;
     double min_x = (fiducial_margin < width_pixels) ? (double)fiducial_margin : 0.0;
     double max_x = (width_pixels > fiducial_margin)
                        ? (double)(width_pixels - 1u - fiducial_margin)
@@ -22033,7 +24929,7 @@ static bool apply_default_fiducial_grid(const makocode::ByteBuffer& input,
     if (max_x < min_x) {
         max_x = min_x;
     }
-    u32 grid_height = height_pixels;
+    grid_height = height_pixels;
     if (data_height_pixels > 0u && data_height_pixels < height_pixels) {
         grid_height = data_height_pixels;
     }
@@ -22047,7 +24943,7 @@ static bool apply_default_fiducial_grid(const makocode::ByteBuffer& input,
     double available_width = (max_x >= min_x) ? (max_x - min_x) : 0.0;
     double available_height = (max_y >= min_y) ? (max_y - min_y) : 0.0;
     // Fit the grid into the drawable span so fixtures keep the configured spacing.
-    u32 fiducial_columns = 1u;
+    fiducial_columns = 1u;
     if (fiducial_spacing > 0u && available_width > 0.0) {
         double span = available_width / (double)fiducial_spacing;
         if (span < 0.0) {
@@ -22062,7 +24958,7 @@ static bool apply_default_fiducial_grid(const makocode::ByteBuffer& input,
     if (fiducial_columns == 0u) {
         fiducial_columns = 1u;
     }
-    u32 fiducial_rows = 1u;
+    fiducial_rows = 1u;
     if (fiducial_spacing > 0u && available_height > 0.0) {
         double span = available_height / (double)fiducial_spacing;
         if (span < 0.0) {
@@ -22093,6 +24989,50 @@ static bool apply_default_fiducial_grid(const makocode::ByteBuffer& input,
             span = (double)fiducial_spacing * (double)(fiducial_rows - 1u);
         }
     }
+}
+
+// Place the default fiducial grid on an in-memory RGB raster.
+static bool paint_default_fiducial_grid(u8* pixels,
+                                        u32 width_pixels,
+                                        u32 height_pixels,
+                                        u32 data_height_pixels) {
+    u32 marker_size = 0u;
+    u32 columns = 0u;
+    u32 rows = 0u;
+    u32 margin = 0u;
+    u32 grid_height = 0u;
+    default_fiducial_grid_layout(width_pixels, height_pixels, data_height_pixels,
+                                 marker_size, columns, rows, margin, grid_height);
+    PpmParserState state;
+    return ppm_paint_fiducial_grid(state,
+                                   pixels,
+                                   width_pixels,
+                                   height_pixels,
+                                   marker_size,
+                                   columns,
+                                   rows,
+                                   margin,
+                                   grid_height);
+}
+
+// Place the default fiducial grid. Optional data_height_pixels clips the grid
+// so markers stay above the footer stripe.
+static bool apply_default_fiducial_grid(const makocode::ByteBuffer& input,
+                                        makocode::ByteBuffer& output,
+                                        u32 data_height_pixels = 0u) {
+    u32 width_pixels = 0u;
+    u32 height_pixels = 0u;
+    if (!ppm_measure_dimensions(input, width_pixels, height_pixels)) {
+        return false;
+    }
+    u32 fiducial_marker_size = 0u;
+    u32 fiducial_columns = 0u;
+    u32 fiducial_rows = 0u;
+    u32 fiducial_margin = 0u;
+    u32 grid_height = 0u;
+    default_fiducial_grid_layout(width_pixels, height_pixels, data_height_pixels,
+                                 fiducial_marker_size, fiducial_columns, fiducial_rows,
+                                 fiducial_margin, grid_height);
     return ppm_insert_fiducial_grid(input,
                                     fiducial_marker_size,
                                     fiducial_columns,
@@ -22118,11 +25058,11 @@ static bool write_ppm_with_fiducials_to_file(const char* path, const makocode::B
         const char* token = 0;
         usize token_length = 0u;
         if (ppm_next_token(state, &token, &token_length) &&
-            ascii_equals_token(token, token_length, "P3") &&
+            ppm_accept_magic(state, token, token_length) &&
             ppm_next_token(state, &token, &token_length) &&
             ppm_next_token(state, &token, &token_length) &&
             ppm_next_token(state, &token, &token_length)) {
-            // The first three tokens after P3 are width/height/max_value; width/height are already known.
+            // The first three tokens after the magic are width/height/max_value; width/height are already known.
             u64 max_value = 0u;
             if (ascii_to_u64(token, token_length, &max_value) && max_value == 255u) {
                 u64 pixel_count = (u64)width_pixels * (u64)height_pixels;
@@ -22182,15 +25122,13 @@ static bool compute_fiducial_marker_mask(u32 width_pixels,
     }
     u64 total_pixels = (u64)width_pixels * (u64)height_pixels;
     if (mask_out) {
-        mask_out->release();
+        mask_out->clear();
         if (total_pixels) {
             if (!mask_out->ensure((usize)total_pixels)) {
                 return false;
             }
             mask_out->size = (usize)total_pixels;
-            for (u64 i = 0u; i < total_pixels; ++i) {
-                mask_out->data[i] = 0u;
-            }
+            memset(mask_out->data, 0, (usize)total_pixels);
         } else {
             mask_out->size = 0u;
         }
@@ -22361,6 +25299,133 @@ static bool compute_fiducial_reservation(u32 width_pixels,
     return true;
 }
 
+// Layouts a process keeps geometry for. Encode and decode jobs use one layout
+// each; the cap only bounds memory when pages of many sizes are decoded.
+static const u32 PAGE_GEOMETRY_CACHE_LIMIT = 8u;
+static PageGeometry g_page_geometry_cache[PAGE_GEOMETRY_CACHE_LIMIT];
+static u32 g_page_geometry_cache_count = 0u;
+static pthread_mutex_t g_page_geometry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool page_geometry_metadata_tile(bool reserve_metadata_tile) {
+    const char* disable_tile_env = getenv("MAKO_DISABLE_METADATA_TILE");
+    return reserve_metadata_tile && !(disable_tile_env && disable_tile_env[0]);
+}
+
+static bool page_geometry_matches(const PageGeometry& geometry,
+                                  u32 width_pixels,
+                                  u32 height_pixels,
+                                  u32 data_height_pixels,
+                                  bool metadata_tile) {
+    return geometry.width_pixels == width_pixels &&
+           geometry.height_pixels == height_pixels &&
+           geometry.data_height_pixels == data_height_pixels &&
+           geometry.metadata_tile == metadata_tile &&
+           geometry.fiducials.marker_size_pixels == g_fiducial_defaults.marker_size_pixels &&
+           geometry.fiducials.spacing_pixels == g_fiducial_defaults.spacing_pixels &&
+           geometry.fiducials.margin_pixels == g_fiducial_defaults.margin_pixels;
+}
+
+static bool page_geometry_build(PageGeometry& geometry,
+                                u32 width_pixels,
+                                u32 height_pixels,
+                                u32 data_height_pixels,
+                                bool metadata_tile) {
+    geometry.width_pixels = width_pixels;
+    geometry.height_pixels = height_pixels;
+    geometry.data_height_pixels = data_height_pixels;
+    geometry.metadata_tile = metadata_tile;
+    geometry.fiducials = g_fiducial_defaults;
+    geometry.run_count = 0u;
+    geometry.run_storage.clear();
+    geometry.data_pixel_count = 0u;
+    u64 marker_reserved = 0u;
+    if (!compute_fiducial_marker_mask(width_pixels,
+                                      height_pixels,
+                                      data_height_pixels,
+                                      marker_reserved,
+                                      &geometry.marker_mask) ||
+        !compute_fiducial_reservation(width_pixels,
+                                      height_pixels,
+                                      data_height_pixels,
+                                      geometry.reserved_data_pixels,
+                                      &geometry.reservation_mask,
+                                      metadata_tile)) {
+        return false;
+    }
+    u32 data_rows = (data_height_pixels < height_pixels) ? data_height_pixels : height_pixels;
+    const u8* mask = geometry.reservation_mask.size ? geometry.reservation_mask.data : (const u8*)0;
+    for (u32 row = 0u; row < data_rows; ++row) {
+        const u8* mask_row = mask ? mask + (usize)row * (usize)width_pixels : (const u8*)0;
+        u32 column = 0u;
+        while (column < width_pixels) {
+            while (column < width_pixels && mask_row && mask_row[column]) {
+                ++column;
+            }
+            u32 start = column;
+            while (column < width_pixels && !(mask_row && mask_row[column])) {
+                ++column;
+            }
+            if (column == start) {
+                continue;
+            }
+            if (!geometry.run_storage.ensure(geometry.run_storage.size + sizeof(PageGeometryRun))) {
+                return false;
+            }
+            PageGeometryRun* run = (PageGeometryRun*)(geometry.run_storage.data + geometry.run_storage.size);
+            run->row = row;
+            run->column = start;
+            run->length = column - start;
+            geometry.run_storage.size += sizeof(PageGeometryRun);
+            ++geometry.run_count;
+            geometry.data_pixel_count += (u64)(column - start);
+        }
+    }
+    return true;
+}
+
+// Must be called with g_page_geometry_lock held.
+static const PageGeometry* page_geometry_find_locked(u32 width_pixels,
+                                                     u32 height_pixels,
+                                                     u32 data_height_pixels,
+                                                     bool metadata_tile) {
+    for (u32 i = 0u; i < g_page_geometry_cache_count; ++i) {
+        if (page_geometry_matches(g_page_geometry_cache[i], width_pixels, height_pixels, data_height_pixels, metadata_tile)) {
+            return &g_page_geometry_cache[i];
+        }
+    }
+    return 0;
+}
+
+// Returns the shared geometry for a layout, building and caching it on first
+// use. When the cache is full the geometry is built into `fallback` instead.
+static const PageGeometry* page_geometry_acquire(u32 width_pixels,
+                                                 u32 height_pixels,
+                                                 u32 data_height_pixels,
+                                                 bool reserve_metadata_tile,
+                                                 PageGeometry& fallback) {
+    bool metadata_tile = page_geometry_metadata_tile(reserve_metadata_tile);
+    pthread_mutex_lock(&g_page_geometry_lock);
+    const PageGeometry* result = page_geometry_find_locked(width_pixels, height_pixels, data_height_pixels, metadata_tile);
+    if (result) {
+        pthread_mutex_unlock(&g_page_geometry_lock);
+        return result;
+    }
+    if (g_page_geometry_cache_count < PAGE_GEOMETRY_CACHE_LIMIT) {
+        PageGeometry& entry = g_page_geometry_cache[g_page_geometry_cache_count];
+        if (page_geometry_build(entry, width_pixels, height_pixels, data_height_pixels, metadata_tile)) {
+            ++g_page_geometry_cache_count;
+            result = &entry;
+        }
+        pthread_mutex_unlock(&g_page_geometry_lock);
+        return result;
+    }
+    pthread_mutex_unlock(&g_page_geometry_lock);
+    if (page_geometry_build(fallback, width_pixels, height_pixels, data_height_pixels, metadata_tile)) {
+        result = &fallback;
+    }
+    return result;
+}
+
 static bool compute_bits_per_page(u32 width_pixels,
                                   u32 height_pixels,
                                   u32 data_height_pixels,
@@ -22375,12 +25440,23 @@ static bool compute_bits_per_page(u32 width_pixels,
     }
     u64 total_pixels = (u64)width_pixels * (u64)data_height_pixels;
     u64 reserved_pixels = 0u;
+    // Capacity searches probe many data heights, so only reuse a cached layout
+    // here rather than caching every probe.
+    pthread_mutex_lock(&g_page_geometry_lock);
+    const PageGeometry* cached = page_geometry_find_locked(width_pixels,
+                                                           height_pixels,
+                                                           data_height_pixels,
+                                                           page_geometry_metadata_tile(true));
+    if (cached) {
+        reserved_pixels = cached->reserved_data_pixels;
+    }
+    pthread_mutex_unlock(&g_page_geometry_lock);
     makocode::ByteBuffer temp_mask;
-    if (!compute_fiducial_reservation(width_pixels,
-                                      height_pixels,
-                                      data_height_pixels,
-                                      reserved_pixels,
-                                      &temp_mask)) {
+    if (!cached && !compute_fiducial_reservation(width_pixels,
+                                                 height_pixels,
+                                                 data_height_pixels,
+                                                 reserved_pixels,
+                                                 &temp_mask)) {
         return false;
     }
     if (reserved_pixels >= total_pixels) {
@@ -22482,35 +25558,16 @@ static bool build_frame_bits(const makocode::EncoderContext& encoder,
     }
     (void)palette;
     payload_bit_count = encoder.bit_writer.bit_size();
-    usize payload_byte_count = encoder.bit_writer.byte_size();
     makocode::BitWriter frame_writer;
     if (!frame_writer.write_bits(payload_bit_count, 64u)) {
         return false;
     }
-    const u8* payload_raw = encoder.bit_writer.data();
-    for (usize byte_index = 0u; byte_index < payload_byte_count; ++byte_index) {
-        u8 byte = payload_raw ? payload_raw[byte_index] : 0u;
-        u64 bits_written = (u64)byte_index * 8u;
-        u64 bits_remaining = (payload_bit_count > bits_written) ? (payload_bit_count - bits_written) : 0u;
-        if (!bits_remaining) {
-            break;
-        }
-        usize chunk = (bits_remaining >= 8u) ? 8u : (usize)bits_remaining;
-        if (!frame_writer.write_bits((u64)byte, chunk)) {
-            return false;
-        }
+    if (!frame_writer.append_bits(encoder.bit_writer.data(), payload_bit_count)) {
+        return false;
     }
     frame_bit_count = frame_writer.bit_size();
     usize frame_bytes = frame_writer.byte_size();
-    frame_bits.release();
-    if (frame_bytes && !frame_bits.ensure(frame_bytes)) {
-        return false;
-    }
-    const u8* raw = frame_writer.data();
-    for (usize i = 0u; i < frame_bytes; ++i) {
-        frame_bits.data[i] = raw ? raw[i] : 0u;
-    }
-    frame_bits.size = frame_bytes;
+    byte_buffer_move(frame_bits, frame_writer.buffer);
     if (mapping.color_channels == 3u && frame_bytes) {
         for (usize i = 0u; i < frame_bytes; ++i) {
             u8 rotate = (u8)((i % 3u) + 1u);
@@ -22521,6 +25578,12 @@ static bool build_frame_bits(const makocode::EncoderContext& encoder,
 }
 
 
+// Page-sized buffers an encode worker keeps across encode_page_to_ppm calls so
+// consecutive pages reuse one set of allocations.
+struct EncodePageScratch {
+    makocode::ByteBuffer raster;
+};
+
 static bool encode_page_to_ppm(const ImageMappingConfig& mapping,
                                const makocode::ByteBuffer& frame_bits,
                                u64 frame_bit_count,
@@ -22535,7 +25598,9 @@ static bool encode_page_to_ppm(const ImageMappingConfig& mapping,
                                const char* footer_text,
                                usize footer_length,
                                const FooterLayout& footer_layout,
-                               makocode::ByteBuffer& output) {
+                               makocode::ByteBuffer& output,
+                               EncodePageScratch* scratch = 0) {
+    StatsTimer stats_timer(StatsStage_Render);
     if (mapping.color_channels == 0u || mapping.color_channels > 3u) {
         return false;
     }
@@ -22560,26 +25625,21 @@ static bool encode_page_to_ppm(const ImageMappingConfig& mapping,
         return false;
     }
     data_height_pixels = footer_layout.data_height_pixels;
-    makocode::ByteBuffer fiducial_mask;
-    makocode::ByteBuffer fiducial_marker_mask;
-    u64 reserved_data_pixels = 0u;
-    if (!compute_fiducial_reservation(width_pixels,
-                                      height_pixels,
-                                      data_height_pixels,
-                                      reserved_data_pixels,
-                                      &fiducial_mask)) {
-        return false;
-    }
-    // Keep a fiducial-only mask so metadata tile rendering never overwrites the
-    // white fiducial markers (the combined reservation mask also marks the tile).
-    u64 fiducial_only_reserved = 0u;
-    if (!compute_fiducial_marker_mask(width_pixels,
-                                      height_pixels,
-                                      data_height_pixels,
-                                      fiducial_only_reserved,
-                                      &fiducial_marker_mask)) {
-        return false;
-    }
+    EncodePageScratch local_scratch;
+    EncodePageScratch& buffers = scratch ? *scratch : local_scratch;
+    PageGeometry fallback_geometry;
+    const PageGeometry* geometry = page_geometry_acquire(width_pixels,
+                                                         height_pixels,
+                                                         data_height_pixels,
+                                                         true,
+                                                         fallback_geometry);
+    if (!geometry) {
+        return false;
+    }
+    // The marker-only mask keeps metadata tile rendering from overwriting the
+    // white fiducial markers (the reservation mask also marks the tile).
+    const makocode::ByteBuffer& fiducial_marker_mask = geometry->marker_mask;
+    u64 reserved_data_pixels = geometry->reserved_data_pixels;
     u64 total_data_pixels = (u64)width_pixels * (u64)data_height_pixels;
     if (reserved_data_pixels > total_data_pixels) {
         return false;
@@ -22685,22 +25745,16 @@ static bool encode_page_to_ppm(const ImageMappingConfig& mapping,
     u8 footer_text_rgb[3] = {0u, 0u, 0u};
     u8 footer_background_rgb[3] = {255u, 255u, 255u};
     footer_select_colors(mapping, footer_text_rgb, footer_background_rgb);
-    output.release();
-    if (!output.append_ascii("P3\n")) {
-        return false;
-    }
-    if (!buffer_append_number(output, (u64)width_pixels) || !output.append_char(' ')) {
-        return false;
-    }
-    if (!buffer_append_number(output, (u64)height_pixels) || !output.append_char('\n')) {
-        return false;
-    }
-    if (!output.append_ascii("255\n")) {
+    output.clear();
+    // Render the whole page (data, metadata tile, footer, fiducials) into one RGB
+    // raster and serialize it once at the end.
+    makocode::ByteBuffer& raster = buffers.raster;
+    raster.clear();
+    if (total_pixels > (u64)(USIZE_MAX_VALUE / 3u) || !raster.ensure((usize)total_pixels * 3u)) {
         return false;
     }
+    raster.size = (usize)total_pixels * 3u;
     const u8* frame_data = frame_bits.data;
-    const u8* mask_data = fiducial_mask.data;
-    usize mask_size = fiducial_mask.size;
     u64 bit_cursor = bit_offset;
     u64 digit_index = 0u;
 
@@ -22807,115 +25861,103 @@ static bool encode_page_to_ppm(const ImageMappingConfig& mapping,
         }
     }
 
-    for (u32 row = 0u; row < height_pixels; ++row) {
-        bool is_footer_row = (row >= data_height_pixels);
-        for (u32 column = 0u; column < width_pixels; ++column) {
-            u8 rgb[3] = {0u, 0u, 0u};
-            usize mask_index = ((usize)row * (usize)width_pixels) + (usize)column;
-            bool reserved_pixel = (!is_footer_row &&
-                                   mask_data &&
-                                   mask_index < mask_size &&
-                                   mask_data[mask_index] != 0u);
-            bool inside_tile = false;
-            if (!is_footer_row && have_metadata_tile) {
-                if (column >= tile_placement.x0 &&
-                    column < tile_placement.x0 + MetadataTile::TILE_SIDE &&
-                    row >= tile_placement.y0 &&
-                    row < tile_placement.y0 + MetadataTile::TILE_SIDE) {
-                    inside_tile = true;
-                }
-            }
-            if (!is_footer_row && inside_tile) {
-                bool is_fiducial_marker_pixel = false;
-                if (fiducial_marker_mask.data && fiducial_marker_mask.size) {
-                    if (mask_index < fiducial_marker_mask.size) {
-                        is_fiducial_marker_pixel = (fiducial_marker_mask.data[mask_index] != 0u);
-                    }
-                }
-                if (is_fiducial_marker_pixel) {
-                    // Preserve fiducial markers as pure white (255,255,255).
-                    rgb[0] = 255u;
-                    rgb[1] = 255u;
-                    rgb[2] = 255u;
-                } else {
-                    u32 local_x = column - tile_placement.x0;
-                    u32 local_y = row - tile_placement.y0;
-                    u8 bit = tile_bitfield.data[(usize)local_y * (usize)MetadataTile::TILE_SIDE + (usize)local_x];
-                    const PaletteColor& c = bit ? tile_dark : tile_light;
-                    rgb[0] = c.r;
-                    rgb[1] = c.g;
-                    rgb[2] = c.b;
-                }
-            } else if (!is_footer_row && !reserved_pixel) {
-                if (use_custom_palette) {
-                    u8 symbol = 0u;
-                    if (digit_index < (u64)base_digits.size) {
-                        symbol = base_digits.data[digit_index];
-                    }
-                    ++digit_index;
-                    if (symbol >= mapping.custom_palette_count) {
-                        return false;
-                    }
-                    const PaletteColor& color = mapping.custom_palette[symbol];
-                    rgb[0] = color.r;
-                    rgb[1] = color.g;
-                    rgb[2] = color.b;
-                } else {
-                    u32 samples_raw[3] = {0u, 0u, 0u};
-                    for (u8 sample_index = 0u; sample_index < samples_per_pixel; ++sample_index) {
-                        u32 sample = 0u;
-                        for (u8 bit = 0u; bit < sample_bits; ++bit) {
-                            u8 bit_value = 0u;
-                            if (bit_cursor < frame_bit_count && frame_data) {
-                                usize byte_index = (usize)(bit_cursor >> 3u);
-                                u8 mask = (u8)(1u << (bit_cursor & 7u));
-                                bit_value = (frame_data[byte_index] & mask) ? 1u : 0u;
-                            }
-                            sample |= ((u32)bit_value) << bit;
-                            ++bit_cursor;
-                        }
-                        samples_raw[sample_index] = sample;
-                    }
-                    if (!map_samples_to_rgb(mapping.color_channels, samples_raw, rgb)) {
-                        return false;
-                    }
-                }
-            } else if (!is_footer_row) {
-                rgb[0] = 255u;
-                rgb[1] = 255u;
-                rgb[2] = 255u;
-            } else {
-                rgb[0] = footer_background_rgb[0];
-                rgb[1] = footer_background_rgb[1];
-                rgb[2] = footer_background_rgb[2];
-                bool text_pixel = (has_footer_text &&
-                                   footer_is_text_pixel(footer_text, footer_length, footer_layout, column, row));
-                if (text_pixel) {
-                    rgb[0] = footer_text_rgb[0];
-                    rgb[1] = footer_text_rgb[1];
-                    rgb[2] = footer_text_rgb[2];
-                }
-            }
-            for (u8 channel = 0u; channel < 3u; ++channel) {
-                if (channel) {
-                    if (!output.append_char(' ')) {
-                        return false;
-                    }
-                }
-                if (!buffer_append_number(output, (u64)rgb[channel])) {
-                    return false;
-                }
+    // Reserved data pixels stay white. Payload pixels follow the geometry's
+    // data runs, then the metadata tile is painted over its reserved square.
+    usize row_bytes = (usize)width_pixels * 3u;
+    memset(raster.data, 255, (usize)data_height_pixels * row_bytes);
+    // The colour of every sample value is looked up once here, and the run
+    // kernel is picked once for the page's sample width.
+    u8 sample_rgb[8][3];
+    if (!use_custom_palette) {
+        if (samples_per_pixel != 1u || sample_bits > 3u) {
+            return false;
+        }
+        for (u32 sample = 0u; sample < (1u << sample_bits); ++sample) {
+            if (!map_samples_to_rgb(mapping.color_channels, &sample, sample_rgb[sample])) {
+                return false;
             }
-            if (!output.append_char('\n')) {
+        }
+    }
+    u64 frame_bits_available = frame_data ? frame_bit_count : 0u;
+    const PageGeometryRun* runs = geometry->runs();
+    for (usize run_index = 0u; run_index < geometry->run_count; ++run_index) {
+        const PageGeometryRun& run = runs[run_index];
+        u8* pixel = raster.data + (usize)run.row * row_bytes + (usize)run.column * 3u;
+        if (use_custom_palette) {
+            if (!render_run_from_digits(base_digits,
+                                        digit_index,
+                                        mapping.custom_palette,
+                                        mapping.custom_palette_count,
+                                        pixel,
+                                        run.length)) {
                 return false;
             }
+            continue;
+        }
+        switch (sample_bits) {
+            case 1u:
+                render_run_from_bits<1u>(frame_data, frame_bits_available, bit_cursor, sample_rgb, pixel, run.length);
+                break;
+            case 2u:
+                render_run_from_bits<2u>(frame_data, frame_bits_available, bit_cursor, sample_rgb, pixel, run.length);
+                break;
+            default:
+                render_run_from_bits<3u>(frame_data, frame_bits_available, bit_cursor, sample_rgb, pixel, run.length);
+                break;
+        }
+    }
+    if (have_metadata_tile) {
+        for (u32 dy = 0u; dy < MetadataTile::TILE_SIDE; ++dy) {
+            u32 row = tile_placement.y0 + dy;
+            if (row >= data_height_pixels) {
+                continue;
+            }
+            for (u32 dx = 0u; dx < MetadataTile::TILE_SIDE; ++dx) {
+                u32 column = tile_placement.x0 + dx;
+                if (column >= width_pixels) {
+                    continue;
+                }
+                usize mask_index = ((usize)row * (usize)width_pixels) + (usize)column;
+                u8* pixel = raster.data + mask_index * 3u;
+                if (mask_index < fiducial_marker_mask.size && fiducial_marker_mask.data[mask_index] != 0u) {
+                    // Preserve fiducial markers as pure white (255,255,255).
+                    pixel[0] = 255u;
+                    pixel[1] = 255u;
+                    pixel[2] = 255u;
+                    continue;
+                }
+                u8 bit = tile_bitfield.data[(usize)dy * (usize)MetadataTile::TILE_SIDE + (usize)dx];
+                const PaletteColor& c = bit ? tile_dark : tile_light;
+                pixel[0] = c.r;
+                pixel[1] = c.g;
+                pixel[2] = c.b;
+            }
+        }
+    }
+    for (u32 row = data_height_pixels; row < height_pixels; ++row) {
+        u8* pixel = raster.data + (usize)row * row_bytes;
+        for (u32 column = 0u; column < width_pixels; ++column, pixel += 3u) {
+            bool text_pixel = (has_footer_text &&
+                               footer_is_text_pixel(footer_text, footer_length, footer_layout, column, row));
+            const u8* rgb = text_pixel ? footer_text_rgb : footer_background_rgb;
+            pixel[0] = rgb[0];
+            pixel[1] = rgb[1];
+            pixel[2] = rgb[2];
         }
     }
     if (use_custom_palette && digit_index != digit_span) {
         console_line(2, "encode_page_to_ppm: palette digit span mismatch");
         return false;
     }
-    return true;
+    // Clip fiducials to the data area so they don't land on the footer stripe.
+    if (!paint_default_fiducial_grid(raster.data, width_pixels, height_pixels, data_height_pixels)) {
+        console_line(2, "encode_page_to_ppm: failed to embed fiducial grid");
+        return false;
+    }
+    PpmParserState page_state;
+    page_state.binary_pixels = mapping.ppm_binary_output;
+    stats_count(StatsCounter_Pages, 1u);
+    return ppm_write_raster(page_state, width_pixels, height_pixels, raster.data, output);
 }
 static bool process_fiducial_option(int arg_count,
                                     char** args,
@@ -23162,7 +26204,60 @@ static bool process_image_mapping_option(int arg_count,
     return true;
 }
 
+// --ppm-format only matters where pages are written (encode, bench); decode
+// reads either format and rejects it as an unknown option.
+static bool process_ppm_format_option(int arg_count,
+                                      char** args,
+                                      int* arg_index,
+                                      ImageMappingConfig& config,
+                                      const char* command_name,
+                                      bool* handled) {
+    if (!handled || !arg_index || !args) {
+        return false;
+    }
+    *handled = false;
+    int index = *arg_index;
+    if (index < 0 || index >= arg_count) {
+        return false;
+    }
+    const char* arg = args[index];
+    if (!arg) {
+        return true;
+    }
+    const char format_prefix[] = "--ppm-format=";
+    const char* value_text = 0;
+    usize length = 0u;
+    if (ascii_equals_token(arg, ascii_length(arg), "--ppm-format")) {
+        if ((index + 1) >= arg_count || !args[index + 1]) {
+            console_write(2, command_name);
+            console_line(2, ": --ppm-format requires a value (P3 or P6)");
+            return false;
+        }
+        value_text = args[index + 1];
+        length = ascii_length(value_text);
+        *arg_index = index + 1;
+    } else if (ascii_starts_with(arg, format_prefix)) {
+        value_text = arg + (sizeof(format_prefix) - 1u);
+        length = ascii_length(value_text);
+    }
+    if (value_text) {
+        if (ascii_equals_token(value_text, length, "P3") || ascii_equals_token(value_text, length, "p3")) {
+            config.ppm_binary_output = false;
+        } else if (ascii_equals_token(value_text, length, "P6") || ascii_equals_token(value_text, length, "p6")) {
+            config.ppm_binary_output = true;
+        } else {
+            console_write(2, command_name);
+            console_line(2, ": --ppm-format must be P3 (ASCII) or P6 (binary)");
+            return false;
+        }
+        *handled = true;
+        return true;
+    }
+    return true;
+}
+
 static bool read_entire_stdin(makocode::ByteBuffer& buffer) {
+    StatsTimer stats_timer(StatsStage_Read);
     const usize chunk = 4096u;
     usize total = 0u;
     for (;;) {
@@ -23180,6 +26275,7 @@ static bool read_entire_stdin(makocode::ByteBuffer& buffer) {
         buffer.size = total;
     }
     buffer.size = total;
+    stats_count(StatsCounter_BytesRead, (u64)total);
     return true;
 }
 
@@ -23192,14 +26288,28 @@ static bool read_entire_file(const char* path, makocode::ByteBuffer& buffer) {
         return false;
     }
     buffer.release();
-    const usize chunk = 4096u;
+    // Size the buffer from fstat so regular files are read into one allocation;
+    // the chunked loop still handles pipes and files that grow underneath us.
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0 &&
+        (u64)info.st_size < (u64)(USIZE_MAX_VALUE / 2u)) {
+        if (!buffer.reserve((usize)info.st_size + 1u)) {
+            close(fd);
+            return false;
+        }
+    }
+    const usize chunk = 1u << 20u;
     usize total = 0u;
     for (;;) {
-        if (!buffer.ensure(total + chunk)) {
+        if (!buffer.ensure(total + 1u)) {
             close(fd);
             return false;
         }
-        int read_result = read(fd, buffer.data + total, chunk);
+        usize request = buffer.capacity - total;
+        if (request > chunk) {
+            request = chunk;
+        }
+        int read_result = read(fd, buffer.data + total, (unsigned long)request);
         if (read_result < 0) {
             close(fd);
             return false;
@@ -23218,6 +26328,7 @@ static bool read_entire_file(const char* path, makocode::ByteBuffer& buffer) {
     }
     buffer.size = total;
     close(fd);
+    stats_count(StatsCounter_BytesRead, (u64)total);
     if (debug_logging_enabled() && buffer.size >= 8u && buffer.data) {
         console_write(2, "debug file first bytes: ");
         for (usize debug_i = 0u; debug_i < 8u && debug_i < buffer.size; ++debug_i) {
@@ -23233,20 +26344,187 @@ static bool read_entire_file(const char* path, makocode::ByteBuffer& buffer) {
     return true;
 }
 
+// Read-only view of an input page. Regular files are mapped so the PPM parser
+// runs directly on the page cache instead of a heap copy of it; anything mmap
+// refuses (pipes, character devices, empty files) is read into `fallback`.
+// `data`/`size` describe whichever one backs the view.
+struct InputFile {
+    const u8* data;
+    usize size;
+    void* map;
+    usize map_size;
+    makocode::ByteBuffer fallback;
+
+    InputFile()
+        : data(0),
+          size(0u),
+          map(0),
+          map_size(0u),
+          fallback() {}
+
+    ~InputFile() {
+        release();
+    }
+
+    void release() {
+        if (map) {
+            munmap(map, map_size);
+        }
+        map = 0;
+        map_size = 0u;
+        fallback.release();
+        data = 0;
+        size = 0u;
+    }
+};
+
+static bool input_file_open(InputFile& input, const char* path) {
+    StatsTimer stats_timer(StatsStage_Read);
+    input.release();
+    if (!path) {
+        return false;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 &&
+        (u64)info.st_size <= (u64)USIZE_MAX_VALUE) {
+        usize length = (usize)info.st_size;
+        void* view = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view != MAP_FAILED) {
+            // Every parser walks the page front to back exactly once.
+            madvise(view, length, MADV_SEQUENTIAL);
+            close(fd);
+            input.map = view;
+            input.map_size = length;
+            input.data = (const u8*)view;
+            input.size = length;
+            stats_count(StatsCounter_BytesRead, (u64)length);
+            return true;
+        }
+    }
+    close(fd);
+    if (!read_entire_file(path, input.fallback)) {
+        return false;
+    }
+    input.data = input.fallback.data;
+    input.size = input.fallback.size;
+    return true;
+}
+
+static bool ensure_parent_directories(const char* file_path);
+static bool join_output_path(const char* base_dir,
+                             const char* rel_path,
+                             makocode::ByteBuffer& out);
+
+// Unlinked scratch file backing one stage of `encode --stream`. Stages read and
+// write spools sequentially; the final stream is mapped, and because the
+// mapping is file-backed the kernel can evict it instead of the encoder
+// pinning the whole payload in anonymous memory.
+struct SpoolFile {
+    int fd;
+    u64 size;
+    u8* map;
+    usize map_size;
+
+    SpoolFile()
+        : fd(-1),
+          size(0u),
+          map(0),
+          map_size(0u) {}
+
+    ~SpoolFile() {
+        release();
+    }
+
+    void unmap() {
+        if (map) {
+            munmap(map, map_size);
+        }
+        map = 0;
+        map_size = 0u;
+    }
+
+    void release() {
+        unmap();
+        if (fd >= 0) {
+            close(fd);
+        }
+        fd = -1;
+        size = 0u;
+    }
+};
+
+static bool spool_open(SpoolFile& spool, const char* directory) {
+    spool.release();
+    makocode::ByteBuffer path;
+    if (!join_output_path(directory, ".makocode-spool-XXXXXX", path)) {
+        return false;
+    }
+    if (!ensure_parent_directories((const char*)path.data)) {
+        return false;
+    }
+    spool.fd = mkstemp((char*)path.data);
+    if (spool.fd < 0) {
+        return false;
+    }
+    unlink((const char*)path.data);
+    return true;
+}
+
+static bool spool_append(SpoolFile& spool, const u8* data, usize length) {
+    if (spool.fd < 0 || !makocode::stream_write_exact(spool.fd, data, length)) {
+        return false;
+    }
+    spool.size += (u64)length;
+    return true;
+}
+
+static bool spool_rewind(SpoolFile& spool) {
+    return spool.fd >= 0 && lseek(spool.fd, 0, 0) == 0;
+}
+
+// Maps the spool read/write, growing or truncating the file to `length` first.
+static bool spool_map(SpoolFile& spool, u64 length) {
+    spool.unmap();
+    if (spool.fd < 0 || length == 0u || length > (u64)USIZE_MAX_VALUE) {
+        return false;
+    }
+    if (length != spool.size) {
+        if (ftruncate(spool.fd, (long)length) != 0) {
+            return false;
+        }
+        spool.size = length;
+    }
+    void* view = mmap(0, (usize)length, PROT_READ | PROT_WRITE, MAP_SHARED, spool.fd, 0);
+    if (view == MAP_FAILED) {
+        return false;
+    }
+    spool.map = (u8*)view;
+    spool.map_size = (usize)length;
+    return true;
+}
+
 static const char ARCHIVE_MAGIC[8] = {'M', 'K', 'A', 'R', 'C', 'H', '0', '1'};
 static const usize ARCHIVE_MAGIC_SIZE = (usize)sizeof(ARCHIVE_MAGIC);
 static const usize ARCHIVE_HEADER_SIZE = ARCHIVE_MAGIC_SIZE + 4u;
 static const usize MAX_ARCHIVE_PATH_COMPONENTS = 512u;
 
+// With `spool` set the archive is streamed to disk: `buffer` only stages entry
+// headers between flushes and file contents are copied through in chunks.
 struct ArchiveBuildContext {
     makocode::ByteBuffer buffer;
     makocode::ByteBuffer path_registry;
     u32 entry_count;
+    SpoolFile* spool;
 
     ArchiveBuildContext()
         : buffer(),
           path_registry(),
-          entry_count(0u) {}
+          entry_count(0u),
+          spool(0) {}
 
     ~ArchiveBuildContext() {
         buffer.release();
@@ -23355,6 +26633,8 @@ static bool archive_register_path(ArchiveBuildContext& ctx,
     return true;
 }
 
+static bool archive_flush(ArchiveBuildContext& ctx);
+
 static bool archive_add_directory(ArchiveBuildContext& ctx,
                                   const char* rel_path) {
     if (!rel_path) {
@@ -23382,13 +26662,24 @@ static bool archive_add_directory(ArchiveBuildContext& ctx,
         return false;
     }
     ++ctx.entry_count;
+    return archive_flush(ctx);
+}
+
+static bool archive_flush(ArchiveBuildContext& ctx) {
+    if (!ctx.spool) {
+        return true;
+    }
+    if (!spool_append(*ctx.spool, ctx.buffer.data, ctx.buffer.size)) {
+        console_line(2, "encode: failed to write archive spool");
+        return false;
+    }
+    ctx.buffer.size = 0u;
     return true;
 }
 
-static bool archive_add_file(ArchiveBuildContext& ctx,
-                             const char* rel_path,
-                             const u8* data,
-                             usize length) {
+static bool archive_begin_file(ArchiveBuildContext& ctx,
+                               const char* rel_path,
+                               u64 length) {
     if (!rel_path) {
         return false;
     }
@@ -23413,17 +26704,98 @@ static bool archive_add_file(ArchiveBuildContext& ctx,
     if (!archive_append_bytes(ctx.buffer, (const u8*)rel_path, path_len)) {
         return false;
     }
-    if (!archive_append_u64(ctx.buffer, (u64)length)) {
+    if (!archive_append_u64(ctx.buffer, length)) {
+        return false;
+    }
+    ++ctx.entry_count;
+    return true;
+}
+
+static bool archive_add_file(ArchiveBuildContext& ctx,
+                             const char* rel_path,
+                             const u8* data,
+                             usize length) {
+    if (!archive_begin_file(ctx, rel_path, (u64)length)) {
         return false;
     }
-    if (!archive_append_bytes(ctx.buffer, data, length)) {
+    return archive_append_bytes(ctx.buffer, data, length);
+}
+
+// Adds the regular file at `fs_path`. Spooled archives copy it through a fixed
+// chunk rather than reading it whole.
+static bool archive_add_file_from_path(ArchiveBuildContext& ctx,
+                                       const char* rel_path,
+                                       const char* fs_path) {
+    if (!ctx.spool) {
+        makocode::ByteBuffer file_data;
+        if (!read_entire_file(fs_path, file_data)) {
+            console_write(2, "encode: failed to read ");
+            console_line(2, fs_path);
+            return false;
+        }
+        bool added = archive_add_file(ctx, rel_path, file_data.data, file_data.size);
+        file_data.release();
+        return added;
+    }
+    int fd = open(fs_path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        console_write(2, "encode: failed to read ");
+        console_line(2, fs_path);
+        return false;
+    }
+    u64 expected = (u64)info.st_size;
+    if (!archive_begin_file(ctx, rel_path, expected) || !archive_flush(ctx)) {
+        close(fd);
+        return false;
+    }
+    makocode::ByteBuffer chunk;
+    if (!chunk.ensure(makocode::STREAM_IO_CHUNK_BYTES)) {
+        close(fd);
+        return false;
+    }
+    u64 copied = 0u;
+    for (;;) {
+        int result = read(fd, chunk.data, (unsigned long)makocode::STREAM_IO_CHUNK_BYTES);
+        if (result < 0) {
+            close(fd);
+            console_write(2, "encode: failed to read ");
+            console_line(2, fs_path);
+            return false;
+        }
+        if (result == 0) {
+            break;
+        }
+        if (!spool_append(*ctx.spool, chunk.data, (usize)result)) {
+            close(fd);
+            console_line(2, "encode: failed to write archive spool");
+            return false;
+        }
+        copied += (u64)result;
+    }
+    close(fd);
+    stats_count(StatsCounter_BytesRead, copied);
+    if (copied != expected) {
+        console_write(2, "encode: file changed while reading ");
+        console_line(2, fs_path);
         return false;
     }
-    ++ctx.entry_count;
     return true;
 }
 
 static bool archive_finalize(ArchiveBuildContext& ctx) {
+    if (ctx.spool) {
+        if (!archive_flush(ctx) || ctx.spool->size < ARCHIVE_HEADER_SIZE) {
+            return false;
+        }
+        u8 count_bytes[4];
+        write_le_u32(count_bytes, ctx.entry_count);
+        return lseek(ctx.spool->fd, (long)ARCHIVE_MAGIC_SIZE, 0) == (long)ARCHIVE_MAGIC_SIZE &&
+               makocode::stream_write_exact(ctx.spool->fd, count_bytes, 4u);
+    }
     if (ctx.buffer.size < ARCHIVE_HEADER_SIZE) {
         return false;
     }
@@ -23730,22 +27102,12 @@ static bool archive_collect_directory(const char* fs_path,
                 return false;
             }
         } else if (S_ISREG(st.st_mode)) {
-            makocode::ByteBuffer file_data;
-            if (!read_entire_file((const char*)child_fs.data, file_data)) {
-                console_write(2, "encode: failed to read ");
-                console_line(2, (const char*)child_fs.data);
-                closedir(dir);
-                return false;
-            }
-            if (!archive_add_file(ctx,
-                                  (const char*)child_rel.data,
-                                  file_data.data,
-                                  file_data.size)) {
-                file_data.release();
+            if (!archive_add_file_from_path(ctx,
+                                            (const char*)child_rel.data,
+                                            (const char*)child_fs.data)) {
                 closedir(dir);
                 return false;
             }
-            file_data.release();
         } else {
             console_write(2, "encode: unsupported entry type for ");
             console_line(2, (const char*)child_rel.data);
@@ -23943,8 +27305,16 @@ static bool join_output_path(const char* base_dir,
     return true;
 }
 
+// With `only_path`, entries outside that file or directory are validated but
+// not written; `matched_count` receives the number that were.
 static bool unpack_archive_to_directory(const makocode::ByteBuffer& payload,
-                                        const char* output_dir) {
+                                        const char* output_dir,
+                                        const char* only_path = 0,
+                                        u32* matched_count = 0) {
+    StatsTimer stats_timer(StatsStage_Unpack);
+    if (matched_count) {
+        *matched_count = 0u;
+    }
     if (!payload.data || payload.size < ARCHIVE_HEADER_SIZE) {
         console_line(2, "decode: payload missing archive header");
         return false;
@@ -23993,7 +27363,18 @@ static bool unpack_archive_to_directory(const makocode::ByteBuffer& payload,
             return false;
         }
         cursor += (usize)path_length;
+        bool selected = !only_path ||
+                        makocode::payload_path_matches(entry_path,
+                                                       (usize)path_length,
+                                                       only_path,
+                                                       ascii_length(only_path));
+        if (selected && matched_count) {
+            *matched_count += 1u;
+        }
         if (entry_type == 1u) {
+            if (!selected) {
+                continue;
+            }
             makocode::ByteBuffer output_path;
             if (!join_output_path(output_dir, entry_path, output_path)) {
                 return false;
@@ -24016,6 +27397,9 @@ static bool unpack_archive_to_directory(const makocode::ByteBuffer& payload,
             }
             const u8* file_data = payload.data + cursor;
             cursor += (usize)file_size;
+            if (!selected) {
+                continue;
+            }
             makocode::ByteBuffer output_path;
             if (!join_output_path(output_dir, entry_path, output_path)) {
                 return false;
@@ -24044,6 +27428,35 @@ static bool unpack_archive_to_directory(const makocode::ByteBuffer& payload,
     return true;
 }
 
+// Rebuilds a MKARCH01 archive holding only the entries under `path`, reading
+// them out of a block container without decompressing unrelated blocks.
+static bool extract_block_container_entries(const makocode::ByteBuffer& container,
+                                            const char* path,
+                                            makocode::ByteBuffer& archive) {
+    archive.release();
+    makocode::LzmaBlockIndex index;
+    if (!makocode::lzma_blocks_parse(container.data, container.size, index)) {
+        console_line(2, "decode: compressed block index is corrupt");
+        return false;
+    }
+    makocode::ByteBuffer records;
+    u32 record_count = 0u;
+    if (!makocode::lzma_blocks_extract_records(index, path, ascii_length(path), records, record_count)) {
+        console_line(2, "decode: failed to decompress archive blocks");
+        return false;
+    }
+    if (!archive.ensure(ARCHIVE_HEADER_SIZE + records.size)) {
+        return false;
+    }
+    memcpy(archive.data, ARCHIVE_MAGIC, ARCHIVE_MAGIC_SIZE);
+    write_le_u32(archive.data + ARCHIVE_MAGIC_SIZE, record_count);
+    if (records.size) {
+        memcpy(archive.data + ARCHIVE_HEADER_SIZE, records.data, records.size);
+    }
+    archive.size = ARCHIVE_HEADER_SIZE + records.size;
+    return true;
+}
+
 static void write_usage() {
     console_line(1, "MakoCode CLI");
     console_line(1, "Usage:");
@@ -24051,6 +27464,7 @@ static void write_usage() {
     console_line(1, "  makocode decode [options] files... (reads PPM pages; use stdin when no files)");
     console_line(1, "  makocode overlay BASE.ppm OVERLAY.ppm FRACTION (writes merged page to stdout)");
     console_line(1, "  makocode minify             (writes makocode_minified.cpp without comments)");
+    console_line(1, "  makocode bench [options]    (times each pipeline stage on a synthetic payload)");
     console_line(1, "Options:");
     console_line(1, "  --palette \"Color ...\" (2-16 unique names from White/Cyan/Magenta/Yellow/Black; default palette is White Black)");
     console_line(1, "  --page-width PX    (page width in pixels; default 2480)");
@@ -24067,6 +27481,7 @@ static void write_usage() {
     console_line(1, "  --title TEXT       (optional footer title; letters, digits, common symbols)");
     console_line(1, "  --font-size PX     (footer font scale in pixels; default 1)");
     console_line(1, "  --debug            (emit verbose diagnostic logs; default off)");
+    console_line(1, "  --stats[=PATH]     (JSON stage timings and counters to stderr or PATH; default off)");
     console_line(1, "");
     console_line(1, "Run 'makocode <command> --help' (or -h) for command-specific details.");
 }
@@ -24097,6 +27512,8 @@ static void write_encode_help() {
     console_line(1, "Output:");
     console_line(1, "  --output-dir PATH    Directory for generated PPM pages (default current directory).");
     console_line(1, "  --prefix TEXT        Base filename prefix for generated pages (default UTC timestamp, no '/' or '\\\\').");
+    console_line(1, "  --ppm-format FMT     Page encoding: P3 (ASCII, default) or P6 (binary, ~4x smaller).");
+    console_line(1, "  --y4m PATH           Write every page as a frame of one YUV4MPEG2 stream (- for stdout).");
     console_line(1, "");
     console_line(1, "Layout:");
     console_line(1, "  --palette \"Color ...\"   Custom palette (2-16 unique entries from White/Cyan/Magenta/Yellow/Black; default is \"White Black\").");
@@ -24110,6 +27527,12 @@ static void write_encode_help() {
     console_line(1, "  --ecc-fill           Derive the ECC ratio that fills the final page and emit pages with that redundancy.");
     console_line(1, "  --password TEXT      Encrypt payload with ChaCha20-Poly1305.");
     console_line(1, "");
+    console_line(1, "Performance:");
+    console_line(1, "  --jobs N             Render and write pages on N threads (default 1, max 256).");
+    console_line(1, "  --stream             Spool archive/LZMA/ECC stages through the output directory for bounded memory.");
+    console_line(1, "  --compression MODE   LZMA profile: fast, default, max or store (no compression).");
+    console_line(1, "  --compression-block KIB  Compress the archive in independent KiB blocks on --jobs threads (min 64).");
+    console_line(1, "");
     console_line(1, "Footer customization:");
     console_line(1, "  --title TEXT         Footer title (letters/digits/common symbols).");
     console_line(1, "  --font-size PX       Footer font scaling (default 1, max 2048).");
@@ -24118,6 +27541,7 @@ static void write_encode_help() {
     console_line(1, "");
     console_line(1, "General:");
     console_line(1, "  --debug              Emit verbose diagnostic logs to stderr.");
+    console_line(1, "  --stats[=PATH]       Write a JSON summary of stage timings and counters to stderr or PATH.");
     console_line(1, "  --help               Show this message.");
     console_line(1, "All options accept either --flag=value or --flag value forms where supported.");
 }
@@ -24127,20 +27551,32 @@ static void write_decode_help() {
     console_line(1, "Usage: makocode decode [options] [PPM files...]");
     console_line(1, "Reads pages from files or stdin (when no files) and reconstructs the archive.");
     console_line(1, "");
+    console_line(1, "Progressive input:");
+    console_line(1, "  --stream             Read concatenated pages from stdin and decode as they arrive.");
+    console_line(1, "  --watch DIR          Decode *.ppm pages as they appear in DIR.");
+    console_line(1, "  --watch-idle SECONDS Stop watching after SECONDS without a new page (default 600; 0 waits forever).");
+    console_line(1, "");
     console_line(1, "Output & security:");
     console_line(1, "  --output-dir PATH    Destination directory (default current directory).");
     console_line(1, "  --password TEXT      Supply the decryption password for protected payloads.");
+    console_line(1, "  --extract PATH       Restore only the archive file or directory at PATH.");
     console_line(1, "");
     console_line(1, "Layout overrides (match encoder settings when non-default):");
     console_line(1, "  --palette \"Color ...\"   Custom palette (2-16 unique entries from White/Cyan/Magenta/Yellow/Black; default is \"White Black\").");
     console_line(1, "  --page-width PX      Page width in pixels (default 2480).");
     console_line(1, "  --page-height PX     Page height in pixels (default 3508).");
     console_line(1, "  --fiducials S,D[,M]  Marker size, spacing, optional margin (default 4,24,12).");
+    console_line(1, "  --recover-metadata   Guess the layout of pages whose metadata tile is unreadable.");
+    console_line(1, "");
+    console_line(1, "Performance:");
+    console_line(1, "  --jobs N             Extract bits from up to N pages concurrently (default 1, max 256).");
     console_line(1, "");
     console_line(1, "General:");
     console_line(1, "  --debug              Emit verbose diagnostic logs to stderr.");
+    console_line(1, "  --stats[=PATH]       Write a JSON summary of stage timings and counters to stderr or PATH.");
     console_line(1, "  --help               Show this message.");
     console_line(1, "Provide one or more PPM files, or pipe pages via stdin.");
+    console_line(1, "A single YUV4MPEG2 stream (encode --y4m) is read as one page per frame, from a file or stdin.");
 }
 
 static void write_overlay_help() {
@@ -24159,6 +27595,25 @@ static void write_minify_help() {
     console_line(1, "Strips comments/whitespace from makocode.cpp and emits makocode_minified.cpp.");
 }
 
+static void write_bench_help() {
+    console_line(1, "makocode bench");
+    console_line(1, "Usage: makocode bench [options]");
+    console_line(1, "Times each pipeline stage on a deterministic synthetic payload and prints one");
+    console_line(1, "'bench stage=NAME bytes=N runs=N ms=T mb_per_s=R [pages=N pages_per_s=R]' line per stage.");
+    console_line(1, "Timings are the fastest of --iterations runs; MB is 10^6 bytes.");
+    console_line(1, "");
+    console_line(1, "Options:");
+    console_line(1, "  --size KIB           Synthetic payload size in KiB (default 1024).");
+    console_line(1, "  --iterations N       Runs per stage (default 3, max 1000).");
+    console_line(1, "  --pages N            Pages rendered, parsed and extracted (default 1, max 1024).");
+    console_line(1, "  --compression MODE   LZMA profile: fast, default, max or store.");
+    console_line(1, "  --ecc RATIO          Reed-Solomon redundancy (default 0.20).");
+    console_line(1, "  --palette, --page-width, --page-height, --fiducials");
+    console_line(1, "                       Page layout, as for encode.");
+    console_line(1, "  --ppm-format FMT     Page encoding for the render and parse stages: P3 (default) or P6.");
+    console_line(1, "  --help               Show this message.");
+}
+
 static bool title_char_is_allowed(char c) {
     bool is_digit = (c >= '0' && c <= '9');
     bool is_upper = (c >= 'A' && c <= 'Z');
@@ -24456,65 +27911,116 @@ static bool compute_frame_statistics(usize payload_bytes,
     return true;
 }
 
-struct EccFillCandidate {
-    double ratio;
-    u16 block_data;
-    u16 parity;
-    u64 block_count;
-    u64 payload_bits;
-    u64 frame_bits;
-    u64 bits_per_page;
-    u64 page_count;
-};
+// Page capacity for --ecc-fill. With everything else fixed, the footer text
+// length (which grows with the page-count digits) is the only input to the
+// layout that changes between candidates. Each distinct length is laid out
+// once and remembered.
+struct EccFillCapacityModel {
+    const ImageMappingConfig& mapping;
+    PageFooterConfig footer;
+    u32 width_pixels;
+    u32 height_pixels;
+    double bits_per_pixel;
+    static const u32 MAX_LAYOUTS = 16u;
+    usize text_lengths[MAX_LAYOUTS];
+    u64 page_bits[MAX_LAYOUTS];
+    u32 layout_count;
+
+    EccFillCapacityModel(const ImageMappingConfig& mapping_in,
+                         const PageFooterConfig& footer_in,
+                         u32 width_in,
+                         u32 height_in)
+        : mapping(mapping_in),
+          footer(footer_in),
+          width_pixels(width_in),
+          height_pixels(height_in),
+          bits_per_pixel(mapping_bits_per_data_pixel(mapping_in)),
+          layout_count(0u) {
+        // Footer barcode removed: disable stripe sizing hints.
+        footer.stripe_rows_hint = 0u;
+        footer.stripe_module_count_hint = 0u;
+        footer.stripe_module_pitch_hint = 0u;
+    }
 
-static bool evaluate_ecc_fill_candidate(usize payload_bytes,
-                                        double redundancy,
-                                        const ImageMappingConfig& mapping,
-                                        const PageFooterConfig& footer_template,
-                                        u32 width_pixels,
-                                        u32 height_pixels,
-                                        EccFillCandidate& candidate) {
-    if (payload_bytes == 0u) {
-        return false;
+    bool bits_per_page_for(u64 page_count, u64& bits_per_page) {
+        u64 text_page_count = footer.display_page_info ? page_count : 1u;
+        usize text_length = footer_compute_max_text_length(footer, text_page_count);
+        for (u32 i = 0u; i < layout_count; ++i) {
+            if (text_lengths[i] == text_length) {
+                bits_per_page = page_bits[i];
+                return true;
+            }
+        }
+        if (bits_per_pixel <= 0.0) {
+            return false;
+        }
+        footer.max_text_length = text_length;
+        FooterLayout layout = FooterLayout();
+        if (!compute_footer_layout(width_pixels, height_pixels, footer, layout)) {
+            return false;
+        }
+        u32 data_height_pixels = layout.data_height_pixels;
+        if (layout.stripe_height_pixels > 0u && data_height_pixels >= height_pixels) {
+            return false;
+        }
+        if (data_height_pixels == 0u || data_height_pixels > height_pixels) {
+            return false;
+        }
+        if (!compute_bits_per_page(width_pixels, height_pixels, data_height_pixels, bits_per_pixel, bits_per_page, 0) ||
+            bits_per_page == 0u) {
+            return false;
+        }
+        if (layout_count < MAX_LAYOUTS) {
+            text_lengths[layout_count] = text_length;
+            page_bits[layout_count] = bits_per_page;
+            ++layout_count;
+        }
+        return true;
     }
-    u64 dummy_payload_bits = 0u;
-    if (!compute_frame_statistics(payload_bytes,
-                                  redundancy,
-                                  candidate.block_data,
-                                  candidate.parity,
-                                  candidate.block_count,
-                                  dummy_payload_bits,
-                                  candidate.frame_bits)) {
+
+    // Same fixed point as compute_page_layout: the page count feeds back into
+    // the footer text, which can change the page capacity.
+    bool page_count_for(u64 frame_bits, u64& bits_per_page, u64& page_count) {
+        page_count = 1u;
+        const u32 MAX_FOOTER_LAYOUT_PASSES = 16u;
+        for (u32 pass = 0u; pass < MAX_FOOTER_LAYOUT_PASSES; ++pass) {
+            if (!bits_per_page_for(page_count, bits_per_page)) {
+                return false;
+            }
+            u64 new_page_count = (frame_bits + bits_per_page - 1u) / bits_per_page;
+            if (new_page_count == 0u) {
+                new_page_count = 1u;
+            }
+            bool converged = !footer.display_page_info || new_page_count == page_count;
+            page_count = new_page_count;
+            if (converged) {
+                return true;
+            }
+        }
         return false;
     }
-    if (candidate.block_data == 0u || candidate.parity == 0u) {
+};
+
+// Frame size of an ECC layout, as compute_frame_statistics would report it.
+static bool ecc_fill_frame_bits(usize payload_bytes, u32 block_data, u32 parity, u64& frame_bits) {
+    u64 block_count = ((u64)payload_bytes + block_data - 1u) / block_data;
+    if (block_count == 0u) {
+        block_count = 1u;
+    }
+    u64 total_symbols = (u64)(block_data + parity) * block_count;
+    if (total_symbols > (U64_MAX_VALUE - makocode::ECC_HEADER_TOTAL_BITS - 64u) / 8u) {
         return false;
     }
-    FooterLayout layout = FooterLayout();
-    PageFooterConfig footer_copy = footer_template;
-    u32 layout_data_height = height_pixels;
-    u64 bits_per_page = 0u;
-    u64 page_count = 0u;
-    if (!compute_page_layout(mapping,
-                             footer_copy,
-                             candidate.frame_bits,
-                             width_pixels,
-                             height_pixels,
-                             layout,
-                             layout_data_height,
-                             bits_per_page,
-                             page_count)) {
-        return false;
-    }
-    if (page_count == 0u) {
-        page_count = 1u;
-    }
-    candidate.ratio = (double)candidate.parity / (double)candidate.block_data;
-    candidate.bits_per_page = bits_per_page;
-    candidate.page_count = page_count;
+    frame_bits = total_symbols * 8u + makocode::ECC_HEADER_TOTAL_BITS + 64u;
     return true;
 }
 
+// Enumerates every Reed-Solomon layout with a ratio in [min_ratio, max_ratio]
+// and keeps the one that needs the fewest pages and then leaves the fewest
+// unused bits on the last page (ties go to the smaller ratio). The encoder is
+// configured by ratio alone, so only layouts that compute_ecc_layout
+// reproduces from parity / block_data are considered; every layout a ratio
+// can select is of that form.
 static bool find_best_ecc_fill(usize payload_bytes,
                                double min_ratio,
                                double max_ratio,
@@ -24537,233 +28043,1927 @@ static bool find_best_ecc_fill(usize payload_bytes,
     if (payload_bytes == 0u) {
         return false;
     }
-    double search_low = min_ratio;
-    double search_high = max_ratio;
-    EccFillCandidate candidate;
-    auto try_candidate = [&](double redundancy) -> bool {
-        EccFillCandidate local;
-        if (!evaluate_ecc_fill_candidate(payload_bytes,
-                                          redundancy,
-                                          mapping,
-                                          footer_config,
-                                          width_pixels,
-                                          height_pixels,
-                                          local)) {
-            return false;
-        }
-        u64 bits_remaining = (local.bits_per_page > local.frame_bits) ? (local.bits_per_page - local.frame_bits) : 0u;
-        if (best_ratio < 0.0 ||
-            local.page_count < best_page_count ||
-            (local.page_count == best_page_count && bits_remaining < best_bits_needed) ||
-            (local.page_count == best_page_count && bits_remaining == best_bits_needed && local.ratio < best_ratio)) {
-            best_ratio = local.ratio;
-            best_block_data = local.block_data;
-            best_parity = local.parity;
-            best_frame_bits = local.frame_bits;
-            best_bits_needed = bits_remaining;
-            best_page_count = local.page_count;
-        }
-        candidate = local;
+    EccFillCapacityModel capacity(mapping, footer_config, width_pixels, height_pixels);
+    for (u32 block_data = 1u; block_data < makocode::RS_FIELD_SIZE; ++block_data) {
+        for (u32 parity = 2u; block_data + parity <= makocode::RS_FIELD_SIZE; ++parity) {
+            double ratio = (double)parity / (double)block_data;
+            if (ratio < min_ratio || ratio > max_ratio) {
+                continue;
+            }
+            u16 layout_data = 0u;
+            u16 layout_parity = 0u;
+            u64 layout_blocks = 0u;
+            if (!makocode::compute_ecc_layout(payload_bytes, ratio, layout_data, layout_parity, layout_blocks) ||
+                layout_data != block_data ||
+                layout_parity != parity) {
+                continue;
+            }
+            u64 frame_bits = 0u;
+            u64 bits_per_page = 0u;
+            u64 page_count = 0u;
+            if (!ecc_fill_frame_bits(payload_bytes, block_data, parity, frame_bits) ||
+                !capacity.page_count_for(frame_bits, bits_per_page, page_count)) {
+                continue;
+            }
+            u64 bits_remaining = page_count * bits_per_page - frame_bits;
+            if (best_ratio < 0.0 ||
+                page_count < best_page_count ||
+                (page_count == best_page_count && bits_remaining < best_bits_needed) ||
+                (page_count == best_page_count && bits_remaining == best_bits_needed && ratio < best_ratio)) {
+                best_ratio = ratio;
+                best_block_data = (u16)block_data;
+                best_parity = (u16)parity;
+                best_frame_bits = frame_bits;
+                best_bits_needed = bits_remaining;
+                best_page_count = page_count;
+            }
+        }
+    }
+    return (best_ratio >= 0.0);
+}
+
+static const u32 MAX_WORKER_THREADS = 256u;
+
+// Parses --jobs=N / --jobs N (1..MAX_WORKER_THREADS) shared by encode and decode.
+static bool process_jobs_option(int arg_count,
+                                char** args,
+                                int* arg_index,
+                                u32& jobs,
+                                const char* command_name,
+                                bool* handled) {
+    if (!handled || !arg_index || !args) {
+        return false;
+    }
+    *handled = false;
+    int index = *arg_index;
+    if (index < 0 || index >= arg_count) {
+        return false;
+    }
+    const char* arg = args[index];
+    if (!arg) {
         return true;
-    };
-    if (!try_candidate(search_low)) {
+    }
+    const char jobs_prefix[] = "--jobs=";
+    const char* jobs_value = 0;
+    if (ascii_equals_token(arg, ascii_length(arg), "--jobs")) {
+        if ((index + 1) >= arg_count || !args[index + 1]) {
+            console_write(2, command_name);
+            console_line(2, ": --jobs requires a positive integer value");
+            return false;
+        }
+        jobs_value = args[index + 1];
+        *arg_index = index + 1;
+    } else if (ascii_starts_with(arg, jobs_prefix)) {
+        jobs_value = arg + (sizeof(jobs_prefix) - 1u);
+    }
+    if (!jobs_value) {
+        return true;
+    }
+    u64 value = 0u;
+    if (!ascii_to_u64(jobs_value, ascii_length(jobs_value), &value) ||
+        value == 0u ||
+        value > (u64)MAX_WORKER_THREADS) {
+        console_write(2, command_name);
+        console_line(2, ": --jobs must be between 1 and 256");
         return false;
     }
-    for (u32 iteration = 0u; iteration < 64u; ++iteration) {
-        double mid = (search_low + search_high) * 0.5;
-        if (mid == search_low || mid == search_high) {
+    jobs = (u32)value;
+    *handled = true;
+    return true;
+}
+
+// Runs worker(context) on worker_count threads, the calling thread being one of
+// them. Workers pull their own work items from context; if thread creation
+// fails the remaining work is simply shared by fewer threads.
+static void run_worker_pool(void* (*worker)(void*), void* context, u64 worker_count) {
+    if (worker_count > (u64)MAX_WORKER_THREADS) {
+        worker_count = MAX_WORKER_THREADS;
+    }
+    // Shared lookup tables are filled lazily; populate them before any worker
+    // can race on the first use.
+    makocode::rs_ensure_tables();
+    pthread_t threads[MAX_WORKER_THREADS];
+    u32 started = 0u;
+    for (u64 i = 1u; i < worker_count; ++i) {
+        if (pthread_create(&threads[started], 0, worker, context) != 0) {
             break;
         }
-        if (!evaluate_ecc_fill_candidate(payload_bytes,
-                                          mid,
-                                          mapping,
-                                          footer_config,
-                                          width_pixels,
-                                          height_pixels,
-                                          candidate)) {
-            search_high = mid;
-            continue;
-        }
-        u64 bits_remaining = (candidate.bits_per_page > candidate.frame_bits) ? (candidate.bits_per_page - candidate.frame_bits) : 0u;
-        if (best_ratio < 0.0 ||
-            candidate.page_count < best_page_count ||
-            (candidate.page_count == best_page_count && bits_remaining < best_bits_needed) ||
-            (candidate.page_count == best_page_count && bits_remaining == best_bits_needed && candidate.ratio < best_ratio)) {
-            best_ratio = candidate.ratio;
-            best_block_data = candidate.block_data;
-            best_parity = candidate.parity;
-            best_frame_bits = candidate.frame_bits;
-            best_bits_needed = bits_remaining;
-            best_page_count = candidate.page_count;
-        }
-        if (candidate.page_count <= 1u) {
-            search_low = mid;
-        } else {
-            search_high = mid;
-        }
+        ++started;
+    }
+    worker(context);
+    for (u32 i = 0u; i < started; ++i) {
+        pthread_join(threads[i], 0);
     }
-    return (best_ratio >= 0.0);
 }
 
-static int command_encode(int arg_count, char** args) {
-    if (arguments_request_help(arg_count, args)) {
-        write_encode_help();
-        return 0;
+// Smallest and largest --compression-block sizes, in KiB. Block sizes are
+// stored as u32 byte counts.
+static const u64 MIN_COMPRESSION_BLOCK_KIB = 64u;
+static const u64 MAX_COMPRESSION_BLOCK_KIB = 4194303u;
+
+struct ArchiveRecord {
+    u64 offset;
+    u64 length;
+    const u8* path;
+    u32 path_length;
+};
+
+// Walks a finished MKARCH01 archive and lists every entry's byte range.
+static bool archive_collect_records(const u8* archive,
+                                    usize length,
+                                    ArchiveRecord*& records,
+                                    u32& record_count) {
+    records = 0;
+    record_count = 0u;
+    if (!archive || length < ARCHIVE_HEADER_SIZE) {
+        return false;
     }
-    ImageMappingConfig mapping;
-    PageFooterConfig footer_config;
-    double ecc_redundancy = 0.2;
-    static const usize MAX_INPUT_ITEMS = 512u;
-    const char* input_paths[MAX_INPUT_ITEMS];
-    usize input_count = 0u;
-    makocode::ByteBuffer title_buffer;
-    makocode::ByteBuffer filename_buffer;
-    makocode::ByteBuffer password_buffer;
-    makocode::ByteBuffer output_dir_buffer;
-    makocode::ByteBuffer prefix_buffer;
-    bool have_password = false;
-    const char* output_dir = ".";
-    bool have_output_dir = false;
-    bool have_prefix = false;
-    bool ecc_fill_requested = false;
-    bool compact_page = false;
-    for (int i = 0; i < arg_count; ++i) {
-        bool handled = false;
-        if (!process_image_mapping_option(arg_count, args, &i, mapping, "encode", &handled)) {
-            return 1;
-        }
-        if (handled) {
-            continue;
-        }
-        handled = false;
-        if (!process_fiducial_option(arg_count, args, &i, g_fiducial_defaults, "encode", &handled)) {
-            return 1;
-        }
-        if (handled) {
-            continue;
+    u32 entry_count = read_le_u32(archive + ARCHIVE_MAGIC_SIZE);
+    if (entry_count > 0u) {
+        records = (ArchiveRecord*)malloc((usize)entry_count * sizeof(ArchiveRecord));
+        if (!records) {
+            return false;
         }
-        const char* arg = args[i];
-        if (!arg) {
-            continue;
+    }
+    usize cursor = ARCHIVE_HEADER_SIZE;
+    for (u32 i = 0u; i < entry_count; ++i) {
+        usize start = cursor;
+        if ((length - cursor) < 5u) {
+            break;
         }
-        if (consume_debug_flag(arg)) {
-            continue;
+        u8 entry_type = archive[cursor];
+        u32 path_length = read_le_u32(archive + cursor + 1u);
+        cursor += 5u;
+        if ((length - cursor) < (usize)path_length) {
+            break;
         }
-        const char output_prefix[] = "--output-dir=";
-        const char* output_value = 0;
-        usize output_length = 0u;
-        if (ascii_equals_token(arg, ascii_length(arg), "--output-dir")) {
-            if (have_output_dir) {
-                console_line(2, "encode: output directory specified multiple times");
-                return 1;
-            }
-            if ((i + 1) >= arg_count) {
-                console_line(2, "encode: --output-dir requires a non-empty path");
-                return 1;
-            }
-            output_value = args[i + 1];
-            if (!output_value) {
-                console_line(2, "encode: --output-dir requires a non-empty path");
-                return 1;
+        const u8* path = archive + cursor;
+        cursor += (usize)path_length;
+        if (entry_type == 0u) {
+            if ((length - cursor) < 8u) {
+                break;
             }
-            output_length = ascii_length(output_value);
-            i += 1;
-        } else if (ascii_starts_with(arg, output_prefix)) {
-            if (have_output_dir) {
-                console_line(2, "encode: output directory specified multiple times");
-                return 1;
+            u64 file_size = read_le_u64(archive + cursor);
+            cursor += 8u;
+            if ((u64)(length - cursor) < file_size) {
+                break;
             }
-            output_value = arg + (sizeof(output_prefix) - 1u);
-            output_length = ascii_length(output_value);
+            cursor += (usize)file_size;
+        } else if (entry_type != 1u) {
+            break;
         }
-        if (output_value) {
-            if (output_length == 0u) {
-                console_line(2, "encode: --output-dir requires a non-empty path");
-                return 1;
-            }
-            if (!output_dir_buffer.ensure(output_length + 1u)) {
-                console_line(2, "encode: failed to allocate output directory buffer");
-                return 1;
-            }
-            for (usize j = 0u; j < output_length; ++j) {
-                output_dir_buffer.data[j] = (u8)output_value[j];
-            }
-            output_dir_buffer.data[output_length] = 0u;
-            output_dir_buffer.size = output_length;
-            output_dir = (const char*)output_dir_buffer.data;
-            have_output_dir = true;
-            continue;
+        records[i].offset = (u64)start;
+        records[i].length = (u64)(cursor - start);
+        records[i].path = path;
+        records[i].path_length = path_length;
+        ++record_count;
+    }
+    if (record_count != entry_count || cursor != length) {
+        free(records);
+        records = 0;
+        record_count = 0u;
+        return false;
+    }
+    return true;
+}
+
+struct BlockCompressJob {
+    const u8* input;
+    u64 length;
+    u64 block_bytes;
+    u32 block_count;
+    makocode::CompressionProfile profile;
+    makocode::ByteBuffer* blocks;
+    u32 next_block;
+    bool failed;
+};
+
+static void* block_compress_worker(void* context) {
+    BlockCompressJob& job = *(BlockCompressJob*)context;
+    for (;;) {
+        if (__atomic_load_n(&job.failed, __ATOMIC_RELAXED)) {
+            break;
         }
-        const char prefix_prefix[] = "--prefix=";
-        const char* prefix_value = 0;
-        usize prefix_length = 0u;
-        if (ascii_equals_token(arg, ascii_length(arg), "--prefix")) {
-            if (have_prefix) {
-                console_line(2, "encode: --prefix specified multiple times");
-                return 1;
-            }
-            if ((i + 1) >= arg_count) {
-                console_line(2, "encode: --prefix requires a non-empty value");
-                return 1;
-            }
-            prefix_value = args[i + 1];
-            if (!prefix_value) {
-                console_line(2, "encode: --prefix requires a non-empty value");
-                return 1;
-            }
-            prefix_length = ascii_length(prefix_value);
-            i += 1;
-        } else if (ascii_starts_with(arg, prefix_prefix)) {
-            if (have_prefix) {
-                console_line(2, "encode: --prefix specified multiple times");
-                return 1;
-            }
-            prefix_value = arg + (sizeof(prefix_prefix) - 1u);
-            prefix_length = ascii_length(prefix_value);
+        u32 block = __atomic_fetch_add(&job.next_block, 1u, __ATOMIC_RELAXED);
+        if (block >= job.block_count) {
+            break;
         }
-        if (prefix_value) {
-            if (prefix_length == 0u) {
-                console_line(2, "encode: --prefix requires a non-empty value");
-                return 1;
-            }
-            if (!prefix_buffer.ensure(prefix_length + 1u)) {
-                console_line(2, "encode: failed to allocate prefix buffer");
-                return 1;
-            }
-            for (usize j = 0u; j < prefix_length; ++j) {
-                char c = prefix_value[j];
-                if (c == '/' || c == '\\') {
-                    console_line(2, "encode: --prefix must not contain '/' or '\\\\'");
-                    return 1;
-                }
-                prefix_buffer.data[j] = (u8)c;
-            }
-            prefix_buffer.data[prefix_length] = 0u;
-            prefix_buffer.size = prefix_length;
-            have_prefix = true;
-            continue;
+        u64 offset = (u64)block * job.block_bytes;
+        u64 size = job.length - offset;
+        if (size > job.block_bytes) {
+            size = job.block_bytes;
         }
-        if (ascii_equals_token(arg, ascii_length(arg), "--no-filename")) {
-            footer_config.display_filename = false;
-            continue;
+        if (!makocode::lzma_compress(job.input + offset, (usize)size, job.blocks[block], job.profile)) {
+            __atomic_store_n(&job.failed, true, __ATOMIC_RELAXED);
         }
-        if (ascii_equals_token(arg, ascii_length(arg), "--no-page-count")) {
-            footer_config.display_page_info = false;
-            continue;
+    }
+    return 0;
+}
+
+// Compresses an MKARCH01 archive. With `block_bytes` of zero, or an archive
+// that fits in one block, this is a single lzma_compress stream; otherwise the
+// blocks are compressed on `jobs` threads into the indexed container described
+// at LzmaBlockIndex.
+static bool compress_archive_payload(const u8* archive,
+                                     usize length,
+                                     makocode::CompressionProfile profile,
+                                     u64 block_bytes,
+                                     u32 jobs,
+                                     makocode::ByteBuffer& output) {
+    output.release();
+    if (block_bytes == 0u || (u64)length <= block_bytes) {
+        return makocode::lzma_compress(archive, length, output, profile);
+    }
+    ArchiveRecord* records = 0;
+    u32 record_count = 0u;
+    if (!archive_collect_records(archive, length, records, record_count)) {
+        return false;
+    }
+    u64 block_count64 = ((u64)length + block_bytes - 1u) / block_bytes;
+    if (block_count64 > 0xFFFFFFFFull) {
+        free(records);
+        return false;
+    }
+    u32 block_count = (u32)block_count64;
+    makocode::ByteBuffer* blocks =
+        (makocode::ByteBuffer*)malloc((usize)block_count * sizeof(makocode::ByteBuffer));
+    if (!blocks) {
+        free(records);
+        return false;
+    }
+    memset((void*)blocks, 0, (usize)block_count * sizeof(makocode::ByteBuffer));
+    BlockCompressJob job;
+    job.input = archive;
+    job.length = (u64)length;
+    job.block_bytes = block_bytes;
+    job.block_count = block_count;
+    job.profile = profile;
+    job.blocks = blocks;
+    job.next_block = 0u;
+    job.failed = false;
+    u64 worker_count = (jobs > 0u) ? (u64)jobs : 1u;
+    if (worker_count > (u64)block_count) {
+        worker_count = block_count;
+    }
+    run_worker_pool(block_compress_worker, &job, worker_count);
+    bool ok = !job.failed;
+
+    usize index_bytes = makocode::LZMA_BLOCKS_HEADER_BYTES +
+                        (usize)block_count * makocode::LZMA_BLOCKS_BLOCK_BYTES;
+    for (u32 i = 0u; i < record_count; ++i) {
+        index_bytes += makocode::LZMA_BLOCKS_ENTRY_FIXED_BYTES + (usize)records[i].path_length;
+    }
+    usize total_bytes = index_bytes;
+    for (u32 b = 0u; ok && b < block_count; ++b) {
+        total_bytes += blocks[b].size;
+    }
+    if (ok && output.ensure(total_bytes)) {
+        u8* header = output.data;
+        header[0] = makocode::LZMA_BLOCKS_MARKER;
+        header[1] = makocode::LZMA_BLOCKS_VERSION;
+        header[2] = 0u;
+        header[3] = 0u;
+        header[4] = 0u;
+        write_le_u64(header + LZMA_PROPS_SIZE, (u64)length);
+        write_le_u32(header + makocode::LZMA_HEADER_BYTES, (u32)block_bytes);
+        write_le_u32(header + makocode::LZMA_HEADER_BYTES + 4u, block_count);
+        write_le_u32(header + makocode::LZMA_HEADER_BYTES + 8u, record_count);
+        usize cursor = makocode::LZMA_BLOCKS_HEADER_BYTES;
+        u64 data_offset = 0u;
+        for (u32 b = 0u; b < block_count; ++b) {
+            u64 block_start = (u64)b * block_bytes;
+            u64 block_length = (u64)length - block_start;
+            if (block_length > block_bytes) {
+                block_length = block_bytes;
+            }
+            write_le_u64(output.data + cursor, data_offset);
+            write_le_u64(output.data + cursor + 8u, (u64)blocks[b].size);
+            write_le_u32(output.data + cursor + 16u, (u32)block_length);
+            cursor += makocode::LZMA_BLOCKS_BLOCK_BYTES;
+            data_offset += (u64)blocks[b].size;
+        }
+        for (u32 i = 0u; i < record_count; ++i) {
+            write_le_u64(output.data + cursor, records[i].offset);
+            write_le_u64(output.data + cursor + 8u, records[i].length);
+            write_le_u32(output.data + cursor + 16u, records[i].path_length);
+            cursor += makocode::LZMA_BLOCKS_ENTRY_FIXED_BYTES;
+            memcpy(output.data + cursor, records[i].path, (usize)records[i].path_length);
+            cursor += (usize)records[i].path_length;
+        }
+        for (u32 b = 0u; b < block_count; ++b) {
+            if (blocks[b].size > 0u) {
+                memcpy(output.data + cursor, blocks[b].data, blocks[b].size);
+            }
+            cursor += blocks[b].size;
+        }
+        output.size = cursor;
+    } else {
+        ok = false;
+    }
+    for (u32 b = 0u; b < block_count; ++b) {
+        blocks[b].release();
+    }
+    free(blocks);
+    free(records);
+    return ok;
+}
+
+// Shared, read-only description of a multi-page encode. Workers claim page
+// indices from next_page; every page is rendered and written independently, so
+// the files are identical regardless of how many workers run.
+// `encode --stream` stages. The archive spool is LZMA-compressed (and optionally
+// encrypted) into `payload`, then RS-encoded into a mapped spool. Each stage
+// streams the previous spool through fixed-size chunks and drops it when done.
+// With a block size the archive spool is mapped instead and the block
+// container is assembled in memory before it is written out.
+static bool stream_prepare_payload(SpoolFile& archive_spool,
+                                   const char* spool_dir,
+                                   const makocode::ByteBuffer* password,
+                                   makocode::CompressionProfile compression,
+                                   u64 block_bytes,
+                                   u32 jobs,
+                                   SpoolFile& payload) {
+    u64 archive_size = archive_spool.size;
+    SpoolFile compressed;
+    SpoolFile& compressed_target = password ? compressed : payload;
+    if (!spool_rewind(archive_spool) || !spool_open(compressed_target, spool_dir)) {
+        return false;
+    }
+    u64 compressed_size = 0u;
+    if (block_bytes > 0u && archive_size > block_bytes) {
+        makocode::ByteBuffer container;
+        if (!spool_map(archive_spool, archive_size) ||
+            !compress_archive_payload(archive_spool.map,
+                                      archive_spool.map_size,
+                                      compression,
+                                      block_bytes,
+                                      jobs,
+                                      container) ||
+            !makocode::stream_write_exact(compressed_target.fd, container.data, container.size)) {
+            return false;
+        }
+        compressed_size = (u64)container.size;
+    } else if (!makocode::lzma_compress_fd(archive_spool.fd,
+                                           archive_size,
+                                           compressed_target.fd,
+                                           compressed_size,
+                                           compression)) {
+        return false;
+    }
+    compressed_target.size = compressed_size;
+    archive_spool.release();
+    if (!password) {
+        return true;
+    }
+    if (!spool_rewind(compressed) || !spool_open(payload, spool_dir)) {
+        return false;
+    }
+    u64 encrypted_size = 0u;
+    if (!makocode::encrypt_payload_fd(compressed.fd,
+                                      compressed.size,
+                                      (const char*)password->data,
+                                      password->size,
+                                      payload.fd,
+                                      encrypted_size)) {
+        return false;
+    }
+    payload.size = encrypted_size;
+    return true;
+}
+
+// Produces the same byte stream as EncoderContext::build, leaving it mapped in
+// `stream`/`stream_bytes` (backed by `encoded` or, without ECC, by `payload`).
+static bool stream_build_encoded(SpoolFile& payload,
+                                 double redundancy,
+                                 const char* spool_dir,
+                                 SpoolFile& encoded,
+                                 makocode::EccSummary& summary,
+                                 const u8*& stream,
+                                 usize& stream_bytes) {
+    summary = makocode::EccSummary();
+    stream = 0;
+    stream_bytes = 0u;
+    if (!spool_map(payload, payload.size)) {
+        return false;
+    }
+    if (redundancy > 0.0) {
+        u16 block_data = 0u;
+        u16 parity = 0u;
+        u64 block_count = 0u;
+        if (!makocode::compute_ecc_layout(payload.map_size, redundancy, block_data, parity, block_count)) {
+            return false;
         }
-        if (ascii_equals_token(arg, ascii_length(arg), "--compact-page")) {
-            compact_page = true;
-            continue;
+        u64 total_bytes = (u64)makocode::ECC_HEADER_TOTAL_BYTES + (u64)(block_data + parity) * block_count;
+        if (!spool_open(encoded, spool_dir) || !spool_map(encoded, total_bytes)) {
+            return false;
         }
-        const char ecc_prefix[] = "--ecc=";
-        const char* ecc_value = 0;
-        usize ecc_length = 0u;
-        if (ascii_equals_token(arg, ascii_length(arg), "--ecc")) {
-            if ((i + 1) >= arg_count) {
-                console_line(2, "encode: --ecc requires a numeric value");
-                return 1;
-            }
-            ecc_value = args[i + 1];
+        if (!makocode::encode_payload_with_ecc_into(payload.map,
+                                                    payload.map_size,
+                                                    block_data,
+                                                    parity,
+                                                    block_count,
+                                                    encoded.map,
+                                                    encoded.map_size,
+                                                    summary)) {
+            return false;
+        }
+        payload.release();
+        stream = encoded.map;
+        stream_bytes = encoded.map_size;
+        return true;
+    }
+    if (!makocode::shuffle_encoded_stream(payload.map, payload.map_size, false)) {
+        return false;
+    }
+    summary.original_bytes = payload.map_size;
+    stream = payload.map;
+    stream_bytes = payload.map_size;
+    return true;
+}
+
+// Slices frame bits [first_bit, first_bit + bit_count) out of the frame that
+// build_frame_bits would produce for `stream`. The window starts on the
+// enclosing byte; `window_bit_base` is the frame bit index of its first bit.
+static bool build_stream_frame_window(const u8* stream,
+                                      usize stream_bytes,
+                                      u8 color_channels,
+                                      u64 first_bit,
+                                      u64 bit_count,
+                                      makocode::ByteBuffer& window,
+                                      u64& window_bit_base,
+                                      u64& window_bit_count) {
+    window.release();
+    window_bit_base = 0u;
+    window_bit_count = 0u;
+    if (!stream || stream_bytes == 0u) {
+        return false;
+    }
+    u64 frame_bit_count = 64u + (u64)stream_bytes * 8u;
+    u64 end_bit = (bit_count > frame_bit_count - first_bit || first_bit >= frame_bit_count)
+                      ? frame_bit_count
+                      : first_bit + bit_count;
+    if (first_bit >= end_bit) {
+        return false;
+    }
+    usize first_byte = (usize)(first_bit >> 3u);
+    usize end_byte = (usize)((end_bit + 7u) >> 3u);
+    if (!window.ensure(end_byte - first_byte)) {
+        return false;
+    }
+    u8 header[8];
+    write_le_u64(header, (u64)stream_bytes * 8u);
+    for (usize k = first_byte; k < end_byte; ++k) {
+        u8 byte = (k < 8u) ? header[k] : stream[k - 8u];
+        if (color_channels == 3u) {
+            byte = rotate_left_u8(byte, (u8)((k % 3u) + 1u));
+        }
+        window.data[k - first_byte] = byte;
+    }
+    window.size = end_byte - first_byte;
+    window_bit_base = (u64)first_byte * 8u;
+    window_bit_count = end_bit - window_bit_base;
+    return true;
+}
+
+namespace makocode {
+
+// In-process encode/decode surface. `encode` and `decode` are thin wrappers
+// over it that parse arguments, build or unpack the archive and route pages to
+// files; an embedding service can drive the same pipeline over memory buffers.
+// Process-wide state (Reed-Solomon tables, page geometry caches, fiducial
+// defaults and stats) persists between calls, so repeated jobs in one process
+// skip that warm-up. Failures are reported through console_line, as the
+// commands do.
+
+// Receives each rendered page; `page` is 1-based. With jobs > 1 the pages
+// arrive out of order and from several threads at once. `data` is only valid
+// for the duration of the call.
+struct PageSink {
+    bool (*write_page)(void* context, u64 page, u64 page_count, const u8* data, usize size);
+    void* context;
+
+    PageSink() : write_page(0), context(0) {}
+};
+
+// Supplies the pages of one payload in page order. `open_page` fills `page`,
+// either through input_file_open or by pointing data/size at caller memory.
+// It can run concurrently for different indices, and again for a page that
+// is retried without the fiducial subgrid. `page_names`, when set, labels the
+// pages in diagnostics.
+struct PageSource {
+    bool (*open_page)(void* context, usize index, InputFile& page);
+    void* context;
+    usize page_count;
+    const char* const* page_names;
+
+    PageSource() : open_page(0), context(0), page_count(0u), page_names(0) {}
+};
+
+struct EncodeOptions {
+    ImageMappingConfig mapping;
+    PageFooterConfig footer;
+    double ecc_redundancy;
+    bool ecc_fill;
+    bool compact_page;
+    CompressionProfile compression;
+    u64 compression_block_bytes;
+    u32 jobs;
+    const char* password;
+    usize password_length;
+
+    EncodeOptions()
+        : mapping(),
+          footer(),
+          ecc_redundancy(0.2),
+          ecc_fill(false),
+          compact_page(false),
+          compression(CompressionProfile_Default),
+          compression_block_bytes(0u),
+          jobs(1u),
+          password(0),
+          password_length(0u) {}
+};
+
+// What encode_to_pages settled on. `ecc_redundancy` is the ratio actually
+// used; with ecc_fill the fill_* fields describe the chosen layout. A zero
+// page_count means there was nothing to encode.
+struct EncodeReport {
+    u64 page_count;
+    double ecc_redundancy;
+    bool ecc_filled;
+    u16 fill_block_data;
+    u16 fill_parity;
+    u64 fill_bits_needed;
+    u64 fill_page_count;
+
+    EncodeReport()
+        : page_count(0u),
+          ecc_redundancy(0.0),
+          ecc_filled(false),
+          fill_block_data(0u),
+          fill_parity(0u),
+          fill_bits_needed(0u),
+          fill_page_count(0u) {}
+};
+
+struct DecodeOptions {
+    ImageMappingConfig mapping;
+    const char* password;
+    usize password_length;
+    u32 jobs;
+    // With a block-container payload, only the entries under this archive
+    // path are decompressed into `out` (decode --extract).
+    const char* extract_path;
+    // Test hook: flips parity bytes in the leading ECC header copies.
+    u32 corrupt_header_copies;
+    // Guess the layout of pages whose metadata tile is unreadable
+    // (decode --recover-metadata).
+    bool recover_metadata;
+
+    DecodeOptions()
+        : mapping(),
+          password(0),
+          password_length(0u),
+          jobs(1u),
+          extract_path(0),
+          corrupt_header_copies(0u),
+          recover_metadata(false) {}
+};
+
+struct DecodeReport {
+    EccDecodeStats ecc;
+    u64 page_count;
+    bool subgrid_retried;
+    bool ecc_header_repaired;
+    bool password_ignored;
+    bool ecc_uncorrected;
+    bool metadata_recovered;
+
+    DecodeReport()
+        : ecc(),
+          page_count(0u),
+          subgrid_retried(false),
+          ecc_header_repaired(false),
+          password_ignored(false),
+          ecc_uncorrected(false),
+          metadata_recovered(false) {}
+};
+
+// Compresses `payload` (an archive built with archive_init/archive_add_file/
+// archive_finalize), applies encryption and ECC, and renders every page into
+// `sink`.
+bool encode_to_pages(const ByteBuffer& payload,
+                     const EncodeOptions& options,
+                     PageSink& sink,
+                     EncodeReport& report);
+
+// Extracts, reassembles and decodes the pages of `source`, leaving the
+// recovered archive in `out`.
+bool decode_pages(PageSource& source,
+                  const DecodeOptions& options,
+                  ByteBuffer& out,
+                  DecodeReport& report);
+
+PageSource page_source_from_files(const char* const* paths, usize count);
+PageSource page_source_from_buffers(const ByteBuffer* pages, usize count);
+
+enum PageStreamStatus {
+    PageStream_Page = 0,
+    PageStream_End = 1,
+    PageStream_Error = 2
+};
+
+// Supplies pages in arrival order, for scanners that feed a page every few
+// seconds. `next_page` blocks until the next page is complete and fills `page`
+// as PageSource::open_page does, setting `name` to label it in diagnostics.
+// Errors are reported through console_line before PageStream_Error returns.
+struct PageStream {
+    PageStreamStatus (*next_page)(void* context, InputFile& page, const char*& name);
+    void* context;
+
+    PageStream() : next_page(0), context(0) {}
+};
+
+// Extracts each page of `stream` as it arrives and places it by its page
+// index. With interleaved ECC the payload is decoded as soon as the pages
+// still missing fit within the Reed-Solomon erasure budget, and no further
+// pages are read; otherwise it decodes once every advertised page is present
+// or the stream ends.
+bool decode_page_stream(PageStream& stream,
+                        const DecodeOptions& options,
+                        ByteBuffer& out,
+                        DecodeReport& report);
+
+// YUV4MPEG2 frame container, for film recorders and anything else that wants
+// one sequential stream instead of a file per page. Every page becomes a 4:4:4
+// frame in full-range BT.601 YCbCr, and each FRAME header carries
+// `XMAKOCODE_PAGE=<page>/<count>`. The sink takes P6 pages of one size and
+// writes them to `fd` in page order, holding back pages that arrive early from
+// other jobs; finish reports a page that never arrived.
+struct Y4mPageSink {
+    int fd;
+    u64 page_count;
+    u64 next_page;
+    u32 width;
+    u32 height;
+    // Frames waiting for an earlier page, indexed by page - 1.
+    ByteBuffer* pending;
+    bool failed;
+    pthread_mutex_t lock;
+
+    Y4mPageSink();
+    ~Y4mPageSink();
+};
+
+PageSink page_sink_to_y4m(Y4mPageSink& frames, int fd);
+bool y4m_sink_finish(Y4mPageSink& frames);
+
+// Serves the frames of a YUV4MPEG2 stream in memory as P6 pages. Indexing
+// records where every frame starts, so open_page seeks straight to its frame
+// and can run for several indices at once. `data` must outlive the source;
+// `label` names the frames in diagnostics ("<label> frame N").
+struct Y4mPageSource {
+    const u8* data;
+    usize size;
+    u32 width;
+    u32 height;
+    usize frame_count;
+    // usize offset of each frame's pixels.
+    ByteBuffer frame_offsets;
+    ByteBuffer names;
+    ByteBuffer name_pointers;
+
+    Y4mPageSource()
+        : data(0),
+          size(0u),
+          width(0u),
+          height(0u),
+          frame_count(0u),
+          frame_offsets(),
+          names(),
+          name_pointers() {}
+};
+
+bool is_y4m_stream(const u8* data, usize size);
+bool y4m_source_index(Y4mPageSource& frames, const u8* data, usize size, const char* label);
+PageSource page_source_from_y4m(Y4mPageSource& frames);
+
+} // namespace makocode
+
+struct EncodePageJob {
+    const ImageMappingConfig* mapping;
+    const PageFooterConfig* footer_config;
+    const FooterLayout* footer_layout;
+    const makocode::ByteBuffer* frame_bits;
+    const u8* stream;
+    usize stream_bytes;
+    const makocode::EccSummary* ecc_summary;
+    makocode::PageSink* sink;
+    u64 frame_bit_count;
+    u64 payload_bit_count;
+    u64 bits_per_page;
+    u64 page_count;
+    u32 width_pixels;
+    u32 height_pixels;
+    u64 next_page;
+    bool failed;
+
+    EncodePageJob()
+        : mapping(0),
+          footer_config(0),
+          footer_layout(0),
+          frame_bits(0),
+          stream(0),
+          stream_bytes(0u),
+          ecc_summary(0),
+          sink(0),
+          frame_bit_count(0u),
+          payload_bit_count(0u),
+          bits_per_page(0u),
+          page_count(0u),
+          width_pixels(0u),
+          height_pixels(0u),
+          next_page(0u),
+          failed(false) {}
+};
+
+static bool encode_job_write_page(const EncodePageJob& job,
+                                  u64 page,
+                                  makocode::ByteBuffer& footer_text_buffer,
+                                  makocode::ByteBuffer& page_output,
+                                  EncodePageScratch& scratch) {
+    u64 bit_offset = page * job.bits_per_page;
+    const makocode::ByteBuffer* frame_bits = job.frame_bits;
+    u64 frame_bit_count = job.frame_bit_count;
+    makocode::ByteBuffer window;
+    if (job.stream) {
+        u64 window_base = 0u;
+        if (!build_stream_frame_window(job.stream,
+                                       job.stream_bytes,
+                                       job.mapping->color_channels,
+                                       bit_offset,
+                                       job.bits_per_page,
+                                       window,
+                                       window_base,
+                                       frame_bit_count)) {
+            console_line(2, "encode: failed to slice streamed frame bits");
+            return false;
+        }
+        frame_bits = &window;
+        bit_offset -= window_base;
+    }
+    if (!footer_build_page_text(*job.footer_config, page + 1u, job.page_count, footer_text_buffer)) {
+        console_line(2, "encode: failed to build footer text");
+        return false;
+    }
+    const char* footer_text = job.footer_layout->has_text ? (const char*)footer_text_buffer.data : 0;
+    usize footer_length = job.footer_layout->has_text ? footer_text_buffer.size : 0u;
+    if (!encode_page_to_ppm(*job.mapping,
+                            *frame_bits,
+                            frame_bit_count,
+                            bit_offset,
+                            job.width_pixels,
+                            job.height_pixels,
+                            page + 1u,
+                            job.page_count,
+                            job.bits_per_page,
+                            job.payload_bit_count,
+                            job.ecc_summary,
+                            footer_text,
+                            footer_length,
+                            *job.footer_layout,
+                            page_output,
+                            &scratch)) {
+        console_line(2, "encode: failed to format ppm page");
+        return false;
+    }
+    return job.sink->write_page(job.sink->context, page + 1u, job.page_count, page_output.data, page_output.size);
+}
+
+static void* encode_page_worker(void* context) {
+    EncodePageJob& job = *(EncodePageJob*)context;
+    makocode::ByteBuffer footer_text_buffer;
+    makocode::ByteBuffer page_output;
+    EncodePageScratch scratch;
+    for (;;) {
+        if (__atomic_load_n(&job.failed, __ATOMIC_RELAXED)) {
+            break;
+        }
+        u64 page = __atomic_fetch_add(&job.next_page, (u64)1u, __ATOMIC_RELAXED);
+        if (page >= job.page_count) {
+            break;
+        }
+        if (!encode_job_write_page(job, page, footer_text_buffer, page_output, scratch)) {
+            __atomic_store_n(&job.failed, true, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    return 0;
+}
+
+static bool run_encode_page_job(EncodePageJob& job, u32 max_parallelism) {
+    u64 worker_count = max_parallelism ? (u64)max_parallelism : 1u;
+    if (worker_count > job.page_count) {
+        worker_count = job.page_count;
+    }
+    run_worker_pool(encode_page_worker, &job, worker_count);
+    return !job.failed;
+}
+
+// Builds the custom palette requested with --palette for an encoding command.
+// Custom palettes that exactly match a built-in palette are downgraded to the
+// simpler fixed color modes (avoids palette-digit packing for standard
+// BW/CMYW/RGB pages).
+static bool encode_mapping_prepare_palette(ImageMappingConfig& mapping, const char* command_name) {
+    if (!mapping.palette_set) {
+        return true;
+    }
+    if (!image_mapping_build_custom_palette(mapping, command_name)) {
+        return false;
+    }
+    if (mapping.custom_palette_valid) {
+        auto palette_matches = [&](const PaletteColor* builtin, u32 count) -> bool {
+            if (!builtin || count == 0u || mapping.custom_palette_count != count) {
+                return false;
+            }
+            for (u32 i = 0u; i < count; ++i) {
+                const PaletteColor& a = mapping.custom_palette[i];
+                const PaletteColor& b = builtin[i];
+                if (a.r != b.r || a.g != b.g || a.b != b.b) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        if (palette_matches(PALETTE_GRAY, (u32)(sizeof(PALETTE_GRAY) / sizeof(PALETTE_GRAY[0])))) {
+            mapping.color_channels = 1u;
+            mapping.custom_palette_valid = false;
+        } else if (palette_matches(PALETTE_CMYW, (u32)(sizeof(PALETTE_CMYW) / sizeof(PALETTE_CMYW[0])))) {
+            mapping.color_channels = 2u;
+            mapping.custom_palette_valid = false;
+        } else if (palette_matches(PALETTE_RGB_CMY_WB, (u32)(sizeof(PALETTE_RGB_CMY_WB) / sizeof(PALETTE_RGB_CMY_WB[0])))) {
+            mapping.color_channels = 3u;
+            mapping.custom_palette_valid = false;
+        }
+    }
+    return true;
+}
+
+// Copies the caller's mapping, resolves its palette and derives the page size.
+static bool encode_prepare_mapping(const makocode::EncodeOptions& options,
+                                   ImageMappingConfig& mapping,
+                                   u32& width_pixels,
+                                   u32& height_pixels) {
+    mapping = options.mapping;
+    if (!encode_mapping_prepare_palette(mapping, "encode")) {
+        return false;
+    }
+    if (!compute_page_dimensions(mapping, width_pixels, height_pixels)) {
+        console_line(2, "encode: invalid page dimensions");
+        return false;
+    }
+    return true;
+}
+
+// --ecc-fill: picks the redundancy that best fills the pages a payload of
+// `payload_bytes` (compressed, plus any encryption overhead) occupies. An empty
+// payload leaves report.ecc_filled clear and there is nothing to encode.
+static bool encode_resolve_ecc_fill(usize payload_bytes,
+                                    const makocode::EncodeOptions& options,
+                                    const ImageMappingConfig& mapping,
+                                    u32 width_pixels,
+                                    u32 height_pixels,
+                                    makocode::EncodeReport& report) {
+    if (payload_bytes == 0u) {
+        console_line(2, "encode: payload is empty, ECC fill calculation unnecessary");
+        return true;
+    }
+    u16 frame_block_data = 0u;
+    u16 frame_parity = 0u;
+    u64 frame_block_count = 0u;
+    u64 frame_payload_bits = 0u;
+    u64 frame_bits = 0u;
+    if (!compute_frame_statistics(payload_bytes,
+                                  options.ecc_redundancy,
+                                  frame_block_data,
+                                  frame_parity,
+                                  frame_block_count,
+                                  frame_payload_bits,
+                                  frame_bits)) {
+        console_line(2, "encode: could not compute frame size for ECC fill calculation");
+        return false;
+    }
+    double best_ratio = -1.0;
+    u16 best_block_data = 0u;
+    u16 best_parity = 0u;
+    u64 best_frame_bits = 0u;
+    u64 best_bits_needed = 0u;
+    u64 best_page_count = 0u;
+    if (!find_best_ecc_fill(payload_bytes,
+                            options.ecc_redundancy,
+                            (double)makocode::RS_FIELD_SIZE,
+                            mapping,
+                            options.footer,
+                            width_pixels,
+                            height_pixels,
+                            best_ratio,
+                            best_block_data,
+                            best_parity,
+                            best_frame_bits,
+                            best_bits_needed,
+                            best_page_count)) {
+        console_line(2, "encode: failed to derive ECC fill candidate");
+        return false;
+    }
+    report.ecc_redundancy = best_ratio;
+    report.ecc_filled = true;
+    report.fill_block_data = best_block_data;
+    report.fill_parity = best_parity;
+    report.fill_bits_needed = best_bits_needed;
+    report.fill_page_count = best_page_count;
+    return true;
+}
+
+// Lays the frame out over pages and hands each rendered page to `sink`.
+// `stream` is set for encode --stream; pages then slice their bits from the
+// mapped final stream and `frame_bits` only backs a single-page frame.
+static bool encode_frame_to_pages(const makocode::EncodeOptions& options,
+                                  const ImageMappingConfig& mapping,
+                                  u32 width_pixels,
+                                  u32 height_pixels,
+                                  makocode::ByteBuffer& frame_bits,
+                                  u64 frame_bit_count,
+                                  u64 payload_bit_count,
+                                  const u8* stream,
+                                  usize stream_bytes,
+                                  const makocode::EccSummary* ecc_summary,
+                                  makocode::PageSink& sink,
+                                  makocode::EncodeReport& report) {
+    // compute_page_layout sizes the footer text for the page count it settles on.
+    PageFooterConfig footer_config = options.footer;
+    FooterLayout footer_layout;
+    u32 layout_data_height = height_pixels;
+    u64 bits_per_page = 0u;
+    u64 page_count = 0u;
+    if (!compute_page_layout(mapping,
+                             footer_config,
+                             frame_bit_count,
+                             width_pixels,
+                             height_pixels,
+                             footer_layout,
+                             layout_data_height,
+                             bits_per_page,
+                             page_count)) {
+        console_line(2, "encode: footer layout did not converge");
+        return false;
+    }
+    if (page_count == 1u && stream) {
+        u64 window_base = 0u;
+        u64 window_bits = 0u;
+        if (!build_stream_frame_window(stream,
+                                       stream_bytes,
+                                       mapping.color_channels,
+                                       0u,
+                                       frame_bit_count,
+                                       frame_bits,
+                                       window_base,
+                                       window_bits)) {
+            console_line(2, "encode: failed to build frame");
+            return false;
+        }
+    }
+    if (page_count == 1u) {
+        u32 output_height_pixels = height_pixels;
+        FooterLayout output_footer_layout = footer_layout;
+        u64 output_bits_per_page = bits_per_page;
+
+        if (options.compact_page && footer_layout.has_text) {
+            console_line(2, "encode: --compact-page requires the footer text to be disabled (use --no-filename and --no-page-count, and omit --title)");
+            return false;
+        }
+
+        // For single-page outputs with no footer text, allow the footer band to
+        // collapse to the minimum height needed for payload data.
+        if (options.compact_page && !footer_layout.has_text && layout_data_height > 0u) {
+            double bits_per_pixel = mapping_bits_per_data_pixel(mapping);
+            if (bits_per_pixel > 0.0) {
+                u32 max_data_height = layout_data_height;
+                u32 stripe_height = footer_layout.stripe_height_pixels;
+                u32 stripe_limited = (height_pixels > stripe_height) ? (height_pixels - stripe_height) : 0u;
+                if (stripe_limited > 0u && stripe_limited < max_data_height) {
+                    max_data_height = stripe_limited;
+                }
+                if (max_data_height > 0u) {
+                    u32 low = 1u;
+                    u32 high = max_data_height;
+                    u32 best = max_data_height;
+                    u64 best_bits = 0u;
+                    while (low <= high) {
+                        u32 mid = low + (high - low) / 2u;
+                        u64 candidate_bits = 0u;
+                        if (compute_bits_per_page(width_pixels,
+                                                  height_pixels,
+                                                  mid,
+                                                  bits_per_pixel,
+                                                  candidate_bits,
+                                                  0) &&
+                            candidate_bits >= frame_bit_count) {
+                            best = mid;
+                            best_bits = candidate_bits;
+                            if (mid == 1u) {
+                                break;
+                            }
+                            high = mid - 1u;
+                        } else {
+                            low = mid + 1u;
+                        }
+                    }
+                    // Only apply if it meaningfully reduces the unused band.
+                    if (best_bits > 0u && best + 4u < layout_data_height) {
+                        u32 minimal_height = best + stripe_height;
+                        if (minimal_height >= best && minimal_height <= height_pixels) {
+                            output_height_pixels = minimal_height;
+                        }
+                        output_footer_layout.data_height_pixels = best;
+                        output_footer_layout.stripe_top_row = best;
+                        output_footer_layout.footer_height_pixels = stripe_height;
+                        // Bits-per-page depends on data_height; keep it consistent with
+                        // the chosen data height even when we shrink the output image.
+                        output_bits_per_page = best_bits;
+                    }
+                }
+            }
+        }
+        makocode::ByteBuffer footer_text_buffer;
+        makocode::ByteBuffer page_output;
+        if (!footer_build_page_text(footer_config, 1u, page_count, footer_text_buffer)) {
+            console_line(2, "encode: failed to build footer text");
+            return false;
+        }
+        const char* footer_text = output_footer_layout.has_text ? (const char*)footer_text_buffer.data : 0;
+        usize footer_length = output_footer_layout.has_text ? footer_text_buffer.size : 0u;
+        if (!encode_page_to_ppm(mapping,
+                                frame_bits,
+                                frame_bit_count,
+                                0u,
+                                width_pixels,
+                                output_height_pixels,
+                                1u,
+                                1u,
+                                output_bits_per_page,
+                                payload_bit_count,
+                                ecc_summary,
+                                footer_text,
+                                footer_length,
+                                output_footer_layout,
+                                page_output)) {
+            console_line(2, "encode: failed to format ppm");
+            return false;
+        }
+        if (!sink.write_page(sink.context, 1u, 1u, page_output.data, page_output.size)) {
+            return false;
+        }
+    } else {
+        EncodePageJob job;
+        job.mapping = &mapping;
+        job.footer_config = &footer_config;
+        job.footer_layout = &footer_layout;
+        job.frame_bits = &frame_bits;
+        job.stream = stream;
+        job.stream_bytes = stream_bytes;
+        job.ecc_summary = ecc_summary;
+        job.sink = &sink;
+        job.frame_bit_count = frame_bit_count;
+        job.payload_bit_count = payload_bit_count;
+        job.bits_per_page = bits_per_page;
+        job.page_count = page_count;
+        job.width_pixels = width_pixels;
+        job.height_pixels = height_pixels;
+        if (!run_encode_page_job(job, options.jobs)) {
+            return false;
+        }
+    }
+    report.page_count = page_count;
+    return true;
+}
+
+bool makocode::encode_to_pages(const ByteBuffer& payload,
+                               const EncodeOptions& options,
+                               PageSink& sink,
+                               EncodeReport& report) {
+    report = EncodeReport();
+    report.ecc_redundancy = options.ecc_redundancy;
+    ImageMappingConfig mapping;
+    u32 width_pixels = 0u;
+    u32 height_pixels = 0u;
+    if (!encode_prepare_mapping(options, mapping, width_pixels, height_pixels)) {
+        return false;
+    }
+    ByteBuffer compressed_payload;
+    if (!compress_archive_payload(payload.data,
+                                  payload.size,
+                                  options.compression,
+                                  options.compression_block_bytes,
+                                  options.jobs,
+                                  compressed_payload)) {
+        console_line(2, "encode: failed to compress payload");
+        return false;
+    }
+    if (options.ecc_fill) {
+        usize payload_bytes = compressed_payload.size;
+        if (options.password) {
+            usize overhead = ENCRYPTION_HEADER_BYTES + ENCRYPTION_TAG_BYTES;
+            if (payload_bytes > USIZE_MAX_VALUE - overhead) {
+                console_line(2, "encode: payload size overflow while estimating ECC fill");
+                return false;
+            }
+            payload_bytes += overhead;
+        }
+        if (!encode_resolve_ecc_fill(payload_bytes, options, mapping, width_pixels, height_pixels, report)) {
+            return false;
+        }
+        if (!report.ecc_filled) {
+            return true;
+        }
+    }
+    EncoderContext encoder;
+    encoder.config.ecc_redundancy = report.ecc_redundancy;
+    encoder.config.max_parallelism = options.jobs;
+    encoder.config.compression = options.compression;
+    if (options.password) {
+        if (!encoder.set_password(options.password, options.password_length)) {
+            console_line(2, "encode: failed to set encryption password");
+            return false;
+        }
+    }
+    encoder.adopt_compressed_payload(compressed_payload);
+    if (!encoder.build()) {
+        console_line(2, "encode: build failed");
+        return false;
+    }
+    ByteBuffer frame_bits;
+    u64 frame_bit_count = 0u;
+    u64 payload_bit_count = 0u;
+    if (!build_frame_bits(encoder, mapping, frame_bits, frame_bit_count, payload_bit_count)) {
+        console_line(2, "encode: failed to build frame");
+        return false;
+    }
+    return encode_frame_to_pages(options,
+                                 mapping,
+                                 width_pixels,
+                                 height_pixels,
+                                 frame_bits,
+                                 frame_bit_count,
+                                 payload_bit_count,
+                                 0,
+                                 0u,
+                                 &encoder.ecc_info(),
+                                 sink,
+                                 report);
+}
+
+// Outcome of scanning for a page or frame in bytes that may still be arriving.
+enum PpmScanStatus {
+    PpmScan_Complete = 0,
+    PpmScan_NeedMore = 1,
+    PpmScan_Invalid = 2
+};
+
+// YUV4MPEG2 streams (encode --y4m, Y4M input to decode). Only 4:4:4 frames are
+// used: subsampled chroma would smear the one-pixel cells of a page.
+static const char Y4M_STREAM_MAGIC[] = "YUV4MPEG2 ";
+static const char Y4M_FRAME_MAGIC[] = "FRAME";
+// Header lines longer than this are treated as garbage rather than scanned.
+static const usize Y4M_MAX_LINE_BYTES = 4096u;
+
+static u8 y4m_clamp_u8(int value) {
+    if (value < 0) {
+        return 0u;
+    }
+    if (value > 255) {
+        return 255u;
+    }
+    return (u8)value;
+}
+
+// Full-range BT.601 in 16.16 fixed point. The palette colours come back within
+// one step per channel, far inside the tolerance that scanned pages need.
+static void y4m_planes_from_rgb(const u8* rgb, usize pixel_count, u8* planes) {
+    u8* y_plane = planes;
+    u8* cb_plane = planes + pixel_count;
+    u8* cr_plane = planes + pixel_count * 2u;
+    for (usize i = 0u; i < pixel_count; ++i) {
+        int r = (int)rgb[i * 3u];
+        int g = (int)rgb[i * 3u + 1u];
+        int b = (int)rgb[i * 3u + 2u];
+        y_plane[i] = y4m_clamp_u8((19595 * r + 38470 * g + 7471 * b + 32768) >> 16);
+        cb_plane[i] = y4m_clamp_u8((-11059 * r - 21709 * g + 32768 * b + 8421376) >> 16);
+        cr_plane[i] = y4m_clamp_u8((32768 * r - 27439 * g - 5329 * b + 8421376) >> 16);
+    }
+}
+
+static void y4m_rgb_from_planes(const u8* planes, usize pixel_count, u8* rgb) {
+    const u8* y_plane = planes;
+    const u8* cb_plane = planes + pixel_count;
+    const u8* cr_plane = planes + pixel_count * 2u;
+    for (usize i = 0u; i < pixel_count; ++i) {
+        int y = (int)y_plane[i];
+        int cb = (int)cb_plane[i] - 128;
+        int cr = (int)cr_plane[i] - 128;
+        rgb[i * 3u] = y4m_clamp_u8(y + ((91881 * cr + 32768) >> 16));
+        rgb[i * 3u + 1u] = y4m_clamp_u8(y + ((-22554 * cb - 46802 * cr + 32768) >> 16));
+        rgb[i * 3u + 2u] = y4m_clamp_u8(y + ((116130 * cb + 32768) >> 16));
+    }
+}
+
+// Parses the stream header up to its newline. The colour space defaults to
+// 4:2:0 when the C tag is absent, so it has to be present and say 444.
+static PpmScanStatus y4m_scan_stream_header(const u8* data,
+                                            usize size,
+                                            bool at_end,
+                                            u32& width,
+                                            u32& height,
+                                            usize& header_bytes) {
+    usize magic_length = (usize)(sizeof(Y4M_STREAM_MAGIC) - 1u);
+    usize line_end = 0u;
+    while (line_end < size && data[line_end] != '\n') {
+        ++line_end;
+    }
+    if (line_end >= size) {
+        return (at_end || size > Y4M_MAX_LINE_BYTES) ? PpmScan_Invalid : PpmScan_NeedMore;
+    }
+    if (line_end < magic_length || memcmp(data, Y4M_STREAM_MAGIC, magic_length) != 0) {
+        return PpmScan_Invalid;
+    }
+    u64 width_value = 0u;
+    u64 height_value = 0u;
+    bool chroma_444 = false;
+    usize cursor = magic_length;
+    while (cursor < line_end) {
+        while (cursor < line_end && data[cursor] == ' ') {
+            ++cursor;
+        }
+        usize token_start = cursor;
+        while (cursor < line_end && data[cursor] != ' ') {
+            ++cursor;
+        }
+        if (cursor == token_start) {
+            break;
+        }
+        const char* value = (const char*)data + token_start + 1u;
+        usize value_length = cursor - token_start - 1u;
+        switch (data[token_start]) {
+            case 'W':
+                if (!ascii_to_u64(value, value_length, &width_value)) {
+                    return PpmScan_Invalid;
+                }
+                break;
+            case 'H':
+                if (!ascii_to_u64(value, value_length, &height_value)) {
+                    return PpmScan_Invalid;
+                }
+                break;
+            case 'C':
+                chroma_444 = ascii_equals_token(value, value_length, "444");
+                break;
+            default:
+                break;
+        }
+    }
+    if (!chroma_444 || width_value == 0u || height_value == 0u ||
+        width_value > (u64)0xFFFFFFFFu || height_value > (u64)0xFFFFFFFFu ||
+        width_value * height_value > (u64)(USIZE_MAX_VALUE / 4u)) {
+        return PpmScan_Invalid;
+    }
+    width = (u32)width_value;
+    height = (u32)height_value;
+    header_bytes = line_end + 1u;
+    return PpmScan_Complete;
+}
+
+// Locates one frame: its FRAME line (any parameters are skipped) and the three
+// planes after it. `pixels_offset` and `extent` are relative to `data`.
+static PpmScanStatus y4m_scan_frame(const u8* data,
+                                    usize size,
+                                    bool at_end,
+                                    u32 width,
+                                    u32 height,
+                                    usize& pixels_offset,
+                                    usize& extent) {
+    usize magic_length = (usize)(sizeof(Y4M_FRAME_MAGIC) - 1u);
+    usize compare_length = (size < magic_length) ? size : magic_length;
+    if (memcmp(data, Y4M_FRAME_MAGIC, compare_length) != 0) {
+        return PpmScan_Invalid;
+    }
+    usize line_end = magic_length;
+    while (line_end < size && data[line_end] != '\n') {
+        ++line_end;
+    }
+    if (line_end >= size) {
+        return (at_end || size > Y4M_MAX_LINE_BYTES) ? PpmScan_Invalid : PpmScan_NeedMore;
+    }
+    if (line_end > magic_length && data[magic_length] != ' ') {
+        return PpmScan_Invalid;
+    }
+    usize plane_bytes = (usize)width * (usize)height;
+    pixels_offset = line_end + 1u;
+    extent = pixels_offset + plane_bytes * 3u;
+    if (size < extent) {
+        return at_end ? PpmScan_Invalid : PpmScan_NeedMore;
+    }
+    return PpmScan_Complete;
+}
+
+// Rebuilds the P6 page a frame was made from, in page.fallback.
+static bool y4m_frame_to_page(const u8* planes, u32 width, u32 height, InputFile& page) {
+    StatsTimer stats_timer(StatsStage_PageParse);
+    page.release();
+    char header[64];
+    usize header_length = 0u;
+    char digits[32];
+    header[header_length++] = 'P';
+    header[header_length++] = '6';
+    header[header_length++] = '\n';
+    u64_to_ascii(width, digits, sizeof(digits));
+    for (usize i = 0u; digits[i]; ++i) {
+        header[header_length++] = digits[i];
+    }
+    header[header_length++] = ' ';
+    u64_to_ascii(height, digits, sizeof(digits));
+    for (usize i = 0u; digits[i]; ++i) {
+        header[header_length++] = digits[i];
+    }
+    memcpy(header + header_length, "\n255\n", 5u);
+    header_length += 5u;
+    usize pixel_count = (usize)width * (usize)height;
+    if (!page.fallback.ensure(header_length + pixel_count * 3u)) {
+        console_line(2, "decode: failed to allocate page buffer");
+        return false;
+    }
+    memcpy(page.fallback.data, header, header_length);
+    y4m_rgb_from_planes(planes, pixel_count, page.fallback.data + header_length);
+    page.fallback.size = header_length + pixel_count * 3u;
+    page.data = page.fallback.data;
+    page.size = page.fallback.size;
+    return true;
+}
+
+// Width, height and raster of a P6 page with a maximum value of 255.
+static bool ppm_binary_raster(const u8* data, usize size, u32& width, u32& height, const u8*& raster) {
+    PpmParserState state;
+    state.data = data;
+    state.size = size;
+    const char* token = 0;
+    usize token_length = 0u;
+    if (!ppm_next_token(state, &token, &token_length) ||
+        !ppm_accept_magic(state, token, token_length) ||
+        !state.binary_pixels) {
+        return false;
+    }
+    u64 header_values[3] = {0u, 0u, 0u};
+    for (u32 i = 0u; i < 3u; ++i) {
+        if (!ppm_next_token(state, &token, &token_length) ||
+            !ascii_to_u64(token, token_length, &header_values[i])) {
+            return false;
+        }
+    }
+    if (header_values[0] == 0u || header_values[1] == 0u || header_values[2] != 255u ||
+        header_values[0] > (u64)0xFFFFFFFFu || header_values[1] > (u64)0xFFFFFFFFu) {
+        return false;
+    }
+    u64 raster_bytes = header_values[0] * header_values[1] * 3u;
+    if (state.cursor >= size || raster_bytes > (u64)(size - state.cursor - 1u)) {
+        return false;
+    }
+    width = (u32)header_values[0];
+    height = (u32)header_values[1];
+    raster = data + state.cursor + 1u;
+    return true;
+}
+
+static bool y4m_append_number(makocode::ByteBuffer& buffer, u64 value, u32 min_digits) {
+    char digits[32];
+    u64_to_ascii(value, digits, sizeof(digits));
+    for (usize length = ascii_length(digits); length < (usize)min_digits; ++length) {
+        if (!buffer.append_char('0')) {
+            return false;
+        }
+    }
+    return buffer.append_ascii(digits);
+}
+
+// Page numbers are zero-padded to the width of the count, so every frame of a
+// stream has the same size.
+static bool y4m_build_frame(const u8* raster,
+                            u32 width,
+                            u32 height,
+                            u64 page,
+                            u64 page_count,
+                            makocode::ByteBuffer& frame) {
+    char count_digits[32];
+    u64_to_ascii(page_count, count_digits, sizeof(count_digits));
+    usize pixel_count = (usize)width * (usize)height;
+    if (!frame.ensure(64u + pixel_count * 3u) ||
+        !frame.append_ascii("FRAME XMAKOCODE_PAGE=") ||
+        !y4m_append_number(frame, page, (u32)ascii_length(count_digits)) ||
+        !frame.append_char('/') ||
+        !frame.append_ascii(count_digits) ||
+        !frame.append_char('\n')) {
+        return false;
+    }
+    y4m_planes_from_rgb(raster, pixel_count, frame.data + frame.size);
+    frame.size += pixel_count * 3u;
+    return true;
+}
+
+static bool y4m_sink_write(makocode::Y4mPageSink& frames, const u8* data, usize size) {
+    StatsTimer stats_timer(StatsStage_Write);
+    if (!write_all_fd(frames.fd, data, size)) {
+        console_line(2, "encode: failed to write y4m stream");
+        frames.failed = true;
+        return false;
+    }
+    stats_count(StatsCounter_BytesWritten, (u64)size);
+    return true;
+}
+
+// Called with the sink locked. The first page to arrive sizes the stream and
+// writes its header; frames then go out strictly in page order.
+static bool y4m_sink_accept(makocode::Y4mPageSink& frames,
+                            u64 page,
+                            u64 page_count,
+                            u32 width,
+                            u32 height,
+                            makocode::ByteBuffer& frame) {
+    if (frames.failed) {
+        return false;
+    }
+    if (!frames.pending) {
+        frames.pending = (makocode::ByteBuffer*)malloc((usize)page_count * sizeof(makocode::ByteBuffer));
+        if (!frames.pending) {
+            console_line(2, "encode: failed to allocate y4m frame queue");
+            frames.failed = true;
+            return false;
+        }
+        memset((void*)frames.pending, 0, (usize)page_count * sizeof(makocode::ByteBuffer));
+        frames.page_count = page_count;
+        frames.next_page = 1u;
+        frames.width = width;
+        frames.height = height;
+        makocode::ByteBuffer header;
+        if (!header.append_ascii(Y4M_STREAM_MAGIC) ||
+            !header.append_char('W') ||
+            !y4m_append_number(header, width, 1u) ||
+            !header.append_ascii(" H") ||
+            !y4m_append_number(header, height, 1u) ||
+            !header.append_ascii(" F1:1 Ip A1:1 C444 XCOLORRANGE=FULL XMAKOCODE_PAGES=") ||
+            !y4m_append_number(header, page_count, 1u) ||
+            !header.append_char('\n')) {
+            console_line(2, "encode: failed to allocate y4m header");
+            frames.failed = true;
+            return false;
+        }
+        if (!y4m_sink_write(frames, header.data, header.size)) {
+            return false;
+        }
+    }
+    if (width != frames.width || height != frames.height || page_count != frames.page_count ||
+        page == 0u || page > frames.page_count) {
+        console_line(2, "encode: --y4m needs every page to be the same size");
+        frames.failed = true;
+        return false;
+    }
+    if (page != frames.next_page) {
+        makocode::ByteBuffer& slot = frames.pending[page - 1u];
+        slot.data = frame.data;
+        slot.size = frame.size;
+        slot.capacity = frame.capacity;
+        frame.data = 0;
+        frame.size = 0u;
+        frame.capacity = 0u;
+        return true;
+    }
+    if (!y4m_sink_write(frames, frame.data, frame.size)) {
+        return false;
+    }
+    ++frames.next_page;
+    while (frames.next_page <= frames.page_count && frames.pending[frames.next_page - 1u].data) {
+        makocode::ByteBuffer& slot = frames.pending[frames.next_page - 1u];
+        if (!y4m_sink_write(frames, slot.data, slot.size)) {
+            return false;
+        }
+        slot.release();
+        ++frames.next_page;
+    }
+    return true;
+}
+
+static bool y4m_sink_write_page(void* context, u64 page, u64 page_count, const u8* data, usize size) {
+    makocode::Y4mPageSink& frames = *(makocode::Y4mPageSink*)context;
+    u32 width = 0u;
+    u32 height = 0u;
+    const u8* raster = 0;
+    if (!ppm_binary_raster(data, size, width, height, raster)) {
+        console_line(2, "encode: --y4m needs binary P6 pages");
+        return false;
+    }
+    makocode::ByteBuffer frame;
+    if (!y4m_build_frame(raster, width, height, page, page_count, frame)) {
+        console_line(2, "encode: failed to allocate y4m frame");
+        return false;
+    }
+    pthread_mutex_lock(&frames.lock);
+    bool accepted = y4m_sink_accept(frames, page, page_count, width, height, frame);
+    pthread_mutex_unlock(&frames.lock);
+    return accepted;
+}
+
+makocode::Y4mPageSink::Y4mPageSink()
+    : fd(-1),
+      page_count(0u),
+      next_page(0u),
+      width(0u),
+      height(0u),
+      pending(0),
+      failed(false) {
+    pthread_mutex_init(&lock, 0);
+}
+
+makocode::Y4mPageSink::~Y4mPageSink() {
+    if (pending) {
+        for (u64 i = 0u; i < page_count; ++i) {
+            pending[i].release();
+        }
+        free((void*)pending);
+    }
+    pthread_mutex_destroy(&lock);
+}
+
+makocode::PageSink makocode::page_sink_to_y4m(Y4mPageSink& frames, int fd) {
+    frames.fd = fd;
+    PageSink sink;
+    sink.write_page = y4m_sink_write_page;
+    sink.context = &frames;
+    return sink;
+}
+
+bool makocode::y4m_sink_finish(Y4mPageSink& frames) {
+    if (frames.failed) {
+        return false;
+    }
+    if (frames.pending && frames.next_page <= frames.page_count) {
+        char page_buffer[32];
+        u64_to_ascii(frames.next_page, page_buffer, sizeof(page_buffer));
+        console_write(2, "encode: y4m stream is missing page ");
+        console_line(2, page_buffer);
+        return false;
+    }
+    return true;
+}
+
+// Page sink behind `encode`: each page goes to output_dir under the name
+// build_page_filename gives it.
+struct EncodeFileSink {
+    const char* output_dir;
+    const char* page_name_prefix;
+};
+
+static bool encode_file_sink_write_page(void* context, u64 page, u64 page_count, const u8* data, usize size) {
+    const EncodeFileSink& files = *(const EncodeFileSink*)context;
+    makocode::ByteBuffer name_buffer;
+    makocode::ByteBuffer path_buffer;
+    if (!build_page_filename(name_buffer, files.page_name_prefix, page, page_count)) {
+        console_line(2, "encode: failed to build filename");
+        return false;
+    }
+    if (!join_output_path(files.output_dir, (const char*)name_buffer.data, path_buffer)) {
+        console_line(2, "encode: failed to prepare output path");
+        return false;
+    }
+    if (!ensure_parent_directories((const char*)path_buffer.data)) {
+        console_line(2, "encode: failed to prepare output directories");
+        return false;
+    }
+    if (!write_bytes_to_file((const char*)path_buffer.data, data, size)) {
+        console_line(2, "encode: failed to write ppm file");
+        return false;
+    }
+    return true;
+}
+
+// encode --stream counterpart of encode_to_pages. The archive is already in a
+// spool, and the compressed, encrypted and ECC stages spool into `spool_dir`.
+static bool encode_streamed_archive(SpoolFile& archive_spool,
+                                    const char* spool_dir,
+                                    const makocode::ByteBuffer* password,
+                                    const makocode::EncodeOptions& options,
+                                    makocode::PageSink& sink,
+                                    makocode::EncodeReport& report) {
+    report = makocode::EncodeReport();
+    report.ecc_redundancy = options.ecc_redundancy;
+    ImageMappingConfig mapping;
+    u32 width_pixels = 0u;
+    u32 height_pixels = 0u;
+    if (!encode_prepare_mapping(options, mapping, width_pixels, height_pixels)) {
+        return false;
+    }
+    SpoolFile payload_spool;
+    if (!stream_prepare_payload(archive_spool,
+                                spool_dir,
+                                password,
+                                options.compression,
+                                options.compression_block_bytes,
+                                options.jobs,
+                                payload_spool)) {
+        console_line(2, "encode: failed to compress streamed payload");
+        return false;
+    }
+    if (options.ecc_fill) {
+        if (!encode_resolve_ecc_fill((usize)payload_spool.size, options, mapping, width_pixels, height_pixels, report)) {
+            return false;
+        }
+        if (!report.ecc_filled) {
+            return true;
+        }
+    }
+    SpoolFile encoded_spool;
+    makocode::EccSummary stream_summary;
+    const u8* stream = 0;
+    usize stream_bytes = 0u;
+    if (!stream_build_encoded(payload_spool,
+                              (report.ecc_redundancy > 0.0) ? report.ecc_redundancy : 0.0,
+                              spool_dir,
+                              encoded_spool,
+                              stream_summary,
+                              stream,
+                              stream_bytes)) {
+        console_line(2, "encode: build failed");
+        return false;
+    }
+    // Frame bits are sliced per page from the mapped stream.
+    u64 payload_bit_count = (u64)stream_bytes * 8u;
+    makocode::ByteBuffer frame_bits;
+    return encode_frame_to_pages(options,
+                                 mapping,
+                                 width_pixels,
+                                 height_pixels,
+                                 frame_bits,
+                                 64u + payload_bit_count,
+                                 payload_bit_count,
+                                 stream,
+                                 stream_bytes,
+                                 &stream_summary,
+                                 sink,
+                                 report);
+}
+
+static int command_encode(int arg_count, char** args) {
+    if (arguments_request_help(arg_count, args)) {
+        write_encode_help();
+        return 0;
+    }
+    ImageMappingConfig mapping;
+    PageFooterConfig footer_config;
+    double ecc_redundancy = 0.2;
+    static const usize MAX_INPUT_ITEMS = 512u;
+    const char* input_paths[MAX_INPUT_ITEMS];
+    usize input_count = 0u;
+    makocode::ByteBuffer title_buffer;
+    makocode::ByteBuffer filename_buffer;
+    makocode::ByteBuffer password_buffer;
+    makocode::ByteBuffer output_dir_buffer;
+    makocode::ByteBuffer prefix_buffer;
+    bool have_password = false;
+    const char* output_dir = ".";
+    bool have_output_dir = false;
+    bool have_prefix = false;
+    bool ecc_fill_requested = false;
+    bool compact_page = false;
+    bool stream_encode = false;
+    const char* y4m_path = 0;
+    u32 encode_jobs = 1u;
+    makocode::CompressionProfile compression = makocode::CompressionProfile_Default;
+    u64 compression_block_bytes = 0u;
+    for (int i = 0; i < arg_count; ++i) {
+        bool handled = false;
+        if (!process_image_mapping_option(arg_count, args, &i, mapping, "encode", &handled)) {
+            return 1;
+        }
+        if (handled) {
+            continue;
+        }
+        if (!process_ppm_format_option(arg_count, args, &i, mapping, "encode", &handled)) {
+            return 1;
+        }
+        if (handled) {
+            continue;
+        }
+        handled = false;
+        if (!process_fiducial_option(arg_count, args, &i, g_fiducial_defaults, "encode", &handled)) {
+            return 1;
+        }
+        if (handled) {
+            continue;
+        }
+        handled = false;
+        if (!process_jobs_option(arg_count, args, &i, encode_jobs, "encode", &handled)) {
+            return 1;
+        }
+        if (handled) {
+            continue;
+        }
+        const char* arg = args[i];
+        if (!arg) {
+            continue;
+        }
+        if (consume_debug_flag(arg)) {
+            continue;
+        }
+        if (consume_stats_flag(arg)) {
+            continue;
+        }
+        const char output_prefix[] = "--output-dir=";
+        const char* output_value = 0;
+        usize output_length = 0u;
+        if (ascii_equals_token(arg, ascii_length(arg), "--output-dir")) {
+            if (have_output_dir) {
+                console_line(2, "encode: output directory specified multiple times");
+                return 1;
+            }
+            if ((i + 1) >= arg_count) {
+                console_line(2, "encode: --output-dir requires a non-empty path");
+                return 1;
+            }
+            output_value = args[i + 1];
+            if (!output_value) {
+                console_line(2, "encode: --output-dir requires a non-empty path");
+                return 1;
+            }
+            output_length = ascii_length(output_value);
+            i += 1;
+        } else if (ascii_starts_with(arg, output_prefix)) {
+            if (have_output_dir) {
+                console_line(2, "encode: output directory specified multiple times");
+                return 1;
+            }
+            output_value = arg + (sizeof(output_prefix) - 1u);
+            output_length = ascii_length(output_value);
+        }
+        if (output_value) {
+            if (output_length == 0u) {
+                console_line(2, "encode: --output-dir requires a non-empty path");
+                return 1;
+            }
+            if (!output_dir_buffer.ensure(output_length + 1u)) {
+                console_line(2, "encode: failed to allocate output directory buffer");
+                return 1;
+            }
+            for (usize j = 0u; j < output_length; ++j) {
+                output_dir_buffer.data[j] = (u8)output_value[j];
+            }
+            output_dir_buffer.data[output_length] = 0u;
+            output_dir_buffer.size = output_length;
+            output_dir = (const char*)output_dir_buffer.data;
+            have_output_dir = true;
+            continue;
+        }
+        const char prefix_prefix[] = "--prefix=";
+        const char* prefix_value = 0;
+        usize prefix_length = 0u;
+        if (ascii_equals_token(arg, ascii_length(arg), "--prefix")) {
+            if (have_prefix) {
+                console_line(2, "encode: --prefix specified multiple times");
+                return 1;
+            }
+            if ((i + 1) >= arg_count) {
+                console_line(2, "encode: --prefix requires a non-empty value");
+                return 1;
+            }
+            prefix_value = args[i + 1];
+            if (!prefix_value) {
+                console_line(2, "encode: --prefix requires a non-empty value");
+                return 1;
+            }
+            prefix_length = ascii_length(prefix_value);
+            i += 1;
+        } else if (ascii_starts_with(arg, prefix_prefix)) {
+            if (have_prefix) {
+                console_line(2, "encode: --prefix specified multiple times");
+                return 1;
+            }
+            prefix_value = arg + (sizeof(prefix_prefix) - 1u);
+            prefix_length = ascii_length(prefix_value);
+        }
+        if (prefix_value) {
+            if (prefix_length == 0u) {
+                console_line(2, "encode: --prefix requires a non-empty value");
+                return 1;
+            }
+            if (!prefix_buffer.ensure(prefix_length + 1u)) {
+                console_line(2, "encode: failed to allocate prefix buffer");
+                return 1;
+            }
+            for (usize j = 0u; j < prefix_length; ++j) {
+                char c = prefix_value[j];
+                if (c == '/' || c == '\\') {
+                    console_line(2, "encode: --prefix must not contain '/' or '\\\\'");
+                    return 1;
+                }
+                prefix_buffer.data[j] = (u8)c;
+            }
+            prefix_buffer.data[prefix_length] = 0u;
+            prefix_buffer.size = prefix_length;
+            have_prefix = true;
+            continue;
+        }
+        if (ascii_equals_token(arg, ascii_length(arg), "--no-filename")) {
+            footer_config.display_filename = false;
+            continue;
+        }
+        if (ascii_equals_token(arg, ascii_length(arg), "--no-page-count")) {
+            footer_config.display_page_info = false;
+            continue;
+        }
+        if (ascii_equals_token(arg, ascii_length(arg), "--compact-page")) {
+            compact_page = true;
+            continue;
+        }
+        if (ascii_equals_token(arg, ascii_length(arg), "--stream")) {
+            stream_encode = true;
+            continue;
+        }
+        const char y4m_prefix[] = "--y4m=";
+        const char* y4m_value = 0;
+        if (ascii_equals_token(arg, ascii_length(arg), "--y4m")) {
+            if ((i + 1) >= arg_count || !args[i + 1]) {
+                console_line(2, "encode: --y4m requires a path (or - for stdout)");
+                return 1;
+            }
+            y4m_value = args[i + 1];
+            i += 1;
+        } else if (ascii_starts_with(arg, y4m_prefix)) {
+            y4m_value = arg + (sizeof(y4m_prefix) - 1u);
+        }
+        if (y4m_value) {
+            if (y4m_value[0] == '\0') {
+                console_line(2, "encode: --y4m requires a path (or - for stdout)");
+                return 1;
+            }
+            y4m_path = y4m_value;
+            continue;
+        }
+        const char compression_prefix[] = "--compression=";
+        const char* compression_value = 0;
+        if (ascii_equals_token(arg, ascii_length(arg), "--compression")) {
+            if ((i + 1) >= arg_count || !args[i + 1]) {
+                console_line(2, "encode: --compression requires a value (fast, default, max or store)");
+                return 1;
+            }
+            compression_value = args[i + 1];
+            i += 1;
+        } else if (ascii_starts_with(arg, compression_prefix)) {
+            compression_value = arg + (sizeof(compression_prefix) - 1u);
+        }
+        if (compression_value) {
+            if (!makocode::parse_compression_profile(compression_value,
+                                                     ascii_length(compression_value),
+                                                     compression)) {
+                console_line(2, "encode: --compression must be fast, default, max or store");
+                return 1;
+            }
+            continue;
+        }
+        const char block_prefix[] = "--compression-block=";
+        const char* block_value = 0;
+        if (ascii_equals_token(arg, ascii_length(arg), "--compression-block")) {
+            if ((i + 1) >= arg_count || !args[i + 1]) {
+                console_line(2, "encode: --compression-block requires a size in KiB");
+                return 1;
+            }
+            block_value = args[i + 1];
+            i += 1;
+        } else if (ascii_starts_with(arg, block_prefix)) {
+            block_value = arg + (sizeof(block_prefix) - 1u);
+        }
+        if (block_value) {
+            u64 block_kib = 0u;
+            if (!ascii_to_u64(block_value, ascii_length(block_value), &block_kib) ||
+                block_kib < MIN_COMPRESSION_BLOCK_KIB || block_kib > MAX_COMPRESSION_BLOCK_KIB) {
+                console_line(2, "encode: --compression-block must be between 64 and 4194303 KiB");
+                return 1;
+            }
+            compression_block_bytes = block_kib * 1024u;
+            continue;
+        }
+        const char ecc_prefix[] = "--ecc=";
+        const char* ecc_value = 0;
+        usize ecc_length = 0u;
+        if (ascii_equals_token(arg, ascii_length(arg), "--ecc")) {
+            if ((i + 1) >= arg_count) {
+                console_line(2, "encode: --ecc requires a numeric value");
+                return 1;
+            }
+            ecc_value = args[i + 1];
             if (!ecc_value) {
                 console_line(2, "encode: --ecc requires a numeric value");
                 return 1;
@@ -24895,2461 +30095,4628 @@ static int command_encode(int arg_count, char** args) {
                 console_line(2, "encode: --font-size must be between 1 and 2048");
                 return 1;
             }
-            footer_config.font_size = (u32)value;
-            continue;
+            footer_config.font_size = (u32)value;
+            continue;
+        }
+        const char password_prefix[] = "--password=";
+        const char* password_value = 0;
+        usize password_length = 0u;
+        if (ascii_equals_token(arg, ascii_length(arg), "--password")) {
+            if (have_password) {
+                console_line(2, "encode: password specified multiple times");
+                return 1;
+            }
+            if ((i + 1) >= arg_count) {
+                console_line(2, "encode: --password requires a non-empty value");
+                return 1;
+            }
+            password_value = args[i + 1];
+            if (!password_value) {
+                console_line(2, "encode: --password requires a non-empty value");
+                return 1;
+            }
+            password_length = ascii_length(password_value);
+            i += 1;
+        } else if (ascii_starts_with(arg, password_prefix)) {
+            if (have_password) {
+                console_line(2, "encode: password specified multiple times");
+                return 1;
+            }
+            password_value = arg + (sizeof(password_prefix) - 1u);
+            password_length = ascii_length(password_value);
+        }
+        if (password_value) {
+            if (password_length == 0u) {
+                console_line(2, "encode: --password requires a non-empty value");
+                return 1;
+            }
+            if (!password_buffer.ensure(password_length)) {
+                console_line(2, "encode: failed to allocate password buffer");
+                return 1;
+            }
+            for (usize j = 0u; j < password_length; ++j) {
+                password_buffer.data[j] = (u8)password_value[j];
+            }
+            password_buffer.size = password_length;
+            have_password = true;
+            continue;
+        }
+        console_write(2, "encode: unknown option: ");
+        console_line(2, arg);
+        return 1;
+    }
+    if (input_count == 0u) {
+        console_line(2, "encode: at least one --input PATH is required");
+        return 1;
+    }
+    ArchiveBuildContext archive;
+    if (!archive_init(archive)) {
+        console_line(2, "encode: failed to initialize archive buffer");
+        return 1;
+    }
+    SpoolFile archive_spool;
+    if (stream_encode) {
+        if (!spool_open(archive_spool, output_dir)) {
+            console_line(2, "encode: failed to create spool file in output directory");
+            return 1;
+        }
+        archive.spool = &archive_spool;
+    }
+    StatsTimer archive_timer(StatsStage_Archive);
+    bool single_input = (input_count == 1u);
+    makocode::ByteBuffer single_normalized;
+    bool have_single_normalized = false;
+    for (usize path_index = 0u; path_index < input_count; ++path_index) {
+        const char* input_path = input_paths[path_index];
+        struct stat path_info;
+        if (stat(input_path, &path_info) != 0) {
+            console_write(2, "encode: unable to stat ");
+            console_line(2, input_path);
+            return 1;
+        }
+        makocode::ByteBuffer normalized_path;
+        if (!normalize_store_path(input_path, normalized_path)) {
+            console_write(2, "encode: failed to normalize input path ");
+            console_line(2, input_path);
+            return 1;
+        }
+        const char* stored_rel = (const char*)normalized_path.data;
+        if (!stored_rel || stored_rel[0] == '\0') {
+            console_write(2, "encode: input path resolves to empty relative name ");
+            console_line(2, input_path);
+            return 1;
+        }
+        if (S_ISDIR(path_info.st_mode)) {
+            if (!archive_collect_directory(input_path, stored_rel, archive)) {
+                return 1;
+            }
+        } else if (S_ISREG(path_info.st_mode)) {
+            if (!archive_add_file_from_path(archive, stored_rel, input_path)) {
+                return 1;
+            }
+        } else {
+            console_write(2, "encode: unsupported input type for ");
+            console_line(2, input_path);
+            return 1;
         }
-        const char password_prefix[] = "--password=";
-        const char* password_value = 0;
-        usize password_length = 0u;
-        if (ascii_equals_token(arg, ascii_length(arg), "--password")) {
-            if (have_password) {
-                console_line(2, "encode: password specified multiple times");
+        if (single_input && !have_single_normalized) {
+            if (!single_normalized.ensure(normalized_path.size + 1u)) {
+                console_line(2, "encode: failed to record normalized path");
                 return 1;
             }
-            if ((i + 1) >= arg_count) {
-                console_line(2, "encode: --password requires a non-empty value");
-                return 1;
+            for (usize j = 0u; j < normalized_path.size; ++j) {
+                single_normalized.data[j] = normalized_path.data[j];
             }
-            password_value = args[i + 1];
-            if (!password_value) {
-                console_line(2, "encode: --password requires a non-empty value");
+            single_normalized.data[normalized_path.size] = 0u;
+            single_normalized.size = normalized_path.size;
+            have_single_normalized = true;
+        }
+    }
+    if (archive.entry_count == 0u) {
+        console_line(2, "encode: no files or directories to encode");
+        return 1;
+    }
+    if (!archive_finalize(archive)) {
+        console_line(2, "encode: failed to finalize archive payload");
+        return 1;
+    }
+    archive_timer.stop();
+    footer_config.filename_text = 0;
+    footer_config.filename_length = 0u;
+    footer_config.has_filename = false;
+    if (footer_config.display_filename) {
+        if (single_input && have_single_normalized) {
+            const char* base_name = find_last_path_component((const char*)single_normalized.data);
+            usize base_length = ascii_length(base_name);
+            if (base_length == 0u) {
+                console_line(2, "encode: input path yielded empty filename");
                 return 1;
             }
-            password_length = ascii_length(password_value);
-            i += 1;
-        } else if (ascii_starts_with(arg, password_prefix)) {
-            if (have_password) {
-                console_line(2, "encode: password specified multiple times");
+            if (!filename_buffer.ensure(base_length + 1u)) {
+                console_line(2, "encode: failed to allocate filename buffer");
                 return 1;
             }
-            password_value = arg + (sizeof(password_prefix) - 1u);
-            password_length = ascii_length(password_value);
-        }
-        if (password_value) {
-            if (password_length == 0u) {
-                console_line(2, "encode: --password requires a non-empty value");
-                return 1;
+            for (usize j = 0u; j < base_length; ++j) {
+                char c = base_name[j];
+                if (!title_char_is_allowed(c)) {
+                    console_line(2, "encode: filename contains unsupported characters for footer text");
+                    return 1;
+                }
+                filename_buffer.data[j] = (u8)c;
             }
-            if (!password_buffer.ensure(password_length)) {
-                console_line(2, "encode: failed to allocate password buffer");
+            filename_buffer.data[base_length] = 0u;
+            filename_buffer.size = base_length;
+            footer_config.filename_text = (const char*)filename_buffer.data;
+            footer_config.filename_length = base_length;
+            footer_config.has_filename = true;
+        } else {
+            const char bundle_label[] = "bundle";
+            usize label_length = (usize)(sizeof(bundle_label) - 1u);
+            if (!filename_buffer.ensure(label_length + 1u)) {
+                console_line(2, "encode: failed to allocate filename buffer");
                 return 1;
             }
-            for (usize j = 0u; j < password_length; ++j) {
-                password_buffer.data[j] = (u8)password_value[j];
+            for (usize j = 0u; j < label_length; ++j) {
+                filename_buffer.data[j] = (u8)bundle_label[j];
+            }
+            filename_buffer.data[label_length] = 0u;
+            filename_buffer.size = label_length;
+            footer_config.filename_text = (const char*)filename_buffer.data;
+            footer_config.filename_length = label_length;
+            footer_config.has_filename = true;
+        }
+    }
+    if (footer_config.has_title && (!footer_config.title_text || footer_config.title_length == 0u)) {
+        console_line(2, "encode: title configuration is invalid");
+        return 1;
+    }
+    makocode::EncodeOptions options;
+    options.mapping = mapping;
+    options.footer = footer_config;
+    options.ecc_redundancy = ecc_redundancy;
+    options.ecc_fill = ecc_fill_requested;
+    options.compact_page = compact_page;
+    options.compression = compression;
+    options.compression_block_bytes = compression_block_bytes;
+    options.jobs = encode_jobs;
+    if (have_password) {
+        options.password = (const char*)password_buffer.data;
+        options.password_length = password_buffer.size;
+    }
+    // The frame container takes raw pixels, so pages skip the ASCII form.
+    if (y4m_path) {
+        options.mapping.ppm_binary_output = true;
+    }
+    bool y4m_to_stdout = y4m_path && ascii_equals_token(y4m_path, ascii_length(y4m_path), "-");
+    // Keep stdout clean for the frames when they go there.
+    int summary_fd = y4m_to_stdout ? 2 : 1;
+    char timestamp_name[32];
+    const char* page_name_prefix = 0;
+    if (have_prefix) {
+        page_name_prefix = (const char*)prefix_buffer.data;
+    } else {
+        if (!utc_timestamp_string(timestamp_name, sizeof(timestamp_name))) {
+            console_line(2, "encode: failed to construct timestamped filename");
+            return 1;
+        }
+        page_name_prefix = timestamp_name;
+    }
+    EncodeFileSink files;
+    files.output_dir = output_dir;
+    files.page_name_prefix = page_name_prefix;
+    makocode::PageSink sink;
+    sink.write_page = encode_file_sink_write_page;
+    sink.context = &files;
+    makocode::Y4mPageSink frames;
+    int y4m_fd = -1;
+    if (y4m_to_stdout) {
+        y4m_fd = 1;
+    } else if (y4m_path) {
+        if (!ensure_parent_directories(y4m_path) || (y4m_fd = creat(y4m_path, 0644)) < 0) {
+            console_write(2, "encode: failed to create ");
+            console_line(2, y4m_path);
+            return 1;
+        }
+    }
+    if (y4m_path) {
+        sink = makocode::page_sink_to_y4m(frames, y4m_fd);
+    }
+    makocode::EncodeReport report;
+    bool encoded = stream_encode ? encode_streamed_archive(archive_spool,
+                                                           output_dir,
+                                                           have_password ? &password_buffer : 0,
+                                                           options,
+                                                           sink,
+                                                           report)
+                                 : makocode::encode_to_pages(archive.buffer, options, sink, report);
+    if (y4m_path) {
+        encoded = encoded && makocode::y4m_sink_finish(frames);
+        if (!y4m_to_stdout) {
+            close(y4m_fd);
+            if (encoded) {
+                stats_count(StatsCounter_FilesWritten, 1u);
+            }
+        }
+    }
+    if (!encoded) {
+        return 1;
+    }
+    if (report.ecc_filled) {
+        char ratio_buffer[32];
+        format_fixed_3(report.ecc_redundancy, ratio_buffer, sizeof(ratio_buffer));
+        char block_buffer[32];
+        u64_to_ascii(report.fill_block_data, block_buffer, sizeof(block_buffer));
+        char parity_buffer[32];
+        u64_to_ascii(report.fill_parity, parity_buffer, sizeof(parity_buffer));
+        char bits_buffer[32];
+        u64_to_ascii(report.fill_bits_needed, bits_buffer, sizeof(bits_buffer));
+        char page_buffer[32];
+        u64_to_ascii(report.fill_page_count, page_buffer, sizeof(page_buffer));
+        console_write(summary_fd, "encode: --ecc-fill -> --ecc=");
+        console_write(summary_fd, ratio_buffer);
+        console_write(summary_fd, " (blocks=");
+        console_write(summary_fd, block_buffer);
+        console_write(summary_fd, " parity=");
+        console_write(summary_fd, parity_buffer);
+        console_write(summary_fd, " pages=");
+        console_write(summary_fd, page_buffer);
+        console_write(summary_fd, " bits_needed=");
+        console_write(summary_fd, bits_buffer);
+        console_line(summary_fd, ")");
+    }
+    if (report.page_count == 0u) {
+        return 0;
+    }
+    if (y4m_path) {
+        char frame_digits[32];
+        u64_to_ascii(report.page_count, frame_digits, sizeof(frame_digits));
+        console_write(summary_fd, "encode: wrote ");
+        console_write(summary_fd, frame_digits);
+        console_write(summary_fd, (report.page_count == 1u) ? " frame to " : " frames to ");
+        console_line(summary_fd, y4m_to_stdout ? "stdout" : y4m_path);
+        return 0;
+    }
+    makocode::ByteBuffer sample_name;
+    if (!build_page_filename(sample_name, page_name_prefix, 1u, report.page_count)) {
+        console_line(2, "encode: failed to summarize filenames");
+        return 1;
+    }
+    makocode::ByteBuffer sample_path;
+    const char* summary_name = (const char*)sample_name.data;
+    if (join_output_path(output_dir, summary_name, sample_path)) {
+        summary_name = (const char*)sample_path.data;
+    }
+    if (report.page_count == 1u) {
+        console_write(1, "encode: wrote 1 page (");
+        console_write(1, summary_name);
+        console_line(1, ")");
+        return 0;
+    }
+    char digits[32];
+    u64_to_ascii(report.page_count, digits, sizeof(digits));
+    console_write(1, "encode: wrote ");
+    console_write(1, digits);
+    console_write(1, " pages (");
+    console_write(1, summary_name);
+    console_line(1, " ...)");
+    return 0;
+}
+
+struct OverlayPage {
+    InputFile           original;
+    makocode::ByteBuffer pixels;
+    PpmParserState      metadata;
+    u32                 width;
+    u32                 height;
+    u32                 data_height;
+    u32                 footer_rows;
+    u8                  color_mode;
+
+    OverlayPage()
+        : original(),
+          pixels(),
+          metadata(),
+          width(0u),
+          height(0u),
+          data_height(0u),
+          footer_rows(0u),
+          color_mode(1u) {}
+
+    ~OverlayPage() {
+        original.release();
+        pixels.release();
+        metadata = PpmParserState();
+        width = 0u;
+        height = 0u;
+        data_height = 0u;
+        footer_rows = 0u;
+        color_mode = 1u;
+    }
+};
+
+static const usize MAX_OVERLAY_IGNORE_COLORS = 64u;
+
+struct OverlayIgnoreColorList {
+    PaletteColor colors[MAX_OVERLAY_IGNORE_COLORS];
+    usize count;
+};
+
+// The overlay PPM that carries the mask rarely encodes layout metadata such as
+// footer rows or fiducial sizing. When that metadata is absent we still need the
+// overlay to line up pixel-for-pixel with the base page so that the merged image
+// doesn't appear shifted. Synchronize the layout-critical fields from the base
+// page onto the overlay before we build masks or gather bits.
+static void overlay_apply_base_layout(const OverlayPage& base, OverlayPage& overlay) {
+    overlay.footer_rows = base.footer_rows;
+    if (overlay.footer_rows > overlay.height) {
+        overlay.footer_rows = overlay.height;
+    }
+    overlay.data_height = (overlay.height >= overlay.footer_rows)
+                              ? (overlay.height - overlay.footer_rows)
+                              : overlay.height;
+    if (base.metadata.has_footer_rows) {
+        overlay.metadata.has_footer_rows = true;
+        overlay.metadata.footer_rows_value = base.metadata.footer_rows_value;
+    }
+    if (base.metadata.has_fiducial_size) {
+        overlay.metadata.has_fiducial_size = true;
+        overlay.metadata.fiducial_size_value = base.metadata.fiducial_size_value;
+    }
+    if (base.metadata.has_fiducial_margin) {
+        overlay.metadata.has_fiducial_margin = true;
+        overlay.metadata.fiducial_margin_value = base.metadata.fiducial_margin_value;
+    }
+    if (base.metadata.has_fiducial_columns) {
+        overlay.metadata.has_fiducial_columns = true;
+        overlay.metadata.fiducial_columns_value = base.metadata.fiducial_columns_value;
+    }
+    if (base.metadata.has_fiducial_rows) {
+        overlay.metadata.has_fiducial_rows = true;
+        overlay.metadata.fiducial_rows_value = base.metadata.fiducial_rows_value;
+    }
+}
+
+static bool overlay_ignore_char_is_delimiter(char c) {
+    switch (c) {
+        case ' ':
+        case '\t':
+        case '\n':
+        case '\r':
+        case ',':
+        case ';':
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool parse_overlay_ignore_colors(const char* text,
+                                        usize length,
+                                        OverlayIgnoreColorList& list) {
+    list.count = 0u;
+    if (!text || length == 0u) {
+        return true;
+    }
+    usize cursor = 0u;
+    while (cursor < length) {
+        while (cursor < length && overlay_ignore_char_is_delimiter(text[cursor])) {
+            ++cursor;
+        }
+        if (cursor >= length) {
+            break;
+        }
+        usize start = cursor;
+        while (cursor < length && !overlay_ignore_char_is_delimiter(text[cursor])) {
+            ++cursor;
+        }
+        usize token_length = cursor - start;
+        if (token_length == 0u) {
+            continue;
+        }
+        if (list.count >= MAX_OVERLAY_IGNORE_COLORS) {
+            console_line(2, "overlay: --ignore-colors supports at most 64 entries");
+            return false;
+        }
+        PaletteColor color;
+        u8 color_id = NAMED_COLOR_INVALID;
+        if (!decode_named_palette_color(text + start, token_length, color_id, color)) {
+            console_line(2, "overlay: --ignore-colors contains an invalid color");
+            return false;
+        }
+        bool duplicate = false;
+        for (usize i = 0u; i < list.count; ++i) {
+            if (palette_colors_equal(list.colors[i], color)) {
+                duplicate = true;
+                break;
             }
-            password_buffer.size = password_length;
-            have_password = true;
+        }
+        if (duplicate) {
             continue;
         }
-        console_write(2, "encode: unknown option: ");
-        console_line(2, arg);
-        return 1;
+        list.colors[list.count++] = color;
     }
-    if (mapping.palette_set) {
-        if (!image_mapping_build_custom_palette(mapping, "encode")) {
-            return 1;
-        }
-        // Downgrade custom palettes that exactly match built-in palettes so we
-        // encode using the simpler fixed color modes (avoids palette-digit
-        // packing for standard BW/CMYW/RGB pages).
-        if (mapping.custom_palette_valid) {
-            auto palette_matches = [&](const PaletteColor* builtin, u32 count) -> bool {
-                if (!builtin || count == 0u || mapping.custom_palette_count != count) {
-                    return false;
-                }
-                for (u32 i = 0u; i < count; ++i) {
-                    const PaletteColor& a = mapping.custom_palette[i];
-                    const PaletteColor& b = builtin[i];
-                    if (a.r != b.r || a.g != b.g || a.b != b.b) {
-                        return false;
-                    }
-                }
-                return true;
-            };
-            if (palette_matches(PALETTE_GRAY, (u32)(sizeof(PALETTE_GRAY) / sizeof(PALETTE_GRAY[0])))) {
-                mapping.color_channels = 1u;
-                mapping.custom_palette_valid = false;
-            } else if (palette_matches(PALETTE_CMYW, (u32)(sizeof(PALETTE_CMYW) / sizeof(PALETTE_CMYW[0])))) {
-                mapping.color_channels = 2u;
-                mapping.custom_palette_valid = false;
-            } else if (palette_matches(PALETTE_RGB_CMY_WB, (u32)(sizeof(PALETTE_RGB_CMY_WB) / sizeof(PALETTE_RGB_CMY_WB[0])))) {
-                mapping.color_channels = 3u;
-                mapping.custom_palette_valid = false;
-            }
-        }
+    return true;
+}
+
+static bool load_overlay_page(const char* path, OverlayPage& page) {
+    page.original.release();
+    page.pixels.release();
+    page.metadata = PpmParserState();
+    page.width = 0u;
+    page.height = 0u;
+    page.data_height = 0u;
+    page.footer_rows = 0u;
+    page.color_mode = 1u;
+    if (!path) {
+        console_line(2, "overlay: missing file path");
+        return false;
     }
-    if (input_count == 0u) {
-        console_line(2, "encode: at least one --input PATH is required");
-        return 1;
+    if (!input_file_open(page.original, path)) {
+        console_write(2, "overlay: failed to read ");
+        console_line(2, path);
+        return false;
     }
-    ArchiveBuildContext archive;
-    if (!archive_init(archive)) {
-        console_line(2, "encode: failed to initialize archive buffer");
-        return 1;
+    if (!page.original.data || page.original.size == 0u) {
+        console_write(2, "overlay: empty file ");
+        console_line(2, path);
+        return false;
     }
-    bool single_input = (input_count == 1u);
-    makocode::ByteBuffer single_normalized;
-    bool have_single_normalized = false;
-    for (usize path_index = 0u; path_index < input_count; ++path_index) {
-        const char* input_path = input_paths[path_index];
-        struct stat path_info;
-        if (stat(input_path, &path_info) != 0) {
-            console_write(2, "encode: unable to stat ");
-            console_line(2, input_path);
-            return 1;
-        }
-        makocode::ByteBuffer normalized_path;
-        if (!normalize_store_path(input_path, normalized_path)) {
-            console_write(2, "encode: failed to normalize input path ");
-            console_line(2, input_path);
-            return 1;
-        }
-        const char* stored_rel = (const char*)normalized_path.data;
-        if (!stored_rel || stored_rel[0] == '\0') {
-            console_write(2, "encode: input path resolves to empty relative name ");
-            console_line(2, input_path);
-            return 1;
+    PpmParserState state;
+    state.data = page.original.data;
+    state.size = page.original.size;
+    const char* token = 0;
+    usize token_length = 0u;
+    if (!ppm_next_token(state, &token, &token_length) ||
+        !ppm_accept_magic(state, token, token_length)) {
+        console_write(2, "overlay: ");
+        console_write(2, path);
+        console_line(2, " is not a P3/P6 PPM");
+        return false;
+    }
+    u64 width_value = 0u;
+    if (!ppm_next_token(state, &token, &token_length) ||
+        !ascii_to_u64(token, token_length, &width_value) ||
+        width_value == 0u ||
+        width_value > 0xFFFFFFFFull) {
+        console_write(2, "overlay: invalid width in ");
+        console_line(2, path);
+        return false;
+    }
+    u64 height_value = 0u;
+    if (!ppm_next_token(state, &token, &token_length) ||
+        !ascii_to_u64(token, token_length, &height_value) ||
+        height_value == 0u ||
+        height_value > 0xFFFFFFFFull) {
+        console_write(2, "overlay: invalid height in ");
+        console_line(2, path);
+        return false;
+    }
+    u64 max_value = 0u;
+    if (!ppm_next_token(state, &token, &token_length) ||
+        !ascii_to_u64(token, token_length, &max_value) ||
+        max_value != 255u) {
+        console_write(2, "overlay: unsupported max pixel value in ");
+        console_line(2, path);
+        return false;
+    }
+    if (width_value == 0u || height_value == 0u) {
+        console_write(2, "overlay: zero dimension in ");
+        console_line(2, path);
+        return false;
+    }
+    if (width_value > (u64)USIZE_MAX_VALUE || height_value > (u64)USIZE_MAX_VALUE) {
+        console_write(2, "overlay: dimensions overflow in ");
+        console_line(2, path);
+        return false;
+    }
+    u64 pixel_count = width_value * height_value;
+    if (pixel_count == 0u || pixel_count > ((u64)USIZE_MAX_VALUE / 3u)) {
+        console_write(2, "overlay: pixel count overflow in ");
+        console_line(2, path);
+        return false;
+    }
+    makocode::ByteBuffer pixel_data;
+    if (!ppm_read_rgb_pixels(state, pixel_count, pixel_data)) {
+        console_write(2, "overlay: failed to parse pixel data from ");
+        console_line(2, path);
+        return false;
+    }
+    page.metadata = state;
+    page.metadata.data = 0;
+    page.metadata.size = 0u;
+    page.metadata.cursor = 0u;
+
+    // Prefer metadata tile (v3) for layout/ecc details now that footer stripes may be absent.
+    MetadataTile::Values tile_values = {};
+    makocode::ByteBuffer tile_palette_text;
+    MetadataTile::Placement placement = MetadataTile::compute_tile_placement((u32)width_value, (u32)height_value);
+    if (placement.valid) {
+        if (MetadataTile::decode_tile(pixel_data.data,
+                                      (u32)width_value,
+                                      (u32)height_value,
+                                      (u32)height_value,
+                                      placement,
+                                      tile_values,
+                                      tile_palette_text)) {
+            apply_metadata_tile_metadata(page.metadata, tile_values, tile_palette_text);
         }
-        if (S_ISDIR(path_info.st_mode)) {
-            if (!archive_collect_directory(input_path, stored_rel, archive)) {
-                return 1;
-            }
-        } else if (S_ISREG(path_info.st_mode)) {
-            makocode::ByteBuffer file_data;
-            if (!read_entire_file(input_path, file_data)) {
-                console_write(2, "encode: failed to read ");
-                console_line(2, input_path);
-                return 1;
-            }
-            if (!archive_add_file(archive, stored_rel, file_data.data, file_data.size)) {
-                file_data.release();
-                return 1;
-            }
-            file_data.release();
-        } else {
-            console_write(2, "encode: unsupported input type for ");
-            console_line(2, input_path);
-            return 1;
+    }
+
+    FooterStripe::Values stripe_values = {};
+    bool stripe_available = false;
+    if (kFooterStripeEnabled && width_value <= 0xFFFFFFFFull && height_value <= 0xFFFFFFFFull) {
+        stripe_available = FooterStripe::decode_v3(pixel_data.data,
+                                                   (u32)width_value,
+                                                   (u32)height_value,
+                                                   stripe_values);
+        if (!stripe_available) {
+            stripe_available = FooterStripe::decode(FooterStripe::SPEC_V2,
+                                                    pixel_data.data,
+                                                    (u32)width_value,
+                                                    (u32)height_value,
+                                                    stripe_values);
         }
-        if (single_input && !have_single_normalized) {
-            if (!single_normalized.ensure(normalized_path.size + 1u)) {
-                console_line(2, "encode: failed to record normalized path");
-                return 1;
-            }
-            for (usize j = 0u; j < normalized_path.size; ++j) {
-                single_normalized.data[j] = normalized_path.data[j];
-            }
-            single_normalized.data[normalized_path.size] = 0u;
-            single_normalized.size = normalized_path.size;
-            have_single_normalized = true;
+        if (!stripe_available) {
+            stripe_available = FooterStripe::decode(FooterStripe::SPEC_V1,
+                                                    pixel_data.data,
+                                                    (u32)width_value,
+                                                    (u32)height_value,
+                                                    stripe_values);
         }
     }
-    if (archive.entry_count == 0u) {
-        console_line(2, "encode: no files or directories to encode");
-        return 1;
-    }
-    if (!archive_finalize(archive)) {
-        console_line(2, "encode: failed to finalize archive payload");
-        return 1;
+    if (stripe_available) {
+        page.metadata.has_footer_stripe = true;
+        page.metadata.footer_stripe_values = stripe_values;
+        apply_footer_stripe_metadata(page.metadata, stripe_values);
     }
-    footer_config.filename_text = 0;
-    footer_config.filename_length = 0u;
-    footer_config.has_filename = false;
-    if (footer_config.display_filename) {
-        if (single_input && have_single_normalized) {
-            const char* base_name = find_last_path_component((const char*)single_normalized.data);
-            usize base_length = ascii_length(base_name);
-            if (base_length == 0u) {
-                console_line(2, "encode: input path yielded empty filename");
-                return 1;
-            }
-            if (!filename_buffer.ensure(base_length + 1u)) {
-                console_line(2, "encode: failed to allocate filename buffer");
-                return 1;
-            }
-            for (usize j = 0u; j < base_length; ++j) {
-                char c = base_name[j];
-                if (!title_char_is_allowed(c)) {
-                    console_line(2, "encode: filename contains unsupported characters for footer text");
-                    return 1;
-                }
-                filename_buffer.data[j] = (u8)c;
-            }
-            filename_buffer.data[base_length] = 0u;
-            filename_buffer.size = base_length;
-            footer_config.filename_text = (const char*)filename_buffer.data;
-            footer_config.filename_length = base_length;
-            footer_config.has_filename = true;
-        } else {
-            const char bundle_label[] = "bundle";
-            usize label_length = (usize)(sizeof(bundle_label) - 1u);
-            if (!filename_buffer.ensure(label_length + 1u)) {
-                console_line(2, "encode: failed to allocate filename buffer");
-                return 1;
-            }
-            for (usize j = 0u; j < label_length; ++j) {
-                filename_buffer.data[j] = (u8)bundle_label[j];
-            }
-            filename_buffer.data[label_length] = 0u;
-            filename_buffer.size = label_length;
-            footer_config.filename_text = (const char*)filename_buffer.data;
-            footer_config.filename_length = label_length;
-            footer_config.has_filename = true;
+
+    byte_buffer_move(page.pixels, pixel_data);
+    page.width = (u32)width_value;
+    page.height = (u32)height_value;
+
+    u32 footer_rows = 0u;
+    if (page.metadata.has_footer_rows) {
+        if (page.metadata.footer_rows_value > height_value) {
+            console_write(2, "overlay: footer metadata exceeds image height in ");
+            console_line(2, path);
+            return false;
         }
+        footer_rows = (u32)page.metadata.footer_rows_value;
     }
-    if (footer_config.has_title && (!footer_config.title_text || footer_config.title_length == 0u)) {
-        console_line(2, "encode: title configuration is invalid");
-        return 1;
+    if (footer_rows > page.height) {
+        footer_rows = page.height;
     }
-    u32 width_pixels = 0u;
-    u32 height_pixels = 0u;
-    if (!compute_page_dimensions(mapping, width_pixels, height_pixels)) {
-        console_line(2, "encode: invalid page dimensions");
-        return 1;
+    page.footer_rows = footer_rows;
+    page.data_height = page.height - footer_rows;
+    if (page.data_height > page.height) {
+        page.data_height = page.height;
     }
-    if (ecc_fill_requested) {
-        makocode::ByteBuffer compressed_payload;
-        if (!lzma_compress(archive.buffer.data, archive.buffer.size, compressed_payload)) {
-            console_line(2, "encode: failed to compress payload for ECC fill calculation");
-            return 1;
+    page.color_mode = 1u;
+    if (page.metadata.has_palette_base) {
+        const u64 palette_base = page.metadata.palette_base_value;
+        if (palette_base >= 8u) {
+            page.color_mode = 3u;
+        } else if (palette_base >= 4u) {
+            page.color_mode = 2u;
+        } else {
+            page.color_mode = 1u;
         }
-        usize compressed_size = compressed_payload.size;
-        compressed_payload.release();
-        usize payload_bytes = compressed_size;
-        if (have_password) {
-            usize overhead = makocode::ENCRYPTION_HEADER_BYTES + makocode::ENCRYPTION_TAG_BYTES;
-            if (payload_bytes > USIZE_MAX_VALUE - overhead) {
-                console_line(2, "encode: payload size overflow while estimating ECC fill");
-                return 1;
+    } else if (page.pixels.data && page.pixels.size >= (usize)page.width * (usize)page.height * 3u) {
+        // When palette metadata is unavailable (e.g., synthetic overlay masks),
+        // infer whether the image uses chroma at all. Overlay behavior only
+        // needs a coarse "grayscale vs. color" distinction to decide between
+    // raw-pixel overlay and data-bit overlay. Avoid depending on container metadata
+        // comments, which are not preserved across print/scan workflows.
+        usize total_pixels = (usize)page.width * (usize)page.height;
+        bool has_color = false;
+        for (usize i = 0u; i < total_pixels; ++i) {
+            const u8* rgb = page.pixels.data + i * 3u;
+            if (rgb[0] != rgb[1] || rgb[1] != rgb[2]) {
+                has_color = true;
+                break;
             }
-            payload_bytes += overhead;
-        }
-        if (payload_bytes == 0u) {
-            console_line(2, "encode: payload is empty, ECC fill calculation unnecessary");
-            return 0;
-        }
-        u16 frame_block_data = 0u;
-        u16 frame_parity = 0u;
-        u64 frame_block_count = 0u;
-        u64 frame_payload_bits = 0u;
-        u64 frame_bits = 0u;
-        if (!compute_frame_statistics(payload_bytes,
-                                      ecc_redundancy,
-                                      frame_block_data,
-                                      frame_parity,
-                                      frame_block_count,
-                                      frame_payload_bits,
-                                      frame_bits)) {
-            console_line(2, "encode: could not compute frame size for ECC fill calculation");
-            return 1;
         }
-        double best_ratio = -1.0;
-        u16 best_block_data = 0u;
-        u16 best_parity = 0u;
-        u64 best_frame_bits = 0u;
-        u64 best_bits_needed = 0u;
-        u64 best_page_count = 0u;
-        if (!find_best_ecc_fill(payload_bytes,
-                                ecc_redundancy,
-                                (double)makocode::RS_FIELD_SIZE,
-                                mapping,
-                                footer_config,
-                                width_pixels,
-                                height_pixels,
-                                best_ratio,
-                                best_block_data,
-                                best_parity,
-                                best_frame_bits,
-                                best_bits_needed,
-                                best_page_count)) {
-            console_line(2, "encode: failed to derive ECC fill candidate");
-            return 1;
+        if (has_color) {
+            page.color_mode = 2u;
         }
-        char ratio_buffer[32];
-        format_fixed_3(best_ratio, ratio_buffer, sizeof(ratio_buffer));
-        char block_buffer[32];
-        u64_to_ascii(best_block_data, block_buffer, sizeof(block_buffer));
-        char parity_buffer[32];
-        u64_to_ascii(best_parity, parity_buffer, sizeof(parity_buffer));
-        char bits_buffer[32];
-        u64_to_ascii(best_bits_needed, bits_buffer, sizeof(bits_buffer));
-        char page_buffer[32];
-        u64_to_ascii(best_page_count, page_buffer, sizeof(page_buffer));
-        console_write(1, "encode: --ecc-fill -> --ecc=");
-        console_write(1, ratio_buffer);
-        console_write(1, " (blocks=");
-        console_write(1, block_buffer);
-        console_write(1, " parity=");
-        console_write(1, parity_buffer);
-        console_write(1, " pages=");
-        console_write(1, page_buffer);
-        console_write(1, " bits_needed=");
-        console_write(1, bits_buffer);
-        console_line(1, ")");
-        ecc_redundancy = best_ratio;
     }
-    makocode::EncoderContext encoder;
-    encoder.config.ecc_redundancy = ecc_redundancy;
-    if (have_password) {
-        if (!encoder.set_password((const char*)password_buffer.data, password_buffer.size)) {
-            console_line(2, "encode: failed to set encryption password");
-            return 1;
-        }
+    return true;
+}
+
+static bool build_overlay_mask(const OverlayPage& page,
+                               makocode::ByteBuffer& mask_out,
+                               u64& reserved_pixels) {
+    reserved_pixels = 0u;
+    mask_out.release();
+    if (page.width == 0u || page.height == 0u) {
+        return false;
     }
-    if (!encoder.set_payload(archive.buffer.data, archive.buffer.size)) {
-        console_line(2, "encode: failed to set payload");
-        return 1;
+    u64 total_pixels = (u64)page.width * (u64)page.height;
+    if (!mask_out.ensure((usize)total_pixels)) {
+        return false;
     }
-    if (!encoder.build()) {
-        console_line(2, "encode: build failed");
-        return 1;
+    mask_out.size = (usize)total_pixels;
+    for (usize i = 0u; i < mask_out.size; ++i) {
+        mask_out.data[i] = 0u;
     }
-    makocode::ByteBuffer frame_bits;
-    u64 frame_bit_count = 0u;
-    u64 payload_bit_count = 0u;
-    if (!build_frame_bits(encoder, mapping, frame_bits, frame_bit_count, payload_bit_count)) {
-        console_line(2, "encode: failed to build frame");
-        return 1;
+    if (page.data_height == 0u) {
+        return true;
     }
-    FooterLayout footer_layout;
-    u32 layout_data_height = height_pixels;
-    u64 bits_per_page = 0u;
-    u64 page_count = 0u;
-    if (!compute_page_layout(mapping,
-                             footer_config,
-                             frame_bit_count,
-                             width_pixels,
-                             height_pixels,
-                             footer_layout,
-                             layout_data_height,
-                             bits_per_page,
-                             page_count)) {
-        console_line(2, "encode: footer layout did not converge");
-        return 1;
+    u32 marker_size = g_fiducial_defaults.marker_size_pixels;
+    if (page.metadata.has_fiducial_size && page.metadata.fiducial_size_value > 0u && page.metadata.fiducial_size_value <= 0xFFFFFFFFull) {
+        marker_size = (u32)page.metadata.fiducial_size_value;
     }
-    char timestamp_name[32];
-    const char* page_name_prefix = 0;
-    if (have_prefix) {
-        page_name_prefix = (const char*)prefix_buffer.data;
-    } else {
-        if (!utc_timestamp_string(timestamp_name, sizeof(timestamp_name))) {
-            console_line(2, "encode: failed to construct timestamped filename");
-            return 1;
-        }
-        page_name_prefix = timestamp_name;
+    if (marker_size == 0u) {
+        return true;
     }
-    makocode::ByteBuffer footer_text_buffer;
-    const makocode::EccSummary* ecc_summary = &encoder.ecc_info();
-    if (page_count == 1u) {
-        u32 output_height_pixels = height_pixels;
-        FooterLayout output_footer_layout = footer_layout;
-        u32 output_data_height_pixels = layout_data_height;
-        u64 output_bits_per_page = bits_per_page;
-
-        if (compact_page && footer_layout.has_text) {
-            console_line(2, "encode: --compact-page requires the footer text to be disabled (use --no-filename and --no-page-count, and omit --title)");
-            return 1;
-        }
-
-        // For single-page outputs with no footer text, allow the footer band to
-        // collapse to the minimum height needed for payload data.
-        if (compact_page && !footer_layout.has_text && layout_data_height > 0u) {
-            double bits_per_pixel = mapping_bits_per_data_pixel(mapping);
-            if (bits_per_pixel > 0.0) {
-                u32 max_data_height = layout_data_height;
-                u32 stripe_height = footer_layout.stripe_height_pixels;
-                u32 stripe_limited = (height_pixels > stripe_height) ? (height_pixels - stripe_height) : 0u;
-                if (stripe_limited > 0u && stripe_limited < max_data_height) {
-                    max_data_height = stripe_limited;
-                }
-                if (max_data_height > 0u) {
-                    u32 low = 1u;
-                    u32 high = max_data_height;
-                    u32 best = max_data_height;
-                    u64 best_bits = 0u;
-                    while (low <= high) {
-                        u32 mid = low + (high - low) / 2u;
-                        u64 candidate_bits = 0u;
-                        if (compute_bits_per_page(width_pixels,
-                                                  height_pixels,
-                                                  mid,
-                                                  bits_per_pixel,
-                                                  candidate_bits,
-                                                  0) &&
-                            candidate_bits >= frame_bit_count) {
-                            best = mid;
-                            best_bits = candidate_bits;
-                            if (mid == 1u) {
-                                break;
-                            }
-                            high = mid - 1u;
-                        } else {
-                            low = mid + 1u;
-                        }
-                    }
-                    // Only apply if it meaningfully reduces the unused band.
-                    if (best_bits > 0u && best + 4u < layout_data_height) {
-                        u32 minimal_height = best + stripe_height;
-                        if (minimal_height >= best && minimal_height <= height_pixels) {
-                            output_height_pixels = minimal_height;
-                        }
-                        output_footer_layout.data_height_pixels = best;
-                        output_footer_layout.stripe_top_row = best;
-                        output_footer_layout.footer_height_pixels = stripe_height;
-                        output_data_height_pixels = best;
-                        // Bits-per-page depends on data_height; keep it consistent with
-                        // the chosen data height even when we shrink the output image.
-                        output_bits_per_page = best_bits;
-                    }
-                }
-            }
-        }
-        makocode::ByteBuffer page_output;
-        if (!footer_build_page_text(footer_config, 1u, page_count, footer_text_buffer)) {
-            console_line(2, "encode: failed to build footer text");
-            return 1;
-        }
-        const char* footer_text = output_footer_layout.has_text ? (const char*)footer_text_buffer.data : 0;
-        usize footer_length = output_footer_layout.has_text ? footer_text_buffer.size : 0u;
-        if (!encode_page_to_ppm(mapping,
-                                frame_bits,
-                                frame_bit_count,
-                                0u,
-                                width_pixels,
-                                output_height_pixels,
-                                1u,
-                                1u,
-                                output_bits_per_page,
-                                payload_bit_count,
-                                ecc_summary,
-                                footer_text,
-                                footer_length,
-                                output_footer_layout,
-                                page_output)) {
-           console_line(2, "encode: failed to format ppm");
-           return 1;
-       }
-        makocode::ByteBuffer fiducial_page;
-        // Clip fiducials to the data area so they don't land on the footer stripe.
-        if (!apply_default_fiducial_grid(page_output, fiducial_page, output_data_height_pixels)) {
-            console_line(2, "encode: failed to embed fiducial grid");
-            return 1;
+    u32 draw_height = page.height;
+    if (page.data_height > 0u && page.data_height < page.height) {
+        draw_height = page.data_height;
+    }
+    u32 margin = g_fiducial_defaults.margin_pixels;
+    if (page.metadata.has_fiducial_margin && page.metadata.fiducial_margin_value <= 0xFFFFFFFFull) {
+        margin = (u32)page.metadata.fiducial_margin_value;
+    }
+    double min_x = (margin < page.width) ? (double)margin : 0.0;
+    double max_x = (page.width > margin)
+                       ? (double)(page.width - 1u - margin)
+                       : (page.width ? (double)(page.width - 1u) : 0.0);
+    if (max_x < min_x) {
+        max_x = min_x;
+    }
+    double min_y = (margin < draw_height) ? (double)margin : 0.0;
+    double max_y = (draw_height > margin)
+                       ? (double)(draw_height - 1u - margin)
+                       : (draw_height ? (double)(draw_height - 1u) : 0.0);
+    if (max_y < min_y) {
+        max_y = min_y;
+    }
+    double available_width = (max_x >= min_x) ? (max_x - min_x) : 0.0;
+    double available_height = (max_y >= min_y) ? (max_y - min_y) : 0.0;
+    u32 columns = (page.metadata.has_fiducial_columns && page.metadata.fiducial_columns_value > 0u)
+                      ? (u32)page.metadata.fiducial_columns_value
+                      : 0u;
+    u32 rows = (page.metadata.has_fiducial_rows && page.metadata.fiducial_rows_value > 0u)
+                   ? (u32)page.metadata.fiducial_rows_value
+                   : 0u;
+    if (columns == 0u || rows == 0u) {
+        u32 spacing = g_fiducial_defaults.spacing_pixels;
+        if (spacing == 0u) {
+            spacing = marker_size ? marker_size : 1u;
         }
-        byte_buffer_move(page_output, fiducial_page);
-        makocode::ByteBuffer output_name;
-        makocode::ByteBuffer output_path;
-        if (!build_page_filename(output_name, page_name_prefix, 1u, 1u)) {
-            console_line(2, "encode: failed to build output filename");
-            return 1;
+        if (columns == 0u) {
+            columns = 1u;
+            if (spacing > 0u && available_width > 0.0) {
+                double span = available_width / (double)spacing;
+                if (span < 0.0) {
+                    span = 0.0;
+                }
+                u64 additional = (u64)span;
+                if (additional > 0xFFFFFFFFull - 1ull) {
+                    additional = 0xFFFFFFFFull - 1ull;
+                }
+                columns = (u32)(additional + 1ull);
+            }
         }
-        if (!join_output_path(output_dir, (const char*)output_name.data, output_path)) {
-            console_line(2, "encode: failed to prepare output path");
-            return 1;
+        if (rows == 0u) {
+            rows = 1u;
+            if (spacing > 0u && available_height > 0.0) {
+                double span = available_height / (double)spacing;
+                if (span < 0.0) {
+                    span = 0.0;
+                }
+                u64 additional = (u64)span;
+                if (additional > 0xFFFFFFFFull - 1ull) {
+                    additional = 0xFFFFFFFFull - 1ull;
+                }
+                rows = (u32)(additional + 1ull);
+            }
         }
-        if (!ensure_parent_directories((const char*)output_path.data)) {
-            console_line(2, "encode: failed to prepare output directories");
-            return 1;
+        if (columns == 0u) {
+            columns = 1u;
         }
-        if (!write_buffer_to_file((const char*)output_path.data, page_output)) {
-            console_line(2, "encode: failed to write ppm file");
-            return 1;
+        if (rows == 0u) {
+            rows = 1u;
         }
-        console_write(1, "encode: wrote 1 page (");
-        console_write(1, (const char*)output_path.data);
-        console_line(1, ")");
-    } else {
-        makocode::ByteBuffer name_buffer;
-        makocode::ByteBuffer path_buffer;
-        for (u64 page = 0u; page < page_count; ++page) {
-            makocode::ByteBuffer page_output;
-            u64 bit_offset = page * bits_per_page;
-            if (!footer_build_page_text(footer_config, page + 1u, page_count, footer_text_buffer)) {
-                console_line(2, "encode: failed to build footer text");
-                return 1;
-            }
-            const char* footer_text = footer_layout.has_text ? (const char*)footer_text_buffer.data : 0;
-            usize footer_length = footer_layout.has_text ? footer_text_buffer.size : 0u;
-            if (!encode_page_to_ppm(mapping,
-                                    frame_bits,
-                                    frame_bit_count,
-                                    bit_offset,
-                                    width_pixels,
-                                    height_pixels,
-                                    page + 1u,
-                                    page_count,
-                                    bits_per_page,
-                                    payload_bit_count,
-                                    ecc_summary,
-                                    footer_text,
-                                    footer_length,
-                                    footer_layout,
-                                    page_output)) {
-                console_line(2, "encode: failed to format ppm page");
-                return 1;
-            }
-            makocode::ByteBuffer fiducial_page;
-            // Clip fiducials to the data area so they don't land on the footer stripe.
-            if (!apply_default_fiducial_grid(page_output, fiducial_page, footer_layout.data_height_pixels)) {
-                console_line(2, "encode: failed to embed fiducial grid");
-                return 1;
-            }
-            byte_buffer_move(page_output, fiducial_page);
-            if (!build_page_filename(name_buffer, page_name_prefix, page + 1u, page_count)) {
-                console_line(2, "encode: failed to build filename");
-                return 1;
-            }
-            if (!join_output_path(output_dir, (const char*)name_buffer.data, path_buffer)) {
-                console_line(2, "encode: failed to prepare output path");
-                return 1;
-            }
-            if (!ensure_parent_directories((const char*)path_buffer.data)) {
-                console_line(2, "encode: failed to prepare output directories");
-                return 1;
-            }
-            if (!write_buffer_to_file((const char*)path_buffer.data, page_output)) {
-                console_line(2, "encode: failed to write ppm file");
-                return 1;
+    }
+    for (u32 grid_row = 0u; grid_row < rows; ++grid_row) {
+        double t_y = (rows == 1u) ? 0.5 : ((double)grid_row / (double)(rows - 1u));
+        double center_y = min_y + (max_y - min_y) * t_y;
+        int start_y = (int)(center_y - ((double)marker_size - 1.0) * 0.5);
+        for (u32 grid_col = 0u; grid_col < columns; ++grid_col) {
+            double t_x = (columns == 1u) ? 0.5 : ((double)grid_col / (double)(columns - 1u));
+            double center_x = min_x + (max_x - min_x) * t_x;
+            int start_x = (int)(center_x - ((double)marker_size - 1.0) * 0.5);
+            for (u32 dy = 0u; dy < marker_size; ++dy) {
+                int pixel_y = start_y + (int)dy;
+                if (pixel_y < 0 || pixel_y >= (int)draw_height) {
+                    continue;
+                }
+                bool within_data = ((u32)pixel_y < page.data_height);
+                for (u32 dx = 0u; dx < marker_size; ++dx) {
+                    int pixel_x = start_x + (int)dx;
+                    if (pixel_x < 0 || pixel_x >= (int)page.width) {
+                        continue;
+                    }
+                    usize index = ((usize)pixel_y * (usize)page.width) + (usize)pixel_x;
+                    if (mask_out.data[index]) {
+                        continue;
+                    }
+                    mask_out.data[index] = 1u;
+                    if (within_data) {
+                        ++reserved_pixels;
+                    }
+                }
             }
         }
-        makocode::ByteBuffer sample_name;
-        if (!build_page_filename(sample_name, page_name_prefix, 1u, page_count)) {
-            console_line(2, "encode: failed to summarize filenames");
-            return 1;
-        }
-        makocode::ByteBuffer sample_path;
-        const char* summary_name = (const char*)sample_name.data;
-        if (join_output_path(output_dir, summary_name, sample_path)) {
-            summary_name = (const char*)sample_path.data;
+    }
+
+    // Protect the metadata tile region from overlays so pixel-carried metadata survives.
+    const char* disable_tile_env = getenv("MAKO_DISABLE_METADATA_TILE");
+    if (!(disable_tile_env && disable_tile_env[0]) &&
+        page.data_height >= MetadataTile::TILE_SIDE && page.width >= MetadataTile::TILE_SIDE) {
+        MetadataTile::Placement placement = MetadataTile::compute_tile_placement(page.width, page.data_height);
+        if (placement.valid) {
+            for (u32 dy = 0u; dy < MetadataTile::TILE_SIDE; ++dy) {
+                u32 y = placement.y0 + dy;
+                if (y >= page.data_height) continue;
+                for (u32 dx = 0u; dx < MetadataTile::TILE_SIDE; ++dx) {
+                    u32 x = placement.x0 + dx;
+                    if (x >= page.width) continue;
+                    usize index = (usize)y * (usize)page.width + (usize)x;
+                    if (mask_out.data[index]) {
+                        continue;
+                    }
+                    mask_out.data[index] = 1u;
+                    ++reserved_pixels;
+                }
+            }
         }
-        char digits[32];
-        u64_to_ascii(page_count, digits, sizeof(digits));
-        console_write(1, "encode: wrote ");
-        console_write(1, digits);
-        console_write(1, " pages (");
-        console_write(1, summary_name);
-        console_line(1, " ...)");
     }
-    return 0;
+    return true;
 }
 
-struct OverlayPage {
-    makocode::ByteBuffer original;
-    makocode::ByteBuffer pixels;
-    PpmParserState      metadata;
-    u32                 width;
-    u32                 height;
-    u32                 data_height;
-    u32                 footer_rows;
-    u8                  color_mode;
-
-    OverlayPage()
-        : original(),
-          pixels(),
-          metadata(),
-          width(0u),
-          height(0u),
-          data_height(0u),
-          footer_rows(0u),
-          color_mode(1u) {}
-
-    ~OverlayPage() {
-        original.release();
-        pixels.release();
-        metadata = PpmParserState();
-        width = 0u;
-        height = 0u;
-        data_height = 0u;
-        footer_rows = 0u;
-        color_mode = 1u;
-    }
+// Every overlay pass works from one classification of the page pair. Each
+// plane packs one bit per pixel in row-major order (pixel i is bit i % 64 of
+// word i / 64), so counting is a popcount and gathering or scattering walks
+// the set bits a word at a time instead of re-testing both fiducial masks and
+// the ignore list for every pixel. Ignored colours live in a small
+// open-addressed table that is probed at most once per colour run.
+struct OverlayColorClassTable {
+    static const usize SLOT_COUNT = 256u;
+    static const u32 EMPTY_SLOT = 0xFFFFFFFFu;
+    u32 slots[SLOT_COUNT];
+    usize count;
 };
 
-static const usize MAX_OVERLAY_IGNORE_COLORS = 64u;
+static inline u32 overlay_color_key(const u8* rgb) {
+    return ((u32)rgb[0] << 16u) | ((u32)rgb[1] << 8u) | (u32)rgb[2];
+}
 
-struct OverlayIgnoreColorList {
-    PaletteColor colors[MAX_OVERLAY_IGNORE_COLORS];
-    usize count;
-};
+static inline usize overlay_color_slot(u32 key) {
+    return (usize)((key * 0x9E3779B1u) >> 24u);
+}
 
-// The overlay PPM that carries the mask rarely encodes layout metadata such as
-// footer rows or fiducial sizing. When that metadata is absent we still need the
-// overlay to line up pixel-for-pixel with the base page so that the merged image
-// doesn't appear shifted. Synchronize the layout-critical fields from the base
-// page onto the overlay before we build masks or gather bits.
-static void overlay_apply_base_layout(const OverlayPage& base, OverlayPage& overlay) {
-    overlay.footer_rows = base.footer_rows;
-    if (overlay.footer_rows > overlay.height) {
-        overlay.footer_rows = overlay.height;
-    }
-    overlay.data_height = (overlay.height >= overlay.footer_rows)
-                              ? (overlay.height - overlay.footer_rows)
-                              : overlay.height;
-    if (base.metadata.has_footer_rows) {
-        overlay.metadata.has_footer_rows = true;
-        overlay.metadata.footer_rows_value = base.metadata.footer_rows_value;
-    }
-    if (base.metadata.has_fiducial_size) {
-        overlay.metadata.has_fiducial_size = true;
-        overlay.metadata.fiducial_size_value = base.metadata.fiducial_size_value;
-    }
-    if (base.metadata.has_fiducial_margin) {
-        overlay.metadata.has_fiducial_margin = true;
-        overlay.metadata.fiducial_margin_value = base.metadata.fiducial_margin_value;
+static void overlay_color_class_table_build(const OverlayIgnoreColorList* list,
+                                            OverlayColorClassTable& table) {
+    for (usize i = 0u; i < OverlayColorClassTable::SLOT_COUNT; ++i) {
+        table.slots[i] = OverlayColorClassTable::EMPTY_SLOT;
     }
-    if (base.metadata.has_fiducial_columns) {
-        overlay.metadata.has_fiducial_columns = true;
-        overlay.metadata.fiducial_columns_value = base.metadata.fiducial_columns_value;
+    table.count = 0u;
+    if (!list) {
+        return;
     }
-    if (base.metadata.has_fiducial_rows) {
-        overlay.metadata.has_fiducial_rows = true;
-        overlay.metadata.fiducial_rows_value = base.metadata.fiducial_rows_value;
+    for (usize i = 0u; i < list->count; ++i) {
+        const PaletteColor& color = list->colors[i];
+        u8 rgb[3] = {color.r, color.g, color.b};
+        u32 key = overlay_color_key(rgb);
+        usize slot = overlay_color_slot(key);
+        while (table.slots[slot] != OverlayColorClassTable::EMPTY_SLOT &&
+               table.slots[slot] != key) {
+            slot = (slot + 1u) & (OverlayColorClassTable::SLOT_COUNT - 1u);
+        }
+        if (table.slots[slot] == OverlayColorClassTable::EMPTY_SLOT) {
+            table.slots[slot] = key;
+            ++table.count;
+        }
     }
 }
 
-static bool overlay_ignore_char_is_delimiter(char c) {
-    switch (c) {
-        case ' ':
-        case '\t':
-        case '\n':
-        case '\r':
-        case ',':
-        case ';':
+static inline bool overlay_color_class_table_contains(const OverlayColorClassTable& table,
+                                                      u32 key) {
+    usize slot = overlay_color_slot(key);
+    for (;;) {
+        u32 entry = table.slots[slot];
+        if (entry == key) {
             return true;
-        default:
+        }
+        if (entry == OverlayColorClassTable::EMPTY_SLOT) {
             return false;
+        }
+        slot = (slot + 1u) & (OverlayColorClassTable::SLOT_COUNT - 1u);
     }
 }
 
-static bool overlay_color_matches_ignore(const OverlayIgnoreColorList& list,
-                                        u8 r,
-                                        u8 g,
-                                        u8 b) {
-    for (usize i = 0u; i < list.count; ++i) {
-        const PaletteColor& candidate = list.colors[i];
-        if (candidate.r == r && candidate.g == g && candidate.b == b) {
-            return true;
-        }
+struct OverlayBitPlanes {
+    u32 width;
+    u32 height;
+    usize word_count;
+    u64 candidate_count;
+    makocode::ByteBuffer base_free;       // base data pixels outside the base mask
+    makocode::ByteBuffer overlay_free;    // overlay data pixels outside the overlay mask
+    makocode::ByteBuffer ignored;         // base_free pixels whose overlay colour is ignored
+    makocode::ByteBuffer candidates;      // base_free & overlay_free & ~ignored
+    makocode::ByteBuffer candidate_ranks; // u64 per word: candidates in earlier words
+
+    OverlayBitPlanes()
+        : width(0u),
+          height(0u),
+          word_count(0u),
+          candidate_count(0u),
+          base_free(),
+          overlay_free(),
+          ignored(),
+          candidates(),
+          candidate_ranks() {}
+
+    ~OverlayBitPlanes() {
+        base_free.release();
+        overlay_free.release();
+        ignored.release();
+        candidates.release();
+        candidate_ranks.release();
     }
-    return false;
+};
+
+static inline const u64* overlay_plane_words(const makocode::ByteBuffer& plane) {
+    return (const u64*)plane.data;
 }
 
-static bool parse_overlay_ignore_colors(const char* text,
-                                        usize length,
-                                        OverlayIgnoreColorList& list) {
-    list.count = 0u;
-    if (!text || length == 0u) {
-        return true;
+static bool overlay_bit_planes_build(const OverlayPage& base_page,
+                                     const OverlayPage& overlay_page,
+                                     const makocode::ByteBuffer& base_mask,
+                                     const makocode::ByteBuffer& overlay_mask,
+                                     const OverlayIgnoreColorList* ignore_list,
+                                     OverlayBitPlanes& planes) {
+    planes.width = 0u;
+    planes.height = 0u;
+    planes.word_count = 0u;
+    planes.candidate_count = 0u;
+    if (!base_page.pixels.data || !overlay_page.pixels.data) {
+        return false;
     }
-    usize cursor = 0u;
-    while (cursor < length) {
-        while (cursor < length && overlay_ignore_char_is_delimiter(text[cursor])) {
-            ++cursor;
-        }
-        if (cursor >= length) {
-            break;
-        }
-        usize start = cursor;
-        while (cursor < length && !overlay_ignore_char_is_delimiter(text[cursor])) {
-            ++cursor;
-        }
-        usize token_length = cursor - start;
-        if (token_length == 0u) {
-            continue;
-        }
-        if (list.count >= MAX_OVERLAY_IGNORE_COLORS) {
-            console_line(2, "overlay: --ignore-colors supports at most 64 entries");
-            return false;
-        }
-        PaletteColor color;
-        u8 color_id = NAMED_COLOR_INVALID;
-        if (!decode_named_palette_color(text + start, token_length, color_id, color)) {
-            console_line(2, "overlay: --ignore-colors contains an invalid color");
-            return false;
-        }
-        bool duplicate = false;
-        for (usize i = 0u; i < list.count; ++i) {
-            if (palette_colors_equal(list.colors[i], color)) {
-                duplicate = true;
-                break;
+    if (base_page.width == 0u || base_page.height == 0u ||
+        base_page.width != overlay_page.width ||
+        base_page.height != overlay_page.height) {
+        return false;
+    }
+    usize total_pixels = (usize)base_page.width * (usize)base_page.height;
+    if (base_page.pixels.size < total_pixels * 3u ||
+        overlay_page.pixels.size < total_pixels * 3u) {
+        return false;
+    }
+    if ((base_mask.size && base_mask.size != total_pixels) ||
+        (overlay_mask.size && overlay_mask.size != total_pixels)) {
+        return false;
+    }
+    usize word_count = (total_pixels + 63u) >> 6u;
+    if (word_count > (SIZE_MAX / sizeof(u64))) {
+        return false;
+    }
+    usize plane_bytes = word_count * sizeof(u64);
+    makocode::ByteBuffer* plane_buffers[5] = {&planes.base_free,
+                                              &planes.overlay_free,
+                                              &planes.ignored,
+                                              &planes.candidates,
+                                              &planes.candidate_ranks};
+    for (usize i = 0u; i < 5u; ++i) {
+        if (!plane_buffers[i]->ensure(plane_bytes)) {
+            return false;
+        }
+        plane_buffers[i]->size = plane_bytes;
+    }
+    OverlayColorClassTable ignore_table;
+    overlay_color_class_table_build(ignore_list, ignore_table);
+    const bool filter_colors = (ignore_table.count > 0u);
+    u32 base_rows = (base_page.data_height < base_page.height) ? base_page.data_height : base_page.height;
+    u32 overlay_rows = (overlay_page.data_height < overlay_page.height) ? overlay_page.data_height
+                                                                        : overlay_page.height;
+    usize base_limit = (usize)base_rows * (usize)base_page.width;
+    usize overlay_limit = (usize)overlay_rows * (usize)overlay_page.width;
+    const u8* base_reserved = (base_mask.data && base_mask.size) ? base_mask.data : 0;
+    const u8* overlay_reserved = (overlay_mask.data && overlay_mask.size) ? overlay_mask.data : 0;
+    const u8* overlay_rgb = overlay_page.pixels.data;
+    u64* base_words = (u64*)planes.base_free.data;
+    u64* overlay_words = (u64*)planes.overlay_free.data;
+    u64* ignored_words = (u64*)planes.ignored.data;
+    u64* candidate_words = (u64*)planes.candidates.data;
+    u64* rank_words = (u64*)planes.candidate_ranks.data;
+    u32 last_key = OverlayColorClassTable::EMPTY_SLOT;
+    bool last_ignored = false;
+    u64 running = 0u;
+    for (usize word = 0u; word < word_count; ++word) {
+        usize first = word << 6u;
+        usize end = first + 64u;
+        if (end > total_pixels) {
+            end = total_pixels;
+        }
+        u64 base_bits = 0u;
+        u64 overlay_bits = 0u;
+        u64 ignored_bits = 0u;
+        for (usize pixel = first; pixel < end; ++pixel) {
+            u64 bit = 1ull << (pixel - first);
+            if (pixel < base_limit && !(base_reserved && base_reserved[pixel])) {
+                base_bits |= bit;
+                if (filter_colors) {
+                    u32 key = overlay_color_key(overlay_rgb + pixel * 3u);
+                    if (key != last_key) {
+                        last_key = key;
+                        last_ignored = overlay_color_class_table_contains(ignore_table, key);
+                    }
+                    if (last_ignored) {
+                        ignored_bits |= bit;
+                    }
+                }
+            }
+            if (pixel < overlay_limit && !(overlay_reserved && overlay_reserved[pixel])) {
+                overlay_bits |= bit;
             }
         }
-        if (duplicate) {
-            continue;
-        }
-        list.colors[list.count++] = color;
+        u64 candidate_bits = base_bits & overlay_bits & ~ignored_bits;
+        base_words[word] = base_bits;
+        overlay_words[word] = overlay_bits;
+        ignored_words[word] = ignored_bits;
+        candidate_words[word] = candidate_bits;
+        rank_words[word] = running;
+        running += (u64)__builtin_popcountll(candidate_bits);
     }
+    planes.width = base_page.width;
+    planes.height = base_page.height;
+    planes.word_count = word_count;
+    planes.candidate_count = running;
     return true;
 }
 
-static bool load_overlay_page(const char* path, OverlayPage& page) {
-    page.original.release();
-    page.pixels.release();
-    page.metadata = PpmParserState();
-    page.width = 0u;
-    page.height = 0u;
-    page.data_height = 0u;
-    page.footer_rows = 0u;
-    page.color_mode = 1u;
-    if (!path) {
-        console_line(2, "overlay: missing file path");
+static bool gather_overlay_bits(const OverlayPage& page,
+                                const OverlayBitPlanes& planes,
+                                const makocode::ByteBuffer& free_plane,
+                                makocode::ByteBuffer& bits_out,
+                                u64& bit_count) {
+    bit_count = 0u;
+    bits_out.release();
+    if (!page.pixels.data || page.pixels.size == 0u) {
         return false;
     }
-    if (!read_entire_file(path, page.original)) {
-        console_write(2, "overlay: failed to read ");
-        console_line(2, path);
+    if (page.width == 0u || page.height == 0u) {
         return false;
     }
-    if (!page.original.data || page.original.size == 0u) {
-        console_write(2, "overlay: empty file ");
-        console_line(2, path);
+    if (page.width != planes.width || page.height != planes.height ||
+        free_plane.size != planes.word_count * sizeof(u64)) {
         return false;
     }
-    PpmParserState state;
-    state.data = page.original.data;
-    state.size = page.original.size;
-    const char* token = 0;
-    usize token_length = 0u;
-    if (!ppm_next_token(state, &token, &token_length) ||
-        !ascii_equals_token(token, token_length, "P3")) {
-        console_write(2, "overlay: ");
-        console_write(2, path);
-        console_line(2, " is not a P3 ASCII PPM");
+    u8 sample_bits = bits_per_sample(page.color_mode);
+    u8 samples_per_pixel = color_mode_samples_per_pixel(page.color_mode);
+    if (sample_bits == 0u || samples_per_pixel == 0u) {
         return false;
     }
-    u64 width_value = 0u;
-    if (!ppm_next_token(state, &token, &token_length) ||
-        !ascii_to_u64(token, token_length, &width_value) ||
-        width_value == 0u ||
-        width_value > 0xFFFFFFFFull) {
-        console_write(2, "overlay: invalid width in ");
-        console_line(2, path);
+    u32 bits_per_pixel = (u32)sample_bits * (u32)samples_per_pixel;
+    if (bits_per_pixel > 8u) {
         return false;
     }
-    u64 height_value = 0u;
-    if (!ppm_next_token(state, &token, &token_length) ||
-        !ascii_to_u64(token, token_length, &height_value) ||
-        height_value == 0u ||
-        height_value > 0xFFFFFFFFull) {
-        console_write(2, "overlay: invalid height in ");
-        console_line(2, path);
+    const u64* words = overlay_plane_words(free_plane);
+    u64 pixel_count = 0u;
+    for (usize word = 0u; word < planes.word_count; ++word) {
+        pixel_count += (u64)__builtin_popcountll(words[word]);
+    }
+    u64 total_bytes = (pixel_count * (u64)bits_per_pixel + 7u) >> 3u;
+    if (total_bytes == 0u) {
+        return true;
+    }
+    if (total_bytes > (u64)USIZE_MAX_VALUE || !bits_out.ensure((usize)total_bytes)) {
+        return false;
+    }
+    bits_out.size = (usize)total_bytes;
+    u8* out = bits_out.data;
+    usize out_index = 0u;
+    u64 pending = 0u;
+    u32 pending_bits = 0u;
+    // Pages hold few distinct colours, so cache the palette search per colour
+    // in a direct-mapped table keyed like the ignore table.
+    u32 cached_keys[OverlayColorClassTable::SLOT_COUNT];
+    u8 cached_codes[OverlayColorClassTable::SLOT_COUNT];
+    for (usize i = 0u; i < OverlayColorClassTable::SLOT_COUNT; ++i) {
+        cached_keys[i] = OverlayColorClassTable::EMPTY_SLOT;
+        cached_codes[i] = 0u;
+    }
+    for (usize word = 0u; word < planes.word_count; ++word) {
+        u64 bits = words[word];
+        while (bits) {
+            usize pixel = (word << 6u) + (usize)__builtin_ctzll(bits);
+            bits &= bits - 1u;
+            const u8* rgb = page.pixels.data + pixel * 3u;
+            u32 key = overlay_color_key(rgb);
+            usize slot = overlay_color_slot(key);
+            if (cached_keys[slot] != key) {
+                u32 samples[3] = {0u, 0u, 0u};
+                if (!map_rgb_to_samples(page.color_mode, rgb, samples)) {
+                    return false;
+                }
+                u32 code = 0u;
+                for (u8 sample_idx = 0u; sample_idx < samples_per_pixel; ++sample_idx) {
+                    u32 sample = samples[sample_idx] & ((1u << sample_bits) - 1u);
+                    code |= sample << (sample_idx * sample_bits);
+                }
+                cached_keys[slot] = key;
+                cached_codes[slot] = (u8)code;
+            }
+            pending |= (u64)cached_codes[slot] << pending_bits;
+            pending_bits += bits_per_pixel;
+            if (pending_bits >= 56u) {
+                for (u32 i = 0u; i < 7u; ++i) {
+                    out[out_index++] = (u8)(pending >> (i * 8u));
+                }
+                pending >>= 56u;
+                pending_bits -= 56u;
+            }
+        }
+    }
+    while (pending_bits > 0u) {
+        out[out_index++] = (u8)pending;
+        pending >>= 8u;
+        pending_bits = (pending_bits > 8u) ? (pending_bits - 8u) : 0u;
+    }
+    if (page.color_mode == 3u) {
+        for (usize i = 0u; i < bits_out.size; ++i) {
+            u8 rotate = (u8)((i % 3u) + 1u);
+            out[i] = rotate_right_u8(out[i], rotate);
+        }
+    }
+    bit_count = (u64)bits_out.size * 8u;
+    return true;
+}
+
+static bool apply_overlay_bits(const makocode::ByteBuffer& bits,
+                               u64 bit_count,
+                               const OverlayBitPlanes& planes,
+                               OverlayPage& page) {
+    if (!page.pixels.data || page.pixels.size == 0u) {
         return false;
     }
-    u64 max_value = 0u;
-    if (!ppm_next_token(state, &token, &token_length) ||
-        !ascii_to_u64(token, token_length, &max_value) ||
-        max_value != 255u) {
-        console_write(2, "overlay: unsupported max pixel value in ");
-        console_line(2, path);
+    if (page.width == 0u || page.height == 0u) {
         return false;
     }
-    if (width_value == 0u || height_value == 0u) {
-        console_write(2, "overlay: zero dimension in ");
-        console_line(2, path);
+    if (page.width != planes.width || page.height != planes.height) {
         return false;
     }
-    if (width_value > (u64)USIZE_MAX_VALUE || height_value > (u64)USIZE_MAX_VALUE) {
-        console_write(2, "overlay: dimensions overflow in ");
-        console_line(2, path);
+    u8 sample_bits = bits_per_sample(page.color_mode);
+    u8 samples_per_pixel = color_mode_samples_per_pixel(page.color_mode);
+    if (sample_bits == 0u || samples_per_pixel == 0u) {
         return false;
     }
-    u64 pixel_count = width_value * height_value;
-    if (pixel_count == 0u || pixel_count > ((u64)USIZE_MAX_VALUE / 3u)) {
-        console_write(2, "overlay: pixel count overflow in ");
-        console_line(2, path);
+    u32 bits_per_pixel = (u32)sample_bits * (u32)samples_per_pixel;
+    if (bits_per_pixel > 8u) {
         return false;
     }
-    makocode::ByteBuffer pixel_data;
-    if (!ppm_read_rgb_pixels(state, pixel_count, pixel_data)) {
-        console_write(2, "overlay: failed to parse pixel data from ");
-        console_line(2, path);
-        return false;
+    const u8* bit_data = bits.data;
+    usize bit_data_size = bits.size;
+    makocode::ByteBuffer rotated;
+    if (page.color_mode == 3u && bits.size) {
+        if (!rotated.ensure(bits.size)) {
+            return false;
+        }
+        rotated.size = bits.size;
+        for (usize i = 0u; i < bits.size; ++i) {
+            u8 rotate = (u8)((i % 3u) + 1u);
+            rotated.data[i] = rotate_left_u8(bits.data[i], rotate);
+        }
+        bit_data = rotated.data;
+        bit_data_size = rotated.size;
+    }
+    // Every pixel code maps to a fixed colour, so resolve them all up front.
+    u32 code_count = 1u << bits_per_pixel;
+    u8 code_rgb[256][3];
+    bool code_valid[256];
+    for (u32 code = 0u; code < code_count; ++code) {
+        u32 samples[3] = {0u, 0u, 0u};
+        for (u8 sample_idx = 0u; sample_idx < samples_per_pixel; ++sample_idx) {
+            samples[sample_idx] = (code >> (sample_idx * sample_bits)) & ((1u << sample_bits) - 1u);
+        }
+        code_valid[code] = map_samples_to_rgb(page.color_mode, samples, code_rgb[code]);
+    }
+    const u32 code_mask = code_count - 1u;
+    const u64* free_words = overlay_plane_words(planes.base_free);
+    const u64* ignored_words = overlay_plane_words(planes.ignored);
+    u64 cursor = 0u;
+    for (usize word = 0u; word < planes.word_count; ++word) {
+        u64 free_bits = free_words[word];
+        u64 ignored_bits = ignored_words[word];
+        while (free_bits) {
+            u32 bit = (u32)__builtin_ctzll(free_bits);
+            free_bits &= free_bits - 1u;
+            u32 code = 0u;
+            if (cursor < bit_count && bit_data) {
+                usize byte_index = (usize)(cursor >> 3u);
+                if (byte_index < bit_data_size) {
+                    u32 window = bit_data[byte_index];
+                    if (byte_index + 1u < bit_data_size) {
+                        window |= (u32)bit_data[byte_index + 1u] << 8u;
+                    }
+                    code = (window >> (u32)(cursor & 7u)) & code_mask;
+                    u64 available = bit_count - cursor;
+                    if (available < (u64)bits_per_pixel) {
+                        code &= (1u << (u32)available) - 1u;
+                    }
+                }
+            }
+            cursor += bits_per_pixel;
+            if (!code_valid[code]) {
+                return false;
+            }
+            if ((ignored_bits >> bit) & 1u) {
+                continue;
+            }
+            u8* rgb = page.pixels.data + (((word << 6u) + (usize)bit) * 3u);
+            rgb[0] = code_rgb[code][0];
+            rgb[1] = code_rgb[code][1];
+            rgb[2] = code_rgb[code][2];
+        }
+    }
+    return true;
+}
+
+struct RawOverlayBlockTracker {
+    bool enabled;
+    bool limits_known;
+    bool hit_limit;
+    bool log_enabled;
+    u64 parity_symbols;
+    u64 block_total_symbols;
+    u64 block_count;
+    u64 block_limit_per_block;
+    u64 rs_region_start;
+    u64 rs_region_end;
+    u64 encoded_block_bytes;
+    u64 total_symbol_changes;
+    u64 max_block_errors;
+    u64 max_block_index;
+    u64 first_limit_block;
+    u64 first_limit_errors;
+    u64 rejected_changes;
+    bool interleaved;
+    makocode::EccInterleave interleave;
+    makocode::ByteBuffer counts;
+    makocode::ByteBuffer shuffle_map;
+    makocode::ByteBuffer symbol_marks;
+    makocode::ByteBuffer pending_symbols;
+    makocode::ByteBuffer pending_blocks;
+
+    RawOverlayBlockTracker()
+        : enabled(false),
+          limits_known(false),
+          hit_limit(false),
+          log_enabled(false),
+          parity_symbols(0u),
+          block_total_symbols(0u),
+          block_count(0u),
+          block_limit_per_block(0u),
+          rs_region_start(0u),
+          rs_region_end(0u),
+          encoded_block_bytes(0u),
+          total_symbol_changes(0u),
+          max_block_errors(0u),
+          max_block_index(0u),
+          first_limit_block(0u),
+          first_limit_errors(0u),
+          rejected_changes(0u),
+          interleaved(false),
+          interleave(),
+          counts(),
+          shuffle_map(),
+          symbol_marks(),
+          pending_symbols(),
+          pending_blocks() {}
+
+    ~RawOverlayBlockTracker() {
+        counts.release();
+        shuffle_map.release();
+        symbol_marks.release();
+        pending_symbols.release();
+        pending_blocks.release();
+    }
+};
+
+static void raw_overlay_tracker_init(const OverlayPage& base_page,
+                                     RawOverlayBlockTracker& tracker) {
+    tracker.enabled = false;
+    tracker.limits_known = false;
+    tracker.hit_limit = false;
+    tracker.log_enabled = false;
+    tracker.parity_symbols = 0u;
+    tracker.block_total_symbols = 0u;
+    tracker.block_count = 0u;
+    tracker.block_limit_per_block = 0u;
+    tracker.rs_region_start = 0u;
+    tracker.rs_region_end = 0u;
+    tracker.encoded_block_bytes = 0u;
+    tracker.total_symbol_changes = 0u;
+    tracker.max_block_errors = 0u;
+    tracker.max_block_index = 0u;
+    tracker.first_limit_block = 0u;
+    tracker.first_limit_errors = 0u;
+    tracker.rejected_changes = 0u;
+    tracker.interleaved = false;
+    tracker.counts.release();
+    tracker.shuffle_map.release();
+    tracker.symbol_marks.release();
+    tracker.pending_symbols.release();
+    tracker.pending_blocks.release();
+    const char* debug_env = getenv("MAKO_OVERLAY_DEBUG_RAW");
+    if (debug_env && debug_env[0]) {
+        tracker.log_enabled = true;
+    }
+    if (!base_page.metadata.has_ecc_block_data ||
+        !base_page.metadata.has_ecc_parity ||
+        !base_page.metadata.has_ecc_block_count) {
+        return;
+    }
+    u64 block_data_symbols = base_page.metadata.ecc_block_data_value;
+    u64 parity_symbols = base_page.metadata.ecc_parity_value;
+    u64 block_count = base_page.metadata.ecc_block_count_value;
+    if (block_data_symbols == 0u || parity_symbols == 0u || block_count == 0u) {
+        return;
+    }
+    if (block_data_symbols > (U64_MAX_VALUE - parity_symbols)) {
+        return;
+    }
+    u64 block_total_symbols = block_data_symbols + parity_symbols;
+    if (block_total_symbols == 0u) {
+        return;
+    }
+    u64 encoded_block_bytes = 0u;
+    if (block_total_symbols > (U64_MAX_VALUE / block_count)) {
+        return;
+    }
+    encoded_block_bytes = block_total_symbols * block_count;
+    const u64 payload_prefix_bytes = 8u;
+    const u64 header_span_bytes = (u64)makocode::ECC_HEADER_TOTAL_BYTES;
+    u64 rs_region_start = payload_prefix_bytes + header_span_bytes;
+    u64 rs_region_end = rs_region_start;
+    if (encoded_block_bytes > (U64_MAX_VALUE - rs_region_start)) {
+        rs_region_end = U64_MAX_VALUE;
+    } else {
+        rs_region_end = rs_region_start + encoded_block_bytes;
+    }
+    u64 base_bits = 0u;
+    if (base_page.metadata.has_bits) {
+        base_bits = base_page.metadata.bits_value;
+    }
+    u64 base_bytes = (base_bits + 7u) >> 3u;
+    if (!base_bytes) {
+        // Fall back to the stored MAKOCODE_BYTES metadata if available.
+        if (base_page.metadata.has_bytes) {
+            base_bytes = base_page.metadata.bytes_value;
+        }
+    }
+    if (!base_bytes) {
+        // Without a reliable byte count we cannot safely map symbols.
+        return;
     }
-    page.metadata = state;
-    page.metadata.data = 0;
-    page.metadata.size = 0u;
-    page.metadata.cursor = 0u;
-
-    // Prefer metadata tile (v3) for layout/ecc details now that footer stripes may be absent.
-    MetadataTile::Values tile_values = {};
-    makocode::ByteBuffer tile_palette_text;
-    MetadataTile::Placement placement = MetadataTile::compute_tile_placement((u32)width_value, (u32)height_value);
-    if (placement.valid) {
-        if (MetadataTile::decode_tile(pixel_data.data,
-                                      (u32)width_value,
-                                      (u32)height_value,
-                                      (u32)height_value,
-                                      placement,
-                                      tile_values,
-                                      tile_palette_text)) {
-            apply_metadata_tile_metadata(page.metadata, tile_values, tile_palette_text);
-        }
+    if (rs_region_start >= base_bytes) {
+        return;
     }
-
-    FooterStripe::Values stripe_values = {};
-    bool stripe_available = false;
-    if (kFooterStripeEnabled && width_value <= 0xFFFFFFFFull && height_value <= 0xFFFFFFFFull) {
-        stripe_available = FooterStripe::decode_v3(pixel_data.data,
-                                                   (u32)width_value,
-                                                   (u32)height_value,
-                                                   stripe_values);
-        if (!stripe_available) {
-            stripe_available = FooterStripe::decode(FooterStripe::SPEC_V2,
-                                                    pixel_data.data,
-                                                    (u32)width_value,
-                                                    (u32)height_value,
-                                                    stripe_values);
-        }
-        if (!stripe_available) {
-            stripe_available = FooterStripe::decode(FooterStripe::SPEC_V1,
-                                                    pixel_data.data,
-                                                    (u32)width_value,
-                                                    (u32)height_value,
-                                                    stripe_values);
-        }
+    if (rs_region_end > base_bytes) {
+        rs_region_end = base_bytes;
     }
-    if (stripe_available) {
-        page.metadata.has_footer_stripe = true;
-        page.metadata.footer_stripe_values = stripe_values;
-        apply_footer_stripe_metadata(page.metadata, stripe_values);
+    usize counter_bytes = 0u;
+    if (block_count > (U64_MAX_VALUE / (u64)sizeof(u32))) {
+        return;
     }
-
-    byte_buffer_move(page.pixels, pixel_data);
-    page.width = (u32)width_value;
-    page.height = (u32)height_value;
-
-    u32 footer_rows = 0u;
-    if (page.metadata.has_footer_rows) {
-        if (page.metadata.footer_rows_value > height_value) {
-            console_write(2, "overlay: footer metadata exceeds image height in ");
-            console_line(2, path);
-            return false;
-        }
-        footer_rows = (u32)page.metadata.footer_rows_value;
+    counter_bytes = (usize)(block_count * (u64)sizeof(u32));
+    if (counter_bytes == 0u) {
+        return;
     }
-    if (footer_rows > page.height) {
-        footer_rows = page.height;
+    if (!tracker.counts.ensure(counter_bytes)) {
+        return;
     }
-    page.footer_rows = footer_rows;
-    page.data_height = page.height - footer_rows;
-    if (page.data_height > page.height) {
-        page.data_height = page.height;
+    tracker.counts.size = counter_bytes;
+    for (usize i = 0u; i < counter_bytes; ++i) {
+        tracker.counts.data[i] = 0u;
     }
-    page.color_mode = 1u;
-    if (page.metadata.has_palette_base) {
-        const u64 palette_base = page.metadata.palette_base_value;
-        if (palette_base >= 8u) {
-            page.color_mode = 3u;
-        } else if (palette_base >= 4u) {
-            page.color_mode = 2u;
-        } else {
-            page.color_mode = 1u;
+    if (encoded_block_bytes == 0u) {
+        return;
+    }
+    if (base_page.metadata.ecc_interleaved) {
+        if (block_total_symbols > (u64)makocode::RS_FIELD_SIZE ||
+            !tracker.interleave.configure((u16)block_total_symbols, block_count)) {
+            return;
         }
-    } else if (page.pixels.data && page.pixels.size >= (usize)page.width * (usize)page.height * 3u) {
-        // When palette metadata is unavailable (e.g., synthetic overlay masks),
-        // infer whether the image uses chroma at all. Overlay behavior only
-        // needs a coarse "grayscale vs. color" distinction to decide between
-    // raw-pixel overlay and data-bit overlay. Avoid depending on container metadata
-        // comments, which are not preserved across print/scan workflows.
-        usize total_pixels = (usize)page.width * (usize)page.height;
-        bool has_color = false;
-        for (usize i = 0u; i < total_pixels; ++i) {
-            const u8* rgb = page.pixels.data + i * 3u;
-            if (rgb[0] != rgb[1] || rgb[1] != rgb[2]) {
-                has_color = true;
-                break;
-            }
+        tracker.interleaved = true;
+    } else {
+        if (encoded_block_bytes > (U64_MAX_VALUE / (u64)sizeof(usize))) {
+            return;
         }
-        if (has_color) {
-            page.color_mode = 2u;
+        usize shuffle_bytes = (usize)(encoded_block_bytes * (u64)sizeof(usize));
+        if (shuffle_bytes == 0u) {
+            return;
+        }
+        if (!tracker.shuffle_map.ensure(shuffle_bytes)) {
+            return;
         }
+        tracker.shuffle_map.size = shuffle_bytes;
+        usize* shuffle_ptr = (usize*)tracker.shuffle_map.data;
+        for (u64 entry = 0u; entry < encoded_block_bytes; ++entry) {
+            shuffle_ptr[entry] = (usize)entry;
+        }
+        makocode::Pcg64Generator rng;
+        rng.seed(0u);
+        for (u64 remaining = encoded_block_bytes; remaining > 1u; --remaining) {
+            usize i_map = (usize)(remaining - 1u);
+            u64 value = rng.next();
+            usize j_map = (usize)(value % (u64)(i_map + 1u));
+            usize temp = shuffle_ptr[i_map];
+            shuffle_ptr[i_map] = shuffle_ptr[j_map];
+            shuffle_ptr[j_map] = temp;
+        }
+    }
+    // One bit per encoded symbol, packed like the overlay pixel planes.
+    u64 mark_words = (encoded_block_bytes + 63u) >> 6u;
+    if (mark_words > (U64_MAX_VALUE / (u64)sizeof(u64)) ||
+        mark_words * (u64)sizeof(u64) > (u64)USIZE_MAX_VALUE) {
+        return;
     }
-    return true;
-}
-
-static bool build_overlay_mask(const OverlayPage& page,
-                               makocode::ByteBuffer& mask_out,
-                               u64& reserved_pixels) {
-    reserved_pixels = 0u;
-    mask_out.release();
-    if (page.width == 0u || page.height == 0u) {
-        return false;
+    usize mark_bytes = (usize)(mark_words * (u64)sizeof(u64));
+    if (!tracker.symbol_marks.ensure(mark_bytes)) {
+        return;
     }
-    u64 total_pixels = (u64)page.width * (u64)page.height;
-    if (!mask_out.ensure((usize)total_pixels)) {
-        return false;
+    tracker.symbol_marks.size = mark_bytes;
+    memset(tracker.symbol_marks.data, 0, mark_bytes);
+    tracker.enabled = true;
+    tracker.limits_known = true;
+    tracker.parity_symbols = parity_symbols;
+    tracker.block_total_symbols = block_total_symbols;
+    tracker.block_count = block_count;
+    tracker.block_limit_per_block = parity_symbols / 2u;
+    if (tracker.block_limit_per_block > 1u) {
+        tracker.block_limit_per_block = (tracker.block_limit_per_block * 2u) / 3u;
     }
-    mask_out.size = (usize)total_pixels;
-    for (usize i = 0u; i < mask_out.size; ++i) {
-        mask_out.data[i] = 0u;
+    if (tracker.block_limit_per_block == 0u) {
+        tracker.block_limit_per_block = 1u;
     }
-    if (page.data_height == 0u) {
+    tracker.rs_region_start = rs_region_start;
+    tracker.rs_region_end = rs_region_end;
+    tracker.encoded_block_bytes = encoded_block_bytes;
+}
+
+static bool raw_overlay_tracker_try_reserve_bytes(RawOverlayBlockTracker& tracker,
+                                                  u64 byte_start,
+                                                  u64 byte_end) {
+    if (!tracker.enabled || !tracker.limits_known) {
         return true;
     }
-    u32 marker_size = g_fiducial_defaults.marker_size_pixels;
-    if (page.metadata.has_fiducial_size && page.metadata.fiducial_size_value > 0u && page.metadata.fiducial_size_value <= 0xFFFFFFFFull) {
-        marker_size = (u32)page.metadata.fiducial_size_value;
+    if (byte_start >= byte_end) {
+        return true;
     }
-    if (marker_size == 0u) {
+    if (byte_end <= tracker.rs_region_start || byte_start >= tracker.rs_region_end) {
         return true;
     }
-    u32 draw_height = page.height;
-    if (page.data_height > 0u && page.data_height < page.height) {
-        draw_height = page.data_height;
+    if (byte_start < tracker.rs_region_start) {
+        byte_start = tracker.rs_region_start;
     }
-    u32 margin = g_fiducial_defaults.margin_pixels;
-    if (page.metadata.has_fiducial_margin && page.metadata.fiducial_margin_value <= 0xFFFFFFFFull) {
-        margin = (u32)page.metadata.fiducial_margin_value;
+    if (byte_end > tracker.rs_region_end) {
+        byte_end = tracker.rs_region_end;
     }
-    double min_x = (margin < page.width) ? (double)margin : 0.0;
-    double max_x = (page.width > margin)
-                       ? (double)(page.width - 1u - margin)
-                       : (page.width ? (double)(page.width - 1u) : 0.0);
-    if (max_x < min_x) {
-        max_x = min_x;
+    if (byte_start >= byte_end) {
+        return true;
     }
-    double min_y = (margin < draw_height) ? (double)margin : 0.0;
-    double max_y = (draw_height > margin)
-                       ? (double)(draw_height - 1u - margin)
-                       : (draw_height ? (double)(draw_height - 1u) : 0.0);
-    if (max_y < min_y) {
-        max_y = min_y;
+    u32* counts = (u32*)tracker.counts.data;
+    const usize* shuffle_ptr = tracker.shuffle_map.data
+                                   ? (const usize*)tracker.shuffle_map.data
+                                   : 0;
+    u64* mark_words = tracker.symbol_marks.data ? (u64*)tracker.symbol_marks.data : 0;
+    struct RawOverlayPendingSymbol {
+        u64 relative;
+        usize counter_index;
+        u64 block_index;
+    };
+    struct RawOverlayPendingBlock {
+        u64 block_index;
+        usize counter_index;
+        u32 pending;
+    };
+    usize span = (usize)(byte_end - byte_start);
+    if (span == 0u) {
+        return true;
     }
-    double available_width = (max_x >= min_x) ? (max_x - min_x) : 0.0;
-    double available_height = (max_y >= min_y) ? (max_y - min_y) : 0.0;
-    u32 columns = (page.metadata.has_fiducial_columns && page.metadata.fiducial_columns_value > 0u)
-                      ? (u32)page.metadata.fiducial_columns_value
-                      : 0u;
-    u32 rows = (page.metadata.has_fiducial_rows && page.metadata.fiducial_rows_value > 0u)
-                   ? (u32)page.metadata.fiducial_rows_value
-                   : 0u;
-    if (columns == 0u || rows == 0u) {
-        u32 spacing = g_fiducial_defaults.spacing_pixels;
-        if (spacing == 0u) {
-            spacing = marker_size ? marker_size : 1u;
+    // Single pixels span at most two bytes; keep their bookkeeping on the
+    // stack and only fall back to the tracker buffers for wide reservations.
+    const usize LOCAL_SPAN = 8u;
+    RawOverlayPendingSymbol local_symbols[LOCAL_SPAN];
+    RawOverlayPendingBlock local_blocks[LOCAL_SPAN];
+    RawOverlayPendingSymbol* pending_symbols = local_symbols;
+    RawOverlayPendingBlock* block_accums = local_blocks;
+    if (span > LOCAL_SPAN) {
+        if (span > (SIZE_MAX / sizeof(RawOverlayPendingSymbol))) {
+            return false;
         }
-        if (columns == 0u) {
-            columns = 1u;
-            if (spacing > 0u && available_width > 0.0) {
-                double span = available_width / (double)spacing;
-                if (span < 0.0) {
-                    span = 0.0;
-                }
-                u64 additional = (u64)span;
-                if (additional > 0xFFFFFFFFull - 1ull) {
-                    additional = 0xFFFFFFFFull - 1ull;
-                }
-                columns = (u32)(additional + 1ull);
+        usize pending_symbol_bytes = span * sizeof(RawOverlayPendingSymbol);
+        if (!tracker.pending_symbols.ensure(pending_symbol_bytes)) {
+            return false;
+        }
+        pending_symbols = (RawOverlayPendingSymbol*)tracker.pending_symbols.data;
+        if (span > (SIZE_MAX / sizeof(RawOverlayPendingBlock))) {
+            return false;
+        }
+        usize block_bytes = span * sizeof(RawOverlayPendingBlock);
+        if (!tracker.pending_blocks.ensure(block_bytes)) {
+            return false;
+        }
+        block_accums = (RawOverlayPendingBlock*)tracker.pending_blocks.data;
+    }
+    usize pending_symbol_count = 0u;
+    usize block_accum_count = 0u;
+    for (u64 byte_index = byte_start; byte_index < byte_end; ++byte_index) {
+        u64 relative = byte_index - tracker.rs_region_start;
+        if (relative >= tracker.encoded_block_bytes) {
+            continue;
+        }
+        if (mark_words && ((mark_words[relative >> 6u] >> (relative & 63u)) & 1u)) {
+            continue;
+        }
+        u64 block_index = 0u;
+        if (tracker.interleaved) {
+            u16 symbol_index = 0u;
+            tracker.interleave.locate(relative, block_index, symbol_index);
+        } else {
+            u64 original_index = shuffle_ptr ? (u64)shuffle_ptr[(usize)relative] : relative;
+            block_index = original_index / tracker.block_total_symbols;
+        }
+        if (block_index >= tracker.block_count) {
+            continue;
+        }
+        usize counter_index = (usize)block_index;
+        if (counter_index >= (tracker.counts.size / sizeof(u32))) {
+            continue;
+        }
+        RawOverlayPendingBlock* block_entry = 0;
+        for (usize i = 0u; i < block_accum_count; ++i) {
+            if (block_accums[i].block_index == block_index) {
+                block_entry = &block_accums[i];
+                break;
             }
         }
-        if (rows == 0u) {
-            rows = 1u;
-            if (spacing > 0u && available_height > 0.0) {
-                double span = available_height / (double)spacing;
-                if (span < 0.0) {
-                    span = 0.0;
-                }
-                u64 additional = (u64)span;
-                if (additional > 0xFFFFFFFFull - 1ull) {
-                    additional = 0xFFFFFFFFull - 1ull;
-                }
-                rows = (u32)(additional + 1ull);
+        if (!block_entry) {
+            if (block_accum_count >= span) {
+                return false;
             }
+            block_entry = &block_accums[block_accum_count++];
+            block_entry->block_index = block_index;
+            block_entry->counter_index = counter_index;
+            block_entry->pending = 0u;
         }
-        if (columns == 0u) {
-            columns = 1u;
+        u32 current_value = counts[counter_index];
+        u64 prospective = (u64)current_value + (u64)block_entry->pending + 1u;
+        if (prospective > tracker.block_limit_per_block) {
+            tracker.rejected_changes += 1u;
+            if (!tracker.hit_limit) {
+                tracker.hit_limit = true;
+                tracker.first_limit_block = block_index;
+                tracker.first_limit_errors = prospective;
+            }
+            return false;
         }
-        if (rows == 0u) {
-            rows = 1u;
+        RawOverlayPendingSymbol* symbol_entry = &pending_symbols[pending_symbol_count++];
+        symbol_entry->relative = relative;
+        symbol_entry->counter_index = counter_index;
+        symbol_entry->block_index = block_index;
+        block_entry->pending += 1u;
+    }
+    if (pending_symbol_count == 0u) {
+        return true;
+    }
+    for (usize i = 0u; i < pending_symbol_count; ++i) {
+        if (mark_words) {
+            u64 relative = pending_symbols[i].relative;
+            mark_words[relative >> 6u] |= 1ull << (relative & 63u);
         }
     }
-    for (u32 grid_row = 0u; grid_row < rows; ++grid_row) {
-        double t_y = (rows == 1u) ? 0.5 : ((double)grid_row / (double)(rows - 1u));
-        double center_y = min_y + (max_y - min_y) * t_y;
-        int start_y = (int)(center_y - ((double)marker_size - 1.0) * 0.5);
-        for (u32 grid_col = 0u; grid_col < columns; ++grid_col) {
-            double t_x = (columns == 1u) ? 0.5 : ((double)grid_col / (double)(columns - 1u));
-            double center_x = min_x + (max_x - min_x) * t_x;
-            int start_x = (int)(center_x - ((double)marker_size - 1.0) * 0.5);
-            for (u32 dy = 0u; dy < marker_size; ++dy) {
-                int pixel_y = start_y + (int)dy;
-                if (pixel_y < 0 || pixel_y >= (int)draw_height) {
-                    continue;
-                }
-                bool within_data = ((u32)pixel_y < page.data_height);
-                for (u32 dx = 0u; dx < marker_size; ++dx) {
-                    int pixel_x = start_x + (int)dx;
-                    if (pixel_x < 0 || pixel_x >= (int)page.width) {
-                        continue;
-                    }
-                    usize index = ((usize)pixel_y * (usize)page.width) + (usize)pixel_x;
-                    if (mask_out.data[index]) {
-                        continue;
-                    }
-                    mask_out.data[index] = 1u;
-                    if (within_data) {
-                        ++reserved_pixels;
-                    }
-                }
-            }
+    for (usize i = 0u; i < block_accum_count; ++i) {
+        RawOverlayPendingBlock& block_entry = block_accums[i];
+        u32* counter_ptr = counts + block_entry.counter_index;
+        u64 new_value = (u64)(*counter_ptr) + (u64)block_entry.pending;
+        if (new_value > 0xFFFFFFFFu) {
+            new_value = 0xFFFFFFFFu;
+        }
+        *counter_ptr = (u32)new_value;
+        tracker.total_symbol_changes += (u64)block_entry.pending;
+        if (new_value > tracker.max_block_errors) {
+            tracker.max_block_errors = new_value;
+            tracker.max_block_index = block_entry.block_index;
         }
     }
+    return true;
+}
 
-    // Protect the metadata tile region from overlays so pixel-carried metadata survives.
-    const char* disable_tile_env = getenv("MAKO_DISABLE_METADATA_TILE");
-    if (!(disable_tile_env && disable_tile_env[0]) &&
-        page.data_height >= MetadataTile::TILE_SIDE && page.width >= MetadataTile::TILE_SIDE) {
-        MetadataTile::Placement placement = MetadataTile::compute_tile_placement(page.width, page.data_height);
-        if (placement.valid) {
-            for (u32 dy = 0u; dy < MetadataTile::TILE_SIDE; ++dy) {
-                u32 y = placement.y0 + dy;
-                if (y >= page.data_height) continue;
-                for (u32 dx = 0u; dx < MetadataTile::TILE_SIDE; ++dx) {
-                    u32 x = placement.x0 + dx;
-                    if (x >= page.width) continue;
-                    usize index = (usize)y * (usize)page.width + (usize)x;
-                    if (mask_out.data[index]) {
-                        continue;
-                    }
-                    mask_out.data[index] = 1u;
-                    ++reserved_pixels;
-                }
-            }
-        }
+static bool raw_overlay_tracker_try_reserve_bits(RawOverlayBlockTracker& tracker,
+                                                 u64 bit_start,
+                                                 u64 bit_length) {
+    if (!tracker.enabled || bit_length == 0u) {
+        return true;
+    }
+    u64 bit_end = bit_start + bit_length;
+    if (bit_end < bit_start) {
+        return false;
+    }
+    u64 byte_start = bit_start >> 3u;
+    u64 byte_end = (bit_end + 7u) >> 3u;
+    return raw_overlay_tracker_try_reserve_bytes(tracker, byte_start, byte_end);
+}
+
+static bool count_overlay_byte_candidates(const OverlayBitPlanes& planes,
+                                          u8 color_mode,
+                                          u64& out_bytes) {
+    out_bytes = 0u;
+    u8 sample_bits = bits_per_sample(color_mode);
+    u8 samples_per_pixel = color_mode_samples_per_pixel(color_mode);
+    if (sample_bits == 0u || samples_per_pixel == 0u) {
+        return false;
+    }
+    u64 bits_per_pixel = (u64)sample_bits * (u64)samples_per_pixel;
+    u64 bit_count = U64_MAX_VALUE;
+    if (planes.candidate_count <= (U64_MAX_VALUE / bits_per_pixel)) {
+        bit_count = planes.candidate_count * bits_per_pixel;
     }
+    out_bytes = (bit_count >> 3u) + ((bit_count & 7u) ? 1u : 0u);
     return true;
 }
 
-static bool gather_overlay_bits(const OverlayPage& page,
-                                const makocode::ByteBuffer& mask,
-                                makocode::ByteBuffer& bits_out,
-                                u64& bit_count) {
-    bit_count = 0u;
-    bits_out.release();
-    if (!page.pixels.data || page.pixels.size == 0u) {
+static void raw_overlay_tracker_finish(const RawOverlayBlockTracker& tracker) {
+    if (!tracker.enabled || !tracker.log_enabled) {
+        return;
+    }
+    console_write(2, "overlay raw debug: blocks=");
+    char buffer[32];
+    u64_to_ascii(tracker.block_count, buffer, sizeof(buffer));
+    console_write(2, buffer);
+    console_write(2, " symbols_per_block=");
+    u64_to_ascii(tracker.block_total_symbols, buffer, sizeof(buffer));
+    console_write(2, buffer);
+    console_write(2, " parity=");
+    u64_to_ascii(tracker.parity_symbols, buffer, sizeof(buffer));
+    console_write(2, buffer);
+    console_write(2, " limit_per_block=");
+    u64_to_ascii(tracker.block_limit_per_block, buffer, sizeof(buffer));
+    console_write(2, buffer);
+    console_write(2, " total_symbol_changes=");
+    u64_to_ascii(tracker.total_symbol_changes, buffer, sizeof(buffer));
+    console_write(2, buffer);
+    console_write(2, " peak_block=");
+    u64_to_ascii(tracker.max_block_index, buffer, sizeof(buffer));
+    console_write(2, buffer);
+    console_write(2, " peak_errors=");
+    u64_to_ascii(tracker.max_block_errors, buffer, sizeof(buffer));
+    console_write(2, buffer);
+    console_write(2, " rejected_changes=");
+    u64_to_ascii(tracker.rejected_changes, buffer, sizeof(buffer));
+    console_write(2, buffer);
+    if (tracker.hit_limit) {
+        console_write(2, " first_limit_block=");
+        u64_to_ascii(tracker.first_limit_block, buffer, sizeof(buffer));
+        console_write(2, buffer);
+        console_write(2, " first_limit_errors=");
+        u64_to_ascii(tracker.first_limit_errors, buffer, sizeof(buffer));
+        console_write(2, buffer);
+    }
+    console_line(2, "");
+}
+
+static bool apply_overlay_pixels_raw(const OverlayPage& overlay_page,
+                                     const OverlayBitPlanes& planes,
+                                     u64 numerator,
+                                     u64 denominator,
+                                     OverlayPage& base_page) {
+    RawOverlayBlockTracker tracker;
+    raw_overlay_tracker_init(base_page, tracker);
+    if (!base_page.pixels.data || !overlay_page.pixels.data) {
         return false;
     }
-    if (page.width == 0u || page.height == 0u) {
+    if (base_page.width != overlay_page.width ||
+        base_page.height != overlay_page.height ||
+        base_page.width != planes.width ||
+        base_page.height != planes.height) {
         return false;
     }
-    if (mask.size && mask.size != (usize)page.width * (usize)page.height) {
+    if (denominator == 0u) {
         return false;
     }
-    u8 sample_bits = bits_per_sample(page.color_mode);
-    u8 samples_per_pixel = color_mode_samples_per_pixel(page.color_mode);
+    usize total_pixels = (usize)base_page.width * (usize)base_page.height;
+    if (base_page.pixels.size < total_pixels * 3u ||
+        overlay_page.pixels.size < total_pixels * 3u) {
+        return false;
+    }
+    if (planes.candidate_count == 0u) {
+        return true;
+    }
+    u8 sample_bits = bits_per_sample(base_page.color_mode);
+    u8 samples_per_pixel = color_mode_samples_per_pixel(base_page.color_mode);
     if (sample_bits == 0u || samples_per_pixel == 0u) {
         return false;
     }
-    makocode::BitWriter writer;
-    for (u32 row = 0u; row < page.data_height; ++row) {
-        for (u32 column = 0u; column < page.width; ++column) {
-            bool reserved = false;
-            if (mask.data && mask.size) {
-                usize index = ((usize)row * (usize)page.width) + (usize)column;
-                reserved = (mask.data[index] != 0u);
-            }
-            if (reserved) {
-                continue;
-            }
-            usize pixel_index = (((usize)row * (usize)page.width) + (usize)column) * 3u;
-            if ((pixel_index + 2u) >= page.pixels.size) {
-                return false;
-            }
-            u32 samples[3] = {0u, 0u, 0u};
-            if (!map_rgb_to_samples(page.color_mode, page.pixels.data + pixel_index, samples)) {
-                return false;
+    u64 bits_per_pixel = (u64)sample_bits * (u64)samples_per_pixel;
+    // Candidates are stored as bare 32-bit pixel indices; a pixel's position
+    // in the bitstream is its rank among candidates, which the per-word prefix
+    // counts recover with one popcount when the ECC tracker needs it.
+    if (total_pixels > 0xFFFFFFFFull ||
+        planes.candidate_count > (u64)(SIZE_MAX / sizeof(u32))) {
+        return false;
+    }
+    usize candidate_count = (usize)planes.candidate_count;
+    makocode::ByteBuffer candidate_buffer;
+    if (!candidate_buffer.ensure(candidate_count * sizeof(u32))) {
+        return false;
+    }
+    u32* candidates = (u32*)candidate_buffer.data;
+    const u64* candidate_words = overlay_plane_words(planes.candidates);
+    const u64* rank_words = overlay_plane_words(planes.candidate_ranks);
+    usize fill = 0u;
+    for (usize word = 0u; word < planes.word_count; ++word) {
+        u64 bits = candidate_words[word];
+        while (bits) {
+            candidates[fill++] = (u32)((word << 6u) + (usize)__builtin_ctzll(bits));
+            bits &= bits - 1u;
+        }
+    }
+    const usize LOOKAHEAD = 16u;
+    if (candidate_count > 1u) {
+        // A photo-sized shuffle is bound by cache misses on candidates[j], so
+        // draw swap targets LOOKAHEAD steps early and prefetch them. The RNG
+        // is still consumed in descending `remaining` order.
+        makocode::Pcg64Generator shuffle_rng;
+        shuffle_rng.seed(0u);
+        usize targets[LOOKAHEAD];
+        usize next_draw = candidate_count;
+        auto draw_target = [&](usize slot) {
+            u64 value = shuffle_rng.next();
+            targets[slot] = (usize)(value % (u64)next_draw);
+            __builtin_prefetch(candidates + targets[slot], 1);
+            --next_draw;
+        };
+        for (usize slot = 0u; slot < LOOKAHEAD && next_draw > 1u; ++slot) {
+            draw_target(slot);
+        }
+        for (usize remaining = candidate_count; remaining > 1u; --remaining) {
+            usize slot = (candidate_count - remaining) % LOOKAHEAD;
+            usize i = remaining - 1u;
+            usize j = targets[slot];
+            u32 temp = candidates[i];
+            candidates[i] = candidates[j];
+            candidates[j] = temp;
+            if (next_draw > 1u) {
+                draw_target(slot);
             }
-            for (u8 sample_idx = 0u; sample_idx < samples_per_pixel; ++sample_idx) {
-                if (!writer.write_bits(samples[sample_idx], sample_bits)) {
-                    return false;
-                }
+        }
+    }
+    if (!tracker.enabled && candidate_count > 0u) {
+        u64 requested = (u64)candidate_count;
+        requested *= numerator;
+        requested /= denominator;
+        u64 cap = (u64)candidate_count / 50u; // ~2% of candidates when ECC metadata is unknown.
+        if (cap == 0u) {
+            cap = 1u;
+        }
+        if (requested > cap) {
+            numerator = cap;
+            denominator = (u64)candidate_count;
+            if (numerator == 0u) {
+                numerator = 1u;
             }
         }
     }
-    if (!writer.align_to_byte()) {
+    // Copying an unchanged pixel is a no-op, and only changed pixels consult
+    // the tracker, so classify changes in one sequential sweep. The shuffled
+    // walk then touches only the packed planes, and the chosen pixels are
+    // copied in raster order afterwards.
+    makocode::ByteBuffer changed_plane;
+    makocode::ByteBuffer apply_plane;
+    usize plane_bytes = planes.word_count * sizeof(u64);
+    if (!changed_plane.ensure(plane_bytes) || !apply_plane.ensure(plane_bytes)) {
         return false;
     }
-    if (page.color_mode == 3u) {
-        usize total_bytes = writer.byte_size();
-        if (total_bytes && writer.buffer.data) {
-            for (usize i = 0u; i < total_bytes; ++i) {
-                u8 rotate = (u8)((i % 3u) + 1u);
-                writer.buffer.data[i] = rotate_right_u8(writer.buffer.data[i], rotate);
+    changed_plane.size = plane_bytes;
+    apply_plane.size = plane_bytes;
+    u64* changed_words = (u64*)changed_plane.data;
+    u64* apply_words = (u64*)apply_plane.data;
+    const u8* base_rgb = base_page.pixels.data;
+    const u8* overlay_rgb = overlay_page.pixels.data;
+    for (usize word = 0u; word < planes.word_count; ++word) {
+        u64 bits = candidate_words[word];
+        u64 changed_bits = 0u;
+        while (bits) {
+            u32 bit = (u32)__builtin_ctzll(bits);
+            bits &= bits - 1u;
+            usize byte_index = ((word << 6u) + (usize)bit) * 3u;
+            if (base_rgb[byte_index + 0u] != overlay_rgb[byte_index + 0u] ||
+                base_rgb[byte_index + 1u] != overlay_rgb[byte_index + 1u] ||
+                base_rgb[byte_index + 2u] != overlay_rgb[byte_index + 2u]) {
+                changed_bits |= 1ull << bit;
+            }
+        }
+        changed_words[word] = changed_bits;
+        apply_words[word] = 0u;
+    }
+    u64 accumulator = 0u;
+    for (usize idx = 0u; idx < candidate_count; ++idx) {
+        accumulator += numerator;
+        if (accumulator < denominator) {
+            continue;
+        }
+        accumulator -= denominator;
+        usize pixel_index = candidates[idx];
+        usize word = pixel_index >> 6u;
+        u64 bit = 1ull << (pixel_index & 63u);
+        if (!(changed_words[word] & bit)) {
+            continue;
+        }
+        if (tracker.enabled) {
+            u64 below = candidate_words[word] & (bit - 1u);
+            u64 rank = rank_words[word] + (u64)__builtin_popcountll(below);
+            if (!raw_overlay_tracker_try_reserve_bits(tracker, rank * bits_per_pixel, bits_per_pixel)) {
+                continue;
             }
         }
+        apply_words[word] |= bit;
     }
-    bit_count = writer.bit_size();
-    byte_buffer_move(bits_out, writer.buffer);
+    for (usize word = 0u; word < planes.word_count; ++word) {
+        u64 bits = apply_words[word];
+        while (bits) {
+            usize byte_index = ((word << 6u) + (usize)__builtin_ctzll(bits)) * 3u;
+            bits &= bits - 1u;
+            memcpy(base_page.pixels.data + byte_index, overlay_rgb + byte_index, 3u);
+        }
+    }
+    raw_overlay_tracker_finish(tracker);
     return true;
 }
 
-static bool apply_overlay_bits(const makocode::ByteBuffer& bits,
-                               u64 bit_count,
-                               const makocode::ByteBuffer& mask,
-                               OverlayPage& page,
-                               const OverlayPage* overlay_page,
-                               const OverlayIgnoreColorList* ignore_list) {
-    if (!page.pixels.data || page.pixels.size == 0u) {
-        return false;
-    }
-    if (page.width == 0u || page.height == 0u) {
+static bool serialize_overlay_page(const OverlayPage& page,
+                                   makocode::ByteBuffer& output) {
+    output.release();
+    if (!page.pixels.data) {
         return false;
     }
-    if (mask.size && mask.size != (usize)page.width * (usize)page.height) {
+    usize total_pixels = (usize)page.width * (usize)page.height;
+    if (page.pixels.size < total_pixels * 3u) {
         return false;
     }
-    u8 sample_bits = bits_per_sample(page.color_mode);
-    u8 samples_per_pixel = color_mode_samples_per_pixel(page.color_mode);
-    if (sample_bits == 0u || samples_per_pixel == 0u) {
-        return false;
+    return ppm_write_raster(page.metadata, page.width, page.height, page.pixels.data, output);
+}
+
+static bool write_buffer_to_fd(int fd, const makocode::ByteBuffer& buffer) {
+    if (!buffer.data || buffer.size == 0u) {
+        return true;
     }
-    const u8* bit_data = bits.data;
-    usize bit_data_size = bits.size;
-    makocode::ByteBuffer rotated;
-    if (page.color_mode == 3u && bits.size) {
-        if (!rotated.ensure(bits.size)) {
-            return false;
-        }
-        rotated.size = bits.size;
-        for (usize i = 0u; i < bits.size; ++i) {
-            u8 rotate = (u8)((i % 3u) + 1u);
-            rotated.data[i] = rotate_left_u8(bits.data[i], rotate);
+    usize offset = 0u;
+    while (offset < buffer.size) {
+        unsigned long chunk = (unsigned long)(buffer.size - offset);
+        if (chunk > 65536ul) {
+            chunk = 65536ul;
         }
-        bit_data = rotated.data;
-        bit_data_size = rotated.size;
-    }
-    const bool filter_overlay_colors = (ignore_list && overlay_page && overlay_page->pixels.data);
-    if (filter_overlay_colors) {
-        if (overlay_page->width != page.width || overlay_page->height != page.height) {
+        int wrote = write(fd, buffer.data + offset, chunk);
+        if (wrote <= 0) {
             return false;
         }
+        offset += (usize)wrote;
     }
-    u64 cursor = 0u;
-    for (u32 row = 0u; row < page.data_height; ++row) {
-        for (u32 column = 0u; column < page.width; ++column) {
-            bool reserved = false;
-            if (mask.data && mask.size) {
-                usize index = ((usize)row * (usize)page.width) + (usize)column;
-                reserved = (mask.data[index] != 0u);
-            }
-            if (reserved) {
-                continue;
-            }
+    return true;
+}
 
-            bool skip_overlay_pixel = false;
-            if (filter_overlay_colors) {
-                usize overlay_index = (((usize)row * (usize)overlay_page->width) + (usize)column) * 3u;
-                if ((overlay_index + 2u) >= overlay_page->pixels.size) {
-                    return false;
-                }
-                u8 overlay_r = overlay_page->pixels.data[overlay_index + 0u];
-                u8 overlay_g = overlay_page->pixels.data[overlay_index + 1u];
-                u8 overlay_b = overlay_page->pixels.data[overlay_index + 2u];
-                if (overlay_color_matches_ignore(*ignore_list, overlay_r, overlay_g, overlay_b)) {
-                    skip_overlay_pixel = true;
-                }
-            }
-            u32 samples[3] = {0u, 0u, 0u};
-            for (u8 sample_idx = 0u; sample_idx < samples_per_pixel; ++sample_idx) {
-                u32 value = 0u;
-                for (u8 bit = 0u; bit < sample_bits; ++bit) {
-                    u8 bit_value = 0u;
-                    if (cursor < bit_count && bit_data) {
-                        usize byte_index = (usize)(cursor >> 3u);
-                        if (byte_index < bit_data_size) {
-                            u8 mask_bit = (u8)(1u << (cursor & 7u));
-                            bit_value = (bit_data[byte_index] & mask_bit) ? 1u : 0u;
-                        }
-                    }
-                    value |= ((u32)bit_value) << bit;
-                    ++cursor;
-                }
-                samples[sample_idx] = value;
+static int command_overlay(int arg_count, char** args) {
+    if (arguments_request_help(arg_count, args)) {
+        write_overlay_help();
+        return 0;
+    }
+    OverlayIgnoreColorList ignore_colors;
+    ignore_colors.count = 0u;
+    const char* ignore_text = 0;
+    usize ignore_length = 0u;
+    bool ignore_specified = false;
+    bool ecc_target_specified = false;
+    u64 ecc_target_numerator = 0u;
+    u64 ecc_target_denominator = 1u;
+    int option_index = 0;
+    const char ignore_option[] = "--ignore-colors";
+    const char ignore_prefix[] = "--ignore-colors=";
+    const char ecc_target_option[] = "--overlay-ecc-target";
+    const char ecc_target_prefix[] = "--overlay-ecc-target=";
+    while (option_index < arg_count) {
+        const char* arg = args[option_index];
+        if (!arg) {
+            ++option_index;
+            continue;
+        }
+        if (consume_debug_flag(arg)) {
+            ++option_index;
+            continue;
+        }
+        usize length = ascii_length(arg);
+        if (ascii_equals_token(arg, length, ignore_option)) {
+            if (ignore_specified) {
+                console_line(2, "overlay: --ignore-colors specified multiple times");
+                return 1;
             }
-            u8 rgb[3];
-            if (!map_samples_to_rgb(page.color_mode, samples, rgb)) {
-                return false;
+            if ((option_index + 1) >= arg_count) {
+                console_line(2, "overlay: --ignore-colors requires a value");
+                return 1;
             }
-            usize pixel_index = (((usize)row * (usize)page.width) + (usize)column) * 3u;
-            if ((pixel_index + 2u) >= page.pixels.size) {
-                return false;
+            const char* value = args[option_index + 1];
+            if (!value) {
+                console_line(2, "overlay: --ignore-colors requires a value");
+                return 1;
             }
-            if (skip_overlay_pixel) {
-                continue;
+            usize value_length = ascii_length(value);
+            if (value_length == 0u) {
+                console_line(2, "overlay: --ignore-colors requires a non-empty value");
+                return 1;
             }
-            page.pixels.data[pixel_index + 0u] = rgb[0];
-            page.pixels.data[pixel_index + 1u] = rgb[1];
-            page.pixels.data[pixel_index + 2u] = rgb[2];
+            ignore_text = value;
+            ignore_length = value_length;
+            ignore_specified = true;
+            option_index += 2;
+            continue;
         }
-    }
-    return true;
-}
-
-struct RawOverlayBlockTracker {
-    bool enabled;
-    bool limits_known;
-    bool hit_limit;
-    bool log_enabled;
-    u64 parity_symbols;
-    u64 block_total_symbols;
-    u64 block_count;
-    u64 block_limit_per_block;
-    u64 rs_region_start;
-    u64 rs_region_end;
-    u64 encoded_block_bytes;
-    u64 total_symbol_changes;
-    u64 max_block_errors;
-    u64 max_block_index;
-    u64 first_limit_block;
-    u64 first_limit_errors;
-    u64 rejected_changes;
-    makocode::ByteBuffer counts;
-    makocode::ByteBuffer shuffle_map;
-    makocode::ByteBuffer symbol_marks;
-    makocode::ByteBuffer pending_symbols;
-    makocode::ByteBuffer pending_blocks;
-
-    RawOverlayBlockTracker()
-        : enabled(false),
-          limits_known(false),
-          hit_limit(false),
-          log_enabled(false),
-          parity_symbols(0u),
-          block_total_symbols(0u),
-          block_count(0u),
-          block_limit_per_block(0u),
-          rs_region_start(0u),
-          rs_region_end(0u),
-          encoded_block_bytes(0u),
-          total_symbol_changes(0u),
-          max_block_errors(0u),
-          max_block_index(0u),
-          first_limit_block(0u),
-          first_limit_errors(0u),
-          rejected_changes(0u),
-          counts(),
-          shuffle_map(),
-          symbol_marks(),
-          pending_symbols(),
-          pending_blocks() {}
-
-    ~RawOverlayBlockTracker() {
-        counts.release();
-        shuffle_map.release();
-        symbol_marks.release();
-        pending_symbols.release();
-        pending_blocks.release();
-    }
-};
-
-static void raw_overlay_tracker_init(const OverlayPage& base_page,
-                                     RawOverlayBlockTracker& tracker) {
-    tracker.enabled = false;
-    tracker.limits_known = false;
-    tracker.hit_limit = false;
-    tracker.log_enabled = false;
-    tracker.parity_symbols = 0u;
-    tracker.block_total_symbols = 0u;
-    tracker.block_count = 0u;
-    tracker.block_limit_per_block = 0u;
-    tracker.rs_region_start = 0u;
-    tracker.rs_region_end = 0u;
-    tracker.encoded_block_bytes = 0u;
-    tracker.total_symbol_changes = 0u;
-    tracker.max_block_errors = 0u;
-    tracker.max_block_index = 0u;
-    tracker.first_limit_block = 0u;
-    tracker.first_limit_errors = 0u;
-    tracker.rejected_changes = 0u;
-    tracker.counts.release();
-    tracker.shuffle_map.release();
-    tracker.symbol_marks.release();
-    tracker.pending_symbols.release();
-    tracker.pending_blocks.release();
-    const char* debug_env = getenv("MAKO_OVERLAY_DEBUG_RAW");
-    if (debug_env && debug_env[0]) {
-        tracker.log_enabled = true;
-    }
-    if (!base_page.metadata.has_ecc_block_data ||
-        !base_page.metadata.has_ecc_parity ||
-        !base_page.metadata.has_ecc_block_count) {
-        return;
-    }
-    u64 block_data_symbols = base_page.metadata.ecc_block_data_value;
-    u64 parity_symbols = base_page.metadata.ecc_parity_value;
-    u64 block_count = base_page.metadata.ecc_block_count_value;
-    if (block_data_symbols == 0u || parity_symbols == 0u || block_count == 0u) {
-        return;
-    }
-    if (block_data_symbols > (U64_MAX_VALUE - parity_symbols)) {
-        return;
-    }
-    u64 block_total_symbols = block_data_symbols + parity_symbols;
-    if (block_total_symbols == 0u) {
-        return;
-    }
-    u64 encoded_block_bytes = 0u;
-    if (block_total_symbols > (U64_MAX_VALUE / block_count)) {
-        return;
-    }
-    encoded_block_bytes = block_total_symbols * block_count;
-    const u64 payload_prefix_bytes = 8u;
-    const u64 header_span_bytes = (u64)makocode::ECC_HEADER_TOTAL_BYTES;
-    u64 rs_region_start = payload_prefix_bytes + header_span_bytes;
-    u64 rs_region_end = rs_region_start;
-    if (encoded_block_bytes > (U64_MAX_VALUE - rs_region_start)) {
-        rs_region_end = U64_MAX_VALUE;
-    } else {
-        rs_region_end = rs_region_start + encoded_block_bytes;
-    }
-    u64 base_bits = 0u;
-    if (base_page.metadata.has_bits) {
-        base_bits = base_page.metadata.bits_value;
-    }
-    u64 base_bytes = (base_bits + 7u) >> 3u;
-    if (!base_bytes) {
-        // Fall back to the stored MAKOCODE_BYTES metadata if available.
-        if (base_page.metadata.has_bytes) {
-            base_bytes = base_page.metadata.bytes_value;
+        if (ascii_starts_with(arg, ignore_prefix)) {
+            if (ignore_specified) {
+                console_line(2, "overlay: --ignore-colors specified multiple times");
+                return 1;
+            }
+            const char* value = arg + (sizeof(ignore_prefix) - 1u);
+            if (!value || *value == '\0') {
+                console_line(2, "overlay: --ignore-colors requires a non-empty value");
+                return 1;
+            }
+            ignore_text = value;
+            ignore_length = ascii_length(value);
+            ignore_specified = true;
+            ++option_index;
+            continue;
         }
+        if (ascii_equals_token(arg, length, ecc_target_option)) {
+            if (ecc_target_specified) {
+                console_line(2, "overlay: --overlay-ecc-target specified multiple times");
+                return 1;
+            }
+            if ((option_index + 1) >= arg_count) {
+                console_line(2, "overlay: --overlay-ecc-target requires a value");
+                return 1;
+            }
+            const char* value = args[option_index + 1];
+            if (!value) {
+                console_line(2, "overlay: --overlay-ecc-target requires a value");
+                return 1;
+            }
+            usize value_length = ascii_length(value);
+            if (value_length == 0u) {
+                console_line(2, "overlay: --overlay-ecc-target requires a non-empty value");
+                return 1;
+            }
+            if (!ascii_to_fraction(value, value_length, ecc_target_numerator, ecc_target_denominator)) {
+                console_line(2, "overlay: --overlay-ecc-target requires a decimal value such as 0.5");
+                return 1;
+            }
+            if (ecc_target_denominator == 0u) {
+                console_line(2, "overlay: --overlay-ecc-target requires a non-zero denominator");
+                return 1;
+            }
+            ecc_target_specified = true;
+            option_index += 2;
+            continue;
+        }
+        if (ascii_starts_with(arg, ecc_target_prefix)) {
+            if (ecc_target_specified) {
+                console_line(2, "overlay: --overlay-ecc-target specified multiple times");
+                return 1;
+            }
+            const char* value = arg + (sizeof(ecc_target_prefix) - 1u);
+            if (!value || *value == '\0') {
+                console_line(2, "overlay: --overlay-ecc-target requires a non-empty value");
+                return 1;
+            }
+            if (!ascii_to_fraction(value, ascii_length(value), ecc_target_numerator, ecc_target_denominator)) {
+                console_line(2, "overlay: --overlay-ecc-target requires a decimal value such as 0.5");
+                return 1;
+            }
+            if (ecc_target_denominator == 0u) {
+                console_line(2, "overlay: --overlay-ecc-target requires a non-zero denominator");
+                return 1;
+            }
+            ecc_target_specified = true;
+            ++option_index;
+            continue;
+        }
+        if (ascii_starts_with(arg, "--")) {
+            console_write(2, "overlay: unknown option: ");
+            console_line(2, arg);
+            return 1;
+        }
+        break;
     }
-    if (!base_bytes) {
-        // Without a reliable byte count we cannot safely map symbols.
-        return;
-    }
-    if (rs_region_start >= base_bytes) {
-        return;
-    }
-    if (rs_region_end > base_bytes) {
-        rs_region_end = base_bytes;
-    }
-    usize counter_bytes = 0u;
-    if (block_count > (U64_MAX_VALUE / (u64)sizeof(u32))) {
-        return;
-    }
-    counter_bytes = (usize)(block_count * (u64)sizeof(u32));
-    if (counter_bytes == 0u) {
-        return;
-    }
-    if (!tracker.counts.ensure(counter_bytes)) {
-        return;
-    }
-    tracker.counts.size = counter_bytes;
-    for (usize i = 0u; i < counter_bytes; ++i) {
-        tracker.counts.data[i] = 0u;
-    }
-    if (encoded_block_bytes == 0u) {
-        return;
-    }
-    if (encoded_block_bytes > (U64_MAX_VALUE / (u64)sizeof(usize))) {
-        return;
-    }
-    usize shuffle_bytes = (usize)(encoded_block_bytes * (u64)sizeof(usize));
-    if (shuffle_bytes == 0u) {
-        return;
-    }
-    if (!tracker.shuffle_map.ensure(shuffle_bytes)) {
-        return;
-    }
-    tracker.shuffle_map.size = shuffle_bytes;
-    usize* shuffle_ptr = (usize*)tracker.shuffle_map.data;
-    for (u64 entry = 0u; entry < encoded_block_bytes; ++entry) {
-        shuffle_ptr[entry] = (usize)entry;
-    }
-    makocode::Pcg64Generator rng;
-    rng.seed(0u);
-    for (u64 remaining = encoded_block_bytes; remaining > 1u; --remaining) {
-        usize i_map = (usize)(remaining - 1u);
-        u64 value = rng.next();
-        usize j_map = (usize)(value % (u64)(i_map + 1u));
-        usize temp = shuffle_ptr[i_map];
-        shuffle_ptr[i_map] = shuffle_ptr[j_map];
-        shuffle_ptr[j_map] = temp;
-    }
-    if (!tracker.symbol_marks.ensure((usize)encoded_block_bytes)) {
-        return;
+    int positional_count = arg_count - option_index;
+    if (positional_count != 3) {
+        console_line(2, "overlay: usage: makocode overlay [--ignore-colors COLORS] [--overlay-ecc-target TARGET] BASE.ppm OVERLAY.ppm FRACTION");
+        return 1;
     }
-    tracker.symbol_marks.size = (usize)encoded_block_bytes;
-    for (u64 entry = 0u; entry < encoded_block_bytes; ++entry) {
-        tracker.symbol_marks.data[entry] = 0u;
+    const char* base_path = args[option_index];
+    const char* overlay_path = args[option_index + 1];
+    const char* fraction_text = args[option_index + 2];
+    if (ignore_specified) {
+        if (!parse_overlay_ignore_colors(ignore_text, ignore_length, ignore_colors)) {
+            return 1;
+        }
     }
-    tracker.enabled = true;
-    tracker.limits_known = true;
-    tracker.parity_symbols = parity_symbols;
-    tracker.block_total_symbols = block_total_symbols;
-    tracker.block_count = block_count;
-    tracker.block_limit_per_block = parity_symbols / 2u;
-    if (tracker.block_limit_per_block > 1u) {
-        tracker.block_limit_per_block = (tracker.block_limit_per_block * 2u) / 3u;
+    const OverlayIgnoreColorList* overlay_ignore = (ignore_colors.count > 0u) ? &ignore_colors : 0;
+    if (!base_path || !overlay_path || !fraction_text) {
+        console_line(2, "overlay: arguments may not be empty");
+        return 1;
     }
-    if (tracker.block_limit_per_block == 0u) {
-        tracker.block_limit_per_block = 1u;
+    usize fraction_length = ascii_length(fraction_text);
+    u64 numerator = 0u;
+    u64 denominator = 1u;
+    if (fraction_length == 0u ||
+        !ascii_to_fraction(fraction_text, fraction_length, numerator, denominator)) {
+        console_line(2, "overlay: fraction must be a decimal value such as 0.25");
+        return 1;
     }
-    tracker.rs_region_start = rs_region_start;
-    tracker.rs_region_end = rs_region_end;
-    tracker.encoded_block_bytes = encoded_block_bytes;
-}
-
-static bool raw_overlay_tracker_try_reserve_bytes(RawOverlayBlockTracker& tracker,
-                                                  u64 byte_start,
-                                                  u64 byte_end) {
-    if (!tracker.enabled || !tracker.limits_known) {
-        return true;
+    if (denominator == 0u) {
+        console_line(2, "overlay: invalid fraction");
+        return 1;
     }
-    if (byte_start >= byte_end) {
-        return true;
+    if (numerator >= denominator) {
+        numerator = denominator;
     }
-    if (byte_end <= tracker.rs_region_start || byte_start >= tracker.rs_region_end) {
-        return true;
+    OverlayPage base_page;
+    OverlayPage overlay_page;
+    if (!load_overlay_page(base_path, base_page)) {
+        return 1;
     }
-    if (byte_start < tracker.rs_region_start) {
-        byte_start = tracker.rs_region_start;
+    if (!load_overlay_page(overlay_path, overlay_page)) {
+        return 1;
     }
-    if (byte_end > tracker.rs_region_end) {
-        byte_end = tracker.rs_region_end;
+    if (base_page.width != overlay_page.width ||
+        base_page.height != overlay_page.height) {
+        console_line(2, "overlay: ppm images must have identical dimensions");
+        return 1;
     }
-    if (byte_start >= byte_end) {
-        return true;
+    // Align overlay layout to the base so fiducial/data regions match pixel-for-pixel.
+    overlay_apply_base_layout(base_page, overlay_page);
+    makocode::ByteBuffer base_mask;
+    makocode::ByteBuffer overlay_mask;
+    u64 base_reserved = 0u;
+    u64 overlay_reserved = 0u;
+    if (!build_overlay_mask(base_page, base_mask, base_reserved)) {
+        console_line(2, "overlay: failed to prepare fiducial mask for base image");
+        return 1;
     }
-    u32* counts = (u32*)tracker.counts.data;
-    const usize* shuffle_ptr = tracker.shuffle_map.data
-                                   ? (const usize*)tracker.shuffle_map.data
-                                   : 0;
-    u8* mark_ptr = tracker.symbol_marks.data ? tracker.symbol_marks.data : 0;
-    struct RawOverlayPendingSymbol {
-        u64 relative;
-        usize counter_index;
-        u64 block_index;
-    };
-    struct RawOverlayPendingBlock {
-        u64 block_index;
-        usize counter_index;
-        u32 pending;
-    };
-    usize span = (usize)(byte_end - byte_start);
-    if (span == 0u) {
-        return true;
+    if (!build_overlay_mask(overlay_page, overlay_mask, overlay_reserved)) {
+        console_line(2, "overlay: failed to prepare fiducial mask for overlay image");
+        return 1;
     }
-    if (span > (SIZE_MAX / sizeof(RawOverlayPendingSymbol))) {
-        return false;
+    if (base_mask.size != overlay_mask.size) {
+        console_line(2, "overlay: fiducial mask size mismatch");
+        return 1;
     }
-    usize pending_symbol_bytes = span * sizeof(RawOverlayPendingSymbol);
-    if (!tracker.pending_symbols.ensure(pending_symbol_bytes)) {
-        return false;
+    OverlayBitPlanes planes;
+    if (!overlay_bit_planes_build(base_page, overlay_page, base_mask, overlay_mask, overlay_ignore, planes)) {
+        console_line(2, "overlay: failed to classify overlay pixels");
+        return 1;
     }
-    RawOverlayPendingSymbol* pending_symbols =
-        (RawOverlayPendingSymbol*)tracker.pending_symbols.data;
-    usize pending_symbol_count = 0u;
-    if (span > (SIZE_MAX / sizeof(RawOverlayPendingBlock))) {
-        return false;
+    base_mask.release();
+    overlay_mask.release();
+    if (ecc_target_specified) {
+        RawOverlayBlockTracker ecc_tracker;
+        raw_overlay_tracker_init(base_page, ecc_tracker);
+        if (!ecc_tracker.enabled) {
+            console_line(2, "overlay: --overlay-ecc-target requires ECC metadata");
+            return 1;
+        }
+        u64 candidate_limit = 0u;
+        if (base_page.color_mode != overlay_page.color_mode) {
+            candidate_limit = planes.candidate_count;
+        } else {
+            u64 candidate_bytes = 0u;
+            if (!count_overlay_byte_candidates(planes, base_page.color_mode, candidate_bytes)) {
+                console_line(2, "overlay: failed to evaluate overlay candidates");
+                return 1;
+            }
+            candidate_limit = candidate_bytes;
+        }
+        long double target_fraction = (long double)ecc_target_numerator /
+                                       (long double)ecc_target_denominator;
+        if (target_fraction < 0.0L) {
+            target_fraction = 0.0L;
+        } else if (target_fraction > 1.0L) {
+            target_fraction = 1.0L;
+        }
+        u64 total_limit = ecc_tracker.block_count * ecc_tracker.block_limit_per_block;
+        if (total_limit == 0u) {
+            console_line(2, "overlay: ECC metadata reports zero capacity");
+            return 1;
+        }
+        long double desired_changes = target_fraction * (long double)total_limit;
+        u64 target_changes = (u64)(desired_changes + 0.5L);
+        if (target_changes == 0u && target_fraction > 0.0L && candidate_limit > 0u) {
+            target_changes = 1u;
+        }
+        if (target_changes > candidate_limit) {
+            target_changes = candidate_limit;
+        }
+        if (candidate_limit == 0u) {
+            if (target_changes > 0u) {
+                console_line(2, "overlay: no overlay candidates remain after masks/ignore");
+                return 1;
+            }
+            numerator = 0u;
+            denominator = 1u;
+        } else {
+            numerator = target_changes;
+            denominator = candidate_limit;
+            if (numerator > denominator) {
+                numerator = denominator;
+            }
+        }
     }
-    usize block_bytes = span * sizeof(RawOverlayPendingBlock);
-    if (!tracker.pending_blocks.ensure(block_bytes)) {
-        return false;
+    if (numerator == 0u) {
+        if (!write_all_fd(1, base_page.original.data, base_page.original.size)) {
+            console_line(2, "overlay: failed to write original base image");
+            return 1;
+        }
+        return 0;
     }
-    RawOverlayPendingBlock* block_accums =
-        (RawOverlayPendingBlock*)tracker.pending_blocks.data;
-    usize block_accum_count = 0u;
-    for (u64 byte_index = byte_start; byte_index < byte_end; ++byte_index) {
-        u64 relative = byte_index - tracker.rs_region_start;
-        if (relative >= tracker.encoded_block_bytes) {
-            continue;
+    if (base_page.color_mode != overlay_page.color_mode) {
+        if (!apply_overlay_pixels_raw(overlay_page, planes, numerator, denominator, base_page)) {
+            console_line(2, "overlay: failed to copy raw pixel data between color modes");
+            return 1;
         }
-        if (mark_ptr && mark_ptr[relative]) {
-            continue;
+    } else {
+        makocode::ByteBuffer base_bits;
+        makocode::ByteBuffer overlay_bits;
+        u64 base_bit_count = 0u;
+        u64 overlay_bit_count = 0u;
+        if (!gather_overlay_bits(base_page, planes, planes.base_free, base_bits, base_bit_count)) {
+            console_line(2, "overlay: failed to extract data bytes from base image");
+            return 1;
         }
-        u64 original_index = shuffle_ptr ? (u64)shuffle_ptr[(usize)relative] : relative;
-        u64 block_index = original_index / tracker.block_total_symbols;
-        if (block_index >= tracker.block_count) {
-            continue;
+        if (!gather_overlay_bits(overlay_page, planes, planes.overlay_free, overlay_bits, overlay_bit_count)) {
+            console_line(2, "overlay: failed to extract data bytes from overlay image");
+            return 1;
         }
-        usize counter_index = (usize)block_index;
-        if (counter_index >= (tracker.counts.size / sizeof(u32))) {
-            continue;
+        if (base_bit_count == 0u || base_bits.size == 0u) {
+            console_line(2, "overlay: base image does not contain data bytes to modify");
+            return 1;
         }
-        RawOverlayPendingBlock* block_entry = 0;
-        for (usize i = 0u; i < block_accum_count; ++i) {
-            if (block_accums[i].block_index == block_index) {
-                block_entry = &block_accums[i];
-                break;
-            }
+        if (overlay_bits.size == 0u) {
+            console_line(2, "overlay: overlay image does not provide data bytes");
+            return 1;
         }
-        if (!block_entry) {
-            if (block_accum_count >= span) {
-                return false;
+        u64 base_bytes = (base_bit_count + 7u) >> 3u;
+        u64 overlay_bytes = (overlay_bit_count + 7u) >> 3u;
+        u64 copy_bytes = (base_bytes < overlay_bytes) ? base_bytes : overlay_bytes;
+        if (copy_bytes == 0u) {
+            console_line(2, "overlay: no whole bytes available for overlay");
+            return 1;
+        }
+        u8* base_ptr = base_bits.data;
+        const u8* overlay_ptr = overlay_bits.data;
+        if (!base_ptr || !overlay_ptr) {
+            console_line(2, "overlay: internal byte buffer unavailable");
+            return 1;
+        }
+        u64 accumulator = 0u;
+        makocode::ByteBuffer block_counters;
+        makocode::ByteBuffer block_shuffle_map;
+        u16* block_counters_ptr = 0;
+        usize* block_shuffle_map_ptr = 0;
+        bool block_interleaved = false;
+        makocode::EccInterleave block_interleave;
+        bool block_limit_active = false;
+        u64 block_limit_start = 0u;
+        u64 block_limit_end = 0u;
+        u64 block_limit_hits = 0u;
+        u64 block_total_symbols = 0u;
+        u64 block_total_count = 0u;
+        u64 block_limit_per_block = 0u;
+        u64 shuffle_entry_count = 0u;
+        const u64 payload_prefix_bytes = 8u;
+        const u64 header_span_bytes = (u64)makocode::ECC_HEADER_TOTAL_BYTES;
+        if (base_bytes >= payload_prefix_bytes + header_span_bytes) {
+            u64 payload_bytes = base_bytes - payload_prefix_bytes;
+            usize payload_byte_count = (payload_bytes > (u64)USIZE_MAX_VALUE)
+                                          ? USIZE_MAX_VALUE
+                                          : (usize)payload_bytes;
+            if (payload_byte_count >= makocode::ECC_HEADER_TOTAL_BYTES) {
+                const u8* payload_ptr = base_ptr + payload_prefix_bytes;
+                makocode::EccHeaderInfo ecc_header;
+                if (makocode::parse_ecc_header(payload_ptr, payload_byte_count, ecc_header) &&
+                    ecc_header.valid && ecc_header.enabled) {
+                    u64 block_data = (u64)ecc_header.block_data;
+                    u64 parity = (u64)ecc_header.parity;
+                    u64 block_total = block_data + parity;
+                    u64 block_count_value = ecc_header.block_count;
+                    if (block_data && parity && block_total && block_count_value &&
+                        block_total <= (U64_MAX_VALUE / block_count_value)) {
+                        u64 encoded_block_bytes = block_total * block_count_value;
+                        u64 available_rs_bytes = (payload_bytes >= header_span_bytes)
+                                                    ? (payload_bytes - header_span_bytes)
+                                                    : 0u;
+                        if (encoded_block_bytes > available_rs_bytes) {
+                            encoded_block_bytes = available_rs_bytes;
+                        }
+                        if (encoded_block_bytes > 0u &&
+                            block_count_value <= (u64)(USIZE_MAX_VALUE / sizeof(u16))) {
+                            usize counter_bytes = (usize)(block_count_value * (u64)sizeof(u16));
+                            if (counter_bytes != 0u && block_counters.ensure(counter_bytes)) {
+                                block_counters.size = counter_bytes;
+                                for (usize counter_index = 0u; counter_index < counter_bytes; ++counter_index) {
+                                    block_counters.data[counter_index] = 0u;
+                                }
+                                block_total_symbols = block_total;
+                                block_total_count = block_count_value;
+                                // RS can correct up to t = floor(parity/2) symbol errors per block.
+                                // Stay slightly under that theoretical maximum to avoid edge-case
+                                // failures when additional corruption exists (e.g. header/prefix).
+                                block_limit_per_block = parity / 2u;
+                                if (block_limit_per_block > 1u) {
+                                    block_limit_per_block -= 1u;
+                                } else {
+                                    block_limit_per_block = 1u;
+                                }
+                                if (ecc_header.interleaved) {
+                                    if (block_interleave.configure((u16)block_total, block_count_value)) {
+                                        block_interleaved = true;
+                                        block_counters_ptr = (u16*)block_counters.data;
+                                        shuffle_entry_count = encoded_block_bytes;
+                                        block_limit_start = payload_prefix_bytes + header_span_bytes;
+                                        block_limit_end = block_limit_start + shuffle_entry_count;
+                                        if (block_limit_end > base_bytes) {
+                                            block_limit_end = base_bytes;
+                                        }
+                                        block_limit_active = true;
+                                    }
+                                } else if (encoded_block_bytes <= (u64)USIZE_MAX_VALUE) {
+                                    usize entries = (usize)encoded_block_bytes;
+                                    if (entries != 0u &&
+                                        entries <= (USIZE_MAX_VALUE / sizeof(usize))) {
+                                        usize map_bytes = entries * sizeof(usize);
+                                        if (map_bytes != 0u && block_shuffle_map.ensure(map_bytes)) {
+                                            block_shuffle_map.size = map_bytes;
+                                            block_shuffle_map_ptr = (usize*)block_shuffle_map.data;
+                                            for (usize map_index = 0u; map_index < entries; ++map_index) {
+                                                block_shuffle_map_ptr[map_index] = map_index;
+                                            }
+                                            makocode::Pcg64Generator rng;
+                                            rng.seed(0u);
+                                            for (usize map_index = entries; map_index > 1u; --map_index) {
+                                                usize i_map = map_index - 1u;
+                                                u64 value = rng.next();
+                                                usize j_map = (usize)(value % (u64)(i_map + 1u));
+                                                usize temp = block_shuffle_map_ptr[i_map];
+                                                block_shuffle_map_ptr[i_map] = block_shuffle_map_ptr[j_map];
+                                                block_shuffle_map_ptr[j_map] = temp;
+                                            }
+                                            block_counters_ptr = (u16*)block_counters.data;
+                                            shuffle_entry_count = (u64)entries;
+                                            block_limit_start = payload_prefix_bytes + header_span_bytes;
+                                            block_limit_end = block_limit_start + shuffle_entry_count;
+                                            if (block_limit_end > base_bytes) {
+                                                block_limit_end = base_bytes;
+                                            }
+                                            block_limit_active = true;
+                                        }
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
             }
-            block_entry = &block_accums[block_accum_count++];
-            block_entry->block_index = block_index;
-            block_entry->counter_index = counter_index;
-            block_entry->pending = 0u;
         }
-        u32 current_value = counts[counter_index];
-        u64 prospective = (u64)current_value + (u64)block_entry->pending + 1u;
-        if (prospective > tracker.block_limit_per_block) {
-            tracker.rejected_changes += 1u;
-            if (!tracker.hit_limit) {
-                tracker.hit_limit = true;
-                tracker.first_limit_block = block_index;
-                tracker.first_limit_errors = prospective;
+
+        // If ECC metadata is available and the caller did not specify an explicit ECC target,
+        // clamp the requested overlay fraction to a conservative bound based on correctable
+        // symbols. The raw fraction argument is in terms of bytes to replace and can easily
+        // exceed ECC capabilities when used with heavy overlays.
+        if (!ecc_target_specified &&
+            block_limit_active &&
+            block_total_symbols > 0u &&
+            block_total_count > 0u &&
+            block_limit_per_block > 0u &&
+            copy_bytes > 0u &&
+            denominator > 0u) {
+            // Keep generous headroom beyond the theoretical RS limit to survive
+            // additional damage (e.g., scanning noise) on top of the overlay.
+            u64 safe_per_block = block_limit_per_block;
+            if (safe_per_block > 1u) {
+                safe_per_block = (safe_per_block * 2u) / 3u; // ~67% of the nominal limit
+                if (safe_per_block == 0u) {
+                    safe_per_block = 1u;
+                }
+            }
+            __uint128_t safe_total = (__uint128_t)safe_per_block * (__uint128_t)block_total_count;
+            __uint128_t max_num128 = safe_total * (__uint128_t)denominator;
+            max_num128 /= (__uint128_t)copy_bytes;
+            u64 max_numerator = (max_num128 > (__uint128_t)U64_MAX_VALUE) ? U64_MAX_VALUE : (u64)max_num128;
+            if (max_numerator == 0u && safe_total > 0u) {
+                max_numerator = 1u;
+            }
+            if (numerator > max_numerator) {
+                numerator = max_numerator;
             }
-            return false;
         }
-        RawOverlayPendingSymbol* symbol_entry = &pending_symbols[pending_symbol_count++];
-        symbol_entry->relative = relative;
-        symbol_entry->counter_index = counter_index;
-        symbol_entry->block_index = block_index;
-        block_entry->pending += 1u;
-    }
-    if (pending_symbol_count == 0u) {
-        return true;
-    }
-    for (usize i = 0u; i < pending_symbol_count; ++i) {
-        if (mark_ptr) {
-            mark_ptr[pending_symbols[i].relative] = 1u;
+        for (u64 i = 0u; i < copy_bytes; ++i) {
+            accumulator += numerator;
+            if (accumulator < denominator) {
+                continue;
+            }
+            bool replaced = false;
+            bool skipped_for_limit = false;
+            if (block_limit_active &&
+                (block_shuffle_map_ptr || block_interleaved) &&
+                block_counters_ptr &&
+                block_total_symbols > 0u &&
+                block_total_count > 0u &&
+                i >= block_limit_start &&
+                i < block_limit_end) {
+                u64 relative = i - block_limit_start;
+                if (relative < shuffle_entry_count) {
+                    u64 block_index = 0u;
+                    if (block_interleaved) {
+                        u16 symbol_index = 0u;
+                        block_interleave.locate(relative, block_index, symbol_index);
+                    } else {
+                        u64 original_index = (u64)block_shuffle_map_ptr[(usize)relative];
+                        block_index = original_index / block_total_symbols;
+                    }
+                    if (block_index < block_total_count) {
+                        usize counter_index = (usize)block_index;
+                        u16 current_count = block_counters_ptr[counter_index];
+                        if ((u64)current_count < block_limit_per_block) {
+                            base_ptr[i] = overlay_ptr[i];
+                            block_counters_ptr[counter_index] = (u16)(current_count + 1u);
+                            replaced = true;
+                        } else {
+                            skipped_for_limit = true;
+                            ++block_limit_hits;
+                        }
+                    }
+                }
+            }
+            if (!replaced && !skipped_for_limit) {
+                base_ptr[i] = overlay_ptr[i];
+                replaced = true;
+            }
+            if (replaced) {
+                accumulator -= denominator;
+            }
         }
-    }
-    for (usize i = 0u; i < block_accum_count; ++i) {
-        RawOverlayPendingBlock& block_entry = block_accums[i];
-        u32* counter_ptr = counts + block_entry.counter_index;
-        u64 new_value = (u64)(*counter_ptr) + (u64)block_entry.pending;
-        if (new_value > 0xFFFFFFFFu) {
-            new_value = 0xFFFFFFFFu;
+        if (block_limit_active && debug_logging_enabled()) {
+            char limit_buf[32];
+            char hits_buf[32];
+            console_write(2, "debug overlay: block limit=");
+            u64_to_ascii(block_limit_per_block, limit_buf, sizeof(limit_buf));
+            console_write(2, limit_buf);
+            console_write(2, " blocks=");
+            u64_to_ascii(block_total_count, limit_buf, sizeof(limit_buf));
+            console_write(2, limit_buf);
+            console_write(2, " hits=");
+            u64_to_ascii(block_limit_hits, hits_buf, sizeof(hits_buf));
+            console_line(2, hits_buf);
         }
-        *counter_ptr = (u32)new_value;
-        tracker.total_symbol_changes += (u64)block_entry.pending;
-        if (new_value > tracker.max_block_errors) {
-            tracker.max_block_errors = new_value;
-            tracker.max_block_index = block_entry.block_index;
+        if (!apply_overlay_bits(base_bits, base_bit_count, planes, base_page)) {
+            console_line(2, "overlay: failed to map merged bytes back to base image");
+            return 1;
         }
     }
-    return true;
-}
-
-static bool raw_overlay_tracker_try_reserve_bits(RawOverlayBlockTracker& tracker,
-                                                 u64 bit_start,
-                                                 u64 bit_length) {
-    if (!tracker.enabled || bit_length == 0u) {
-        return true;
+    makocode::ByteBuffer output;
+    if (!serialize_overlay_page(base_page, output)) {
+        console_line(2, "overlay: failed to serialize merged ppm");
+        return 1;
     }
-    u64 bit_end = bit_start + bit_length;
-    if (bit_end < bit_start) {
-        return false;
+    if (!write_buffer_to_fd(1, output)) {
+        console_line(2, "overlay: failed to emit merged ppm");
+        return 1;
     }
-    u64 byte_start = bit_start >> 3u;
-    u64 byte_end = (bit_end + 7u) >> 3u;
-    return raw_overlay_tracker_try_reserve_bytes(tracker, byte_start, byte_end);
+    return 0;
 }
 
-static bool count_overlay_pixel_candidates(const OverlayPage& base_page,
-                                          const OverlayPage& overlay_page,
-                                          const makocode::ByteBuffer& base_mask,
-                                          const makocode::ByteBuffer& overlay_mask,
-                                          const OverlayIgnoreColorList* ignore_list,
-                                          usize& out_count) {
-    out_count = 0u;
-    if (!base_page.pixels.data || !overlay_page.pixels.data) {
-        return false;
-    }
-    if (base_page.width != overlay_page.width ||
-        base_page.height != overlay_page.height) {
-        return false;
-    }
-    usize total_pixels = (usize)base_page.width * (usize)base_page.height;
-    if (base_page.pixels.size < total_pixels * 3u ||
-        overlay_page.pixels.size < total_pixels * 3u) {
-        return false;
+// Decode keeps the ECC totals of its final parse attempt.
+static void stats_record_ecc(const makocode::EccDecodeStats& ecc) {
+    if (!stats_enabled()) {
+        return;
     }
-    if ((base_mask.size && base_mask.size != total_pixels) ||
-        (overlay_mask.size && overlay_mask.size != total_pixels)) {
+    g_stats.counters[StatsCounter_EccBlocks] = ecc.total_blocks;
+    g_stats.counters[StatsCounter_EccBlocksWithErrors] = ecc.blocks_with_errors;
+    g_stats.counters[StatsCounter_EccCorrectedSymbols] = ecc.corrected_symbols;
+    g_stats.counters[StatsCounter_EccErasureSymbols] = ecc.erasure_symbols;
+    g_stats.counters[StatsCounter_EccParitySymbols] = ecc.total_parity_symbols;
+    g_stats.counters[StatsCounter_EccHeaderRepairs] = ecc.header_copy_repairs;
+}
+
+static bool stats_append_json_string(makocode::ByteBuffer& out, const char* text) {
+    static const char kHex[] = "0123456789abcdef";
+    if (!out.append_char('"')) {
         return false;
     }
-    u32 apply_height = base_page.data_height;
-    if (overlay_page.data_height < apply_height) {
-        apply_height = overlay_page.data_height;
+    for (const char* cursor = text ? text : ""; *cursor; ++cursor) {
+        u8 ch = (u8)*cursor;
+        bool ok = true;
+        if (ch == '"' || ch == '\\') {
+            ok = out.append_char('\\') && out.append_char((char)ch);
+        } else if (ch < 0x20u) {
+            char escape[7] = {'\\', 'u', '0', '0', kHex[ch >> 4u], kHex[ch & 15u], 0};
+            ok = out.append_ascii(escape);
+        } else {
+            ok = out.append_char((char)ch);
+        }
+        if (!ok) {
+            return false;
+        }
     }
-    if (apply_height > base_page.height) {
-        apply_height = base_page.height;
+    return out.append_char('"');
+}
+
+static bool stats_append_key(makocode::ByteBuffer& out, const char* key, bool first) {
+    return (first || out.append_char(',')) &&
+           stats_append_json_string(out, key) &&
+           out.append_char(':');
+}
+
+static bool stats_append_ms(makocode::ByteBuffer& out, u64 nanoseconds) {
+    char number[64];
+    format_fixed_3((double)nanoseconds / 1e6, number, sizeof(number));
+    return out.append_ascii(number);
+}
+
+// Writes the --stats summary as one JSON line, e.g.
+//   {"command":"decode","status":0,"wall_ms":812.004,
+//    "stages":{"read":{"ms":0.051,"calls":1},...},
+//    "counters":{"pages":1,...},
+//    "pages":[{"path":"p1.ppm","ms":640.113,"bits":8601264,"attempts":1,"extracted":true}]}
+// Only stages that ran are listed; "pages" is present for decode.
+static void stats_emit(const char* command, int status) {
+    if (!g_stats.enabled) {
+        return;
     }
-    if (apply_height == 0u) {
-        return true;
+    u64 wall_nanoseconds = (u64)((monotonic_seconds() - g_stats.started) * 1e9);
+    makocode::ByteBuffer out;
+    bool ok = out.append_char('{') &&
+              stats_append_key(out, "command", true) &&
+              stats_append_json_string(out, command) &&
+              stats_append_key(out, "status", false) &&
+              buffer_append_number(out, (u64)(u32)status) &&
+              stats_append_key(out, "wall_ms", false) &&
+              stats_append_ms(out, wall_nanoseconds) &&
+              stats_append_key(out, "stages", false) &&
+              out.append_char('{');
+    bool first = true;
+    for (u32 stage = 0u; ok && stage < (u32)StatsStage_Count; ++stage) {
+        if (!g_stats.stage_calls[stage]) {
+            continue;
+        }
+        ok = stats_append_key(out, STATS_STAGE_NAMES[stage], first) &&
+             out.append_ascii("{\"ms\":") &&
+             stats_append_ms(out, g_stats.stage_nanoseconds[stage]) &&
+             out.append_ascii(",\"calls\":") &&
+             buffer_append_number(out, g_stats.stage_calls[stage]) &&
+             out.append_char('}');
+        first = false;
+    }
+    ok = ok && out.append_char('}') && stats_append_key(out, "counters", false) && out.append_char('{');
+    for (u32 counter = 0u; ok && counter < (u32)StatsCounter_Count; ++counter) {
+        ok = stats_append_key(out, STATS_COUNTER_NAMES[counter], counter == 0u) &&
+             buffer_append_number(out, g_stats.counters[counter]);
+    }
+    ok = ok && out.append_char('}');
+    if (ok && g_stats.pages) {
+        ok = stats_append_key(out, "pages", false) && out.append_char('[');
+        for (usize i = 0u; ok && i < g_stats.page_count; ++i) {
+            const StatsPageRecord& page = g_stats.pages[i];
+            ok = (i == 0u || out.append_char(',')) &&
+                 out.append_char('{') &&
+                 stats_append_key(out, "path", true) &&
+                 stats_append_json_string(out, page.path) &&
+                 stats_append_key(out, "ms", false) &&
+                 stats_append_ms(out, page.nanoseconds) &&
+                 stats_append_key(out, "bits", false) &&
+                 buffer_append_number(out, page.bit_count) &&
+                 stats_append_key(out, "attempts", false) &&
+                 buffer_append_number(out, (u64)page.attempts) &&
+                 stats_append_key(out, "extracted", false) &&
+                 out.append_ascii(page.extracted ? "true" : "false") &&
+                 out.append_char('}');
+        }
+        ok = ok && out.append_char(']');
+    }
+    ok = ok && out.append_ascii("}\n");
+    free(g_stats.pages);
+    g_stats.pages = 0;
+    g_stats.page_count = 0u;
+    g_stats.enabled = false;
+    if (!ok) {
+        console_line(2, "stats: failed to format summary");
+        return;
     }
-    const bool have_base_mask = (base_mask.data && base_mask.size);
-    const bool have_overlay_mask = (overlay_mask.data && overlay_mask.size);
-    for (u32 row = 0u; row < (u32)apply_height; ++row) {
-        for (u32 column = 0u; column < base_page.width; ++column) {
-            usize pixel_index = ((usize)row * (usize)base_page.width) + (usize)column;
-            bool reserved = false;
-            if (have_base_mask && base_mask.data[pixel_index]) {
-                reserved = true;
-            }
-            if (!reserved && have_overlay_mask && overlay_mask.data[pixel_index]) {
-                reserved = true;
-            }
-            if (reserved) {
-                continue;
-            }
-            usize byte_index = pixel_index * 3u;
-            if (byte_index + 2u >= base_page.pixels.size ||
-                byte_index + 2u >= overlay_page.pixels.size) {
-                return false;
-            }
-            if (ignore_list) {
-                u8 overlay_r = overlay_page.pixels.data[byte_index + 0u];
-                u8 overlay_g = overlay_page.pixels.data[byte_index + 1u];
-                u8 overlay_b = overlay_page.pixels.data[byte_index + 2u];
-                if (overlay_color_matches_ignore(*ignore_list, overlay_r, overlay_g, overlay_b)) {
-                    continue;
-                }
-            }
-            out_count += 1u;
+    if (g_stats.output_path) {
+        if (!write_bytes_to_file(g_stats.output_path, out.data, out.size)) {
+            console_write(2, "stats: failed to write ");
+            console_line(2, g_stats.output_path);
         }
+        return;
     }
-    return true;
+    write_all_fd(2, out.data, out.size);
 }
 
-static bool count_overlay_byte_candidates(const OverlayPage& base_page,
-                                          const OverlayPage& overlay_page,
-                                          const makocode::ByteBuffer& base_mask,
-                                          const makocode::ByteBuffer& overlay_mask,
-                                          const OverlayIgnoreColorList* ignore_list,
-                                          u64& out_bytes) {
-    out_bytes = 0u;
-    if (!base_page.pixels.data || !overlay_page.pixels.data) {
-        return false;
+// One input page of a multi-file decode. Pages are extracted independently and
+// only stitched together (metadata merge, page order, bit concatenation) once
+// every page has been read.
+struct DecodedPage {
+    makocode::ByteBuffer bits;
+    u64 bit_count;
+    makocode::ByteBuffer erasures;
+    PpmParserState state;
+    bool read_ok;
+    bool extracted;
+
+    DecodedPage()
+        : bits(),
+          bit_count(0u),
+          erasures(),
+          state(),
+          read_ok(false),
+          extracted(false) {}
+};
+
+// Hands the page in `src` to `dest`, releasing what `dest` held, and leaves
+// `src` empty.
+static void decoded_page_move(DecodedPage& dest, DecodedPage& src) {
+    byte_buffer_move(dest.bits, src.bits);
+    byte_buffer_move(dest.erasures, src.erasures);
+    dest.bit_count = src.bit_count;
+    dest.state = src.state;
+    dest.read_ok = src.read_ok;
+    dest.extracted = src.extracted;
+    src.bit_count = 0u;
+    src.state = PpmParserState();
+    src.read_ok = false;
+    src.extracted = false;
+}
+
+// Heap-backed array of DecodedPage; PpmParserState is too large to keep one per
+// input file on the stack.
+struct DecodedPageTable {
+    DecodedPage* pages;
+    usize count;
+
+    DecodedPageTable() : pages(0), count(0u) {}
+
+    ~DecodedPageTable() {
+        release();
     }
-    if (base_page.width != overlay_page.width ||
-        base_page.height != overlay_page.height) {
-        return false;
+
+    bool allocate(usize page_count) {
+        release();
+        if (page_count == 0u || page_count > USIZE_MAX_VALUE / sizeof(DecodedPage)) {
+            return false;
+        }
+        pages = (DecodedPage*)malloc(page_count * sizeof(DecodedPage));
+        if (!pages) {
+            return false;
+        }
+        for (usize i = 0u; i < page_count; ++i) {
+            memset((void*)&pages[i], 0, sizeof(DecodedPage));
+            pages[i].state = PpmParserState();
+        }
+        count = page_count;
+        return true;
     }
-    usize total_pixels = (usize)base_page.width * (usize)base_page.height;
-    if (base_page.pixels.size < total_pixels * 3u ||
-        overlay_page.pixels.size < total_pixels * 3u) {
-        return false;
+
+    // Extends the table to `page_count` entries, keeping the pages already
+    // stored (decode_page_stream learns the page count as pages arrive).
+    bool grow(usize page_count) {
+        if (page_count <= count) {
+            return true;
+        }
+        if (page_count > USIZE_MAX_VALUE / sizeof(DecodedPage)) {
+            return false;
+        }
+        DecodedPage* grown = (DecodedPage*)malloc(page_count * sizeof(DecodedPage));
+        if (!grown) {
+            return false;
+        }
+        for (usize i = 0u; i < page_count; ++i) {
+            memset((void*)&grown[i], 0, sizeof(DecodedPage));
+            grown[i].state = PpmParserState();
+        }
+        for (usize i = 0u; i < count; ++i) {
+            decoded_page_move(grown[i], pages[i]);
+        }
+        free(pages);
+        pages = grown;
+        count = page_count;
+        return true;
     }
-    if ((base_mask.size && base_mask.size != total_pixels) ||
-        (overlay_mask.size && overlay_mask.size != total_pixels)) {
-        return false;
+
+    void release() {
+        if (pages) {
+            for (usize i = 0u; i < count; ++i) {
+                pages[i].bits.release();
+                pages[i].erasures.release();
+            }
+            free(pages);
+        }
+        pages = 0;
+        count = 0u;
     }
-    u32 apply_height = base_page.data_height;
-    if (overlay_page.data_height < apply_height) {
-        apply_height = overlay_page.data_height;
+};
+
+struct DecodePageJob {
+    makocode::PageSource* source;
+    DecodedPage* pages;
+    usize file_count;
+    const ImageMappingConfig* mapping;
+    // Layout to assume in place of the metadata tile (--recover-metadata).
+    const MetadataTile::Values* assumed_metadata;
+    bool disable_subgrid;
+    bool retry_only;
+    usize next_file;
+
+    DecodePageJob()
+        : source(0),
+          pages(0),
+          file_count(0u),
+          mapping(0),
+          assumed_metadata(0),
+          disable_subgrid(false),
+          retry_only(false),
+          next_file(0u) {}
+};
+
+// Diagnostic label of page `index`: the source's name for it, or "page N"
+// formatted into `buffer`.
+static const char* decode_page_name(const makocode::PageSource& source, usize index, char* buffer, usize capacity) {
+    if (source.page_names && source.page_names[index]) {
+        return source.page_names[index];
     }
-    if (apply_height > base_page.height) {
-        apply_height = base_page.height;
+    static const char label[] = "page ";
+    usize label_length = (usize)(sizeof(label) - 1u);
+    if (capacity <= label_length) {
+        return "page";
     }
-    if (apply_height == 0u) {
-        return true;
+    for (usize i = 0u; i < label_length; ++i) {
+        buffer[i] = label[i];
     }
-    const bool have_base_mask = (base_mask.data && base_mask.size);
-    const bool have_overlay_mask = (overlay_mask.data && overlay_mask.size);
-    u8 sample_bits = bits_per_sample(base_page.color_mode);
-    u8 samples_per_pixel = color_mode_samples_per_pixel(base_page.color_mode);
-    if (sample_bits == 0u || samples_per_pixel == 0u) {
-        return false;
+    u64_to_ascii((u64)index + 1u, buffer + label_length, capacity - label_length);
+    return buffer;
+}
+
+static void decode_job_extract_page(const DecodePageJob& job, usize file_index) {
+    DecodedPage& page = job.pages[file_index];
+    makocode::PageSource& source = *job.source;
+    double stats_started = stats_enabled() ? monotonic_seconds() : 0.0;
+    InputFile ppm_input;
+    if (debug_logging_enabled()) {
+        char name_buffer[48];
+        console_write(2, "debug reading file: ");
+        console_line(2, decode_page_name(source, file_index, name_buffer, sizeof(name_buffer)));
     }
-    u64 bits_per_pixel = (u64)sample_bits * (u64)samples_per_pixel;
-    if (bits_per_pixel == 0u) {
-        return false;
+    page.read_ok = source.open_page(source.context, file_index, ppm_input);
+    if (!page.read_ok) {
+        return;
     }
-    u64 bit_count = 0u;
-    for (u32 row = 0u; row < (u32)apply_height; ++row) {
-        for (u32 column = 0u; column < base_page.width; ++column) {
-            usize pixel_index = ((usize)row * (usize)base_page.width) + (usize)column;
-            bool reserved = false;
-            if (have_base_mask && base_mask.data[pixel_index]) {
-                reserved = true;
-            }
-            if (!reserved && have_overlay_mask && overlay_mask.data[pixel_index]) {
-                reserved = true;
-            }
-            if (reserved) {
-                continue;
-            }
-            usize byte_index = pixel_index * 3u;
-            if (byte_index + 2u >= base_page.pixels.size ||
-                byte_index + 2u >= overlay_page.pixels.size) {
-                return false;
-            }
-            if (ignore_list) {
-                u8 overlay_r = overlay_page.pixels.data[byte_index + 0u];
-                u8 overlay_g = overlay_page.pixels.data[byte_index + 1u];
-                u8 overlay_b = overlay_page.pixels.data[byte_index + 2u];
-                if (overlay_color_matches_ignore(*ignore_list, overlay_r, overlay_g, overlay_b)) {
-                    continue;
-                }
-            }
-            if (bit_count > (U64_MAX_VALUE - bits_per_pixel)) {
-                bit_count = U64_MAX_VALUE;
-            } else {
-                bit_count += bits_per_pixel;
+    if (debug_logging_enabled() && ppm_input.size >= 8u && ppm_input.data) {
+        console_write(2, "debug read bytes: ");
+        for (usize debug_i = 0u; debug_i < 8u && debug_i < ppm_input.size; ++debug_i) {
+            char value_buffer[32];
+            u64_to_ascii((u64)(unsigned char)ppm_input.data[debug_i], value_buffer, sizeof(value_buffer));
+            console_write(2, value_buffer);
+            if ((debug_i + 1u) < ppm_input.size && debug_i < 7u) {
+                console_write(2, " ");
             }
         }
+        console_line(2, "");
     }
-    if (bit_count == 0u) {
-        return true;
-    }
-    u64 byte_count = bit_count >> 3u;
-    if (bit_count & 7u) {
-        ++byte_count;
+    page.bits.release();
+    page.bit_count = 0u;
+    page.state = PpmParserState();
+    page.extracted = ppm_extract_frame_bits(ppm_input.data,
+                                            ppm_input.size,
+                                            *job.mapping,
+                                            page.bits,
+                                            page.bit_count,
+                                            page.state,
+                                            job.disable_subgrid,
+                                            &page.erasures,
+                                            job.assumed_metadata);
+    // The parser state points into ppm_input, which is unmapped on return.
+    page.state.data = 0;
+    page.state.size = 0u;
+    page.state.cursor = 0u;
+    if (stats_enabled()) {
+        stats_record_page(file_index, monotonic_seconds() - stats_started, page.bit_count, page.extracted);
+    }
+}
+
+static void* decode_page_worker(void* context) {
+    DecodePageJob& job = *(DecodePageJob*)context;
+    for (;;) {
+        usize file_index = __atomic_fetch_add(&job.next_file, (usize)1u, __ATOMIC_RELAXED);
+        if (file_index >= job.file_count) {
+            break;
+        }
+        if (job.retry_only && (!job.pages[file_index].read_ok || job.pages[file_index].extracted)) {
+            continue;
+        }
+        decode_job_extract_page(job, file_index);
     }
-    out_bytes = byte_count;
-    return true;
+    return 0;
 }
 
-static void raw_overlay_tracker_finish(const RawOverlayBlockTracker& tracker) {
-    if (!tracker.enabled || !tracker.log_enabled) {
-        return;
-    }
-    console_write(2, "overlay raw debug: blocks=");
-    char buffer[32];
-    u64_to_ascii(tracker.block_count, buffer, sizeof(buffer));
-    console_write(2, buffer);
-    console_write(2, " symbols_per_block=");
-    u64_to_ascii(tracker.block_total_symbols, buffer, sizeof(buffer));
-    console_write(2, buffer);
-    console_write(2, " parity=");
-    u64_to_ascii(tracker.parity_symbols, buffer, sizeof(buffer));
-    console_write(2, buffer);
-    console_write(2, " limit_per_block=");
-    u64_to_ascii(tracker.block_limit_per_block, buffer, sizeof(buffer));
-    console_write(2, buffer);
-    console_write(2, " total_symbol_changes=");
-    u64_to_ascii(tracker.total_symbol_changes, buffer, sizeof(buffer));
-    console_write(2, buffer);
-    console_write(2, " peak_block=");
-    u64_to_ascii(tracker.max_block_index, buffer, sizeof(buffer));
-    console_write(2, buffer);
-    console_write(2, " peak_errors=");
-    u64_to_ascii(tracker.max_block_errors, buffer, sizeof(buffer));
-    console_write(2, buffer);
-    console_write(2, " rejected_changes=");
-    u64_to_ascii(tracker.rejected_changes, buffer, sizeof(buffer));
-    console_write(2, buffer);
-    if (tracker.hit_limit) {
-        console_write(2, " first_limit_block=");
-        u64_to_ascii(tracker.first_limit_block, buffer, sizeof(buffer));
-        console_write(2, buffer);
-        console_write(2, " first_limit_errors=");
-        u64_to_ascii(tracker.first_limit_errors, buffer, sizeof(buffer));
-        console_write(2, buffer);
+static void run_decode_page_job(DecodePageJob& job, u32 max_parallelism) {
+    u64 worker_count = max_parallelism ? (u64)max_parallelism : 1u;
+    if (worker_count > (u64)job.file_count) {
+        worker_count = (u64)job.file_count;
+    }
+    job.next_file = 0u;
+    run_worker_pool(decode_page_worker, &job, worker_count);
+}
+
+// --recover-metadata: candidate layouts for a page whose metadata tile is
+// unreadable. Each candidate fixes the palette, the page size the scan was
+// rendered at, and the footer height; the fiducial grid follows from the
+// compiled defaults exactly as it does for a decoded tile. Candidates are
+// ranked by how well the palette explains the scanned colors and how usual
+// the geometry is, then tried best-first on the worker pool.
+static const u32 METADATA_RECOVERY_MAX_SCALE = 4u;
+static const u32 METADATA_RECOVERY_MAX_PERMUTED_COLORS = 4u;
+static const u32 METADATA_RECOVERY_SAMPLE_COUNT = 65536u;
+// Built-in palettes, then orderings of up to four named colors with and
+// without black.
+static const u32 METADATA_RECOVERY_MAX_PALETTES = 3u + 24u + 6u;
+// Footer text scales in order of likelihood; 0 is a page without footer text.
+static const u32 METADATA_RECOVERY_FONT_SIZES[] = {1u, 0u, 2u, 3u};
+
+struct MetadataPaletteCandidate {
+    PaletteColor colors[MAX_CUSTOM_PALETTE_COLORS];
+    u32 count;
+    double score;
+};
+
+struct MetadataHypothesis {
+    MetadataTile::Values values;
+    u32 rank;
+};
+
+// Heap-backed hypothesis list, sized once for the whole search.
+struct MetadataHypothesisTable {
+    MetadataHypothesis* entries;
+    usize count;
+    usize capacity;
+
+    MetadataHypothesisTable() : entries(0), count(0u), capacity(0u) {}
+
+    ~MetadataHypothesisTable() {
+        release();
     }
-    console_line(2, "");
-}
 
-static bool apply_overlay_pixels_raw(const OverlayPage& overlay_page,
-                                     const makocode::ByteBuffer& base_mask,
-                                     const makocode::ByteBuffer& overlay_mask,
-                                     u64 numerator,
-                                     u64 denominator,
-                                     const OverlayIgnoreColorList* ignore_list,
-                                     OverlayPage& base_page) {
-    RawOverlayBlockTracker tracker;
-    raw_overlay_tracker_init(base_page, tracker);
-    if (!base_page.pixels.data || !overlay_page.pixels.data) {
-        return false;
+    bool allocate(usize entry_capacity) {
+        release();
+        if (entry_capacity == 0u || entry_capacity > USIZE_MAX_VALUE / sizeof(MetadataHypothesis)) {
+            return false;
+        }
+        entries = (MetadataHypothesis*)malloc(entry_capacity * sizeof(MetadataHypothesis));
+        if (!entries) {
+            return false;
+        }
+        memset((void*)entries, 0, entry_capacity * sizeof(MetadataHypothesis));
+        capacity = entry_capacity;
+        return true;
     }
-    if (base_page.width != overlay_page.width ||
-        base_page.height != overlay_page.height) {
-        return false;
+
+    void release() {
+        free(entries);
+        entries = 0;
+        count = 0u;
+        capacity = 0u;
     }
-    if (denominator == 0u) {
-        return false;
+};
+
+// Configures `mapping` to render with `colors` the way the decoder will: a
+// built-in mode when the colors match one exactly, otherwise a custom palette.
+static bool metadata_palette_mapping(const PaletteColor* colors, u32 count, ImageMappingConfig& mapping) {
+    mapping = ImageMappingConfig();
+    for (u8 mode = 1u; mode <= 3u; ++mode) {
+        const PaletteColor* builtin = 0;
+        u32 builtin_count = 0u;
+        if (!palette_for_mode(mode, builtin, builtin_count) || builtin_count != count) {
+            continue;
+        }
+        bool matches = true;
+        for (u32 i = 0u; i < count && matches; ++i) {
+            matches = (builtin[i].r == colors[i].r && builtin[i].g == colors[i].g && builtin[i].b == colors[i].b);
+        }
+        if (matches) {
+            mapping.color_channels = mode;
+            return true;
+        }
     }
-    usize total_pixels = (usize)base_page.width * (usize)base_page.height;
-    if (base_page.pixels.size < total_pixels * 3u ||
-        overlay_page.pixels.size < total_pixels * 3u) {
+    makocode::ByteBuffer palette_text;
+    if (!MetadataTile::build_palette_text_from_colors(colors, count, palette_text) || palette_text.size < 2u) {
         return false;
     }
-    if ((base_mask.size && base_mask.size != total_pixels) ||
-        (overlay_mask.size && overlay_mask.size != total_pixels)) {
-        return false;
+    return image_mapping_set_palette_text(mapping, (const char*)palette_text.data, palette_text.size - 1u, "decode") &&
+           image_mapping_build_custom_palette(mapping, "decode");
+}
+
+// Fraction of sampled pixels within reach of a palette color, scaled down by
+// the share of palette colors that go unused. Unused colors mean the page was
+// rendered with a smaller palette.
+static double metadata_palette_fit(const u8* pixels, u64 pixel_count, const PaletteColor* colors, u32 count) {
+    if (!pixels || pixel_count == 0u || count == 0u) {
+        return 0.0;
     }
-    u32 apply_height = base_page.data_height;
-    if (overlay_page.data_height < apply_height) {
-        apply_height = overlay_page.data_height;
+    const u32 MATCH_DISTANCE_SQUARED = 3u * 64u * 64u;
+    u64 step = pixel_count / METADATA_RECOVERY_SAMPLE_COUNT;
+    if (step == 0u) {
+        step = 1u;
+    }
+    u64 hits[MAX_CUSTOM_PALETTE_COLORS] = {0u};
+    u64 samples = 0u;
+    u64 matched = 0u;
+    for (u64 pixel = 0u; pixel < pixel_count; pixel += step) {
+        const u8* rgb = pixels + pixel * 3u;
+        u32 best_distance = 0xFFFFFFFFu;
+        u32 best_index = 0u;
+        for (u32 i = 0u; i < count; ++i) {
+            int dr = (int)rgb[0] - (int)colors[i].r;
+            int dg = (int)rgb[1] - (int)colors[i].g;
+            int db = (int)rgb[2] - (int)colors[i].b;
+            u32 distance = (u32)(dr * dr + dg * dg + db * db);
+            if (distance < best_distance) {
+                best_distance = distance;
+                best_index = i;
+            }
+        }
+        ++samples;
+        if (best_distance <= MATCH_DISTANCE_SQUARED) {
+            ++matched;
+            ++hits[best_index];
+        }
     }
-    if (apply_height > base_page.height) {
-        apply_height = base_page.height;
+    if (matched == 0u) {
+        return 0.0;
     }
-    if (apply_height == 0u) {
-        return true;
+    u32 used = 0u;
+    for (u32 i = 0u; i < count; ++i) {
+        // Sparse payloads leave most of a page as padding, so even a rare
+        // color counts as used.
+        if (hits[i] * 200u >= matched) {
+            ++used;
+        }
     }
-    const bool have_base_mask = (base_mask.data && base_mask.size);
-    const bool have_overlay_mask = (overlay_mask.data && overlay_mask.size);
-    u8 sample_bits = bits_per_sample(base_page.color_mode);
-    u8 samples_per_pixel = color_mode_samples_per_pixel(base_page.color_mode);
-    if (sample_bits == 0u || samples_per_pixel == 0u) {
-        return false;
+    return ((double)matched / (double)samples) * ((double)used / (double)count);
+}
+
+static void metadata_palette_insert(MetadataPaletteCandidate* candidates,
+                                    u32& candidate_count,
+                                    u32 candidate_capacity,
+                                    const PaletteColor* colors,
+                                    u32 count,
+                                    double score) {
+    if (candidate_count >= candidate_capacity) {
+        return;
     }
-    u64 bits_per_pixel = (u64)sample_bits * (u64)samples_per_pixel;
-    struct RawOverlayPixelCandidate {
-        u64 bit_start;
-        usize pixel_index;
-    };
-    if (total_pixels > (SIZE_MAX / sizeof(RawOverlayPixelCandidate))) {
-        return false;
+    for (u32 i = 0u; i < candidate_count; ++i) {
+        if (candidates[i].count != count) {
+            continue;
+        }
+        bool same = true;
+        for (u32 c = 0u; c < count && same; ++c) {
+            same = (candidates[i].colors[c].r == colors[c].r &&
+                    candidates[i].colors[c].g == colors[c].g &&
+                    candidates[i].colors[c].b == colors[c].b);
+        }
+        if (same) {
+            return;
+        }
     }
-    usize candidate_capacity_bytes = total_pixels * sizeof(RawOverlayPixelCandidate);
-    makocode::ByteBuffer candidate_buffer;
-    if (!candidate_buffer.ensure(candidate_capacity_bytes)) {
-        return false;
+    // Keep the list sorted by descending score; equal scores keep insertion order.
+    u32 position = candidate_count;
+    while (position > 0u && candidates[position - 1u].score < score) {
+        candidates[position] = candidates[position - 1u];
+        --position;
+    }
+    for (u32 c = 0u; c < count; ++c) {
+        candidates[position].colors[c] = colors[c];
+    }
+    candidates[position].count = count;
+    candidates[position].score = score;
+    ++candidate_count;
+}
+
+// Ranks the built-in palettes and every ordering of the named colors that
+// dominate the scan. The color order decides which digit each pixel carries,
+// so it cannot be read off the histogram and has to be tried.
+static u32 metadata_rank_palettes(const u8* pixels,
+                                  u64 pixel_count,
+                                  MetadataPaletteCandidate* candidates,
+                                  u32 candidate_capacity) {
+    u32 candidate_count = 0u;
+    for (u8 mode = 1u; mode <= 3u; ++mode) {
+        const PaletteColor* colors = 0;
+        u32 count = 0u;
+        if (palette_for_mode(mode, colors, count)) {
+            metadata_palette_insert(candidates, candidate_count, candidate_capacity,
+                                    colors, count, metadata_palette_fit(pixels, pixel_count, colors, count));
+        }
+    }
+    const u32 named_count = (u32)(sizeof(NAMED_COLOR_VALUES) / sizeof(NAMED_COLOR_VALUES[0]));
+    PaletteColor present[sizeof(NAMED_COLOR_VALUES) / sizeof(NAMED_COLOR_VALUES[0])];
+    u32 present_count = 0u;
+    bool black_present = false;
+    for (u32 named = 0u; named < named_count; ++named) {
+        const PaletteColor& color = NAMED_COLOR_VALUES[named];
+        if (metadata_palette_fit(pixels, pixel_count, &color, 1u) < 0.005) {
+            continue;
+        }
+        black_present = black_present || named == NAMED_COLOR_BLACK;
+        present[present_count++] = color;
     }
-    RawOverlayPixelCandidate* candidates =
-        (RawOverlayPixelCandidate*)candidate_buffer.data;
-    usize candidate_count = 0u;
-    u64 candidate_rank = 0u;
-    for (u32 row = 0u; row < apply_height; ++row) {
-        for (u32 column = 0u; column < base_page.width; ++column) {
-            usize pixel_index = ((usize)row * (usize)base_page.width) + (usize)column;
-            bool reserved = false;
-            if (have_base_mask && base_mask.data[pixel_index]) {
-                reserved = true;
-            }
-            if (!reserved && have_overlay_mask && overlay_mask.data[pixel_index]) {
-                reserved = true;
-            }
-            if (reserved) {
-                continue;
+    // Fiducials and footer text are black on every page, so black may not be
+    // a palette color even when it shows up.
+    for (u32 pass = 0u; pass < 2u; ++pass) {
+        PaletteColor set[sizeof(NAMED_COLOR_VALUES) / sizeof(NAMED_COLOR_VALUES[0])];
+        u32 set_count = 0u;
+        for (u32 i = 0u; i < present_count; ++i) {
+            bool is_black = present[i].r == 0u && present[i].g == 0u && present[i].b == 0u;
+            if (pass == 0u || !is_black) {
+                set[set_count++] = present[i];
             }
-            usize byte_index = pixel_index * 3u;
-            if (byte_index + 2u >= base_page.pixels.size ||
-                byte_index + 2u >= overlay_page.pixels.size) {
-                return false;
+        }
+        if ((pass == 1u && !black_present) || set_count < 2u || set_count > METADATA_RECOVERY_MAX_PERMUTED_COLORS) {
+            continue;
+        }
+        u32 permutations = 1u;
+        for (u32 i = 2u; i <= set_count; ++i) {
+            permutations *= i;
+        }
+        for (u32 permutation = 0u; permutation < permutations; ++permutation) {
+            // Decode `permutation` in the factorial number system.
+            PaletteColor pool[sizeof(NAMED_COLOR_VALUES) / sizeof(NAMED_COLOR_VALUES[0])];
+            for (u32 i = 0u; i < set_count; ++i) {
+                pool[i] = set[i];
             }
-            if (ignore_list) {
-                u8 overlay_r = overlay_page.pixels.data[byte_index + 0u];
-                u8 overlay_g = overlay_page.pixels.data[byte_index + 1u];
-                u8 overlay_b = overlay_page.pixels.data[byte_index + 2u];
-                if (overlay_color_matches_ignore(*ignore_list, overlay_r, overlay_g, overlay_b)) {
-                    continue;
+            PaletteColor ordered[sizeof(NAMED_COLOR_VALUES) / sizeof(NAMED_COLOR_VALUES[0])];
+            u32 remaining = set_count;
+            u32 code = permutation;
+            for (u32 slot = 0u; slot < set_count; ++slot) {
+                u32 pick = code % remaining;
+                code /= remaining;
+                ordered[slot] = pool[pick];
+                for (u32 i = pick; i + 1u < remaining; ++i) {
+                    pool[i] = pool[i + 1u];
                 }
+                --remaining;
             }
-            RawOverlayPixelCandidate* entry = &candidates[candidate_count++];
-            entry->pixel_index = pixel_index;
-            entry->bit_start = candidate_rank * bits_per_pixel;
-            candidate_rank += 1u;
+            metadata_palette_insert(candidates, candidate_count, candidate_capacity,
+                                    ordered, set_count,
+                                    metadata_palette_fit(pixels, pixel_count, ordered, set_count));
         }
     }
-    if (candidate_count > 1u) {
-        makocode::Pcg64Generator shuffle_rng;
-        shuffle_rng.seed(0u);
-        for (usize remaining = candidate_count; remaining > 1u; --remaining) {
-            usize i = remaining - 1u;
-            u64 value = shuffle_rng.next();
-            usize j = (usize)(value % (u64)remaining);
-            RawOverlayPixelCandidate temp = candidates[i];
-            candidates[i] = candidates[j];
-            candidates[j] = temp;
-        }
+    // Palettes that explain less than half as much of the scan as the best one
+    // are not worth an extraction.
+    u32 kept = 0u;
+    while (kept < candidate_count && candidates[kept].score > 0.0 && candidates[kept].score >= candidates[0].score * 0.5) {
+        ++kept;
     }
-    if (!tracker.enabled && candidate_count > 0u) {
-        u64 requested = (u64)candidate_count;
-        requested *= numerator;
-        requested /= denominator;
-        u64 cap = (u64)candidate_count / 50u; // ~2% of candidates when ECC metadata is unknown.
-        if (cap == 0u) {
-            cap = 1u;
+    return kept;
+}
+
+static bool metadata_build_hypotheses(const u8* page_data,
+                                      usize page_size,
+                                      const ImageMappingConfig& mapping,
+                                      MetadataHypothesisTable& table) {
+    u32 image_width = 0u;
+    u32 image_height = 0u;
+    makocode::ByteBuffer pixels;
+    if (!ppm_load_page_pixels(page_data, page_size, image_width, image_height, pixels)) {
+        return false;
+    }
+    MetadataPaletteCandidate palettes[METADATA_RECOVERY_MAX_PALETTES];
+    u32 palette_count = 0u;
+    ImageMappingConfig override_mapping = mapping;
+    if (override_mapping.palette_set) {
+        // An explicit --palette is the only candidate.
+        if (!image_mapping_build_custom_palette(override_mapping, "decode")) {
+            return false;
         }
-        if (requested > cap) {
-            numerator = cap;
-            denominator = (u64)candidate_count;
-            if (numerator == 0u) {
-                numerator = 1u;
+        for (u32 c = 0u; c < override_mapping.custom_palette_count; ++c) {
+            palettes[0].colors[c] = override_mapping.custom_palette[c];
+        }
+        palettes[0].count = override_mapping.custom_palette_count;
+        palettes[0].score = 1.0;
+        palette_count = 1u;
+    } else {
+        palette_count = metadata_rank_palettes(pixels.data,
+                                               (u64)image_width * (u64)image_height,
+                                               palettes,
+                                               METADATA_RECOVERY_MAX_PALETTES);
+    }
+    // Page sizes: the scan as-is, then integer downscales, exact ones first.
+    u32 widths[METADATA_RECOVERY_MAX_SCALE];
+    u32 heights[METADATA_RECOVERY_MAX_SCALE];
+    u32 size_count = 0u;
+    if (mapping.page_width_set || mapping.page_height_set) {
+        widths[0] = mapping.page_width_set ? mapping.page_width_pixels : image_width;
+        heights[0] = mapping.page_height_set ? mapping.page_height_pixels : image_height;
+        size_count = 1u;
+    } else {
+        for (u32 pass = 0u; pass < 2u; ++pass) {
+            for (u32 scale = 1u; scale <= METADATA_RECOVERY_MAX_SCALE; ++scale) {
+                bool exact = (image_width % scale) == 0u && (image_height % scale) == 0u;
+                if (exact != (pass == 0u)) {
+                    continue;
+                }
+                widths[size_count] = (image_width + scale / 2u) / scale;
+                heights[size_count] = (image_height + scale / 2u) / scale;
+                ++size_count;
             }
         }
     }
-    u64 accumulator = 0u;
-    for (usize idx = 0u; idx < candidate_count; ++idx) {
-        const RawOverlayPixelCandidate& candidate = candidates[idx];
-        accumulator += numerator;
-        if (accumulator < denominator) {
+    const u32 font_count = (u32)(sizeof(METADATA_RECOVERY_FONT_SIZES) / sizeof(METADATA_RECOVERY_FONT_SIZES[0]));
+    if (!table.allocate((usize)palette_count * size_count * font_count)) {
+        return false;
+    }
+    for (u32 p = 0u; p < palette_count; ++p) {
+        ImageMappingConfig palette_mapping;
+        if (!metadata_palette_mapping(palettes[p].colors, palettes[p].count, palette_mapping)) {
             continue;
         }
-        accumulator -= denominator;
-        usize pixel_index = candidate.pixel_index;
-        usize byte_index = pixel_index * 3u;
-        if (byte_index + 2u >= base_page.pixels.size ||
-            byte_index + 2u >= overlay_page.pixels.size) {
+        double bits_per_pixel = mapping_bits_per_data_pixel(palette_mapping);
+        for (u32 s = 0u; s < size_count; ++s) {
+            for (u32 f = 0u; f < font_count; ++f) {
+                u32 footer_rows = FOOTER_BASE_GLYPH_HEIGHT * METADATA_RECOVERY_FONT_SIZES[f];
+                if (footer_rows >= heights[s]) {
+                    continue;
+                }
+                u32 data_height = heights[s] - footer_rows;
+                if (!MetadataTile::compute_tile_placement(widths[s], data_height).valid) {
+                    continue;
+                }
+                u64 page_bits = 0u;
+                if (!compute_bits_per_page(widths[s], heights[s], data_height, bits_per_pixel, page_bits) ||
+                    page_bits == 0u) {
+                    continue;
+                }
+                MetadataHypothesis& hypothesis = table.entries[table.count];
+                hypothesis.values = MetadataTile::Values();
+                hypothesis.values.page_bits = page_bits;
+                hypothesis.values.page_width_pixels = widths[s];
+                hypothesis.values.page_height_pixels = heights[s];
+                hypothesis.values.footer_rows = footer_rows;
+                hypothesis.values.fiducial_marker_size_pixels = g_fiducial_defaults.marker_size_pixels ? g_fiducial_defaults.marker_size_pixels : 1u;
+                hypothesis.values.palette_count = palettes[p].count;
+                for (u32 c = 0u; c < palettes[p].count; ++c) {
+                    hypothesis.values.palette[c] = palettes[p].colors[c];
+                }
+                hypothesis.rank = p + s + f;
+                // Insertion sort by rank; ties keep palette-major order.
+                usize position = table.count;
+                while (position > 0u && table.entries[position - 1u].rank > hypothesis.rank) {
+                    --position;
+                }
+                if (position != table.count) {
+                    MetadataHypothesis moved = hypothesis;
+                    for (usize i = table.count; i > position; --i) {
+                        table.entries[i] = table.entries[i - 1u];
+                    }
+                    table.entries[position] = moved;
+                }
+                ++table.count;
+            }
+        }
+    }
+    return table.count > 0u;
+}
+
+struct MetadataRecoveryJob {
+    // The whole input set; multi-page hypotheses are checked against it.
+    makocode::PageSource* source;
+    const u8* page_data;
+    usize page_size;
+    const ImageMappingConfig* mapping;
+    const char* password;
+    usize password_length;
+    bool disable_subgrid;
+    MetadataHypothesis* hypotheses;
+    usize hypothesis_count;
+    usize next_hypothesis;
+    // Lowest index proven valid so far; hypothesis_count while none is.
+    usize accepted;
+
+    MetadataRecoveryJob()
+        : source(0),
+          page_data(0),
+          page_size(0u),
+          mapping(0),
+          password(0),
+          password_length(0u),
+          disable_subgrid(false),
+          hypotheses(0),
+          hypothesis_count(0u),
+          next_hypothesis(0u),
+          accepted(0u) {}
+};
+
+// Whether the frame in `frame_bits` decodes: its header has to size a
+// payload that fits, ECC has to repair every block, and the result has to
+// open as an archive, since without ECC nothing else checks the bits. A
+// found `ecc_header` replaces the header copies, which may be damaged.
+static bool metadata_frame_decodes(const MetadataRecoveryJob& job,
+                                   const u8* frame_bits,
+                                   u64 frame_bit_count,
+                                   bool ecc_found,
+                                   const makocode::EccHeader& ecc_header) {
+    makocode::BitReader reader;
+    reader.reset(frame_bits, frame_bit_count);
+    u64 header_bits = reader.read_bits(64u);
+    if (reader.failed || header_bits == 0u || header_bits > frame_bit_count - 64u) {
+        return false;
+    }
+    makocode::ByteBuffer payload;
+    if (!copy_bits_segment(frame_bits, frame_bit_count, 64u, header_bits, payload)) {
+        return false;
+    }
+    if (ecc_found &&
+        !makocode::build_ecc_header_bytes(payload.data,
+                                          payload.size,
+                                          ecc_header.block_data,
+                                          ecc_header.parity,
+                                          ecc_header.block_count,
+                                          ecc_header.original_bytes,
+                                          (ecc_header.flags & makocode::ECC_HEADER_FLAG_INTERLEAVED) != 0u)) {
+        return false;
+    }
+    makocode::DecoderContext decoder;
+    if (!decoder.parse(payload.data, header_bits, job.password, job.password_length) ||
+        decoder.ecc_correction_failed()) {
+        return false;
+    }
+    return decoder.payload.size >= ARCHIVE_MAGIC_SIZE &&
+           memcmp(decoder.payload.data, ARCHIVE_MAGIC, ARCHIVE_MAGIC_SIZE) == 0;
+}
+
+// Extracts every page of the set under `values` and joins them the way
+// decode_pages does, each page contributing its first page_bits bits.
+static bool metadata_assemble_set(const MetadataRecoveryJob& job,
+                                  const MetadataTile::Values& values,
+                                  makocode::BitWriter& frame) {
+    makocode::PageSource& source = *job.source;
+    frame.reset();
+    for (usize file_index = 0u; file_index < source.page_count; ++file_index) {
+        InputFile page_input;
+        if (!source.open_page(source.context, file_index, page_input)) {
+            return false;
+        }
+        makocode::ByteBuffer page_bits;
+        u64 page_bit_count = 0u;
+        PpmParserState state;
+        if (!ppm_extract_frame_bits(page_input.data,
+                                    page_input.size,
+                                    *job.mapping,
+                                    page_bits,
+                                    page_bit_count,
+                                    state,
+                                    job.disable_subgrid,
+                                    0,
+                                    &values)) {
             return false;
         }
-        bool changed = false;
-        if (base_page.pixels.data[byte_index + 0u] != overlay_page.pixels.data[byte_index + 0u] ||
-            base_page.pixels.data[byte_index + 1u] != overlay_page.pixels.data[byte_index + 1u] ||
-            base_page.pixels.data[byte_index + 2u] != overlay_page.pixels.data[byte_index + 2u]) {
-            changed = true;
+        u64 effective_bits = page_bit_count;
+        if (state.has_page_bits && state.page_bits_value <= effective_bits) {
+            effective_bits = state.page_bits_value;
         }
-        if (changed) {
-            if (!raw_overlay_tracker_try_reserve_bits(tracker, candidate.bit_start, bits_per_pixel)) {
-                continue;
-            }
+        if (!append_bits_from_buffer(frame, page_bits.data, effective_bits)) {
+            return false;
         }
-        memcpy(base_page.pixels.data + byte_index,
-               overlay_page.pixels.data + byte_index,
-               3u);
     }
-    raw_overlay_tracker_finish(tracker);
     return true;
 }
 
-static bool serialize_overlay_page(const OverlayPage& page,
-                                   makocode::ByteBuffer& output) {
-    output.release();
-    if (!ppm_write_metadata_header(page.metadata, output)) {
+// Extracts the page under `values` and checks what it yields. A page holding
+// the whole frame must decode outright. Otherwise the Reed-Solomon protected
+// ECC header copies at the start of the payload must agree, and when the page
+// belongs to a larger set, the set must decode too: the header copies sit in
+// the first rows and read the same under every footer height, while the
+// footer decides how many bits each page adds to the frame, so only the
+// assembled frame tells footer hypotheses apart. On success the measured
+// capacity and the ECC layout read from that header are copied into `values`.
+static bool metadata_hypothesis_verifies(const MetadataRecoveryJob& job, MetadataTile::Values& values) {
+    makocode::ByteBuffer frame_bits;
+    u64 frame_bit_count = 0u;
+    PpmParserState state;
+    if (!ppm_extract_frame_bits(job.page_data,
+                                job.page_size,
+                                *job.mapping,
+                                frame_bits,
+                                frame_bit_count,
+                                state,
+                                job.disable_subgrid,
+                                0,
+                                &values)) {
         return false;
     }
-    if (!ppm_append_extended_metadata(page.metadata, output)) {
+    // The sampler sizes the data area from the fiducials it finds, so the
+    // capacity it measured replaces the hypothesis. Custom palettes count the
+    // 64-bit frame header as well.
+    ImageMappingConfig palette_mapping;
+    if (!metadata_palette_mapping(values.palette, values.palette_count, palette_mapping)) {
         return false;
     }
-    if (!ppm_append_fiducial_metadata(page.metadata, output)) {
+    u64 header_overhead = palette_mapping.palette_set ? 64u : 0u;
+    if (frame_bit_count <= header_overhead + 64u) {
         return false;
     }
-    if (!ppm_write_dimensions((u64)page.width, (u64)page.height, output)) {
+    values.page_bits = frame_bit_count - header_overhead;
+    makocode::BitReader reader;
+    reader.reset(frame_bits.data, frame_bit_count);
+    u64 header_bits = reader.read_bits(64u);
+    if (reader.failed) {
         return false;
     }
-    if (!page.pixels.data) {
+    u64 available_bits = frame_bit_count - 64u;
+    bool whole_frame = header_bits > 0u && header_bits <= available_bits;
+    u64 payload_bits = whole_frame ? header_bits : available_bits;
+    makocode::ByteBuffer payload;
+    if (!copy_bits_segment(frame_bits.data, frame_bit_count, 64u, payload_bits, payload)) {
         return false;
     }
-    usize total_pixels = (usize)page.width * (usize)page.height;
-    if (page.pixels.size < total_pixels * 3u) {
+    // The header copies carry their own Reed-Solomon parity, so they verify
+    // even when damage elsewhere on the page has hit the leading magic.
+    makocode::EccHeader ecc_header;
+    u32 repaired_copies = 0u;
+    u32 valid_copies = 0u;
+    bool ecc_found = payload.size >= makocode::ECC_HEADER_TOTAL_BYTES &&
+                     makocode::reconstruct_ecc_header_copies(payload.data, payload.size, ecc_header, repaired_copies, valid_copies) &&
+                     ecc_header.magic == makocode::ECC_HEADER_MAGIC &&
+                     (ecc_header.flags & makocode::ECC_HEADER_FLAG_ENABLED) != 0u;
+    if (!ecc_found && !whole_frame) {
         return false;
     }
-    for (usize index = 0u; index < total_pixels; ++index) {
-        const u8* rgb = page.pixels.data + index * 3u;
-        for (u8 channel = 0u; channel < 3u; ++channel) {
-            if (channel) {
-                if (!output.append_char(' ')) {
-                    return false;
-                }
-            }
-            if (!buffer_append_number(output, (u64)rgb[channel])) {
-                return false;
-            }
-        }
-        if (!output.append_char('\n')) {
+    if (whole_frame && !metadata_frame_decodes(job, frame_bits.data, frame_bit_count, ecc_found, ecc_header)) {
+        return false;
+    }
+    if (ecc_found) {
+        values.ecc_enabled = true;
+        values.ecc_block_data = ecc_header.block_data;
+        values.ecc_parity = ecc_header.parity;
+        values.ecc_block_count = ecc_header.block_count;
+        values.ecc_original_bytes = ecc_header.original_bytes;
+    }
+    if (!whole_frame && job.source->page_count > 1u) {
+        makocode::BitWriter set_frame;
+        if (!metadata_assemble_set(job, values, set_frame) ||
+            !metadata_frame_decodes(job, set_frame.data(), set_frame.bit_size(), ecc_found, ecc_header)) {
             return false;
         }
     }
     return true;
 }
 
-static bool write_buffer_to_fd(int fd, const makocode::ByteBuffer& buffer) {
-    if (!buffer.data || buffer.size == 0u) {
-        return true;
-    }
-    usize offset = 0u;
-    while (offset < buffer.size) {
-        unsigned long chunk = (unsigned long)(buffer.size - offset);
-        if (chunk > 65536ul) {
-            chunk = 65536ul;
+static void* metadata_recovery_worker(void* context) {
+    MetadataRecoveryJob& job = *(MetadataRecoveryJob*)context;
+    for (;;) {
+        usize index = __atomic_fetch_add(&job.next_hypothesis, (usize)1u, __ATOMIC_RELAXED);
+        // Every lower index is already taken, so once one verifies, later
+        // hypotheses cannot win and the workers drain.
+        if (index >= job.hypothesis_count || index > __atomic_load_n(&job.accepted, __ATOMIC_RELAXED)) {
+            break;
         }
-        int wrote = write(fd, buffer.data + offset, chunk);
-        if (wrote <= 0) {
-            return false;
+        if (!metadata_hypothesis_verifies(job, job.hypotheses[index].values)) {
+            continue;
         }
-        offset += (usize)wrote;
+        usize current = __atomic_load_n(&job.accepted, __ATOMIC_RELAXED);
+        while (index < current &&
+               !__atomic_compare_exchange_n(&job.accepted, &current, index, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+    }
+    return 0;
+}
+
+// Searches for the layout of page `file_index`, whose metadata tile could not
+// be read. The best-ranked hypothesis that verifies wins regardless of the
+// thread count.
+static bool recover_page_metadata(makocode::PageSource& source,
+                                  usize file_index,
+                                  const ImageMappingConfig& mapping,
+                                  const makocode::DecodeOptions& options,
+                                  bool disable_subgrid,
+                                  MetadataTile::Values& recovered) {
+    InputFile page_input;
+    if (!source.open_page(source.context, file_index, page_input)) {
+        return false;
     }
+    MetadataHypothesisTable table;
+    if (!metadata_build_hypotheses(page_input.data, page_input.size, mapping, table)) {
+        return false;
+    }
+    MetadataRecoveryJob job;
+    job.source = &source;
+    job.page_data = page_input.data;
+    job.page_size = page_input.size;
+    job.mapping = &mapping;
+    job.password = options.password;
+    job.password_length = options.password_length;
+    job.disable_subgrid = disable_subgrid;
+    job.hypotheses = table.entries;
+    job.hypothesis_count = table.count;
+    job.accepted = table.count;
+    u64 worker_count = options.jobs ? (u64)options.jobs : 1u;
+    if (worker_count > (u64)table.count) {
+        worker_count = (u64)table.count;
+    }
+    run_worker_pool(metadata_recovery_worker, &job, worker_count);
+    if (job.accepted >= table.count) {
+        return false;
+    }
+    recovered = table.entries[job.accepted].values;
     return true;
 }
 
-static int command_overlay(int arg_count, char** args) {
-    if (arguments_request_help(arg_count, args)) {
-        write_overlay_help();
-        return 0;
+// Layout of a page that extracted normally, for siblings whose tile is
+// unreadable. Returns false when the page carried no palette to copy.
+static bool metadata_values_from_state(const PpmParserState& state, MetadataTile::Values& values) {
+    if (!state.has_bits || !state.has_page_width_pixels || !state.has_page_height_pixels ||
+        !state.has_palette_text || !state.palette_text_length) {
+        return false;
     }
-    OverlayIgnoreColorList ignore_colors;
-    ignore_colors.count = 0u;
-    const char* ignore_text = 0;
-    usize ignore_length = 0u;
-    bool ignore_specified = false;
-    bool ecc_target_specified = false;
-    u64 ecc_target_numerator = 0u;
-    u64 ecc_target_denominator = 1u;
-    int option_index = 0;
-    const char ignore_option[] = "--ignore-colors";
-    const char ignore_prefix[] = "--ignore-colors=";
-    const char ecc_target_option[] = "--overlay-ecc-target";
-    const char ecc_target_prefix[] = "--overlay-ecc-target=";
-    while (option_index < arg_count) {
-        const char* arg = args[option_index];
-        if (!arg) {
-            ++option_index;
-            continue;
+    ImageMappingConfig palette_mapping;
+    if (!image_mapping_set_palette_text(palette_mapping, state.palette_text, state.palette_text_length, "decode") ||
+        !image_mapping_build_custom_palette(palette_mapping, "decode")) {
+        return false;
+    }
+    values = MetadataTile::Values();
+    values.page_bits = state.bits_value;
+    values.page_count = state.has_page_count ? state.page_count_value : 0u;
+    values.page_width_pixels = (u32)state.page_width_pixels_value;
+    values.page_height_pixels = (u32)state.page_height_pixels_value;
+    values.footer_rows = state.has_footer_rows ? (u32)state.footer_rows_value : 0u;
+    values.fiducial_marker_size_pixels = state.has_fiducial_size ? (u32)state.fiducial_size_value : 0u;
+    values.ecc_enabled = state.has_ecc_flag && state.ecc_flag_value;
+    if (values.ecc_enabled) {
+        values.ecc_block_data = (u16)state.ecc_block_data_value;
+        values.ecc_parity = (u16)state.ecc_parity_value;
+        values.ecc_block_count = state.ecc_block_count_value;
+        values.ecc_original_bytes = state.ecc_original_bytes_value;
+    }
+    values.palette_count = palette_mapping.custom_palette_count;
+    for (u32 c = 0u; c < palette_mapping.custom_palette_count; ++c) {
+        values.palette[c] = palette_mapping.custom_palette[c];
+    }
+    values.schema_version = state.whole_page_digits ? MetadataTile::TILE_SCHEMA_WHOLE_PAGE_DIGITS
+                                                    : MetadataTile::TILE_SCHEMA_VERSION;
+    return true;
+}
+
+enum FrameDecodeResult {
+    FrameDecode_Decoded = 0,
+    FrameDecode_Failed = 1,
+    // The caller may re-extract its pages without the fiducial subgrid.
+    FrameDecode_RetrySubgrid = 2
+};
+
+// Turns an assembled frame (every page's bits back to back) into the
+// recovered archive: reads the frame header, repairs the ECC header from page
+// metadata, then runs ECC, decryption and decompression. With
+// `can_retry_subgrid`, failures that a subgrid-free extraction might fix
+// return FrameDecode_RetrySubgrid. A `tentative` attempt fails quietly,
+// including when ECC leaves blocks unrepaired, so a progressive decode can try
+// again once more pages arrive.
+static FrameDecodeResult decode_assembled_frame(const u8* frame_data,
+                                                u64 frame_bit_total,
+                                                const makocode::ByteBuffer* frame_erasures,
+                                                PpmParserState& aggregate_state,
+                                                ImageMappingConfig& mapping,
+                                                const makocode::DecodeOptions& options,
+                                                bool can_retry_subgrid,
+                                                bool tentative,
+                                                makocode::ByteBuffer& out,
+                                                makocode::DecodeReport& report) {
+    makocode::ByteBuffer bitstream;
+    makocode::ByteBuffer bitstream_erasures;
+    u64 bit_count = 0u;
+    if (!frame_bits_to_payload(frame_data,
+                               frame_bit_total,
+                               aggregate_state,
+                               bitstream,
+                               bit_count,
+                               frame_erasures,
+                               &bitstream_erasures)) {
+        if (can_retry_subgrid) {
+            console_line(2, "decode: retrying without fiducial subgrid (payload header unreadable)");
+            return FrameDecode_RetrySubgrid;
+        }
+        if (!tentative) {
+            console_line(2, "decode: failed to extract payload bits");
         }
-        if (consume_debug_flag(arg)) {
-            ++option_index;
-            continue;
+        return FrameDecode_Failed;
+    }
+    if (aggregate_state.has_palette_text &&
+        aggregate_state.palette_text_length &&
+        !mapping.palette_set) {
+        if (!image_mapping_set_palette_text(mapping,
+                                            aggregate_state.palette_text,
+                                            aggregate_state.palette_text_length,
+                                            "decode")) {
+            return FrameDecode_Failed;
         }
-        usize length = ascii_length(arg);
-        if (ascii_equals_token(arg, length, ignore_option)) {
-            if (ignore_specified) {
-                console_line(2, "overlay: --ignore-colors specified multiple times");
-                return 1;
-            }
-            if ((option_index + 1) >= arg_count) {
-                console_line(2, "overlay: --ignore-colors requires a value");
-                return 1;
-            }
-            const char* value = args[option_index + 1];
-            if (!value) {
-                console_line(2, "overlay: --ignore-colors requires a value");
-                return 1;
-            }
-            usize value_length = ascii_length(value);
-            if (value_length == 0u) {
-                console_line(2, "overlay: --ignore-colors requires a non-empty value");
-                return 1;
-            }
-            ignore_text = value;
-            ignore_length = value_length;
-            ignore_specified = true;
-            option_index += 2;
-            continue;
+        if (!image_mapping_build_custom_palette(mapping, "decode")) {
+            return FrameDecode_Failed;
         }
-        if (ascii_starts_with(arg, ignore_prefix)) {
-            if (ignore_specified) {
-                console_line(2, "overlay: --ignore-colors specified multiple times");
-                return 1;
-            }
-            const char* value = arg + (sizeof(ignore_prefix) - 1u);
-            if (!value || *value == '\0') {
-                console_line(2, "overlay: --ignore-colors requires a non-empty value");
-                return 1;
+    }
+    bool ecc_header_repaired = false;
+    makocode::EccHeaderInfo bitstream_header;
+    bool bitstream_header_present = false;
+    bool bitstream_header_valid = false;
+    if (bitstream.data && bitstream.size >= makocode::ECC_HEADER_TOTAL_BYTES) {
+        bitstream_header_present = makocode::parse_ecc_header(bitstream.data, bitstream.size, bitstream_header);
+        bitstream_header_valid = bitstream_header_present && bitstream_header.valid && bitstream_header.enabled;
+    }
+    bool ecc_metadata_available = aggregate_state.has_ecc_flag && aggregate_state.ecc_flag_value;
+    bool ecc_metadata_complete = ecc_metadata_available &&
+                                 aggregate_state.has_ecc_block_data &&
+                                 aggregate_state.has_ecc_parity &&
+                                 aggregate_state.has_ecc_block_count &&
+                                 aggregate_state.has_ecc_original_bytes;
+    // Only surface the absence of ECC when the user explicitly requests debug
+    // logging; tests intentionally encode payloads without ECC and should not
+    // emit warnings during normal operation.
+    if (aggregate_state.has_ecc_flag &&
+        !aggregate_state.ecc_flag_value &&
+        debug_logging_enabled()) {
+        console_line(1, "decode: note: payload was encoded without ECC protection");
+    }
+    if (!bitstream_header_valid) {
+        if (ecc_metadata_complete &&
+            bitstream.data &&
+            bitstream.size >= makocode::ECC_HEADER_TOTAL_BYTES &&
+            bit_count >= (u64)makocode::ECC_HEADER_TOTAL_BITS) {
+            u64 block_data_value = aggregate_state.ecc_block_data_value;
+            u64 parity_value = aggregate_state.ecc_parity_value;
+            if (block_data_value <= 0xFFFFu && parity_value <= 0xFFFFu) {
+                u8 header_bytes[makocode::ECC_HEADER_TOTAL_BYTES];
+                if (makocode::build_ecc_header_bytes(header_bytes,
+                                           makocode::ECC_HEADER_TOTAL_BYTES,
+                                           (u16)block_data_value,
+                                           (u16)parity_value,
+                                           aggregate_state.ecc_block_count_value,
+                                           aggregate_state.ecc_original_bytes_value,
+                                           aggregate_state.ecc_interleaved)) {
+                    bool differs = false;
+                    for (usize i = 0u; i < makocode::ECC_HEADER_TOTAL_BYTES; ++i) {
+                        if (bitstream.data[i] != header_bytes[i]) {
+                            differs = true;
+                            break;
+                        }
+                    }
+                    if (differs) {
+                        for (usize i = 0u; i < makocode::ECC_HEADER_TOTAL_BYTES; ++i) {
+                            bitstream.data[i] = header_bytes[i];
+                        }
+                        ecc_header_repaired = true;
+                    }
+                }
             }
-            ignore_text = value;
-            ignore_length = ascii_length(value);
-            ignore_specified = true;
-            ++option_index;
-            continue;
+        } else if (ecc_metadata_available) {
+            console_line(2, "decode: warning: ECC metadata incomplete; header reconstruction skipped");
         }
-        if (ascii_equals_token(arg, length, ecc_target_option)) {
-            if (ecc_target_specified) {
-                console_line(2, "overlay: --overlay-ecc-target specified multiple times");
-                return 1;
-            }
-            if ((option_index + 1) >= arg_count) {
-                console_line(2, "overlay: --overlay-ecc-target requires a value");
-                return 1;
-            }
-            const char* value = args[option_index + 1];
-            if (!value) {
-                console_line(2, "overlay: --overlay-ecc-target requires a value");
-                return 1;
-            }
-            usize value_length = ascii_length(value);
-            if (value_length == 0u) {
-                console_line(2, "overlay: --overlay-ecc-target requires a non-empty value");
-                return 1;
-            }
-            if (!ascii_to_fraction(value, value_length, ecc_target_numerator, ecc_target_denominator)) {
-                console_line(2, "overlay: --overlay-ecc-target requires a decimal value such as 0.5");
-                return 1;
-            }
-            if (ecc_target_denominator == 0u) {
-                console_line(2, "overlay: --overlay-ecc-target requires a non-zero denominator");
-                return 1;
-            }
-            ecc_target_specified = true;
-            option_index += 2;
-            continue;
+    }
+    if (ecc_header_repaired && !tentative) {
+        console_line(2, "decode: repaired ECC header from metadata");
+    }
+    if (options.corrupt_header_copies > 0u &&
+        bitstream.data &&
+        bitstream.size >= ((usize)makocode::ECC_HEADER_COPY_TOTAL_BYTES)) {
+        u32 count = options.corrupt_header_copies;
+        if (count > (u32)makocode::ECC_HEADER_COPY_COUNT) {
+            count = (u32)makocode::ECC_HEADER_COPY_COUNT;
         }
-        if (ascii_starts_with(arg, ecc_target_prefix)) {
-            if (ecc_target_specified) {
-                console_line(2, "overlay: --overlay-ecc-target specified multiple times");
-                return 1;
-            }
-            const char* value = arg + (sizeof(ecc_target_prefix) - 1u);
-            if (!value || *value == '\0') {
-                console_line(2, "overlay: --overlay-ecc-target requires a non-empty value");
-                return 1;
+        for (u32 copy_index = 0u; copy_index < count; ++copy_index) {
+            usize base = (usize)copy_index * makocode::ECC_HEADER_COPY_TOTAL_BYTES + makocode::ECC_HEADER_COPY_DATA_BYTES;
+            usize limit = base + ((usize)makocode::ECC_HEADER_COPY_PARITY_SYMBOLS + 1u);
+            usize copy_end = ((usize)copy_index + 1u) * makocode::ECC_HEADER_COPY_TOTAL_BYTES;
+            if (limit > copy_end) {
+                limit = copy_end;
             }
-            if (!ascii_to_fraction(value, ascii_length(value), ecc_target_numerator, ecc_target_denominator)) {
-                console_line(2, "overlay: --overlay-ecc-target requires a decimal value such as 0.5");
-                return 1;
+            if (limit > bitstream.size) {
+                limit = bitstream.size;
             }
-            if (ecc_target_denominator == 0u) {
-                console_line(2, "overlay: --overlay-ecc-target requires a non-zero denominator");
-                return 1;
+            for (usize i = base; i < limit; ++i) {
+                bitstream.data[i] ^= 0xFFu;
             }
-            ecc_target_specified = true;
-            ++option_index;
-            continue;
         }
-        break;
-    }
-    int positional_count = arg_count - option_index;
-    if (positional_count != 3) {
-        console_line(2, "overlay: usage: makocode overlay [--ignore-colors COLORS] [--overlay-ecc-target TARGET] BASE.ppm OVERLAY.ppm FRACTION");
-        return 1;
-    }
-    const char* base_path = args[option_index];
-    const char* overlay_path = args[option_index + 1];
-    const char* fraction_text = args[option_index + 2];
-    if (ignore_specified) {
-        if (!parse_overlay_ignore_colors(ignore_text, ignore_length, ignore_colors)) {
-            return 1;
+        if (debug_logging_enabled()) {
+            char count_buffer[32];
+            u64_to_ascii((u64)count, count_buffer, sizeof(count_buffer));
+            console_write(2, "debug decode: corrupted ");
+            console_write(2, count_buffer);
+            console_line(2, " header copies");
         }
     }
-    const OverlayIgnoreColorList* overlay_ignore = (ignore_colors.count > 0u) ? &ignore_colors : 0;
-    if (!base_path || !overlay_path || !fraction_text) {
-        console_line(2, "overlay: arguments may not be empty");
-        return 1;
-    }
-    usize fraction_length = ascii_length(fraction_text);
-    u64 numerator = 0u;
-    u64 denominator = 1u;
-    if (fraction_length == 0u ||
-        !ascii_to_fraction(fraction_text, fraction_length, numerator, denominator)) {
-        console_line(2, "overlay: fraction must be a decimal value such as 0.25");
-        return 1;
+    const char* debug_bitstream_path = getenv("MAKOCODE_DEBUG_BITSTREAM");
+    if (debug_bitstream_path && *debug_bitstream_path && bitstream.data && bitstream.size > 0u) {
+        int dump_fd = open(debug_bitstream_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (dump_fd >= 0) {
+            const u8* dump_ptr = bitstream.data;
+            usize dump_remaining = bitstream.size;
+            while (dump_remaining > 0u) {
+                usize chunk = dump_remaining;
+                if (chunk > 1u << 20) {
+                    chunk = 1u << 20;
+                }
+                ssize_t write_result = write(dump_fd, dump_ptr, chunk);
+                if (write_result < 0) {
+                    if (debug_logging_enabled()) {
+                        console_line(2, "debug decode: bitstream dump write failed");
+                    }
+                    break;
+                }
+                if (write_result == 0) {
+                    break;
+                }
+                dump_ptr += (usize)write_result;
+                dump_remaining -= (usize)write_result;
+            }
+            close(dump_fd);
+        } else if (debug_logging_enabled()) {
+            console_write(2, "debug decode: failed to open bitstream dump ");
+            console_line(2, debug_bitstream_path);
+        }
     }
-    if (denominator == 0u) {
-        console_line(2, "overlay: invalid fraction");
-        return 1;
+
+    makocode::DecoderContext decoder;
+    decoder.keep_block_container = (options.extract_path != 0);
+    const u8* erasure_ptr = (bitstream_erasures.size >= bitstream.size) ? bitstream_erasures.data : (const u8*)0;
+    bool parsed = decoder.parse(bitstream.data, bit_count, options.password, options.password_length, erasure_ptr);
+    stats_record_ecc(decoder.ecc_statistics());
+    // A tentative decode only counts when every block repaired; otherwise
+    // the caller waits for more pages.
+    if (tentative && (!parsed || decoder.ecc_correction_failed())) {
+        return FrameDecode_Failed;
+    }
+    if (!parsed) {
+        if (decoder.password_auth_failed()) {
+            console_line(2, "decode: decryption failed (password mismatch or corrupted data)");
+            return FrameDecode_Failed;
+        }
+        if (can_retry_subgrid) {
+            if (decoder.ecc_correction_failed()) {
+                console_line(2, "decode: ECC could not repair the payload; retrying without fiducial subgrid");
+            } else {
+                console_line(2, "decode: parse failure; retrying without fiducial subgrid");
+            }
+            return FrameDecode_RetrySubgrid;
+        }
+        if (decoder.ecc_correction_failed()) {
+            console_line(2, "decode: ECC could not repair the payload");
+        } else {
+            console_line(2, "decode: parse failure");
+        }
+        return FrameDecode_Failed;
     }
-    if (numerator >= denominator) {
-        numerator = denominator;
+    if (ecc_header_repaired) {
+        if (tentative) {
+            console_line(2, "decode: repaired ECC header from metadata");
+        }
+        report.ecc_header_repaired = true;
     }
-    OverlayPage base_page;
-    OverlayPage overlay_page;
-    if (!load_overlay_page(base_path, base_page)) {
-        return 1;
+    if (decoder.password_attempt_made() && decoder.password_was_ignored()) {
+        console_line(2, "decode: warning: payload was not encrypted; password ignored");
+        report.password_ignored = true;
     }
-    if (!load_overlay_page(overlay_path, overlay_page)) {
-        return 1;
+    if (decoder.ecc_correction_failed()) {
+        console_line(2, "decode: warning: payload may contain uncorrected errors");
+        report.ecc_uncorrected = true;
     }
-    if (base_page.width != overlay_page.width ||
-        base_page.height != overlay_page.height) {
-        console_line(2, "overlay: ppm images must have identical dimensions");
-        return 1;
+    report.ecc = decoder.ecc_statistics();
+    if (!decoder.has_payload) {
+        console_line(2, "decode: no payload recovered");
+        return FrameDecode_Failed;
     }
-    // Align overlay layout to the base so fiducial/data regions match pixel-for-pixel.
-    overlay_apply_base_layout(base_page, overlay_page);
-    makocode::ByteBuffer base_mask;
-    makocode::ByteBuffer overlay_mask;
-    u64 base_reserved = 0u;
-    u64 overlay_reserved = 0u;
-    if (!build_overlay_mask(base_page, base_mask, base_reserved)) {
-        console_line(2, "overlay: failed to prepare fiducial mask for base image");
-        return 1;
+    if (decoder.payload_is_block_container) {
+        return extract_block_container_entries(decoder.payload, options.extract_path, out) ? FrameDecode_Decoded
+                                                                                           : FrameDecode_Failed;
     }
-    if (!build_overlay_mask(overlay_page, overlay_mask, overlay_reserved)) {
-        console_line(2, "overlay: failed to prepare fiducial mask for overlay image");
-        return 1;
+    out.data = decoder.payload.data;
+    out.size = decoder.payload.size;
+    out.capacity = decoder.payload.capacity;
+    decoder.payload.data = 0;
+    decoder.payload.size = 0u;
+    decoder.payload.capacity = 0u;
+    return FrameDecode_Decoded;
+}
+
+
+bool makocode::decode_pages(PageSource& source,
+                            const DecodeOptions& options,
+                            ByteBuffer& out,
+                            DecodeReport& report) {
+    out.release();
+    report = DecodeReport();
+    usize file_count = source.page_count;
+    if (file_count == 0u || !source.open_page) {
+        console_line(2, "decode: no input pages");
+        return false;
     }
-    if (base_mask.size != overlay_mask.size) {
-        console_line(2, "overlay: fiducial mask size mismatch");
-        return 1;
+    report.page_count = (u64)file_count;
+    ImageMappingConfig mapping = options.mapping;
+    if (mapping.palette_set) {
+        if (!image_mapping_build_custom_palette(mapping, "decode")) {
+            return false;
+        }
     }
-    if (ecc_target_specified) {
-        RawOverlayBlockTracker ecc_tracker;
-        raw_overlay_tracker_init(base_page, ecc_tracker);
-        if (!ecc_tracker.enabled) {
-            console_line(2, "overlay: --overlay-ecc-target requires ECC metadata");
-            return 1;
+    PpmParserState aggregate_state;
+    bool force_disable_subgrid = false;
+    bool retried_subgrid = false;
+    char name_buffer[48];
+    MetadataTile::Values recovered_metadata;
+    bool have_recovered_metadata = false;
+
+retry_decode:
+    aggregate_state = PpmParserState();
+    {
+        DecodedPageTable page_table;
+        if (!page_table.allocate(file_count)) {
+            console_line(2, "decode: failed to allocate page table");
+            return false;
+        }
+        DecodedPage* pages = page_table.pages;
+        DecodePageJob page_job;
+        page_job.source = &source;
+        page_job.pages = pages;
+        page_job.file_count = file_count;
+        page_job.mapping = &mapping;
+        page_job.disable_subgrid = force_disable_subgrid;
+        run_decode_page_job(page_job, options.jobs);
+        // Re-extract only the pages that failed, this time without the subgrid.
+        if (!force_disable_subgrid) {
+            usize failed_pages = 0u;
+            for (usize file_index = 0u; file_index < file_count; ++file_index) {
+                if (pages[file_index].read_ok && !pages[file_index].extracted) {
+                    ++failed_pages;
+                }
+            }
+            if (failed_pages) {
+                char failed_buffer[32];
+                u64_to_ascii((u64)failed_pages, failed_buffer, sizeof(failed_buffer));
+                console_write(2, "decode: retrying ");
+                console_write(2, failed_buffer);
+                console_line(2, " page(s) without fiducial subgrid (frame extraction failed)");
+                stats_count(StatsCounter_SubgridRetries, (u64)failed_pages);
+                report.subgrid_retried = true;
+                page_job.disable_subgrid = true;
+                page_job.retry_only = true;
+                run_decode_page_job(page_job, options.jobs);
+            }
+        }
+        if (options.recover_metadata) {
+            usize first_failed = file_count;
+            usize first_extracted = file_count;
+            for (usize file_index = 0u; file_index < file_count; ++file_index) {
+                if (pages[file_index].extracted) {
+                    if (first_extracted == file_count) {
+                        first_extracted = file_index;
+                    }
+                } else if (pages[file_index].read_ok && first_failed == file_count) {
+                    first_failed = file_index;
+                }
+            }
+            if (first_failed < file_count && !have_recovered_metadata) {
+                // Pages of one encode share a layout, so a readable sibling
+                // beats guessing.
+                have_recovered_metadata = first_extracted < file_count &&
+                                          metadata_values_from_state(pages[first_extracted].state, recovered_metadata);
+                if (!have_recovered_metadata) {
+                    have_recovered_metadata = recover_page_metadata(source,
+                                                                    first_failed,
+                                                                    mapping,
+                                                                    options,
+                                                                    force_disable_subgrid,
+                                                                    recovered_metadata);
+                }
+                if (have_recovered_metadata) {
+                    char width_buffer[32];
+                    char height_buffer[32];
+                    char colors_buffer[32];
+                    char footer_buffer[32];
+                    char bits_buffer[32];
+                    u64_to_ascii((u64)recovered_metadata.page_width_pixels, width_buffer, sizeof(width_buffer));
+                    u64_to_ascii((u64)recovered_metadata.page_height_pixels, height_buffer, sizeof(height_buffer));
+                    u64_to_ascii((u64)recovered_metadata.palette_count, colors_buffer, sizeof(colors_buffer));
+                    u64_to_ascii((u64)recovered_metadata.footer_rows, footer_buffer, sizeof(footer_buffer));
+                    u64_to_ascii(recovered_metadata.page_bits, bits_buffer, sizeof(bits_buffer));
+                    console_write(2, "decode: recovered metadata: ");
+                    console_write(2, width_buffer);
+                    console_write(2, "x");
+                    console_write(2, height_buffer);
+                    console_write(2, " page, ");
+                    console_write(2, colors_buffer);
+                    console_write(2, " colors, ");
+                    console_write(2, footer_buffer);
+                    console_write(2, " footer rows, ");
+                    console_write(2, bits_buffer);
+                    console_line(2, " bits per page");
+                } else {
+                    console_line(2, "decode: metadata recovery found no layout that verifies");
+                }
+            }
+            if (first_failed < file_count && have_recovered_metadata) {
+                report.metadata_recovered = true;
+                page_job.assumed_metadata = &recovered_metadata;
+                page_job.disable_subgrid = force_disable_subgrid;
+                page_job.retry_only = true;
+                run_decode_page_job(page_job, options.jobs);
+                page_job.assumed_metadata = 0;
+            }
         }
-        u64 candidate_limit = 0u;
-        if (base_page.color_mode != overlay_page.color_mode) {
-            usize candidate_count = 0u;
-            if (!count_overlay_pixel_candidates(base_page,
-                                                overlay_page,
-                                                base_mask,
-                                                overlay_mask,
-                                                overlay_ignore,
-                                                candidate_count)) {
-                console_line(2, "overlay: failed to evaluate overlay candidates");
-                return 1;
+        StatsTimer assemble_timer(StatsStage_Assemble);
+        BitWriter frame_aggregator;
+        frame_aggregator.reset();
+        BitWriter erasure_aggregator;
+        erasure_aggregator.reset();
+        bool have_erasures = false;
+        bool aggregate_initialized = false;
+        bool enforce_page_index = true;
+        u64 expected_page_index = 1u;
+        for (usize file_index = 0u; file_index < file_count; ++file_index) {
+            DecodedPage& page = pages[file_index];
+            if (!page.read_ok) {
+                console_write(2, "decode: failed to read ");
+                console_line(2, decode_page_name(source, file_index, name_buffer, sizeof(name_buffer)));
+                return false;
+            }
+            if (!page.extracted) {
+                console_write(2, "decode: invalid ppm in ");
+                console_line(2, decode_page_name(source, file_index, name_buffer, sizeof(name_buffer)));
+                return false;
+            }
+            PpmParserState& page_state = page.state;
+            const ByteBuffer& page_bits = page.bits;
+            u64 page_bit_count = page.bit_count;
+            if (!aggregate_initialized) {
+                if (!merge_parser_state(aggregate_state, page_state)) {
+                    console_line(2, "decode: inconsistent metadata");
+                    return false;
+                }
+                aggregate_initialized = true;
+            } else {
+                if (!merge_parser_state(aggregate_state, page_state)) {
+                    console_line(2, "decode: conflicting metadata between pages");
+                    return false;
+                }
+            }
+            if (!page_state.has_page_index || page_state.page_index_value == 0u) {
+                page_state.has_page_index = true;
+                page_state.page_index_value = expected_page_index;
+            }
+            if (enforce_page_index) {
+                if (page_state.has_page_index) {
+                    if (page_state.page_index_value != expected_page_index) {
+                        char expected_buffer[32];
+                        char actual_buffer[32];
+                        u64_to_ascii(expected_page_index, expected_buffer, sizeof(expected_buffer));
+                        u64_to_ascii(page_state.page_index_value, actual_buffer, sizeof(actual_buffer));
+                        console_write(2, "decode: unexpected page order (expected: ");
+                        console_write(2, expected_buffer);
+                        console_write(2, ", actual: ");
+                        console_write(2, actual_buffer);
+                        console_line(2, ")");
+                        return false;
+                    }
+                } else {
+                    enforce_page_index = false;
+                }
             }
-            candidate_limit = (candidate_count > (usize)U64_MAX_VALUE)
-                                ? U64_MAX_VALUE
-                                : (u64)candidate_count;
-        } else {
-            u64 candidate_bytes = 0u;
-            if (!count_overlay_byte_candidates(base_page,
-                                               overlay_page,
-                                               base_mask,
-                                               overlay_mask,
-                                               overlay_ignore,
-                                               candidate_bytes)) {
-                console_line(2, "overlay: failed to evaluate overlay candidates");
-                return 1;
+            u64 effective_bits = page_bit_count;
+            if (page_state.has_page_bits && page_state.page_bits_value <= effective_bits) {
+                effective_bits = page_state.page_bits_value;
             }
-            candidate_limit = candidate_bytes;
-        }
-        long double target_fraction = (long double)ecc_target_numerator /
-                                       (long double)ecc_target_denominator;
-        if (target_fraction < 0.0L) {
-            target_fraction = 0.0L;
-        } else if (target_fraction > 1.0L) {
-            target_fraction = 1.0L;
-        }
-        u64 total_limit = ecc_tracker.block_count * ecc_tracker.block_limit_per_block;
-        if (total_limit == 0u) {
-            console_line(2, "overlay: ECC metadata reports zero capacity");
-            return 1;
-        }
-        long double desired_changes = target_fraction * (long double)total_limit;
-        u64 target_changes = (u64)(desired_changes + 0.5L);
-        if (target_changes == 0u && target_fraction > 0.0L && candidate_limit > 0u) {
-            target_changes = 1u;
+            if (!append_bits_from_buffer(frame_aggregator, page_bits.data, effective_bits)) {
+                console_line(2, "decode: failed to assemble bitstream");
+                return false;
+            }
+            // Pages without ambiguous pixels contribute zero (trusted) bits.
+            u64 erasure_bits = (u64)page.erasures.size * 8u;
+            if (erasure_bits > effective_bits) {
+                erasure_bits = effective_bits;
+            }
+            have_erasures = have_erasures || (erasure_bits > 0u);
+            if (!append_bits_from_buffer(erasure_aggregator, page.erasures.data, erasure_bits) ||
+                !append_bits_from_buffer(erasure_aggregator, 0, effective_bits - erasure_bits)) {
+                console_line(2, "decode: failed to assemble bitstream");
+                return false;
+            }
+            page.bits.release();
+            page.erasures.release();
+            ++expected_page_index;
         }
-        if (target_changes > candidate_limit) {
-            target_changes = candidate_limit;
+        if (!aggregate_state.has_page_count ||
+            aggregate_state.page_count_value == 0u ||
+            aggregate_state.page_count_value < file_count) {
+            aggregate_state.has_page_count = false;
         }
-        if (candidate_limit == 0u) {
-            if (target_changes > 0u) {
-                console_line(2, "overlay: no overlay candidates remain after masks/ignore");
-                return 1;
+        if (aggregate_state.has_page_count) {
+            u64 advertised_pages = aggregate_state.page_count_value;
+            if (file_count > advertised_pages) {
+                console_line(2, "decode: page count metadata mismatch");
+                return false;
             }
-            numerator = 0u;
-            denominator = 1u;
-        } else {
-            numerator = target_changes;
-            denominator = candidate_limit;
-            if (numerator > denominator) {
-                numerator = denominator;
+            if (file_count != advertised_pages && debug_logging_enabled()) {
+                console_line(2, "debug: decoding subset of pages; skipping page count check");
             }
         }
-    }
-    if (numerator == 0u) {
-        if (!write_buffer_to_fd(1, base_page.original)) {
-            console_line(2, "overlay: failed to write original base image");
-            return 1;
+        const u8* frame_data = frame_aggregator.data();
+        u64 frame_bit_total = frame_aggregator.bit_size();
+        ByteBuffer frame_erasures;
+        if (have_erasures && erasure_aggregator.byte_size()) {
+            usize erasure_bytes = erasure_aggregator.byte_size();
+            if (frame_erasures.ensure(erasure_bytes)) {
+                const u8* erasure_data = erasure_aggregator.data();
+                for (usize i = 0u; i < erasure_bytes; ++i) {
+                    frame_erasures.data[i] = erasure_data ? erasure_data[i] : 0u;
+                }
+                frame_erasures.size = erasure_bytes;
+            }
+        }
+        FrameDecodeResult result = decode_assembled_frame(frame_data,
+                                                          frame_bit_total,
+                                                          &frame_erasures,
+                                                          aggregate_state,
+                                                          mapping,
+                                                          options,
+                                                          !force_disable_subgrid && !retried_subgrid,
+                                                          false,
+                                                          out,
+                                                          report);
+        if (result == FrameDecode_RetrySubgrid) {
+            force_disable_subgrid = true;
+            retried_subgrid = true;
+            report.subgrid_retried = true;
+            stats_count(StatsCounter_SubgridRetries, 1u);
+            goto retry_decode;
         }
-        return 0;
+        return result == FrameDecode_Decoded;
     }
-    if (base_page.color_mode != overlay_page.color_mode) {
-        if (!apply_overlay_pixels_raw(overlay_page, base_mask, overlay_mask, numerator, denominator, overlay_ignore, base_page)) {
-            console_line(2, "overlay: failed to copy raw pixel data between color modes");
-            return 1;
-        }
-    } else {
-        makocode::ByteBuffer base_bits;
-        makocode::ByteBuffer overlay_bits;
-        u64 base_bit_count = 0u;
-        u64 overlay_bit_count = 0u;
-        if (!gather_overlay_bits(base_page, base_mask, base_bits, base_bit_count)) {
-            console_line(2, "overlay: failed to extract data bytes from base image");
-            return 1;
-        }
-        if (!gather_overlay_bits(overlay_page, overlay_mask, overlay_bits, overlay_bit_count)) {
-            console_line(2, "overlay: failed to extract data bytes from overlay image");
-            return 1;
+}
+
+static bool page_source_open_file(void* context, usize index, InputFile& page) {
+    const char* const* paths = (const char* const*)context;
+    return input_file_open(page, paths[index]);
+}
+
+static bool page_source_open_buffer(void* context, usize index, InputFile& page) {
+    const makocode::ByteBuffer* pages = (const makocode::ByteBuffer*)context;
+    page.release();
+    page.data = pages[index].data;
+    page.size = pages[index].size;
+    return page.data != 0;
+}
+
+makocode::PageSource makocode::page_source_from_files(const char* const* paths, usize count) {
+    PageSource source;
+    source.open_page = page_source_open_file;
+    source.context = (void*)paths;
+    source.page_count = count;
+    source.page_names = paths;
+    return source;
+}
+
+makocode::PageSource makocode::page_source_from_buffers(const ByteBuffer* pages, usize count) {
+    PageSource source;
+    source.open_page = page_source_open_buffer;
+    source.context = (void*)pages;
+    source.page_count = count;
+    return source;
+}
+
+static bool page_source_open_y4m_frame(void* context, usize index, InputFile& page) {
+    const makocode::Y4mPageSource& frames = *(const makocode::Y4mPageSource*)context;
+    const usize* offsets = (const usize*)frames.frame_offsets.data;
+    return y4m_frame_to_page(frames.data + offsets[index], frames.width, frames.height, page);
+}
+
+bool makocode::is_y4m_stream(const u8* data, usize size) {
+    usize magic_length = (usize)(sizeof(Y4M_STREAM_MAGIC) - 1u);
+    return data && size >= magic_length && memcmp(data, Y4M_STREAM_MAGIC, magic_length) == 0;
+}
+
+bool makocode::y4m_source_index(Y4mPageSource& frames, const u8* data, usize size, const char* label) {
+    frames.frame_offsets.release();
+    frames.names.release();
+    frames.name_pointers.release();
+    frames.frame_count = 0u;
+    usize cursor = 0u;
+    if (y4m_scan_stream_header(data, size, true, frames.width, frames.height, cursor) != PpmScan_Complete) {
+        console_line(2, "decode: invalid y4m stream header (4:4:4 frames are required)");
+        return false;
+    }
+    // Name offsets first; the pointers are fixed up once `names` stops growing.
+    makocode::ByteBuffer name_offsets;
+    while (cursor < size) {
+        usize pixels_offset = 0u;
+        usize extent = 0u;
+        if (y4m_scan_frame(data + cursor, size - cursor, true, frames.width, frames.height, pixels_offset, extent) !=
+            PpmScan_Complete) {
+            char frame_buffer[32];
+            u64_to_ascii((u64)frames.frame_count + 1u, frame_buffer, sizeof(frame_buffer));
+            console_write(2, "decode: invalid or truncated y4m frame ");
+            console_line(2, frame_buffer);
+            return false;
         }
-        if (base_bit_count == 0u || base_bits.size == 0u) {
-            console_line(2, "overlay: base image does not contain data bytes to modify");
-            return 1;
+        usize frame_offset = cursor + pixels_offset;
+        usize name_offset = frames.names.size;
+        if (!frames.frame_offsets.append_bytes((const u8*)&frame_offset, sizeof(frame_offset)) ||
+            !name_offsets.append_bytes((const u8*)&name_offset, sizeof(name_offset)) ||
+            !frames.names.append_ascii(label ? label : "y4m") ||
+            !frames.names.append_ascii(" frame ") ||
+            !y4m_append_number(frames.names, (u64)frames.frame_count + 1u, 1u) ||
+            !frames.names.push(0u)) {
+            console_line(2, "decode: failed to allocate y4m frame index");
+            return false;
         }
-        if (overlay_bits.size == 0u) {
-            console_line(2, "overlay: overlay image does not provide data bytes");
-            return 1;
+        ++frames.frame_count;
+        cursor += extent;
+    }
+    if (frames.frame_count == 0u) {
+        console_line(2, "decode: y4m stream holds no frames");
+        return false;
+    }
+    if (!frames.name_pointers.ensure(frames.frame_count * sizeof(const char*))) {
+        console_line(2, "decode: failed to allocate y4m frame index");
+        return false;
+    }
+    const usize* offsets = (const usize*)name_offsets.data;
+    const char** pointers = (const char**)frames.name_pointers.data;
+    for (usize i = 0u; i < frames.frame_count; ++i) {
+        pointers[i] = (const char*)frames.names.data + offsets[i];
+    }
+    frames.name_pointers.size = frames.frame_count * sizeof(const char*);
+    frames.data = data;
+    frames.size = size;
+    return true;
+}
+
+makocode::PageSource makocode::page_source_from_y4m(Y4mPageSource& frames) {
+    PageSource source;
+    source.open_page = page_source_open_y4m_frame;
+    source.context = &frames;
+    source.page_count = frames.frame_count;
+    source.page_names = (const char* const*)frames.name_pointers.data;
+    return source;
+}
+
+// decode_page_stream keeps each extracted page in a slot indexed by its page
+// index; a slot whose page has not arrived (or did not extract) stays empty.
+static bool stream_extract_page(const InputFile& input, const ImageMappingConfig& mapping, DecodedPage& page) {
+    // Each page gets the subgrid retry on its own; a streamed page is not kept
+    // around for a second pass over the whole set.
+    for (u32 attempt = 0u; attempt < 2u; ++attempt) {
+        bool disable_subgrid = (attempt == 1u);
+        if (disable_subgrid) {
+            stats_count(StatsCounter_SubgridRetries, 1u);
+        }
+        page.bits.release();
+        page.erasures.release();
+        page.bit_count = 0u;
+        page.state = PpmParserState();
+        page.extracted = ppm_extract_frame_bits(input.data,
+                                                input.size,
+                                                mapping,
+                                                page.bits,
+                                                page.bit_count,
+                                                page.state,
+                                                disable_subgrid,
+                                                &page.erasures);
+        page.state.data = 0;
+        page.state.size = 0u;
+        page.state.cursor = 0u;
+        if (page.extracted) {
+            return true;
         }
-        u64 base_bytes = (base_bit_count + 7u) >> 3u;
-        u64 overlay_bytes = (overlay_bit_count + 7u) >> 3u;
-        u64 copy_bytes = (base_bytes < overlay_bytes) ? base_bytes : overlay_bytes;
-        if (copy_bytes == 0u) {
-            console_line(2, "overlay: no whole bytes available for overlay");
-            return 1;
+    }
+    return false;
+}
+
+static u64 stream_page_frame_bits(const DecodedPage& page) {
+    u64 effective_bits = page.bit_count;
+    if (page.state.has_page_bits && page.state.page_bits_value <= effective_bits) {
+        effective_bits = page.state.page_bits_value;
+    }
+    return effective_bits;
+}
+
+// Symbol errors per RS block held in reserve when decoding before every page
+// has arrived. Scanned pages always carry some misread symbols, and each one
+// costs two parity symbols; a block whose erasures used up the whole parity
+// would "correct" them into wrong bytes, and no payload checksum catches that.
+// The reserve is an eighth of the parity, and never less than this.
+static const u64 STREAM_EARLY_DECODE_MIN_ERROR_MARGIN = 2u;
+
+// Whether the pages still missing, read as erasures, fit every RS block's
+// parity with the error reserve above to spare. The interleave spreads a run
+// of L missing bytes so that it touches any one block at most
+// ceil(L / block_count) times; the extra byte covers a run that starts
+// mid-byte.
+static bool stream_missing_pages_within_parity(const DecodedPageTable& pages,
+                                               u64 slot_count,
+                                               u64 page_frame_bits,
+                                               const PpmParserState& state) {
+    if (!state.has_ecc_flag || !state.ecc_flag_value || !state.ecc_interleaved ||
+        !state.has_ecc_block_data || !state.has_ecc_parity ||
+        !state.has_ecc_block_count || !state.has_ecc_original_bytes) {
+        return false;
+    }
+    u64 block_count = state.ecc_block_count_value;
+    if (block_count == 0u || state.ecc_parity_value == 0u || page_frame_bits == 0u) {
+        return false;
+    }
+    u64 erasures_per_block = 0u;
+    u64 slot = 0u;
+    while (slot < slot_count) {
+        if (pages.pages[slot].extracted) {
+            ++slot;
+            continue;
         }
-        u8* base_ptr = base_bits.data;
-        const u8* overlay_ptr = overlay_bits.data;
-        if (!base_ptr || !overlay_ptr) {
-            console_line(2, "overlay: internal byte buffer unavailable");
-            return 1;
+        u64 run_start = slot;
+        while (slot < slot_count && !pages.pages[slot].extracted) {
+            ++slot;
+        }
+        u64 run_bytes = ((slot - run_start) * page_frame_bits + 7u) / 8u + 1u;
+        erasures_per_block += (run_bytes + block_count - 1u) / block_count;
+    }
+    u64 error_margin = state.ecc_parity_value / 8u;
+    if (error_margin < STREAM_EARLY_DECODE_MIN_ERROR_MARGIN) {
+        error_margin = STREAM_EARLY_DECODE_MIN_ERROR_MARGIN;
+    }
+    return erasures_per_block + 2u * error_margin < state.ecc_parity_value;
+}
+
+// Assembles slots [0, slot_count) into one frame, filling missing pages with
+// zero bits flagged as erasures, and decodes it. A missing first page also
+// loses the frame header, which is rebuilt from the ECC layout in the page
+// metadata; decode_assembled_frame repairs the ECC header copies the same way.
+static FrameDecodeResult stream_decode_attempt(DecodedPageTable& pages,
+                                               u64 slot_count,
+                                               PpmParserState& aggregate_state,
+                                               ImageMappingConfig& mapping,
+                                               const makocode::DecodeOptions& options,
+                                               bool tentative,
+                                               makocode::ByteBuffer& out,
+                                               makocode::DecodeReport& report) {
+    StatsTimer assemble_timer(StatsStage_Assemble);
+    u64 page_frame_bits = 0u;
+    for (u64 slot = 0u; slot < slot_count; ++slot) {
+        if (pages.pages[slot].extracted) {
+            u64 bits = stream_page_frame_bits(pages.pages[slot]);
+            if (bits > page_frame_bits) {
+                page_frame_bits = bits;
+            }
+        }
+    }
+    if (page_frame_bits < 64u) {
+        return FrameDecode_Failed;
+    }
+    makocode::ByteBuffer erased_page;
+    if (!erased_page.ensure((usize)((page_frame_bits + 7u) / 8u))) {
+        return FrameDecode_Failed;
+    }
+    memset(erased_page.data, 0xFF, (usize)((page_frame_bits + 7u) / 8u));
+    makocode::BitWriter frame_aggregator;
+    frame_aggregator.reset();
+    makocode::BitWriter erasure_aggregator;
+    erasure_aggregator.reset();
+    bool have_erasures = false;
+    for (u64 slot = 0u; slot < slot_count; ++slot) {
+        DecodedPage& page = pages.pages[slot];
+        bool appended = true;
+        if (page.extracted) {
+            u64 effective_bits = stream_page_frame_bits(page);
+            u64 erasure_bits = (u64)page.erasures.size * 8u;
+            if (erasure_bits > effective_bits) {
+                erasure_bits = effective_bits;
+            }
+            have_erasures = have_erasures || (erasure_bits > 0u);
+            appended = append_bits_from_buffer(frame_aggregator, page.bits.data, effective_bits) &&
+                       append_bits_from_buffer(erasure_aggregator, page.erasures.data, erasure_bits) &&
+                       append_bits_from_buffer(erasure_aggregator, 0, effective_bits - erasure_bits);
+        } else {
+            u64 header_bits = 0u;
+            if (slot == 0u &&
+                aggregate_state.has_ecc_block_data &&
+                aggregate_state.has_ecc_parity &&
+                aggregate_state.has_ecc_block_count) {
+                u64 codeword_bytes = (aggregate_state.ecc_block_data_value + aggregate_state.ecc_parity_value) *
+                                     aggregate_state.ecc_block_count_value;
+                appended = frame_aggregator.write_bits(((u64)makocode::ECC_HEADER_TOTAL_BYTES + codeword_bytes) * 8u, 64u) &&
+                           append_bits_from_buffer(erasure_aggregator, 0, 64u);
+                header_bits = 64u;
+            }
+            have_erasures = true;
+            appended = appended &&
+                       append_bits_from_buffer(frame_aggregator, 0, page_frame_bits - header_bits) &&
+                       append_bits_from_buffer(erasure_aggregator, erased_page.data, page_frame_bits - header_bits);
+        }
+        if (!appended) {
+            console_line(2, "decode: failed to assemble bitstream");
+            return FrameDecode_Failed;
+        }
+    }
+    makocode::ByteBuffer frame_erasures;
+    if (have_erasures && erasure_aggregator.byte_size()) {
+        if (!frame_erasures.append_bytes(erasure_aggregator.data(), erasure_aggregator.byte_size())) {
+            return FrameDecode_Failed;
+        }
+    }
+    assemble_timer.stop();
+    return decode_assembled_frame(frame_aggregator.data(),
+                                  frame_aggregator.bit_size(),
+                                  &frame_erasures,
+                                  aggregate_state,
+                                  mapping,
+                                  options,
+                                  false,
+                                  tentative,
+                                  out,
+                                  report);
+}
+
+bool makocode::decode_page_stream(PageStream& stream,
+                                  const DecodeOptions& options,
+                                  ByteBuffer& out,
+                                  DecodeReport& report) {
+    out.release();
+    report = DecodeReport();
+    if (!stream.next_page) {
+        console_line(2, "decode: no input pages");
+        return false;
+    }
+    ImageMappingConfig mapping = options.mapping;
+    if (mapping.palette_set) {
+        if (!image_mapping_build_custom_palette(mapping, "decode")) {
+            return false;
         }
-        u64 accumulator = 0u;
-        makocode::ByteBuffer block_counters;
-        makocode::ByteBuffer block_shuffle_map;
-        u16* block_counters_ptr = 0;
-        usize* block_shuffle_map_ptr = 0;
-        bool block_limit_active = false;
-        u64 block_limit_start = 0u;
-        u64 block_limit_end = 0u;
-        u64 block_limit_hits = 0u;
-        u64 block_total_symbols = 0u;
-        u64 block_total_count = 0u;
-        u64 block_limit_per_block = 0u;
-        u64 shuffle_entry_count = 0u;
-        const u64 payload_prefix_bytes = 8u;
-        const u64 header_span_bytes = (u64)makocode::ECC_HEADER_TOTAL_BYTES;
-        if (base_bytes >= payload_prefix_bytes + header_span_bytes) {
-            u64 payload_bytes = base_bytes - payload_prefix_bytes;
-            usize payload_byte_count = (payload_bytes > (u64)USIZE_MAX_VALUE)
-                                          ? USIZE_MAX_VALUE
-                                          : (usize)payload_bytes;
-            if (payload_byte_count >= makocode::ECC_HEADER_TOTAL_BYTES) {
-                const u8* payload_ptr = base_ptr + payload_prefix_bytes;
-                makocode::EccHeaderInfo ecc_header;
-                if (makocode::parse_ecc_header(payload_ptr, payload_byte_count, ecc_header) &&
-                    ecc_header.valid && ecc_header.enabled) {
-                    u64 block_data = (u64)ecc_header.block_data;
-                    u64 parity = (u64)ecc_header.parity;
-                    u64 block_total = block_data + parity;
-                    u64 block_count_value = ecc_header.block_count;
-                    if (block_data && parity && block_total && block_count_value &&
-                        block_total <= (U64_MAX_VALUE / block_count_value)) {
-                        u64 encoded_block_bytes = block_total * block_count_value;
-                        u64 available_rs_bytes = (payload_bytes >= header_span_bytes)
-                                                    ? (payload_bytes - header_span_bytes)
-                                                    : 0u;
-                        if (encoded_block_bytes > available_rs_bytes) {
-                            encoded_block_bytes = available_rs_bytes;
-                        }
-                        if (encoded_block_bytes > 0u &&
-                            block_count_value <= (u64)(USIZE_MAX_VALUE / sizeof(u16))) {
-                            usize counter_bytes = (usize)(block_count_value * (u64)sizeof(u16));
-                            if (counter_bytes != 0u && block_counters.ensure(counter_bytes)) {
-                                block_counters.size = counter_bytes;
-                                for (usize counter_index = 0u; counter_index < counter_bytes; ++counter_index) {
-                                    block_counters.data[counter_index] = 0u;
-                                }
-                                block_total_symbols = block_total;
-                                block_total_count = block_count_value;
-                                // RS can correct up to t = floor(parity/2) symbol errors per block.
-                                // Stay slightly under that theoretical maximum to avoid edge-case
-                                // failures when additional corruption exists (e.g. header/prefix).
-                                block_limit_per_block = parity / 2u;
-                                if (block_limit_per_block > 1u) {
-                                    block_limit_per_block -= 1u;
-                                } else {
-                                    block_limit_per_block = 1u;
-                                }
-                                if (encoded_block_bytes <= (u64)USIZE_MAX_VALUE) {
-                                    usize entries = (usize)encoded_block_bytes;
-                                    if (entries != 0u &&
-                                        entries <= (USIZE_MAX_VALUE / sizeof(usize))) {
-                                        usize map_bytes = entries * sizeof(usize);
-                                        if (map_bytes != 0u && block_shuffle_map.ensure(map_bytes)) {
-                                            block_shuffle_map.size = map_bytes;
-                                            block_shuffle_map_ptr = (usize*)block_shuffle_map.data;
-                                            for (usize map_index = 0u; map_index < entries; ++map_index) {
-                                                block_shuffle_map_ptr[map_index] = map_index;
-                                            }
-                                            makocode::Pcg64Generator rng;
-                                            rng.seed(0u);
-                                            for (usize map_index = entries; map_index > 1u; --map_index) {
-                                                usize i_map = map_index - 1u;
-                                                u64 value = rng.next();
-                                                usize j_map = (usize)(value % (u64)(i_map + 1u));
-                                                usize temp = block_shuffle_map_ptr[i_map];
-                                                block_shuffle_map_ptr[i_map] = block_shuffle_map_ptr[j_map];
-                                                block_shuffle_map_ptr[j_map] = temp;
-                                            }
-                                            block_counters_ptr = (u16*)block_counters.data;
-                                            shuffle_entry_count = (u64)entries;
-                                            block_limit_start = payload_prefix_bytes + header_span_bytes;
-                                            block_limit_end = block_limit_start + shuffle_entry_count;
-                                            if (block_limit_end > base_bytes) {
-                                                block_limit_end = base_bytes;
-                                            }
-                                            block_limit_active = true;
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-            }
+    }
+    DecodedPageTable pages;
+    DecodedPageTable incoming;
+    if (!incoming.allocate(1u)) {
+        console_line(2, "decode: failed to allocate page table");
+        return false;
+    }
+    PpmParserState aggregate_state;
+    u64 arrivals = 0u;
+    u64 present = 0u;
+    u64 page_count = 0u;
+    u64 slot_count = 0u;
+    for (;;) {
+        InputFile input;
+        const char* name = "stdin";
+        PageStreamStatus status = stream.next_page(stream.context, input, name);
+        if (status == PageStream_Error) {
+            return false;
+        }
+        if (status == PageStream_End) {
+            break;
+        }
+        ++arrivals;
+        stats_count(StatsCounter_Pages, 1u);
+        DecodedPage& page = incoming.pages[0];
+        if (!stream_extract_page(input, mapping, page)) {
+            // The page may still be covered by ECC, so keep listening.
+            console_write(2, "decode: skipping unreadable page ");
+            console_line(2, name);
+            continue;
+        }
+        u64 page_index = arrivals;
+        if (page.state.has_page_index && page.state.page_index_value > 0u) {
+            page_index = page.state.page_index_value;
+        }
+        if (page.state.has_page_count && page.state.page_count_value > 0u && page_count == 0u) {
+            page_count = page.state.page_count_value;
+        }
+        if (page_count && page_index > page_count) {
+            console_write(2, "decode: page index beyond page count in ");
+            console_line(2, name);
+            return false;
+        }
+        if (page_index > slot_count) {
+            slot_count = page_index;
         }
+        if (!pages.grow((usize)(page_count > slot_count ? page_count : slot_count))) {
+            console_line(2, "decode: failed to allocate page table");
+            return false;
+        }
+        DecodedPage& slot = pages.pages[page_index - 1u];
+        if (slot.extracted) {
+            console_write(2, "decode: skipping duplicate page ");
+            console_line(2, name);
+            continue;
+        }
+        if (!merge_parser_state(aggregate_state, page.state)) {
+            console_line(2, "decode: conflicting metadata between pages");
+            return false;
+        }
+        decoded_page_move(slot, page);
+        ++present;
+        report.page_count = present;
+        if (page_count && present == page_count) {
+            return stream_decode_attempt(pages, page_count, aggregate_state, mapping, options, false, out, report) ==
+                   FrameDecode_Decoded;
+        }
+        if (page_count &&
+            stream_missing_pages_within_parity(pages, page_count, stream_page_frame_bits(slot), aggregate_state) &&
+            stream_decode_attempt(pages, page_count, aggregate_state, mapping, options, true, out, report) ==
+                FrameDecode_Decoded) {
+            char present_buffer[32];
+            char count_buffer[32];
+            u64_to_ascii(present, present_buffer, sizeof(present_buffer));
+            u64_to_ascii(page_count, count_buffer, sizeof(count_buffer));
+            console_write(2, "decode: decoded from ");
+            console_write(2, present_buffer);
+            console_write(2, " of ");
+            console_write(2, count_buffer);
+            console_line(2, " pages; the rest are covered by ECC");
+            return true;
+        }
+    }
+    if (present == 0u) {
+        console_line(2, "decode: no input pages");
+        return false;
+    }
+    u64 final_count = page_count ? page_count : slot_count;
+    return stream_decode_attempt(pages, final_count, aggregate_state, mapping, options, false, out, report) ==
+           FrameDecode_Decoded;
+}
 
-        // If ECC metadata is available and the caller did not specify an explicit ECC target,
-        // clamp the requested overlay fraction to a conservative bound based on correctable
-        // symbols. The raw fraction argument is in terms of bytes to replace and can easily
-        // exceed ECC capabilities when used with heavy overlays.
-        if (!ecc_target_specified &&
-            block_limit_active &&
-            block_total_symbols > 0u &&
-            block_total_count > 0u &&
-            block_limit_per_block > 0u &&
-            copy_bytes > 0u &&
-            denominator > 0u) {
-            // Keep generous headroom beyond the theoretical RS limit to survive
-            // additional damage (e.g., scanning noise) on top of the overlay.
-            u64 safe_per_block = block_limit_per_block;
-            if (safe_per_block > 1u) {
-                safe_per_block = (safe_per_block * 2u) / 3u; // ~67% of the nominal limit
-                if (safe_per_block == 0u) {
-                    safe_per_block = 1u;
-                }
+// Finds where the page at the front of a P3/P6 byte stream ends, as the bytes
+// arrive. The header is re-read on each call until it is whole; the P3 sample
+// scan resumes where the previous call stopped, so a page is tokenized once
+// however the stream is chunked. Reset it (= PpmStreamScan()) for each page.
+struct PpmStreamScan {
+    bool header_done;
+    bool binary;
+    u64 sample_total;
+    u64 samples_seen;
+    usize cursor;
+
+    PpmStreamScan()
+        : header_done(false),
+          binary(false),
+          sample_total(0u),
+          samples_seen(0u),
+          cursor(0u) {}
+};
+
+static PpmScanStatus ppm_stream_scan(PpmStreamScan& scan,
+                                     const u8* data,
+                                     usize size,
+                                     bool at_end,
+                                     usize& extent) {
+    if (!scan.header_done) {
+        PpmParserState state;
+        state.data = data;
+        state.size = size;
+        const char* token = 0;
+        usize token_length = 0u;
+        u64 header_values[3] = {0u, 0u, 0u};
+        if (!ppm_next_token(state, &token, &token_length)) {
+            return at_end ? PpmScan_Invalid : PpmScan_NeedMore;
+        }
+        if (state.cursor >= size && !at_end) {
+            return PpmScan_NeedMore;
+        }
+        if (!ppm_accept_magic(state, token, token_length)) {
+            return PpmScan_Invalid;
+        }
+        for (u32 i = 0u; i < 3u; ++i) {
+            if (!ppm_next_token(state, &token, &token_length)) {
+                return at_end ? PpmScan_Invalid : PpmScan_NeedMore;
             }
-            __uint128_t safe_total = (__uint128_t)safe_per_block * (__uint128_t)block_total_count;
-            __uint128_t max_num128 = safe_total * (__uint128_t)denominator;
-            max_num128 /= (__uint128_t)copy_bytes;
-            u64 max_numerator = (max_num128 > (__uint128_t)U64_MAX_VALUE) ? U64_MAX_VALUE : (u64)max_num128;
-            if (max_numerator == 0u && safe_total > 0u) {
-                max_numerator = 1u;
+            if (state.cursor >= size && !at_end) {
+                // The token may continue in the next chunk.
+                return PpmScan_NeedMore;
             }
-            if (numerator > max_numerator) {
-                numerator = max_numerator;
+            if (!ascii_to_u64(token, token_length, &header_values[i])) {
+                return PpmScan_Invalid;
             }
         }
-        for (u64 i = 0u; i < copy_bytes; ++i) {
-            accumulator += numerator;
-            if (accumulator < denominator) {
+        if (header_values[0] == 0u || header_values[1] == 0u || header_values[2] != 255u ||
+            header_values[0] > (u64)0xFFFFFFFFu || header_values[1] > (u64)0xFFFFFFFFu) {
+            return PpmScan_Invalid;
+        }
+        scan.header_done = true;
+        scan.binary = state.binary_pixels;
+        scan.sample_total = header_values[0] * header_values[1] * 3u;
+        scan.samples_seen = 0u;
+        scan.cursor = state.cursor;
+    }
+    if (scan.binary) {
+        // One whitespace byte separates the max value from the raster.
+        if (scan.sample_total > (u64)(USIZE_MAX_VALUE - scan.cursor - 1u)) {
+            return PpmScan_Invalid;
+        }
+        usize page_end = scan.cursor + 1u + (usize)scan.sample_total;
+        if (size < page_end) {
+            return at_end ? PpmScan_Invalid : PpmScan_NeedMore;
+        }
+        extent = page_end;
+        return PpmScan_Complete;
+    }
+    usize cursor = scan.cursor;
+    while (scan.samples_seen < scan.sample_total) {
+        while (cursor < size && data[cursor] <= ' ') {
+            ++cursor;
+        }
+        if (cursor >= size) {
+            scan.cursor = cursor;
+            return at_end ? PpmScan_Invalid : PpmScan_NeedMore;
+        }
+        usize token_start = cursor;
+        if (data[cursor] == '#') {
+            while (cursor < size && data[cursor] != '\n' && data[cursor] != '\r') {
+                ++cursor;
+            }
+            if (cursor >= size && !at_end) {
+                scan.cursor = token_start;
+                return PpmScan_NeedMore;
+            }
+            continue;
+        }
+        u32 value = 0u;
+        u32 digits = 0u;
+        while (cursor < size && data[cursor] > ' ' && data[cursor] != '#') {
+            u32 digit = (u32)data[cursor] - (u32)'0';
+            if (digit > 9u || ++digits > 3u) {
+                return PpmScan_Invalid;
+            }
+            value = value * 10u + digit;
+            ++cursor;
+        }
+        if (cursor >= size && !at_end) {
+            scan.cursor = token_start;
+            return PpmScan_NeedMore;
+        }
+        if (value > 255u) {
+            return PpmScan_Invalid;
+        }
+        ++scan.samples_seen;
+    }
+    scan.cursor = cursor;
+    extent = cursor;
+    return PpmScan_Complete;
+}
+
+// decode --stream: pages concatenated on a file descriptor, typically a pipe
+// from the scanner. Whitespace between pages is skipped. A stream that opens
+// with a YUV4MPEG2 header (encode --y4m) is read frame by frame instead.
+struct FdPageStream {
+    int fd;
+    makocode::ByteBuffer buffer;
+    usize start;
+    bool at_end;
+    PpmStreamScan scan;
+    u64 pages_read;
+    bool y4m;
+    u32 y4m_width;
+    u32 y4m_height;
+    char name[48];
+
+    FdPageStream()
+        : fd(0),
+          buffer(),
+          start(0u),
+          at_end(false),
+          scan(),
+          pages_read(0u),
+          y4m(false),
+          y4m_width(0u),
+          y4m_height(0u),
+          name() {}
+};
+
+static makocode::PageStreamStatus fd_page_stream_next(void* context, InputFile& page, const char*& name) {
+    FdPageStream& stream = *(FdPageStream*)context;
+    const usize chunk = 65536u;
+    for (;;) {
+        while (stream.start < stream.buffer.size && stream.buffer.data[stream.start] <= ' ' && !stream.scan.header_done) {
+            ++stream.start;
+        }
+        const u8* pending = stream.buffer.data + stream.start;
+        usize available = stream.buffer.size - stream.start;
+        if (available && stream.pages_read == 0u && !stream.y4m && pending[0] == (u8)'Y') {
+            usize header_bytes = 0u;
+            PpmScanStatus status = y4m_scan_stream_header(pending,
+                                                          available,
+                                                          stream.at_end,
+                                                          stream.y4m_width,
+                                                          stream.y4m_height,
+                                                          header_bytes);
+            if (status == PpmScan_Invalid) {
+                console_line(2, "decode: invalid y4m stream header (4:4:4 frames are required)");
+                return makocode::PageStream_Error;
+            }
+            if (status == PpmScan_Complete) {
+                stream.y4m = true;
+                stream.start += header_bytes;
                 continue;
             }
-            bool replaced = false;
-            bool skipped_for_limit = false;
-            if (block_limit_active &&
-                block_shuffle_map_ptr &&
-                block_counters_ptr &&
-                block_total_symbols > 0u &&
-                block_total_count > 0u &&
-                i >= block_limit_start &&
-                i < block_limit_end) {
-                u64 relative = i - block_limit_start;
-                if (relative < shuffle_entry_count) {
-                    u64 original_index = (u64)block_shuffle_map_ptr[(usize)relative];
-                    u64 block_index = original_index / block_total_symbols;
-                    if (block_index < block_total_count) {
-                        usize counter_index = (usize)block_index;
-                        u16 current_count = block_counters_ptr[counter_index];
-                        if ((u64)current_count < block_limit_per_block) {
-                            base_ptr[i] = overlay_ptr[i];
-                            block_counters_ptr[counter_index] = (u16)(current_count + 1u);
-                            replaced = true;
-                        } else {
-                            skipped_for_limit = true;
-                            ++block_limit_hits;
-                        }
+        } else if (available) {
+            usize extent = 0u;
+            usize pixels_offset = 0u;
+            PpmScanStatus status = stream.y4m ? y4m_scan_frame(pending,
+                                                               available,
+                                                               stream.at_end,
+                                                               stream.y4m_width,
+                                                               stream.y4m_height,
+                                                               pixels_offset,
+                                                               extent)
+                                              : ppm_stream_scan(stream.scan, pending, available, stream.at_end, extent);
+            if (status == PpmScan_Complete) {
+                if (stream.y4m) {
+                    if (!y4m_frame_to_page(pending + pixels_offset, stream.y4m_width, stream.y4m_height, page)) {
+                        return makocode::PageStream_Error;
+                    }
+                } else {
+                    page.release();
+                    if (!page.fallback.append_bytes(pending, extent)) {
+                        console_line(2, "decode: failed to allocate page buffer");
+                        return makocode::PageStream_Error;
                     }
+                    page.data = page.fallback.data;
+                    page.size = page.fallback.size;
+                }
+                stream.start += extent;
+                stream.scan = PpmStreamScan();
+                ++stream.pages_read;
+                const char* label = stream.y4m ? "stdin frame " : "stdin page ";
+                usize label_length = ascii_length(label);
+                memcpy(stream.name, label, label_length);
+                u64_to_ascii(stream.pages_read, stream.name + label_length, sizeof(stream.name) - label_length);
+                name = stream.name;
+                return makocode::PageStream_Page;
+            }
+            if (status == PpmScan_Invalid) {
+                if (stream.at_end) {
+                    console_line(2, "decode: truncated page at end of stream");
+                } else {
+                    console_line(2, stream.y4m ? "decode: invalid y4m frame in stream" : "decode: invalid ppm in stream");
                 }
+                return makocode::PageStream_Error;
             }
-            if (!replaced && !skipped_for_limit) {
-                base_ptr[i] = overlay_ptr[i];
-                replaced = true;
+        }
+        if (stream.at_end) {
+            return makocode::PageStream_End;
+        }
+        // Drop consumed pages before growing the buffer for the next read.
+        if (stream.start > 0u) {
+            usize remaining = stream.buffer.size - stream.start;
+            memmove(stream.buffer.data, stream.buffer.data + stream.start, remaining);
+            stream.buffer.size = remaining;
+            stream.start = 0u;
+        }
+        if (!stream.buffer.ensure(stream.buffer.size + chunk)) {
+            console_line(2, "decode: failed to allocate page buffer");
+            return makocode::PageStream_Error;
+        }
+        int read_result = read(stream.fd, stream.buffer.data + stream.buffer.size, chunk);
+        if (read_result < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            if (replaced) {
-                accumulator -= denominator;
+            console_line(2, "decode: failed to read stdin");
+            return makocode::PageStream_Error;
+        }
+        if (read_result == 0) {
+            stream.at_end = true;
+            continue;
+        }
+        stream.buffer.size += (usize)read_result;
+        stats_count(StatsCounter_BytesRead, (u64)read_result);
+    }
+}
+
+// decode --watch: polls a directory for *.ppm pages and hands over each new
+// page, oldest name first, once its bytes form a whole page (a scanner may
+// still be writing it). decode_page_stream stops pulling once the payload
+// decodes; otherwise the stream ends after idle_seconds without a new page,
+// and the decoder makes its last attempt with the pages it has.
+struct WatchedPageStream {
+    const char* directory;
+    // 0 waits for pages forever.
+    u32 idle_seconds;
+    // Names already handed over, each followed by a NUL.
+    makocode::ByteBuffer delivered;
+    // Files that did not hold a whole page when last read: a WatchedRejection
+    // followed by the NUL-terminated name. They are read again only once their
+    // size or modification time changes.
+    makocode::ByteBuffer rejected;
+    makocode::ByteBuffer path;
+
+    WatchedPageStream() : directory(0), idle_seconds(0u), delivered(), rejected(), path() {}
+};
+
+struct WatchedRejection {
+    u64 size;
+    u64 modified_nanoseconds;
+};
+
+static const u32 WATCH_POLL_MILLISECONDS = 250u;
+static const u32 WATCH_DEFAULT_IDLE_SECONDS = 600u;
+
+static bool watched_page_delivered(const WatchedPageStream& stream, const char* name) {
+    usize cursor = 0u;
+    while (cursor < stream.delivered.size) {
+        const char* entry = (const char*)stream.delivered.data + cursor;
+        if (ascii_equals_token(name, ascii_length(name), entry)) {
+            return true;
+        }
+        cursor += ascii_length(entry) + 1u;
+    }
+    return false;
+}
+
+// Where name's rejection record starts in stream.rejected, or the buffer
+// size when the file was never rejected. Records are unaligned, so they are
+// copied in and out with memcpy.
+static usize watched_page_rejection(const WatchedPageStream& stream, const char* name) {
+    usize cursor = 0u;
+    while (cursor < stream.rejected.size) {
+        const char* entry = (const char*)stream.rejected.data + cursor + sizeof(WatchedRejection);
+        if (ascii_equals_token(name, ascii_length(name), entry)) {
+            return cursor;
+        }
+        cursor += sizeof(WatchedRejection) + ascii_length(entry) + 1u;
+    }
+    return stream.rejected.size;
+}
+
+static bool watched_page_unchanged_since_rejected(const WatchedPageStream& stream,
+                                                  const char* name,
+                                                  const WatchedRejection& current) {
+    usize offset = watched_page_rejection(stream, name);
+    if (offset == stream.rejected.size) {
+        return false;
+    }
+    WatchedRejection recorded;
+    memcpy((void*)&recorded, stream.rejected.data + offset, sizeof(recorded));
+    return recorded.size == current.size && recorded.modified_nanoseconds == current.modified_nanoseconds;
+}
+
+static bool watched_page_reject(WatchedPageStream& stream, const char* name, const WatchedRejection& rejection) {
+    usize offset = watched_page_rejection(stream, name);
+    if (offset != stream.rejected.size) {
+        memcpy(stream.rejected.data + offset, (const void*)&rejection, sizeof(rejection));
+        return true;
+    }
+    return stream.rejected.append_bytes((const u8*)&rejection, sizeof(rejection)) &&
+           stream.rejected.append_bytes((const u8*)name, ascii_length(name) + 1u);
+}
+
+static bool watched_page_name_before(const char* left, const char* right) {
+    usize i = 0u;
+    while (left[i] && left[i] == right[i]) {
+        ++i;
+    }
+    return (u8)left[i] < (u8)right[i];
+}
+
+static makocode::PageStreamStatus watched_page_stream_next(void* context, InputFile& page, const char*& name) {
+    WatchedPageStream& stream = *(WatchedPageStream*)context;
+    double idle_since = monotonic_seconds();
+    for (;;) {
+        DIR* dir = opendir(stream.directory);
+        if (!dir) {
+            console_write(2, "decode: failed to open directory ");
+            console_line(2, stream.directory);
+            return makocode::PageStream_Error;
+        }
+        // Earliest-named complete page that has not been handed over yet.
+        makocode::ByteBuffer best_name;
+        struct dirent* entry = 0;
+        while ((entry = readdir(dir)) != (struct dirent*)0) {
+            const char* entry_name = entry->d_name;
+            usize length = ascii_length(entry_name);
+            if (length <= 4u || entry_name[0] == '.' ||
+                !ascii_equals_token(entry_name + length - 4u, 4u, ".ppm")) {
+                continue;
+            }
+            if (watched_page_delivered(stream, entry_name)) {
+                continue;
+            }
+            if (best_name.size && !watched_page_name_before(entry_name, (const char*)best_name.data)) {
+                continue;
+            }
+            makocode::ByteBuffer candidate_path;
+            struct stat info;
+            if (!join_fs_path(stream.directory, entry_name, candidate_path) ||
+                stat((const char*)candidate_path.data, &info) != 0 || !S_ISREG(info.st_mode)) {
+                continue;
+            }
+            WatchedRejection current;
+            current.size = (u64)info.st_size;
+            current.modified_nanoseconds = (u64)info.st_mtim.tv_sec * 1000000000ull + (u64)info.st_mtim.tv_nsec;
+            if (watched_page_unchanged_since_rejected(stream, entry_name, current)) {
+                continue;
+            }
+            InputFile candidate;
+            PpmStreamScan scan;
+            usize extent = 0u;
+            if (!input_file_open(candidate, (const char*)candidate_path.data) ||
+                ppm_stream_scan(scan, candidate.data, candidate.size, true, extent) != PpmScan_Complete) {
+                if (!watched_page_reject(stream, entry_name, current)) {
+                    closedir(dir);
+                    return makocode::PageStream_Error;
+                }
+                continue;
+            }
+            best_name.release();
+            if (!best_name.append_bytes((const u8*)entry_name, length + 1u)) {
+                closedir(dir);
+                return makocode::PageStream_Error;
             }
+            best_name.size = length;
         }
-        if (block_limit_active && debug_logging_enabled()) {
-            char limit_buf[32];
-            char hits_buf[32];
-            console_write(2, "debug overlay: block limit=");
-            u64_to_ascii(block_limit_per_block, limit_buf, sizeof(limit_buf));
-            console_write(2, limit_buf);
-            console_write(2, " blocks=");
-            u64_to_ascii(block_total_count, limit_buf, sizeof(limit_buf));
-            console_write(2, limit_buf);
-            console_write(2, " hits=");
-            u64_to_ascii(block_limit_hits, hits_buf, sizeof(hits_buf));
-            console_line(2, hits_buf);
+        closedir(dir);
+        if (best_name.size) {
+            if (!stream.delivered.append_bytes(best_name.data, best_name.size + 1u) ||
+                !join_fs_path(stream.directory, (const char*)best_name.data, stream.path) ||
+                !input_file_open(page, (const char*)stream.path.data)) {
+                console_write(2, "decode: failed to read ");
+                console_line(2, (const char*)best_name.data);
+                return makocode::PageStream_Error;
+            }
+            name = (const char*)stream.path.data;
+            return makocode::PageStream_Page;
         }
-        if (!apply_overlay_bits(base_bits, base_bit_count, base_mask, base_page, &overlay_page, overlay_ignore)) {
-            console_line(2, "overlay: failed to map merged bytes back to base image");
-            return 1;
+        if (stream.idle_seconds && monotonic_seconds() - idle_since >= (double)stream.idle_seconds) {
+            char seconds_buffer[32];
+            u64_to_ascii((u64)stream.idle_seconds, seconds_buffer, sizeof(seconds_buffer));
+            console_write(2, "decode: no new page in ");
+            console_write(2, stream.directory);
+            console_write(2, " for ");
+            console_write(2, seconds_buffer);
+            console_line(2, " s; decoding the pages that arrived");
+            return makocode::PageStream_End;
         }
+        struct timespec delay;
+        delay.tv_sec = 0;
+        delay.tv_nsec = (long)WATCH_POLL_MILLISECONDS * 1000000L;
+        nanosleep(&delay, 0);
     }
-    makocode::ByteBuffer output;
-    if (!serialize_overlay_page(base_page, output)) {
-        console_line(2, "overlay: failed to serialize merged ppm");
-        return 1;
+}
+
+// A lone page file holding a Y4M stream is decoded frame by frame.
+static bool path_holds_y4m_stream(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
     }
-    if (!write_buffer_to_fd(1, output)) {
-        console_line(2, "overlay: failed to emit merged ppm");
-        return 1;
+    u8 magic[sizeof(Y4M_STREAM_MAGIC) - 1u];
+    usize filled = 0u;
+    while (filled < sizeof(magic)) {
+        int result = read(fd, magic + filled, sizeof(magic) - filled);
+        if (result <= 0) {
+            break;
+        }
+        filled += (usize)result;
     }
-    return 0;
+    close(fd);
+    return makocode::is_y4m_stream(magic, filled);
 }
 
 static int command_decode(int arg_count, char** args) {
@@ -27358,8 +34725,8 @@ static int command_decode(int arg_count, char** args) {
         return 0;
     }
     ImageMappingConfig mapping;
-    static const usize MAX_INPUT_FILES = 256u;
-    const char* input_files[MAX_INPUT_FILES];
+    // Page paths as an array of const char*; there is no cap on the count.
+    makocode::ByteBuffer input_file_list;
     usize file_count = 0u;
     makocode::ByteBuffer password_buffer;
     bool have_password = false;
@@ -27367,6 +34734,12 @@ static int command_decode(int arg_count, char** args) {
     const char* output_dir = ".";
     bool have_output_dir = false;
     u32 corrupt_header_copies = 0u;
+    u32 decode_jobs = 1u;
+    const char* extract_path = 0;
+    bool recover_metadata = false;
+    bool stream_pages = false;
+    const char* watch_directory = 0;
+    u32 watch_idle_seconds = WATCH_DEFAULT_IDLE_SECONDS;
    for (int i = 0; i < arg_count; ++i) {
        bool handled = false;
         if (!process_image_mapping_option(arg_count, args, &i, mapping, "decode", &handled)) {
@@ -27375,6 +34748,13 @@ static int command_decode(int arg_count, char** args) {
         if (handled) {
             continue;
         }
+        handled = false;
+        if (!process_jobs_option(arg_count, args, &i, decode_jobs, "decode", &handled)) {
+            return 1;
+        }
+        if (handled) {
+            continue;
+        }
         const char* arg = args[i];
         if (!arg) {
             continue;
@@ -27382,6 +34762,9 @@ static int command_decode(int arg_count, char** args) {
         if (consume_debug_flag(arg)) {
             continue;
         }
+        if (consume_stats_flag(arg)) {
+            continue;
+        }
         const char output_prefix[] = "--output-dir=";
         const char* output_value = 0;
         usize output_length = 0u;
@@ -27451,23 +34834,92 @@ static int command_decode(int arg_count, char** args) {
                 console_line(2, "decode: password specified multiple times");
                 return 1;
             }
-            password_value = arg + (sizeof(password_prefix) - 1u);
-            password_length = ascii_length(password_value);
+            password_value = arg + (sizeof(password_prefix) - 1u);
+            password_length = ascii_length(password_value);
+        }
+        if (password_value) {
+            if (password_length == 0u) {
+                console_line(2, "decode: --password requires a non-empty value");
+                return 1;
+            }
+            if (!password_buffer.ensure(password_length)) {
+                console_line(2, "decode: failed to allocate password buffer");
+                return 1;
+            }
+            for (usize j = 0u; j < password_length; ++j) {
+                password_buffer.data[j] = (u8)password_value[j];
+            }
+            password_buffer.size = password_length;
+            have_password = true;
+            continue;
+        }
+        const char extract_prefix[] = "--extract=";
+        const char* extract_value = 0;
+        if (ascii_equals_token(arg, ascii_length(arg), "--extract")) {
+            if ((i + 1) >= arg_count || !args[i + 1]) {
+                console_line(2, "decode: --extract requires a non-empty relative path");
+                return 1;
+            }
+            extract_value = args[i + 1];
+            i += 1;
+        } else if (ascii_starts_with(arg, extract_prefix)) {
+            extract_value = arg + (sizeof(extract_prefix) - 1u);
+        }
+        if (extract_value) {
+            if (extract_value[0] == '/' || extract_value[0] == 0) {
+                console_line(2, "decode: --extract requires a non-empty relative path");
+                return 1;
+            }
+            extract_path = extract_value;
+            continue;
+        }
+        if (ascii_equals_token(arg, ascii_length(arg), "--recover-metadata")) {
+            recover_metadata = true;
+            continue;
+        }
+        if (ascii_equals_token(arg, ascii_length(arg), "--stream")) {
+            stream_pages = true;
+            continue;
+        }
+        const char watch_prefix[] = "--watch=";
+        const char* watch_value = 0;
+        if (ascii_equals_token(arg, ascii_length(arg), "--watch")) {
+            if ((i + 1) >= arg_count || !args[i + 1]) {
+                console_line(2, "decode: --watch requires a directory");
+                return 1;
+            }
+            watch_value = args[i + 1];
+            i += 1;
+        } else if (ascii_starts_with(arg, watch_prefix)) {
+            watch_value = arg + (sizeof(watch_prefix) - 1u);
+        }
+        if (watch_value) {
+            if (watch_value[0] == 0) {
+                console_line(2, "decode: --watch requires a directory");
+                return 1;
+            }
+            watch_directory = watch_value;
+            continue;
         }
-        if (password_value) {
-            if (password_length == 0u) {
-                console_line(2, "decode: --password requires a non-empty value");
+        const char watch_idle_prefix[] = "--watch-idle=";
+        const char* watch_idle_value = 0;
+        if (ascii_equals_token(arg, ascii_length(arg), "--watch-idle")) {
+            if ((i + 1) >= arg_count || !args[i + 1]) {
+                console_line(2, "decode: --watch-idle requires a value");
                 return 1;
             }
-            if (!password_buffer.ensure(password_length)) {
-                console_line(2, "decode: failed to allocate password buffer");
+            watch_idle_value = args[i + 1];
+            i += 1;
+        } else if (ascii_starts_with(arg, watch_idle_prefix)) {
+            watch_idle_value = arg + (sizeof(watch_idle_prefix) - 1u);
+        }
+        if (watch_idle_value) {
+            u64 parsed = 0u;
+            if (!ascii_to_u64(watch_idle_value, ascii_length(watch_idle_value), &parsed) || parsed > 0xFFFFFFFFull) {
+                console_line(2, "decode: invalid value for --watch-idle");
                 return 1;
             }
-            for (usize j = 0u; j < password_length; ++j) {
-                password_buffer.data[j] = (u8)password_value[j];
-            }
-            password_buffer.size = password_length;
-            have_password = true;
+            watch_idle_seconds = (u32)parsed;
             continue;
         }
         const char corrupt_prefix[] = "--corrupt-header-copies=";
@@ -27489,346 +34941,95 @@ static int command_decode(int arg_count, char** args) {
             corrupt_header_copies = (u32)parsed;
             continue;
         }
-        if (file_count >= MAX_INPUT_FILES) {
-            console_line(2, "decode: too many input files");
-            return 1;
-        }
-    input_files[file_count++] = arg;
-}
-    if (mapping.palette_set) {
-        if (!image_mapping_build_custom_palette(mapping, "decode")) {
-            return 1;
-        }
-    }
-    makocode::ByteBuffer bitstream;
-    u64 bit_count = 0u;
-    PpmParserState aggregate_state;
-    bool have_metadata = false;
-    bool force_disable_subgrid = false;
-    bool retried_subgrid = false;
-
-retry_decode:
-    bitstream.release();
-    bit_count = 0u;
-    aggregate_state = PpmParserState();
-    have_metadata = false;
-    if (file_count == 0u) {
-        makocode::ByteBuffer ppm_stream;
-        if (!read_entire_stdin(ppm_stream)) {
-            console_line(2, "decode: failed to read stdin");
-            return 1;
-        }
-        makocode::ByteBuffer frame_bits;
-        u64 frame_bit_count = 0u;
-        PpmParserState single_state;
-        if (!ppm_extract_frame_bits(ppm_stream, mapping, frame_bits, frame_bit_count, single_state, force_disable_subgrid)) {
-            if (!force_disable_subgrid && !retried_subgrid) {
-                console_line(2, "decode: retrying without fiducial subgrid (frame extraction failed)");
-                force_disable_subgrid = true;
-                retried_subgrid = true;
-                goto retry_decode;
-            }
-            console_line(2, "decode: invalid ppm input");
-            return 1;
-        }
-        if (!frame_bits_to_payload(frame_bits.data, frame_bit_count, single_state, bitstream, bit_count)) {
-            if (!force_disable_subgrid && !retried_subgrid) {
-                console_line(2, "decode: retrying without fiducial subgrid (payload header unreadable)");
-                force_disable_subgrid = true;
-                retried_subgrid = true;
-                goto retry_decode;
-            }
-            console_line(2, "decode: failed to extract payload bits");
-            return 1;
-        }
-        aggregate_state = single_state;
-        have_metadata = true;
-    } else {
-        makocode::BitWriter frame_aggregator;
-        frame_aggregator.reset();
-        bool aggregate_initialized = false;
-        bool enforce_page_index = true;
-        u64 expected_page_index = 1u;
-        for (usize file_index = 0u; file_index < file_count; ++file_index) {
-            makocode::ByteBuffer ppm_stream;
-            if (debug_logging_enabled()) {
-                console_write(2, "debug reading file: ");
-                console_line(2, input_files[file_index]);
-            }
-            if (!read_entire_file(input_files[file_index], ppm_stream)) {
-                console_write(2, "decode: failed to read ");
-                console_line(2, input_files[file_index]);
-                return 1;
-            }
-            if (debug_logging_enabled() && ppm_stream.size >= 8u && ppm_stream.data) {
-                console_write(2, "debug read bytes: ");
-                for (usize debug_i = 0u; debug_i < 8u && debug_i < ppm_stream.size; ++debug_i) {
-                    char value_buffer[32];
-                    u64_to_ascii((u64)(unsigned char)ppm_stream.data[debug_i], value_buffer, sizeof(value_buffer));
-                    console_write(2, value_buffer);
-                    if ((debug_i + 1u) < ppm_stream.size && debug_i < 7u) {
-                        console_write(2, " ");
-                    }
-                }
-                console_line(2, "");
-            }
-            makocode::ByteBuffer page_bits;
-            u64 page_bit_count = 0u;
-            PpmParserState page_state;
-            if (!ppm_extract_frame_bits(ppm_stream, mapping, page_bits, page_bit_count, page_state, force_disable_subgrid)) {
-                if (!force_disable_subgrid && !retried_subgrid) {
-                    console_line(2, "decode: retrying without fiducial subgrid (frame extraction failed)");
-                    force_disable_subgrid = true;
-                    retried_subgrid = true;
-                    goto retry_decode;
-                }
-                console_write(2, "decode: invalid ppm in ");
-                console_line(2, input_files[file_index]);
-                return 1;
-            }
-            if (!aggregate_initialized) {
-                if (!merge_parser_state(aggregate_state, page_state)) {
-                    console_line(2, "decode: inconsistent metadata");
-                    return 1;
-                }
-                aggregate_initialized = true;
-            } else {
-                if (!merge_parser_state(aggregate_state, page_state)) {
-                    console_line(2, "decode: conflicting metadata between pages");
-                    return 1;
-                }
-            }
-            if (!page_state.has_page_index || page_state.page_index_value == 0u) {
-                page_state.has_page_index = true;
-                page_state.page_index_value = expected_page_index;
-            }
-            if (enforce_page_index) {
-                if (page_state.has_page_index) {
-                    if (page_state.page_index_value != expected_page_index) {
-                        char expected_buffer[32];
-                        char actual_buffer[32];
-                        u64_to_ascii(expected_page_index, expected_buffer, sizeof(expected_buffer));
-                        u64_to_ascii(page_state.page_index_value, actual_buffer, sizeof(actual_buffer));
-                        console_write(2, "decode: unexpected page order (expected: ");
-                        console_write(2, expected_buffer);
-                        console_write(2, ", actual: ");
-                        console_write(2, actual_buffer);
-                        console_line(2, ")");
-                        return 1;
-                    }
-                } else {
-                    enforce_page_index = false;
-                }
-            }
-            u64 effective_bits = page_bit_count;
-            if (page_state.has_page_bits && page_state.page_bits_value <= effective_bits) {
-                effective_bits = page_state.page_bits_value;
-            }
-            if (!append_bits_from_buffer(frame_aggregator, page_bits.data, effective_bits)) {
-                console_line(2, "decode: failed to assemble bitstream");
-                return 1;
-            }
-            ++expected_page_index;
-        }
-        if (!aggregate_state.has_page_count ||
-            aggregate_state.page_count_value == 0u ||
-            aggregate_state.page_count_value < file_count) {
-            aggregate_state.has_page_count = false;
-        }
-        if (aggregate_state.has_page_count) {
-            u64 advertised_pages = aggregate_state.page_count_value;
-            if (file_count > advertised_pages) {
-                console_line(2, "decode: page count metadata mismatch");
-                return 1;
-            }
-            if (file_count != advertised_pages && debug_logging_enabled()) {
-                console_line(2, "debug: decoding subset of pages; skipping page count check");
-            }
-        }
-        const u8* frame_data = frame_aggregator.data();
-        u64 frame_bit_total = frame_aggregator.bit_size();
-        if (!frame_bits_to_payload(frame_data, frame_bit_total, aggregate_state, bitstream, bit_count)) {
-            if (!force_disable_subgrid && !retried_subgrid) {
-                console_line(2, "decode: retrying without fiducial subgrid (payload header unreadable)");
-                force_disable_subgrid = true;
-                retried_subgrid = true;
-                goto retry_decode;
-            }
-            console_line(2, "decode: failed to extract payload bits");
-            return 1;
-        }
-        have_metadata = true;
-    }
-    if (have_metadata &&
-        aggregate_state.has_palette_text &&
-        aggregate_state.palette_text_length &&
-        !mapping.palette_set) {
-        if (!image_mapping_set_palette_text(mapping,
-                                            aggregate_state.palette_text,
-                                            aggregate_state.palette_text_length,
-                                            "decode")) {
+        if (ascii_starts_with(arg, "--")) {
+            console_write(2, "decode: unknown option: ");
+            console_line(2, arg);
             return 1;
         }
-        if (!image_mapping_build_custom_palette(mapping, "decode")) {
+        if (!input_file_list.append_bytes((const u8*)&arg, sizeof(arg))) {
+            console_line(2, "decode: failed to allocate input file list");
             return 1;
         }
+        ++file_count;
+}
+    if (stream_pages && watch_directory) {
+        console_line(2, "decode: --stream and --watch cannot be combined");
+        return 1;
     }
-    bool ecc_header_repaired = false;
-    makocode::EccHeaderInfo bitstream_header;
-    bool bitstream_header_present = false;
-    bool bitstream_header_valid = false;
-    if (bitstream.data && bitstream.size >= makocode::ECC_HEADER_TOTAL_BYTES) {
-        bitstream_header_present = makocode::parse_ecc_header(bitstream.data, bitstream.size, bitstream_header);
-        bitstream_header_valid = bitstream_header_present && bitstream_header.valid && bitstream_header.enabled;
-    }
-    bool ecc_metadata_available = have_metadata &&
-                                  aggregate_state.has_ecc_flag &&
-                                  aggregate_state.ecc_flag_value;
-    bool ecc_metadata_complete = ecc_metadata_available &&
-                                 aggregate_state.has_ecc_block_data &&
-                                 aggregate_state.has_ecc_parity &&
-                                 aggregate_state.has_ecc_block_count &&
-                                 aggregate_state.has_ecc_original_bytes;
-    // Only surface the absence of ECC when the user explicitly requests debug
-    // logging; tests intentionally encode payloads without ECC and should not
-    // emit warnings during normal operation.
-    if (have_metadata &&
-        aggregate_state.has_ecc_flag &&
-        !aggregate_state.ecc_flag_value &&
-        debug_logging_enabled()) {
-        console_line(1, "decode: note: payload was encoded without ECC protection");
-    }
-    if (!bitstream_header_valid) {
-        if (ecc_metadata_complete &&
-            bitstream.data &&
-            bitstream.size >= makocode::ECC_HEADER_TOTAL_BYTES &&
-            bit_count >= (u64)makocode::ECC_HEADER_TOTAL_BITS) {
-            u64 block_data_value = aggregate_state.ecc_block_data_value;
-            u64 parity_value = aggregate_state.ecc_parity_value;
-            if (block_data_value <= 0xFFFFu && parity_value <= 0xFFFFu) {
-                u8 header_bytes[makocode::ECC_HEADER_TOTAL_BYTES];
-                if (makocode::build_ecc_header_bytes(header_bytes,
-                                                     makocode::ECC_HEADER_TOTAL_BYTES,
-                                                     (u16)block_data_value,
-                                                     (u16)parity_value,
-                                                     aggregate_state.ecc_block_count_value,
-                                                     aggregate_state.ecc_original_bytes_value)) {
-                    bool differs = false;
-                    for (usize i = 0u; i < makocode::ECC_HEADER_TOTAL_BYTES; ++i) {
-                        if (bitstream.data[i] != header_bytes[i]) {
-                            differs = true;
-                            break;
-                        }
-                    }
-                    if (differs) {
-                        for (usize i = 0u; i < makocode::ECC_HEADER_TOTAL_BYTES; ++i) {
-                            bitstream.data[i] = header_bytes[i];
-                        }
-                        ecc_header_repaired = true;
-                    }
-                }
-            }
-        } else if (ecc_metadata_available) {
-            console_line(2, "decode: warning: ECC metadata incomplete; header reconstruction skipped");
-        }
-    }
-    if (ecc_header_repaired) {
-        console_line(2, "decode: repaired ECC header from metadata");
-    }
-    if (corrupt_header_copies > 0u &&
-        bitstream.data &&
-        bitstream.size >= ((usize)makocode::ECC_HEADER_COPY_TOTAL_BYTES)) {
-        u32 count = corrupt_header_copies;
-        if (count > (u32)makocode::ECC_HEADER_COPY_COUNT) {
-            count = (u32)makocode::ECC_HEADER_COPY_COUNT;
-        }
-        for (u32 copy_index = 0u; copy_index < count; ++copy_index) {
-            usize base = (usize)copy_index * makocode::ECC_HEADER_COPY_TOTAL_BYTES + makocode::ECC_HEADER_COPY_DATA_BYTES;
-            usize limit = base + ((usize)makocode::ECC_HEADER_COPY_PARITY_SYMBOLS + 1u);
-            usize copy_end = ((usize)copy_index + 1u) * makocode::ECC_HEADER_COPY_TOTAL_BYTES;
-            if (limit > copy_end) {
-                limit = copy_end;
-            }
-            if (limit > bitstream.size) {
-                limit = bitstream.size;
-            }
-            for (usize i = base; i < limit; ++i) {
-                bitstream.data[i] ^= 0xFFu;
-            }
-        }
-        if (debug_logging_enabled()) {
-            char count_buffer[32];
-            u64_to_ascii((u64)count, count_buffer, sizeof(count_buffer));
-            console_write(2, "debug decode: corrupted ");
-            console_write(2, count_buffer);
-            console_line(2, " header copies");
-        }
+    if ((stream_pages || watch_directory) && file_count) {
+        console_line(2, "decode: --stream and --watch take no page files");
+        return 1;
     }
-    const char* debug_bitstream_path = getenv("MAKOCODE_DEBUG_BITSTREAM");
-    if (debug_bitstream_path && *debug_bitstream_path && bitstream.data && bitstream.size > 0u) {
-        int dump_fd = open(debug_bitstream_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (dump_fd >= 0) {
-            const u8* dump_ptr = bitstream.data;
-            usize dump_remaining = bitstream.size;
-            while (dump_remaining > 0u) {
-                usize chunk = dump_remaining;
-                if (chunk > 1u << 20) {
-                    chunk = 1u << 20;
-                }
-                ssize_t write_result = write(dump_fd, dump_ptr, chunk);
-                if (write_result < 0) {
-                    if (debug_logging_enabled()) {
-                        console_line(2, "debug decode: bitstream dump write failed");
-                    }
-                    break;
-                }
-                if (write_result == 0) {
-                    break;
-                }
-                dump_ptr += (usize)write_result;
-                dump_remaining -= (usize)write_result;
-            }
-            close(dump_fd);
-        } else if (debug_logging_enabled()) {
-            console_write(2, "debug decode: failed to open bitstream dump ");
-            console_line(2, debug_bitstream_path);
-        }
+    if ((stream_pages || watch_directory) && recover_metadata) {
+        console_line(2, "decode: --recover-metadata needs the whole page set and cannot be combined with --stream or --watch");
+        return 1;
     }
-
-    makocode::DecoderContext decoder;
-    const char* password_ptr = have_password ? (const char*)password_buffer.data : (const char*)0;
-    usize password_length = have_password ? password_buffer.size : 0u;
-    if (!decoder.parse(bitstream.data, bit_count, password_ptr, password_length)) {
-        if (decoder.password_auth_failed()) {
-            console_line(2, "decode: decryption failed (password mismatch or corrupted data)");
+    const char* const* input_files = (const char* const*)input_file_list.data;
+    static const char* const stdin_page_paths[] = {"-"};
+    makocode::ByteBuffer stdin_page;
+    makocode::PageSource source;
+    InputFile y4m_file;
+    makocode::Y4mPageSource y4m_frames;
+    FdPageStream fd_stream;
+    WatchedPageStream watched_stream;
+    makocode::PageStream page_stream;
+    if (stream_pages) {
+        page_stream.next_page = fd_page_stream_next;
+        page_stream.context = &fd_stream;
+    } else if (watch_directory) {
+        watched_stream.directory = watch_directory;
+        watched_stream.idle_seconds = watch_idle_seconds;
+        page_stream.next_page = watched_page_stream_next;
+        page_stream.context = &watched_stream;
+    } else if (file_count == 1u && path_holds_y4m_stream(input_files[0])) {
+        if (!input_file_open(y4m_file, input_files[0])) {
+            console_write(2, "decode: failed to read ");
+            console_line(2, input_files[0]);
             return 1;
         }
-        if (!decoder.ecc_correction_failed() && !force_disable_subgrid && !retried_subgrid) {
-            console_line(2, "decode: parse failure; retrying without fiducial subgrid");
-            force_disable_subgrid = true;
-            retried_subgrid = true;
-            goto retry_decode;
-        }
-        if (decoder.ecc_correction_failed() && !force_disable_subgrid && !retried_subgrid) {
-            console_line(2, "decode: ECC could not repair the payload; retrying without fiducial subgrid");
-            force_disable_subgrid = true;
-            retried_subgrid = true;
-            goto retry_decode;
+        if (!makocode::y4m_source_index(y4m_frames, y4m_file.data, y4m_file.size, input_files[0])) {
+            return 1;
         }
-        if (decoder.ecc_correction_failed()) {
-            console_line(2, "decode: ECC could not repair the payload");
+        source = makocode::page_source_from_y4m(y4m_frames);
+        stats_track_pages(source.page_names, source.page_count);
+    } else if (file_count) {
+        stats_track_pages(input_files, file_count);
+        source = makocode::page_source_from_files(input_files, file_count);
+    } else {
+        if (!read_entire_stdin(stdin_page)) {
+            console_line(2, "decode: failed to read stdin");
+            return 1;
+        }
+        if (makocode::is_y4m_stream(stdin_page.data, stdin_page.size)) {
+            if (!makocode::y4m_source_index(y4m_frames, stdin_page.data, stdin_page.size, "stdin")) {
+                return 1;
+            }
+            source = makocode::page_source_from_y4m(y4m_frames);
+            stats_track_pages(source.page_names, source.page_count);
         } else {
-            console_line(2, "decode: parse failure");
+            stats_track_pages(stdin_page_paths, 1u);
+            source = makocode::page_source_from_buffers(&stdin_page, 1u);
+            source.page_names = stdin_page_paths;
         }
-        return 1;
-    }
-    if (decoder.password_attempt_made() && decoder.password_was_ignored()) {
-        console_line(2, "decode: warning: payload was not encrypted; password ignored");
     }
-    if (decoder.ecc_correction_failed()) {
-        console_line(2, "decode: warning: payload may contain uncorrected errors");
+    makocode::DecodeOptions options;
+    options.mapping = mapping;
+    options.jobs = decode_jobs;
+    options.extract_path = extract_path;
+    options.corrupt_header_copies = corrupt_header_copies;
+    options.recover_metadata = recover_metadata;
+    if (have_password) {
+        options.password = (const char*)password_buffer.data;
+        options.password_length = password_buffer.size;
+    }
+    makocode::ByteBuffer archive_payload;
+    makocode::DecodeReport report;
+    bool decoded = page_stream.next_page ? makocode::decode_page_stream(page_stream, options, archive_payload, report)
+                                         : makocode::decode_pages(source, options, archive_payload, report);
+    if (!decoded) {
+        return 1;
     }
-    const makocode::EccDecodeStats& ecc_stats = decoder.ecc_statistics();
+    const makocode::EccDecodeStats& ecc_stats = report.ecc;
     if (ecc_stats.total_parity_symbols > 0u) {
         u64 corrected_bits = ecc_stats.corrected_symbols * 8u;
         u64 available_bits = ecc_stats.total_parity_symbols * 8u;
@@ -27849,12 +35050,21 @@ retry_decode:
         console_write(1, (corrected_bits == 1u) ? " bit corrected, " : " bits corrected, ");
         console_write(1, percent_buffer);
         console_line(1, "% of available correction bits)");
-    }
-    if (!decoder.has_payload) {
-        console_line(2, "decode: no payload recovered");
+        if (ecc_stats.erasure_symbols > 0u) {
+            u64_to_ascii(ecc_stats.erasure_symbols, count_buffer, sizeof(count_buffer));
+            console_write(1, "decode: ECC used ");
+            console_write(1, count_buffer);
+            console_line(1, (ecc_stats.erasure_symbols == 1u) ? " erasure hint" : " erasure hints");
+        }
+    }
+    u32 extracted_count = 0u;
+    bool unpacked = unpack_archive_to_directory(archive_payload, output_dir, extract_path, &extracted_count);
+    if (unpacked && extract_path && extracted_count == 0u) {
+        console_write(2, "decode: no archive entry matches ");
+        console_line(2, extract_path);
         return 1;
     }
-    if (!unpack_archive_to_directory(decoder.payload, output_dir)) {
+    if (!unpacked) {
         const char* raw_fallback = getenv("MAKOCODE_DECODE_RAW_FALLBACK");
         bool allow_raw_fallback = (raw_fallback && *raw_fallback && raw_fallback[0] != '0');
         if (allow_raw_fallback && output_dir) {
@@ -27881,7 +35091,7 @@ retry_decode:
                     path_buffer[cursor++] = filename[i];
                 }
                 path_buffer[cursor] = '\0';
-                write_buffer_to_file(path_buffer, decoder.payload);
+                write_buffer_to_file(path_buffer, archive_payload);
             }
             console_line(1, "decode: wrote raw payload.bin (MAKOCODE_DECODE_RAW_FALLBACK enabled)");
             return 0;
@@ -27893,48 +35103,17 @@ retry_decode:
     return 0;
 }
 
-static bool read_file_into_buffer(const char* path, makocode::ByteBuffer& buffer) {
-    if (!path) {
-        return false;
-    }
-    buffer.release();
-    int fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        return false;
-    }
-    u8 chunk[4096];
-    while (1) {
-        int read_result = read(fd, chunk, sizeof(chunk));
-        if (read_result < 0) {
-            close(fd);
-            buffer.release();
-            return false;
-        }
-        if (read_result == 0) {
-            break;
-        }
-        if (!buffer.append_bytes(chunk, (usize)read_result)) {
-            close(fd);
-            buffer.release();
-            return false;
-        }
-    }
-    close(fd);
-    return true;
-}
-
-static bool strip_cpp_comments(const makocode::ByteBuffer& input,
+static bool strip_cpp_comments(const u8* data,
+                               usize size,
                                makocode::ByteBuffer& output) {
     output.release();
-    if (!input.data || input.size == 0u) {
+    if (!data || size == 0u) {
         return true;
     }
     bool in_line_comment = false;
     bool in_block_comment = false;
     bool in_string = false;
     bool in_char = false;
-    const u8* data = input.data;
-    usize size = input.size;
     usize index = 0u;
     while (index < size) {
         u8 ch = data[index];
@@ -28047,13 +35226,13 @@ static int command_minify(int arg_count, char** args) {
         console_line(2, "minify: this command does not accept arguments");
         return 1;
     }
-    makocode::ByteBuffer source;
-    if (!read_file_into_buffer("makocode.cpp", source)) {
+    InputFile source;
+    if (!input_file_open(source, "makocode.cpp")) {
         console_line(2, "minify: failed to read makocode.cpp");
         return 1;
     }
     makocode::ByteBuffer stripped;
-    if (!strip_cpp_comments(source, stripped)) {
+    if (!strip_cpp_comments(source.data, source.size, stripped)) {
         console_line(2, "minify: failed to strip comments");
         return 1;
     }
@@ -28163,6 +35342,732 @@ static int command_minify(int arg_count, char** args) {
     return 0;
 }
 
+// `makocode bench` times each pipeline stage in isolation on a synthetic
+// payload. Stages run on the output of the previous one so they see realistic
+// data, but only the stage under test sits inside the timed region.
+static const u64 BENCH_DEFAULT_SIZE_KIB = 1024u;
+static const u64 BENCH_MAX_SIZE_KIB = 1048576u;
+static const u64 BENCH_DEFAULT_ITERATIONS = 3u;
+static const u64 BENCH_MAX_ITERATIONS = 1000u;
+static const u64 BENCH_MAX_PAGES = 1024u;
+static const u32 BENCH_FILE_COUNT = 16u;
+static const char BENCH_PASSWORD[] = "makocode-bench";
+// Pages for the extract_distorted stage are resampled the way
+// `ppm_transform transform --scale-x 2 --scale-y 2 --rotate 1.5` would.
+static const double BENCH_DISTORT_SCALE = 2.0;
+static const double BENCH_DISTORT_DEGREES = 1.5;
+
+// Fastest run of a stage over all iterations.
+struct BenchTimer {
+    double best_seconds;
+    double started;
+    u32 runs;
+
+    BenchTimer() : best_seconds(0.0), started(0.0), runs(0u) {}
+
+    void begin() {
+        started = monotonic_seconds();
+    }
+
+    void end() {
+        double elapsed = monotonic_seconds() - started;
+        if (runs == 0u || elapsed < best_seconds) {
+            best_seconds = elapsed;
+        }
+        runs += 1u;
+    }
+};
+
+// Writes one machine-readable result line to stdout:
+//   bench stage=NAME bytes=N runs=N ms=T mb_per_s=R [pages=N pages_per_s=R]
+// Rates use the fastest run and decimal megabytes (10^6 bytes).
+static void bench_report(const char* stage, u64 bytes, u64 pages, const BenchTimer& timer) {
+    char number[64];
+    double seconds = timer.best_seconds;
+    if (seconds < 1e-9) {
+        seconds = 1e-9;
+    }
+    console_write(1, "bench stage=");
+    console_write(1, stage);
+    console_write(1, " bytes=");
+    u64_to_ascii(bytes, number, sizeof(number));
+    console_write(1, number);
+    console_write(1, " runs=");
+    u64_to_ascii((u64)timer.runs, number, sizeof(number));
+    console_write(1, number);
+    console_write(1, " ms=");
+    format_fixed_3(timer.best_seconds * 1000.0, number, sizeof(number));
+    console_write(1, number);
+    console_write(1, " mb_per_s=");
+    format_fixed_3((double)bytes / seconds / 1000000.0, number, sizeof(number));
+    console_write(1, number);
+    if (pages) {
+        console_write(1, " pages=");
+        u64_to_ascii(pages, number, sizeof(number));
+        console_write(1, number);
+        console_write(1, " pages_per_s=");
+        format_fixed_3((double)pages / seconds, number, sizeof(number));
+        console_write(1, number);
+    }
+    console_line(1, "");
+}
+
+static int bench_stage_failed(const char* stage) {
+    console_write(2, "bench: stage ");
+    console_write(2, stage);
+    console_line(2, " failed");
+    return 1;
+}
+
+static bool bench_buffers_equal(const makocode::ByteBuffer& a, const u8* data, usize size) {
+    if (a.size != size) {
+        return false;
+    }
+    return size == 0u || memcmp(a.data, data, size) == 0;
+}
+
+// Parses `--NAME N` / `--NAME=N` into value, accepting [min_value, max_value].
+static bool bench_count_option(int arg_count,
+                               char** args,
+                               int* arg_index,
+                               const char* name,
+                               u64 min_value,
+                               u64 max_value,
+                               u64& value,
+                               bool* handled) {
+    *handled = false;
+    int index = *arg_index;
+    const char* arg = args[index];
+    usize name_length = ascii_length(name);
+    const char* text = 0;
+    if (ascii_equals_token(arg, ascii_length(arg), name)) {
+        if ((index + 1) >= arg_count || !args[index + 1]) {
+            console_write(2, "bench: ");
+            console_write(2, name);
+            console_line(2, " requires a positive integer value");
+            return false;
+        }
+        text = args[index + 1];
+        *arg_index = index + 1;
+    } else if (ascii_length(arg) > name_length &&
+               memcmp(arg, name, name_length) == 0 &&
+               arg[name_length] == '=') {
+        text = arg + name_length + 1u;
+    }
+    if (!text) {
+        return true;
+    }
+    u64 parsed = 0u;
+    if (!ascii_to_u64(text, ascii_length(text), &parsed) ||
+        parsed < min_value || parsed > max_value) {
+        char bound[32];
+        console_write(2, "bench: ");
+        console_write(2, name);
+        console_write(2, " must be between ");
+        u64_to_ascii(min_value, bound, sizeof(bound));
+        console_write(2, bound);
+        console_write(2, " and ");
+        u64_to_ascii(max_value, bound, sizeof(bound));
+        console_line(2, bound);
+        return false;
+    }
+    value = parsed;
+    *handled = true;
+    return true;
+}
+
+// Fills payload with BENCH_FILE_COUNT equal slices: every fourth slice is raw
+// generator output (incompressible), the rest word-like text. The generator is
+// seeded like the encoder's shuffle so every run benches identical bytes.
+static bool bench_generate_payload(u64 byte_count, makocode::ByteBuffer& payload) {
+    static const char* const kWords[] = {
+        "page", "symbol", "fiducial", "palette", "archive", "parity", "block", "sample",
+        "border", "footer", "the", "of", "and", "to", "data", "grid",
+        "bits", "ink", "paper", "scan", "marker", "row", "column", "decode"
+    };
+    static const u32 kWordCount = (u32)(sizeof(kWords) / sizeof(kWords[0]));
+    payload.release();
+    if (byte_count == 0u || byte_count > (u64)USIZE_MAX_VALUE || !payload.ensure((usize)byte_count)) {
+        return false;
+    }
+    makocode::Pcg64Generator rng;
+    rng.seed(0u);
+    usize total = (usize)byte_count;
+    for (u32 file = 0u; file < BENCH_FILE_COUNT; ++file) {
+        usize begin = (usize)((u64)total * file / BENCH_FILE_COUNT);
+        usize end = (usize)((u64)total * (file + 1u) / BENCH_FILE_COUNT);
+        usize cursor = begin;
+        if ((file & 3u) == 3u) {
+            while (cursor < end) {
+                u64 word = rng.next();
+                for (u32 i = 0u; i < 8u && cursor < end; ++i) {
+                    payload.data[cursor++] = (u8)(word >> (i * 8u));
+                }
+            }
+            continue;
+        }
+        u32 line_words = 0u;
+        while (cursor < end) {
+            u64 draw = rng.next();
+            const char* word = kWords[(u32)(draw % kWordCount)];
+            for (usize i = 0u; word[i] && cursor < end; ++i) {
+                payload.data[cursor++] = (u8)word[i];
+            }
+            if (cursor < end) {
+                line_words += 1u;
+                bool newline = line_words >= 8u + (u32)((draw >> 32u) % 8u);
+                payload.data[cursor++] = newline ? (u8)'\n' : (u8)' ';
+                if (newline) {
+                    line_words = 0u;
+                }
+            }
+        }
+    }
+    payload.size = total;
+    return true;
+}
+
+static bool bench_build_archive(const makocode::ByteBuffer& payload, ArchiveBuildContext& archive) {
+    if (!archive_init(archive)) {
+        return false;
+    }
+    for (u32 file = 0u; file < BENCH_FILE_COUNT; ++file) {
+        usize begin = (usize)((u64)payload.size * file / BENCH_FILE_COUNT);
+        usize end = (usize)((u64)payload.size * (file + 1u) / BENCH_FILE_COUNT);
+        char name[32] = "bench_00.txt";
+        name[6] = (char)('0' + file / 10u);
+        name[7] = (char)('0' + file % 10u);
+        if ((file & 3u) == 3u) {
+            name[9] = 'b';
+            name[10] = 'i';
+            name[11] = 'n';
+        }
+        if (!archive_add_file(archive, name, payload.data + begin, end - begin)) {
+            return false;
+        }
+    }
+    return archive_finalize(archive);
+}
+
+static void bench_bilinear_sample(const u8* pixels, u32 width, u32 height, double fx, double fy, u8 rgb[3]) {
+    if (fx < 0.0) fx = 0.0;
+    if (fy < 0.0) fy = 0.0;
+    if (fx > (double)(width - 1u)) fx = (double)(width - 1u);
+    if (fy > (double)(height - 1u)) fy = (double)(height - 1u);
+    u32 x0 = (u32)fx;
+    u32 y0 = (u32)fy;
+    u32 x1 = (x0 + 1u < width) ? x0 + 1u : x0;
+    u32 y1 = (y0 + 1u < height) ? y0 + 1u : y0;
+    double dx = fx - (double)x0;
+    double dy = fy - (double)y0;
+    for (u32 c = 0u; c < 3u; ++c) {
+        double p00 = pixels[((usize)y0 * width + x0) * 3u + c];
+        double p10 = pixels[((usize)y0 * width + x1) * 3u + c];
+        double p01 = pixels[((usize)y1 * width + x0) * 3u + c];
+        double p11 = pixels[((usize)y1 * width + x1) * 3u + c];
+        double top = p00 + (p10 - p00) * dx;
+        double bottom = p01 + (p11 - p01) * dx;
+        double value = top + (bottom - top) * dy + 0.5;
+        rgb[c] = (u8)((value > 255.0) ? 255.0 : value);
+    }
+}
+
+// Scales by BENCH_DISTORT_SCALE and rotates by BENCH_DISTORT_DEGREES onto a
+// white canvas that fits the rotated page, in one inverse-mapped bilinear
+// pass, and emits the result as a comment-free P6 so the decoder has to
+// recover the geometry from the image alone.
+static bool bench_distort_page(const makocode::ByteBuffer& pixels,
+                               u32 width,
+                               u32 height,
+                               makocode::ByteBuffer& output) {
+    output.release();
+    double scaled_w = (double)width * BENCH_DISTORT_SCALE;
+    double scaled_h = (double)height * BENCH_DISTORT_SCALE;
+    double radians = BENCH_DISTORT_DEGREES * (3.14159265358979323846 / 180.0);
+    double cos_a = cos(radians);
+    double sin_a = sin(radians);
+    u32 out_w = (u32)(fabs(scaled_w * cos_a) + fabs(scaled_h * sin_a) + 0.5);
+    u32 out_h = (u32)(fabs(scaled_w * sin_a) + fabs(scaled_h * cos_a) + 0.5);
+    if (!out_w || !out_h) {
+        return false;
+    }
+    if (!output.append_ascii("P6\n") || !ppm_write_dimensions(out_w, out_h, output)) {
+        return false;
+    }
+    usize header = output.size;
+    usize raster = (usize)out_w * out_h * 3u;
+    if (!output.ensure(header + raster)) {
+        return false;
+    }
+    u8* dest = output.data + header;
+    double cx = (scaled_w - 1.0) / 2.0;
+    double cy = (scaled_h - 1.0) / 2.0;
+    double nx = ((double)out_w - 1.0) / 2.0;
+    double ny = ((double)out_h - 1.0) / 2.0;
+    double inverse_scale = 1.0 / BENCH_DISTORT_SCALE;
+    for (u32 y = 0u; y < out_h; ++y) {
+        double ry = (double)y - ny;
+        for (u32 x = 0u; x < out_w; ++x) {
+            double rx = (double)x - nx;
+            double sx = cos_a * rx + sin_a * ry + cx;
+            double sy = -sin_a * rx + cos_a * ry + cy;
+            u8* px = dest + ((usize)y * out_w + x) * 3u;
+            if (sx < 0.0 || sy < 0.0 || sx > scaled_w - 1.0 || sy > scaled_h - 1.0) {
+                px[0] = 255u;
+                px[1] = 255u;
+                px[2] = 255u;
+                continue;
+            }
+            bench_bilinear_sample(pixels.data,
+                                  width,
+                                  height,
+                                  (sx + 0.5) * inverse_scale - 0.5,
+                                  (sy + 0.5) * inverse_scale - 0.5,
+                                  px);
+        }
+    }
+    output.size = header + raster;
+    return true;
+}
+
+static void bench_release_pages(makocode::ByteBuffer* pages, u64 count) {
+    if (!pages) {
+        return;
+    }
+    for (u64 i = 0u; i < count; ++i) {
+        pages[i].release();
+    }
+    free(pages);
+}
+
+static makocode::ByteBuffer* bench_allocate_pages(u64 count) {
+    makocode::ByteBuffer* pages = (makocode::ByteBuffer*)malloc((usize)count * sizeof(makocode::ByteBuffer));
+    if (pages) {
+        memset((void*)pages, 0, (usize)count * sizeof(makocode::ByteBuffer));
+    }
+    return pages;
+}
+
+// Page stages: render, parse and extract the first `page_limit` pages of the
+// encoded payload. Extraction runs on the clean pages and on distorted copies.
+static int bench_page_stages(const ImageMappingConfig& mapping,
+                             const makocode::ByteBuffer& compressed,
+                             double ecc_redundancy,
+                             u64 page_limit,
+                             u32 iterations) {
+    makocode::EncoderContext encoder;
+    encoder.config.ecc_redundancy = ecc_redundancy;
+    makocode::ByteBuffer payload_copy;
+    if (!payload_copy.append_bytes(compressed.data, compressed.size)) {
+        return bench_stage_failed("render");
+    }
+    encoder.adopt_compressed_payload(payload_copy);
+    makocode::ByteBuffer frame_bits;
+    u64 frame_bit_count = 0u;
+    u64 payload_bit_count = 0u;
+    if (!encoder.build() ||
+        !build_frame_bits(encoder, mapping, frame_bits, frame_bit_count, payload_bit_count)) {
+        return bench_stage_failed("render");
+    }
+    u32 width_pixels = 0u;
+    u32 height_pixels = 0u;
+    PageFooterConfig footer_config;
+    FooterLayout footer_layout;
+    u32 data_height = 0u;
+    u64 bits_per_page = 0u;
+    u64 page_count = 0u;
+    if (!compute_page_dimensions(mapping, width_pixels, height_pixels) ||
+        !compute_page_layout(mapping,
+                             footer_config,
+                             frame_bit_count,
+                             width_pixels,
+                             height_pixels,
+                             footer_layout,
+                             data_height,
+                             bits_per_page,
+                             page_count)) {
+        return bench_stage_failed("render");
+    }
+    u64 pages_used = (page_count < page_limit) ? page_count : page_limit;
+    makocode::ByteBuffer* pages = bench_allocate_pages(pages_used);
+    makocode::ByteBuffer* distorted = bench_allocate_pages(pages_used);
+    if (!pages || !distorted) {
+        bench_release_pages(pages, 0u);
+        bench_release_pages(distorted, 0u);
+        return bench_stage_failed("render");
+    }
+    int result = 0;
+    const char* failed_stage = 0;
+    makocode::ByteBuffer footer_text;
+    makocode::ByteBuffer pixels;
+    makocode::ByteBuffer extracted;
+    EncodePageScratch scratch;
+    u64 page_bytes = 0u;
+    u64 distorted_bytes = 0u;
+    u32 width_read = 0u;
+    u32 height_read = 0u;
+    u64 extracted_bits = 0u;
+    BenchTimer render_timer;
+    for (u32 iter = 0u; iter < iterations && !failed_stage; ++iter) {
+        page_bytes = 0u;
+        render_timer.begin();
+        for (u64 page = 0u; page < pages_used; ++page) {
+            pages[page].clear();
+            if (!footer_build_page_text(footer_config, page + 1u, page_count, footer_text) ||
+                !encode_page_to_ppm(mapping,
+                                    frame_bits,
+                                    frame_bit_count,
+                                    page * bits_per_page,
+                                    width_pixels,
+                                    height_pixels,
+                                    page + 1u,
+                                    page_count,
+                                    bits_per_page,
+                                    payload_bit_count,
+                                    &encoder.ecc_info(),
+                                    footer_layout.has_text ? (const char*)footer_text.data : 0,
+                                    footer_layout.has_text ? footer_text.size : 0u,
+                                    footer_layout,
+                                    pages[page],
+                                    &scratch)) {
+                failed_stage = "render";
+                break;
+            }
+            page_bytes += (u64)pages[page].size;
+        }
+        render_timer.end();
+    }
+    if (!failed_stage) {
+        bench_report("render", page_bytes, pages_used, render_timer);
+    }
+    const char* parse_stage = mapping.ppm_binary_output ? "ppm_parse_p6" : "ppm_parse_p3";
+    BenchTimer parse_timer;
+    for (u32 iter = 0u; iter < iterations && !failed_stage; ++iter) {
+        parse_timer.begin();
+        for (u64 page = 0u; page < pages_used; ++page) {
+            if (!ppm_load_page_pixels(pages[page].data, pages[page].size, width_read, height_read, pixels)) {
+                failed_stage = parse_stage;
+                break;
+            }
+        }
+        parse_timer.end();
+    }
+    if (!failed_stage) {
+        bench_report(parse_stage, page_bytes, pages_used, parse_timer);
+    }
+    BenchTimer clean_timer;
+    for (u32 iter = 0u; iter < iterations && !failed_stage; ++iter) {
+        clean_timer.begin();
+        for (u64 page = 0u; page < pages_used; ++page) {
+            PpmParserState metadata;
+            if (!ppm_extract_frame_bits(pages[page].data, pages[page].size, mapping, extracted, extracted_bits, metadata) ||
+                extracted_bits == 0u) {
+                failed_stage = "extract_clean";
+                break;
+            }
+        }
+        clean_timer.end();
+    }
+    if (!failed_stage) {
+        bench_report("extract_clean", page_bytes, pages_used, clean_timer);
+        for (u64 page = 0u; page < pages_used; ++page) {
+            if (!ppm_load_page_pixels(pages[page].data, pages[page].size, width_read, height_read, pixels) ||
+                !bench_distort_page(pixels, width_read, height_read, distorted[page])) {
+                failed_stage = "extract_distorted";
+                break;
+            }
+            distorted_bytes += (u64)distorted[page].size;
+        }
+    }
+    BenchTimer distorted_timer;
+    for (u32 iter = 0u; iter < iterations && !failed_stage; ++iter) {
+        distorted_timer.begin();
+        for (u64 page = 0u; page < pages_used; ++page) {
+            PpmParserState metadata;
+            if (!ppm_extract_frame_bits(distorted[page].data, distorted[page].size, mapping, extracted, extracted_bits, metadata) ||
+                extracted_bits == 0u) {
+                failed_stage = "extract_distorted";
+                break;
+            }
+        }
+        distorted_timer.end();
+    }
+    if (!failed_stage) {
+        bench_report("extract_distorted", distorted_bytes, pages_used, distorted_timer);
+    } else {
+        result = bench_stage_failed(failed_stage);
+    }
+    bench_release_pages(pages, pages_used);
+    bench_release_pages(distorted, pages_used);
+    return result;
+}
+
+static int command_bench(int arg_count, char** args) {
+    if (arguments_request_help(arg_count, args)) {
+        write_bench_help();
+        return 0;
+    }
+    ImageMappingConfig mapping;
+    u64 size_kib = BENCH_DEFAULT_SIZE_KIB;
+    u64 iterations = BENCH_DEFAULT_ITERATIONS;
+    u64 page_limit = 1u;
+    double ecc_redundancy = 0.2;
+    makocode::CompressionProfile compression = makocode::CompressionProfile_Default;
+    for (int i = 0; i < arg_count; ++i) {
+        const char* arg = args[i];
+        if (!arg) {
+            continue;
+        }
+        bool handled = false;
+        if (!process_image_mapping_option(arg_count, args, &i, mapping, "bench", &handled)) {
+            return 1;
+        }
+        if (handled) {
+            continue;
+        }
+        if (!process_ppm_format_option(arg_count, args, &i, mapping, "bench", &handled)) {
+            return 1;
+        }
+        if (handled) {
+            continue;
+        }
+        if (!process_fiducial_option(arg_count, args, &i, g_fiducial_defaults, "bench", &handled)) {
+            return 1;
+        }
+        if (handled) {
+            continue;
+        }
+        if (!bench_count_option(arg_count, args, &i, "--size", 1u, BENCH_MAX_SIZE_KIB, size_kib, &handled)) {
+            return 1;
+        }
+        if (handled) {
+            continue;
+        }
+        if (!bench_count_option(arg_count, args, &i, "--iterations", 1u, BENCH_MAX_ITERATIONS, iterations, &handled)) {
+            return 1;
+        }
+        if (handled) {
+            continue;
+        }
+        if (!bench_count_option(arg_count, args, &i, "--pages", 1u, BENCH_MAX_PAGES, page_limit, &handled)) {
+            return 1;
+        }
+        if (handled) {
+            continue;
+        }
+        const char compression_prefix[] = "--compression=";
+        const char* compression_value = 0;
+        if (ascii_equals_token(arg, ascii_length(arg), "--compression")) {
+            if ((i + 1) >= arg_count || !args[i + 1]) {
+                console_line(2, "bench: --compression requires a value (fast, default, max or store)");
+                return 1;
+            }
+            compression_value = args[i + 1];
+            i += 1;
+        } else if (ascii_starts_with(arg, compression_prefix)) {
+            compression_value = arg + (sizeof(compression_prefix) - 1u);
+        }
+        if (compression_value) {
+            if (!makocode::parse_compression_profile(compression_value,
+                                                     ascii_length(compression_value),
+                                                     compression)) {
+                console_line(2, "bench: --compression must be fast, default, max or store");
+                return 1;
+            }
+            continue;
+        }
+        const char ecc_prefix[] = "--ecc=";
+        const char* ecc_value = 0;
+        if (ascii_equals_token(arg, ascii_length(arg), "--ecc")) {
+            if ((i + 1) >= arg_count || !args[i + 1]) {
+                console_line(2, "bench: --ecc requires a numeric value");
+                return 1;
+            }
+            ecc_value = args[i + 1];
+            i += 1;
+        } else if (ascii_starts_with(arg, ecc_prefix)) {
+            ecc_value = arg + (sizeof(ecc_prefix) - 1u);
+        }
+        if (ecc_value) {
+            if (!ascii_to_double(ecc_value, ascii_length(ecc_value), &ecc_redundancy) ||
+                ecc_redundancy <= 0.0) {
+                console_line(2, "bench: --ecc must be a decimal number > 0");
+                return 1;
+            }
+            continue;
+        }
+        console_write(2, "bench: unknown option: ");
+        console_line(2, arg);
+        return 1;
+    }
+    if (!encode_mapping_prepare_palette(mapping, "bench")) {
+        return 1;
+    }
+    u32 runs = (u32)iterations;
+    makocode::ByteBuffer payload;
+    if (!bench_generate_payload(size_kib * 1024u, payload)) {
+        console_line(2, "bench: failed to generate payload");
+        return 1;
+    }
+
+    ArchiveBuildContext archive;
+    BenchTimer timer;
+    for (u32 iter = 0u; iter < runs; ++iter) {
+        timer.begin();
+        bool ok = bench_build_archive(payload, archive);
+        timer.end();
+        if (!ok) {
+            return bench_stage_failed("archive_build");
+        }
+    }
+    bench_report("archive_build", (u64)payload.size, 0u, timer);
+    const makocode::ByteBuffer& archive_bytes = archive.buffer;
+
+    makocode::ByteBuffer compressed;
+    timer = BenchTimer();
+    for (u32 iter = 0u; iter < runs; ++iter) {
+        timer.begin();
+        bool ok = makocode::lzma_compress(archive_bytes.data, archive_bytes.size, compressed, compression);
+        timer.end();
+        if (!ok) {
+            return bench_stage_failed("lzma_compress");
+        }
+    }
+    bench_report("lzma_compress", (u64)archive_bytes.size, 0u, timer);
+
+    makocode::ByteBuffer restored;
+    timer = BenchTimer();
+    for (u32 iter = 0u; iter < runs; ++iter) {
+        timer.begin();
+        bool ok = makocode::lzma_decompress(compressed.data, compressed.size * 8u, restored);
+        timer.end();
+        if (!ok || !bench_buffers_equal(restored, archive_bytes.data, archive_bytes.size)) {
+            return bench_stage_failed("lzma_decompress");
+        }
+    }
+    bench_report("lzma_decompress", (u64)archive_bytes.size, 0u, timer);
+    restored.release();
+
+    usize password_length = sizeof(BENCH_PASSWORD) - 1u;
+    makocode::ByteBuffer encrypted;
+    timer = BenchTimer();
+    for (u32 iter = 0u; iter < runs; ++iter) {
+        timer.begin();
+        bool ok = makocode::encrypt_payload_buffer(compressed, BENCH_PASSWORD, password_length, encrypted);
+        timer.end();
+        if (!ok) {
+            return bench_stage_failed("encrypt");
+        }
+    }
+    bench_report("encrypt", (u64)compressed.size, 0u, timer);
+
+    makocode::ByteBuffer decrypted;
+    timer = BenchTimer();
+    for (u32 iter = 0u; iter < runs; ++iter) {
+        timer.begin();
+        makocode::DecryptStatus status = makocode::decrypt_payload_buffer(encrypted.data,
+                                                                          encrypted.size,
+                                                                          BENCH_PASSWORD,
+                                                                          password_length,
+                                                                          decrypted);
+        timer.end();
+        if (status != makocode::DecryptStatus_Success ||
+            !bench_buffers_equal(decrypted, compressed.data, compressed.size)) {
+            return bench_stage_failed("decrypt");
+        }
+    }
+    bench_report("decrypt", (u64)encrypted.size, 0u, timer);
+    decrypted.release();
+
+    makocode::BitWriter ecc_writer;
+    makocode::EccSummary ecc_summary;
+    timer = BenchTimer();
+    for (u32 iter = 0u; iter < runs; ++iter) {
+        ecc_writer.reset();
+        timer.begin();
+        bool ok = makocode::encode_payload_with_ecc(encrypted, ecc_redundancy, ecc_writer, ecc_summary);
+        timer.end();
+        if (!ok) {
+            return bench_stage_failed("ecc_encode");
+        }
+    }
+    bench_report("ecc_encode", (u64)encrypted.size, 0u, timer);
+    const u8* ecc_bytes = ecc_writer.data();
+    usize ecc_size = ecc_writer.byte_size();
+
+    makocode::ByteBuffer ecc_decoded;
+    timer = BenchTimer();
+    for (u32 iter = 0u; iter < runs; ++iter) {
+        timer.begin();
+        makocode::EccHeaderInfo header;
+        bool ok = makocode::parse_ecc_header(ecc_bytes, ecc_size, header) &&
+                  makocode::decode_ecc_payload(ecc_bytes + makocode::ecc_header_span_for_bytes(ecc_size),
+                                               header,
+                                               ecc_decoded,
+                                               0);
+        timer.end();
+        if (!ok || !bench_buffers_equal(ecc_decoded, encrypted.data, encrypted.size)) {
+            return bench_stage_failed("ecc_decode");
+        }
+    }
+    bench_report("ecc_decode", (u64)ecc_size, 0u, timer);
+    ecc_decoded.release();
+
+    // Interleaved ECC streams skip the whole-stream shuffle, so it is timed on
+    // the --ecc 0 layout: the encrypted payload without ECC framing.
+    makocode::ByteBuffer shuffled;
+    BenchTimer unshuffle_timer;
+    timer = BenchTimer();
+    for (u32 iter = 0u; iter < runs; ++iter) {
+        shuffled.clear();
+        if (!shuffled.append_bytes(encrypted.data, encrypted.size)) {
+            return bench_stage_failed("shuffle");
+        }
+        timer.begin();
+        bool ok = makocode::shuffle_encoded_stream(shuffled.data, shuffled.size, false);
+        timer.end();
+        if (!ok) {
+            return bench_stage_failed("shuffle");
+        }
+        unshuffle_timer.begin();
+        ok = makocode::unshuffle_encoded_stream(shuffled.data, shuffled.size);
+        unshuffle_timer.end();
+        if (!ok || !bench_buffers_equal(shuffled, encrypted.data, encrypted.size)) {
+            return bench_stage_failed("unshuffle");
+        }
+    }
+    bench_report("shuffle", (u64)encrypted.size, 0u, timer);
+    bench_report("unshuffle", (u64)encrypted.size, 0u, unshuffle_timer);
+    shuffled.release();
+
+    // One stage per palette size the CLI accepts (2-5 named colors).
+    makocode::ByteBuffer bit_scratch;
+    makocode::ByteBuffer digits;
+    for (u32 base = 2u; base <= 5u; ++base) {
+        char stage[32] = "base_digits_0";
+        stage[12] = (char)('0' + base);
+        timer = BenchTimer();
+        for (u32 iter = 0u; iter < runs; ++iter) {
+            bit_scratch.clear();
+            if (!bit_scratch.append_bytes(ecc_bytes, ecc_size)) {
+                return bench_stage_failed(stage);
+            }
+            u64 digit_count = 0u;
+            timer.begin();
+            bool ok = bits_to_base_digits(bit_scratch, (u64)ecc_size * 8u, base, digits, digit_count);
+            timer.end();
+            if (!ok || digit_count == 0u) {
+                return bench_stage_failed(stage);
+            }
+        }
+        bench_report(stage, (u64)ecc_size, 0u, timer);
+    }
+    bit_scratch.release();
+    digits.release();
+
+    return bench_page_stages(mapping, compressed, ecc_redundancy, page_limit, runs);
+}
+
 static void run_coverage_probes() {
     const char* probes = getenv("MAKOCODE_COVERAGE_PROBES");
     if (!probes || probes[0] == '\0') {
@@ -28197,6 +36102,9 @@ static void run_coverage_probes() {
     }
 }
 
+// An embedding service that includes this file defines MAKOCODE_NO_MAIN and
+// calls the makocode:: API directly.
+#ifndef MAKOCODE_NO_MAIN
 int main(int argc, char** argv) {
     run_coverage_probes();
     if (argc < 2) {
@@ -28230,10 +36138,14 @@ int main(int argc, char** argv) {
     int command_argc = argc - arg_index - 1;
     char** command_argv = argv + arg_index + 1;
     if (ascii_compare(command, "encode") == 0) {
-        return command_encode(command_argc, command_argv);
+        int status = command_encode(command_argc, command_argv);
+        stats_emit("encode", status);
+        return status;
     }
     if (ascii_compare(command, "decode") == 0) {
-        return command_decode(command_argc, command_argv);
+        int status = command_decode(command_argc, command_argv);
+        stats_emit("decode", status);
+        return status;
     }
     if (ascii_compare(command, "overlay") == 0) {
         return command_overlay(command_argc, command_argv);
@@ -28241,6 +36153,10 @@ int main(int argc, char** argv) {
     if (ascii_compare(command, "minify") == 0) {
         return command_minify(command_argc, command_argv);
     }
+    if (ascii_compare(command, "bench") == 0) {
+        return command_bench(command_argc, command_argv);
+    }
     write_usage();
     return 0;
 }
+#endif
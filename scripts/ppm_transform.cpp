@@ -778,6 +778,8 @@ static void usage() {
             "  ppm_transform noise --output OUT --width W --height H --seed N\n"
             "  ppm_transform corrupt-footer-data-destroyed --input IN --output OUT [--seed N] [--footer-height-px N]\n"
             "  ppm_transform corrupt-footer-valid-data-too-corrupt --input IN --output OUT [--seed N] [--footer-height-px N] [--border-keep N]\n"
+            "  ppm_transform corrupt-metadata-tile --input IN --output OUT [--footer-height-px N]\n"
+            "  ppm_transform flip-pixels --input IN --output OUT --count N [--seed N] [--footer-height-px N]\n"
             "  ppm_transform overlay-mask --output OUT --circle-color \"R G B\" --background-color \"R G B\" [--width W] [--height H]\n"
             "  ppm_transform copy-footer-rows --encoded IN --merged INOUT\n"
             "  ppm_transform overlay-check --base IN --merged IN [--skip-grayscale 0|1]\n"
@@ -938,6 +940,84 @@ static void cmd_corrupt_footer_valid_data_too_corrupt(int argc, char** argv) {
     ppm_free(&ppm);
 }
 
+// Blanks the square that compute_metadata_guard protects elsewhere, leaving a
+// page whose metadata tile is unreadable (decode --recover-metadata tests).
+static void cmd_corrupt_metadata_tile(int argc, char** argv) {
+    const char* input = nullptr;
+    const char* output = nullptr;
+    int footer_height_px = 0;
+    for (int i = 2; i < argc; i++) {
+        const char* arg = argv[i];
+        auto require_value = [&](const char* flag) -> const char* {
+            if (i + 1 >= argc) die2("ppm_transform: missing value for ", flag);
+            return argv[++i];
+        };
+        if (strcmp(arg, "--input") == 0) input = require_value("--input");
+        else if (strcmp(arg, "--output") == 0) output = require_value("--output");
+        else if (strcmp(arg, "--footer-height-px") == 0) footer_height_px = parse_i32(require_value("--footer-height-px"), "footer-height-px");
+        else die2("ppm_transform: unknown flag ", arg);
+    }
+    if (!input || !output) die("ppm_transform: corrupt-metadata-tile requires --input/--output");
+    Ppm ppm = read_ppm_p3_ascii(input);
+    int guard_x0 = 0, guard_y0 = 0, guard_x1 = 0, guard_y1 = 0;
+    if (!compute_metadata_guard(ppm.width, ppm.height, footer_height_px, &guard_x0, &guard_y0, &guard_x1, &guard_y1)) {
+        die("ppm_transform: corrupt-metadata-tile: image too small");
+    }
+    for (int y = guard_y0; y < guard_y1; y++) {
+        size_t row_base = (size_t)y * ppm.width * 3;
+        for (int x = guard_x0; x < guard_x1; x++) {
+            size_t idx = row_base + (size_t)x * 3;
+            ppm.pixels.data[idx] = 255;
+            ppm.pixels.data[idx + 1] = 255;
+            ppm.pixels.data[idx + 2] = 255;
+        }
+    }
+    write_ppm_p3_ascii(output, &ppm.comments, ppm.width, ppm.height, &ppm.pixels, 0);
+    ppm_free(&ppm);
+}
+
+// Inverts COUNT pixels picked at random outside the footer and the metadata
+// tile, scattering symbol errors over the data area (decode --stream tests).
+static void cmd_flip_pixels(int argc, char** argv) {
+    const char* input = nullptr;
+    const char* output = nullptr;
+    int seed = 1;
+    int count = 0;
+    int footer_height_px = 0;
+    for (int i = 2; i < argc; i++) {
+        const char* arg = argv[i];
+        auto require_value = [&](const char* flag) -> const char* {
+            if (i + 1 >= argc) die2("ppm_transform: missing value for ", flag);
+            return argv[++i];
+        };
+        if (strcmp(arg, "--input") == 0) input = require_value("--input");
+        else if (strcmp(arg, "--output") == 0) output = require_value("--output");
+        else if (strcmp(arg, "--seed") == 0) seed = parse_i32(require_value("--seed"), "seed");
+        else if (strcmp(arg, "--count") == 0) count = parse_i32(require_value("--count"), "count");
+        else if (strcmp(arg, "--footer-height-px") == 0) footer_height_px = parse_i32(require_value("--footer-height-px"), "footer-height-px");
+        else die2("ppm_transform: unknown flag ", arg);
+    }
+    if (!input || !output) die("ppm_transform: flip-pixels requires --input/--output");
+    Ppm ppm = read_ppm_p3_ascii(input);
+    int data_height = ppm.height - footer_height_px;
+    if (data_height <= 0 || ppm.width <= 0) die("ppm_transform: flip-pixels: image too short");
+    int guard_x0 = 0, guard_y0 = 0, guard_x1 = 0, guard_y1 = 0;
+    int have_guard = compute_metadata_guard(ppm.width, ppm.height, footer_height_px, &guard_x0, &guard_y0, &guard_x1, &guard_y1);
+    uint32_t rng = (uint32_t)seed ^ 0x9E3779B9u;
+    for (int flipped = 0; flipped < count;) {
+        int x = (int)(xorshift32(&rng) % (uint32_t)ppm.width);
+        int y = (int)(xorshift32(&rng) % (uint32_t)data_height);
+        if (have_guard && x >= guard_x0 && x < guard_x1 && y >= guard_y0 && y < guard_y1) continue;
+        size_t idx = ((size_t)y * ppm.width + (size_t)x) * 3;
+        ppm.pixels.data[idx] = 255 - ppm.pixels.data[idx];
+        ppm.pixels.data[idx + 1] = 255 - ppm.pixels.data[idx + 1];
+        ppm.pixels.data[idx + 2] = 255 - ppm.pixels.data[idx + 2];
+        flipped++;
+    }
+    write_ppm_p3_ascii(output, &ppm.comments, ppm.width, ppm.height, &ppm.pixels, 0);
+    ppm_free(&ppm);
+}
+
 static void cmd_overlay_mask(int argc, char** argv) {
     const char* output = nullptr;
     const char* circle_color_text = nullptr;
@@ -1327,6 +1407,14 @@ int main(int argc, char** argv) {
         cmd_corrupt_footer_valid_data_too_corrupt(argc, argv);
         return 0;
     }
+    if (strcmp(cmd, "corrupt-metadata-tile") == 0) {
+        cmd_corrupt_metadata_tile(argc, argv);
+        return 0;
+    }
+    if (strcmp(cmd, "flip-pixels") == 0) {
+        cmd_flip_pixels(argc, argv);
+        return 0;
+    }
     if (strcmp(cmd, "overlay-mask") == 0) {
         cmd_overlay_mask(argc, argv);
         return 0;
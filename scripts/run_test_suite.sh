@@ -282,6 +282,9 @@ run_roundtrip_case "ecc_fill_moderate" "ECC fill saturates moderate payload" \
 run_roundtrip_case "ecc_fill_sparse_large_page" "ECC fill small payload on large page" \
     --size 1024 --ecc 0.5 --width 1400 --height 1800 --encode-opt "--ecc-fill"
 
+run_script_case "$repo_root/scripts/test_ecc_fill.sh" \
+    "ecc_fill_multi_page" "ECC fill keeps the page count and fills the last page with the chosen parity"
+
 run_roundtrip_case "palette_white_black" "Two-color palette stress" \
     --size 8192 --ecc 0.25 --width 360 --height 360 --palette "White Black"
 
@@ -298,6 +301,10 @@ run_roundtrip_case "palette_hex_octet" "Expanded hex palette stress" \
     --size 8192 --ecc 0.25 --width 480 --height 480 \
     --palette "FFFFFF FF0000 00FF00 0000FF FFFF00 FF00FF 00FFFF 000000"
 
+run_roundtrip_case "binary_ppm_multi_page" "Binary P6 pages multi-page roundtrip" \
+    --size 32768 --ecc 0.25 --width 420 --height 420 --multi-page \
+    --encode-opt "--ppm-format=P6"
+
 run_roundtrip_case "large_canvas_cmykw" "Large canvas CMYKW palette" \
     --size 8192 --ecc 0.25 --width 1000 --height 1000 --palette "White Cyan Magenta Yellow Black"
 
@@ -371,6 +378,9 @@ run_decode_case "decode_wrong_depth" "Decoder rejects malformed PPM (wrong maxva
 run_decode_case "decode_invalid_magic" "Decoder rejects malformed PPM (bad magic)" \
     --case invalid_magic
 
+run_decode_case "decode_truncated_binary" "Decoder rejects P6 PPM with missing raster" \
+    --case truncated_binary
+
 run_decode_case "decode_all_black" "Decoder rejects all-black image (no barcode)" \
     --case all_black
 
@@ -394,9 +404,48 @@ run_script_case "$palette_test" "palette_wrong_rejected" "Decoder rejects forced
 
 run_script_case "$password_fail_test" "password_failures" "Decoder enforces password requirement"
 
+run_script_case "$repo_root/scripts/test_crypto_kernels.sh" \
+    "crypto_kernels" "Accelerated and portable crypto paths decrypt each other's pages"
+
 run_script_case "$repo_root/scripts/test_header_copy_corruption.sh" \
     "header_copy_corruption" "Header copy RS repairs before decode"
 
+run_script_case "$repo_root/scripts/test_encode_jobs.sh" \
+    "encode_jobs" "Parallel page encode matches serial output and decodes in parallel" \
+    --jobs 4
+
+run_script_case "$repo_root/scripts/test_encode_stream.sh" \
+    "encode_stream" "Streamed encode matches buffered pages and round-trips encrypted"
+
+run_script_case "$repo_root/scripts/test_ppm_ascii_layout.sh" \
+    "ppm_ascii_layout" "Reflowed P3 sample body decodes and malformed samples are rejected"
+
+run_script_case "$repo_root/scripts/test_encode_compression.sh" \
+    "encode_compression" "Compression profiles round-trip and incompressible payloads are stored"
+
+run_script_case "$repo_root/scripts/test_compression_blocks.sh" \
+    "compression_blocks" "Block-compressed payloads round-trip and --extract restores single paths"
+
+run_script_case "$repo_root/scripts/test_bench.sh" \
+    "bench" "Bench reports every pipeline stage with deterministic byte counts"
+
+run_script_case "$repo_root/scripts/test_stats.sh" \
+    "stats" "Encode and decode --stats summaries report stage timings and counters"
+
+run_script_case "$repo_root/scripts/test_recover_metadata.sh" \
+    "recover_metadata" "Pages with a blanked metadata tile decode with --recover-metadata"
+
+run_script_case "$repo_root/scripts/test_decode_stream.sh" \
+    "decode_stream" "Streamed and watched pages decode as they arrive, early when ECC covers the rest"
+run_script_case "$repo_root/scripts/test_y4m_container.sh" \
+    "y4m_container" "Pages written as Y4M frames decode from a file, stdin and a piped stream"
+run_script_case "$repo_root/scripts/test_embed_api.sh" \
+    "embed_api" "A harness built with MAKOCODE_NO_MAIN round-trips a payload through encode_to_pages/decode_pages"
+run_script_case "$repo_root/scripts/test_legacy_pages.sh" \
+    "legacy_pages" "Pages written by older builds decode through their legacy paths"
+run_script_case "$repo_root/scripts/test_component_labels.sh" \
+    "component_labels" "Run-length component labelling and border dirt removal on fixed bitmaps"
+
 run_roundtrip_case "palette_white_black_blot_black" "High-ECC black blot recovery on White/Black page" \
     --size 4096 --ecc 8.0 --width 600 --height 600 --palette "White Black" \
     --ink-blot-radius 180 --ink-blot-color black
@@ -405,6 +454,10 @@ run_roundtrip_case "palette_white_black_blot_white" "High-ECC white blot recover
     --size 4096 --ecc 8.0 --width 600 --height 600 --palette "White Black" \
     --ink-blot-radius 180 --ink-blot-color white
 
+run_roundtrip_case "palette_cmy_blot_gray_erasures" "Gray blot decoded as RS erasures on White/CMY page" \
+    --size 4096 --ecc 1.0 --width 300 --height 300 --palette "White Cyan Magenta Yellow" \
+    --ink-blot-radius 100 --ink-blot-color 404040
+
 run_overlay_case "overlay_e2e" "Overlay CLI merges masks and decodes" \
     --overlay-fraction 0.35 \
     --overlay-encode-opt "--ecc-fill"
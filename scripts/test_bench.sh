@@ -0,0 +1,112 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+script_dir=$(cd -- "$(dirname "$0")" && pwd -P)
+. "$script_dir/lib/colors.sh"
+
+usage() {
+    cat <<'USAGE'
+Usage: test_bench.sh [--label NAME]
+
+  --label NAME    Prefix for artifacts under test/ (default: bench).
+  --help          Show this message.
+USAGE
+}
+
+label="bench"
+while [[ $# -gt 0 ]]; do
+    case "$1" in
+        --label)
+            label=${2:-}
+            shift 2
+            ;;
+        --help)
+            usage
+            exit 0
+            ;;
+        *)
+            echo "test_bench: unknown flag '$1'" >&2
+            usage >&2
+            exit 1
+            ;;
+    esac
+done
+
+if [[ -z $label ]]; then
+    echo "test_bench: --label requires a value" >&2
+    exit 1
+fi
+
+repo_root=$(cd -- "$script_dir/.." && pwd -P)
+makocode_bin=${MAKOCODE_BIN:-"$repo_root/makocode"}
+if [[ ! -x $makocode_bin ]]; then
+    echo "test_bench: makocode binary not found at $makocode_bin" >&2
+    exit 1
+fi
+
+test_dir="$repo_root/test"
+work_dir="$test_dir/${label}_work"
+
+cleanup() {
+    local exit_code=${1:-0}
+    if [[ $exit_code -ne 0 ]]; then
+        return
+    fi
+    if [[ -d $work_dir ]]; then
+        rm -rf "$work_dir"
+    fi
+}
+on_exit() {
+    local exit_code=$?
+    cleanup "$exit_code"
+}
+trap 'on_exit' EXIT
+
+rm -rf "$work_dir"
+mkdir -p "$work_dir"
+
+label_fmt=$(mako_format_label "$label")
+bench_args=(bench --size=64 --iterations=2 --page-width=1400 --page-height=1400)
+printf '%s makocode bench: %s\n' "$label_fmt" "${bench_args[*]}"
+"$makocode_bin" "${bench_args[@]}" > "$work_dir/first.txt"
+"$makocode_bin" "${bench_args[@]}" > "$work_dir/second.txt"
+
+stages=(archive_build lzma_compress lzma_decompress encrypt decrypt ecc_encode ecc_decode
+        shuffle unshuffle base_digits_2 base_digits_3 base_digits_4 base_digits_5
+        render ppm_parse_p3 extract_clean extract_distorted)
+number='[0-9]+\.[0-9]{3}'
+for stage in "${stages[@]}"; do
+    pattern="^bench stage=$stage bytes=[1-9][0-9]* runs=2 ms=$number mb_per_s=$number"
+    case $stage in
+        render|ppm_parse_p3|extract_clean|extract_distorted)
+            pattern+=" pages=1 pages_per_s=$number"
+            ;;
+    esac
+    if ! grep -Eq "$pattern\$" "$work_dir/first.txt"; then
+        echo "test_bench: missing or malformed line for stage $stage" >&2
+        cat "$work_dir/first.txt" >&2
+        exit 1
+    fi
+done
+if [[ $(wc -l < "$work_dir/first.txt") -ne ${#stages[@]} ]]; then
+    echo "test_bench: unexpected extra output" >&2
+    cat "$work_dir/first.txt" >&2
+    exit 1
+fi
+
+# The synthetic payload is deterministic, so every stage sees the same bytes.
+strip_timing() {
+    sed -E 's/ (ms|mb_per_s|pages_per_s)=[0-9.]+//g' "$1"
+}
+if ! diff <(strip_timing "$work_dir/first.txt") <(strip_timing "$work_dir/second.txt"); then
+    echo "test_bench: byte counts differ between runs" >&2
+    exit 1
+fi
+
+if "$makocode_bin" bench --size=0 > /dev/null 2> "$work_dir/error.txt"; then
+    echo "test_bench: --size=0 was accepted" >&2
+    exit 1
+fi
+grep -q "bench: --size must be between" "$work_dir/error.txt"
+
+printf '%s SUCCESS bench reports every pipeline stage\n' "$label_fmt"
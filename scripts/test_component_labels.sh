@@ -0,0 +1,216 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+script_dir=$(cd -- "$(dirname "$0")" && pwd -P)
+repo_root=$(cd -- "$script_dir/.." && pwd -P)
+cxx=${CXX:-g++}
+
+usage() {
+    cat <<'USAGE'
+Usage: test_component_labels.sh [--label NAME]
+
+  --label NAME    Identifier for log messages and generated artifacts.
+  --help          Show this help message.
+USAGE
+}
+
+label="component_labels"
+while [[ $# -gt 0 ]]; do
+    case "$1" in
+        --label)
+            label=${2:-}
+            shift 2
+            ;;
+        --help)
+            usage
+            exit 0
+            ;;
+        *)
+            echo "test_component_labels: unknown flag '$1'" >&2
+            usage >&2
+            exit 1
+            ;;
+    esac
+done
+
+if [[ -z $label ]]; then
+    echo "test_component_labels: --label requires a value" >&2
+    exit 1
+fi
+
+test_dir="$repo_root/test"
+work_dir="$test_dir/${label}_work"
+rm -rf "$work_dir"
+mkdir -p "$work_dir"
+
+# Runs label_components, component_at and remove_border_dirt on fixed bitmaps
+# and checks component areas, bounding boxes, and the pixels whitened.
+cat > "$work_dir/harness.cpp" <<'HARNESS'
+#define MAKOCODE_NO_MAIN
+#include "makocode.cpp"
+
+using namespace makocode;
+
+static int failures = 0;
+
+static void expect(bool condition, const char* what) {
+    if (!condition) {
+        console_write(2, "harness: ");
+        console_line(2, what);
+        ++failures;
+    }
+}
+
+// Class plane from rows of digits.
+static void fill_classes(const char* const* rows, unsigned width, unsigned height, u8* classes) {
+    for (unsigned y = 0u; y < height; ++y) {
+        for (unsigned x = 0u; x < width; ++x) {
+            classes[y * width + x] = (u8)(rows[y][x] - '0');
+        }
+    }
+}
+
+struct ExpectedComponent {
+    u64 area;
+    unsigned min_x;
+    unsigned min_y;
+    unsigned max_x;
+    unsigned max_y;
+    unsigned char value;
+};
+
+static void check_labels() {
+    static const char* const rows[] = {
+        "00110000",
+        "01110110",
+        "00000110",
+        "22200000",
+        "02001110",
+        "00001010",
+    };
+    const unsigned width = 8u;
+    const unsigned height = 6u;
+    u8 classes[8u * 6u];
+    fill_classes(rows, width, height, classes);
+    ComponentLabels labels;
+    if (!label_components(classes, width, height, labels)) {
+        expect(false, "label_components failed");
+        return;
+    }
+    // Numbered in scan order of each component's first pixel. The zeros
+    // wrap around every island; (5,5) is a zero boxed in by ones.
+    static const ExpectedComponent expected[] = {
+        {29u, 0u, 0u, 7u, 5u, 0u},
+        {5u, 1u, 0u, 3u, 1u, 1u},
+        {4u, 5u, 1u, 6u, 2u, 1u},
+        {4u, 0u, 3u, 2u, 4u, 2u},
+        {5u, 4u, 4u, 6u, 5u, 1u},
+        {1u, 5u, 5u, 5u, 5u, 0u},
+    };
+    const usize expected_count = sizeof(expected) / sizeof(expected[0]);
+    expect(labels.component_count == expected_count, "component count");
+    for (usize i = 0u; i < expected_count && i < labels.component_count; ++i) {
+        const ComponentStats& stats = labels.components[i];
+        expect(stats.area == expected[i].area, "component area");
+        expect(stats.min_x == expected[i].min_x && stats.min_y == expected[i].min_y &&
+               stats.max_x == expected[i].max_x && stats.max_y == expected[i].max_y,
+               "component bounding box");
+        expect(stats.value == expected[i].value, "component value");
+    }
+    for (unsigned y = 0u; y < height; ++y) {
+        for (unsigned x = 0u; x < width; ++x) {
+            usize component = component_at(labels, x, y);
+            expect(component < labels.component_count &&
+                   labels.components[component].value == classes[y * width + x],
+                   "component_at disagrees with the class plane");
+        }
+    }
+    expect(component_at(labels, 4u, 1u) == 0u, "component_at joins the zeros around the islands");
+    expect(component_at(labels, 5u, 5u) == 5u, "component_at finds the boxed-in zero");
+    expect(component_at(labels, width, 0u) == USIZE_MAX_VALUE, "component_at past the right edge");
+    expect(component_at(labels, 0u, height) == USIZE_MAX_VALUE, "component_at past the bottom edge");
+}
+
+// A dark content block around the page center with a light hole, and dark
+// specks in the margin. Light is 255 and dark is 0; the threshold is 128.
+static const char* const PAGE_ROWS[] = {
+    "............",
+    ".#..........",
+    "..#.........",
+    "...######...",
+    "...##.###...",
+    "...######...",
+    "...######...",
+    "............",
+    "..........#.",
+    "............",
+};
+static const unsigned PAGE_WIDTH = 12u;
+static const unsigned PAGE_HEIGHT = 10u;
+
+static void fill_page(u8* pixels) {
+    for (unsigned y = 0u; y < PAGE_HEIGHT; ++y) {
+        for (unsigned x = 0u; x < PAGE_WIDTH; ++x) {
+            pixels[y * PAGE_WIDTH + x] = PAGE_ROWS[y][x] == '#' ? 0u : 255u;
+        }
+    }
+}
+
+// `whitened` lists the specks remove_border_dirt must clear as x,y pairs.
+static void check_border_dirt(unsigned protected_margin, const unsigned (*whitened)[2], usize whitened_count) {
+    u8 pixels[12u * 10u];
+    fill_page(pixels);
+    image::ImageBuffer page;
+    page.width = PAGE_WIDTH;
+    page.height = PAGE_HEIGHT;
+    page.pixels = pixels;
+    ByteBuffer mask;
+    if (!remove_border_dirt(page, 128u, &mask, protected_margin)) {
+        expect(false, "remove_border_dirt failed");
+        return;
+    }
+    expect(mask.size == (usize)PAGE_WIDTH * PAGE_HEIGHT, "mask size");
+    for (unsigned y = 0u; y < PAGE_HEIGHT; ++y) {
+        for (unsigned x = 0u; x < PAGE_WIDTH; ++x) {
+            bool listed = false;
+            for (usize i = 0u; i < whitened_count; ++i) {
+                listed = listed || (whitened[i][0] == x && whitened[i][1] == y);
+            }
+            u8 original = PAGE_ROWS[y][x] == '#' ? 0u : 255u;
+            u8 expected_pixel = listed ? 255u : original;
+            expect(pixels[y * PAGE_WIDTH + x] == expected_pixel, "whitened pixels");
+            expect(mask.data && mask.data[y * PAGE_WIDTH + x] == (listed ? 0xFFu : 0u), "dirt mask");
+        }
+    }
+}
+
+int main() {
+    check_labels();
+    // Every speck goes; the content block and its hole stay.
+    static const unsigned all_specks[][2] = {{1u, 1u}, {2u, 2u}, {10u, 8u}};
+    check_border_dirt(0u, all_specks, 3u);
+    // The speck at (2,2) lies inside the protected margin and survives.
+    static const unsigned outer_specks[][2] = {{1u, 1u}, {10u, 8u}};
+    check_border_dirt(2u, outer_specks, 2u);
+    if (failures) {
+        return 1;
+    }
+    console_line(1, "harness: component labels ok");
+    return 0;
+}
+HARNESS
+
+if ! "$cxx" -std=c++17 -O2 -I"$repo_root" "$work_dir/harness.cpp" -o "$work_dir/harness" -pthread \
+    > "$work_dir/build.log" 2>&1; then
+    echo "test_component_labels: harness failed to build" >&2
+    cat "$work_dir/build.log" >&2
+    exit 1
+fi
+
+if ! "$work_dir/harness" > "$work_dir/harness.log" 2>&1; then
+    echo "test_component_labels: component labelling checks failed" >&2
+    cat "$work_dir/harness.log" >&2
+    exit 1
+fi
+
+printf '%s SUCCESS component labelling met expectations\n' "$label"
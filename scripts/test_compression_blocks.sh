@@ -0,0 +1,158 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+script_dir=$(cd -- "$(dirname "$0")" && pwd -P)
+. "$script_dir/lib/colors.sh"
+
+usage() {
+    cat <<'USAGE'
+Usage: test_compression_blocks.sh [--label NAME]
+
+  --label NAME    Prefix for artifacts under test/ (default: compression_blocks).
+  --help          Show this message.
+USAGE
+}
+
+label="compression_blocks"
+while [[ $# -gt 0 ]]; do
+    case "$1" in
+        --label)
+            label=${2:-}
+            shift 2
+            ;;
+        --help)
+            usage
+            exit 0
+            ;;
+        *)
+            echo "test_compression_blocks: unknown flag '$1'" >&2
+            usage >&2
+            exit 1
+            ;;
+    esac
+done
+
+if [[ -z $label ]]; then
+    echo "test_compression_blocks: --label requires a value" >&2
+    exit 1
+fi
+
+format_command() {
+    local formatted="" quoted=""
+    for arg in "$@"; do
+        printf -v quoted '%q' "$arg"
+        if [[ -z $formatted ]]; then
+            formatted=$quoted
+        else
+            formatted+=" $quoted"
+        fi
+    done
+    printf '%s' "$formatted"
+}
+
+print_makocode_cmd() {
+    local phase=$1
+    shift
+    local label_fmt
+    label_fmt=$(mako_format_label "$label")
+    printf '%s makocode %s: %s\n' "$label_fmt" "$phase" "$(format_command "$@")"
+}
+
+repo_root=$(cd -- "$script_dir/.." && pwd -P)
+makocode_bin=${MAKOCODE_BIN:-"$repo_root/makocode"}
+if [[ ! -x $makocode_bin ]]; then
+    echo "test_compression_blocks: makocode binary not found at $makocode_bin" >&2
+    exit 1
+fi
+
+test_dir="$repo_root/test"
+work_dir="$test_dir/${label}_work"
+
+cleanup() {
+    local exit_code=${1:-0}
+    if [[ $exit_code -ne 0 ]]; then
+        return
+    fi
+    if [[ -d $work_dir ]]; then
+        rm -rf "$work_dir"
+    fi
+}
+on_exit() {
+    local exit_code=$?
+    cleanup "$exit_code"
+}
+trap 'on_exit' EXIT
+
+rm -rf "$work_dir"
+mkdir -p "$work_dir/payload/logs" "$work_dir/payload/data"
+seq 1 30000 > "$work_dir/payload/logs/counts.txt"
+seq 1 20000 | sed 's/$/ entry/' > "$work_dir/payload/logs/entries.txt"
+head -c 150000 /dev/urandom > "$work_dir/payload/data/noise.bin"
+printf 'top\n' > "$work_dir/payload/readme.txt"
+
+page_args=(--page-width=1600 --page-height=1600 --ecc=0.1 --prefix=page)
+
+# encode_into NAME ARGS... writes pages for the payload into $work_dir/NAME.
+encode_into() {
+    local name=$1
+    shift
+    local encode_cmd=("$makocode_bin" encode --input=payload "${page_args[@]}" "--output-dir=$work_dir/$name" "$@")
+    print_makocode_cmd "encode-$name" "${encode_cmd[@]}"
+    (
+        cd "$work_dir"
+        "${encode_cmd[@]}"
+    ) >/dev/null
+}
+
+# decode_into NAME DEST ARGS... decodes the pages in $work_dir/NAME.
+decode_into() {
+    local name=$1
+    local dest=$2
+    shift 2
+    local decode_cmd=("$makocode_bin" decode "--output-dir=$work_dir/$dest" "$@" "$work_dir/$name"/*.ppm)
+    print_makocode_cmd "decode-$dest" "${decode_cmd[@]}"
+    "${decode_cmd[@]}" >/dev/null
+}
+
+encode_into blocks --compression-block=64 --jobs=3
+encode_into blocks_serial --compression-block=64 --jobs=1 --stream
+for page in "$work_dir/blocks"/*.ppm; do
+    if ! cmp --silent "$page" "$work_dir/blocks_serial/$(basename "$page")"; then
+        echo "test_compression_blocks: $(basename "$page") depends on --jobs or --stream" >&2
+        exit 1
+    fi
+done
+
+decode_into blocks full
+diff -r "$work_dir/payload" "$work_dir/full/payload"
+
+decode_into blocks single --extract=payload/logs/entries.txt
+diff "$work_dir/payload/logs/entries.txt" "$work_dir/single/payload/logs/entries.txt"
+if [[ -e $work_dir/single/payload/logs/counts.txt || -e $work_dir/single/payload/data ]]; then
+    echo "test_compression_blocks: --extract restored entries outside the requested file" >&2
+    exit 1
+fi
+
+decode_into blocks directory --extract payload/data/
+diff -r "$work_dir/payload/data" "$work_dir/directory/payload/data"
+if [[ -e $work_dir/directory/payload/logs || -e $work_dir/directory/payload/readme.txt ]]; then
+    echo "test_compression_blocks: --extract restored entries outside the requested directory" >&2
+    exit 1
+fi
+
+# Without blocks, --extract filters the fully decompressed archive instead.
+encode_into plain
+decode_into plain plain_single --extract=payload/readme.txt
+diff "$work_dir/payload/readme.txt" "$work_dir/plain_single/payload/readme.txt"
+
+if "$makocode_bin" decode "--output-dir=$work_dir/missing" --extract=payload/none "$work_dir/blocks"/*.ppm >/dev/null 2>&1; then
+    echo "test_compression_blocks: --extract of a missing path succeeded" >&2
+    exit 1
+fi
+if "$makocode_bin" encode --input=payload --compression-block=8 "--output-dir=$work_dir/bad" >/dev/null 2>&1; then
+    echo "test_compression_blocks: undersized --compression-block was accepted" >&2
+    exit 1
+fi
+
+label_fmt=$(mako_format_label "$label")
+printf '%s SUCCESS block container round-trips and --extract restores single paths\n' "$label_fmt"
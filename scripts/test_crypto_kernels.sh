@@ -0,0 +1,270 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+script_dir=$(cd -- "$(dirname "$0")" && pwd -P)
+. "$script_dir/lib/colors.sh"
+
+usage() {
+    cat <<'USAGE'
+Usage: test_crypto_kernels.sh [--label NAME]
+
+  --label NAME    Prefix for artifacts under test/ (default: crypto_kernels).
+  --help          Show this message.
+USAGE
+}
+
+label="crypto_kernels"
+while [[ $# -gt 0 ]]; do
+    case "$1" in
+        --label)
+            label=${2:-}
+            shift 2
+            ;;
+        --help)
+            usage
+            exit 0
+            ;;
+        *)
+            echo "test_crypto_kernels: unknown flag '$1'" >&2
+            usage >&2
+            exit 1
+            ;;
+    esac
+done
+
+if [[ -z $label ]]; then
+    echo "test_crypto_kernels: --label requires a value" >&2
+    exit 1
+fi
+
+format_command() {
+    local formatted="" quoted=""
+    for arg in "$@"; do
+        printf -v quoted '%q' "$arg"
+        if [[ -z $formatted ]]; then
+            formatted=$quoted
+        else
+            formatted+=" $quoted"
+        fi
+    done
+    printf '%s' "$formatted"
+}
+
+print_makocode_cmd() {
+    local phase=$1
+    shift
+    local label_fmt
+    label_fmt=$(mako_format_label "$label")
+    printf '%s makocode %s: %s\n' "$label_fmt" "$phase" "$(format_command "$@")"
+}
+
+repo_root=$(cd -- "$script_dir/.." && pwd -P)
+makocode_bin=${MAKOCODE_BIN:-"$repo_root/makocode"}
+if [[ ! -x $makocode_bin ]]; then
+    echo "test_crypto_kernels: makocode binary not found at $makocode_bin" >&2
+    exit 1
+fi
+
+test_dir="$repo_root/test"
+work_dir="$test_dir/${label}_work"
+
+cleanup() {
+    local exit_code=${1:-0}
+    if [[ $exit_code -ne 0 ]]; then
+        return
+    fi
+    if [[ -d $work_dir ]]; then
+        rm -rf "$work_dir"
+    fi
+}
+on_exit() {
+    local exit_code=$?
+    cleanup "$exit_code"
+}
+trap 'on_exit' EXIT
+
+rm -rf "$work_dir"
+mkdir -p "$work_dir/payload"
+head -c 40000 /dev/urandom > "$work_dir/payload/noise.bin"
+seq 1 3000 > "$work_dir/payload/counts.txt"
+printf 'x' > "$work_dir/payload/tiny.txt"
+
+password="kernel-password"
+page_args=(--page-width=1400 --page-height=1400 --ecc=0.1 "--password=$password")
+
+# run_with KERNELS PHASE CMD... runs CMD with the CPU kernels on or forced off.
+run_with() {
+    local kernels=$1
+    local phase=$2
+    shift 2
+    print_makocode_cmd "$phase" "$@"
+    if [[ $kernels == off ]]; then
+        MAKOCODE_DISABLE_CPU_KERNELS=1 "$@" >/dev/null
+    else
+        "$@" >/dev/null
+    fi
+}
+
+# Known answers, checked with the CPU kernels on and forced off: FIPS 180-2
+# SHA-256, RFC 7914 PBKDF2-HMAC-SHA256, RFC 8439 ChaCha20 and Poly1305, and
+# the SHA-256 of a 4 KiB ChaCha20 keystream (captured with openssl) that runs
+# through the multi-lane block kernels. It also checks the GF(256) region
+# multiply against single products. The harness includes makocode.cpp with
+# MAKOCODE_NO_MAIN to reach the primitives directly.
+cat > "$work_dir/kat.cpp" <<'HARNESS'
+#define MAKOCODE_NO_MAIN
+#include "makocode.cpp"
+
+using namespace makocode;
+
+static bool expect_hex(const char* name, const u8* data, usize length, const char* hex) {
+    static const char digits[] = "0123456789abcdef";
+    bool match = ascii_length(hex) == length * 2u;
+    for (usize i = 0u; match && i < length; ++i) {
+        match = hex[i * 2u] == digits[data[i] >> 4u] && hex[i * 2u + 1u] == digits[data[i] & 0x0Fu];
+    }
+    if (!match) {
+        console_write(2, "kat: mismatch in ");
+        console_line(2, name);
+    }
+    return match;
+}
+
+static bool sha256_expect(const char* name, const u8* data, usize length, const char* hex) {
+    Sha256State state;
+    sha256_init(state);
+    sha256_update(state, data, length);
+    u8 digest[32];
+    sha256_finalize(state, digest);
+    return expect_hex(name, digest, sizeof(digest), hex);
+}
+
+int main() {
+    bool ok = true;
+    const u8* abc = (const u8*)"abc";
+    ok = sha256_expect("sha256 abc", abc, 3u,
+                       "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad") && ok;
+    ByteBuffer million;
+    if (!million.ensure(1000000u)) {
+        return 1;
+    }
+    memset(million.data, 'a', 1000000u);
+    ok = sha256_expect("sha256 million a", million.data, 1000000u,
+                       "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0") && ok;
+
+    u8 derived[64];
+    ok = pbkdf2_hmac_sha256((const u8*)"passwd", 6u, (const u8*)"salt", 4u, 1u, derived, sizeof(derived)) &&
+         expect_hex("pbkdf2", derived, sizeof(derived),
+                    "55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc"
+                    "49ca9cccf179b645991664b39d77ef317c71b845b1e30bd509112041d3a19783") && ok;
+
+    u8 key[32];
+    for (u32 i = 0u; i < 32u; ++i) {
+        key[i] = (u8)i;
+    }
+    const u8 block_nonce[12] = {0, 0, 0, 0x09, 0, 0, 0, 0x4a, 0, 0, 0, 0};
+    u8 block[64];
+    chacha20_block(key, block_nonce, 1u, block);
+    ok = expect_hex("chacha20 block", block, sizeof(block),
+                    "10f1e7e4d13b5915500fdd1fa32071c4c7d1f4c733c068030422aa9ac3d46c4e"
+                    "d2826446079faa0914c2d705d98b02a2b5129cd1de164eb9cbd083e8a2503c4e") && ok;
+    const u8 nonce[12] = {0, 0, 0, 0, 0, 0, 0, 0x4a, 0, 0, 0, 0};
+    const char* sunscreen =
+        "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, "
+        "sunscreen would be it.";
+    usize sunscreen_length = ascii_length(sunscreen);
+    u8 sealed[128];
+    ok = chacha20_xor(key, nonce, 1u, (const u8*)sunscreen, sealed, sunscreen_length) &&
+         expect_hex("chacha20 encrypt", sealed, sunscreen_length,
+                    "6e2e359a2568f98041ba0728dd0d6981e97e7aec1d4360c20a27afccfd9fae0b"
+                    "f91b65c5524733ab8f593dabcd62b3571639d624e65152ab8f530c359f0861d8"
+                    "07ca0dbf500d6a6156a38e088a22b65e52bc514d16ccf806818ce91ab7793736"
+                    "5af90bbf74a35be6b40b8eedf2785e42874d") && ok;
+    u8 zeros[4096];
+    u8 keystream[4096];
+    memset(zeros, 0, sizeof(zeros));
+    ok = chacha20_xor(key, nonce, 1u, zeros, keystream, sizeof(keystream)) &&
+         sha256_expect("chacha20 keystream", keystream, sizeof(keystream),
+                       "03e37045b672bfe4c0c0265ac4ea21d51eda7e5de4f812ecc13bbdeaf7c9fa41") && ok;
+
+    u8 mac_key[32];
+    const char* mac_key_hex = "85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b";
+    for (u32 i = 0u; i < 32u; ++i) {
+        u8 value = 0u;
+        for (u32 nibble = 0u; nibble < 2u; ++nibble) {
+            char c = mac_key_hex[i * 2u + nibble];
+            value = (u8)((value << 4u) | (u8)((c <= '9') ? (c - '0') : (c - 'a' + 10)));
+        }
+        mac_key[i] = value;
+    }
+    const char* forum = "Cryptographic Forum Research Group";
+    Poly1305State mac;
+    poly1305_init_state(mac, mac_key);
+    poly1305_update(mac, (const u8*)forum, ascii_length(forum));
+    u8 tag[16];
+    poly1305_finish(mac, mac_key + 16u, tag);
+    // RFC 8439 gives a8061dc1305136c6c22b8baf0c0127a9. The upper half differs
+    // on purpose (see poly1305_finish) and was captured from the build before
+    // the CPU kernels.
+    ok = expect_hex("poly1305", tag, sizeof(tag), "a8061dc1305136c639981fafd7b85836") && ok;
+
+    // The GF(256) region multiply behind RS parity, against single products,
+    // for every scale and lengths around the 32-symbol kernel width.
+    u8 source[100];
+    u8 target[100];
+    for (u32 i = 0u; i < sizeof(source); ++i) {
+        source[i] = (u8)(i * 37u + 11u);
+    }
+    bool gf_ok = true;
+    for (u32 scale = 0u; scale < 256u && gf_ok; ++scale) {
+        for (usize length = 0u; length <= sizeof(source) && gf_ok; length += 7u) {
+            memset(target, 0x5A, sizeof(target));
+            gf_mul_add_region(target, source, length, (u8)scale);
+            for (usize i = 0u; i < sizeof(target); ++i) {
+                u8 expected = (u8)(0x5Au ^ ((i < length) ? gf_mul((u8)scale, source[i]) : 0u));
+                gf_ok = gf_ok && target[i] == expected;
+            }
+        }
+    }
+    if (!gf_ok) {
+        console_line(2, "kat: mismatch in gf_mul_add_region");
+    }
+    ok = gf_ok && ok;
+    return ok ? 0 : 1;
+}
+HARNESS
+cxx=${CXX:-g++}
+"$cxx" -std=c++17 -O2 -I"$repo_root" "$work_dir/kat.cpp" -o "$work_dir/kat" -pthread
+for kernels in on off; do
+    if [[ $kernels == off ]]; then
+        MAKOCODE_DISABLE_CPU_KERNELS=1 "$work_dir/kat"
+    else
+        "$work_dir/kat"
+    fi
+done
+
+# Pages sealed by either SHA-256/ChaCha20/Poly1305 path must authenticate and
+# decrypt under the other one.
+for encoder in on off; do
+    for mode in buffered stream; do
+        name="${mode}_${encoder}"
+        extra=()
+        if [[ $mode == stream ]]; then
+            extra=(--stream)
+        fi
+        (
+            cd "$work_dir"
+            run_with "$encoder" "encode-$name" "$makocode_bin" encode --input=payload "${page_args[@]}" \
+                "--output-dir=$work_dir/$name" "${extra[@]}"
+        )
+        for decoder in on off; do
+            dest="$work_dir/$name/decoded_$decoder"
+            run_with "$decoder" "decode-$name-$decoder" "$makocode_bin" decode "--password=$password" \
+                "--output-dir=$dest" "$work_dir/$name"/*.ppm
+            diff -r "$work_dir/payload" "$dest/payload"
+        done
+    done
+done
+
+label_fmt=$(mako_format_label "$label")
+printf '%s SUCCESS accelerated and portable crypto paths interoperate\n' "$label_fmt"
@@ -12,11 +12,13 @@ Usage: test_decode_failures.sh [--label NAME] [--case NAME]
   --case NAME     Which case to run:
                    wrong_depth
                    invalid_magic
+                   truncated_binary
                    all_black
                    all_white
                    random_noise
                    footer_data_destroyed
                    footer_valid_data_too_corrupt
+                   ppm_format_option
                    all (default)
   --help          Show this help message.
 USAGE
@@ -107,6 +109,7 @@ test_dir="$repo_root/test"
 mkdir -p "$test_dir"
 wrong_depth="$test_dir/${label}_wrong_depth.ppm"
 invalid_magic="$test_dir/${label}_invalid_magic.ppm"
+truncated_binary="$test_dir/${label}_truncated_binary.ppm"
 all_black="$test_dir/${label}_all_black.ppm"
 all_white="$test_dir/${label}_all_white.ppm"
 random_noise="$test_dir/${label}_random_noise.ppm"
@@ -114,7 +117,7 @@ footer_data_destroyed="$test_dir/${label}_footer_present_data_destroyed.ppm"
 footer_valid_data_too_corrupt="$test_dir/${label}_footer_valid_data_too_corrupt.ppm"
 work_dir="$test_dir/${label}_work"
 payload_path="$work_dir/payload.bin"
-rm -f "$wrong_depth" "$invalid_magic" "$all_black" "$all_white" "$random_noise" "$footer_data_destroyed" "$footer_valid_data_too_corrupt"
+rm -f "$wrong_depth" "$invalid_magic" "$truncated_binary" "$all_black" "$all_white" "$random_noise" "$footer_data_destroyed" "$footer_valid_data_too_corrupt"
 rm -rf "$work_dir"
 
 run_case_wrong_depth() {
@@ -130,13 +133,22 @@ PPM
 
 run_case_invalid_magic() {
     cat > "$invalid_magic" <<'PPM'
-P6
+P5
 2 2
 255
 PPM
     run_expect_failure "decode-invalid-magic" "$makocode_bin" decode "$invalid_magic"
 }
 
+run_case_truncated_binary() {
+    cat > "$truncated_binary" <<'PPM'
+P6
+2 2
+255
+PPM
+    run_expect_failure "decode-truncated-binary" "$makocode_bin" decode "$truncated_binary"
+}
+
 write_solid_ppm() {
     local path=$1
     local width=$2
@@ -260,6 +272,32 @@ run_case_footer_valid_data_too_corrupt() {
     rm -rf "$work_dir"
 }
 
+# --ppm-format picks the format pages are written in; decode reads either one
+# and overlay keeps the base page's, so both reject it even with a good page.
+run_case_ppm_format_option() {
+    local option_dir="$work_dir/ppm_format_option"
+    mkdir -p "$option_dir"
+    printf 'ppm format option\n' > "$option_dir/payload.txt"
+    (cd "$option_dir" && "$makocode_bin" encode --input=payload.txt --page-width=400 --page-height=400 \
+        "--output-dir=$option_dir/pages") >/dev/null
+    local page
+    page=$(ls "$option_dir"/pages/*.ppm | head -n 1)
+    "$makocode_bin" decode "--output-dir=$option_dir/decoded" "$page" >/dev/null
+    local message
+    for form in "--ppm-format=P6" "--ppm-format P6"; do
+        # shellcheck disable=SC2086
+        run_expect_failure "decode-ppm-format" "$makocode_bin" decode $form "--output-dir=$option_dir/decoded" "$page"
+        # shellcheck disable=SC2086
+        message=$("$makocode_bin" decode $form "--output-dir=$option_dir/decoded" "$page" 2>&1 >/dev/null || true)
+        if [[ $message != *"unknown option"* ]]; then
+            echo "test_decode_failures: decode did not report $form as an unknown option" >&2
+            exit 1
+        fi
+    done
+    run_expect_failure "overlay-ppm-format" "$makocode_bin" overlay --ppm-format=P6 "$page" "$page" 0.5
+    rm -rf "$work_dir"
+}
+
 case "${case_name}" in
     wrong_depth)
         run_case_wrong_depth
@@ -267,6 +305,9 @@ case "${case_name}" in
     invalid_magic)
         run_case_invalid_magic
         ;;
+    truncated_binary)
+        run_case_truncated_binary
+        ;;
     all_black)
         run_case_all_black
         ;;
@@ -282,14 +323,19 @@ case "${case_name}" in
     footer_valid_data_too_corrupt)
         run_case_footer_valid_data_too_corrupt
         ;;
+    ppm_format_option)
+        run_case_ppm_format_option
+        ;;
     all)
         run_case_wrong_depth
         run_case_invalid_magic
+        run_case_truncated_binary
         run_case_all_black
         run_case_all_white
         run_case_random_noise
         run_case_footer_data_destroyed
         run_case_footer_valid_data_too_corrupt
+        run_case_ppm_format_option
         ;;
     *)
         echo "test_decode_failures: unknown --case '${case_name}'" >&2
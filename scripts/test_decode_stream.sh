@@ -0,0 +1,210 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+script_dir=$(cd -- "$(dirname "$0")" && pwd -P)
+repo_root=$(cd -- "$script_dir/.." && pwd -P)
+makocode_bin=${MAKOCODE_BIN:-"$repo_root/makocode"}
+ppm_transform_bin="$repo_root/scripts/ppm_transform"
+
+usage() {
+    cat <<'USAGE'
+Usage: test_decode_stream.sh [--label NAME]
+
+  --label NAME    Identifier for log messages and generated artifacts.
+  --help          Show this help message.
+USAGE
+}
+
+label="decode_stream"
+while [[ $# -gt 0 ]]; do
+    case "$1" in
+        --label)
+            label=${2:-}
+            shift 2
+            ;;
+        --help)
+            usage
+            exit 0
+            ;;
+        *)
+            echo "test_decode_stream: unknown flag '$1'" >&2
+            usage >&2
+            exit 1
+            ;;
+    esac
+done
+
+if [[ -z $label ]]; then
+    echo "test_decode_stream: --label requires a value" >&2
+    exit 1
+fi
+
+if [[ ! -x $makocode_bin ]]; then
+    echo "test_decode_stream: makocode binary not found at $makocode_bin" >&2
+    exit 1
+fi
+
+if [[ ! -x $ppm_transform_bin ]]; then
+    echo "test_decode_stream: ppm_transform helper not found at $ppm_transform_bin" >&2
+    exit 1
+fi
+
+test_dir="$repo_root/test"
+work_dir="$test_dir/${label}_work"
+rm -rf "$work_dir"
+mkdir -p "$work_dir"
+
+head -c 100000 /dev/urandom > "$work_dir/random.bin"
+(cd "$work_dir" && "$makocode_bin" encode "--input=random.bin" "--ecc=1.0" "--page-width=600" "--page-height=600" \
+    "--output-dir=$work_dir/ecc_pages") >/dev/null
+(cd "$work_dir" && "$makocode_bin" encode "--input=random.bin" "--ecc=0" "--ppm-format=P6" "--page-width=600" \
+    "--page-height=600" "--output-dir=$work_dir/plain_pages") >/dev/null
+
+shopt -s nullglob
+ecc_pages=("$work_dir"/ecc_pages/*.ppm)
+plain_pages=("$work_dir"/plain_pages/*.ppm)
+shopt -u nullglob
+if [[ ${#ecc_pages[@]} -lt 3 || ${#plain_pages[@]} -lt 2 ]]; then
+    echo "test_decode_stream: expected multi-page encodes" >&2
+    exit 1
+fi
+
+expect_payload() {
+    local scenario=$1
+    local output_dir=$2
+    if ! cmp --silent "$work_dir/random.bin" "$output_dir/random.bin"; then
+        echo "test_decode_stream: ${scenario} payload differs" >&2
+        exit 1
+    fi
+}
+
+# Every page in order: with --ecc 1.0 the decoder stops before the last pages.
+out="$work_dir/in_order"
+mkdir -p "$out"
+{ cat "${ecc_pages[@]}" || true; } | "$makocode_bin" decode --stream "--output-dir=$out" > "$work_dir/in_order.log" 2>&1
+if ! grep -q "the rest are covered by ECC" "$work_dir/in_order.log"; then
+    echo "test_decode_stream: in_order did not decode early" >&2
+    cat "$work_dir/in_order.log" >&2
+    exit 1
+fi
+expect_payload "in_order" "$out"
+
+# Pages placed by index: reversed, and without the first page.
+out="$work_dir/reversed"
+mkdir -p "$out"
+reversed_pages=()
+for ((i = ${#ecc_pages[@]} - 1; i >= 0; i--)); do
+    reversed_pages+=("${ecc_pages[i]}")
+done
+{ cat "${reversed_pages[@]}" || true; } | "$makocode_bin" decode --stream "--output-dir=$out" >/dev/null 2>&1
+expect_payload "reversed" "$out"
+
+out="$work_dir/without_first"
+mkdir -p "$out"
+{ cat "${ecc_pages[@]:1}" || true; } | "$makocode_bin" decode --stream "--output-dir=$out" >/dev/null 2>&1
+expect_payload "without_first" "$out"
+
+# Scanned pages carry misread symbols. With one page lost the decoder must
+# keep parity in reserve for them rather than spend it all on erasures: it
+# either decodes the exact payload or fails, never writes wrong bytes.
+# The payload is fixed so that the pages held after the third one, without
+# the reserve, would be decoded into wrong bytes.
+noisy_src="$work_dir/noisy_src"
+noisy_dir="$work_dir/noisy_pages"
+mkdir -p "$noisy_src" "$noisy_dir"
+LC_ALL=C awk 'BEGIN { srand(2); for (i = 0; i < 100000; i++) printf "%c", int(rand() * 256) }' > "$noisy_src/noisy.bin"
+(cd "$noisy_src" && "$makocode_bin" encode "--input=noisy.bin" "--ecc=1.0" "--page-width=600" "--page-height=600" \
+    "--output-dir=$noisy_src/pages") >/dev/null
+seed=1
+for page in "$noisy_src"/pages/*.ppm; do
+    "$ppm_transform_bin" flip-pixels --input "$page" --output "$noisy_dir/$(basename "$page")" --count 3000 --seed "$seed"
+    seed=$((seed + 1))
+done
+noisy_pages=("$noisy_dir"/*.ppm)
+last=$((${#noisy_pages[@]} - 1))
+out="$work_dir/noisy_missing"
+mkdir -p "$out"
+set +e
+{ cat "${noisy_pages[@]:0:last-1}" "${noisy_pages[last]}" || true; } |
+    "$makocode_bin" decode --stream "--output-dir=$out" > "$work_dir/noisy_missing.log" 2>&1
+status=$?
+set -e
+if [[ $status -ne 0 ]]; then
+    echo "test_decode_stream: noisy_missing failed to decode" >&2
+    cat "$work_dir/noisy_missing.log" >&2
+    exit 1
+fi
+if ! cmp --silent "$noisy_src/noisy.bin" "$out/noisy.bin"; then
+    echo "test_decode_stream: noisy_missing payload differs" >&2
+    exit 1
+fi
+
+# Without ECC every page has to arrive.
+out="$work_dir/plain"
+mkdir -p "$out"
+{ cat "${plain_pages[@]}" || true; } | "$makocode_bin" decode --stream "--output-dir=$out" >/dev/null 2>&1
+expect_payload "plain" "$out"
+
+out="$work_dir/plain_missing"
+mkdir -p "$out"
+set +e
+{ cat "${plain_pages[@]:1}" || true; } | "$makocode_bin" decode --stream "--output-dir=$out" >/dev/null 2>&1
+status=$?
+set -e
+if [[ $status -eq 0 ]] && cmp --silent "$work_dir/random.bin" "$out/random.bin"; then
+    echo "test_decode_stream: plain_missing decoded without its first page" >&2
+    exit 1
+fi
+
+out="$work_dir/truncated"
+mkdir -p "$out"
+set +e
+head -c 100000 "${plain_pages[0]}" | "$makocode_bin" decode --stream "--output-dir=$out" >/dev/null 2>&1
+status=$?
+set -e
+if [[ $status -eq 0 ]]; then
+    echo "test_decode_stream: truncated stream unexpectedly succeeded" >&2
+    exit 1
+fi
+
+# A watched directory that a scanner fills one page at a time.
+watch_dir="$work_dir/scanner"
+out="$work_dir/watched"
+mkdir -p "$watch_dir" "$out"
+timeout 120 "$makocode_bin" decode --watch "$watch_dir" "--output-dir=$out" > "$work_dir/watched.log" 2>&1 &
+watch_pid=$!
+for page in "${ecc_pages[@]}"; do
+    cp "$page" "$watch_dir/.partial"
+    mv "$watch_dir/.partial" "$watch_dir/$(basename "$page")"
+    sleep 0.3
+done
+if ! wait "$watch_pid"; then
+    echo "test_decode_stream: watched decode failed" >&2
+    cat "$work_dir/watched.log" >&2
+    exit 1
+fi
+expect_payload "watched" "$out"
+
+# A watched directory that stops receiving pages: a file that never becomes a
+# whole page is read once, and the decoder gives up after --watch-idle.
+watch_dir="$work_dir/stalled_scanner"
+out="$work_dir/stalled"
+mkdir -p "$watch_dir" "$out"
+cp "${plain_pages[1]}" "$watch_dir/"
+head -c 1000 "${plain_pages[0]}" > "$watch_dir/$(basename "${plain_pages[0]}")"
+set +e
+timeout 60 "$makocode_bin" decode --watch "$watch_dir" --watch-idle 2 "--output-dir=$out" > "$work_dir/stalled.log" 2>&1
+status=$?
+set -e
+if [[ $status -eq 0 || $status -eq 124 ]]; then
+    echo "test_decode_stream: stalled watch did not give up (status $status)" >&2
+    cat "$work_dir/stalled.log" >&2
+    exit 1
+fi
+if ! grep -q "no new page in" "$work_dir/stalled.log"; then
+    echo "test_decode_stream: stalled watch did not report the idle limit" >&2
+    cat "$work_dir/stalled.log" >&2
+    exit 1
+fi
+
+printf '%s SUCCESS streaming decode expectations met\n' "$label"
@@ -0,0 +1,92 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+script_dir=$(cd -- "$(dirname "$0")" && pwd -P)
+repo_root=$(cd -- "$script_dir/.." && pwd -P)
+makocode_bin=${MAKOCODE_BIN:-"$repo_root/makocode"}
+
+usage() {
+    cat <<'USAGE'
+Usage: test_ecc_fill.sh [--label NAME]
+
+  --label NAME    Identifier for log messages and generated artifacts.
+  --help          Show this help message.
+USAGE
+}
+
+label="ecc_fill"
+while [[ $# -gt 0 ]]; do
+    case "$1" in
+        --label)
+            label=${2:-}
+            shift 2
+            ;;
+        --help)
+            usage
+            exit 0
+            ;;
+        *)
+            echo "test_ecc_fill: unknown flag '$1'" >&2
+            usage >&2
+            exit 1
+            ;;
+    esac
+done
+
+if [[ -z $label ]]; then
+    echo "test_ecc_fill: --label requires a value" >&2
+    exit 1
+fi
+
+if [[ ! -x $makocode_bin ]]; then
+    echo "test_ecc_fill: makocode binary not found at $makocode_bin" >&2
+    exit 1
+fi
+
+test_dir="$repo_root/test"
+work_dir="$test_dir/${label}_work"
+rm -rf "$work_dir"
+mkdir -p "$work_dir"
+
+# Random bytes do not compress, so the layout depends only on the payload
+# size. The fill keeps the three pages a 30000-byte payload needs on 420x420
+# pages and raises the parity until the last page is full: RS(253,123).
+expected_pages=3
+expected_block_data=123
+expected_parity=130
+
+head -c 30000 /dev/urandom > "$work_dir/random.bin"
+(cd "$work_dir" && "$makocode_bin" encode "--input=random.bin" "--ecc=0.5" "--ecc-fill" "--page-width=420" \
+    "--page-height=420" "--output-dir=$work_dir/pages") > "$work_dir/encode.log"
+
+fill_line=$(grep "ecc-fill" "$work_dir/encode.log" || true)
+expected_fill="(blocks=${expected_block_data} parity=${expected_parity} pages=${expected_pages} "
+if [[ $fill_line != *"$expected_fill"* ]]; then
+    echo "test_ecc_fill: expected a fill with ${expected_fill}, got: ${fill_line}" >&2
+    exit 1
+fi
+
+shopt -s nullglob
+pages=("$work_dir"/pages/*.ppm)
+shopt -u nullglob
+if [[ ${#pages[@]} -ne $expected_pages ]]; then
+    echo "test_ecc_fill: expected ${expected_pages} pages, found ${#pages[@]}" >&2
+    exit 1
+fi
+
+# The decoder reads the layout back from the page metadata: every block
+# carries the filled parity.
+"$makocode_bin" decode --stats "--output-dir=$work_dir/decoded" "${pages[@]}" > /dev/null 2> "$work_dir/decode.log"
+if ! cmp --silent "$work_dir/random.bin" "$work_dir/decoded/random.bin"; then
+    echo "test_ecc_fill: decoded payload differs" >&2
+    exit 1
+fi
+stats=$(grep '"ecc_blocks"' "$work_dir/decode.log")
+blocks=$(printf '%s' "$stats" | sed -n 's/.*"ecc_blocks":\([0-9]*\).*/\1/p')
+parity_symbols=$(printf '%s' "$stats" | sed -n 's/.*"ecc_parity_symbols":\([0-9]*\).*/\1/p')
+if [[ -z $blocks || $blocks -eq 0 || $parity_symbols -ne $((blocks * expected_parity)) ]]; then
+    echo "test_ecc_fill: metadata ECC is not ${expected_parity} parity per block (${stats})" >&2
+    exit 1
+fi
+
+printf '%s SUCCESS ecc fill layout and page count met expectations\n' "$label"
@@ -0,0 +1,152 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+script_dir=$(cd -- "$(dirname "$0")" && pwd -P)
+repo_root=$(cd -- "$script_dir/.." && pwd -P)
+cxx=${CXX:-g++}
+
+usage() {
+    cat <<'USAGE'
+Usage: test_embed_api.sh [--label NAME]
+
+  --label NAME    Identifier for log messages and generated artifacts.
+  --help          Show this help message.
+USAGE
+}
+
+label="embed_api"
+while [[ $# -gt 0 ]]; do
+    case "$1" in
+        --label)
+            label=${2:-}
+            shift 2
+            ;;
+        --help)
+            usage
+            exit 0
+            ;;
+        *)
+            echo "test_embed_api: unknown flag '$1'" >&2
+            usage >&2
+            exit 1
+            ;;
+    esac
+done
+
+if [[ -z $label ]]; then
+    echo "test_embed_api: --label requires a value" >&2
+    exit 1
+fi
+
+test_dir="$repo_root/test"
+work_dir="$test_dir/${label}_work"
+rm -rf "$work_dir"
+mkdir -p "$work_dir"
+
+# A service that includes makocode.cpp with MAKOCODE_NO_MAIN and round-trips
+# an archive through encode_to_pages/decode_pages without touching files.
+cat > "$work_dir/harness.cpp" <<'HARNESS'
+#define MAKOCODE_NO_MAIN
+#include "makocode.cpp"
+
+static const usize HARNESS_MAX_PAGES = 64u;
+
+struct MemoryPages {
+    makocode::ByteBuffer pages[HARNESS_MAX_PAGES];
+    u64 page_count;
+};
+
+static bool memory_pages_write(void* context, u64 page, u64 page_count, const u8* data, usize size) {
+    MemoryPages& memory = *(MemoryPages*)context;
+    if (page == 0u || page > HARNESS_MAX_PAGES || page_count > HARNESS_MAX_PAGES) {
+        return false;
+    }
+    memory.page_count = page_count;
+    makocode::ByteBuffer& target = memory.pages[page - 1u];
+    target.clear();
+    return target.append_bytes(data, size);
+}
+
+int main() {
+    makocode::ByteBuffer payload;
+    if (!payload.ensure(60000u)) {
+        return 1;
+    }
+    u32 state = 0x2545F491u;
+    for (usize i = 0u; i < 60000u; ++i) {
+        state ^= state << 13u;
+        state ^= state >> 17u;
+        state ^= state << 5u;
+        payload.data[i] = (u8)state;
+    }
+    payload.size = 60000u;
+
+    ArchiveBuildContext archive;
+    if (!archive_init(archive) ||
+        !archive_add_file(archive, "payload.bin", payload.data, payload.size) ||
+        !archive_finalize(archive)) {
+        console_line(2, "harness: failed to build archive");
+        return 1;
+    }
+
+    makocode::EncodeOptions encode_options;
+    encode_options.mapping.page_width_pixels = 600u;
+    encode_options.mapping.page_width_set = true;
+    encode_options.mapping.page_height_pixels = 600u;
+    encode_options.mapping.page_height_set = true;
+    encode_options.ecc_redundancy = 0.5;
+    encode_options.jobs = 2u;
+    MemoryPages memory;
+    memory.page_count = 0u;
+    makocode::PageSink sink;
+    sink.write_page = memory_pages_write;
+    sink.context = &memory;
+    makocode::EncodeReport encode_report;
+    if (!makocode::encode_to_pages(archive.buffer, encode_options, sink, encode_report)) {
+        console_line(2, "harness: encode_to_pages failed");
+        return 1;
+    }
+    if (encode_report.page_count < 2u || encode_report.page_count != memory.page_count) {
+        console_line(2, "harness: expected a multi-page encode");
+        return 1;
+    }
+
+    makocode::DecodeOptions decode_options;
+    decode_options.mapping.page_width_pixels = 600u;
+    decode_options.mapping.page_width_set = true;
+    decode_options.mapping.page_height_pixels = 600u;
+    decode_options.mapping.page_height_set = true;
+    makocode::PageSource source = makocode::page_source_from_buffers(memory.pages, (usize)memory.page_count);
+    makocode::ByteBuffer decoded;
+    makocode::DecodeReport decode_report;
+    if (!makocode::decode_pages(source, decode_options, decoded, decode_report)) {
+        console_line(2, "harness: decode_pages failed");
+        return 1;
+    }
+    if (decoded.size != archive.buffer.size || memcmp(decoded.data, archive.buffer.data, decoded.size) != 0) {
+        console_line(2, "harness: decoded archive differs");
+        return 1;
+    }
+    if (decode_report.page_count != encode_report.page_count) {
+        console_line(2, "harness: decode report page count differs");
+        return 1;
+    }
+    console_line(1, "harness: round trip ok");
+    return 0;
+}
+HARNESS
+
+if ! "$cxx" -std=c++17 -O2 -I"$repo_root" "$work_dir/harness.cpp" -o "$work_dir/harness" -pthread \
+    > "$work_dir/build.log" 2>&1; then
+    echo "test_embed_api: harness failed to build with MAKOCODE_NO_MAIN" >&2
+    cat "$work_dir/build.log" >&2
+    exit 1
+fi
+
+if ! "$work_dir/harness" > "$work_dir/harness.log" 2>&1; then
+    echo "test_embed_api: in-memory round trip failed" >&2
+    cat "$work_dir/harness.log" >&2
+    exit 1
+fi
+
+printf '%s SUCCESS embedded encode/decode round trip met expectations\n' "$label"
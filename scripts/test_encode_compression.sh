@@ -0,0 +1,147 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+script_dir=$(cd -- "$(dirname "$0")" && pwd -P)
+. "$script_dir/lib/colors.sh"
+
+usage() {
+    cat <<'USAGE'
+Usage: test_encode_compression.sh [--label NAME]
+
+  --label NAME    Prefix for artifacts under test/ (default: encode_compression).
+  --help          Show this message.
+USAGE
+}
+
+label="encode_compression"
+while [[ $# -gt 0 ]]; do
+    case "$1" in
+        --label)
+            label=${2:-}
+            shift 2
+            ;;
+        --help)
+            usage
+            exit 0
+            ;;
+        *)
+            echo "test_encode_compression: unknown flag '$1'" >&2
+            usage >&2
+            exit 1
+            ;;
+    esac
+done
+
+if [[ -z $label ]]; then
+    echo "test_encode_compression: --label requires a value" >&2
+    exit 1
+fi
+
+format_command() {
+    local formatted="" quoted=""
+    for arg in "$@"; do
+        printf -v quoted '%q' "$arg"
+        if [[ -z $formatted ]]; then
+            formatted=$quoted
+        else
+            formatted+=" $quoted"
+        fi
+    done
+    printf '%s' "$formatted"
+}
+
+print_makocode_cmd() {
+    local phase=$1
+    shift
+    local label_fmt
+    label_fmt=$(mako_format_label "$label")
+    printf '%s makocode %s: %s\n' "$label_fmt" "$phase" "$(format_command "$@")"
+}
+
+repo_root=$(cd -- "$script_dir/.." && pwd -P)
+makocode_bin=${MAKOCODE_BIN:-"$repo_root/makocode"}
+if [[ ! -x $makocode_bin ]]; then
+    echo "test_encode_compression: makocode binary not found at $makocode_bin" >&2
+    exit 1
+fi
+
+test_dir="$repo_root/test"
+work_dir="$test_dir/${label}_work"
+
+cleanup() {
+    local exit_code=${1:-0}
+    if [[ $exit_code -ne 0 ]]; then
+        return
+    fi
+    if [[ -d $work_dir ]]; then
+        rm -rf "$work_dir"
+    fi
+}
+on_exit() {
+    local exit_code=$?
+    cleanup "$exit_code"
+}
+trap 'on_exit' EXIT
+
+rm -rf "$work_dir"
+mkdir -p "$work_dir/text_payload" "$work_dir/noise_payload"
+seq 1 40000 > "$work_dir/text_payload/counts.txt"
+head -c 81920 /dev/urandom > "$work_dir/noise_payload/noise.bin"
+
+page_args=(--page-width=1200 --page-height=1200 --ecc=0.1 --prefix=page)
+
+# encode_with NAME PAYLOAD ARGS... encodes PAYLOAD into $work_dir/NAME, decodes
+# it back and checks the restored tree.
+encode_with() {
+    local name=$1
+    local payload=$2
+    shift 2
+    local out_dir="$work_dir/$name"
+    local decode_dir="$out_dir/decoded"
+    mkdir -p "$decode_dir"
+    local encode_cmd=("$makocode_bin" encode "--input=$payload" "${page_args[@]}" "--output-dir=$out_dir" "$@")
+    print_makocode_cmd "encode-$name" "${encode_cmd[@]}"
+    (
+        cd "$work_dir"
+        "${encode_cmd[@]}"
+    ) >/dev/null
+    local decode_cmd=("$makocode_bin" decode "--output-dir=$decode_dir" "$out_dir"/*.ppm)
+    print_makocode_cmd "decode-$name" "${decode_cmd[@]}"
+    "${decode_cmd[@]}" >/dev/null
+    diff -r "$work_dir/$payload" "$decode_dir/$payload"
+}
+
+page_count() {
+    local pages=("$work_dir/$1"/*.ppm)
+    printf '%d' "${#pages[@]}"
+}
+
+for profile in fast default max store; do
+    encode_with "text_$profile" text_payload "--compression=$profile"
+done
+if [[ $(page_count text_store) -le $(page_count text_max) ]]; then
+    echo "test_encode_compression: store should need more pages than max for text" >&2
+    exit 1
+fi
+
+# The entropy probe must store incompressible input exactly as --compression=store
+# does, in both the buffered and the streamed encoder.
+encode_with noise_default noise_payload
+encode_with noise_store noise_payload --compression=store
+encode_with noise_stream noise_payload --stream
+for page in "$work_dir/noise_store"/*.ppm; do
+    for other in noise_default noise_stream; do
+        if ! cmp --silent "$page" "$work_dir/$other/$(basename "$page")"; then
+            echo "test_encode_compression: $(basename "$page") differs between store and $other" >&2
+            exit 1
+        fi
+    done
+done
+
+if "$makocode_bin" encode --input=text_payload --compression=tiny "--output-dir=$work_dir/bad" >/dev/null 2>&1; then
+    echo "test_encode_compression: unknown --compression value was accepted" >&2
+    exit 1
+fi
+
+label_fmt=$(mako_format_label "$label")
+printf '%s SUCCESS compression profiles round-trip and incompressible input is stored\n' "$label_fmt"
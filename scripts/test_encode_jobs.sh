@@ -0,0 +1,147 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+script_dir=$(cd -- "$(dirname "$0")" && pwd -P)
+. "$script_dir/lib/colors.sh"
+
+usage() {
+    cat <<'USAGE'
+Usage: test_encode_jobs.sh [--label NAME] [--jobs N]
+
+  --label NAME    Prefix for artifacts under test/ (default: encode_jobs).
+  --jobs N        Worker count for the parallel encode/decode (default: 4).
+  --help          Show this message.
+USAGE
+}
+
+label="encode_jobs"
+jobs=4
+while [[ $# -gt 0 ]]; do
+    case "$1" in
+        --label)
+            label=${2:-}
+            shift 2
+            ;;
+        --jobs)
+            jobs=${2:-}
+            shift 2
+            ;;
+        --help)
+            usage
+            exit 0
+            ;;
+        *)
+            echo "test_encode_jobs: unknown flag '$1'" >&2
+            usage >&2
+            exit 1
+            ;;
+    esac
+done
+
+if [[ -z $label ]]; then
+    echo "test_encode_jobs: --label requires a value" >&2
+    exit 1
+fi
+
+format_command() {
+    local formatted="" quoted=""
+    for arg in "$@"; do
+        printf -v quoted '%q' "$arg"
+        if [[ -z $formatted ]]; then
+            formatted=$quoted
+        else
+            formatted+=" $quoted"
+        fi
+    done
+    printf '%s' "$formatted"
+}
+
+print_makocode_cmd() {
+    local phase=$1
+    shift
+    local label_fmt
+    label_fmt=$(mako_format_label "$label")
+    printf '%s makocode %s: %s\n' "$label_fmt" "$phase" "$(format_command "$@")"
+}
+
+repo_root=$(cd -- "$script_dir/.." && pwd -P)
+makocode_bin=${MAKOCODE_BIN:-"$repo_root/makocode"}
+if [[ ! -x $makocode_bin ]]; then
+    echo "test_encode_jobs: makocode binary not found at $makocode_bin" >&2
+    exit 1
+fi
+
+test_dir="$repo_root/test"
+work_dir="$test_dir/${label}_work"
+serial_dir="$work_dir/serial"
+parallel_dir="$work_dir/parallel"
+decode_dir="$work_dir/decoded"
+payload_name="jobs_payload.bin"
+
+cleanup() {
+    local exit_code=${1:-0}
+    if [[ $exit_code -ne 0 ]]; then
+        return
+    fi
+    if [[ -d $work_dir ]]; then
+        rm -rf "$work_dir"
+    fi
+}
+on_exit() {
+    local exit_code=$?
+    cleanup "$exit_code"
+}
+trap 'on_exit' EXIT
+
+rm -rf "$work_dir"
+mkdir -p "$serial_dir" "$parallel_dir" "$decode_dir"
+
+head -c 49152 /dev/urandom > "$work_dir/$payload_name"
+
+encode_args=(
+    "--input=$payload_name"
+    --ecc=0.25
+    --page-width=360
+    --page-height=360
+    --prefix=jobs
+)
+serial_cmd=("$makocode_bin" encode "${encode_args[@]}" "--output-dir=$serial_dir")
+parallel_cmd=("$makocode_bin" encode "${encode_args[@]}" "--output-dir=$parallel_dir" "--jobs=$jobs")
+print_makocode_cmd "encode-serial" "${serial_cmd[@]}"
+(
+    cd "$work_dir"
+    "${serial_cmd[@]}"
+) >/dev/null
+print_makocode_cmd "encode-parallel" "${parallel_cmd[@]}"
+(
+    cd "$work_dir"
+    "${parallel_cmd[@]}"
+) >/dev/null
+
+shopt -s nullglob
+serial_pages=("$serial_dir"/*.ppm)
+parallel_pages=("$parallel_dir"/*.ppm)
+shopt -u nullglob
+if [[ ${#serial_pages[@]} -lt 2 ]]; then
+    echo "test_encode_jobs: expected a multi-page encode, got ${#serial_pages[@]} page(s)" >&2
+    exit 1
+fi
+if [[ ${#serial_pages[@]} -ne ${#parallel_pages[@]} ]]; then
+    echo "test_encode_jobs: page count differs (serial ${#serial_pages[@]}, parallel ${#parallel_pages[@]})" >&2
+    exit 1
+fi
+for page in "${serial_pages[@]}"; do
+    name=$(basename "$page")
+    if ! cmp --silent "$page" "$parallel_dir/$name"; then
+        echo "test_encode_jobs: $name differs between serial and --jobs=$jobs encode" >&2
+        exit 1
+    fi
+done
+
+decode_cmd=("$makocode_bin" decode "--output-dir=$decode_dir" "--jobs=$jobs" "${parallel_pages[@]}")
+print_makocode_cmd "decode" "${decode_cmd[@]}"
+"${decode_cmd[@]}" >/dev/null
+cmp --silent "$work_dir/$payload_name" "$decode_dir/$payload_name"
+
+label_fmt=$(mako_format_label "$label")
+printf '%s SUCCESS %d pages identical with --jobs=%s\n' "$label_fmt" "${#serial_pages[@]}" "$jobs"
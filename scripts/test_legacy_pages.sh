@@ -0,0 +1,81 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+script_dir=$(cd -- "$(dirname "$0")" && pwd -P)
+repo_root=$(cd -- "$script_dir/.." && pwd -P)
+makocode_bin=${MAKOCODE_BIN:-"$repo_root/makocode"}
+fixture_dir="$script_dir/fixtures"
+
+usage() {
+    cat <<'USAGE'
+Usage: test_legacy_pages.sh [--label NAME]
+
+  --label NAME    Identifier for log messages and generated artifacts.
+  --help          Show this help message.
+USAGE
+}
+
+label="legacy_pages"
+while [[ $# -gt 0 ]]; do
+    case "$1" in
+        --label)
+            label=${2:-}
+            shift 2
+            ;;
+        --help)
+            usage
+            exit 0
+            ;;
+        *)
+            echo "test_legacy_pages: unknown flag '$1'" >&2
+            usage >&2
+            exit 1
+            ;;
+    esac
+done
+
+if [[ -z $label ]]; then
+    echo "test_legacy_pages: --label requires a value" >&2
+    exit 1
+fi
+
+if [[ ! -x $makocode_bin ]]; then
+    echo "test_legacy_pages: makocode binary not found at $makocode_bin" >&2
+    exit 1
+fi
+
+test_dir="$repo_root/test"
+work_dir="$test_dir/${label}_work"
+rm -rf "$work_dir"
+mkdir -p "$work_dir"
+
+# Pages written by older builds must keep decoding. Each fixture holds
+# scripts/fixtures/legacy.txt and was written with --ppm-format=P6
+# --page-width=160 --page-height=160 by the build named below.
+expect_fixture() {
+    local scenario=$1
+    local page=$2
+    local out="$work_dir/$scenario"
+    mkdir -p "$out"
+    if ! "$makocode_bin" decode "--output-dir=$out" "$fixture_dir/$page" > "$work_dir/$scenario.log" 2>&1; then
+        echo "test_legacy_pages: ${scenario} failed to decode" >&2
+        cat "$work_dir/$scenario.log" >&2
+        exit 1
+    fi
+    if ! cmp --silent "$fixture_dir/legacy.txt" "$out/legacy.txt"; then
+        echo "test_legacy_pages: ${scenario} payload differs" >&2
+        exit 1
+    fi
+}
+
+# Metadata tile schema 1: a base-3 palette whose digits were converted as one
+# whole-page number, before fixed-width digit blocks (written by dd9bd8d with
+# --palette "White Cyan Magenta").
+expect_fixture "schema1_whole_page_digits" "legacy_schema1.ppm"
+
+# An ECC stream (--ecc=0.5) laid out with the whole-stream Fisher-Yates
+# shuffle, before the keyed row-column interleave and its header flag
+# (written by cc56f55).
+expect_fixture "ecc_whole_stream_shuffle" "legacy_shuffle.ppm"
+
+printf '%s SUCCESS legacy pages decode\n' "$label"
@@ -0,0 +1,125 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+script_dir=$(cd -- "$(dirname "$0")" && pwd -P)
+. "$script_dir/lib/colors.sh"
+
+usage() {
+    cat <<'USAGE'
+Usage: test_ppm_ascii_layout.sh [--label NAME]
+
+  --label NAME    Prefix for artifacts under test/ (default: ppm_ascii_layout).
+  --help          Show this message.
+USAGE
+}
+
+label="ppm_ascii_layout"
+while [[ $# -gt 0 ]]; do
+    case "$1" in
+        --label)
+            label=${2:-}
+            shift 2
+            ;;
+        --help)
+            usage
+            exit 0
+            ;;
+        *)
+            echo "test_ppm_ascii_layout: unknown flag '$1'" >&2
+            usage >&2
+            exit 1
+            ;;
+    esac
+done
+
+if [[ -z $label ]]; then
+    echo "test_ppm_ascii_layout: --label requires a value" >&2
+    exit 1
+fi
+
+repo_root=$(cd -- "$script_dir/.." && pwd -P)
+makocode_bin=${MAKOCODE_BIN:-"$repo_root/makocode"}
+if [[ ! -x $makocode_bin ]]; then
+    echo "test_ppm_ascii_layout: makocode binary not found at $makocode_bin" >&2
+    exit 1
+fi
+
+test_dir="$repo_root/test"
+work_dir="$test_dir/${label}_work"
+
+cleanup() {
+    local exit_code=${1:-0}
+    if [[ $exit_code -ne 0 ]]; then
+        return
+    fi
+    if [[ -d $work_dir ]]; then
+        rm -rf "$work_dir"
+    fi
+}
+on_exit() {
+    local exit_code=$?
+    cleanup "$exit_code"
+}
+trap 'on_exit' EXIT
+
+rm -rf "$work_dir"
+mkdir -p "$work_dir/pages" "$work_dir/decoded" "$work_dir/reflowed_decoded"
+
+label_fmt=$(mako_format_label "$label")
+head -c 2048 /dev/urandom > "$work_dir/payload.bin"
+printf '%s makocode encode: --ecc=0.5 --page-width=200 --page-height=200 --palette=%q\n' \
+    "$label_fmt" "White Cyan Magenta Yellow"
+(
+    cd "$work_dir"
+    "$makocode_bin" encode --input=payload.bin --ecc=0.5 --page-width=200 --page-height=200 \
+        "--palette=White Cyan Magenta Yellow" --output-dir=pages
+) >/dev/null
+
+shopt -s nullglob
+pages=("$work_dir"/pages/*.ppm)
+shopt -u nullglob
+if [[ ${#pages[@]} -ne 1 ]]; then
+    echo "test_ppm_ascii_layout: expected one page, got ${#pages[@]}" >&2
+    exit 1
+fi
+page=${pages[0]}
+
+# Rewrite the sample body the way other P3 writers lay it out: several pixels
+# per line, runs of mixed whitespace, a comment between samples and a line
+# break that splits a pixel. The decoder must read the same raster back.
+reflowed="$work_dir/reflowed.ppm"
+awk 'NR <= 3 { print; next }
+    {
+        for (i = 1; i <= NF; ++i) {
+            ++count
+            sep = (count % 7 == 0) ? "\t " : " "
+            if (count == 1000) {
+                printf "\n# mid-body comment\n"
+            }
+            printf "%s%s", $i, sep
+            if (count % 17 == 0) {
+                printf "\n"
+            }
+        }
+    }
+    END { printf "\n" }' "$page" > "$reflowed"
+
+printf '%s makocode decode: %s\n' "$label_fmt" "$(basename "$reflowed")"
+"$makocode_bin" decode --output-dir="$work_dir/reflowed_decoded" "$reflowed" >/dev/null
+cmp "$work_dir/payload.bin" "$work_dir/reflowed_decoded/payload.bin"
+
+# Out-of-range and overlong samples must still be rejected by the fallback path.
+reject_sample() {
+    local name=$1
+    local replacement=$2
+    local broken="$work_dir/${name}.ppm"
+    awk -v repl="$replacement" 'NR == 4 { $1 = repl } { print }' "$page" > "$broken"
+    if "$makocode_bin" decode --output-dir="$work_dir/decoded" "$broken" >/dev/null 2>&1; then
+        echo "test_ppm_ascii_layout: decode accepted $name sample '$replacement'" >&2
+        exit 1
+    fi
+}
+reject_sample "over_range" "256"
+reject_sample "not_numeric" "2x5"
+
+printf '%s SUCCESS reflowed P3 body decodes; malformed samples rejected\n' "$label_fmt"
@@ -0,0 +1,119 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+script_dir=$(cd -- "$(dirname "$0")" && pwd -P)
+repo_root=$(cd -- "$script_dir/.." && pwd -P)
+makocode_bin=${MAKOCODE_BIN:-"$repo_root/makocode"}
+ppm_transform_bin="$repo_root/scripts/ppm_transform"
+
+usage() {
+    cat <<'USAGE'
+Usage: test_recover_metadata.sh [--label NAME]
+
+  --label NAME    Identifier for log messages and generated artifacts.
+  --help          Show this help message.
+USAGE
+}
+
+label="recover_metadata"
+while [[ $# -gt 0 ]]; do
+    case "$1" in
+        --label)
+            label=${2:-}
+            shift 2
+            ;;
+        --help)
+            usage
+            exit 0
+            ;;
+        *)
+            echo "test_recover_metadata: unknown flag '$1'" >&2
+            usage >&2
+            exit 1
+            ;;
+    esac
+done
+
+if [[ -z $label ]]; then
+    echo "test_recover_metadata: --label requires a value" >&2
+    exit 1
+fi
+
+if [[ ! -x $makocode_bin ]]; then
+    echo "test_recover_metadata: makocode binary not found at $makocode_bin" >&2
+    exit 1
+fi
+if [[ ! -x $ppm_transform_bin ]]; then
+    echo "test_recover_metadata: ppm_transform helper not found at $ppm_transform_bin" >&2
+    exit 1
+fi
+
+test_dir="$repo_root/test"
+work_dir="$test_dir/${label}_work"
+rm -rf "$work_dir"
+mkdir -p "$work_dir"
+
+# Encodes a payload, blanks the metadata tile on every page, and checks that
+# decode fails without --recover-metadata and restores the payload with it.
+run_recovery_case() {
+    local scenario=$1
+    local payload_bytes=$2
+    shift 2
+    local case_dir="$work_dir/$scenario"
+    local encoded_dir="$case_dir/encoded"
+    local damaged_dir="$case_dir/damaged"
+    mkdir -p "$encoded_dir" "$damaged_dir"
+    head -c "$payload_bytes" /dev/urandom > "$case_dir/random.bin"
+
+    (cd "$case_dir" && "$makocode_bin" encode "--input=random.bin" "--page-width=600" "--page-height=600" \
+        "--output-dir=$encoded_dir" "$@") >/dev/null
+
+    shopt -s nullglob
+    local pages=("$encoded_dir"/*.ppm)
+    shopt -u nullglob
+    if [[ ${#pages[@]} -eq 0 ]]; then
+        echo "test_recover_metadata: ${scenario} encode produced no PPM pages" >&2
+        exit 1
+    fi
+    local page
+    for page in "${pages[@]}"; do
+        "$ppm_transform_bin" corrupt-metadata-tile --input "$page" --output "$damaged_dir/$(basename "$page")"
+    done
+
+    local plain_dir="$case_dir/plain_decoded"
+    mkdir -p "$plain_dir"
+    set +e
+    "$makocode_bin" decode "--output-dir=$plain_dir" "$damaged_dir"/*.ppm >/dev/null 2>&1
+    local status=$?
+    set -e
+    if [[ $status -eq 0 ]] && cmp --silent "$case_dir/random.bin" "$plain_dir/random.bin"; then
+        echo "test_recover_metadata: ${scenario} decoded without --recover-metadata" >&2
+        exit 1
+    fi
+
+    local recovered_dir="$case_dir/recovered_decoded"
+    mkdir -p "$recovered_dir"
+    if ! "$makocode_bin" decode --recover-metadata --jobs 4 "--output-dir=$recovered_dir" "$damaged_dir"/*.ppm \
+        > "$case_dir/decode.log" 2>&1; then
+        echo "test_recover_metadata: ${scenario} recovery decode failed" >&2
+        cat "$case_dir/decode.log" >&2
+        exit 1
+    fi
+    if ! grep -q "recovered metadata" "$case_dir/decode.log"; then
+        echo "test_recover_metadata: ${scenario} did not report the recovered layout" >&2
+        exit 1
+    fi
+    if ! cmp --silent "$case_dir/random.bin" "$recovered_dir/random.bin"; then
+        echo "test_recover_metadata: ${scenario} recovered payload differs" >&2
+        exit 1
+    fi
+}
+
+run_recovery_case "default_palette" 3000
+run_recovery_case "white_black" 3000 --palette "White Black"
+run_recovery_case "cmyw_multi_page" 120000 --palette "White Cyan Magenta Yellow"
+# Without footer text the ECC header copies on page 1 read the same under every
+# footer height; only the assembled set can reject the 8-row guess.
+run_recovery_case "footerless_multi_page" 120000 --palette "White Cyan Magenta Yellow" --no-filename --no-page-count
+
+printf '%s SUCCESS metadata recovery expectations met\n' "$label"
@@ -0,0 +1,147 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+script_dir=$(cd -- "$(dirname "$0")" && pwd -P)
+. "$script_dir/lib/colors.sh"
+
+usage() {
+    cat <<'USAGE'
+Usage: test_stats.sh [--label NAME]
+
+  --label NAME    Prefix for artifacts under test/ (default: stats).
+  --help          Show this message.
+USAGE
+}
+
+label="stats"
+while [[ $# -gt 0 ]]; do
+    case "$1" in
+        --label)
+            label=${2:-}
+            shift 2
+            ;;
+        --help)
+            usage
+            exit 0
+            ;;
+        *)
+            echo "test_stats: unknown flag '$1'" >&2
+            usage >&2
+            exit 1
+            ;;
+    esac
+done
+
+if [[ -z $label ]]; then
+    echo "test_stats: --label requires a value" >&2
+    exit 1
+fi
+
+repo_root=$(cd -- "$script_dir/.." && pwd -P)
+makocode_bin=${MAKOCODE_BIN:-"$repo_root/makocode"}
+if [[ ! -x $makocode_bin ]]; then
+    echo "test_stats: makocode binary not found at $makocode_bin" >&2
+    exit 1
+fi
+
+test_dir="$repo_root/test"
+work_dir="$test_dir/${label}_work"
+
+cleanup() {
+    local exit_code=${1:-0}
+    if [[ $exit_code -ne 0 ]]; then
+        return
+    fi
+    if [[ -d $work_dir ]]; then
+        rm -rf "$work_dir"
+    fi
+}
+on_exit() {
+    local exit_code=$?
+    cleanup "$exit_code"
+}
+trap 'on_exit' EXIT
+
+rm -rf "$work_dir"
+mkdir -p "$work_dir"
+mkdir -p "$work_dir/payload"
+seq 1 40000 > "$work_dir/payload/counts.txt"
+head -c 200000 /dev/urandom > "$work_dir/payload/noise.bin"
+
+label_fmt=$(mako_format_label "$label")
+password="stats-password"
+encode_args=(encode --input=payload --page-width=700 --page-height=700 "--password=$password"
+             --jobs=2 "--output-dir=$work_dir/pages" --prefix=page "--stats=$work_dir/encode.json")
+printf '%s makocode %s\n' "$label_fmt" "${encode_args[*]}"
+(cd "$work_dir" && "$makocode_bin" "${encode_args[@]}" > /dev/null)
+
+# require_match FILE PATTERN: FILE must contain the extended regex PATTERN.
+require_match() {
+    if ! grep -Eq -- "$2" "$1"; then
+        echo "test_stats: $1 does not match $2" >&2
+        cat "$1" >&2
+        exit 1
+    fi
+}
+
+page_count=$(find "$work_dir/pages" -name '*.ppm' | wc -l)
+if [[ $page_count -lt 2 ]]; then
+    echo "test_stats: expected a multi-page encode, got $page_count page(s)" >&2
+    exit 1
+fi
+if [[ $(wc -l < "$work_dir/encode.json") -ne 1 ]]; then
+    echo "test_stats: encode summary is not a single line" >&2
+    exit 1
+fi
+require_match "$work_dir/encode.json" '^\{"command":"encode","status":0,"wall_ms":[0-9]+\.[0-9]{3},'
+for stage in archive compress encrypt ecc_encode render write; do
+    require_match "$work_dir/encode.json" "\"$stage\":\\{\"ms\":[0-9]+\\.[0-9]{3},\"calls\":[1-9][0-9]*\\}"
+done
+require_match "$work_dir/encode.json" "\"counters\":\\{\"pages\":$page_count,"
+require_match "$work_dir/encode.json" "\"files_written\":$page_count,"
+
+# Decode writes the summary as the last stderr line.
+decode_args=(decode "--password=$password" --jobs=2 --stats "--output-dir=$work_dir/decoded")
+printf '%s makocode %s\n' "$label_fmt" "${decode_args[*]}"
+"$makocode_bin" "${decode_args[@]}" "$work_dir/pages"/*.ppm > /dev/null 2> "$work_dir/decode.err"
+diff -r "$work_dir/payload" "$work_dir/decoded/payload"
+tail -n 1 "$work_dir/decode.err" > "$work_dir/decode.json"
+require_match "$work_dir/decode.json" '^\{"command":"decode","status":0,'
+for stage in read page_parse metadata geometry fiducials bit_extract assemble ecc_decode decrypt decompress unpack write; do
+    require_match "$work_dir/decode.json" "\"$stage\":\\{\"ms\":[0-9]+\\.[0-9]{3},\"calls\":[1-9][0-9]*\\}"
+done
+require_match "$work_dir/decode.json" "\"counters\":\\{\"pages\":$page_count,"
+require_match "$work_dir/decode.json" '"ecc_blocks":[1-9][0-9]*,'
+extracted=$(grep -o '"extracted":true' "$work_dir/decode.json" | wc -l)
+if [[ $extracted -ne $page_count ]]; then
+    echo "test_stats: expected $page_count extracted page records, found $extracted" >&2
+    exit 1
+fi
+require_match "$work_dir/decode.json" "\"path\":\"$work_dir/pages/page_page_0001\\.ppm\""
+
+# A --compression-block payload spans several blocks; decompress is timed
+# once for the whole container, and once more for an --extract.
+block_args=(encode --input=payload --page-width=700 --page-height=700 --compression-block=64 --jobs=2
+            "--output-dir=$work_dir/block_pages" --prefix=block)
+printf '%s makocode %s\n' "$label_fmt" "${block_args[*]}"
+(cd "$work_dir" && "$makocode_bin" "${block_args[@]}" > /dev/null)
+"$makocode_bin" decode --stats "--output-dir=$work_dir/block_decoded" "$work_dir/block_pages"/*.ppm \
+    > /dev/null 2> "$work_dir/block_decode.err"
+diff -r "$work_dir/payload" "$work_dir/block_decoded/payload"
+tail -n 1 "$work_dir/block_decode.err" > "$work_dir/block_decode.json"
+require_match "$work_dir/block_decode.json" '"decompress":\{"ms":[0-9]+\.[0-9]{3},"calls":1\}'
+"$makocode_bin" decode --stats --extract=payload/counts.txt "--output-dir=$work_dir/block_extracted" \
+    "$work_dir/block_pages"/*.ppm > /dev/null 2> "$work_dir/block_extract.err"
+cmp "$work_dir/payload/counts.txt" "$work_dir/block_extracted/payload/counts.txt"
+tail -n 1 "$work_dir/block_extract.err" > "$work_dir/block_extract.json"
+require_match "$work_dir/block_extract.json" '"decompress":\{"ms":[0-9]+\.[0-9]{3},"calls":1\}'
+
+# Failed commands still report, with their exit status.
+if "$makocode_bin" decode --password=wrong "--stats=$work_dir/failed.json" \
+    "--output-dir=$work_dir/failed" "$work_dir/pages"/*.ppm > /dev/null 2>&1; then
+    echo "test_stats: decode with the wrong password succeeded" >&2
+    exit 1
+fi
+require_match "$work_dir/failed.json" '^\{"command":"decode","status":1,'
+
+printf '%s SUCCESS --stats reports stage timings and counters\n' "$label_fmt"
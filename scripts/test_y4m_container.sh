@@ -0,0 +1,113 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+script_dir=$(cd -- "$(dirname "$0")" && pwd -P)
+repo_root=$(cd -- "$script_dir/.." && pwd -P)
+makocode_bin=${MAKOCODE_BIN:-"$repo_root/makocode"}
+
+usage() {
+    cat <<'USAGE'
+Usage: test_y4m_container.sh [--label NAME]
+
+  --label NAME    Identifier for log messages and generated artifacts.
+  --help          Show this help message.
+USAGE
+}
+
+label="y4m_container"
+while [[ $# -gt 0 ]]; do
+    case "$1" in
+        --label)
+            label=${2:-}
+            shift 2
+            ;;
+        --help)
+            usage
+            exit 0
+            ;;
+        *)
+            echo "test_y4m_container: unknown flag '$1'" >&2
+            usage >&2
+            exit 1
+            ;;
+    esac
+done
+
+if [[ -z $label ]]; then
+    echo "test_y4m_container: --label requires a value" >&2
+    exit 1
+fi
+
+if [[ ! -x $makocode_bin ]]; then
+    echo "test_y4m_container: makocode binary not found at $makocode_bin" >&2
+    exit 1
+fi
+
+test_dir="$repo_root/test"
+work_dir="$test_dir/${label}_work"
+rm -rf "$work_dir"
+mkdir -p "$work_dir"
+
+head -c 100000 /dev/urandom > "$work_dir/random.bin"
+
+expect_payload() {
+    local scenario=$1
+    local output_dir=$2
+    if ! cmp --silent "$work_dir/random.bin" "$output_dir/random.bin"; then
+        echo "test_y4m_container: ${scenario} payload differs" >&2
+        exit 1
+    fi
+}
+
+# Frames land in page order even when several jobs render pages.
+film="$work_dir/film/pages.y4m"
+(cd "$work_dir" && "$makocode_bin" encode "--input=random.bin" "--page-width=600" "--page-height=600" \
+    "--jobs=3" "--y4m=$film") >/dev/null
+if ! head -n 1 "$film" | grep -q "^YUV4MPEG2 W600 H600 .*C444"; then
+    echo "test_y4m_container: unexpected stream header" >&2
+    exit 1
+fi
+mapfile -t frame_pages < <(grep -a -o "FRAME XMAKOCODE_PAGE=[0-9]*/[0-9]*" "$film" | cut -d= -f2)
+frame_count=${#frame_pages[@]}
+if [[ $frame_count -lt 2 ]]; then
+    echo "test_y4m_container: expected a multi-frame stream, got ${frame_count} frames" >&2
+    exit 1
+fi
+for ((i = 0; i < frame_count; i++)); do
+    if [[ $((10#${frame_pages[i]%/*})) -ne $((i + 1)) ]]; then
+        echo "test_y4m_container: frame $((i + 1)) carries page ${frame_pages[i]}" >&2
+        exit 1
+    fi
+done
+
+out="$work_dir/from_file"
+mkdir -p "$out"
+"$makocode_bin" decode --jobs 2 "--output-dir=$out" "$film" >/dev/null
+expect_payload "from_file" "$out"
+
+out="$work_dir/from_stdin"
+mkdir -p "$out"
+"$makocode_bin" decode "--output-dir=$out" < "$film" >/dev/null
+expect_payload "from_stdin" "$out"
+
+# Piped straight from encode to a streaming decode, with a four-colour palette.
+out="$work_dir/piped"
+mkdir -p "$out"
+(cd "$work_dir" && "$makocode_bin" encode "--input=random.bin" "--page-width=600" "--page-height=600" \
+    --palette "White Cyan Magenta Yellow" "--y4m=-" 2>/dev/null) |
+    "$makocode_bin" decode --stream "--output-dir=$out" >/dev/null
+expect_payload "piped" "$out"
+
+out="$work_dir/truncated"
+mkdir -p "$out"
+head -c 500000 "$film" > "$work_dir/truncated.y4m"
+set +e
+"$makocode_bin" decode "--output-dir=$out" "$work_dir/truncated.y4m" >/dev/null 2>&1
+status=$?
+set -e
+if [[ $status -eq 0 ]]; then
+    echo "test_y4m_container: truncated stream unexpectedly succeeded" >&2
+    exit 1
+fi
+
+printf '%s SUCCESS y4m container expectations met\n' "$label"